@@ -2,6 +2,8 @@ package client
 
 import (
 	"bytes"
+	"compress/gzip"
+	"crypto/sha256"
 	"encoding/json"
 	"errors"
 	"fmt"
@@ -43,24 +45,24 @@ func postParams(httpClient *http.Client, uri string, data map[string]string, tar
 
 // Creates a new file upload http request with optional extra params
 func BuildUploadRequest(uri string, params map[string]string, paramName, path string) (*http.Request, error) {
-	file, err := os.Open(path)
-	if err != nil {
-		return nil, err
-	}
-	defer file.Close()
+	return BuildMultiUploadRequest(uri, params, map[string]string{paramName: path})
+}
 
+// Creates a new upload http request of several files, by param name, with
+// optional extra params
+func BuildMultiUploadRequest(uri string, params map[string]string, files map[string]string) (*http.Request, error) {
 	body := &bytes.Buffer{}
 	writer := multipart.NewWriter(body)
-	part, err := writer.CreateFormFile(paramName, filepath.Base(path))
-	if err != nil {
-		return nil, err
+	for paramName, path := range files {
+		if err := addFile(writer, paramName, path); err != nil {
+			return nil, err
+		}
 	}
-	_, err = io.Copy(part, file)
 
 	for key, val := range params {
 		_ = writer.WriteField(key, val)
 	}
-	err = writer.Close()
+	err := writer.Close()
 	if err != nil {
 		return nil, err
 	}
@@ -73,6 +75,21 @@ func BuildUploadRequest(uri string, params map[string]string, paramName, path st
 	return req, err
 }
 
+func addFile(writer *multipart.Writer, paramName, path string) error {
+	file, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+
+	part, err := writer.CreateFormFile(paramName, filepath.Base(path))
+	if err != nil {
+		return err
+	}
+	_, err = io.Copy(part, file)
+	return err
+}
+
 type NextGameResponse struct {
 	Type         string
 	TrainingId   uint
@@ -102,20 +119,91 @@ func UploadMatchResult(httpClient *http.Client, hostname string, match_game_id u
 	return postParams(httpClient, hostname+"/match_result", params, nil)
 }
 
+// Downloads the network to networkPath, resuming what an earlier attempt
+// left in networkPath + ".part". The server sends the gzip compressed weights
+// as they are stored, and they are kept compressed, so the file is moved to
+// networkPath only once its uncompressed contents hash to sha.
 func DownloadNetwork(httpClient *http.Client, hostname string, networkPath string, sha string) error {
+	partPath := networkPath + ".part"
+	var offset int64
+	if stat, err := os.Stat(partPath); err == nil {
+		offset = stat.Size()
+	}
+
 	uri := hostname + fmt.Sprintf("/get_network?sha=%s", sha)
-	r, err := httpClient.Get(uri)
+	req, err := http.NewRequest("GET", uri, nil)
+	if err != nil {
+		return err
+	}
+	if offset > 0 {
+		// The network of a sha never changes, but If-Range makes the server
+		// send all of it if the part is of something else.
+		req.Header.Set("Range", fmt.Sprintf("bytes=%d-", offset))
+		req.Header.Set("If-Range", fmt.Sprintf("\"%s\"", sha))
+	}
+	r, err := httpClient.Do(req)
+	if err != nil {
+		return err
+	}
 	defer r.Body.Close()
+
+	flags := os.O_CREATE | os.O_WRONLY
+	switch r.StatusCode {
+	case http.StatusPartialContent:
+		flags |= os.O_APPEND
+		fmt.Printf("Resuming download at %d bytes\n", offset)
+	case http.StatusOK:
+		flags |= os.O_TRUNC
+	case http.StatusRequestedRangeNotSatisfiable:
+		// The part is already complete, or it's too long and gets removed.
+		return finishDownload(partPath, networkPath, sha)
+	default:
+		return fmt.Errorf("Downloading network %s: %s", sha, r.Status)
+	}
+
+	out, err := os.OpenFile(partPath, flags, 0644)
+	if err != nil {
+		return err
+	}
+	_, err = io.Copy(out, r.Body)
+	if closeErr := out.Close(); err == nil {
+		err = closeErr
+	}
 	if err != nil {
+		// Keep the part for the next attempt.
 		return err
 	}
+	return finishDownload(partPath, networkPath, sha)
+}
 
-	out, err := os.Create(networkPath)
-	defer out.Close()
+func finishDownload(partPath string, networkPath string, sha string) error {
+	if err := VerifyNetwork(partPath, sha); err != nil {
+		// Corrupt, start over next time.
+		os.Remove(partPath)
+		return err
+	}
+	return os.Rename(partPath, networkPath)
+}
+
+// Checks that the uncompressed contents of the gzip compressed network file
+// hash to sha, the way the server computes network shas.
+func VerifyNetwork(networkPath string, sha string) error {
+	file, err := os.Open(networkPath)
 	if err != nil {
 		return err
 	}
+	defer file.Close()
 
-	_, err = io.Copy(out, r.Body)
-	return err
+	zr, err := gzip.NewReader(file)
+	if err != nil {
+		return err
+	}
+	h := sha256.New()
+	if _, err := io.Copy(h, zr); err != nil {
+		return err
+	}
+	if actual := fmt.Sprintf("%x", h.Sum(nil)); actual != sha {
+		return fmt.Errorf("Network %s has sha %s", sha, actual)
+	}
+	return nil
 }
@@ -15,8 +15,10 @@ import (
 	"os/exec"
 	"path"
 	"path/filepath"
+	"sort"
 	"strconv"
 	"strings"
+	"sync"
 	"time"
 
 	"client/http"
@@ -29,6 +31,7 @@ var USER = flag.String("user", "", "Username")
 var PASSWORD = flag.String("password", "", "Password")
 var GPU = flag.Int("gpu", -1, "ID of the OpenCL device to use (-1 for default, or no GPU)")
 var DEBUG = flag.Bool("debug", false, "Enable debug mode to see verbose output and save logs")
+var KEEP_NETWORKS = flag.Int("keep-networks", 4, "Number of networks to keep in the local cache")
 
 type Settings struct {
 	User string
@@ -110,6 +113,89 @@ func uploadGame(httpClient *http.Client, path string, pgn string, nextGame clien
 	fmt.Println(resp.Header)
 	fmt.Println(body)
 
+	removeTrainingDir(path)
+	return nil
+}
+
+// A finished training game waiting for its upload.
+type trainingGame struct {
+	path     string
+	pgn      string
+	nextGame client.NextGameResponse
+	version  string
+}
+
+// Most games sent in one upload.
+const maxUploadGames = 32
+
+// The finished training games, which uploadGames sends.
+var pendingGames = make(chan trainingGame, 64)
+
+// Uploads the finished games in the background. The games waiting are sent
+// in one request, so the ones which finish during an upload go together.
+func uploadGames(httpClient *http.Client) {
+	for game := range pendingGames {
+		games := []trainingGame{game}
+	collect:
+		for len(games) < maxUploadGames {
+			select {
+			case game := <-pendingGames:
+				games = append(games, game)
+			default:
+				break collect
+			}
+		}
+		uploadBatch(httpClient, games, 0)
+	}
+}
+
+func uploadBatch(httpClient *http.Client, games []trainingGame, retryCount uint) {
+	extraParams := getExtraParams()
+	extraParams["games"] = strconv.Itoa(len(games))
+	extraParams["engineVersion"] = games[0].version
+	files := map[string]string{}
+	for i, game := range games {
+		n := strconv.Itoa(i)
+		extraParams["training_id"+n] = strconv.Itoa(int(game.nextGame.TrainingId))
+		extraParams["network_id"+n] = strconv.Itoa(int(game.nextGame.NetworkId))
+		extraParams["pgn"+n] = game.pgn
+		files["file"+n] = game.path
+	}
+	request, err := client.BuildMultiUploadRequest(*HOSTNAME+"/upload_games", extraParams, files)
+	if err != nil {
+		log.Print(err)
+		return
+	}
+	body := &bytes.Buffer{}
+	resp, err := httpClient.Do(request)
+	if err == nil {
+		_, err = body.ReadFrom(resp.Body)
+		resp.Body.Close()
+	}
+	if err != nil {
+		log.Print(err)
+		log.Print("Error uploading, retrying...")
+		time.Sleep(time.Second * (2 << retryCount))
+		uploadBatch(httpClient, games, retryCount+1)
+		return
+	}
+	if resp.StatusCode == http.StatusNotFound {
+		// The server takes one game per request.
+		for _, game := range games {
+			uploadGame(httpClient, game.path, game.pgn, game.nextGame, game.version, 0)
+		}
+		return
+	}
+	fmt.Println(resp.StatusCode)
+	fmt.Println(resp.Header)
+	fmt.Println(body)
+
+	for _, game := range games {
+		removeTrainingDir(game.path)
+	}
+}
+
+func removeTrainingDir(path string) {
 	train_dir := filepath.Dir(path)
 	if _, err := os.Stat(train_dir); err == nil {
 		files, err := ioutil.ReadDir(train_dir)
@@ -125,16 +211,20 @@ func uploadGame(httpClient *http.Client, path string, pgn string, nextGame clien
 			log.Fatal(err)
 		}
 	}
-
-	return nil
 }
 
 type CmdWrapper struct {
-	Cmd      *exec.Cmd
+	Cmd *exec.Cmd
+	// Guards Pgn and Version, which the output reader writes.
+	Mutex    sync.Mutex
 	Pgn      string
 	Input    io.WriteCloser
 	BestMove chan string
-	Version  string
+	// Receives the "trainok" line of every finished "train" command.
+	TrainOk chan string
+	// Closed when the output of the engine ends, that is when it exits.
+	Exited  chan struct{}
+	Version string
 }
 
 func (c *CmdWrapper) openInput() {
@@ -146,7 +236,9 @@ func (c *CmdWrapper) openInput() {
 }
 
 func (c *CmdWrapper) launch(networkPath string, args []string, input bool) {
-	c.BestMove = make(chan string)
+	c.BestMove = make(chan string, 1)
+	c.TrainOk = make(chan string, 1)
+	c.Exited = make(chan struct{})
 	weights := fmt.Sprintf("--weights=%s", networkPath)
 	dir, _ := os.Getwd()
 	c.Cmd = exec.Command(path.Join(dir, "lczero"), weights, "-t1")
@@ -180,13 +272,20 @@ func (c *CmdWrapper) launch(networkPath string, args []string, input bool) {
 			} else if line == "END" {
 				reading_pgn = false
 			} else if reading_pgn {
+				c.Mutex.Lock()
 				c.Pgn += line + "\n"
+				c.Mutex.Unlock()
 			} else if strings.HasPrefix(line, "bestmove ") {
 				c.BestMove <- strings.Split(line, " ")[1]
+			} else if strings.HasPrefix(line, "trainok ") {
+				c.TrainOk <- line
 			} else if strings.HasPrefix(line, "id name lczero ") {
+				c.Mutex.Lock()
 				c.Version = strings.Split(line, " ")[3]
+				c.Mutex.Unlock()
 			}
 		}
+		close(c.Exited)
 	}()
 
 	go func() {
@@ -206,24 +305,96 @@ func (c *CmdWrapper) launch(networkPath string, args []string, input bool) {
 	}
 }
 
-func playMatch(baselinePath string, candidatePath string, params []string, flip bool) (int, string, string, error) {
-	baseline := CmdWrapper{}
-	baseline.launch(baselinePath, params, true)
-	defer baseline.Input.Close()
+// Asks the engine to exit, and kills it if it doesn't.
+func (c *CmdWrapper) close() {
+	c.Input.Close()
+	select {
+	case <-c.Exited:
+	case <-time.After(10 * time.Second):
+		c.Cmd.Process.Kill()
+		<-c.Exited
+	}
+	c.Cmd.Wait()
+}
 
-	candidate := CmdWrapper{}
-	candidate.launch(candidatePath, params, true)
-	defer candidate.Input.Close()
+// An engine of a game: its role in the game, and its network.
+type engineSpec struct {
+	role        string
+	networkPath string
+}
+
+// Engines kept running between games, by role, network and parameters, so
+// that every engine loads and tunes its network once rather than per game.
+var engines = map[string]*CmdWrapper{}
+
+// Returns running engines for the specs, launching the ones not running yet.
+// Engines that are not asked for are closed, so that only the ones of the
+// current game hold the GPU.
+func getEngines(specs []engineSpec, params []string) []*CmdWrapper {
+	keys := make([]string, len(specs))
+	wanted := map[string]bool{}
+	for i, spec := range specs {
+		keys[i] = spec.role + " " + spec.networkPath + " " + strings.Join(params, " ")
+		wanted[keys[i]] = true
+	}
+	for key, c := range engines {
+		if !wanted[key] {
+			c.close()
+			delete(engines, key)
+		}
+	}
+
+	result := make([]*CmdWrapper, len(specs))
+	for i, spec := range specs {
+		c, ok := engines[keys[i]]
+		if !ok {
+			c = &CmdWrapper{}
+			c.launch(spec.networkPath, engineParams(params), true)
+			engines[keys[i]] = c
+		}
+		result[i] = c
+	}
+	return result
+}
 
-	p1 := &candidate
-	p2 := &baseline
+// Closes all the engines, for when one of them misbehaved.
+func closeEngines() {
+	for key, c := range engines {
+		c.close()
+		delete(engines, key)
+	}
+}
+
+// Adds the parameters the client sets itself to the ones of the server.
+func engineParams(params []string) []string {
+	result := append([]string{}, params...)
+	if *DEBUG {
+		pid := os.Getpid()
+		dir, _ := os.Getwd()
+		logs_dir := path.Join(dir, fmt.Sprintf("logs-%v", pid))
+		os.MkdirAll(logs_dir, os.ModePerm)
+		logfile := path.Join(logs_dir, fmt.Sprintf("%s.log", time.Now().Format("20060102150405")))
+		result = append(result, "-l"+logfile)
+	}
+	return result
+}
+
+func playMatch(baselinePath string, candidatePath string, params []string, flip bool) (int, string, string, error) {
+	players := getEngines([]engineSpec{{"baseline", baselinePath}, {"candidate", candidatePath}}, params)
+	baseline := players[0]
+	candidate := players[1]
+
+	p1 := candidate
+	p2 := baseline
 
 	if flip {
 		p2, p1 = p1, p2
 	}
 
-	io.WriteString(baseline.Input, "uci\n")
-	io.WriteString(candidate.Input, "uci\n")
+	for _, p := range players {
+		io.WriteString(p.Input, "uci\n")
+		io.WriteString(p.Input, "ucinewgame\n")
+	}
 
 	// Play a game using UCI
 	var result int
@@ -261,6 +432,7 @@ func playMatch(baselinePath string, candidatePath string, params []string, flip
 			err := game.MoveStr(best_move)
 			if err != nil {
 				log.Println("Error decoding: " + best_move + " for game:\n" + game.String())
+				closeEngines()
 				return 0, "", "", err
 			}
 			if len(move_history) == 0 {
@@ -270,11 +442,17 @@ func playMatch(baselinePath string, candidatePath string, params []string, flip
 			turn += 1
 		case <-time.After(60 * time.Second):
 			log.Println("Bestmove has timed out, aborting match")
+			closeEngines()
 			return 0, "", "", errors.New("timeout")
+		case <-p.Exited:
+			closeEngines()
+			return 0, "", "", errors.New("engine exited")
 		}
 	}
 
 	chess.UseNotation(chess.AlgebraicNotation{})(game)
+	candidate.Mutex.Lock()
+	defer candidate.Mutex.Unlock()
 	return result, game.String(), candidate.Version, nil
 }
 
@@ -284,50 +462,130 @@ func train(networkPath string, count int, params []string) (string, string, stri
 
 	dir, _ := os.Getwd()
 	train_dir := path.Join(dir, fmt.Sprintf("data-%v-%v", pid, count))
-	if *DEBUG {
-		logs_dir := path.Join(dir, fmt.Sprintf("logs-%v", pid))
-		os.MkdirAll(logs_dir, os.ModePerm)
-		logfile := path.Join(logs_dir, fmt.Sprintf("%s.log", time.Now().Format("20060102150405")))
-		params = append(params, "-l"+logfile)
-	}
 
+	// The engine plays the game in its loop and stays up for the next one.
+	c := getEngines([]engineSpec{{"train", networkPath}}, params)[0]
+	c.Mutex.Lock()
+	c.Pgn = ""
+	c.Mutex.Unlock()
 	num_games := 1
-	train_cmd := fmt.Sprintf("--start=train %v-%v %v", pid, count, num_games)
-	params = append(params, train_cmd)
-
-	c := CmdWrapper{}
-	c.launch(networkPath, params, false)
-
-	err := c.Cmd.Wait()
-	if err != nil {
-		log.Fatal(err)
+	io.WriteString(c.Input, fmt.Sprintf("train %v-%v %v\n", pid, count, num_games))
+	select {
+	case <-c.TrainOk:
+	case <-c.Exited:
+		log.Fatal("The engine exited while playing a training game")
 	}
 
+	c.Mutex.Lock()
+	defer c.Mutex.Unlock()
 	return path.Join(train_dir, "training.0.gz"), c.Pgn, c.Version
 }
 
-func getNetwork(httpClient *http.Client, sha string, clearOld bool) (string, error) {
-	// Sha already exists?
+// Networks whose file this process checked against their sha.
+var verifiedNetworks = map[string]bool{}
+
+// Returns the path of the network with the sha, downloading it into the
+// networks directory if it isn't there. The directory is a cache addressed by
+// sha: a network is checked against its sha once per run, and with prune the
+// least recently used ones beyond -keep-networks are removed.
+func getNetwork(httpClient *http.Client, sha string, prune bool) (string, error) {
+	os.MkdirAll("networks", os.ModePerm)
 	path := filepath.Join("networks", sha)
-	if stat, err := os.Stat(path); err == nil {
-		if stat.Size() != 0 {
-			return path, nil
+	if _, err := os.Stat(path); err == nil && !verifiedNetworks[sha] {
+		if err := client.VerifyNetwork(path, sha); err != nil {
+			log.Printf("Removing corrupt network: %v\n", err)
+			os.Remove(path)
+			os.Remove(path + ".bin")
+		} else {
+			verifiedNetworks[sha] = true
+		}
+	}
+
+	if _, err := os.Stat(path); os.IsNotExist(err) {
+		fmt.Printf("Downloading network...\n")
+		// A failed attempt leaves what it got, and the next one resumes it.
+		for retry := uint(0); ; retry++ {
+			err = client.DownloadNetwork(httpClient, *HOSTNAME, path, sha)
+			if err == nil || retry == 4 {
+				break
+			}
+			log.Print(err)
+			log.Print("Error downloading, retrying...")
+			time.Sleep(time.Second * (2 << retry))
 		}
+		if err != nil {
+			return "", err
+		}
+		verifiedNetworks[sha] = true
 	}
 
-	if clearOld {
-		// Clean out any old networks
-		os.RemoveAll("networks")
+	now := time.Now()
+	os.Chtimes(path, now, now)
+	if prune {
+		pruneNetworks(sha)
 	}
-	os.MkdirAll("networks", os.ModePerm)
+	return convertNetwork(path), nil
+}
+
+// Returns the path of the network in the binary weights format, which loads
+// much faster than the text one, converting it the first time. Returns the
+// path of the text network if the conversion fails.
+func convertNetwork(networkPath string) string {
+	binaryPath := networkPath + ".bin"
+	if _, err := os.Stat(binaryPath); err == nil {
+		return binaryPath
+	}
+	dir, _ := os.Getwd()
+	tmpPath := binaryPath + ".tmp"
+	cmd := exec.Command(path.Join(dir, "lczero"), fmt.Sprintf("--weights=%s", networkPath),
+		fmt.Sprintf("--convert-weights=%s", tmpPath), "--quiet")
+	if out, err := cmd.CombinedOutput(); err != nil {
+		log.Printf("Converting %s failed: %v\n%s", networkPath, err, out)
+		os.Remove(tmpPath)
+		return networkPath
+	}
+	if err := os.Rename(tmpPath, binaryPath); err != nil {
+		log.Print(err)
+		return networkPath
+	}
+	return binaryPath
+}
 
-	fmt.Printf("Downloading network...\n")
-	// Otherwise, let's download it
-	err := client.DownloadNetwork(httpClient, *HOSTNAME, path, sha)
+// Removes the least recently used networks but current from the cache, with
+// their binary and partly downloaded files, so that -keep-networks are left.
+func pruneNetworks(current string) {
+	files, err := ioutil.ReadDir("networks")
 	if err != nil {
-		return "", err
+		log.Print(err)
+		return
+	}
+	lastUsed := map[string]time.Time{}
+	for _, f := range files {
+		sha := strings.SplitN(f.Name(), ".", 2)[0]
+		if f.ModTime().After(lastUsed[sha]) {
+			lastUsed[sha] = f.ModTime()
+		}
+	}
+	var shas []string
+	for sha := range lastUsed {
+		if sha != current {
+			shas = append(shas, sha)
+		}
+	}
+	sort.Slice(shas, func(i, j int) bool { return lastUsed[shas[i]].After(lastUsed[shas[j]]) })
+	if len(shas) < *KEEP_NETWORKS {
+		return
+	}
+	remove := map[string]bool{}
+	for _, sha := range shas[*KEEP_NETWORKS-1:] {
+		remove[sha] = true
+		delete(verifiedNetworks, sha)
+	}
+	for _, f := range files {
+		if remove[strings.SplitN(f.Name(), ".", 2)[0]] {
+			os.Remove(filepath.Join("networks", f.Name()))
+		}
 	}
-	return path, nil
 }
 
 func nextGame(httpClient *http.Client, count int) error {
@@ -364,7 +622,7 @@ func nextGame(httpClient *http.Client, count int) error {
 			return err
 		}
 		trainFile, pgn, version := train(networkPath, count, params)
-		go uploadGame(httpClient, trainFile, pgn, nextGame, version, 0)
+		pendingGames <- trainingGame{trainFile, pgn, nextGame, version}
 		return nil
 	}
 
@@ -384,8 +642,12 @@ func main() {
 	if len(*PASSWORD) == 0 {
 		log.Fatal("You must specify a non-empty password")
 	}
+	if *KEEP_NETWORKS < 1 {
+		log.Fatal("You must keep at least one network")
+	}
 
 	httpClient := &http.Client{}
+	go uploadGames(httpClient)
 	start := time.Now()
 	for i := 0; ; i++ {
 		err := nextGame(httpClient, i)
@@ -0,0 +1,175 @@
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"log"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"server/db"
+	"time"
+)
+
+// Trainers read the games of many networks, so rather than a file per game
+// they get bundles: the games of one network in a random order, stored one
+// after the other like in a chunk (see ingest.go), so that a bundle is itself
+// a gzip file of all of them. The index next to a bundle has a line
+// "offset size" for every game, which lets trainers read the games one by
+// one, or download some of them with range requests.
+
+// Games in a bundle, only the last bundle of a network can have fewer.
+const gamesPerBundle = 10000
+
+// Time between two runs of the bundler.
+const bundleInterval = 10 * time.Minute
+
+func bundleIndexPath(path string) string {
+	return path + ".index"
+}
+
+func bundleGamesPeriodically() {
+	for {
+		if bundles, err := bundleGames(); err != nil {
+			log.Println(err)
+		} else if bundles > 0 {
+			log.Printf("Wrote %d training bundles\n", bundles)
+		}
+		time.Sleep(bundleInterval)
+	}
+}
+
+// Bundles the games of the networks with gamesPerBundle games that aren't
+// bundled yet, and the remaining games of the networks which aren't the best
+// network of their training run anymore. Returns the number of bundles
+// written.
+func bundleGames() (int, error) {
+	type networkGames struct {
+		NetworkID uint
+		Games     int
+	}
+	counts := []networkGames{}
+	err := db.GetDB().Raw(`SELECT network_id, COUNT(*) AS games FROM training_games WHERE bundle_id = 0 GROUP BY network_id`).Scan(&counts).Error
+	if err != nil {
+		return 0, err
+	}
+
+	runs := []db.TrainingRun{}
+	if err := db.GetDB().Find(&runs).Error; err != nil {
+		return 0, err
+	}
+	best := map[uint]bool{}
+	for _, run := range runs {
+		best[run.BestNetworkID] = true
+	}
+
+	bundles := 0
+	for _, count := range counts {
+		for remaining := count.Games; remaining >= gamesPerBundle || (remaining > 0 && !best[count.NetworkID]); {
+			games := []db.TrainingGame{}
+			err := db.GetDB().Where("network_id = ? AND bundle_id = 0", count.NetworkID).Order("id asc").Limit(gamesPerBundle).Find(&games).Error
+			if err != nil {
+				return bundles, err
+			}
+			if len(games) == 0 {
+				break
+			}
+			if err := writeBundle(games); err != nil {
+				return bundles, err
+			}
+			bundles++
+			remaining -= len(games)
+		}
+	}
+	return bundles, nil
+}
+
+// The gzip compressed training data of a game.
+func readGameData(game *db.TrainingGame) ([]byte, error) {
+	path := game.Path
+	if path == "" {
+		// Games from before the path was stored.
+		path = filepath.Join("games", fmt.Sprintf("run%d/training.%d.gz", game.TrainingRunID, game.ID))
+	}
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer file.Close()
+	if game.ChunkSize == 0 {
+		return ioutil.ReadAll(file)
+	}
+	data := make([]byte, game.ChunkSize)
+	if _, err := file.ReadAt(data, game.ChunkOffset); err != nil {
+		return nil, err
+	}
+	return data, nil
+}
+
+// Writes the games, which are of one network, to a new bundle. Games whose
+// data can't be read are left out, but are marked as bundled all the same.
+func writeBundle(games []db.TrainingGame) error {
+	first := games[0]
+	path := filepath.Join("bundles", fmt.Sprintf("run%d/network%d.%d.bundle.gz", first.TrainingRunID, first.NetworkID, first.ID))
+	if err := os.MkdirAll(filepath.Dir(path), os.ModePerm); err != nil {
+		return err
+	}
+	file, err := os.Create(path)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+
+	var index bytes.Buffer
+	var size int64
+	bundled := 0
+	skipped := 0
+	ids := make([]uint64, len(games))
+	for i, j := range rand.Perm(len(games)) {
+		game := &games[j]
+		ids[i] = game.ID
+		data, err := readGameData(game)
+		if err != nil {
+			if skipped == 0 {
+				log.Printf("Skipping game %d: %v\n", game.ID, err)
+			}
+			skipped++
+			continue
+		}
+		if _, err := file.Write(data); err != nil {
+			return err
+		}
+		fmt.Fprintf(&index, "%d %d\n", size, len(data))
+		size += int64(len(data))
+		bundled++
+	}
+	if skipped > 0 {
+		log.Printf("Skipped %d games of network %d\n", skipped, first.NetworkID)
+	}
+	if err := file.Sync(); err != nil {
+		return err
+	}
+	if err := ioutil.WriteFile(bundleIndexPath(path), index.Bytes(), 0644); err != nil {
+		return err
+	}
+
+	bundle := db.TrainingBundle{
+		TrainingRunID: first.TrainingRunID,
+		NetworkID:     first.NetworkID,
+		Path:          path,
+		Games:         bundled,
+		Size:          size,
+	}
+	tx := db.GetDB().Begin()
+	err = tx.Create(&bundle).Error
+	if err == nil {
+		err = tx.Model(&db.TrainingGame{}).Where("id IN (?)", ids).Update("bundle_id", bundle.ID).Error
+	}
+	if err == nil {
+		err = tx.Commit().Error
+	} else {
+		tx.Rollback()
+	}
+	return err
+}
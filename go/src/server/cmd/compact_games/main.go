@@ -46,6 +46,9 @@ func addFile(tw *tar.Writer, path string) error {
 func tarGame(game *db.TrainingGame, dir string, tw *tar.Writer) error {
 	name := fmt.Sprintf("training.%d.gz", game.ID)
 	source := "../../games/run1/" + name
+	if game.ChunkSize > 0 {
+		source = "../../" + game.Path
+	}
 
 	path := filepath.Join(dir, name[0:len(name)-3])
 	// log.Printf("Compressing %s to %s\n", source, path)
@@ -55,7 +58,12 @@ func tarGame(game *db.TrainingGame, dir string, tw *tar.Writer) error {
 		return err
 	}
 	defer gzFile.Close()
-	gzr, err := gzip.NewReader(gzFile)
+	var compressed io.Reader = gzFile
+	if game.ChunkSize > 0 {
+		// The game was uploaded in a batch, into a chunk of games.
+		compressed = io.NewSectionReader(gzFile, game.ChunkOffset, game.ChunkSize)
+	}
+	gzr, err := gzip.NewReader(compressed)
 	if err != nil {
 		log.Printf("Skipping %s: %v\n", path, err)
 		return nil
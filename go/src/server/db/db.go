@@ -36,6 +36,7 @@ func SetupDB() {
 	db.AutoMigrate(&Match{})
 	db.AutoMigrate(&MatchGame{})
 	db.AutoMigrate(&TrainingGame{})
+	db.AutoMigrate(&TrainingBundle{})
 }
 
 // CreateTrainingRun creates training run
@@ -97,13 +97,33 @@ type TrainingGame struct {
 	Network       Network
 	NetworkID     uint `gorm:"index"`
 
-	Version   uint
-	Path      string
-	Compacted bool
+	Version uint
+	Path    string
+	// Games uploaded in batches share a chunk file at Path, which holds the
+	// gzip compressed data of the game in ChunkSize bytes at ChunkOffset.
+	// ChunkSize is 0 when Path is the file of this game alone.
+	ChunkOffset int64
+	ChunkSize   int64
+	Compacted   bool
+	// The TrainingBundle the game is in, 0 until it is bundled.
+	BundleID uint `gorm:"index;default:0"`
 
 	EngineVersion string
 }
 
+// The games of a network packed into one file for trainers, see bundle.go.
+type TrainingBundle struct {
+	ID        uint `gorm:"primary_key"`
+	CreatedAt time.Time
+
+	TrainingRunID uint `gorm:"index"`
+	NetworkID     uint `gorm:"index"`
+
+	Path  string
+	Games int
+	Size  int64
+}
+
 type ServerData struct {
 	gorm.Model
 
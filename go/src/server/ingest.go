@@ -0,0 +1,152 @@
+package main
+
+import (
+	"fmt"
+	"io/ioutil"
+	"log"
+	"os"
+	"path/filepath"
+	"server/db"
+	"sync"
+
+	"github.com/jinzhu/gorm"
+)
+
+// Games uploaded together are stored by one transaction, and their training
+// data is appended to a chunk file of the training run rather than written to
+// a file per game. A chunk is the gzip files of its games one after the
+// other, which is itself a gzip file of all of them.
+
+// Games in a chunk before the next one is started.
+const gamesPerChunk = 1000
+
+// Most games accepted by one upload.
+const maxUploadGames = 64
+
+type gameUpload struct {
+	game db.TrainingGame
+	// The gzip compressed training data.
+	data []byte
+	pgn  string
+}
+
+type trainingChunk struct {
+	file  *os.File
+	path  string
+	size  int64
+	games int
+}
+
+type gameIngester struct {
+	mutex sync.Mutex
+	// The chunk being filled, by training run.
+	chunks map[uint]*trainingChunk
+}
+
+var ingester = gameIngester{chunks: map[uint]*trainingChunk{}}
+
+// Stores the games, and then their pgns. The games are either all stored or
+// none is.
+func (g *gameIngester) ingest(uploads []gameUpload) error {
+	g.mutex.Lock()
+	defer g.mutex.Unlock()
+
+	// The chunks before the batch, to undo it if it fails.
+	saved := map[uint]*trainingChunk{}
+	savedState := map[uint]trainingChunk{}
+	for run, chunk := range g.chunks {
+		saved[run] = chunk
+		savedState[run] = *chunk
+	}
+
+	tx := db.GetDB().Begin()
+	err := g.store(tx, uploads)
+	if err == nil {
+		err = tx.Commit().Error
+	} else {
+		tx.Rollback()
+	}
+	if err != nil {
+		for run, chunk := range g.chunks {
+			if saved[run] != chunk {
+				chunk.file.Close()
+				os.Remove(chunk.path)
+			}
+		}
+		for run, chunk := range saved {
+			*chunk = savedState[run]
+			chunk.file.Truncate(chunk.size)
+		}
+		g.chunks = saved
+		return err
+	}
+	for run, chunk := range saved {
+		if g.chunks[run] != chunk {
+			chunk.file.Close()
+		}
+	}
+
+	for _, upload := range uploads {
+		pgn_path := fmt.Sprintf("pgns/run%d/%d.pgn", upload.game.TrainingRunID, upload.game.ID)
+		os.MkdirAll(filepath.Dir(pgn_path), os.ModePerm)
+		err = ioutil.WriteFile(pgn_path, []byte(upload.pgn), 0644)
+		if err != nil {
+			log.Println(err.Error())
+		}
+	}
+	return nil
+}
+
+func (g *gameIngester) store(tx *gorm.DB, uploads []gameUpload) error {
+	gamesPlayed := map[uint]int{}
+	for i := range uploads {
+		game := &uploads[i].game
+		data := uploads[i].data
+		chunk := g.chunks[game.TrainingRunID]
+		if chunk != nil && chunk.games < gamesPerChunk {
+			game.Path = chunk.path
+			game.ChunkOffset = chunk.size
+			game.ChunkSize = int64(len(data))
+			if err := tx.Create(game).Error; err != nil {
+				return err
+			}
+		} else {
+			// A new chunk is named after its first game, so it takes the
+			// place of the file of that game.
+			if err := tx.Create(game).Error; err != nil {
+				return err
+			}
+			path := filepath.Join("games", fmt.Sprintf("run%d/training.%d.gz", game.TrainingRunID, game.ID))
+			os.MkdirAll(filepath.Dir(path), os.ModePerm)
+			file, err := os.OpenFile(path, os.O_CREATE|os.O_WRONLY|os.O_TRUNC, 0644)
+			if err != nil {
+				return err
+			}
+			chunk = &trainingChunk{file: file, path: path}
+			g.chunks[game.TrainingRunID] = chunk
+			err = tx.Model(game).Updates(map[string]interface{}{
+				"path":         path,
+				"chunk_offset": 0,
+				"chunk_size":   len(data),
+			}).Error
+			if err != nil {
+				return err
+			}
+		}
+
+		if _, err := chunk.file.WriteAt(data, chunk.size); err != nil {
+			return err
+		}
+		chunk.size += int64(len(data))
+		chunk.games++
+		gamesPlayed[game.NetworkID]++
+	}
+
+	for network_id, games := range gamesPlayed {
+		err := tx.Exec("UPDATE networks SET games_played = games_played + ? WHERE id = ?", games, network_id).Error
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
@@ -395,6 +395,104 @@ func uploadGame(c *gin.Context) {
 	c.String(http.StatusOK, fmt.Sprintf("File %s uploaded successfully with fields user=%s.", file.Filename, user.Username))
 }
 
+// Takes several training games in one request: the fields pgnN, training_idN
+// and network_idN and the file fileN of game N, for the number of games in
+// games.
+func uploadGames(c *gin.Context) {
+	user, version, err := checkUser(c)
+	if err != nil {
+		log.Println(strings.TrimSpace(err.Error()))
+		c.String(http.StatusBadRequest, err.Error())
+		return
+	}
+	if !checkEngineVersion(c.PostForm("engineVersion")) {
+		log.Printf("Rejecting game with old lczero version %s", c.PostForm("engineVersion"))
+		c.String(http.StatusBadRequest, "\n\n\n\n\nYou must upgrade to a newer lczero version!!\n\n\n\n\n")
+		return
+	}
+
+	count, err := strconv.Atoi(c.PostForm("games"))
+	if err != nil || count < 1 || count > maxUploadGames {
+		c.String(http.StatusBadRequest, "Invalid games")
+		return
+	}
+
+	trainingRuns := map[uint64]bool{}
+	networks := map[uint64]bool{}
+	uploads := make([]gameUpload, count)
+	for i := range uploads {
+		n := strconv.Itoa(i)
+		training_id, err := strconv.ParseUint(c.PostForm("training_id"+n), 10, 32)
+		if err != nil {
+			c.String(http.StatusBadRequest, "Invalid training_id")
+			return
+		}
+		if !trainingRuns[training_id] {
+			if _, err := getTrainingRun(uint(training_id)); err != nil {
+				log.Println(err)
+				c.String(http.StatusBadRequest, "Invalid training_id")
+				return
+			}
+			trainingRuns[training_id] = true
+		}
+
+		network_id, err := strconv.ParseUint(c.PostForm("network_id"+n), 10, 32)
+		if err != nil {
+			c.String(http.StatusBadRequest, "Invalid network_id")
+			return
+		}
+		if !networks[network_id] {
+			var network db.Network
+			if err := db.GetDB().Where("id = ?", network_id).First(&network).Error; err != nil {
+				log.Println(err)
+				c.String(http.StatusBadRequest, "Invalid network")
+				return
+			}
+			networks[network_id] = true
+		}
+
+		data, err := readFormFile(c, "file"+n)
+		if err != nil {
+			log.Println(err.Error())
+			c.String(http.StatusBadRequest, "Missing file")
+			return
+		}
+
+		uploads[i] = gameUpload{
+			game: db.TrainingGame{
+				UserID:        user.ID,
+				TrainingRunID: uint(training_id),
+				NetworkID:     uint(network_id),
+				Version:       uint(version),
+				EngineVersion: c.PostForm("engineVersion"),
+			},
+			data: data,
+			pgn:  c.PostForm("pgn" + n),
+		}
+	}
+
+	if err := ingester.ingest(uploads); err != nil {
+		log.Println(err)
+		c.String(500, "Internal error")
+		return
+	}
+
+	c.String(http.StatusOK, fmt.Sprintf("%d games uploaded successfully with fields user=%s.", count, user.Username))
+}
+
+func readFormFile(c *gin.Context, name string) ([]byte, error) {
+	header, err := c.FormFile(name)
+	if err != nil {
+		return nil, err
+	}
+	file, err := header.Open()
+	if err != nil {
+		return nil, err
+	}
+	defer file.Close()
+	return ioutil.ReadAll(file)
+}
+
 func getNetwork(c *gin.Context) {
 	// lczero.org/cached/ is behind the cloudflare CDN.  Redirect to there to ensure
 	// we hit the CDN.
@@ -414,7 +512,12 @@ func cachedGetNetwork(c *gin.Context) {
 		return
 	}
 
-	// Serve the file
+	// Networks never change, and are stored gzip compressed as uploaded, so
+	// the file is sent as it is. Its sha as ETag lets clients resume partial
+	// downloads with range requests.
+	c.Header("ETag", fmt.Sprintf("\"%s\"", network.Sha))
+	c.Header("Cache-Control", "public, max-age=31536000, immutable")
+	c.Header("Content-Type", "application/gzip")
 	c.File(network.Path)
 	// c.Redirect(http.StatusMovedPermanently, "https://s3.amazonaws.com/lczero/" + network.Path)
 }
@@ -1161,6 +1264,74 @@ func viewTrainingData(c *gin.Context) {
 	})
 }
 
+// The bundles of a training run, newest first, as JSON.
+func trainingBundles(c *gin.Context) {
+	training_id, err := strconv.ParseUint(c.DefaultQuery("training_id", "1"), 10, 32)
+	if err != nil {
+		c.String(http.StatusBadRequest, "Invalid training_id")
+		return
+	}
+
+	bundles := []db.TrainingBundle{}
+	err = db.GetDB().Where("training_run_id = ?", training_id).Order("id desc").Find(&bundles).Error
+	if err != nil {
+		log.Println(err)
+		c.String(500, "Internal error")
+		return
+	}
+
+	result := []gin.H{}
+	for _, bundle := range bundles {
+		result = append(result, gin.H{
+			"id":        bundle.ID,
+			"networkId": bundle.NetworkID,
+			"games":     bundle.Games,
+			"size":      bundle.Size,
+			"url":       fmt.Sprintf("/training_bundle/%d", bundle.ID),
+			"indexUrl":  fmt.Sprintf("/training_bundle/%d/index", bundle.ID),
+		})
+	}
+	c.JSON(http.StatusOK, result)
+}
+
+func getTrainingBundle(c *gin.Context) (*db.TrainingBundle, error) {
+	id, err := strconv.ParseUint(c.Param("id"), 10, 32)
+	if err != nil {
+		return nil, err
+	}
+	bundle := db.TrainingBundle{}
+	err = db.GetDB().Where("id = ?", id).First(&bundle).Error
+	return &bundle, err
+}
+
+// Bundles never change, so like networks they are sent as they are, with an
+// ETag for range requests.
+func trainingBundle(c *gin.Context) {
+	bundle, err := getTrainingBundle(c)
+	if err != nil {
+		log.Println(err)
+		c.String(http.StatusBadRequest, "Unknown bundle")
+		return
+	}
+	c.Header("ETag", fmt.Sprintf("\"bundle%d\"", bundle.ID))
+	c.Header("Cache-Control", "public, max-age=31536000, immutable")
+	c.Header("Content-Type", "application/gzip")
+	c.File(bundle.Path)
+}
+
+func trainingBundleIndex(c *gin.Context) {
+	bundle, err := getTrainingBundle(c)
+	if err != nil {
+		log.Println(err)
+		c.String(http.StatusBadRequest, "Unknown bundle")
+		return
+	}
+	c.Header("ETag", fmt.Sprintf("\"bundle%d-index\"", bundle.ID))
+	c.Header("Cache-Control", "public, max-age=31536000, immutable")
+	c.Header("Content-Type", "text/plain")
+	c.File(bundleIndexPath(bundle.Path))
+}
+
 func createTemplates() multitemplate.Render {
 	r := multitemplate.New()
 	r.AddFromFiles("index", "templates/base.tmpl", "templates/index.tmpl")
@@ -1197,8 +1368,12 @@ func setupRouter() *gin.Engine {
 	router.GET("/active_users", viewActiveUsers)
 	router.GET("/match_game/:id", viewMatchGame)
 	router.GET("/training_data", viewTrainingData)
+	router.GET("/training_bundles", trainingBundles)
+	router.GET("/training_bundle/:id", trainingBundle)
+	router.GET("/training_bundle/:id/index", trainingBundleIndex)
 	router.POST("/next_game", nextGame)
 	router.POST("/upload_game", uploadGame)
+	router.POST("/upload_games", uploadGames)
 	router.POST("/upload_network", uploadNetwork)
 	router.POST("/match_result", matchResult)
 	return router
@@ -1209,6 +1384,8 @@ func main() {
 	db.SetupDB()
 	defer db.Close()
 
+	go bundleGamesPeriodically()
+
 	router := setupRouter()
 	router.Run(config.Config.WebServer.Address)
 }
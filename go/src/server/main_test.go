@@ -44,6 +44,7 @@ func (s *StoreSuite) SetupTest() {
 		&db.Match{},
 		&db.MatchGame{},
 		&db.TrainingGame{},
+		&db.TrainingBundle{},
 	).Error
 	if err != nil {
 		log.Fatal(err)
@@ -193,6 +194,137 @@ func (s *StoreSuite) TestUploadGameNewUser() {
 	assert.Equal(s.T(), 1, network.GamesPlayed)
 }
 
+func (s *StoreSuite) TestUploadGames() {
+	extraParams := map[string]string{
+		"user":     "foo",
+		"password": "asdf",
+		"version":  "1",
+		"games":    "2",
+	}
+	files := map[string]string{}
+	for i, content := range []string{"game0", "game1"} {
+		tmpfile, _ := ioutil.TempFile("", "example")
+		defer os.Remove(tmpfile.Name())
+		tmpfile.WriteString(content)
+		tmpfile.Close()
+		n := fmt.Sprintf("%d", i)
+		files["file"+n] = tmpfile.Name()
+		extraParams["training_id"+n] = "1"
+		extraParams["network_id"+n] = "1"
+		extraParams["pgn"+n] = "1. e4 e5"
+	}
+	req, err := client.BuildMultiUploadRequest("/upload_games", extraParams, files)
+	if err != nil {
+		log.Fatal(err)
+	}
+	s.router.ServeHTTP(s.w, req)
+
+	assert.Equal(s.T(), 200, s.w.Code, s.w.Body.String())
+
+	// Both games are in one chunk, one after the other
+	games := []db.TrainingGame{}
+	err = db.GetDB().Order("id asc").Find(&games).Error
+	if err != nil {
+		log.Fatal(err)
+	}
+	assert.Equal(s.T(), 2, len(games))
+	assert.Equal(s.T(), games[0].Path, games[1].Path)
+	assert.Equal(s.T(), int64(0), games[0].ChunkOffset)
+	assert.Equal(s.T(), int64(5), games[1].ChunkOffset)
+	chunk, err := ioutil.ReadFile(games[0].Path)
+	if err != nil {
+		log.Fatal(err)
+	}
+	assert.Equal(s.T(), "game0game1", string(chunk))
+
+	network := db.Network{}
+	err = db.GetDB().Where("id = ?", 1).First(&network).Error
+	if err != nil {
+		log.Fatal(err)
+	}
+	assert.Equal(s.T(), 2, network.GamesPlayed)
+}
+
+func (s *StoreSuite) TestBundleGames() {
+	extraParams := map[string]string{
+		"user":     "foo",
+		"password": "asdf",
+		"version":  "1",
+		"games":    "2",
+	}
+	files := map[string]string{}
+	for i, content := range []string{"game0", "game1"} {
+		tmpfile, _ := ioutil.TempFile("", "example")
+		defer os.Remove(tmpfile.Name())
+		tmpfile.WriteString(content)
+		tmpfile.Close()
+		n := fmt.Sprintf("%d", i)
+		files["file"+n] = tmpfile.Name()
+		extraParams["training_id"+n] = "1"
+		extraParams["network_id"+n] = "1"
+		extraParams["pgn"+n] = "1. e4 e5"
+	}
+	req, err := client.BuildMultiUploadRequest("/upload_games", extraParams, files)
+	if err != nil {
+		log.Fatal(err)
+	}
+	s.router.ServeHTTP(s.w, req)
+	assert.Equal(s.T(), 200, s.w.Code, s.w.Body.String())
+
+	// Too few games for a bundle while the network is the best one.
+	bundles, err := bundleGames()
+	assert.Nil(s.T(), err)
+	assert.Equal(s.T(), 0, bundles)
+
+	network := db.Network{Sha: "efgh", Path: "/tmp/network2", TrainingRunID: 1}
+	if err := db.GetDB().Create(&network).Error; err != nil {
+		log.Fatal(err)
+	}
+	if err := setBestNetwork(1, network.ID); err != nil {
+		log.Fatal(err)
+	}
+	bundles, err = bundleGames()
+	assert.Nil(s.T(), err)
+	assert.Equal(s.T(), 1, bundles)
+	bundles, err = bundleGames()
+	assert.Nil(s.T(), err)
+	assert.Equal(s.T(), 0, bundles)
+
+	bundle := db.TrainingBundle{}
+	if err := db.GetDB().First(&bundle).Error; err != nil {
+		log.Fatal(err)
+	}
+	defer os.Remove(bundle.Path)
+	defer os.Remove(bundleIndexPath(bundle.Path))
+
+	s.w = httptest.NewRecorder()
+	req, _ = http.NewRequest("GET", "/training_bundles?training_id=1", nil)
+	s.router.ServeHTTP(s.w, req)
+	assert.Equal(s.T(), 200, s.w.Code, s.w.Body.String())
+	assert.JSONEqf(s.T(), fmt.Sprintf(`[{"id":%d,"networkId":1,"games":2,"size":10,"url":"/training_bundle/%d","indexUrl":"/training_bundle/%d/index"}]`, bundle.ID, bundle.ID, bundle.ID), s.w.Body.String(), "Body incorrect")
+
+	// The games are in a random order, at the offsets of the index.
+	s.w = httptest.NewRecorder()
+	req, _ = http.NewRequest("GET", fmt.Sprintf("/training_bundle/%d/index", bundle.ID), nil)
+	s.router.ServeHTTP(s.w, req)
+	assert.Equal(s.T(), 200, s.w.Code, s.w.Body.String())
+	assert.Equal(s.T(), "0 5\n5 5\n", s.w.Body.String())
+
+	s.w = httptest.NewRecorder()
+	req, _ = http.NewRequest("GET", fmt.Sprintf("/training_bundle/%d", bundle.ID), nil)
+	s.router.ServeHTTP(s.w, req)
+	assert.Equal(s.T(), 200, s.w.Code, s.w.Body.String())
+	body := s.w.Body.String()
+	assert.True(s.T(), body == "game0game1" || body == "game1game0", body)
+
+	s.w = httptest.NewRecorder()
+	req, _ = http.NewRequest("GET", fmt.Sprintf("/training_bundle/%d", bundle.ID), nil)
+	req.Header.Set("Range", "bytes=5-9")
+	s.router.ServeHTTP(s.w, req)
+	assert.Equal(s.T(), 206, s.w.Code, s.w.Body.String())
+	assert.Equal(s.T(), body[5:], s.w.Body.String())
+}
+
 func uploadTestNetwork(s *StoreSuite, contentString string, networkId int) {
 	s.w = httptest.NewRecorder()
 	content := []byte(contentString)
@@ -200,6 +332,7 @@ func uploadTestNetwork(s *StoreSuite, contentString string, networkId int) {
 	zw := gzip.NewWriterLevel(&buf, BestCompression)
 	zw.Write(content)
 	zw.Close()
+	compressed := append([]byte{}, buf.Bytes()...)
 
 	extraParams := map[string]string{
 		"training_id": "1",
@@ -253,6 +386,15 @@ func uploadTestNetwork(s *StoreSuite, contentString string, networkId int) {
 		log.Fatal(err)
 	}
 	assert.Equal(s.T(), contentString, buf.String(), "Contents don't match")
+
+	// A partial download resumes where it stopped.
+	s.w = httptest.NewRecorder()
+	req, _ = http.NewRequest("GET", fmt.Sprintf("/cached/network/sha/%x", sha), nil)
+	req.Header.Set("Range", "bytes=10-")
+	req.Header.Set("If-Range", fmt.Sprintf(`"%x"`, sha))
+	s.router.ServeHTTP(s.w, req)
+	assert.Equal(s.T(), 206, s.w.Code, s.w.Body.String())
+	assert.Equal(s.T(), compressed[10:], s.w.Body.Bytes(), "Contents don't match")
 }
 
 func (s *StoreSuite) TestUploadNetwork() {
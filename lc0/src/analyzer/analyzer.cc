@@ -25,10 +25,13 @@
 #include "utils/string.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace lczero {
@@ -37,6 +40,7 @@ const char* kTsvReportStr = "Filename of the tab-separated report file";
 const char* kTxtReportStr = "Filename of the text report file";
 const char* kMovesStr = "Moves in UCI format, space separated";
 const char* kMovesToAnalyzeStr = "Number of (last) moves to analyze";
+const char* kParallelismStr = "Number of positions to analyze in parallel";
 const char* kNodesStr = "(comma separated) How many nodes to calculate";
 const char* kTrainExamplesStr =
     "How many examples of training data to generate";
@@ -57,6 +61,7 @@ Analyzer::Analyzer() {
   options_parser_.Add<StringOption>(kTxtReportStr, "txt-report");
   options_parser_.Add<StringOption>(kMovesStr, "moves");
   options_parser_.Add<IntOption>(kMovesToAnalyzeStr, 1, 999, "num-moves") = 4;
+  options_parser_.Add<IntOption>(kParallelismStr, 1, 256, "parallelism") = 4;
   options_parser_.Add<StringOption>(kNodesStr, "nodes-list") =
       "10,50,100,200,400,600,800,1200,1600,5000,10000";
   options_parser_.Add<IntOption>(kTrainExamplesStr, 1, 999,
@@ -87,26 +92,29 @@ void Analyzer::GatherStats(Table3d* table, const Node* root_node,
   const float parent_q =
       -root_node->GetQ(0) - play_options_->Get<float>(Search::kFpuReductionStr);
 
-  for (Node* node : root_node->Children()) {
-    const auto n = node->GetNStarted();
+  for (const auto& edge : root_node->Edges()) {
+    const auto n = edge.GetNStarted();
     total_n += n;
-    const auto u = factor * node->GetU();
-    const auto q = node->GetQ(parent_q);
-    const auto move = node->GetMove(flip).as_string();
+    const auto u = factor * edge.GetU();
+    const auto q = edge.GetQ(parent_q);
+    const auto move = edge.GetMove(flip).as_string();
     table->Add3dVal(col, move, "N", std::to_string(n));
     table->Add3dVal(col, move, "U", std::to_string(u));
     table->Add3dVal(col, move, "Q", std::to_string(q));
     table->Add3dVal(col, move, "U+Q", std::to_string(u + q));
   }
 
-  for (Node* node : root_node->Children()) {
-    auto n = node->GetNStarted();
-    table->Add3dVal(col, node->GetMove(flip).as_string(), "N%",
+  for (const auto& edge : root_node->Edges()) {
+    auto n = edge.GetNStarted();
+    table->Add3dVal(col, edge.GetMove(flip).as_string(), "N%",
                     std::to_string(static_cast<double>(n) / total_n));
   }
 }
 
-void Analyzer::RunOnePosition(const std::vector<Move>& moves) {
+void Analyzer::RunOnePosition(const std::vector<Move>& moves,
+                              Report* report) {
+  // Not shared with the other positions, the cache key is a shorter history
+  // than the network input, so hits would depend on the order of work.
   NNCache cache(200000);
   NodeTree tree;
   tree.ResetToPosition(ChessBoard::kStartingFen, moves);
@@ -117,16 +125,20 @@ void Analyzer::RunOnePosition(const std::vector<Move>& moves) {
   Table3d table;
   std::vector<std::string> cols;
 
-  // Run search in increasing number of nodes.
+  // Run search in increasing number of nodes. The visits limit counts the
+  // visits of the root, so every search continues the tree of the previous
+  // one.
   for (int nodes : nodeses) {
-    WriteToLog("Nodes: " + std::to_string(nodes));
+    report->log.push_back("Nodes: " + std::to_string(nodes));
     SearchLimits limits;
     limits.visits = nodes;
 
     Search search(tree, network_.get(),
-                  std::bind(&Analyzer::OnBestMove, this, std::placeholders::_1),
-                  std::bind(&Analyzer::OnInfo, this, std::placeholders::_1),
-                  limits, *play_options_, &cache);
+                  std::bind(&Analyzer::OnBestMove, this, std::placeholders::_1,
+                            report),
+                  std::bind(&Analyzer::OnInfo, this, std::placeholders::_1,
+                            report),
+                  limits, *play_options_, &cache, nullptr);
 
     search.RunBlocking(1);
 
@@ -137,25 +149,26 @@ void Analyzer::RunOnePosition(const std::vector<Move>& moves) {
   }
 
   // Fetch MCTS-agnostic per-move stats P and V.
-  std::vector<const Node*> nodes;
-  for (Node* iter : tree.GetCurrentHead()->Children()) {
-    nodes.emplace_back(iter);
+  std::vector<EdgeAndNode> edges;
+  for (const auto& edge : tree.GetCurrentHead()->Edges()) {
+    edges.emplace_back(edge);
   }
-  std::sort(nodes.begin(), nodes.end(), [](const Node* a, const Node* b) {
-    return a->GetNStarted() > b->GetNStarted();
-  });
+  std::sort(edges.begin(), edges.end(),
+            [](const EdgeAndNode& a, const EdgeAndNode& b) {
+              return a.GetNStarted() > b.GetNStarted();
+            });
   std::vector<std::string> rows;
-  for (const Node* node : nodes) {
-    auto move = node->GetMove(tree.IsBlackToMove()).as_string();
+  for (const auto& edge : edges) {
+    auto move = edge.GetMove(tree.IsBlackToMove()).as_string();
     rows.push_back(move);
-    table.AddRowVal(move, "P", std::to_string(node->GetP()));
-    table.AddRowVal(move, "V", std::to_string(node->GetV()));
+    table.AddRowVal(move, "P", std::to_string(edge.GetP()));
+    table.AddRowVal(move, "V", std::to_string(edge.GetV()));
   }
 
   // Dump table to log.
   auto lines = table.RenderTable(cols, rows, {"N", "N%", "U", "Q", "U+Q"},
                                  {"P", "V"}, {"bestmove"});
-  for (const auto& line : lines) WriteToTsvLog(line);
+  report->tsv.insert(report->tsv.end(), lines.begin(), lines.end());
 }
 
 void Analyzer::Run() {
@@ -178,28 +191,52 @@ void Analyzer::Run() {
   std::vector<Move> moves;
   for (const auto& move : moves_str) moves.emplace_back(move);
 
+  // The positions to analyze, each with its report started.
+  std::vector<std::vector<Move>> positions;
+  std::vector<Report> reports;
   for (int i = 0; i < play_options_->Get<int>(kMovesToAnalyzeStr); ++i) {
-    // Write position to logs.
-    std::string initial_pos;
+    positions.push_back(moves);
+    reports.emplace_back();
     if (moves_str.empty()) {
-      WriteToLog("Position: startpos");
-      WriteToTsvLog({"Startpos."});
+      reports.back().log.push_back("Position: startpos");
+      reports.back().tsv.push_back({"Startpos."});
     } else {
-      WriteToLog("Position: moves " + StrJoin(moves_str));
-      WriteToTsvLog({"Moves " + StrJoin(moves_str)});
+      reports.back().log.push_back("Position: moves " + StrJoin(moves_str));
+      reports.back().tsv.push_back({"Moves " + StrJoin(moves_str)});
     }
-
-    // Run Mcts at different depths.
-    RunOnePosition(moves);
-
-    // Run training several times.
-
     if (moves.empty()) break;
     moves.pop_back();
     moves_str.pop_back();
-    WriteToTsvLog({});
   }
 
+  // Run Mcts at different depths, for several positions at a time on the same
+  // network. The reports are written in order, as soon as the positions
+  // before them are done.
+  std::atomic<size_t> next_position{0};
+  std::mutex mutex;
+  std::vector<bool> done(positions.size());
+  size_t next_report = 0;
+  const auto worker = [&]() {
+    for (size_t i = next_position++; i < positions.size();
+         i = next_position++) {
+      RunOnePosition(positions[i], &reports[i]);
+      std::lock_guard<std::mutex> lock(mutex);
+      done[i] = true;
+      for (; next_report < positions.size() && done[next_report];
+           ++next_report) {
+        for (const auto& line : reports[next_report].log) WriteToLog(line);
+        for (const auto& line : reports[next_report].tsv) WriteToTsvLog(line);
+        if (!positions[next_report].empty()) WriteToTsvLog({});
+        reports[next_report] = Report();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  const int parallelism = std::min<int>(
+      play_options_->Get<int>(kParallelismStr), positions.size());
+  for (int i = 0; i < parallelism; ++i) threads.emplace_back(worker);
+  for (auto& thread : threads) thread.join();
+
   // DumpFlags();
 }
 
@@ -240,11 +277,11 @@ void Analyzer::WriteToTsvLog(const std::vector<std::string>& line) const {
   tsvlog_ << std::endl;
 }
 
-void Analyzer::OnBestMove(const BestMoveInfo& move) const {
-  WriteToLog("BestMove: " + move.bestmove.as_string());
+void Analyzer::OnBestMove(const BestMoveInfo& move, Report* report) const {
+  report->log.push_back("BestMove: " + move.bestmove.as_string());
 }
 
-void Analyzer::OnInfo(const ThinkingInfo& info) const {
+void Analyzer::OnInfo(const ThinkingInfo& info, Report* report) const {
   std::string res = "Info";
   if (info.depth >= 0) res += " depth " + std::to_string(info.depth);
   if (info.seldepth >= 0) res += " seldepth " + std::to_string(info.seldepth);
@@ -258,7 +295,7 @@ void Analyzer::OnInfo(const ThinkingInfo& info) const {
     for (const auto& move : info.pv) res += " " + move.as_string();
   }
   if (!info.comment.empty()) res += " string " + info.comment;
-  WriteToLog(res);
+  report->log.push_back(res);
 }
 
 }  // namespace lczero
\ No newline at end of file
@@ -19,6 +19,8 @@
 #pragma once
 
 #include <fstream>
+#include <string>
+#include <vector>
 #include "analyzer/table.h"
 #include "chess/board.h"
 #include "chess/callbacks.h"
@@ -34,14 +36,21 @@ class Analyzer {
   void Run();
 
  private:
-  void RunOnePosition(const std::vector<Move>& position);
+  // What the analysis of a position writes, kept until the positions before
+  // it are written, as positions are analyzed in parallel.
+  struct Report {
+    std::vector<std::string> log;
+    std::vector<std::vector<std::string>> tsv;
+  };
+
+  void RunOnePosition(const std::vector<Move>& position, Report* report);
 
   void WriteToLog(const std::string& line) const;
   void WriteToTsvLog(const std::vector<std::string>& line) const;
 
   void InitializeNetwork();
-  void OnBestMove(const BestMoveInfo& move) const;
-  void OnInfo(const ThinkingInfo& info) const;
+  void OnBestMove(const BestMoveInfo& move, Report* report) const;
+  void OnInfo(const ThinkingInfo& info, Report* report) const;
   void GatherStats(Table3d* table, const Node* root_node, std::string& col,
                    bool flip);
 
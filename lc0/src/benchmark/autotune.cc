@@ -0,0 +1,322 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "benchmark/autotune.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include "mcts/search.h"
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "utils/string.h"
+
+namespace lczero {
+namespace {
+const char* kWeightsStr = "Network weights file path";
+const char* kNnBackendStr = "NN backend to use";
+const char* kNnBackendOptionsStr = "NN backend parameters";
+const char* kThreadsStr = "(comma separated) Search threads to try";
+const char* kMinibatchSizesStr = "(comma separated) Minibatch sizes to try";
+const char* kMaxPrefetchesStr = "(comma separated) Max prefetches to try";
+const char* kMuxThreadsStr =
+    "(comma separated) Threads per multiplexed backend to try";
+const char* kMuxMaxBatchesStr =
+    "(comma separated) Max batches of multiplexed backends to try";
+const char* kMoveTimeStr = "Milliseconds to search every position";
+const char* kMaxLatencyStr = "Largest p99 NN latency to accept in ms, 0 any";
+const char* kResultsFileStr = "File to save the best settings into";
+
+const char* kAutoDiscover = "<autodiscover>";
+const char* kMuxBackend = "multiplexing";
+
+// The opening, a middlegame and an endgame, as their trees grow differently.
+const char* kPositions[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP3PPP/R2QKB1R w KQ - 0 9",
+    "8/5pk1/6p1/3R4/7P/6P1/r4PK1/8 w - - 0 40",
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Times the computations of the network the search uses.
+class TimedComputation : public NetworkComputation {
+ public:
+  TimedComputation(std::unique_ptr<NetworkComputation> parent,
+                   std::vector<double>* latencies_ms, std::mutex* mutex)
+      : parent_(std::move(parent)),
+        latencies_ms_(latencies_ms),
+        mutex_(mutex) {}
+
+  void AddInput(InputPlanes&& input) override {
+    parent_->AddInput(std::move(input));
+  }
+  InputPlanesRef AddInputInPlace() override {
+    return parent_->AddInputInPlace();
+  }
+  void SetLegalMoves(const std::uint16_t* move_ids, int count) override {
+    parent_->SetLegalMoves(move_ids, count);
+  }
+  void ComputeBlocking() override {
+    const auto start = Clock::now();
+    parent_->ComputeBlocking();
+    const std::chrono::duration<double, std::milli> elapsed =
+        Clock::now() - start;
+    std::lock_guard<std::mutex> lock(*mutex_);
+    latencies_ms_->push_back(elapsed.count());
+  }
+  int GetBatchSize() const override { return parent_->GetBatchSize(); }
+  float GetQVal(int sample) const override {
+    return parent_->GetQVal(sample);
+  }
+  float GetPVal(int sample, int move_id) const override {
+    return parent_->GetPVal(sample, move_id);
+  }
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    parent_->GetPVals(sample, move_ids, count, out);
+  }
+
+ private:
+  std::unique_ptr<NetworkComputation> parent_;
+  std::vector<double>* const latencies_ms_;
+  std::mutex* const mutex_;
+};
+
+class TimedNetwork : public Network {
+ public:
+  explicit TimedNetwork(std::unique_ptr<Network> parent)
+      : parent_(std::move(parent)) {}
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<TimedComputation>(parent_->NewComputation(),
+                                              &latencies_ms_, &mutex_);
+  }
+
+  void InitThread() override { parent_->InitThread(); }
+
+  // Returns the latencies since the last call.
+  std::vector<double> TakeLatencies() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<double> result;
+    result.swap(latencies_ms_);
+    return result;
+  }
+
+ private:
+  std::unique_ptr<Network> parent_;
+  std::mutex mutex_;
+  std::vector<double> latencies_ms_;
+};
+}  // namespace
+
+Autotune::Autotune() {
+  options_parser_.Add<StringOption>(kWeightsStr, "weights", 'w') =
+      kAutoDiscover;
+  const auto backends = NetworkFactory::Get()->GetBackendsList();
+  options_parser_.Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
+      backends.empty() ? "<none>" : backends[0];
+  options_parser_.Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
+  options_parser_.Add<StringOption>(kThreadsStr, "threads") = "1,2,4";
+  options_parser_.Add<StringOption>(kMinibatchSizesStr, "minibatch-sizes") =
+      "32,64,128,256";
+  options_parser_.Add<StringOption>(kMaxPrefetchesStr, "max-prefetches") =
+      "0,32";
+  options_parser_.Add<StringOption>(kMuxThreadsStr, "mux-threads") = "1,2";
+  options_parser_.Add<StringOption>(kMuxMaxBatchesStr, "mux-max-batches") =
+      "128,256";
+  options_parser_.Add<IntOption>(kMoveTimeStr, 100, 100000, "movetime") =
+      1000;
+  options_parser_.Add<FloatOption>(kMaxLatencyStr, 0, 100000,
+                                   "max-latency") = 0.0f;
+  options_parser_.Add<StringOption>(kResultsFileStr, "results-file") =
+      "lc0-autotune.txt";
+
+  Search::PopulateUciParams(&options_parser_);
+  // Every setting sets these from the lists above.
+  options_parser_.HideOption(Search::kMiniBatchSizeStr);
+  options_parser_.HideOption(Search::kMiniPrefetchBatchStr);
+  // Smart pruning would end the searches early.
+  auto defaults = options_parser_.GetMutableDefaultsOptions();
+  defaults->Set<bool>(Search::kSmartPruningStr, false);
+}
+
+void Autotune::Run() {
+  if (!options_parser_.ProcessAllFlags()) return;
+  const OptionsDict& options = options_parser_.GetOptionsDict();
+
+  std::string net_path = options.Get<std::string>(kWeightsStr);
+  if (net_path == kAutoDiscover) net_path = DiscoveryWeightsFile();
+  weights_ = LoadWeightsFromFile(net_path);
+
+  const bool mux = options.Get<std::string>(kNnBackendStr) == kMuxBackend;
+  std::vector<Setting> settings;
+  for (int threads : ParseIntList(options.Get<std::string>(kThreadsStr))) {
+    for (int minibatch_size :
+         ParseIntList(options.Get<std::string>(kMinibatchSizesStr))) {
+      for (int max_prefetch :
+           ParseIntList(options.Get<std::string>(kMaxPrefetchesStr))) {
+        if (!mux) {
+          settings.push_back({threads, minibatch_size, max_prefetch, 0, 0});
+          continue;
+        }
+        for (int mux_threads :
+             ParseIntList(options.Get<std::string>(kMuxThreadsStr))) {
+          for (int mux_max_batch :
+               ParseIntList(options.Get<std::string>(kMuxMaxBatchesStr))) {
+            settings.push_back({threads, minibatch_size, max_prefetch,
+                                mux_threads, mux_max_batch});
+          }
+        }
+      }
+    }
+  }
+
+  const float max_latency_ms = options.Get<float>(kMaxLatencyStr);
+  const Setting* best = nullptr;
+  Result best_result;
+  for (const auto& setting : settings) {
+    if (setting.threads < 1 || setting.minibatch_size < 1 ||
+        setting.max_prefetch < 0) {
+      continue;
+    }
+    const Result result = RunSetting(setting);
+    const bool within_bound =
+        max_latency_ms <= 0.0f || result.p99_latency_ms <= max_latency_ms;
+    std::cout << std::left << std::setw(64) << Flags(setting) << std::right
+              << std::fixed << std::setprecision(0) << std::setw(10)
+              << result.nps << " nps" << std::setprecision(3) << std::setw(10)
+              << result.p99_latency_ms << " ms p99"
+              << (within_bound ? "" : " (too slow)") << std::endl;
+    if (within_bound && result.nps > best_result.nps) {
+      best = &setting;
+      best_result = result;
+    }
+  }
+
+  if (!best) {
+    std::cout << "No setting is within the latency bound." << std::endl;
+    return;
+  }
+  // The backend and its options stand for the device.
+  const std::string key = options.Get<std::string>(kNnBackendStr) + "(" +
+                          options.Get<std::string>(kNnBackendOptionsStr) +
+                          ") " + std::to_string(weights_.residual.size()) +
+                          "x" + std::to_string(weights_.input.biases.size());
+  std::cout << "Best: " << Flags(*best) << std::endl;
+  Save(key, Flags(*best));
+}
+
+Autotune::Result Autotune::RunSetting(const Setting& setting) {
+  const OptionsDict& options = options_parser_.GetOptionsDict();
+  OptionsDict network_options =
+      OptionsDict::FromString(BackendOptions(setting), &options);
+  TimedNetwork network(NetworkFactory::Get()->Create(
+      options.Get<std::string>(kNnBackendStr), weights_, network_options));
+
+  OptionsDict search_options(&options);
+  search_options.Set<int>(Search::kMiniBatchSizeStr, setting.minibatch_size);
+  search_options.Set<int>(Search::kMiniPrefetchBatchStr, setting.max_prefetch);
+
+  const auto search_position = [&](const std::string& fen, int time_ms) {
+    NNCache cache(200000);
+    NodeTree tree;
+    tree.ResetToPosition(fen, {});
+    SearchLimits limits;
+    limits.time_ms = time_ms;
+    int64_t nodes = 0;
+    Search search(tree, &network, [](const BestMoveInfo&) {},
+                  [&nodes](const ThinkingInfo& info) {
+                    if (info.nodes > nodes) nodes = info.nodes;
+                  },
+                  limits, search_options, &cache, nullptr);
+    search.RunBlocking(setting.threads);
+    return nodes;
+  };
+
+  // The first batches of a backend may allocate or tune.
+  search_position(kPositions[0], 100);
+  network.TakeLatencies();
+
+  const int time_ms = options.Get<int>(kMoveTimeStr);
+  int64_t nodes = 0;
+  const auto start = Clock::now();
+  for (const char* fen : kPositions) nodes += search_position(fen, time_ms);
+  const std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  Result result;
+  result.nps = nodes / elapsed.count();
+  auto latencies_ms = network.TakeLatencies();
+  if (!latencies_ms.empty()) {
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+    result.p99_latency_ms = latencies_ms[std::min<size_t>(
+        latencies_ms.size() * 0.99, latencies_ms.size() - 1)];
+  }
+  return result;
+}
+
+std::string Autotune::BackendOptions(const Setting& setting) {
+  const std::string options = options_parser_.GetOptionsDict().Get<std::string>(
+      kNnBackendOptionsStr);
+  if (setting.mux_threads == 0) return options;
+  // The backends of the multiplexer take these from the top level unless
+  // they set them.
+  return "threads=" + std::to_string(setting.mux_threads) +
+         ",max_batch=" + std::to_string(setting.mux_max_batch) +
+         (options.empty() ? "" : "," + options);
+}
+
+std::string Autotune::Flags(const Setting& setting) {
+  std::string flags = "--threads=" + std::to_string(setting.threads) +
+                      " --minibatch-size=" +
+                      std::to_string(setting.minibatch_size) +
+                      " --max-prefetch=" + std::to_string(setting.max_prefetch);
+  if (setting.mux_threads > 0) {
+    flags += " --backend-opts=" + BackendOptions(setting);
+  }
+  return flags;
+}
+
+void Autotune::Save(const std::string& key, const std::string& flags) {
+  const std::string filename =
+      options_parser_.GetOptionsDict().Get<std::string>(kResultsFileStr);
+  // Lines are "key: flags", one per backend and network size.
+  std::vector<std::string> lines;
+  {
+    std::ifstream in(filename);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.compare(0, key.size() + 1, key + ":") != 0) {
+        lines.push_back(line);
+      }
+    }
+  }
+  lines.push_back(key + ": " + flags);
+  std::ofstream out(filename);
+  for (const auto& line : lines) out << line << std::endl;
+  if (!out) {
+    std::cerr << "Cannot write " << filename << std::endl;
+    return;
+  }
+  std::cout << "Saved to " << filename << std::endl;
+}
+
+}  // namespace lczero
@@ -0,0 +1,66 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "neural/network.h"
+#include "utils/optionsdict.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+
+// Runs short timed searches with every combination of search threads,
+// minibatch size, prefetch and, for the multiplexing backend, its threads
+// and max batch, and picks the one with the best nps whose NN latency stays
+// within a bound. The result is saved in a file under the backend and the
+// network size, as the best values depend on both.
+class Autotune {
+ public:
+  Autotune();
+  void Run();
+
+ private:
+  struct Setting {
+    int threads;
+    int minibatch_size;
+    int max_prefetch;
+    // 0 when the backend is not multiplexing.
+    int mux_threads;
+    int mux_max_batch;
+  };
+  struct Result {
+    double nps = 0.0;
+    double p99_latency_ms = 0.0;
+  };
+
+  // Searches the built-in positions with @setting.
+  Result RunSetting(const Setting& setting);
+  // Backend options with the multiplexing parameters of @setting.
+  std::string BackendOptions(const Setting& setting);
+  // Flags which make lc0 use @setting.
+  std::string Flags(const Setting& setting);
+  // Replaces the line of @key in the results file.
+  void Save(const std::string& key, const std::string& flags);
+
+  Weights weights_;
+  OptionsParser options_parser_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,175 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "benchmark/backend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "chess/position.h"
+#include "neural/encoder.h"
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "utils/random.h"
+#include "utils/string.h"
+
+namespace lczero {
+namespace {
+const char* kWeightsStr = "Network weights file path";
+const char* kNnBackendStr = "NN backend to use";
+const char* kNnBackendOptionsStr = "NN backend parameters";
+const char* kBatchSizesStr = "(comma separated) Batch sizes to measure";
+const char* kIterationsStr = "Batches to compute per thread and batch size";
+const char* kThreadsStr = "Threads computing batches at the same time";
+
+const char* kAutoDiscover = "<autodiscover>";
+
+// Encoded positions to take the inputs from.
+const int kNumPositions = 1024;
+// Random games are cut at this ply, as the endgames of random games are not
+// what a search sees.
+const int kMaxGamePly = 80;
+// Batches computed before the timing starts, for backends which allocate or
+// tune on the first batch of a size.
+const int kWarmupIterations = 2;
+
+using Clock = std::chrono::steady_clock;
+}  // namespace
+
+BackendBenchmark::BackendBenchmark() {
+  options_parser_.Add<StringOption>(kWeightsStr, "weights", 'w') =
+      kAutoDiscover;
+  const auto backends = NetworkFactory::Get()->GetBackendsList();
+  options_parser_.Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
+      backends.empty() ? "<none>" : backends[0];
+  options_parser_.Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
+  options_parser_.Add<StringOption>(kBatchSizesStr, "batch-sizes") =
+      "1,2,4,8,16,32,64,128,256";
+  options_parser_.Add<IntOption>(kIterationsStr, 1, 100000, "iterations") =
+      50;
+  options_parser_.Add<IntOption>(kThreadsStr, 1, 128, "threads") = 1;
+}
+
+void BackendBenchmark::Run() {
+  if (!options_parser_.ProcessAllFlags()) return;
+  const OptionsDict& options = options_parser_.GetOptionsDict();
+
+  InitializeNetwork();
+  GeneratePositions(kNumPositions);
+
+  auto batch_sizes = ParseIntList(options.Get<std::string>(kBatchSizesStr));
+  std::sort(batch_sizes.begin(), batch_sizes.end());
+  const int iterations = options.Get<int>(kIterationsStr);
+  const int threads = options.Get<int>(kThreadsStr);
+
+  std::cout << std::setw(6) << "batch" << std::setw(12) << "evals/s"
+            << std::setw(12) << "p50 ms" << std::setw(12) << "p99 ms"
+            << std::endl;
+  for (int batch_size : batch_sizes) {
+    if (batch_size < 1) continue;
+    RunBatchSize(batch_size, iterations, threads);
+  }
+}
+
+void BackendBenchmark::InitializeNetwork() {
+  const OptionsDict& options = options_parser_.GetOptionsDict();
+  std::string net_path = options.Get<std::string>(kWeightsStr);
+  if (net_path == kAutoDiscover) net_path = DiscoveryWeightsFile();
+  Weights weights = LoadWeightsFromFile(net_path);
+
+  OptionsDict network_options = OptionsDict::FromString(
+      options.Get<std::string>(kNnBackendOptionsStr), &options);
+
+  network_ = NetworkFactory::Get()->Create(
+      options.Get<std::string>(kNnBackendStr), weights, network_options);
+}
+
+void BackendBenchmark::GeneratePositions(int count) {
+  while (static_cast<int>(positions_.size()) < count) {
+    ChessBoard board;
+    int no_capture_ply;
+    int full_moves;
+    board.SetFromFen(ChessBoard::kStartingFen, &no_capture_ply, &full_moves);
+    PositionHistory history;
+    history.Reset(board, no_capture_ply, full_moves * 2 - 2);
+
+    while (static_cast<int>(positions_.size()) < count &&
+           history.GetLength() < kMaxGamePly &&
+           history.ComputeGameResult() == GameResult::UNDECIDED) {
+      const auto moves = history.Last().GetBoard().GenerateLegalMoves();
+      history.Append(moves[Random::Get().GetInt(0, moves.size() - 1)]);
+      positions_.push_back(EncodePositionForNN(history));
+    }
+  }
+}
+
+void BackendBenchmark::RunBatchSize(int batch_size, int iterations,
+                                    int threads) {
+  std::mutex mutex;
+  std::vector<double> latencies_ms;
+  latencies_ms.reserve(iterations * threads);
+
+  const auto worker = [&](int thread_idx) {
+    std::vector<double> thread_latencies_ms;
+    // Threads start at different positions, wrapped like the rest.
+    int next_position = (thread_idx * batch_size) % positions_.size();
+    for (int i = -kWarmupIterations; i < iterations; ++i) {
+      auto computation = network_->NewComputation();
+      for (int j = 0; j < batch_size; ++j) {
+        computation->AddInput(InputPlanes(positions_[next_position]));
+        next_position = (next_position + 1) % positions_.size();
+      }
+      const auto start = Clock::now();
+      computation->ComputeBlocking();
+      const std::chrono::duration<double, std::milli> elapsed =
+          Clock::now() - start;
+      if (i >= 0) thread_latencies_ms.push_back(elapsed.count());
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    latencies_ms.insert(latencies_ms.end(), thread_latencies_ms.begin(),
+                        thread_latencies_ms.end());
+  };
+
+  // The warmup batches are part of the wall time, so throughput is computed
+  // from the latencies instead: every thread is busy for its sum.
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; ++i) workers.emplace_back(worker, i);
+  for (auto& thread : workers) thread.join();
+
+  double busy_ms = 0.0;
+  for (double latency : latencies_ms) busy_ms += latency;
+  std::sort(latencies_ms.begin(), latencies_ms.end());
+  const auto percentile = [&](double p) {
+    return latencies_ms[std::min<size_t>(latencies_ms.size() * p,
+                                         latencies_ms.size() - 1)];
+  };
+  const double evals_per_second =
+      busy_ms > 0.0 ? 1000.0 * batch_size * latencies_ms.size() * threads /
+                          busy_ms
+                    : 0.0;
+
+  std::cout << std::setw(6) << batch_size << std::fixed << std::setprecision(0)
+            << std::setw(12) << evals_per_second << std::setprecision(3)
+            << std::setw(12) << percentile(0.5) << std::setw(12)
+            << percentile(0.99) << std::endl;
+}
+
+}  // namespace lczero
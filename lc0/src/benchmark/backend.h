@@ -0,0 +1,49 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "neural/network.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+
+// Measures how fast a backend computes batches of different sizes, to pick
+// minibatch and backend batch sizes for a machine.
+class BackendBenchmark {
+ public:
+  BackendBenchmark();
+  void Run();
+
+ private:
+  void InitializeNetwork();
+  // Encodes positions from random games, so that the inputs look like the
+  // ones of a search.
+  void GeneratePositions(int count);
+  // Computes @iterations batches of @batch_size in every of @threads threads
+  // and prints the throughput and latencies.
+  void RunBatchSize(int batch_size, int iterations, int threads);
+
+  std::unique_ptr<Network> network_;
+  std::vector<InputPlanes> positions_;
+  OptionsParser options_parser_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,191 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Times the chess core on the perft positions from
+// https://chessprogramming.wikispaces.com/Perft+Results
+//  * perft on ChessBoard: GenerateLegalMoves() and ApplyMove().
+//  * perft on PositionHistory: the same plus Position construction and
+//    repetition detection, as in the search.
+//  * EncodePositionForNN() for every position of a shallower perft, without
+//    the time of the perft itself.
+// Exits with an error if a node count is wrong.
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "chess/board.h"
+#include "chess/position.h"
+#include "neural/encoder.h"
+
+namespace lczero {
+namespace {
+
+struct BenchmarkPosition {
+  const char* name;
+  const char* fen;
+  int depth;
+  uint64_t nodes;
+};
+
+const BenchmarkPosition kPositions[] = {
+    {"startpos", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 5,
+     4865609},
+    {"kiwipete",
+     "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 1 1", 4,
+     4085603},
+    {"position3", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 1 1", 6, 11030083},
+    {"position4",
+     "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1", 5,
+     15833292},
+    {"position5", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4,
+     2103487},
+    {"position6",
+     "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+     4, 3894594},
+};
+
+// Encodes the positions this much shallower than the perft.
+const int kEncodeDepthReduction = 1;
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+uint64_t BoardPerft(const ChessBoard& board, int depth) {
+  if (depth == 0) return 1;
+  uint64_t total = 0;
+  for (const auto& move : board.GenerateLegalMoves()) {
+    ChessBoard new_board = board;
+    new_board.ApplyMove(move);
+    new_board.Mirror();
+    total += BoardPerft(new_board, depth - 1);
+  }
+  return total;
+}
+
+uint64_t HistoryPerft(PositionHistory* history, int depth) {
+  if (depth == 0) return 1;
+  uint64_t total = 0;
+  for (const auto& move : history->Last().GetBoard().GenerateLegalMoves()) {
+    history->Append(move);
+    total += HistoryPerft(history, depth - 1);
+    history->Pop();
+  }
+  return total;
+}
+
+// Visits every position up to @depth, encoding them if @planes are given.
+// Returns how many.
+uint64_t EncodeTree(PositionHistory* history, int depth,
+                    InputPlanesRef planes) {
+  if (planes) EncodePositionForNN(*history, planes);
+  if (depth == 0) return 1;
+  uint64_t total = 1;
+  for (const auto& move : history->Last().GetBoard().GenerateLegalMoves()) {
+    history->Append(move);
+    total += EncodeTree(history, depth - 1, planes);
+    history->Pop();
+  }
+  return total;
+}
+
+void Report(const char* name, const char* what, uint64_t count,
+            double seconds, bool per_second) {
+  std::cout << std::left << std::setw(10) << name << ' ' << std::setw(14)
+            << what << std::right << std::setw(10) << count << ' '
+            << std::fixed << std::setprecision(3) << std::setw(8) << seconds
+            << " s ";
+  if (per_second) {
+    std::cout << std::setw(10) << static_cast<uint64_t>(count / seconds)
+              << " nodes/s\n";
+  } else {
+    std::cout << std::setprecision(1) << std::setw(10)
+              << seconds * 1e9 / count << " ns/position\n";
+  }
+}
+
+int Run() {
+  bool ok = true;
+  uint64_t board_nodes = 0, history_nodes = 0, encoded = 0;
+  double board_seconds = 0, history_seconds = 0, encode_seconds = 0;
+  std::vector<uint64_t> masks(kInputPlanes);
+  std::vector<float> values(kInputPlanes);
+  const InputPlanesRef planes{masks.data(), values.data()};
+
+  for (const auto& position : kPositions) {
+    ChessBoard board;
+    int no_capture_ply;
+    int full_moves;
+    board.SetFromFen(position.fen, &no_capture_ply, &full_moves);
+    PositionHistory history;
+    history.Reset(board, no_capture_ply,
+                  full_moves * 2 - (board.flipped() ? 1 : 2));
+
+    auto start = Clock::now();
+    uint64_t nodes = BoardPerft(board, position.depth);
+    double seconds = SecondsSince(start);
+    Report(position.name, "board perft", nodes, seconds, true);
+    board_nodes += nodes;
+    board_seconds += seconds;
+    if (nodes != position.nodes) {
+      std::cerr << position.name << ": board perft " << position.depth
+                << " gives " << nodes << " nodes, expected " << position.nodes
+                << '\n';
+      ok = false;
+    }
+
+    start = Clock::now();
+    nodes = HistoryPerft(&history, position.depth);
+    seconds = SecondsSince(start);
+    Report(position.name, "history perft", nodes, seconds, true);
+    history_nodes += nodes;
+    history_seconds += seconds;
+    if (nodes != position.nodes) {
+      std::cerr << position.name << ": history perft " << position.depth
+                << " gives " << nodes << " nodes, expected " << position.nodes
+                << '\n';
+      ok = false;
+    }
+
+    // Without the time it takes to walk the tree.
+    const int encode_depth = position.depth - kEncodeDepthReduction;
+    start = Clock::now();
+    EncodeTree(&history, encode_depth, {nullptr, nullptr});
+    const double walk_seconds = SecondsSince(start);
+    start = Clock::now();
+    nodes = EncodeTree(&history, encode_depth, planes);
+    seconds = SecondsSince(start) - walk_seconds;
+    Report(position.name, "encode", nodes, seconds, false);
+    encoded += nodes;
+    encode_seconds += seconds;
+  }
+
+  Report("total", "board perft", board_nodes, board_seconds, true);
+  Report("total", "history perft", history_nodes, history_seconds, true);
+  Report("total", "encode", encoded, encode_seconds, false);
+  return ok ? 0 : 1;
+}
+
+}  // namespace
+}  // namespace lczero
+
+int main() { return lczero::Run(); }
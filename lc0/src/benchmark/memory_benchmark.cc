@@ -0,0 +1,150 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Times what the search threads share, from 1 thread up to one per CPU:
+//  * LruCache and ShardedLruCache (the NNCache) lookups, with an insert for
+//    every miss. There are twice as many keys as the cache holds.
+//  * Node::Pool: growing two plies below a root, and releasing them again.
+// Reports the wall clock time per operation of a thread, and how the
+// throughput scales compared to one thread.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chess/board.h"
+#include "mcts/node.h"
+#include "neural/cache.h"
+#include "utils/cache.h"
+
+namespace lczero {
+namespace {
+
+const int kCacheCapacity = 200000;
+const int kCacheOps = 1000000;
+// Priors per cache entry.
+const int kCachedMoves = 35;
+// Trees each thread grows for the node pool.
+const int kTrees = 1000;
+
+using Clock = std::chrono::steady_clock;
+
+// 1, 2, 4, ... threads up to the number of CPUs.
+std::vector<int> ThreadCounts() {
+  const int cpus = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> counts;
+  for (int threads = 1; threads < cpus; threads *= 2) counts.push_back(threads);
+  counts.push_back(cpus);
+  return counts;
+}
+
+// Runs @op(thread) in @threads threads, returns the wall clock time.
+double RunThreads(int threads, const std::function<void(int)>& op) {
+  std::vector<std::thread> workers;
+  const auto start = Clock::now();
+  for (int i = 0; i < threads; ++i) workers.emplace_back(op, i);
+  for (auto& worker : workers) worker.join();
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void Report(const char* name, int threads, double ns_per_op,
+            double single_thread_ns) {
+  std::cout << std::left << std::setw(18) << name << std::right
+            << std::setw(4) << threads << " threads " << std::fixed
+            << std::setprecision(1) << std::setw(8) << ns_per_op
+            << " ns/op, scaling " << std::setprecision(2)
+            << threads * single_thread_ns / ns_per_op << '\n';
+}
+
+// @lookup(cache, key) returns whether the key was found, unpinning it.
+template <typename Cache, typename Lookup>
+void BenchmarkCache(const char* name, Lookup lookup) {
+  double single_thread_ns = 0;
+  for (int threads : ThreadCounts()) {
+    Cache cache(kCacheCapacity);
+    const double seconds = RunThreads(threads, [&](int thread) {
+      std::mt19937_64 rng(thread + 1);
+      std::uniform_int_distribution<uint64_t> keys(0, 2 * kCacheCapacity);
+      for (int i = 0; i < kCacheOps; ++i) {
+        const uint64_t key = keys(rng);
+        if (lookup(&cache, key)) continue;
+        cache.Insert(key, std::make_unique<CachedNNRequest>(kCachedMoves));
+      }
+    });
+    const double ns = seconds * 1e9 / kCacheOps;
+    if (threads == 1) single_thread_ns = ns;
+    Report(name, threads, ns, single_thread_ns);
+  }
+}
+
+void BenchmarkNodePool() {
+  ChessBoard board;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  const MoveList moves = board.GenerateLegalMoves();
+  const int nodes_per_tree = moves.size() + moves.size() * moves.size();
+
+  double single_thread_ns = 0;
+  for (int threads : ThreadCounts()) {
+    const double seconds = RunThreads(threads, [&](int) {
+      NodeTree tree;
+      tree.ResetToPosition(ChessBoard::kStartingFen, {});
+      Node* root = tree.GetCurrentHead();
+      root->CreateEdges(moves);
+      for (int i = 0; i < kTrees; ++i) {
+        for (const auto& edge : root->Edges()) {
+          // The moves don't matter to the pool.
+          Node* child = root->GetOrCreateChild(edge.edge());
+          child->CreateEdges(moves);
+          for (const auto& grandchild : child->Edges()) {
+            child->GetOrCreateChild(grandchild.edge());
+          }
+        }
+        // Frees the nodes and their edges in the background, like when the
+        // search moves on.
+        root->ReleaseChildNodes();
+      }
+    });
+    const double ns = seconds * 1e9 / (kTrees * nodes_per_tree);
+    if (threads == 1) single_thread_ns = ns;
+    Report("Node::Pool", threads, ns, single_thread_ns);
+  }
+}
+
+void Run() {
+  using Cache = LruCache<uint64_t, CachedNNRequest>;
+  BenchmarkCache<Cache>("LruCache", [](Cache* cache, uint64_t key) {
+    LruCacheLock<uint64_t, CachedNNRequest> lock(cache, key);
+    return static_cast<bool>(lock);
+  });
+  BenchmarkCache<NNCache>("ShardedLruCache", [](NNCache* cache, uint64_t key) {
+    NNCacheLock lock(cache, key);
+    return static_cast<bool>(lock);
+  });
+  BenchmarkNodePool();
+}
+
+}  // namespace
+}  // namespace lczero
+
+int main() { lczero::Run(); }
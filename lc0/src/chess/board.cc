@@ -22,11 +22,16 @@
 #include <cstdlib>
 #include <cstring>
 #include <sstream>
+#include <vector>
+#include "utils/bititer.h"
 #include "utils/exception.h"
 
 #ifdef _MSC_VER
 #include <nmmintrin.h>
 #endif
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 namespace lczero {
 
@@ -35,6 +40,95 @@ using std::string;
 const string ChessBoard::kStartingFen =
     "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
+namespace {
+// The fields of the board that are hashed square by square.
+enum HashedField {
+  kOurPieces,
+  kTheirPieces,
+  kRooks,
+  kBishops,
+  kPawns,
+  kOurKing,
+  kTheirKing,
+  kHashedFields
+};
+
+// What the field is after Mirror().
+constexpr HashedField MirrorField(HashedField field) {
+  return field == kOurPieces
+             ? kTheirPieces
+             : field == kTheirPieces
+                   ? kOurPieces
+                   : field == kOurKing
+                         ? kTheirKing
+                         : field == kTheirKing ? kOurKing : field;
+}
+
+struct ZobristKeys {
+  // From a fixed seed with splitmix64.
+  constexpr ZobristKeys() {
+    uint64_t state = 0x6c63305a6f627269ULL;
+    for (auto& field : squares) {
+      for (auto& key : field) key = Next(&state);
+    }
+    for (auto& key : castlings) key = Next(&state);
+  }
+  static constexpr uint64_t Next(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t squares[kHashedFields][64] = {};
+  // By bit of Castlings.
+  uint64_t castlings[4] = {};
+};
+
+constexpr ZobristKeys kZobrist;
+
+// Xors the keys of the squares set in @changed into the hashes.
+void XorSquares(HashedField field, uint64_t changed, uint64_t* hash,
+                uint64_t* mirrored_hash) {
+  const HashedField mirrored_field = MirrorField(field);
+  for (auto square : IterateBits(changed)) {
+    *hash ^= kZobrist.squares[field][square];
+    *mirrored_hash ^= kZobrist.squares[mirrored_field][square ^ 0b111000];
+  }
+}
+
+uint64_t SquareBit(BoardSquare square) { return 1ULL << square.as_int(); }
+}  // namespace
+
+void ChessBoard::UpdateHashes(const ChessBoard& before) {
+  XorSquares(kOurPieces, our_pieces_.as_int() ^ before.our_pieces_.as_int(),
+             &hash_, &mirrored_hash_);
+  XorSquares(kTheirPieces,
+             their_pieces_.as_int() ^ before.their_pieces_.as_int(), &hash_,
+             &mirrored_hash_);
+  XorSquares(kRooks, rooks_.as_int() ^ before.rooks_.as_int(), &hash_,
+             &mirrored_hash_);
+  XorSquares(kBishops, bishops_.as_int() ^ before.bishops_.as_int(), &hash_,
+             &mirrored_hash_);
+  XorSquares(kPawns, pawns_.as_int() ^ before.pawns_.as_int(), &hash_,
+             &mirrored_hash_);
+  if (our_king_ != before.our_king_) {
+    XorSquares(kOurKing, SquareBit(our_king_) ^ SquareBit(before.our_king_),
+               &hash_, &mirrored_hash_);
+  }
+  if (their_king_ != before.their_king_) {
+    XorSquares(kTheirKing,
+               SquareBit(their_king_) ^ SquareBit(before.their_king_), &hash_,
+               &mirrored_hash_);
+  }
+  // Mirror() swaps the castlings of the sides, bits 0-1 with bits 2-3.
+  for (auto bit :
+       IterateBits(castlings_.as_int() ^ before.castlings_.as_int())) {
+    hash_ ^= kZobrist.castlings[bit];
+    mirrored_hash_ ^= kZobrist.castlings[bit ^ 2];
+  }
+}
+
 void ChessBoard::Clear() { std::memset(this, 0, sizeof(ChessBoard)); }
 
 void ChessBoard::Mirror() {
@@ -49,6 +143,7 @@ void ChessBoard::Mirror() {
   std::swap(our_king_, their_king_);
   castlings_.Mirror();
   flipped_ = !flipped_;
+  std::swap(hash_, mirrored_hash_);
 }
 
 namespace {
@@ -67,54 +162,6 @@ static const std::pair<int, int> kBishopDirections[] = {
 static const int k00Attackers[] = {4, 5, 6};
 static const int k000Attackers[] = {2, 3, 4};
 
-// Which squares can rook attack from every of squares.
-static const BitBoard kRookAttacks[] = {
-    0x01010101010101FEULL, 0x02020202020202FDULL, 0x04040404040404FBULL,
-    0x08080808080808F7ULL, 0x10101010101010EFULL, 0x20202020202020DFULL,
-    0x40404040404040BFULL, 0x808080808080807FULL, 0x010101010101FE01ULL,
-    0x020202020202FD02ULL, 0x040404040404FB04ULL, 0x080808080808F708ULL,
-    0x101010101010EF10ULL, 0x202020202020DF20ULL, 0x404040404040BF40ULL,
-    0x8080808080807F80ULL, 0x0101010101FE0101ULL, 0x0202020202FD0202ULL,
-    0x0404040404FB0404ULL, 0x0808080808F70808ULL, 0x1010101010EF1010ULL,
-    0x2020202020DF2020ULL, 0x4040404040BF4040ULL, 0x80808080807F8080ULL,
-    0x01010101FE010101ULL, 0x02020202FD020202ULL, 0x04040404FB040404ULL,
-    0x08080808F7080808ULL, 0x10101010EF101010ULL, 0x20202020DF202020ULL,
-    0x40404040BF404040ULL, 0x808080807F808080ULL, 0x010101FE01010101ULL,
-    0x020202FD02020202ULL, 0x040404FB04040404ULL, 0x080808F708080808ULL,
-    0x101010EF10101010ULL, 0x202020DF20202020ULL, 0x404040BF40404040ULL,
-    0x8080807F80808080ULL, 0x0101FE0101010101ULL, 0x0202FD0202020202ULL,
-    0x0404FB0404040404ULL, 0x0808F70808080808ULL, 0x1010EF1010101010ULL,
-    0x2020DF2020202020ULL, 0x4040BF4040404040ULL, 0x80807F8080808080ULL,
-    0x01FE010101010101ULL, 0x02FD020202020202ULL, 0x04FB040404040404ULL,
-    0x08F7080808080808ULL, 0x10EF101010101010ULL, 0x20DF202020202020ULL,
-    0x40BF404040404040ULL, 0x807F808080808080ULL, 0xFE01010101010101ULL,
-    0xFD02020202020202ULL, 0xFB04040404040404ULL, 0xF708080808080808ULL,
-    0xEF10101010101010ULL, 0xDF20202020202020ULL, 0xBF40404040404040ULL,
-    0x7F80808080808080ULL};
-// Which squares can bishop attack.
-static const BitBoard kBishopAttacks[] = {
-    0x8040201008040200ULL, 0x0080402010080500ULL, 0x0000804020110A00ULL,
-    0x0000008041221400ULL, 0x0000000182442800ULL, 0x0000010204885000ULL,
-    0x000102040810A000ULL, 0x0102040810204000ULL, 0x4020100804020002ULL,
-    0x8040201008050005ULL, 0x00804020110A000AULL, 0x0000804122140014ULL,
-    0x0000018244280028ULL, 0x0001020488500050ULL, 0x0102040810A000A0ULL,
-    0x0204081020400040ULL, 0x2010080402000204ULL, 0x4020100805000508ULL,
-    0x804020110A000A11ULL, 0x0080412214001422ULL, 0x0001824428002844ULL,
-    0x0102048850005088ULL, 0x02040810A000A010ULL, 0x0408102040004020ULL,
-    0x1008040200020408ULL, 0x2010080500050810ULL, 0x4020110A000A1120ULL,
-    0x8041221400142241ULL, 0x0182442800284482ULL, 0x0204885000508804ULL,
-    0x040810A000A01008ULL, 0x0810204000402010ULL, 0x0804020002040810ULL,
-    0x1008050005081020ULL, 0x20110A000A112040ULL, 0x4122140014224180ULL,
-    0x8244280028448201ULL, 0x0488500050880402ULL, 0x0810A000A0100804ULL,
-    0x1020400040201008ULL, 0x0402000204081020ULL, 0x0805000508102040ULL,
-    0x110A000A11204080ULL, 0x2214001422418000ULL, 0x4428002844820100ULL,
-    0x8850005088040201ULL, 0x10A000A010080402ULL, 0x2040004020100804ULL,
-    0x0200020408102040ULL, 0x0500050810204080ULL, 0x0A000A1120408000ULL,
-    0x1400142241800000ULL, 0x2800284482010000ULL, 0x5000508804020100ULL,
-    0xA000A01008040201ULL, 0x4000402010080402ULL, 0x0002040810204080ULL,
-    0x0005081020408000ULL, 0x000A112040800000ULL, 0x0014224180000000ULL,
-    0x0028448201000000ULL, 0x0050880402010000ULL, 0x00A0100804020100ULL,
-    0x0040201008040201ULL};
 // Which squares can knight attack.
 static const BitBoard kKnightAttacks[] = {
     0x0000000000020400ULL, 0x0000000000050800ULL, 0x00000000000A1100ULL,
@@ -171,6 +218,168 @@ static const Move::Promotion kPromotions[] = {
     Move::Promotion::Knight,
 };
 
+int PopCount(uint64_t value) {
+#ifdef _MSC_VER
+  return _mm_popcnt_u64(value);
+#else
+  return __builtin_popcountll(value);
+#endif
+}
+
+// Which squares a rook or a bishop on a square attacks, looked up by the
+// occupied squares which matter for it. The index is computed with PEXT where
+// the compiler may use BMI2, and with multiplication by a magic number
+// otherwise.
+class SliderAttacks {
+ public:
+  SliderAttacks(const std::pair<int, int> (&directions)[4], int table_size)
+      : table_(table_size) {
+    BitBoard* attacks = table_.data();
+    std::vector<BitBoard> occupancies;
+    std::vector<BitBoard> references;
+    for (int square = 0; square < 64; ++square) {
+      Entry& entry = entries_[square];
+      // Pieces on the last square of a line don't block anything.
+      const uint64_t edges =
+          ((0x00000000000000FFULL | 0xFF00000000000000ULL) &
+           ~(0x00000000000000FFULL << (square / 8 * 8))) |
+          ((0x0101010101010101ULL | 0x8080808080808080ULL) &
+           ~(0x0101010101010101ULL << (square % 8)));
+      entry.mask = Slide(square, 0, directions) & ~edges;
+      const int bits = PopCount(entry.mask);
+      entry.shift = 64 - bits;
+      entry.attacks = attacks;
+      attacks += 1 << bits;
+
+      // Enumerate all subsets of the mask.
+      occupancies.clear();
+      references.clear();
+      uint64_t occupied = 0;
+      do {
+        occupancies.push_back(occupied);
+        references.push_back(Slide(square, occupied, directions));
+        occupied = (occupied - entry.mask) & entry.mask;
+      } while (occupied);
+
+#ifdef __BMI2__
+      for (size_t i = 0; i < occupancies.size(); ++i) {
+        entry.attacks[Index(entry, occupancies[i].as_int())] = references[i];
+      }
+#else
+      FindMagic(square, &entry, occupancies, references);
+#endif
+    }
+  }
+
+  BitBoard Get(BoardSquare square, BitBoard occupied) const {
+    const Entry& entry = entries_[square.as_int()];
+    return entry.attacks[Index(entry, occupied.as_int())];
+  }
+
+ private:
+  struct Entry {
+    uint64_t mask;
+    uint64_t magic;
+    BitBoard* attacks;
+    int shift;
+  };
+
+  static unsigned Index(const Entry& entry, uint64_t occupied) {
+#ifdef __BMI2__
+    return _pext_u64(occupied, entry.mask);
+#else
+    return ((occupied & entry.mask) * entry.magic) >> entry.shift;
+#endif
+  }
+
+  // Attacks found by walking from the square until a piece is hit.
+  static uint64_t Slide(int square, uint64_t occupied,
+                        const std::pair<int, int> (&directions)[4]) {
+    uint64_t result = 0;
+    for (const auto& direction : directions) {
+      int row = square / 8 + direction.first;
+      int col = square % 8 + direction.second;
+      while (BoardSquare::IsValid(row, col)) {
+        result |= 1ULL << (row * 8 + col);
+        if (occupied & (1ULL << (row * 8 + col))) break;
+        row += direction.first;
+        col += direction.second;
+      }
+    }
+    return result;
+  }
+
+  // Tries random sparse numbers until one maps every occupancy to a slot
+  // with the right attacks. The generator is seeded by the rank, with seeds
+  // which are known to find the magics after few attempts.
+  static void FindMagic(int square, Entry* entry,
+                        const std::vector<BitBoard>& occupancies,
+                        const std::vector<BitBoard>& references) {
+    static const uint64_t kSeeds[] = {728,   10316, 55013, 32803,
+                                      12281, 15100, 16645, 255};
+    uint64_t seed = kSeeds[square / 8];
+    const auto random = [&seed]() {
+      // xorshift64*
+      seed ^= seed >> 12;
+      seed ^= seed << 25;
+      seed ^= seed >> 27;
+      return seed * 2685821657736338717ULL;
+    };
+    // The attempt in which a slot was last written, to avoid clearing them.
+    std::vector<int> epoch(occupancies.size(), 0);
+    for (int attempt = 1;; ++attempt) {
+      do {
+        entry->magic = random() & random() & random();
+      } while (PopCount((entry->magic * entry->mask) >> 56) < 6);
+      size_t i = 0;
+      for (; i < occupancies.size(); ++i) {
+        const unsigned index = Index(*entry, occupancies[i].as_int());
+        if (epoch[index] < attempt) {
+          epoch[index] = attempt;
+          entry->attacks[index] = references[i];
+        } else if (!(entry->attacks[index] == references[i])) {
+          break;
+        }
+      }
+      if (i == occupancies.size()) return;
+    }
+  }
+
+  Entry entries_[64];
+  std::vector<BitBoard> table_;
+};
+
+const SliderAttacks kRookAttacks(kRookDirections, 0x19000);
+const SliderAttacks kBishopAttacks(kBishopDirections, 0x1480);
+
+// Returns whether @c is on the line (rank, file or diagonal) which goes
+// through @a and @b.
+bool IsOnLine(BoardSquare a, BoardSquare b, BoardSquare c) {
+  return (c.row() - a.row()) * (b.col() - a.col()) ==
+         (c.col() - a.col()) * (b.row() - a.row());
+}
+
+// Returns squares strictly between @from and @to if they are on the same
+// rank, file or diagonal, and an empty board otherwise.
+BitBoard SquaresBetween(BoardSquare from, BoardSquare to) {
+  BitBoard result;
+  int drow = to.row() - from.row();
+  int dcol = to.col() - from.col();
+  if (drow != 0 && dcol != 0 && std::abs(drow) != std::abs(dcol)) {
+    return result;
+  }
+  drow = (drow > 0) - (drow < 0);  // Sign.
+  dcol = (dcol > 0) - (dcol < 0);
+  int row = from.row() + drow;
+  int col = from.col() + dcol;
+  while (row != to.row() || col != to.col()) {
+    result.set(row, col);
+    row += drow;
+    col += dcol;
+  }
+  return result;
+}
+
 }  // namespace
 
 BitBoard ChessBoard::pawns() const { return pawns_ * kPawnMask; }
@@ -238,35 +447,19 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
     // Rook (and queen)
     if (rooks_.get(source)) {
       processed_piece = true;
-      for (const auto& direction : kRookDirections) {
-        auto dst_row = source.row();
-        auto dst_col = source.col();
-        while (true) {
-          dst_row += direction.first;
-          dst_col += direction.second;
-          if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-          const BoardSquare destination(dst_row, dst_col);
-          if (our_pieces_.get(destination)) break;
-          result.emplace_back(source, destination);
-          if (their_pieces_.get(destination)) break;
-        }
+      for (const auto destination :
+           kRookAttacks.Get(source, our_pieces_ + their_pieces_) -
+               our_pieces_) {
+        result.emplace_back(source, destination);
       }
     }
     // Bishop (and queen)
     if (bishops_.get(source)) {
       processed_piece = true;
-      for (const auto& direction : kBishopDirections) {
-        auto dst_row = source.row();
-        auto dst_col = source.col();
-        while (true) {
-          dst_row += direction.first;
-          dst_col += direction.second;
-          if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-          const BoardSquare destination(dst_row, dst_col);
-          if (our_pieces_.get(destination)) break;
-          result.emplace_back(source, destination);
-          if (their_pieces_.get(destination)) break;
-        }
+      for (const auto destination :
+           kBishopAttacks.Get(source, our_pieces_ + their_pieces_) -
+               our_pieces_) {
+        result.emplace_back(source, destination);
       }
     }
     if (processed_piece) continue;
@@ -335,6 +528,13 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
 }
 
 bool ChessBoard::ApplyMove(Move move) {
+  const ChessBoard before = *this;
+  const bool reset_50_moves = MovePieces(move);
+  UpdateHashes(before);
+  return reset_50_moves;
+}
+
+bool ChessBoard::MovePieces(Move move) {
   const auto& from = move.from();
   const auto& to = move.to();
   const auto from_row = from.row();
@@ -446,6 +646,11 @@ bool ChessBoard::ApplyMove(Move move) {
 }
 
 bool ChessBoard::IsUnderAttack(BoardSquare square) const {
+  return IsUnderAttack(square, our_pieces_, their_pieces_);
+}
+
+bool ChessBoard::IsUnderAttack(BoardSquare square, BitBoard ours,
+                               BitBoard theirs) const {
   const int row = square.row();
   const int col = square.col();
   // Check king
@@ -455,150 +660,127 @@ bool ChessBoard::IsUnderAttack(BoardSquare square) const {
     if (std::abs(krow - row) <= 1 && std::abs(kcol - col) <= 1) return true;
   }
   // Check Rooks (and queen)
-  if (kRookAttacks[square.as_int()].intersects(their_pieces_ * rooks_)) {
-    for (const auto& direction : kRookDirections) {
-      auto dst_row = row;
-      auto dst_col = col;
-      while (true) {
-        dst_row += direction.first;
-        dst_col += direction.second;
-        if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-        const BoardSquare destination(dst_row, dst_col);
-        if (our_pieces_.get(destination)) break;
-        if (their_pieces_.get(destination)) {
-          if (rooks_.get(destination)) return true;
-          break;
-        }
-      }
-    }
+  if (kRookAttacks.Get(square, ours + theirs).intersects(theirs * rooks_)) {
+    return true;
   }
   // Check Bishops
-  if (kBishopAttacks[square.as_int()].intersects(their_pieces_ * bishops_)) {
-    for (const auto& direction : kBishopDirections) {
-      auto dst_row = row;
-      auto dst_col = col;
-      while (true) {
-        dst_row += direction.first;
-        dst_col += direction.second;
-        if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-        const BoardSquare destination(dst_row, dst_col);
-        if (our_pieces_.get(destination)) break;
-        if (their_pieces_.get(destination)) {
-          if (bishops_.get(destination)) return true;
-          break;
-        }
-      }
-    }
+  if (kBishopAttacks.Get(square, ours + theirs)
+          .intersects(theirs * bishops_)) {
+    return true;
   }
   // Check pawns
-  if (kPawnAttacks[square.as_int()].intersects(their_pieces_ * pawns_)) {
+  if (kPawnAttacks[square.as_int()].intersects(theirs * pawns_)) {
     return true;
   }
   // Check knights
   {
-    if (kKnightAttacks[square.as_int()].intersects(their_pieces_ - their_king_ -
-                                                   rooks_ - bishops_ -
-                                                   (pawns_ * kPawnMask))) {
+    if (kKnightAttacks[square.as_int()].intersects(
+            theirs - their_king_ - rooks_ - bishops_ - (pawns_ * kPawnMask))) {
       return true;
     }
   }
   return false;
 }
 
-bool ChessBoard::IsLegalMove(Move move, bool was_under_check) const {
+void ChessBoard::FindChecksAndPins(BitBoard* checkers,
+                                   BitBoard* pinned) const {
+  checkers->clear();
+  pinned->clear();
+  // Their pieces which would attack our king if not for our pieces. Those
+  // with nothing in between give check, and those with one piece pin it.
+  const BitBoard snipers =
+      their_pieces_ *
+      (kRookAttacks.Get(our_king_, their_pieces_) * rooks_ +
+       kBishopAttacks.Get(our_king_, their_pieces_) * bishops_);
+  for (const auto sniper : snipers) {
+    const BitBoard blockers = SquaresBetween(our_king_, sniper) * our_pieces_;
+    if (blockers.empty()) {
+      checkers->set(sniper);
+    } else if (!(blockers.as_int() & (blockers.as_int() - 1))) {
+      *pinned = *pinned + blockers;
+    }
+  }
+
+  // Pawns and knights are never blocked.
+  *checkers = *checkers +
+              kPawnAttacks[our_king_.as_int()] * their_pieces_ * pawns_ +
+              kKnightAttacks[our_king_.as_int()] *
+                  (their_pieces_ - their_king_ - rooks_ - bishops_ -
+                   (pawns_ * kPawnMask));
+}
+
+bool ChessBoard::IsLegalMove(Move move, bool /* was_under_check */) const {
+  BitBoard checkers;
+  BitBoard pinned;
+  FindChecksAndPins(&checkers, &pinned);
+  return IsLegalMove(move, checkers, pinned);
+}
+
+bool ChessBoard::IsLegalMove(Move move, BitBoard checkers,
+                             BitBoard pinned) const {
   const auto& from = move.from();
   const auto& to = move.to();
 
-  // If we are already under check, also apply move and check if valid.
-  // TODO(mooskagh) Optimize this case
-  if (was_under_check) {
-    ChessBoard board(*this);
-    board.ApplyMove(move);
-    return !board.IsUnderCheck();
+  // If it's kings move, check that destination is not under attack. The king
+  // doesn't shield the squares behind it from a check.
+  if (from == our_king_) {
+    // Castlings were checked earlier.
+    if (std::abs(static_cast<int>(from.col()) - static_cast<int>(to.col())) > 1)
+      return true;
+    return !IsUnderAttack(to, our_pieces_ - our_king_, their_pieces_);
   }
 
-  // En passant. Complex but rare. Just apply
-  // and check that we are not under check.
+  // En passant removes two pieces from the board, and may open a line which
+  // goes through both. Rare, so just check the king with the pieces moved.
   if (from.row() == 4 && pawns_.get(from) && from.col() != to.col() &&
       pawns_.get(7, to.col())) {
-    ChessBoard board(*this);
-    board.ApplyMove(move);
-    return !board.IsUnderCheck();
+    BitBoard ours = our_pieces_;
+    ours.reset(from);
+    ours.set(to);
+    BitBoard theirs = their_pieces_;
+    theirs.reset(4, to.col());
+    return !IsUnderAttack(our_king_, ours, theirs);
   }
 
-  // If it's kings move, check that destination
-  // is not under attack.
-  if (from == our_king_) {
-    // Castlings were checked earlier.
-    if (std::abs(static_cast<int>(from.col()) - static_cast<int>(to.col())) > 1)
-      return true;
-    return !IsUnderAttack(to);
-  }
-
-  // Not check that piece was pinned. And it was, check that after the move
-  // it is still on like of attack.
-  int dx = from.col() - our_king_.col();
-  int dy = from.row() - our_king_.row();
-
-  // If it's not on the same file/rank/diagonal as our king, cannot be pinned.
-  if (dx != 0 && dy != 0 && std::abs(dx) != std::abs(dy)) return true;
-  dx = (dx > 0) - (dx < 0);  // Sign.
-  dy = (dy > 0) - (dy < 0);
-  auto col = our_king_.col();
-  auto row = our_king_.row();
-  while (true) {
-    col += dx;
-    row += dy;
-    // Attacking line left board, good.
-    if (!BoardSquare::IsValid(row, col)) return true;
-    const BoardSquare square(row, col);
-    // The source square of the move is now free.
-    if (square == from) continue;
-    // The destination square if the move is our piece. King is not under
-    // attack.
-    if (square == to) return true;
-    // Our piece on the line. Not under attack.
-    if (our_pieces_.get(square)) return true;
-    if (their_pieces_.get(square)) {
-      if (dx == 0 || dy == 0) {
-        // Have to be afraid of rook-like piece.
-        return !rooks_.get(square);
-      } else {
-        // Have to be afraid of bishop-like piece.
-        return !bishops_.get(square);
-      }
-      return true;
-    }
+  // Only the king can escape a double check.
+  if (checkers.as_int() & (checkers.as_int() - 1)) return false;
+
+  // A pinned piece can only move along the line of the pin, which never
+  // blocks a check nor captures the checking piece.
+  if (pinned.get(from)) {
+    return checkers.empty() && IsOnLine(our_king_, from, to);
   }
+
+  if (checkers.empty()) return true;
+  // Check evasion. Capture the checking piece, or get in its way.
+  const BoardSquare checker = *checkers.begin();
+  return to == checker || SquaresBetween(our_king_, checker).get(to);
 }
 
 MoveList ChessBoard::GenerateLegalMoves() const {
-  const bool was_under_check = IsUnderCheck();
+  BitBoard checkers;
+  BitBoard pinned;
+  FindChecksAndPins(&checkers, &pinned);
   MoveList move_list = GeneratePseudolegalMoves();
   MoveList result;
   result.reserve(move_list.size());
 
   for (Move m : move_list) {
-    if (IsLegalMove(m, was_under_check)) result.emplace_back(m);
+    if (IsLegalMove(m, checkers, pinned)) result.emplace_back(m);
   }
 
   return result;
 }
 
 std::vector<MoveExecution> ChessBoard::GenerateLegalMovesAndPositions() const {
-  MoveList move_list = GeneratePseudolegalMoves();
-  std::vector<MoveExecution> result;
-
-  for (const auto& move : move_list) {
-    result.emplace_back();
-    auto& newboard = result.back().board;
-    newboard = *this;
-    result.back().reset_50_moves = newboard.ApplyMove(move);
-    if (newboard.IsUnderCheck()) {
-      result.pop_back();
-      continue;
-    }
-    result.back().move = move;
+  // Only copy the board for the moves which are legal.
+  MoveList move_list = GenerateLegalMoves();
+  std::vector<MoveExecution> result(move_list.size());
+
+  for (size_t i = 0; i < move_list.size(); ++i) {
+    result[i].move = move_list[i];
+    result[i].board = *this;
+    result[i].reset_50_moves = result[i].board.ApplyMove(move_list[i]);
   }
   return result;
 }
@@ -689,6 +871,7 @@ void ChessBoard::SetFromFen(const std::string& fen, int* no_capture_ply,
     pawns_.set((square.row() == 2) ? 0 : 7, square.col());
   }
 
+  UpdateHashes(ChessBoard());
   if (who_to_move == "b" || who_to_move == "B") {
     Mirror();
   }
@@ -701,13 +884,8 @@ bool ChessBoard::HasMatingMaterial() const {
     return true;
   }
 
-#ifdef _MSC_VER
-  int our = _mm_popcnt_u64(our_pieces_.as_int());
-  int their = _mm_popcnt_u64(their_pieces_.as_int());
-#else
-  int our = __builtin_popcountll(our_pieces_.as_int());
-  int their = __builtin_popcountll(their_pieces_.as_int());
-#endif
+  int our = PopCount(our_pieces_.as_int());
+  int their = PopCount(their_pieces_.as_int());
   if (our + their < 4) {
     // K v K, K+B v K, K+N v K.
     return false;
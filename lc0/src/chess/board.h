@@ -20,7 +20,6 @@
 
 #include <string>
 #include "chess/bitboard.h"
-#include "utils/hashcat.h"
 
 namespace lczero {
 
@@ -65,12 +64,9 @@ class ChessBoard {
   // Returns a list of legal moves and board positions after the move is made.
   std::vector<MoveExecution> GenerateLegalMovesAndPositions() const;
 
-  uint64_t Hash() const {
-    return HashCat({our_pieces_.as_int(), their_pieces_.as_int(),
-                    rooks_.as_int(), bishops_.as_int(), pawns_.as_int(),
-                    our_king_.as_int(), their_king_.as_int(),
-                    castlings_.as_int(), flipped_});
-  }
+  // Zobrist hash, kept up to date by ApplyMove() and Mirror(). The keys are
+  // fixed, so it's the same in every run.
+  uint64_t Hash() const { return flipped_ ? hash_ ^ kFlippedHash : hash_; }
 
   class Castlings {
    public:
@@ -160,6 +156,27 @@ class ChessBoard {
   BoardSquare their_king_;
   Castlings castlings_;
   bool flipped_ = false;  // aka "Black to move".
+  // Zobrist hash of the pieces and castlings, and the one they will have
+  // after Mirror(). Both are 0 for an empty board.
+  uint64_t hash_ = 0;
+  uint64_t mirrored_hash_ = 0;
+
+  static const uint64_t kFlippedHash = 0x9d39247e33776d41ULL;
+
+  // Applies the move to the pieces and castlings, without the hashes.
+  bool MovePieces(Move move);
+  // Updates the hashes with the differences of the board from @before.
+  void UpdateHashes(const ChessBoard& before);
+
+  // Checks if the square is under attack from "their" pieces which are in
+  // @theirs, with @ours and @theirs blocking the lines of attack.
+  bool IsUnderAttack(BoardSquare square, BitBoard ours, BitBoard theirs) const;
+  // Finds "their" pieces which give check, and "our" pieces which are pinned
+  // to our king.
+  void FindChecksAndPins(BitBoard* checkers, BitBoard* pinned) const;
+  // Check whether pseudolegal move is legal, given the result of
+  // FindChecksAndPins().
+  bool IsLegalMove(Move move, BitBoard checkers, BitBoard pinned) const;
 };
 
 // Stores the move and state of the board after the move is done.
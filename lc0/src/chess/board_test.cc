@@ -166,6 +166,26 @@ TEST(ChessBoard, MoveGenPosition6) {
   EXPECT_EQ(Perft(board, 4), 3894594);
 }
 
+TEST(ChessBoard, LegalMovesAndPositionsUnderCheck) {
+  ChessBoard board;
+  // Bb5+, blocked on c6 or d7, or Ke7.
+  board.SetFromFen(
+      "rnbqkbnr/ppp2ppp/8/1B1pp3/4P3/8/PPPP1PPP/RNBQK1NR b KQkq - 1 3");
+
+  const auto legal_moves = board.GenerateLegalMoves();
+  EXPECT_EQ(legal_moves.size(), 6);
+  const auto executions = board.GenerateLegalMovesAndPositions();
+  ASSERT_EQ(executions.size(), legal_moves.size());
+  for (size_t i = 0; i < executions.size(); ++i) {
+    EXPECT_EQ(executions[i].move, legal_moves[i]);
+    auto new_board = board;
+    EXPECT_EQ(executions[i].reset_50_moves,
+              new_board.ApplyMove(legal_moves[i]));
+    EXPECT_EQ(executions[i].board, new_board);
+    EXPECT_FALSE(new_board.IsUnderCheck());
+  }
+}
+
 TEST(ChessBoard, HasMatingMaterialStartPosition) {
   ChessBoard board;
   board.SetFromFen(ChessBoard::kStartingFen);
@@ -236,6 +256,52 @@ TEST(ChessBoard, HasMatingMaterialMultipleBishopsNotSameColor) {
   EXPECT_TRUE(board.HasMatingMaterial());
 }
 
+namespace {
+// Plays @moves from the starting position.
+ChessBoard PlayMoves(const std::vector<std::string>& moves) {
+  ChessBoard board;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  bool black = false;
+  for (const auto& move : moves) {
+    board.ApplyMove(Move(move, black));
+    board.Mirror();
+    black = !black;
+  }
+  return board;
+}
+
+uint64_t FenHash(const std::string& fen) {
+  ChessBoard board;
+  board.SetFromFen(fen);
+  return board.Hash();
+}
+}  // namespace
+
+TEST(ChessBoard, HashAfterMovesMatchesFen) {
+  EXPECT_EQ(PlayMoves({"e2e4", "e7e5", "g1f3", "b8c6", "f1c4", "g8f6", "e1g1"})
+                .Hash(),
+            FenHash("r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQ1RK1 b "
+                    "kq - 5 4"));
+  EXPECT_EQ(PlayMoves({"e2e4", "d7d5", "e4d5", "d8d5"}).Hash(),
+            FenHash("rnb1kbnr/ppp1pppp/8/3q4/8/8/PPPP1PPP/RNBQKBNR w KQkq - 0 "
+                    "3"));
+  EXPECT_EQ(PlayMoves({"e2e4"}).Hash(),
+            FenHash("rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 "
+                    "1"));
+  EXPECT_NE(PlayMoves({"e2e4"}).Hash(),
+            FenHash("rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 "
+                    "1"));
+}
+
+TEST(ChessBoard, HashOfTranspositions) {
+  EXPECT_EQ(PlayMoves({"g1f3", "g8f6", "b1c3"}).Hash(),
+            PlayMoves({"b1c3", "g8f6", "g1f3"}).Hash());
+  EXPECT_NE(PlayMoves({"g1f3", "g8f6", "b1c3"}).Hash(),
+            PlayMoves({"g1f3", "g8f6"}).Hash());
+  EXPECT_EQ(PlayMoves({"g1f3", "g8f6", "f3g1", "f6g8"}).Hash(),
+            FenHash(ChessBoard::kStartingFen));
+}
+
 }  // namespace lczero
 
 int main(int argc, char** argv) {
@@ -88,6 +88,11 @@ struct GameInfo {
   int game_id = -1;
   // The color of the player1, if known.
   optional<bool> is_black;
+  // Whether the game ended by resign or draw adjudication.
+  bool adjudicated = false;
+  // Whether black resigned, or would have in a game played on after a
+  // resign. Empty if nobody did.
+  optional<bool> resigned_black;
 
   using Callback = std::function<void(const GameInfo&)>;
 };
@@ -18,14 +18,16 @@
 
 #include "chess/position.h"
 
+#include <algorithm>
+#include "utils/hashcat.h"
+
 namespace lczero {
 
 Position::Position(const Position& parent, Move m)
-    : no_capture_ply_(parent.no_capture_ply_ + 1),
+    : us_board_(parent.us_board_),
+      no_capture_ply_(parent.no_capture_ply_ + 1),
       ply_count_(parent.ply_count_ + 1) {
-  them_board_ = parent.us_board_;
-  bool capture = them_board_.ApplyMove(m);
-  us_board_ = them_board_;
+  bool capture = us_board_.ApplyMove(m);
   us_board_.Mirror();
   if (capture) no_capture_ply_ = 0;
 }
@@ -33,8 +35,6 @@ Position::Position(const Position& parent, Move m)
 Position::Position(const ChessBoard& board, int no_capture_ply, int game_ply)
     : no_capture_ply_(no_capture_ply), repetitions_(0), ply_count_(0) {
   us_board_ = board;
-  them_board_ = board;
-  them_board_.Mirror();
 }
 
 uint64_t Position::Hash() const {
@@ -80,28 +80,60 @@ GameResult PositionHistory::ComputeGameResult() const {
 void PositionHistory::Reset(const ChessBoard& board, int no_capture_ply,
                             int game_ply) {
   positions_.clear();
+  prev_in_bucket_.clear();
+  last_in_bucket_.fill(-1);
   positions_.emplace_back(board, no_capture_ply, game_ply);
+  LinkLast();
 }
 
 void PositionHistory::Append(Move m) {
-  // TODO(mooskagh) That should be emplace_back(Last(), m), but MSVS STL
-  //                has a bug in implementation of emplace_back, when
-  //                reallocation happens. (it also reallocates Last())
-  positions_.push_back(Position(Last(), m));
+  // MSVS STL has a bug in emplace_back when reallocation happens (it
+  // reallocates Last() as well), so grow beforehand. Trim() keeps the
+  // capacity, so the searches, which trim and append again for every
+  // playout, construct positions in place without allocating.
+  if (positions_.size() == positions_.capacity()) {
+    positions_.reserve(std::max<size_t>(2 * positions_.size(), 16));
+  }
+  positions_.emplace_back(Last(), m);
   positions_.back().SetRepetitions(ComputeLastMoveRepetitions());
+  LinkLast();
+}
+
+void PositionHistory::Pop() {
+  const int bucket = GetRepetitionBucket(Last());
+  last_in_bucket_[bucket] = prev_in_bucket_.back();
+  prev_in_bucket_.pop_back();
+  positions_.pop_back();
+}
+
+void PositionHistory::LinkLast() {
+  const int bucket = GetRepetitionBucket(Last());
+  prev_in_bucket_.push_back(last_in_bucket_[bucket]);
+  last_in_bucket_[bucket] = positions_.size() - 1;
+}
+
+int PositionHistory::GetRepetitionBucket(const Position& position) {
+  const ChessBoard& board = position.GetBoard();
+  return ((board.ours().as_int() * 0x9e3779b97f4a7c15ULL) ^
+          board.theirs().as_int()) *
+             0xff51afd7ed558ccdULL >>
+         (64 - kRepetitionBucketBits);
 }
 
 int PositionHistory::ComputeLastMoveRepetitions() const {
   const auto& last = positions_.back();
-  // TODO(crem) implement hash/cache based solution.
-  if (last.GetNoCapturePly() < 4) return 0;
-
-  for (int idx = positions_.size() - 3; idx >= 0; idx -= 2) {
+  // Positions before the last capture or pawn move can't be the same.
+  const int first_idx = GetLength() - 1 - last.GetNoCapturePly();
+  const int bucket = GetRepetitionBucket(last);
+  // The last position is not linked yet, so this starts with the latest
+  // earlier one.
+  for (int idx = last_in_bucket_[bucket]; idx >= 0 && idx >= first_idx;
+       idx = prev_in_bucket_[idx]) {
     const auto& pos = positions_[idx];
+    // The board includes the side to move.
     if (pos.GetBoard() == last.GetBoard()) {
       return 1 + pos.GetRepetitions();
     }
-    if (pos.GetNoCapturePly() < 2) return 0;
   }
   return 0;
 }
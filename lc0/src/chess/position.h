@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <array>
 #include <string>
 #include "chess/board.h"
 
@@ -53,16 +54,19 @@ class Position {
 
   // Gets board from the point of view of player to move.
   const ChessBoard& GetBoard() const { return us_board_; }
-  // Gets board from the point of view of opponent.
-  const ChessBoard& GetThemBoard() const { return them_board_; }
+  // Gets board from the point of view of opponent. Only the encoder needs it,
+  // so it's mirrored on request rather than kept.
+  ChessBoard GetThemBoard() const {
+    ChessBoard board = us_board_;
+    board.Mirror();
+    return board;
+  }
 
   std::string DebugString() const;
 
  private:
   // The board from the point of view of the player to move.
   ChessBoard us_board_;
-  // The board from the point of view of opponent.
-  ChessBoard them_board_;
 
   // How many half-moves without capture or pawn move was there.
   int no_capture_ply_ = 0;
@@ -76,7 +80,7 @@ enum class GameResult { UNDECIDED, WHITE_WON, DRAW, BLACK_WON };
 
 class PositionHistory {
  public:
-  PositionHistory() = default;
+  PositionHistory() { last_in_bucket_.fill(-1); }
   PositionHistory(const PositionHistory& other) = default;
 
   // Returns first position of the game (or fen from which it was initialized).
@@ -90,7 +94,7 @@ class PositionHistory {
 
   // Trims position to a given size.
   void Trim(int size) {
-    positions_.erase(positions_.begin() + size, positions_.end());
+    while (GetLength() > size) Pop();
   }
 
   // Number of positions in history.
@@ -103,7 +107,7 @@ class PositionHistory {
   void Append(Move m);
 
   // Pops last move from history.
-  void Pop() { positions_.pop_back(); }
+  void Pop();
 
   // Finds the endgame state (win/lose/draw/nothing) for the last position.
   GameResult ComputeGameResult() const;
@@ -116,8 +120,22 @@ class PositionHistory {
 
  private:
   int ComputeLastMoveRepetitions() const;
+  // Adds the last position to the front of its bucket.
+  void LinkLast();
+  // Positions are chained by a hash of their occupancy, latest first, so that
+  // repetitions are found without scanning the history. The full board hash
+  // is too slow to compute for every appended position.
+  static int GetRepetitionBucket(const Position& position);
+
+  static const int kRepetitionBucketBits = 10;
+  static const int kRepetitionBuckets = 1 << kRepetitionBucketBits;
 
   std::vector<Position> positions_;
+  // For every position, the index of the previous one in the same bucket,
+  // -1 if none.
+  std::vector<int> prev_in_bucket_;
+  // Index of the latest position in every bucket, -1 if none.
+  std::array<int, kRepetitionBuckets> last_in_bucket_;
 };
 
 }  // namespace lczero
\ No newline at end of file
@@ -0,0 +1,81 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include "src/chess/board.h"
+#include "src/chess/position.h"
+
+namespace lczero {
+
+namespace {
+// Both sides move a knight out and back.
+void AppendKnightShuffle(PositionHistory* history) {
+  history->Append(Move("g1f3", false));
+  history->Append(Move("g8f6", true));
+  history->Append(Move("f3g1", false));
+  history->Append(Move("f6g8", true));
+}
+}  // namespace
+
+TEST(PositionHistory, Repetitions) {
+  ChessBoard board;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  PositionHistory history;
+  history.Reset(board, 0, 0);
+
+  AppendKnightShuffle(&history);
+  EXPECT_EQ(history.Last().GetRepetitions(), 1);
+  EXPECT_EQ(history.ComputeGameResult(), GameResult::UNDECIDED);
+  history.Append(Move("g1f3", false));
+  EXPECT_EQ(history.Last().GetRepetitions(), 1);
+
+  history.Pop();
+  AppendKnightShuffle(&history);
+  EXPECT_EQ(history.Last().GetRepetitions(), 2);
+  EXPECT_EQ(history.ComputeGameResult(), GameResult::DRAW);
+
+  history.Trim(4);
+  history.Append(Move("f6g8", true));
+  EXPECT_EQ(history.Last().GetRepetitions(), 1);
+  EXPECT_EQ(history.ComputeGameResult(), GameResult::UNDECIDED);
+}
+
+TEST(PositionHistory, RepetitionsAfterPawnMoves) {
+  ChessBoard board;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  PositionHistory history;
+  history.Reset(board, 0, 0);
+
+  AppendKnightShuffle(&history);
+  history.Append(Move("e2e3", false));
+  history.Append(Move("e7e6", true));
+  EXPECT_EQ(history.Last().GetRepetitions(), 0);
+  AppendKnightShuffle(&history);
+  EXPECT_EQ(history.Last().GetRepetitions(), 1);
+  AppendKnightShuffle(&history);
+  EXPECT_EQ(history.Last().GetRepetitions(), 2);
+  EXPECT_EQ(history.ComputeGameResult(), GameResult::DRAW);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -23,6 +23,10 @@
 #include "mcts/search.h"
 #include "neural/factory.h"
 #include "neural/loader.h"
+#include "neural/remote.h"
+#include "neural/shared_cache.h"
+#include "utils/hashcat.h"
+#include "utils/trace.h"
 
 namespace lczero {
 namespace {
@@ -30,6 +34,7 @@ namespace {
 const int kDefaultThreads = 2;
 const char* kThreadsOption = "Number of worker threads";
 const char* kDebugLogStr = "Do debug logging into file";
+const char* kTraceFileStr = "Write a timeline of the threads into file";
 
 // TODO(mooskagh) Move weights/backend/backend-opts parameter handling to
 //                network factory.
@@ -37,6 +42,9 @@ const char* kWeightsStr = "Network weights file path";
 const char* kNnBackendStr = "NN backend to use";
 const char* kNnBackendOptionsStr = "NN backend parameters";
 const char* kSlowMoverStr = "Scale thinking time";
+const char* kSyzygyTablebaseStr = "List of Syzygy tablebase directories";
+const char* kSharedCacheStr =
+    "Shared NNCache size, for the engines of the host with the same network";
 
 const char* kAutoDiscover = "<autodiscover>";
 }  // namespace
@@ -57,12 +65,14 @@ void EngineController::PopulateOptions(OptionsParser* options) {
   options->Add<IntOption>(
       "NNCache size", 0, 999999999, "nncache", '\0',
       std::bind(&EngineController::SetCacheSize, this, _1)) = 200000;
+  options->Add<IntOption>(kSharedCacheStr, 0, 999999999, "shared-nncache") = 0;
 
   const auto backends = NetworkFactory::Get()->GetBackendsList();
   options->Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
       backends.empty() ? "<none>" : backends[0];
   options->Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
   options->Add<FloatOption>(kSlowMoverStr, 0.0, 100.0, "slowmover") = 1.5;
+  options->Add<StringOption>(kSyzygyTablebaseStr, "syzygy-paths");
 
   Search::PopulateUciParams(options);
 }
@@ -109,14 +119,17 @@ void EngineController::UpdateNetwork() {
   std::string network_path = options_.Get<std::string>(kWeightsStr);
   std::string backend = options_.Get<std::string>(kNnBackendStr);
   std::string backend_options = options_.Get<std::string>(kNnBackendOptionsStr);
+  int shared_cache_size = options_.Get<int>(kSharedCacheStr);
 
   if (network_path == network_path_ && backend == backend_ &&
-      backend_options == backend_options_)
+      backend_options == backend_options_ &&
+      shared_cache_size == shared_cache_size_)
     return;
 
   network_path_ = network_path;
   backend_ = backend;
   backend_options_ = backend_options;
+  shared_cache_size_ = shared_cache_size;
 
   std::string net_path = network_path;
   if (net_path == kAutoDiscover) {
@@ -128,6 +141,47 @@ void EngineController::UpdateNetwork() {
       OptionsDict::FromString(backend_options, &options_);
 
   network_ = NetworkFactory::Get()->Create(backend, weights, network_options);
+  network_warm_ = false;
+
+  cache_.SetShared(nullptr);
+  if (shared_cache_size > 0) {
+    uint64_t network_hash = HashWeights(weights);
+    if (const uint64_t ns = network_->GetCacheNamespace()) {
+      network_hash = HashCat(network_hash, ns);
+    }
+    cache_.SetShared(
+        std::make_shared<SharedNNCache>(network_hash, shared_cache_size));
+  }
+}
+
+void EngineController::WarmupNetwork() {
+  SharedLock lock(busy_mutex_);
+  if (!network_ || network_warm_) return;
+  network_warm_ = true;
+  // Single evaluations and full minibatches.
+  network_->Warmup(1);
+  const int minibatch = options_.Get<int>(Search::kMiniBatchSizeStr);
+  if (minibatch > 1) network_->Warmup(minibatch);
+}
+
+void EngineController::EnsureReady() {
+  // A search may be running with the network, so changed options are left
+  // to the next position. Only the first network is loaded here.
+  if (!network_) {
+    UpdateNetwork();
+    UpdateTablebase();
+  }
+  WarmupNetwork();
+  std::unique_lock<RpSharedMutex> lock(busy_mutex_);
+}
+
+void EngineController::UpdateTablebase() {
+  std::string paths = options_.Get<std::string>(kSyzygyTablebaseStr);
+  if (paths == tb_paths_) return;
+  tb_paths_ = paths;
+
+  syzygy_tb_ = std::make_unique<SyzygyTablebase>();
+  if (!syzygy_tb_->Init(paths)) syzygy_tb_.reset();
 }
 
 void EngineController::SetCacheSize(int size) { cache_.SetCapacity(size); }
@@ -137,6 +191,7 @@ void EngineController::NewGame() {
   search_.reset();
   tree_.reset();
   UpdateNetwork();
+  UpdateTablebase();
 }
 
 void EngineController::SetPosition(const std::string& fen,
@@ -150,6 +205,8 @@ void EngineController::SetPosition(const std::string& fen,
   for (const auto& move : moves_str) moves.emplace_back(move);
   tree_->ResetToPosition(fen, moves);
   UpdateNetwork();
+  UpdateTablebase();
+  WarmupNetwork();
 }
 
 void EngineController::Go(const GoParams& params) {
@@ -162,7 +219,8 @@ void EngineController::Go(const GoParams& params) {
 
   search_ =
       std::make_unique<Search>(*tree_, network_.get(), best_move_callback_,
-                               info_callback_, limits, options_, &cache_);
+                               info_callback_, limits, options_, &cache_,
+                               syzygy_tb_.get());
 
   search_->StartThreads(options_.Get<int>(kThreadsOption));
 }
@@ -179,6 +237,10 @@ EngineLoop::EngineLoop()
   options_.Add<StringOption>(
       kDebugLogStr, "debuglog", 'l',
       [this](const std::string& filename) { SetLogFilename(filename); }) = "";
+  options_.Add<StringOption>(kTraceFileStr, "trace-file", '\0',
+                             [](const std::string& filename) {
+                               Tracer::Get().SetFilename(filename);
+                             }) = "";
 }
 
 void EngineLoop::RunLoop() {
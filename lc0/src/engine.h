@@ -22,6 +22,7 @@
 #include "mcts/search.h"
 #include "neural/cache.h"
 #include "neural/network.h"
+#include "syzygy/syzygy.h"
 #include "utils/mutex.h"
 #include "utils/optionsparser.h"
 
@@ -45,8 +46,9 @@ class EngineController {
 
   void PopulateOptions(OptionsParser* options);
 
-  // Blocks.
-  void EnsureReady() { std::unique_lock<RpSharedMutex> lock(busy_mutex_); }
+  // Blocks. Loads the network if needed and warms it up, so that the first
+  // search runs at full speed.
+  void EnsureReady();
 
   // Must not block.
   void NewGame();
@@ -66,6 +68,11 @@ class EngineController {
 
  private:
   void UpdateNetwork();
+  // Runs the network once at the batch sizes the search uses, if it wasn't
+  // since it was loaded.
+  void WarmupNetwork();
+  // Reloads the tablebases when their paths change. Only between searches.
+  void UpdateTablebase();
 
   const OptionsDict& options_;
 
@@ -74,6 +81,8 @@ class EngineController {
 
   NNCache cache_;
   std::unique_ptr<Network> network_;
+  bool network_warm_ = false;
+  std::unique_ptr<SyzygyTablebase> syzygy_tb_;
 
   // Locked means that there is some work to wait before responding readyok.
   RpSharedMutex busy_mutex_;
@@ -87,6 +96,8 @@ class EngineController {
   std::string network_path_;
   std::string backend_;
   std::string backend_options_;
+  int shared_cache_size_ = 0;
+  std::string tb_paths_;
 };
 
 class EngineLoop : public UciLoop {
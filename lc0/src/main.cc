@@ -18,9 +18,13 @@
 
 #include <iostream>
 #include "analyzer/analyzer.h"
+#include "benchmark/autotune.h"
+#include "benchmark/backend.h"
 #include "engine.h"
+#include "neural/server.h"
 #include "selfplay/loop.h"
 #include "utils/commandline.h"
+#include "utils/trace.h"
 
 int main(int argc, const char** argv) {
   std::cerr << "       _" << std::endl;
@@ -31,6 +35,12 @@ int main(int argc, const char** argv) {
   CommandLine::RegisterMode("uci", "(default) Act as UCI engine");
   CommandLine::RegisterMode("selfplay", "Play games with itself");
   CommandLine::RegisterMode("debug", "Generate debug data for a position");
+  CommandLine::RegisterMode("benchmark",
+                            "Measure NN backend speed at several batch sizes");
+  CommandLine::RegisterMode("autotune",
+                            "Find the fastest search and backend settings");
+  CommandLine::RegisterMode("serve",
+                            "Compute for the remote backend of other hosts");
 
   if (CommandLine::ConsumeCommand("selfplay")) {
     // Selfplay mode.
@@ -40,6 +50,18 @@ int main(int argc, const char** argv) {
     // Runs analyzer mode.
     Analyzer analyzer;
     analyzer.Run();
+  } else if (CommandLine::ConsumeCommand("benchmark")) {
+    // Backend throughput and latency.
+    BackendBenchmark benchmark;
+    benchmark.Run();
+  } else if (CommandLine::ConsumeCommand("autotune")) {
+    // Sweeps the settings which depend on the hardware.
+    Autotune autotune;
+    autotune.Run();
+  } else if (CommandLine::ConsumeCommand("serve")) {
+    // Shares the local backend over the network.
+    InferenceServer server;
+    server.Run();
   } else {
     // Consuming optional "uci" mode.
     CommandLine::ConsumeCommand("uci");
@@ -47,4 +69,6 @@ int main(int argc, const char** argv) {
     EngineLoop loop;
     loop.RunLoop();
   }
+  // The threads of the loops are joined by now.
+  Tracer::Get().Write();
 }
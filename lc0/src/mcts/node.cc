@@ -20,12 +20,22 @@
 
 #include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include "neural/encoder.h"
 #include "neural/network.h"
+#include "utils/fp16_utils.h"
 #include "utils/hashcat.h"
+#include "utils/hugepages.h"
 
 namespace lczero {
 
@@ -34,30 +44,45 @@ namespace lczero {
 /////////////////////////////////////////////////////////////////////////
 
 namespace {
-const int kAllocationSize = 1024 * 64;
+// Nodes are allocated in batches of two huge pages.
+const int kAllocationSize = 2 * HugePageBuffer::kHugePageSize / sizeof(Node);
+// Free nodes move between the pool and the caches of the threads in lists of
+// this many.
+const int kCacheBatchSize = 256;
+// Threads count the bytes they allocate and release on their own, and add
+// them to the shared count once they are this many either way.
+const int64_t kBytesBatchSize = 64 * 1024;
 }  // namespace
 
 class Node::Pool {
  public:
+  ~Pool();
+
   // Allocates a new node and initializes it with all zeros.
   Node* AllocateNode();
   // Return node to the pool.
   void ReleaseNode(Node*);
 
-  // Releases all children of the node, except specified. Also updates pointers
-  // accordingly.
+  // The functions below detach the released nodes from the tree right away,
+  // but return them to the pool in a background thread, so that they don't
+  // take time in the thread that changes the tree.
+
+  // Releases all child nodes of the node, except specified. Keeps the edges.
   void ReleaseAllChildrenExceptOne(Node* root, Node* subtree);
-  // Releases all children, but doesn't release the node isself.
+  // Releases all children and edges, but doesn't release the node isself.
   void ReleaseChildren(Node*);
   // Releases all children and the node itself;
   void ReleaseSubtree(Node*);
 
- private:
-  void AllocateNewBatch();
-  void ReleaseNodeInternal(Node*);
-  void ReleaseChildrenInternal(Node*);
-  void ReleaseSubtreeInternal(Node*);
+  // Nodes and edges in use, in bytes. Up to kBytesBatchSize per thread off,
+  // for the bytes of the other threads which aren't added up yet.
+  size_t GetBytesInUse() const;
+  void AddEdgeBytes(int num_edges) { AddBytes(num_edges * sizeof(Edge)); }
+  // Has the release thread give the allocations without nodes in use back,
+  // once it released what is queued.
+  void ReleaseUnusedMemory();
 
+ private:
   union FreeNode {
     FreeNode* next;
     Node node;
@@ -65,132 +90,324 @@ class Node::Pool {
     FreeNode() {}
   };
 
-  mutable Mutex mutex_;
   // Linked list of free nodes.
-  FreeNode* free_list_ GUARDED_BY(mutex_) = nullptr;
+  struct FreeList {
+    FreeNode* head = nullptr;
+    int size = 0;
+  };
 
-  // Mutex for slow but rare operations.
-  mutable Mutex allocations_mutex_ ACQUIRED_AFTER(mutex_);
-  FreeNode* reserve_list_ GUARDED_BY(allocations_mutex_) = nullptr;
-  std::vector<std::unique_ptr<FreeNode[]>> allocations_
-      GUARDED_BY(allocations_mutex_);
+  // Free nodes of one thread, which it allocates and releases without
+  // locking. Returned to the pool when the thread exits.
+  struct ThreadCache : FreeList {
+    ~ThreadCache();
+    // Bytes allocated less bytes released, not in bytes_in_use_ yet.
+    int64_t bytes = 0;
+  };
+  static thread_local ThreadCache cache_;
+
+  void AddBytes(int64_t bytes);
+  FreeList TakeFreeList();
+  void PutFreeList(FreeList list);
+  void AllocateNewBatch() REQUIRES(mutex_);
+  // Frees the allocations all nodes of which are in free_lists_.
+  void FreeUnusedBatches();
+
+  // Releases into cache_ of the calling thread.
+  void ReleaseSubtreeNow(Node*);
+  // Queues the subtree for the release thread.
+  void ReleaseInBackground(Node*);
+  void ReleaseWorker();
+
+  mutable Mutex mutex_{"Node::Pool"};
+  // Lists of free nodes, most of kCacheBatchSize.
+  std::vector<FreeList> free_lists_ GUARDED_BY(mutex_);
+  std::vector<HugePageArray<FreeNode>> allocations_ GUARDED_BY(mutex_);
+
+  // Detached subtrees waiting for the release thread, which is started on
+  // first use.
+  std::mutex release_mutex_;
+  std::condition_variable release_cv_;
+  std::vector<Node*> release_queue_;
+  bool stop_release_ = false;
+  bool free_unused_ = false;
+  std::thread release_thread_;
+
+  // Negative while a thread released more than it allocated.
+  std::atomic<int64_t> bytes_in_use_{0};
 };
 
+thread_local Node::Pool::ThreadCache Node::Pool::cache_;
+
+Node::Pool::~Pool() {
+  {
+    std::lock_guard<std::mutex> lock(release_mutex_);
+    stop_release_ = true;
+  }
+  release_cv_.notify_one();
+  if (release_thread_.joinable()) release_thread_.join();
+}
+
 Node* Node::Pool::AllocateNode() {
-  while (true) {
-    Node* result = nullptr;
-    {
-      Mutex::Lock lock(mutex_);
-      // Try to pick from a head of the freelist.
-      if (free_list_) {
-        result = &free_list_->node;
-        free_list_ = free_list_->next;
-      } else {
-        // Free list empty. Trying to make reserve list free list.
-        Mutex::Lock lock(allocations_mutex_);
-        if (reserve_list_) {
-          free_list_ = reserve_list_;
-          reserve_list_ = nullptr;
+  if (!cache_.head) static_cast<FreeList&>(cache_) = TakeFreeList();
+  Node* result = &cache_.head->node;
+  cache_.head = cache_.head->next;
+  --cache_.size;
+  std::memset(result, 0, sizeof(Node));
+  AddBytes(sizeof(Node));
+  return result;
+}
+
+void Node::Pool::ReleaseNode(Node* node) {
+  AddBytes(-int64_t(sizeof(Node)));
+  auto* free_node = reinterpret_cast<FreeNode*>(node);
+  free_node->next = cache_.head;
+  cache_.head = free_node;
+  // Keep up to a list to allocate from, and give the rest back.
+  if (++cache_.size < 2 * kCacheBatchSize) return;
+  FreeList list;
+  list.head = cache_.head;
+  list.size = kCacheBatchSize;
+  FreeNode* last = cache_.head;
+  for (int i = 1; i < kCacheBatchSize; ++i) last = last->next;
+  cache_.head = last->next;
+  cache_.size -= kCacheBatchSize;
+  last->next = nullptr;
+  PutFreeList(list);
+}
+
+void Node::Pool::AddBytes(int64_t bytes) {
+  cache_.bytes += bytes;
+  if (std::abs(cache_.bytes) < kBytesBatchSize) return;
+  bytes_in_use_.fetch_add(cache_.bytes, std::memory_order_relaxed);
+  cache_.bytes = 0;
+}
+
+size_t Node::Pool::GetBytesInUse() const {
+  return std::max<int64_t>(
+      0, bytes_in_use_.load(std::memory_order_relaxed) + cache_.bytes);
+}
+
+Node::Pool::FreeList Node::Pool::TakeFreeList() {
+  Mutex::Lock lock(mutex_);
+  if (free_lists_.empty()) AllocateNewBatch();
+  FreeList list = free_lists_.back();
+  free_lists_.pop_back();
+  return list;
+}
+
+void Node::Pool::PutFreeList(FreeList list) {
+  Mutex::Lock lock(mutex_);
+  free_lists_.push_back(list);
+}
+
+void Node::Pool::AllocateNewBatch() REQUIRES(mutex_) {
+  allocations_.emplace_back(kAllocationSize);
+
+  FreeNode* new_nodes = allocations_.back().data();
+  for (int i = 0; i < kAllocationSize; i += kCacheBatchSize) {
+    FreeList list;
+    for (int j = i; j < std::min(i + kCacheBatchSize, kAllocationSize); ++j) {
+      new_nodes[j].next = list.head;
+      list.head = new_nodes + j;
+      ++list.size;
+    }
+    free_lists_.push_back(list);
+  }
+}
+
+void Node::Pool::FreeUnusedBatches() {
+  Mutex::Lock lock(mutex_);
+  // Allocations by address, to find the one of a node.
+  std::vector<std::pair<uintptr_t, int>> by_address;
+  for (size_t i = 0; i < allocations_.size(); ++i) {
+    by_address.emplace_back(
+        reinterpret_cast<uintptr_t>(allocations_[i].data()), i);
+  }
+  std::sort(by_address.begin(), by_address.end());
+  const auto allocation_of = [&by_address](FreeNode* node) {
+    auto iter = std::upper_bound(
+        by_address.begin(), by_address.end(),
+        std::make_pair(reinterpret_cast<uintptr_t>(node),
+                       std::numeric_limits<int>::max()));
+    return std::prev(iter)->second;
+  };
+
+  std::vector<int> free_count(allocations_.size());
+  for (const FreeList& list : free_lists_) {
+    for (FreeNode* node = list.head; node; node = node->next) {
+      ++free_count[allocation_of(node)];
+    }
+  }
+
+  // Keeps the free nodes of the other allocations, in new lists.
+  std::vector<FreeList> free_lists;
+  FreeList current;
+  for (const FreeList& list : free_lists_) {
+    for (FreeNode* node = list.head; node;) {
+      FreeNode* next = node->next;
+      if (free_count[allocation_of(node)] != kAllocationSize) {
+        node->next = current.head;
+        current.head = node;
+        if (++current.size == kCacheBatchSize) {
+          free_lists.push_back(current);
+          current = FreeList();
         }
       }
+      node = next;
     }
+  }
+  if (current.head) free_lists.push_back(current);
+  free_lists_.swap(free_lists);
 
-    // Have node! Return.
-    if (result) {
-      std::memset(result, 0, sizeof(Node));
-      return result;
+  std::vector<HugePageArray<FreeNode>> allocations;
+  for (size_t i = 0; i < allocations_.size(); ++i) {
+    if (free_count[i] != kAllocationSize) {
+      allocations.push_back(std::move(allocations_[i]));
     }
+  }
+  allocations_.swap(allocations);
+}
 
-    {
-      Mutex::Lock lock(allocations_mutex_);
-      // Reserve is empty now, so unless another thread did that, we have to
-      // rebuild a new reserve.
-      if (!reserve_list_) AllocateNewBatch();
+void Node::Pool::ReleaseUnusedMemory() {
+  {
+    std::lock_guard<std::mutex> lock(release_mutex_);
+    if (!release_thread_.joinable()) {
+      release_thread_ = std::thread([this]() { ReleaseWorker(); });
     }
-    // Repeat again, now as we have reserve list and (possibly) free list.
+    free_unused_ = true;
   }
+  release_cv_.notify_one();
 }
 
-void Node::Pool::ReleaseNode(Node* node) {
-  Mutex::Lock lock(mutex_);
-  ReleaseNodeInternal(node);
+void Node::Pool::ReleaseChildren(Node* node) {
+  ReleaseAllChildrenExceptOne(node, nullptr);
+  AddBytes(-int64_t(node->num_edges_ * sizeof(Edge)));
+  delete[] node->edges_;
+  node->edges_ = nullptr;
+  node->num_edges_ = 0;
 }
 
-void Node::Pool::ReleaseNodeInternal(Node* node) REQUIRES(mutex_) {
-  auto* free_node = reinterpret_cast<FreeNode*>(node);
-  free_node->next = free_list_;
-  free_list_ = free_node;
+void Node::Pool::ReleaseAllChildrenExceptOne(Node* root, Node* subtree) {
+  for (Edge* edge = root->edges_; edge != root->edges_ + root->num_edges_;
+       ++edge) {
+    Node* child = edge->GetChild();
+    if (child && child != subtree) {
+      edge->child_ = nullptr;
+      ReleaseInBackground(child);
+    }
+  }
 }
 
-void Node::Pool::AllocateNewBatch() REQUIRES(allocations_mutex_) {
-  allocations_.emplace_back(std::make_unique<FreeNode[]>(kAllocationSize));
+void Node::Pool::ReleaseSubtree(Node* node) { ReleaseInBackground(node); }
 
-  FreeNode* new_nodes = allocations_.back().get();
-  for (int i = 0; i < kAllocationSize; ++i) {
-    FreeNode* n = new_nodes + i;
-    n->next = reserve_list_;
-    reserve_list_ = n;
+void Node::Pool::ReleaseSubtreeNow(Node* node) {
+  for (const auto& edge : node->Edges()) {
+    if (edge.node()) ReleaseSubtreeNow(edge.node());
   }
+  AddBytes(-int64_t(node->num_edges_ * sizeof(Edge)));
+  delete[] node->edges_;
+  ReleaseNode(node);
 }
 
-void Node::Pool::ReleaseChildren(Node* node) {
-  Mutex::Lock lock(mutex_);
-  ReleaseChildrenInternal(node);
-}
-
-void Node::Pool::ReleaseChildrenInternal(Node* node) REQUIRES(mutex_) {
-  Node* next = node->child_;
-  // Iterating manually rather than with iterator, as node is released in the
-  // middle and can be taken by other threads, so we have to be careful.
-  while (next) {
-    Node* iter = next;
-    // Getting next after releasing node, as otherwise it can be reallocated
-    // and overwritten.
-    next = next->sibling_;
-    ReleaseSubtreeInternal(iter);
+void Node::Pool::ReleaseInBackground(Node* node) {
+  {
+    std::lock_guard<std::mutex> lock(release_mutex_);
+    if (!release_thread_.joinable()) {
+      release_thread_ = std::thread([this]() { ReleaseWorker(); });
+    }
+    release_queue_.push_back(node);
   }
-  node->child_ = nullptr;
+  release_cv_.notify_one();
 }
 
-void Node::Pool::ReleaseAllChildrenExceptOne(Node* root, Node* subtree) {
-  Node* child = nullptr;
-  Node* next = root->child_;
-  while (next) {
-    Node* iter = next;
-    // Getting next after releasing node, as otherwise it can be reallocated
-    // and overwritten.
-    next = next->sibling_;
-    if (iter == subtree) {
-      child = iter;
-    } else {
-      ReleaseSubtree(iter);
+void Node::Pool::ReleaseWorker() {
+  std::unique_lock<std::mutex> lock(release_mutex_);
+  while (true) {
+    release_cv_.wait(lock, [this]() {
+      return stop_release_ || free_unused_ || !release_queue_.empty();
+    });
+    if (release_queue_.empty() && !free_unused_) return;
+    std::vector<Node*> queue;
+    queue.swap(release_queue_);
+    const bool free_unused = free_unused_;
+    free_unused_ = false;
+    lock.unlock();
+    for (Node* node : queue) ReleaseSubtreeNow(node);
+    // Nobody allocates from this thread, so give everything back.
+    if (cache_.head) {
+      PutFreeList(cache_);
+      static_cast<FreeList&>(cache_) = FreeList();
     }
-  }
-  root->child_ = child;
-  if (child) {
-    child->sibling_ = nullptr;
+    bytes_in_use_.fetch_add(cache_.bytes, std::memory_order_relaxed);
+    cache_.bytes = 0;
+    if (free_unused) {
+      FreeUnusedBatches();
+#ifdef __GLIBC__
+      // The edges are on the heap.
+      malloc_trim(0);
+#endif
+    }
+    lock.lock();
   }
 }
 
-void Node::Pool::ReleaseSubtree(Node* node) {
-  Mutex::Lock lock(mutex_);
-  ReleaseSubtreeInternal(node);
+Node::Pool gNodePool;
+
+Node::Pool::ThreadCache::~ThreadCache() {
+  if (head) gNodePool.PutFreeList(*this);
+  gNodePool.bytes_in_use_.fetch_add(bytes, std::memory_order_relaxed);
 }
 
-void Node::Pool::ReleaseSubtreeInternal(Node* node) REQUIRES(mutex_) {
-  ReleaseChildrenInternal(node);
-  ReleaseNodeInternal(node);
+/////////////////////////////////////////////////////////////////////////
+// Edge
+/////////////////////////////////////////////////////////////////////////
+
+Move Edge::GetMove(bool flip) const {
+  if (!flip) return move_;
+  Move m = move_;
+  m.Mirror();
+  return m;
 }
 
-Node::Pool gNodePool;
+/////////////////////////////////////////////////////////////////////////
+// Node
+/////////////////////////////////////////////////////////////////////////
 
-Node* Node::CreateChild(Move m) {
+size_t Node::GetTreeMemoryUsage() { return gNodePool.GetBytesInUse(); }
+
+void Node::ReleaseUnusedMemory() { gNodePool.ReleaseUnusedMemory(); }
+
+void Node::ReleaseChildNodes() {
+  gNodePool.ReleaseAllChildrenExceptOne(this, nullptr);
+}
+
+void Node::CreateEdges(const MoveList& moves) {
+  assert(!edges_);
+  assert(moves.size() < 256);
+  edges_ = new Edge[moves.size()];
+  num_edges_ = moves.size();
+  gNodePool.AddEdgeBytes(num_edges_);
+  for (int i = 0; i < num_edges_; ++i) edges_[i].move_ = moves[i];
+}
+
+Node* Node::CreateSingleChildNode(Move m) {
+  CreateEdges({m});
+  return GetOrCreateChild(edges_);
+}
+
+Node* Node::GetOrCreateChild(Edge* edge) {
+  Node* child = edge->GetChild();
+  if (child) return child;
   Node* new_node = gNodePool.AllocateNode();
   new_node->parent_ = this;
-  new_node->sibling_ = child_;
-  new_node->move_ = m;
-  child_ = new_node;
-  return new_node;
+  new_node->index_ = edge - edges_;
+  // Another thread may have picked the same edge meanwhile.
+  if (edge->child_.compare_exchange_strong(child, new_node,
+                                           std::memory_order_acq_rel)) {
+    return new_node;
+  }
+  gNodePool.ReleaseNode(new_node);
+  return child;
 }
 
 void Node::ResetStats() {
@@ -199,7 +416,6 @@ void Node::ResetStats() {
   v_ = 0.0;
   q_ = 0.0;
   w_ = 0.0;
-  p_ = 0.0;
   max_depth_ = 0;
   full_depth_ = 0;
   is_terminal_ = false;
@@ -207,28 +423,37 @@ void Node::ResetStats() {
 
 std::string Node::DebugString() const {
   std::ostringstream oss;
-  oss << "Move: " << move_.as_string() << " Term:" << is_terminal_
-      << " This:" << this << " Parent:" << parent_ << " child:" << child_
-      << " sibling:" << sibling_ << " P:" << p_ << " Q:" << q_ << " W:" << w_
-      << " N:" << n_ << " N_:" << n_in_flight_;
+  oss << "Move: " << GetMove().as_string() << " Term:" << is_terminal_
+      << " This:" << this << " Parent:" << parent_ << " Index:" << index_
+      << " Edges:" << static_cast<int>(num_edges_) << " Q:" << q_.load()
+      << " W:" << w_.load() << " N:" << n_.load()
+      << " N_:" << n_in_flight_.load();
   return oss.str();
 }
 
+Move Node::GetMove() const {
+  // Root node contains move a1a1.
+  return parent_ ? parent_->edges_[index_].GetMove() : Move();
+}
+
 Move Node::GetMove(bool flip) const {
-  if (!flip) return move_;
-  Move m = move_;
-  m.Mirror();
-  return m;
+  return parent_ ? parent_->edges_[index_].GetMove(flip) : Move();
 }
 
 void Node::MakeTerminal(GameResult result) {
   is_terminal_ = true;
-  v_ = (result == GameResult::DRAW) ? 0.0f : 1.0f;
+  v_ = (result == GameResult::DRAW)
+           ? 0.0f
+           : (result == GameResult::WHITE_WON) ? 1.0f : -1.0f;
 }
 
 bool Node::TryStartScoreUpdate() {
-  if (n_ == 0 && n_in_flight_ > 0) return false;
-  ++n_in_flight_;
+  uint16_t n_in_flight = n_in_flight_;
+  // The compare-exchange makes sure that only one thread gets to expand a
+  // node that nobody has visited yet.
+  do {
+    if (n_ == 0 && n_in_flight > 0) return false;
+  } while (!n_in_flight_.compare_exchange_weak(n_in_flight, n_in_flight + 1));
   return true;
 }
 
@@ -236,27 +461,39 @@ void Node::CancelScoreUpdate() { --n_in_flight_; }
 
 void Node::FinalizeScoreUpdate(float v) {
   // Add new value to W.
-  w_ += v;
-  // Increment N.
-  ++n_;
+  float w = w_.load(std::memory_order_relaxed);
+  while (!w_.compare_exchange_weak(w, w + v, std::memory_order_relaxed)) {
+  }
+  // Increment N. This also publishes the children and the values set during
+  // expansion to the threads which see N > 0.
+  const uint32_t n = ++n_;
   // Decrement virtual loss.
   --n_in_flight_;
   // Recompute Q.
-  q_ = w_ / n_;
+  q_.store((w + v) / n, std::memory_order_relaxed);
 }
 
 void Node::UpdateMaxDepth(int depth) {
-  if (depth > max_depth_) max_depth_ = depth;
+  uint16_t max_depth = max_depth_;
+  while (depth > max_depth &&
+         !max_depth_.compare_exchange_weak(max_depth, depth)) {
+  }
 }
 
 bool Node::UpdateFullDepth(uint16_t* depth) {
-  if (full_depth_ > *depth) return false;
-  for (Node* iter : Children()) {
-    if (*depth > iter->full_depth_) *depth = iter->full_depth_;
+  uint16_t full_depth = full_depth_;
+  if (full_depth > *depth) return false;
+  for (const auto& edge : Edges()) {
+    // Unvisited edges aren't searched at all.
+    const uint16_t child_depth =
+        edge.node() ? edge.node()->GetFullDepth() : 0;
+    if (*depth > child_depth) *depth = child_depth;
   }
-  if (*depth >= full_depth_) {
-    full_depth_ = ++*depth;
-    return true;
+  while (*depth >= full_depth) {
+    if (full_depth_.compare_exchange_weak(full_depth, *depth + 1)) {
+      ++*depth;
+      return true;
+    }
   }
   return false;
 }
@@ -271,21 +508,24 @@ uint64_t ReverseBitsInBytes(uint64_t v) {
 }
 }  // namespace
 
-V3TrainingData Node::GetV3TrainingData(GameResult game_result,
+V4TrainingData Node::GetV4TrainingData(GameResult game_result,
                                        const PositionHistory& history) const {
-  V3TrainingData result;
+  V4TrainingData training_data;
 
-  // Set version.
-  result.version = 3;
-
-  // Populate probabilities.
+  // Populate probabilities, of the legal moves only.
   float total_n = n_ - 1;  // First visit was expansion of it inself.
-  std::memset(result.probabilities, 0, sizeof(result.probabilities));
-  for (Node* iter : Children()) {
-    result.probabilities[iter->move_.as_nn_index()] = iter->n_ / total_n;
+  for (const auto& edge : Edges()) {
+    training_data.probabilities.push_back(
+        {edge.GetMove().as_nn_index(), FP32toFP16(edge.GetN() / total_n)});
   }
+  std::sort(training_data.probabilities.begin(),
+            training_data.probabilities.end(),
+            [](const V4Probability& a, const V4Probability& b) {
+              return a.index < b.index;
+            });
 
   // Populate planes.
+  V4TrainingPosition& result = training_data.position;
   InputPlanes planes = EncodePositionForNN(history);
   int plane_idx = 0;
   for (auto& plane : result.planes) {
@@ -313,21 +553,26 @@ V3TrainingData Node::GetV3TrainingData(GameResult game_result,
     result.result = 0;
   }
 
-  return result;
+  return training_data;
 }
 
 void NodeTree::MakeMove(Move move) {
   if (HeadPosition().IsBlackToMove()) move.Mirror();
 
   Node* new_head = nullptr;
-  for (Node* n : current_head_->Children()) {
-    if (n->GetMove() == move) {
-      new_head = n;
+  for (const auto& edge : current_head_->Edges()) {
+    if (edge.GetMove() == move) {
+      new_head = current_head_->GetOrCreateChild(edge.edge());
       break;
     }
   }
-  gNodePool.ReleaseAllChildrenExceptOne(current_head_, new_head);
-  current_head_ = new_head ? new_head : current_head_->CreateChild(move);
+  if (new_head) {
+    gNodePool.ReleaseAllChildrenExceptOne(current_head_, new_head);
+  } else {
+    gNodePool.ReleaseChildren(current_head_);
+    new_head = current_head_->CreateSingleChildNode(move);
+  }
+  current_head_ = new_head;
   history_.Append(move);
 }
 
@@ -362,7 +607,6 @@ void NodeTree::ResetToPosition(const std::string& starting_fen,
   // If we didn't see old head, it means that new position is shorter.
   // As we killed the search tree already, trim it to redo the search.
   if (!seen_old_head) {
-    assert(!current_head_->sibling_);
     gNodePool.ReleaseChildren(current_head_);
     current_head_->ResetStats();
   }
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include "chess/board.h"
@@ -29,36 +30,126 @@
 namespace lczero {
 
 class Node;
-class Node_Iterator {
+
+// A legal move from a position with its probability from the policy head.
+// Expanded nodes keep their edges in one array, and only the edges which the
+// search visits get a node.
+class Edge {
+ public:
+  // Returns move from the point of view of the player making it (if flip is
+  // false) or of the opponent (if flip is true).
+  Move GetMove(bool flip = false) const;
+
+  // Returns value of Move probability returned from the neural net
+  // (but can be changed by adding Dirichlet noise).
+  float GetP() const { return p_; }
+  void SetP(float val) { p_ = val; }
+
+  // Node of the position after the move, nullptr until it's visited.
+  Node* GetChild() const { return child_.load(std::memory_order_acquire); }
+
+ private:
+  std::atomic<Node*> child_{nullptr};
+  Move move_;
+  float p_ = 0.0f;
+
+  friend class Node;
+};
+
+// An edge together with its node, which is nullptr for edges that are not
+// visited. Returns the statistics of an unvisited node for those.
+class EdgeAndNode {
+ public:
+  EdgeAndNode() = default;
+  EdgeAndNode(Edge* edge, Node* node) : edge_(edge), node_(node) {}
+
+  explicit operator bool() const { return edge_ != nullptr; }
+  bool operator==(const EdgeAndNode& other) const {
+    return edge_ == other.edge_;
+  }
+  bool operator!=(const EdgeAndNode& other) const {
+    return edge_ != other.edge_;
+  }
+
+  Edge* edge() const { return edge_; }
+  Node* node() const { return node_; }
+
+  Move GetMove(bool flip = false) const { return edge_->GetMove(flip); }
+  float GetP() const { return edge_->GetP(); }
+  void SetP(float val) const { edge_->SetP(val); }
+
+  // Node statistics, see Node.
+  uint32_t GetN() const;
+  uint32_t GetNInFlight() const;
+  int GetNStarted() const;
+  float GetQ(float default_q) const;
+  float GetV() const;
+  // Returns U / (Puct * N[parent])
+  float GetU() const { return GetP() / (1 + GetNStarted()); }
+
+ private:
+  Edge* edge_ = nullptr;
+  Node* node_ = nullptr;
+};
+
+class Edge_Iterator {
  public:
-  Node_Iterator(Node* node) : node_(node) {}
-  Node* operator*() { return node_; }
-  Node* operator->() { return node_; }
-  bool operator==(Node_Iterator& other) { return node_ == other.node_; }
-  bool operator!=(Node_Iterator& other) { return node_ != other.node_; }
-  void operator++();
+  Edge_Iterator(Edge* edge) : edge_(edge) {}
+  EdgeAndNode operator*() const { return {edge_, edge_->GetChild()}; }
+  bool operator==(const Edge_Iterator& other) const {
+    return edge_ == other.edge_;
+  }
+  bool operator!=(const Edge_Iterator& other) const {
+    return edge_ != other.edge_;
+  }
+  void operator++() { ++edge_; }
 
  private:
-  Node* node_;
+  Edge* edge_;
 };
 
+// The statistics that change during search (n, n-in-flight, w, q and the
+// depths) are atomics, so that threads can descend and back up through the
+// tree at the same time without a lock. Everything else is written only while
+// a node is being expanded, and the threads that later see n > 0 see it too.
 class Node {
  public:
-  // Resets all values (but not links to parents/children/siblings) to zero.
+  // Resets all values (but not links to parents/children) to zero.
   void ResetStats();
 
-  // Allocates a new node and adds it to front of the children list.
+  // Creates edges for the legal moves, in this order. The node must not have
+  // edges yet. Not thread-friendly.
+  void CreateEdges(const MoveList& moves);
+
+  // Makes the only edge of a node without edges and returns its node.
   // Not thread-friendly.
-  Node* CreateChild(Move m);
+  Node* CreateSingleChildNode(Move m);
+
+  // Returns the node of @edge, which must be one of ours. Creates the node if
+  // the edge was not visited yet. Other threads can do the same at the same
+  // time, all get the same node.
+  Node* GetOrCreateChild(Edge* edge);
+
+  // Releases the nodes below this one, keeping its edges and statistics, so
+  // that its children are visited from scratch again. No other thread may be
+  // in the subtree.
+  void ReleaseChildNodes();
+
+  // Bytes taken by the nodes and edges of all trees.
+  static size_t GetTreeMemoryUsage();
+  // Gives the memory of released nodes back to the system where it can, in
+  // the background.
+  static void ReleaseUnusedMemory();
 
   // Gets parent node.
   Node* GetParent() const { return parent_; }
 
-  // Returns whether a node has children.
-  bool HasChildren() const { return child_ != nullptr; }
+  // Returns whether a node has children (i.e. edges).
+  bool HasChildren() const { return num_edges_ > 0; }
+  int GetNumEdges() const { return num_edges_; }
 
   // Returns move from the point of new of player BEFORE the position.
-  Move GetMove() const { return move_; }
+  Move GetMove() const;
 
   // Returns move, with optional flip (false == player BEFORE the position).
   Move GetMove(bool flip) const;
@@ -68,14 +159,9 @@ class Node {
   // Returns n = n_if_flight.
   int GetNStarted() const { return n_ + n_in_flight_; }
   // Returns Q if number of visits is more than 0,
-  float GetQ(float default_q) const { return n_ ? q_ : default_q; }
-  // Returns U / (Puct * N[parent])
-  float GetU() const { return p_ / (1 + n_ + n_in_flight_); }
+  float GetQ(float default_q) const { return n_ ? q_.load() : default_q; }
   // Returns value of Value Head returned from the neural net.
   float GetV() const { return v_; }
-  // Returns value of Move probabilityreturned from the neural net.
-  // (but can be changed by adding Dirichlet noise).
-  float GetP() const { return p_; }
   // Returns whether the node is known to be draw/lose/win.
   bool IsTerminal() const { return is_terminal_; }
   uint16_t GetFullDepth() const { return full_depth_; }
@@ -83,9 +169,8 @@ class Node {
 
   // Sets node own value (from neural net or win/draw/lose adjudication).
   void SetV(float val) { v_ = val; }
-  // Sets move probability.
-  void SetP(float val) { p_ = val; }
-  // Makes the node terminal and sets it's score.
+  // Makes the node terminal and sets it's score. WHITE_WON means that the
+  // player who moved into the node won, BLACK_WON that they lost.
   void MakeTerminal(GameResult result);
 
   // If this node is not in the process of being expanded by another thread
@@ -101,6 +186,8 @@ class Node {
   // * N-in-flight (-=1)
   // * W (+= v)
   // * Q (=w/n)
+  // Q is stored after the other updates, so it can lag behind a concurrent
+  // update of the same node until the next one.
   void FinalizeScoreUpdate(float v);
 
   // Updates max depth, if new depth is larger.
@@ -110,22 +197,23 @@ class Node {
   // in depth parameter, and returns true if it was indeed updated.
   bool UpdateFullDepth(uint16_t* depth);
 
-  V3TrainingData GetV3TrainingData(GameResult result,
+  V4TrainingData GetV4TrainingData(GameResult result,
                                    const PositionHistory& history) const;
 
-  class NodeRange {
+  class EdgeRange {
    public:
-    Node_Iterator begin() { return Node_Iterator(node_); }
-    Node_Iterator end() { return Node_Iterator(nullptr); }
+    Edge_Iterator begin() const { return Edge_Iterator(begin_); }
+    Edge_Iterator end() const { return Edge_Iterator(end_); }
 
    private:
-    NodeRange(Node* node) : node_(node) {}
-    Node* node_;
+    EdgeRange(Edge* begin, Edge* end) : begin_(begin), end_(end) {}
+    Edge* begin_;
+    Edge* end_;
     friend class Node;
   };
 
-  // Returns range for iterating over children.
-  NodeRange Children() const { return child_; }
+  // Returns range for iterating over the edges, visited or not.
+  EdgeRange Edges() const { return {edges_, edges_ + num_edges_}; }
 
   // Debug information about the node.
   std::string DebugString() const;
@@ -133,50 +221,54 @@ class Node {
   class Pool;
 
  private:
-  // Move corresponding to this node. From the point of view of a player,
-  // i.e. black's e7e5 is stored as e2e4.
-  // Root node contains move a1a1.
-  Move move_;
+  // Pointer to a parent node. nullptr for the root.
+  Node* parent_;
+  // Edges of the legal moves, nullptr for a leaf node.
+  Edge* edges_;
 
-  // Q value fetched from neural network.
-  float v_;
   // Average value (from value head of neural network) of all visited nodes in
   // subtree. Terminal nodes (which lead to checkmate or draw) may be visited
   // several times, those are counted several times. q = w / n
-  float q_;
+  std::atomic<float> q_;
   // Sum of values of all visited nodes in a subtree. Used to compute an
   // average.
-  float w_;
-  // Probabality that this move will be made. From policy head of the neural
-  // network.
-  float p_;
+  std::atomic<float> w_;
   // How many completed visits this node had.
-  uint32_t n_;
+  std::atomic<uint32_t> n_;
   // (aka virtual loss). How many threads currently process this node (started
   // but not finished). This value is added to n during selection which node
   // to pick in MCTS, and also when selecting the best move.
-  uint16_t n_in_flight_;
+  std::atomic<uint16_t> n_in_flight_;
 
   // Maximum depth any subnodes of this node were looked at.
-  uint16_t max_depth_;
+  std::atomic<uint16_t> max_depth_;
   // Complete depth all subnodes of this node were fully searched.
-  uint16_t full_depth_;
+  std::atomic<uint16_t> full_depth_;
+
+  // Q value fetched from neural network.
+  float v_;
+  // Index of our edge in parent_->edges_.
+  uint16_t index_;
+  // There are at most 218 legal moves.
+  uint8_t num_edges_;
   // Does this node end game (with a winning of either sides or draw).
   bool is_terminal_;
 
-  // Pointer to a parent node. nullptr for the root.
-  Node* parent_;
-  // Pointer to a first child. nullptr for leave node.
-  Node* child_;
-  // Pointer to a next sibling. nullptr if there are no further siblings.
-  Node* sibling_;
-
   // TODO(mooskagh) Unfriend both NodeTree and Node::Pool.
   friend class NodeTree;
-  friend class Node_Iterator;
 };
 
-inline void Node_Iterator::operator++() { node_ = node_->sibling_; }
+inline uint32_t EdgeAndNode::GetN() const { return node_ ? node_->GetN() : 0; }
+inline uint32_t EdgeAndNode::GetNInFlight() const {
+  return node_ ? node_->GetNInFlight() : 0;
+}
+inline int EdgeAndNode::GetNStarted() const {
+  return node_ ? node_->GetNStarted() : 0;
+}
+inline float EdgeAndNode::GetQ(float default_q) const {
+  return node_ ? node_->GetQ(default_q) : default_q;
+}
+inline float EdgeAndNode::GetV() const { return node_ ? node_->GetV() : 0.0f; }
 
 class NodeTree {
  public:
@@ -0,0 +1,92 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mcts/node.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+
+namespace lczero {
+
+namespace {
+// Adds the edges of the head of @tree and a node for each of them.
+void Expand(const NodeTree& tree) {
+  Node* head = tree.GetCurrentHead();
+  head->CreateEdges(tree.HeadPosition().GetBoard().GenerateLegalMoves());
+  for (const auto& edge : head->Edges()) head->GetOrCreateChild(edge.edge());
+}
+
+// Waits for the release thread to get the usage down to @bytes.
+bool WaitForTreeMemoryUsage(size_t bytes) {
+  for (int i = 0; i < 1000; ++i) {
+    if (Node::GetTreeMemoryUsage() == bytes) return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return false;
+}
+}  // namespace
+
+TEST(Node, CountsTreeMemory) {
+  const size_t initial = Node::GetTreeMemoryUsage();
+  {
+    NodeTree tree;
+    tree.ResetToPosition(ChessBoard::kStartingFen, {});
+    EXPECT_EQ(Node::GetTreeMemoryUsage(), initial + sizeof(Node));
+
+    Expand(tree);
+    EXPECT_EQ(Node::GetTreeMemoryUsage(),
+              initial + 21 * sizeof(Node) + 20 * sizeof(Edge));
+  }
+  EXPECT_TRUE(WaitForTreeMemoryUsage(initial));
+}
+
+TEST(Node, CountsTreeMemoryOfExitedThreads) {
+  const size_t initial = Node::GetTreeMemoryUsage();
+  {
+    NodeTree tree;
+    tree.ResetToPosition(ChessBoard::kStartingFen, {});
+    std::thread([&tree]() { Expand(tree); }).join();
+    EXPECT_EQ(Node::GetTreeMemoryUsage(),
+              initial + 21 * sizeof(Node) + 20 * sizeof(Edge));
+  }
+  EXPECT_TRUE(WaitForTreeMemoryUsage(initial));
+}
+
+TEST(Node, ReleaseChildNodesKeepsEdgesAndStats) {
+  const size_t initial = Node::GetTreeMemoryUsage();
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartingFen, {});
+  Node* head = tree.GetCurrentHead();
+  Expand(tree);
+  ASSERT_TRUE(head->TryStartScoreUpdate());
+  head->FinalizeScoreUpdate(0.5f);
+
+  head->ReleaseChildNodes();
+  EXPECT_EQ(head->GetNumEdges(), 20);
+  EXPECT_EQ(head->GetN(), 1u);
+  for (const auto& edge : head->Edges()) EXPECT_EQ(edge.node(), nullptr);
+  EXPECT_TRUE(WaitForTreeMemoryUsage(initial + sizeof(Node) +
+                                     20 * sizeof(Edge)));
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -21,15 +21,24 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <thread>
+#include <unordered_set>
 
 #include "mcts/node.h"
 #include "neural/cache.h"
 #include "neural/encoder.h"
+#include "utils/affinity.h"
+#include "utils/hugepages.h"
 #include "utils/random.h"
+#include "utils/trace.h"
 
 namespace lczero {
 
@@ -45,10 +54,25 @@ const char* Search::kVirtualLossBugStr = "Virtual loss bug";
 const char* Search::kFpuReductionStr = "First Play Urgency Reduction";
 const char* Search::kCacheHistoryLengthStr =
     "Length of history to include in cache";
+const char* Search::kPinThreadsStr = "Pin search threads to cores";
+const char* Search::kBatchesInFlightStr =
+    "NN batches in flight per search thread";
+const char* Search::kTranspositionsStr = "Share evaluations of transpositions";
+const char* Search::kSearchStatsStr = "Display search performance counters";
+const char* Search::kAllowedCollisionsStr =
+    "Collisions allowed while gathering a minibatch";
+const char* Search::kTreeMemoryStr = "Max memory of search trees in MiB";
 
 namespace {
 const int kSmartPruningToleranceNodes = 100;
 const int kSmartPruningToleranceMs = 200;
+// How often at most the reporter outputs info and checks the limits.
+const int kReporterIntervalMs = 10;
+// The nps of smart pruning is measured over windows of that length.
+const int kNpsWindowMs = 100;
+// Pruning brings the tree memory down to that share of the budget, so that
+// it's not pruned again right away.
+const float kPruneTarget = 0.8f;
 }  // namespace
 
 void Search::PopulateUciParams(OptionsParser* options) {
@@ -66,19 +90,29 @@ void Search::PopulateUciParams(OptionsParser* options) {
       0.2f;
   options->Add<IntOption>(kCacheHistoryLengthStr, 1, 8,
                           "cache-history-length") = 8;
+  options->Add<BoolOption>(kPinThreadsStr, "pin-threads") = false;
+  options->Add<IntOption>(kBatchesInFlightStr, 1, 8, "batches-in-flight") = 1;
+  options->Add<BoolOption>(kTranspositionsStr, "transpositions") = false;
+  options->Add<BoolOption>(kSearchStatsStr, "search-stats") = false;
+  options->Add<IntOption>(kAllowedCollisionsStr, 0, 1024,
+                          "allowed-collisions") = 32;
+  options->Add<IntOption>(kTreeMemoryStr, 0, 1024 * 1024, "tree-memory") = 0;
 }
 
 Search::Search(const NodeTree& tree, Network* network,
                BestMoveInfo::Callback best_move_callback,
                ThinkingInfo::Callback info_callback, const SearchLimits& limits,
-               const OptionsDict& options, NNCache* cache)
+               const OptionsDict& options, NNCache* cache,
+               SyzygyTablebase* syzygy_tb)
     : root_node_(tree.GetCurrentHead()),
       cache_(cache),
+      syzygy_tb_(syzygy_tb),
       played_history_(tree.GetPositionHistory()),
       network_(network),
       limits_(limits),
       start_time_(std::chrono::steady_clock::now()),
       initial_visits_(root_node_->GetN()),
+      prefetch_batch_(options.Get<int>(kMiniPrefetchBatchStr)),
       best_move_callback_(best_move_callback),
       info_callback_(info_callback),
       kMiniBatchSize(options.Get<int>(kMiniBatchSizeStr)),
@@ -91,42 +125,43 @@ Search::Search(const NodeTree& tree, Network* network,
       kSmartPruning(options.Get<bool>(kSmartPruningStr)),
       kVirtualLossBug(options.Get<float>(kVirtualLossBugStr)),
       kFpuReduction(options.Get<float>(kFpuReductionStr)),
-      kCacheHistoryLength(options.Get<int>(kCacheHistoryLengthStr)) {}
+      kCacheHistoryLength(options.Get<int>(kCacheHistoryLengthStr)),
+      kPinThreads(options.Get<bool>(kPinThreadsStr)),
+      kBatchesInFlight(options.Get<int>(kBatchesInFlightStr)),
+      kTranspositions(options.Get<bool>(kTranspositionsStr)),
+      kSearchStats(options.Get<bool>(kSearchStatsStr)),
+      kAllowedCollisions(options.Get<int>(kAllowedCollisionsStr)),
+      kTreeMemory(size_t(options.Get<int>(kTreeMemoryStr)) * 1024 * 1024) {}
 
 // Returns whether node was already in cache.
 bool Search::AddNodeToCompute(Node* node, CachingComputation* computation,
                               const PositionHistory& history,
-                              bool add_if_cached) {
+                              int prefetch_depth) {
   auto hash = history.HashLast(kCacheHistoryLength);
   // If already in cache, no need to do anything.
-  if (add_if_cached) {
+  if (prefetch_depth == 0) {
     if (computation->AddInputByHash(hash)) return true;
   } else {
     if (cache_->ContainsKey(hash)) return true;
   }
-  auto planes = EncodePositionForNN(history);
-
   std::vector<uint16_t> moves;
 
-  if (node->HasChildren()) {
+  if (node && node->HasChildren()) {
     // Legal moves are known, using them.
-    for (Node* iter : node->Children()) {
-      moves.emplace_back(iter->GetMove().as_nn_index());
+    for (const auto& edge : node->Edges()) {
+      moves.emplace_back(edge.GetMove().as_nn_index());
     }
   } else {
-    // Cache pseudolegal moves. A bit of a waste, but faster.
-    const auto& pseudolegal_moves =
-        history.Last().GetBoard().GeneratePseudolegalMoves();
-    moves.reserve(pseudolegal_moves.size());
-    // As an optimization, store moves in reverse order in cache, because
-    // that's the order nodes are listed in nodelist.
-    for (auto iter = pseudolegal_moves.rbegin(), end = pseudolegal_moves.rend();
-         iter != end; ++iter) {
-      moves.emplace_back(iter->as_nn_index());
+    // The cache keeps priors without their moves, in the order of the
+    // edges, which ExtendNode() creates in the order of the legal moves.
+    const auto& legal_moves = history.Last().GetBoard().GenerateLegalMoves();
+    moves.reserve(legal_moves.size());
+    for (const auto& move : legal_moves) {
+      moves.emplace_back(move.as_nn_index());
     }
   }
 
-  computation->AddInput(hash, std::move(planes), std::move(moves));
+  computation->AddInput(hash, history, std::move(moves), prefetch_depth);
   return false;
 }
 
@@ -136,8 +171,8 @@ void ApplyDirichletNoise(Node* node, float eps, double alpha) {
   std::vector<float> noise;
 
   // TODO(mooskagh) remove this loop when we store number of children.
-  for (Node* iter : node->Children()) {
-    (void)iter;  // Silence the unused variable warning.
+  for (const auto& edge : node->Edges()) {
+    (void)edge;  // Silence the unused variable warning.
     float eta = Random::Get().GetGamma(alpha, 1.0);
     noise.emplace_back(eta);
     total += eta;
@@ -146,147 +181,411 @@ void ApplyDirichletNoise(Node* node, float eps, double alpha) {
   if (total < std::numeric_limits<float>::min()) return;
 
   int noise_idx = 0;
-  for (Node* iter : node->Children()) {
-    iter->SetP(iter->GetP() * (1 - eps) + eps * noise[noise_idx++] / total);
+  for (const auto& edge : node->Edges()) {
+    edge.SetP(edge.GetP() * (1 - eps) + eps * noise[noise_idx++] / total);
   }
 }
 }  // namespace
 
+namespace {
+// Threads which compute the minibatches of one search worker while it
+// gathers the next ones. They live as long as the worker, so that the
+// backend sets each of them up once, e.g. selects the GPU.
+class ComputeThreads {
+ public:
+  ComputeThreads(Network* network, int count) {
+    for (int i = 0; i < count; ++i) {
+      threads_.emplace_back([this, network]() {
+        network->InitThread();
+        Run();
+      });
+    }
+  }
+
+  // Runs what is still queued first.
+  ~ComputeThreads() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      exit_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) thread.join();
+  }
+
+  std::future<void> Post(std::function<void()> work) {
+    std::packaged_task<void()> task(std::move(work));
+    auto result = task.get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+    return result;
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return exit_ || !tasks_.empty(); });
+      if (tasks_.empty()) return;
+      auto task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::packaged_task<void()>> tasks_;
+  bool exit_ = false;
+  std::vector<std::thread> threads_;
+};
+}  // namespace
+
 void Search::Worker() {
-  std::vector<Node*> nodes_to_process;
   PositionHistory history(played_history_);
+  // Batches gathered and sent to the network, oldest first. With more than
+  // one batch in flight, the network computes the older ones on helper
+  // threads while this thread gathers the next one under virtual loss.
+  std::deque<Minibatch> in_flight;
+  // As many as there can be batches in flight besides the one gathered.
+  std::unique_ptr<ComputeThreads> helpers;
+  if (kBatchesInFlight > 1) {
+    helpers = std::make_unique<ComputeThreads>(network_, kBatchesInFlight - 1);
+  }
 
   // Exit check is at the end of the loop as at least one iteration is
   // necessary.
   while (true) {
-    nodes_to_process.clear();
-    auto computation = CachingComputation(network_->NewComputation(), cache_);
-
-    // Gather nodes to process in the current batch.
-    for (int i = 0; i < kMiniBatchSize; ++i) {
-      // Initialize position sequence with pre-move position.
-      history.Trim(played_history_.GetLength());
-      // If there's something to do without touching slow neural net, do it.
-      if (i > 0 && computation.GetCacheMisses() == 0) break;
-      Node* node = PickNodeToExtend(root_node_, &history);
-      // If we hit the node that is already processed (by our batch or in
-      // another thread) stop gathering and process smaller batch.
-      if (!node) break;
-
-      nodes_to_process.push_back(node);
-      // If node is already known as terminal (win/lose/draw according to rules
-      // of the game), it means that we already visited this node before.
-      if (node->IsTerminal()) continue;
-
-      ExtendNode(node, history);
-
-      // If node turned out to be a terminal one, no need to send to NN for
-      // evaluation.
-      if (!node->IsTerminal()) {
-        AddNodeToCompute(node, &computation, history);
+    in_flight.emplace_back();
+    Minibatch& batch = in_flight.back();
+    batch.progress_epoch = progress_epoch_;
+    batch.computation = std::make_unique<CachingComputation>(
+        network_->NewComputation(), cache_);
+    {
+      const auto tree_lock = LockTreeShared();
+      GatherMinibatch(&batch, &history);
+    }
+
+    // Evaluate nodes through NN.
+    if (batch.computation->GetBatchSize() != 0) {
+      Minibatch* computed = &batch;
+      const auto compute = [computed]() {
+        TraceScope trace("search compute");
+        const auto start = std::chrono::steady_clock::now();
+        computed->computation->ComputeBlocking();
+        computed->nn_ms = std::chrono::duration<float, std::milli>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+      };
+      if (kBatchesInFlight > 1) {
+        // Elements of a deque stay in place when others are added or removed
+        // at its ends.
+        batch.computed = helpers->Post(compute);
+      } else {
+        compute();
       }
     }
 
-    // If there are requests to NN, but the batch is not full, try to prefetch
-    // nodes which are likely useful in future.
-    if (computation.GetCacheMisses() > 0 &&
-        computation.GetCacheMisses() < kMiniPrefetchBatch) {
-      history.Trim(played_history_.GetLength());
-      SharedMutex::SharedLock lock(nodes_mutex_);
-      PrefetchIntoCache(root_node_,
-                        kMiniPrefetchBatch - computation.GetCacheMisses(),
-                        &computation, &history);
+    // Keep gathering until the pipeline is full, unless stopping.
+    if (static_cast<int>(in_flight.size()) < kBatchesInFlight &&
+        !IsStopRequested()) {
+      continue;
     }
 
-    // Evaluate nodes through NN.
-    if (computation.GetBatchSize() != 0) {
-      computation.ComputeBlocking();
-
-      int idx_in_computation = 0;
-      for (Node* node : nodes_to_process) {
-        if (node->IsTerminal()) continue;
-        // Populate Q value.
-        node->SetV(-computation.GetQVal(idx_in_computation));
-        // Populate P values.
-        float total = 0.0;
-        for (Node* n : node->Children()) {
-          float p = computation.GetPVal(idx_in_computation,
-                                        n->GetMove().as_nn_index());
-          total += p;
-          n->SetP(p);
-        }
-        // Scale P values to add up to 1.0.
-        if (total > 0.0f) {
-          float scale = 1.0f / total;
-          for (Node* n : node->Children()) n->SetP(n->GetP() * scale);
-        }
-        // Add Dirichlet noise if enabled and at root.
-        if (kNoise && node == root_node_) {
-          ApplyDirichletNoise(node, 0.25, 0.3);
-        }
-        ++idx_in_computation;
+    const uint64_t progress_epoch = in_flight.front().progress_epoch;
+    const bool had_work = FinishOldestMinibatch(&in_flight);
+    // The reporter would notice too, but only at its next interval.
+    if (ShouldStop()) MaybeTriggerStop();
+
+    // If required to stop, stop. Back up the batches still in flight first,
+    // so that no virtual loss is left in the tree.
+    if (IsStopRequested()) {
+      while (!in_flight.empty()) FinishOldestMinibatch(&in_flight);
+      break;
+    }
+    // If this thread had no work, every leaf it tried is being evaluated by
+    // another thread. Wait until one of those is backed up. With batches of
+    // our own in flight, finishing them is progress already.
+    if (!had_work && in_flight.empty()) {
+      TraceScope trace("search idle");
+      const auto start = std::chrono::steady_clock::now();
+      WaitForProgress(progress_epoch);
+      if (kSearchStats) {
+        Mutex::Lock lock(counters_mutex_);
+        perf_counters_.idle_us +=
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
       }
     }
+  }
+}
 
-    {
-      // Update nodes.
-      SharedMutex::Lock lock(nodes_mutex_);
-      for (Node* node : nodes_to_process) {
-        float v = node->GetV();
-        // Maximum depth the node is explored.
-        uint16_t depth = 0;
-        // If the node is terminal, mark it as fully explored to an infinite
-        // depth.
-        uint16_t cur_full_depth = node->IsTerminal() ? 999 : 0;
-        bool full_depth_updated = true;
-        for (Node* n = node; n != root_node_->GetParent(); n = n->GetParent()) {
-          ++depth;
-          n->FinalizeScoreUpdate(v);
-          // Q will be flipped for opponent.
-          v = -v;
-
-          // Updating stats.
-          // Max depth.
-          n->UpdateMaxDepth(depth);
-          // Full depth.
-          if (full_depth_updated)
-            full_depth_updated = n->UpdateFullDepth(&cur_full_depth);
-          // Best move.
-          if (n->GetParent() == root_node_) {
-            if (!best_move_node_ || best_move_node_->GetN() < n->GetN()) {
-              best_move_node_ = n;
-            }
-          }
-        }
-      }
-      total_playouts_ += nodes_to_process.size();
+void Search::WaitForProgress(uint64_t progress_epoch) {
+  std::unique_lock<std::mutex> lock(progress_mutex_);
+  // WakeIdleWorkers() only notifies when someone is idle, so announce that
+  // before looking at the epoch.
+  ++idle_workers_;
+  progress_cv_.wait(lock,
+                    [&]() { return progress_epoch_ != progress_epoch; });
+  --idle_workers_;
+}
+
+void Search::WakeIdleWorkers() {
+  ++progress_epoch_;
+  if (idle_workers_ > 0) {
+    std::lock_guard<std::mutex> lock(progress_mutex_);
+    progress_cv_.notify_all();
+  }
+}
+
+bool Search::IsStopRequested() const { return stop_; }
+
+bool Search::ShouldStop() const {
+  const uint64_t playouts = total_playouts_;
+  // Don't stop when the root node is not yet expanded.
+  if (playouts == 0) return false;
+  // If smart pruning tells to stop (best move found), stop.
+  if (found_best_move_) return true;
+  // Stop if reached playouts limit.
+  if (limits_.playouts >= 0 && playouts >= limits_.playouts) return true;
+  // Stop if reached visits limit.
+  if (limits_.visits >= 0 && playouts + initial_visits_ >= limits_.visits) {
+    return true;
+  }
+  // Stop if reached time limit.
+  return limits_.time_ms >= 0 && GetTimeSinceStart() >= limits_.time_ms;
+}
+
+bool Search::FinishOldestMinibatch(std::deque<Minibatch>* in_flight) {
+  Minibatch& oldest = in_flight->front();
+  if (oldest.computed.valid()) {
+    TraceScope trace("search wait");
+    oldest.computed.get();
+  }
+  TraceScope trace("search backup");
+  const auto tree_lock = LockTreeShared();
+  FetchMinibatchResults(oldest);
+  DoBackupUpdate(oldest.nodes_to_process);
+  UpdatePrefetchStats(oldest.computation->GetPrefetchStats());
+  if (kSearchStats) UpdatePerfCounters(oldest);
+  const bool had_work = !oldest.nodes_to_process.empty();
+  in_flight->pop_front();
+  return had_work;
+}
+
+void Search::GatherMinibatch(Minibatch* batch, PositionHistory* history) {
+  TraceScope trace("search gather");
+  CachingComputation* computation = batch->computation.get();
+  // Picks which ran into a node already being processed. Their paths keep
+  // the virtual loss until the batch is gathered, so that the next picks
+  // go elsewhere.
+  std::vector<Node*> collided;
+  // Gather nodes to process in the current batch.
+  for (int i = 0;
+       static_cast<int>(batch->nodes_to_process.size()) < kMiniBatchSize;
+       ++i) {
+    // Initialize position sequence with pre-move position.
+    history->Trim(played_history_.GetLength());
+    // If there's something to do without touching slow neural net, do it.
+    if (i > 0 && computation->GetCacheMisses() == 0) break;
+    bool is_collision = false;
+    Node* node = PickNodeToExtend(root_node_, history, &is_collision);
+    // If we hit the node that is already processed (by our batch or in
+    // another thread), try another one, until too many did.
+    if (is_collision) {
+      ++batch->collisions;
+      collided.push_back(node);
+      if (batch->collisions > kAllowedCollisions) break;
+      continue;
     }
-    UpdateRemainingMoves();  // Update remaining moves using smart pruning.
-    MaybeOutputInfo();
-    MaybeTriggerStop();
 
-    // If required to stop, stop.
-    {
-      Mutex::Lock lock(counters_mutex_);
-      if (stop_) break;
+    batch->nodes_to_process.push_back(node);
+    // If node is already known as terminal (win/lose/draw according to rules
+    // of the game), it means that we already visited this node before.
+    if (node->IsTerminal()) continue;
+
+    ExtendNode(node, *history);
+
+    // If node turned out to be a terminal one, no need to send to NN for
+    // evaluation. Neither if its position was evaluated in another node.
+    if (!node->IsTerminal() && !CopyTransposition(node, *history)) {
+      batch->nodes_to_evaluate.push_back(node);
+      if (AddNodeToCompute(node, computation, *history)) ++batch->cache_hits;
+    }
+  }
+  for (Node* node : collided) CancelCollision(node);
+
+  // If there are requests to NN, but the batch is not full, try to prefetch
+  // nodes which are likely useful in future.
+  const int prefetch_batch = prefetch_batch_;
+  if (computation->GetCacheMisses() > 0 &&
+      computation->GetCacheMisses() < prefetch_batch) {
+    TraceScope trace("search prefetch");
+    history->Trim(played_history_.GetLength());
+    PrefetchIntoCache(root_node_,
+                      prefetch_batch - computation->GetCacheMisses(), 0,
+                      computation, history);
+  }
+}
+
+void Search::UpdatePerfCounters(const Minibatch& batch) {
+  Mutex::Lock lock(counters_mutex_);
+  PerfCounters& counters = perf_counters_;
+  const int misses = batch.computation->GetCacheMisses();
+  if (misses > 0) {
+    int bucket = 0;
+    while (bucket + 1 < PerfCounters::kBatchSizeBuckets &&
+           misses >= (2 << bucket)) {
+      ++bucket;
     }
-    if (nodes_to_process.empty()) {
-      // If this thread had no work, sleep for some milliseconds.
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ++counters.batch_sizes[bucket];
+    if (counters.nn_ms.size() < PerfCounters::kLatencySamples) {
+      counters.nn_ms.push_back(batch.nn_ms);
+    } else {
+      counters.nn_ms[counters.next_nn_ms] = batch.nn_ms;
     }
+    counters.next_nn_ms = (counters.next_nn_ms + 1) %
+                          PerfCounters::kLatencySamples;
   }
-}  // namespace lczero
+  counters.lookups += batch.nodes_to_evaluate.size();
+  counters.cache_hits += batch.cache_hits;
+  counters.collisions += batch.collisions;
+}
+
+void Search::UpdatePrefetchStats(const PrefetchStats& stats) {
+  // Number of batches between adaptations, and the fractions of prefetches
+  // used below which the budget shrinks and above which it grows.
+  const int kWindowBatches = 64;
+  const float kLowHitRate = 0.2f;
+  const float kHighHitRate = 0.5f;
 
-// Prefetches up to @budget nodes into cache. Returns number of nodes
-// prefetched.
-int Search::PrefetchIntoCache(Node* node, int budget,
+  Mutex::Lock lock(counters_mutex_);
+  prefetch_stats_.Add(stats);
+  prefetch_window_.Add(stats);
+  if (++prefetch_window_batches_ < kWindowBatches) return;
+
+  const int computed = prefetch_window_.TotalComputed();
+  const float hit_rate =
+      computed > 0 ? float(prefetch_window_.TotalHits()) / computed : 1.0f;
+  int batch = prefetch_batch_;
+  if (hit_rate >= kHighHitRate) {
+    batch = std::min(kMiniPrefetchBatch, batch + std::max(1, batch / 4));
+  } else if (hit_rate < kLowHitRate) {
+    batch = std::max(1, batch - std::max(1, batch / 4));
+  }
+  // Keep 0 when prefetching is disabled.
+  prefetch_batch_ = std::min(batch, kMiniPrefetchBatch);
+
+  // The deepest level prefetched decides about the depth limit: it's cut
+  // when those are wasted, and lifted when they are used and the limit is
+  // what stopped the prefetch.
+  int deepest = 0;
+  for (int i = 0; i < PrefetchStats::kMaxDepth; ++i) {
+    if (prefetch_window_.computed[i] > 0) deepest = i + 1;
+  }
+  if (deepest > 0) {
+    const float deepest_hit_rate =
+        float(prefetch_window_.hits[deepest - 1]) /
+        prefetch_window_.computed[deepest - 1];
+    if (deepest_hit_rate < kLowHitRate && deepest > 1) {
+      prefetch_depth_ = deepest - 1;
+    } else if (deepest_hit_rate >= kHighHitRate &&
+               deepest >= prefetch_depth_) {
+      prefetch_depth_ =
+          std::min(PrefetchStats::kMaxDepth, prefetch_depth_ + 1);
+    }
+  }
+
+  prefetch_window_ = PrefetchStats();
+  prefetch_window_batches_ = 0;
+}
+
+void Search::FetchMinibatchResults(const Minibatch& batch) {
+  const CachingComputation& computation = *batch.computation;
+  if (computation.GetBatchSize() == 0) return;
+  int idx_in_computation = 0;
+  std::vector<uint16_t> move_ids;
+  std::vector<float> priors;
+  for (Node* node : batch.nodes_to_evaluate) {
+    // Populate Q value.
+    node->SetV(-computation.GetQVal(idx_in_computation));
+    // Populate P values.
+    move_ids.clear();
+    for (const auto& edge : node->Edges()) {
+      move_ids.push_back(edge.GetMove().as_nn_index());
+    }
+    priors.resize(move_ids.size());
+    computation.GetPVals(idx_in_computation, move_ids.data(), move_ids.size(),
+                         priors.data());
+    float total = 0.0;
+    for (float p : priors) total += p;
+    // Scale P values to add up to 1.0.
+    const float scale = total > 0.0f ? 1.0f / total : 1.0f;
+    int idx = 0;
+    for (const auto& edge : node->Edges()) edge.SetP(priors[idx++] * scale);
+    // Add Dirichlet noise if enabled and at root.
+    if (kNoise && node == root_node_) {
+      ApplyDirichletNoise(node, 0.25, 0.3);
+    }
+    ++idx_in_computation;
+  }
+}
+
+void Search::DoBackupUpdate(const std::vector<Node*>& nodes_to_process) {
+  // Update nodes. Other threads may be descending through or backing up
+  // the same nodes at the same time.
+  for (Node* node : nodes_to_process) {
+    float v = node->GetV();
+    // Maximum depth the node is explored.
+    uint16_t depth = 0;
+    // If the node is terminal, mark it as fully explored to an infinite
+    // depth.
+    uint16_t cur_full_depth = node->IsTerminal() ? 999 : 0;
+    bool full_depth_updated = true;
+    for (Node* n = node; n != root_node_->GetParent(); n = n->GetParent()) {
+      ++depth;
+      n->FinalizeScoreUpdate(v);
+      // Q will be flipped for opponent.
+      v = -v;
+
+      // Updating stats.
+      // Max depth.
+      n->UpdateMaxDepth(depth);
+      // Full depth.
+      if (full_depth_updated)
+        full_depth_updated = n->UpdateFullDepth(&cur_full_depth);
+      // Best move.
+      if (n->GetParent() == root_node_) {
+        Node* best = best_move_node_;
+        while ((!best || best->GetN() < n->GetN()) &&
+               !best_move_node_.compare_exchange_weak(best, n)) {
+        }
+      }
+    }
+  }
+  total_playouts_ += nodes_to_process.size();
+  if (!nodes_to_process.empty()) {
+    WakeIdleWorkers();
+    NotifyReporter();
+  }
+}
+
+// Prefetches up to @budget nodes into cache, not deeper than prefetch_depth_
+// plies below the root. @node is @depth plies below the root. Returns number
+// of nodes prefetched.
+int Search::PrefetchIntoCache(Node* node, int budget, int depth,
                               CachingComputation* computation,
                               PositionHistory* history) {
-  if (budget <= 0) return 0;
+  if (budget <= 0 || depth > prefetch_depth_) return 0;
 
   // We are in a leaf, which is not yet being processed.
-  if (node->GetNStarted() == 0) {
-    if (AddNodeToCompute(node, computation, *history, false)) {
+  if (!node || node->GetNStarted() == 0) {
+    if (AddNodeToCompute(node, computation, *history, std::max(depth, 1))) {
       // Make it return 0 to make it not use the slot, so that the function
       // tries hard to find something to cache even among unpopular moves.
       // In practice that slows things down a lot though, as it's not always
@@ -297,18 +596,22 @@ int Search::PrefetchIntoCache(Node* node, int budget,
   }
 
   // If it's a node in progress of expansion or is terminal, not prefetching.
-  if (!node->HasChildren()) return 0;
+  // Its children may still be being created while N is 0.
+  if (node->GetN() == 0 || !node->HasChildren()) return 0;
 
   // Populate all subnodes and their scores.
-  typedef std::pair<float, Node*> ScoredNode;
-  std::vector<ScoredNode> scores;
+  typedef std::pair<float, EdgeAndNode> ScoredEdge;
+  std::vector<ScoredEdge> scores;
   float factor = kCpuct * std::sqrt(std::max(node->GetN(), 1u));
   const float parent_q = -node->GetQ(0) - kFpuReduction;
-  for (Node* iter : node->Children()) {
-    if (iter->GetP() == 0.0f) continue;
+  for (const auto& edge : node->Edges()) {
+    if (edge.GetP() == 0.0f) continue;
     // Flipping sign of a score to be able to easily sort.
-    scores.emplace_back(-factor * iter->GetU() - iter->GetQ(parent_q), iter);
+    scores.emplace_back(-factor * edge.GetU() - edge.GetQ(parent_q), edge);
   }
+  const auto by_score = [](const ScoredEdge& a, const ScoredEdge& b) {
+    return a.first < b.first;
+  };
 
   int first_unsorted_index = 0;
   int total_budget_spent = 0;
@@ -324,27 +627,30 @@ int Search::PrefetchIntoCache(Node* node, int budget,
           static_cast<int>(scores.size()),
           budget < 2 ? first_unsorted_index + 2 : first_unsorted_index + 3);
       std::partial_sort(scores.begin() + first_unsorted_index,
-                        scores.begin() + new_unsorted_index, scores.end());
+                        scores.begin() + new_unsorted_index, scores.end(),
+                        by_score);
       first_unsorted_index = new_unsorted_index;
     }
 
-    Node* n = scores[i].second;
+    const EdgeAndNode& edge = scores[i].second;
     // Last node gets the same budget as prev-to-last node.
     if (i != scores.size() - 1) {
       // Sign of the score was flipped for sorting, flipping back.
       const float next_score = -scores[i + 1].first;
-      const float q = n->GetQ(-parent_q);
+      const float q = edge.GetQ(-parent_q);
       if (next_score > q) {
         budget_to_spend = std::min(
-            budget,
-            int(n->GetP() * factor / (next_score - q) - n->GetNStarted()) + 1);
+            budget, int(edge.GetP() * factor / (next_score - q) -
+                        edge.GetNStarted()) +
+                        1);
       } else {
         budget_to_spend = budget;
       }
     }
-    history->Append(n->GetMove());
+    history->Append(edge.GetMove());
     const int budget_spent =
-        PrefetchIntoCache(n, budget_to_spend, computation, history);
+        PrefetchIntoCache(edge.node(), budget_to_spend, depth + 1, computation,
+                          history);
     history->Pop();
     budget -= budget_spent;
     total_budget_spent += budget_spent;
@@ -354,25 +660,26 @@ int Search::PrefetchIntoCache(Node* node, int budget,
 
 namespace {
 // Returns a child with most visits.
-Node* GetBestChild(Node* parent) {
-  Node* best_node = nullptr;
+EdgeAndNode GetBestChild(const Node* parent) {
+  EdgeAndNode best_edge;
   std::pair<int, float> best(-1, 0.0);
-  for (Node* node : parent->Children()) {
-    std::pair<int, float> val(node->GetNStarted(), node->GetP());
+  for (const auto& edge : parent->Edges()) {
+    std::pair<int, float> val(edge.GetNStarted(), edge.GetP());
     if (val > best) {
       best = val;
-      best_node = node;
+      best_edge = edge;
     }
   }
-  return best_node;
+  return best_edge;
 }
 
-Node* GetBestChildWithTemperature(Node* parent, float temperature) {
+EdgeAndNode GetBestChildWithTemperature(const Node* parent,
+                                        float temperature) {
   std::vector<double> cumulative_sums;
   double sum = 0.0;
 
-  for (Node* node : parent->Children()) {
-    sum += std::pow(node->GetNStarted(), 1 / temperature);
+  for (const auto& edge : parent->Edges()) {
+    sum += std::pow(edge.GetNStarted(), 1 / temperature);
     cumulative_sums.push_back(sum);
   }
 
@@ -381,16 +688,18 @@ Node* GetBestChildWithTemperature(Node* parent, float temperature) {
       std::lower_bound(cumulative_sums.begin(), cumulative_sums.end(), toss) -
       cumulative_sums.begin();
 
-  for (Node* node : parent->Children()) {
-    if (idx-- == 0) return node;
+  for (const auto& edge : parent->Edges()) {
+    if (idx-- == 0) return edge;
   }
   assert(false);
+  return {};
 }
 }  // namespace
 
-void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
-  if (!best_move_node_) return;
-  last_outputted_best_move_node_ = best_move_node_;
+void Search::SendUciInfo() REQUIRES(counters_mutex_) {
+  Node* const best_move_node = best_move_node_;
+  if (!best_move_node) return;
+  last_outputted_best_move_node_ = best_move_node;
   uci_info_.depth = root_node_->GetFullDepth();
   uci_info_.seldepth = root_node_->GetMaxDepth();
   uci_info_.time = GetTimeSinceStart();
@@ -399,25 +708,63 @@ void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
       cache_->GetSize() * 1000LL / std::max(cache_->GetCapacity(), 1);
   uci_info_.nps =
       uci_info_.time ? (total_playouts_ * 1000 / uci_info_.time) : 0;
-  uci_info_.score = 290.680623072 * tan(1.548090806 * best_move_node_->GetQ(0));
+  uci_info_.score = 290.680623072 * tan(1.548090806 * best_move_node->GetQ(0));
   uci_info_.pv.clear();
 
   bool flip = played_history_.IsBlackToMove();
-  for (Node* iter = best_move_node_; iter;
-       iter = GetBestChild(iter), flip = !flip) {
-    uci_info_.pv.push_back(iter->GetMove(flip));
+  uci_info_.pv.push_back(best_move_node->GetMove(flip));
+  // Down to the first move that is not visited yet.
+  for (const Node* iter = best_move_node; iter && iter->HasChildren();) {
+    flip = !flip;
+    const EdgeAndNode best = GetBestChild(iter);
+    uci_info_.pv.push_back(best.GetMove(flip));
+    iter = best.node();
   }
   uci_info_.comment.clear();
   info_callback_(uci_info_);
+  if (kSearchStats) SendPerfCounters();
+}
+
+void Search::SendPerfCounters() const {
+  const PerfCounters& counters = perf_counters_;
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(1) << "nn batches";
+  for (int i = 0; i < PerfCounters::kBatchSizeBuckets; ++i) {
+    if (counters.batch_sizes[i] == 0) continue;
+    oss << " " << (1 << i);
+    if (i > 0) oss << "-" << (2 << i) - 1;
+    oss << ":" << counters.batch_sizes[i];
+  }
+  oss << ", cache "
+      << (counters.lookups ? 100.0f * counters.cache_hits / counters.lookups
+                           : 0.0f)
+      << "% hits, " << counters.collisions << " collisions";
+  if (!counters.nn_ms.empty()) {
+    std::vector<float> nn_ms = counters.nn_ms;
+    std::sort(nn_ms.begin(), nn_ms.end());
+    const auto percentile = [&nn_ms](int p) {
+      return nn_ms[(nn_ms.size() - 1) * p / 100];
+    };
+    oss << ", nn p50 " << percentile(50) << "ms p90 " << percentile(90)
+        << "ms p99 " << percentile(99) << "ms";
+  }
+  oss << ", idle " << counters.idle_us / 1000 << "ms";
+  const HugePageStats pages = GetHugePageStats();
+  oss << ", huge pages " << pages.huge / (1024 * 1024) << " of "
+      << pages.total / (1024 * 1024) << "MB";
+  ThinkingInfo info;
+  info.comment = oss.str();
+  info_callback_(info);
 }
 
 // Decides whether anything important changed in stats and new info should be
 // shown to a user.
 void Search::MaybeOutputInfo() {
-  SharedMutex::Lock lock(nodes_mutex_);
+  const auto tree_lock = LockTreeShared();
   Mutex::Lock counters_lock(counters_mutex_);
-  if (!responded_bestmove_ && best_move_node_ &&
-      (best_move_node_ != last_outputted_best_move_node_ ||
+  Node* const best_move_node = best_move_node_;
+  if (!responded_bestmove_ && best_move_node &&
+      (best_move_node != last_outputted_best_move_node_ ||
        uci_info_.depth != root_node_->GetFullDepth() ||
        uci_info_.seldepth != root_node_->GetMaxDepth())) {
     SendUciInfo();
@@ -431,84 +778,81 @@ uint64_t Search::GetTimeSinceStart() const {
 }
 
 void Search::SendMovesStats() const {
-  std::vector<const Node*> nodes;
+  std::vector<EdgeAndNode> edges;
   const float parent_q = -root_node_->GetQ(0) - kFpuReduction;
-  for (Node* iter : root_node_->Children()) {
-    nodes.emplace_back(iter);
+  for (const auto& edge : root_node_->Edges()) {
+    edges.emplace_back(edge);
   }
-  std::sort(nodes.begin(), nodes.end(), [](const Node* a, const Node* b) {
-    return a->GetNStarted() < b->GetNStarted();
-  });
+  std::sort(edges.begin(), edges.end(),
+            [](const EdgeAndNode& a, const EdgeAndNode& b) {
+              return a.GetNStarted() < b.GetNStarted();
+            });
 
   const bool is_black_to_move = played_history_.IsBlackToMove();
+  const float u_factor = kCpuct * std::sqrt(std::max(root_node_->GetN(), 1u));
   ThinkingInfo info;
-  for (const Node* node : nodes) {
+  for (const auto& edge : edges) {
     std::ostringstream oss;
     oss << std::fixed;
     oss << std::left << std::setw(5)
-        << node->GetMove(is_black_to_move).as_string();
-    oss << " (" << std::setw(4) << node->GetMove().as_nn_index() << ")";
+        << edge.GetMove(is_black_to_move).as_string();
+    oss << " (" << std::setw(4) << edge.GetMove().as_nn_index() << ")";
     oss << " -> ";
-    oss << std::right << std::setw(7) << node->GetN() << " (+" << std::setw(2)
-        << node->GetNInFlight() << ") ";
-    oss << "(V: " << std::setw(6) << std::setprecision(2) << node->GetV() * 100
+    oss << std::right << std::setw(7) << edge.GetN() << " (+" << std::setw(2)
+        << edge.GetNInFlight() << ") ";
+    oss << "(V: " << std::setw(6) << std::setprecision(2) << edge.GetV() * 100
         << "%) ";
-    oss << "(P: " << std::setw(5) << std::setprecision(2) << node->GetP() * 100
+    oss << "(P: " << std::setw(5) << std::setprecision(2) << edge.GetP() * 100
         << "%) ";
     oss << "(Q: " << std::setw(8) << std::setprecision(5)
-        << node->GetQ(parent_q) << ") ";
+        << edge.GetQ(parent_q) << ") ";
     oss << "(U: " << std::setw(6) << std::setprecision(5)
-        << node->GetU() * kCpuct *
-               std::sqrt(std::max(node->GetParent()->GetN(), 1u))
-        << ") ";
+        << edge.GetU() * u_factor << ") ";
 
     oss << "(Q+U: " << std::setw(8) << std::setprecision(5)
-        << node->GetQ(parent_q) +
-               node->GetU() * kCpuct *
-                   std::sqrt(std::max(node->GetParent()->GetN(), 1u))
-        << ") ";
+        << edge.GetQ(parent_q) + edge.GetU() * u_factor << ") ";
+    info.comment = oss.str();
+    info_callback_(info);
+  }
+
+  const int prefetched = prefetch_stats_.TotalComputed();
+  if (prefetched > 0) {
+    std::ostringstream oss;
+    oss << std::fixed << "prefetch: " << prefetched << " computed, "
+        << std::setprecision(1)
+        << 100.0f * prefetch_stats_.TotalHits() / prefetched << "% used, "
+        << "budget " << prefetch_batch_;
+    if (prefetch_depth_ <= PrefetchStats::kMaxDepth) {
+      oss << ", depth " << prefetch_depth_;
+    }
     info.comment = oss.str();
     info_callback_(info);
   }
 }
 
 void Search::MaybeTriggerStop() {
-  SharedMutex::Lock nodes_lock(nodes_mutex_);
+  const auto tree_lock = LockTreeShared();
   Mutex::Lock lock(counters_mutex_);
-  // Don't stop when the root node is not yet expanded.
-  if (total_playouts_ == 0) return;
-  // If smart pruning tells to stop (best move found), stop.
-  if (found_best_move_) {
-    stop_ = true;
-  }
-  // Stop if reached playouts limit.
-  if (limits_.playouts >= 0 && total_playouts_ >= limits_.playouts) {
-    stop_ = true;
-  }
-  // Stop if reached visits limit.
-  if (limits_.visits >= 0 &&
-      total_playouts_ + initial_visits_ >= limits_.visits) {
-    stop_ = true;
-  }
-  // Stop if reached time limit.
-  if (limits_.time_ms >= 0 && GetTimeSinceStart() >= limits_.time_ms) {
-    stop_ = true;
-  }
-  // If we are the first to see that stop is needed.
-  if (stop_ && !responded_bestmove_) {
-    SendUciInfo();
-    if (kVerboseStats) SendMovesStats();
-    best_move_ = GetBestMoveInternal();
-    best_move_callback_({best_move_.first, best_move_.second});
-    responded_bestmove_ = true;
-    best_move_node_ = nullptr;
-  }
+  if (ShouldStop()) stop_ = true;
+  MaybeSendBestMove();
+}
+
+void Search::MaybeSendBestMove() {
+  if (!stop_ || responded_bestmove_ || total_playouts_ == 0) return;
+  SendUciInfo();
+  if (kVerboseStats) SendMovesStats();
+  best_move_ = GetBestMoveInternal();
+  best_move_callback_({best_move_.first, best_move_.second});
+  responded_bestmove_ = true;
+  best_move_node_ = nullptr;
+  // Let idle workers see the stop.
+  WakeIdleWorkers();
 }
 
 void Search::UpdateRemainingMoves() {
   if (!kSmartPruning) return;
-  SharedMutex::Lock lock(nodes_mutex_);
-  remaining_playouts_ = std::numeric_limits<int>::max();
+  // Computed aside, as the workers read remaining_playouts_ meanwhile.
+  int remaining_playouts_limit = std::numeric_limits<int>::max();
   // Check for how many playouts there is time remaining.
   if (limits_.time_ms >= 0) {
     auto time_since_start = GetTimeSinceStart();
@@ -516,11 +860,15 @@ void Search::UpdateRemainingMoves() {
       auto nps = (1000LL * total_playouts_ + kSmartPruningToleranceNodes) /
                      (time_since_start - kSmartPruningToleranceMs) +
                  1;
+      // Once measured, the recent nps, as nps changes while the tree grows
+      // and the cache fills up.
+      UpdateLiveNps(time_since_start);
+      if (live_nps_ > 0) nps = live_nps_ + 1;
       int64_t remaining_time = limits_.time_ms - time_since_start;
       int64_t remaining_playouts = remaining_time * nps / 1000;
-      // Don't assign directly to remaining_playouts_ as overflow is possible.
-      if (remaining_playouts < remaining_playouts_)
-        remaining_playouts_ = remaining_playouts;
+      // Don't assign directly, as overflow is possible.
+      if (remaining_playouts < remaining_playouts_limit)
+        remaining_playouts_limit = remaining_playouts;
     }
   }
   // Check how many visits are left.
@@ -529,18 +877,140 @@ void Search::UpdateRemainingMoves() {
     // number.
     auto remaining_visits =
         limits_.visits - total_playouts_ - initial_visits_ + kMiniBatchSize;
-    if (remaining_visits < remaining_playouts_)
-      remaining_playouts_ = remaining_visits;
+    if (remaining_visits < remaining_playouts_limit)
+      remaining_playouts_limit = remaining_visits;
   }
   if (limits_.playouts >= 0) {
     // Adding kMiniBatchSize, as it's possible to exceed visits limit by that
     // number.
-    auto remaining_playouts = limits_.visits - total_playouts_ + kMiniBatchSize;
-    if (remaining_playouts < remaining_playouts_)
-      remaining_playouts_ = remaining_playouts;
+    auto remaining_playouts =
+        limits_.playouts - total_playouts_ + kMiniBatchSize;
+    if (remaining_playouts < remaining_playouts_limit)
+      remaining_playouts_limit = remaining_playouts;
   }
   // Even if we exceeded limits, don't go crazy by not allowing any playouts.
-  if (remaining_playouts_ <= 1) remaining_playouts_ = 1;
+  if (remaining_playouts_limit <= 1) remaining_playouts_limit = 1;
+  remaining_playouts_ = remaining_playouts_limit;
+
+  // Stop once no other move can catch up, rather than when a worker finds
+  // that out on its way down from the root.
+  Node* const best_move_node = best_move_node_;
+  if (!best_move_node ||
+      remaining_playouts_limit == std::numeric_limits<int>::max()) {
+    return;
+  }
+  const int best_node_n = best_move_node->GetNStarted();
+  for (const auto& edge : root_node_->Edges()) {
+    if (edge.node() != best_move_node &&
+        remaining_playouts_limit >= best_node_n - edge.GetNStarted()) {
+      return;
+    }
+  }
+  found_best_move_ = true;
+}
+
+std::shared_lock<SharedMutex> Search::LockTreeShared() const {
+  if (kTreeMemory == 0) return {};
+  return std::shared_lock<SharedMutex>(tree_mutex_);
+}
+
+void Search::MaybePruneTree() {
+  if (kTreeMemory == 0 || Node::GetTreeMemoryUsage() <= kTreeMemory) return;
+  TraceScope trace("search prune");
+  SharedMutex::Lock lock(tree_mutex_);
+  const size_t usage = Node::GetTreeMemoryUsage();
+  if (usage <= kTreeMemory) return;
+
+  // Subtrees which can go, by the share of visits of their parent they got.
+  struct Candidate {
+    float share;
+    size_t bytes;
+    Node* node;
+    bool operator<(const Candidate& other) const {
+      return share < other.share;
+    }
+  };
+  std::vector<Candidate> candidates;
+  // Returns the bytes of the subtree of @node.
+  std::function<size_t(Node*)> collect = [&](Node* node) {
+    size_t bytes = sizeof(Node) + node->GetNumEdges() * sizeof(Edge);
+    Node* most_visited = nullptr;
+    for (const auto& edge : node->Edges()) {
+      if (edge.node() && (!most_visited ||
+                          edge.node()->GetN() > most_visited->GetN())) {
+        most_visited = edge.node();
+      }
+    }
+    for (const auto& edge : node->Edges()) {
+      Node* child = edge.node();
+      if (!child) continue;
+      const size_t child_bytes = collect(child);
+      bytes += child_bytes;
+      // The best line of every node stays, and so do the subtrees which
+      // batches in flight go through.
+      if (child != most_visited && child->GetNInFlight() == 0 &&
+          child_bytes > sizeof(Node) + child->GetNumEdges() * sizeof(Edge)) {
+        candidates.push_back(
+            {float(child->GetN()) / std::max(node->GetN(), 1u), child_bytes,
+             child});
+      }
+    }
+    return bytes;
+  };
+  collect(root_node_);
+  std::sort(candidates.begin(), candidates.end());
+
+  // Takes the least visited ones until enough is freed. A subtree of an
+  // already taken one is freed with it.
+  const size_t target = usage - size_t(kTreeMemory * kPruneTarget);
+  std::unordered_set<Node*> taken;
+  size_t freed = 0;
+  for (const Candidate& candidate : candidates) {
+    if (freed >= target) break;
+    bool in_taken = false;
+    for (Node* node = candidate.node->GetParent(); node && !in_taken;
+         node = node->GetParent()) {
+      in_taken = taken.count(node) > 0;
+    }
+    if (in_taken) continue;
+    taken.insert(candidate.node);
+    freed += candidate.bytes - sizeof(Node) -
+             candidate.node->GetNumEdges() * sizeof(Edge);
+  }
+  // All are picked before any is released, as the release thread frees
+  // the released nodes meanwhile.
+  std::vector<Node*> to_release;
+  for (Node* node : taken) {
+    bool in_taken = false;
+    for (Node* parent = node->GetParent(); parent && !in_taken;
+         parent = parent->GetParent()) {
+      in_taken = taken.count(parent) > 0;
+    }
+    if (!in_taken) to_release.push_back(node);
+  }
+  for (Node* node : to_release) node->ReleaseChildNodes();
+  // The transpositions may be in the released subtrees.
+  {
+    Mutex::Lock transpositions_lock(transpositions_mutex_);
+    transpositions_.clear();
+  }
+  Node::ReleaseUnusedMemory();
+}
+
+void Search::UpdateLiveNps(uint64_t time_since_start) {
+  const uint64_t playouts = total_playouts_;
+  if (nps_window_start_ms_ == 0) {
+    nps_window_start_ms_ = time_since_start;
+    nps_window_playouts_ = playouts;
+    return;
+  }
+  const uint64_t elapsed = time_since_start - nps_window_start_ms_;
+  if (elapsed < kNpsWindowMs) return;
+  const int64_t nps = (playouts - nps_window_playouts_) * 1000 / elapsed;
+  // Smoothed, as a window may end in the middle of a batch.
+  live_nps_ = live_nps_ > 0 ? (live_nps_ + nps) / 2 : nps;
+  nps_window_start_ms_ = time_since_start;
+  nps_window_playouts_ = playouts;
 }
 
 void Search::ExtendNode(Node* node, const PositionHistory& history) {
@@ -577,73 +1047,121 @@ void Search::ExtendNode(Node* node, const PositionHistory& history) {
     return;
   }
 
-  // Add legal moves as children to this node.
-  for (const auto& move : legal_moves) node->CreateChild(move);
+  // Right after a capture or pawn move the tables know the result, as the 50
+  // move rule can't interfere. The root keeps its moves to choose from.
+  if (syzygy_tb_ && node != root_node_ &&
+      history.Last().GetNoCapturePly() == 0) {
+    ProbeState state;
+    const WDLScore wdl = syzygy_tb_->ProbeWdl(board, &state);
+    if (state != ProbeState::FAIL) {
+      // The side to move won, so the one which moved into the node lost.
+      if (wdl == WDL_WIN) {
+        node->MakeTerminal(GameResult::BLACK_WON);
+      } else if (wdl == WDL_LOSS) {
+        node->MakeTerminal(GameResult::WHITE_WON);
+      } else {
+        node->MakeTerminal(GameResult::DRAW);
+      }
+      return;
+    }
+  }
+
+  // Add legal moves as edges of this node.
+  node->CreateEdges(legal_moves);
 }
 
-Node* Search::PickNodeToExtend(Node* node, PositionHistory* history) {
-  // Fetch the current best root node visits for possible smart pruning.
-  int best_node_n = 0;
+bool Search::CopyTransposition(Node* node, const PositionHistory& history) {
+  // Priors of the root get noise, so it's neither a source nor a target.
+  if (!kTranspositions || node == root_node_) return false;
+  Node* source;
   {
-    SharedMutex::Lock lock(nodes_mutex_);
-    if (best_move_node_) best_node_n = best_move_node_->GetNStarted();
+    Mutex::Lock lock(transpositions_mutex_);
+    source = transpositions_.emplace(history.HashLast(1), node).first->second;
   }
+  // Values of the other node are set before its first visit is backed up.
+  if (source == node || source->GetN() == 0) return false;
+  // Same position, so same legal moves in the same order. Unless it's a hash
+  // collision.
+  if (source->GetNumEdges() != node->GetNumEdges()) return false;
+  auto source_edge = source->Edges().begin();
+  for (const auto& edge : node->Edges()) {
+    edge.SetP((*source_edge).GetP());
+    ++source_edge;
+  }
+  // The average of the other subtree is a better estimate than its V.
+  node->SetV(source->GetQ(source->GetV()));
+  return true;
+}
+
+void Search::CancelCollision(Node* node) {
+  // The collided node itself never started its update, its ancestors did.
+  if (node == root_node_) return;
+  for (node = node->GetParent(); node != root_node_->GetParent();
+       node = node->GetParent()) {
+    node->CancelScoreUpdate();
+  }
+}
+
+Node* Search::PickNodeToExtend(Node* node, PositionHistory* history,
+                               bool* is_collision) {
+  // Fetch the current best root node visits for possible smart pruning.
+  int best_node_n = 0;
+  Node* const best_move_node = best_move_node_;
+  if (best_move_node) best_node_n = best_move_node->GetNStarted();
 
   // True on first iteration, false as we dive deeper.
   bool is_root_node = true;
   while (true) {
-    {
-      SharedMutex::Lock lock(nodes_mutex_);
-      // Check whether we are in the leave.
-      if (!node->TryStartScoreUpdate()) {
-        // The node is currently being processed by another thread.
-        // Undo the increments of anschestor nodes, and return null.
-        for (node = node->GetParent(); node != root_node_->GetParent();
-             node = node->GetParent()) {
-          node->CancelScoreUpdate();
-        }
-        return nullptr;
-      }
-      // Found leave, and we are the the first to visit it.
-      if (!node->HasChildren()) return node;
+    // Check whether we are in the leave.
+    if (!node->TryStartScoreUpdate()) {
+      // The node is currently being processed, by this batch or another
+      // thread. The increments of the ancestor nodes stay, the caller
+      // undoes them with CancelCollision().
+      *is_collision = true;
+      return node;
     }
+    // Found leave, and we are the the first to visit it.
+    if (!node->HasChildren()) return node;
 
     // Now we are not in leave, we need to go deeper.
-    SharedMutex::SharedLock lock(nodes_mutex_);
     float factor = kCpuct * std::sqrt(std::max(node->GetN(), 1u));
     float best = -100.0f;
     int possible_moves = 0;
     float parent_q = (is_root_node && kNoise) ? -node->GetQ(0)
                                               : -node->GetQ(0) - kFpuReduction;
-    for (Node* iter : node->Children()) {
+    Edge* best_edge = nullptr;
+    for (const auto& edge : node->Edges()) {
       if (is_root_node) {
         // If there's no chance to catch up the currently best node with
         // remaining playouts, not consider it.
         // best_move_node_ can change since best_node_n computation.
         // To ensure we have at least one node to expand, always include
         // current best node.
-        if (iter != best_move_node_ &&
-            remaining_playouts_ < best_node_n - iter->GetNStarted()) {
+        if (edge.node() != best_move_node_.load() &&
+            remaining_playouts_ < best_node_n - edge.GetNStarted()) {
           continue;
         }
         ++possible_moves;
       }
-      float Q = iter->GetQ(parent_q);
-      if (kVirtualLossBug && iter->GetN() == 0) {
-        Q = (Q * iter->GetParent()->GetN() - kVirtualLossBug) /
-            (iter->GetParent()->GetN() + std::fabs(kVirtualLossBug));
+      float Q = edge.GetQ(parent_q);
+      if (kVirtualLossBug && edge.GetN() == 0) {
+        Q = (Q * node->GetN() - kVirtualLossBug) /
+            (node->GetN() + std::fabs(kVirtualLossBug));
       }
-      const float score = factor * iter->GetU() + Q;
+      const float score = factor * edge.GetU() + Q;
       if (score > best) {
         best = score;
-        node = iter;
+        best_edge = edge.edge();
       }
     }
+    // Only if best_move_node_ changed meanwhile and all moves were pruned.
+    if (!best_edge) best_edge = (*node->Edges().begin()).edge();
+    // The node of the first visit of an edge is created here.
+    node = node->GetOrCreateChild(best_edge);
     history->Append(node->GetMove());
     if (is_root_node && possible_moves <= 1) {
       // If there is only one move theoretically possible within remaining time,
       // output it.
-      Mutex::Lock counters_lock(counters_mutex_);
       found_best_move_ = true;
     }
     is_root_node = false;
@@ -651,13 +1169,13 @@ Node* Search::PickNodeToExtend(Node* node, PositionHistory* history) {
 }
 
 std::pair<Move, Move> Search::GetBestMove() const {
-  SharedMutex::SharedLock lock(nodes_mutex_);
+  const auto tree_lock = LockTreeShared();
   Mutex::Lock counters_lock(counters_mutex_);
   return GetBestMoveInternal();
 }
 
 std::pair<Move, Move> Search::GetBestMoveInternal() const
-    REQUIRES_SHARED(nodes_mutex_) REQUIRES_SHARED(counters_mutex_) {
+    REQUIRES_SHARED(counters_mutex_) {
   if (responded_bestmove_) return best_move_;
   if (!root_node_->HasChildren()) return {};
 
@@ -667,30 +1185,41 @@ std::pair<Move, Move> Search::GetBestMoveInternal() const
         std::pow(1 - kTempDecay, played_history_.Last().GetGamePly() / 2);
   if (temperature < 0.01) temperature = 0.0;
 
-  Node* best_node = temperature
-                        ? GetBestChildWithTemperature(root_node_, temperature)
-                        : GetBestChild(root_node_);
+  const EdgeAndNode best_edge =
+      temperature ? GetBestChildWithTemperature(root_node_, temperature)
+                  : GetBestChild(root_node_);
 
   Move ponder_move;
-  if (best_node->HasChildren()) {
-    ponder_move =
-        GetBestChild(best_node)->GetMove(!played_history_.IsBlackToMove());
+  if (best_edge.node() && best_edge.node()->HasChildren()) {
+    ponder_move = GetBestChild(best_edge.node())
+                      .GetMove(!played_history_.IsBlackToMove());
   }
-  return {best_node->GetMove(played_history_.IsBlackToMove()), ponder_move};
+  return {best_edge.GetMove(played_history_.IsBlackToMove()), ponder_move};
 }
 
 void Search::StartThreads(int how_many) {
+  StartReporter();
   Mutex::Lock lock(threads_mutex_);
   while (threads_.size() < how_many) {
-    threads_.emplace_back([&]() { Worker(); });
+    const int slot = threads_.size();
+    threads_.emplace_back([this, slot]() {
+      // Filling one NUMA node before the next keeps the nodes each thread
+      // allocates close to the threads that visit them.
+      if (kPinThreads) PinThreadToCore(slot);
+      Worker();
+    });
   }
 }
 
-void Search::RunSingleThreaded() { Worker(); }
+void Search::RunSingleThreaded() {
+  StartReporter();
+  Worker();
+  StopReporter();
+}
 
 void Search::RunBlocking(int threads) {
   if (threads == 1) {
-    Worker();
+    RunSingleThreaded();
   } else {
     StartThreads(threads);
     Wait();
@@ -698,27 +1227,92 @@ void Search::RunBlocking(int threads) {
 }
 
 void Search::Stop() {
-  Mutex::Lock lock(counters_mutex_);
-  stop_ = true;
+  {
+    const auto tree_lock = LockTreeShared();
+    Mutex::Lock lock(counters_mutex_);
+    stop_ = true;
+    // Right away rather than when a worker gets its batch back from the
+    // network. The workers back up the batches they have in flight and exit
+    // in the background, so the tree has no virtual loss left when it's
+    // reused.
+    MaybeSendBestMove();
+  }
+  WakeIdleWorkers();
 }
 
 void Search::Abort() {
-  Mutex::Lock lock(counters_mutex_);
-  responded_bestmove_ = true;
-  stop_ = true;
+  {
+    Mutex::Lock lock(counters_mutex_);
+    responded_bestmove_ = true;
+    stop_ = true;
+  }
+  WakeIdleWorkers();
 }
 
 void Search::Wait() {
+  {
+    Mutex::Lock lock(threads_mutex_);
+    while (!threads_.empty()) {
+      threads_.back().join();
+      threads_.pop_back();
+    }
+  }
+  StopReporter();
+}
+
+void Search::StartReporter() {
   Mutex::Lock lock(threads_mutex_);
-  while (!threads_.empty()) {
-    threads_.back().join();
-    threads_.pop_back();
+  if (reporter_.joinable()) return;
+  reporter_ = std::thread([this]() { Reporter(); });
+}
+
+void Search::StopReporter() {
+  {
+    std::lock_guard<std::mutex> lock(reporter_mutex_);
+    reporter_exit_ = true;
+  }
+  reporter_cv_.notify_all();
+  Mutex::Lock lock(threads_mutex_);
+  if (reporter_.joinable()) reporter_.join();
+}
+
+void Search::NotifyReporter() {
+  // Only the first notification after a pass of the reporter takes the lock.
+  if (reporter_progress_.exchange(true)) return;
+  { std::lock_guard<std::mutex> lock(reporter_mutex_); }
+  reporter_cv_.notify_one();
+}
+
+void Search::Reporter() {
+  // Only the time limit changes while the workers make no progress.
+  const bool timed = limits_.time_ms >= 0;
+  std::unique_lock<std::mutex> lock(reporter_mutex_);
+  while (!reporter_exit_) {
+    reporter_cv_.wait_for(lock,
+                          std::chrono::milliseconds(kReporterIntervalMs),
+                          [this]() { return reporter_exit_; });
+    if (!timed) {
+      reporter_cv_.wait(lock, [this]() {
+        return reporter_exit_ || reporter_progress_;
+      });
+    }
+    reporter_progress_ = false;
+    lock.unlock();
+    UpdateRemainingMoves();  // Update remaining moves using smart pruning.
+    MaybePruneTree();
+    MaybeOutputInfo();
+    // Also sends bestmove after a stop which came before the first playout.
+    MaybeTriggerStop();
+    lock.lock();
   }
 }
 
 Search::~Search() {
   Abort();
   Wait();
+#ifdef LC0_MUTEX_STATS
+  DumpLockStats();
+#endif
 }
 
 }  // namespace lczero
\ No newline at end of file
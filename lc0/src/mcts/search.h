@@ -18,14 +18,20 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
 #include <shared_mutex>
 #include <thread>
+#include <unordered_map>
 #include "chess/callbacks.h"
 #include "chess/uciloop.h"
 #include "mcts/node.h"
 #include "neural/cache.h"
 #include "neural/network.h"
+#include "syzygy/syzygy.h"
 #include "utils/mutex.h"
 #include "utils/optionsdict.h"
 #include "utils/optionsparser.h"
@@ -43,7 +49,8 @@ class Search {
   Search(const NodeTree& tree, Network* network,
          BestMoveInfo::Callback best_move_callback,
          ThinkingInfo::Callback info_callback, const SearchLimits& limits,
-         const OptionsDict& options, NNCache* cache);
+         const OptionsDict& options, NNCache* cache,
+         SyzygyTablebase* syzygy_tb);
 
   ~Search();
 
@@ -82,45 +89,153 @@ class Search {
   static const char* kVirtualLossBugStr;
   static const char* kFpuReductionStr;
   static const char* kCacheHistoryLengthStr;
+  static const char* kPinThreadsStr;
+  static const char* kBatchesInFlightStr;
+  static const char* kTranspositionsStr;
+  static const char* kSearchStatsStr;
+  static const char* kAllowedCollisionsStr;
+  static const char* kTreeMemoryStr;
 
  private:
+  // Nodes picked for one NN computation, and that computation.
+  struct Minibatch {
+    std::vector<Node*> nodes_to_process;
+    // The ones of them sent to the network, in the order of the computation.
+    std::vector<Node*> nodes_to_evaluate;
+    std::unique_ptr<CachingComputation> computation;
+    // Set while the computation runs on a helper thread.
+    std::future<void> computed;
+    // progress_epoch_ before gathering.
+    uint64_t progress_epoch = 0;
+    // Nodes to evaluate found in the cache, and picks which ran into a node
+    // already being processed.
+    int cache_hits = 0;
+    int collisions = 0;
+    // How long the network took to compute it.
+    float nn_ms = 0.0f;
+  };
+
+  // Why nps is what it is, for --search-stats.
+  struct PerfCounters {
+    // Bucket i counts NN batches of 2^i to 2^(i+1)-1 positions.
+    static const int kBatchSizeBuckets = 12;
+    // NN latencies are kept for this many last batches.
+    static const int kLatencySamples = 1024;
+    uint64_t batch_sizes[kBatchSizeBuckets] = {};
+    uint64_t lookups = 0;
+    uint64_t cache_hits = 0;
+    uint64_t collisions = 0;
+    std::vector<float> nn_ms;
+    int next_nn_ms = 0;
+    // Time workers spent waiting for other threads' batches.
+    uint64_t idle_us = 0;
+  };
+
   // Can run several copies of it in separate threads.
   void Worker();
+  void GatherMinibatch(Minibatch* batch, PositionHistory* history);
+  // Waits for the oldest batch, copies its results into the nodes and backs
+  // them up. Returns whether the batch had any nodes.
+  bool FinishOldestMinibatch(std::deque<Minibatch>* in_flight);
+  void FetchMinibatchResults(const Minibatch& batch);
+  void DoBackupUpdate(const std::vector<Node*>& nodes_to_process);
+  bool IsStopRequested() const;
+  // Whether a limit of the search is reached, from the atomic stats, so
+  // without a lock.
+  bool ShouldStop() const;
+  // Blocks until progress_epoch_ moves on from @progress_epoch.
+  void WaitForProgress(uint64_t progress_epoch);
+  // Moves progress_epoch_ on and wakes the threads in WaitForProgress().
+  void WakeIdleWorkers();
+
+  // Outputs info and checks the limits, so that workers don't take
+  // counters_mutex_ after every batch. At most every kReporterIntervalMs,
+  // and without a time limit only after the workers made progress, so an
+  // idle or unlimited search doesn't wake it for nothing.
+  void Reporter();
+  // Wakes the reporter after playouts were backed up.
+  void NotifyReporter();
+  void StartReporter();
+  // Waits for the reporter to exit. Called once the workers are done.
+  void StopReporter();
+  // Once the trees take more than kTreeMemory, releases the least visited
+  // subtrees, keeping the nodes at their tops.
+  void MaybePruneTree();
 
   std::pair<Move, Move> GetBestMoveInternal() const;
   uint64_t GetTimeSinceStart() const;
+  // Estimates how many playouts the search has left, for smart pruning to
+  // skip the root moves which can't catch up with the best one any more, and
+  // to stop when none can. Called by the reporter only.
   void UpdateRemainingMoves();
+  void UpdateLiveNps(uint64_t time_since_start);
   void MaybeTriggerStop();
+  // Sends bestmove from the current stats, once stop_ is set and the root
+  // has been visited. Only the first call after that does anything.
+  void MaybeSendBestMove() REQUIRES(counters_mutex_);
   void MaybeOutputInfo();
-  void SendMovesStats() const;
+  void SendMovesStats() const REQUIRES(counters_mutex_);
+  void UpdatePerfCounters(const Minibatch& batch);
+  void SendPerfCounters() const REQUIRES(counters_mutex_);
+  // @node is nullptr for a position of an edge that is not visited yet.
+  // A @prefetch_depth above 0 means the node is only prefetched, so it's not
+  // added when cached.
   bool AddNodeToCompute(Node* node, CachingComputation* computation,
                         const PositionHistory& history,
-                        bool add_if_cached = true);
-  int PrefetchIntoCache(Node* node, int budget, CachingComputation* computation,
+                        int prefetch_depth = 0);
+  int PrefetchIntoCache(Node* node, int budget, int depth,
+                        CachingComputation* computation,
                         PositionHistory* history);
+  // Counts the prefetches of a finished computation, and adapts the prefetch
+  // budget and depth to how many of them get used.
+  void UpdatePrefetchStats(const PrefetchStats& stats);
 
-  void SendUciInfo();  // Requires nodes_mutex_ to be held.
+  void SendUciInfo();  // Requires counters_mutex_ to be held.
 
-  Node* PickNodeToExtend(Node* node, PositionHistory* history);
+  // Descends from @node to the leaf to extend, starting score updates on the
+  // way. If a node on the way is being processed already, sets
+  // @is_collision and returns that node, and the updates of its ancestors
+  // have to be cancelled by CancelCollision().
+  Node* PickNodeToExtend(Node* node, PositionHistory* history,
+                         bool* is_collision);
+  void CancelCollision(Node* node);
   void ExtendNode(Node* node, const PositionHistory& history);
+  // Copies the values of another node of the same position, if there is one
+  // which is evaluated already. Returns whether it did, otherwise remembers
+  // @node for the next transpositions.
+  bool CopyTransposition(Node* node, const PositionHistory& history);
 
-  mutable Mutex counters_mutex_ ACQUIRED_AFTER(nodes_mutex_);
-  // Tells all threads to stop.
-  bool stop_ GUARDED_BY(counters_mutex_) = false;
+  mutable Mutex counters_mutex_{"Search::counters_mutex_"};
+  // Tells all threads to stop. Set under counters_mutex_, read without it.
+  std::atomic<bool> stop_{false};
   // There is already one thread that responded bestmove, other threads
   // should not do that.
   bool responded_bestmove_ GUARDED_BY(counters_mutex_) = false;
   // Becomes true when smart pruning decides
-  bool found_best_move_ GUARDED_BY(counters_mutex_) = false;
+  std::atomic<bool> found_best_move_{false};
   // Stored so that in the case of non-zero temperature GetBestMove() returns
   // consistent results.
   std::pair<Move, Move> best_move_ GUARDED_BY(counters_mutex_);
 
   Mutex threads_mutex_;
   std::vector<std::thread> threads_ GUARDED_BY(threads_mutex_);
+  std::thread reporter_ GUARDED_BY(threads_mutex_);
+  std::mutex reporter_mutex_;
+  std::condition_variable reporter_cv_;
+  bool reporter_exit_ = false;
+  // Set by NotifyReporter(), cleared by the reporter under reporter_mutex_.
+  std::atomic<bool> reporter_progress_{false};
 
+  // Held shared by everything which walks the tree, and exclusively by
+  // MaybePruneTree() when it releases nodes. Only with a tree memory limit,
+  // without one nothing is pruned.
+  mutable SharedMutex tree_mutex_{"Search::tree_mutex_"};
+  // tree_mutex_ held shared, or nothing when the tree isn't pruned.
+  std::shared_lock<SharedMutex> LockTreeShared() const;
   Node* root_node_;
   NNCache* cache_;
+  // Makes nodes of positions in the tables terminal. May be null.
+  SyzygyTablebase* syzygy_tb_;
   // Fixed positions which happened before the search.
   const PositionHistory& played_history_;
 
@@ -129,13 +244,40 @@ class Search {
   const std::chrono::steady_clock::time_point start_time_;
   const uint64_t initial_visits_;
 
-  mutable SharedMutex nodes_mutex_;
-  Node* best_move_node_ GUARDED_BY(nodes_mutex_) = nullptr;
-  Node* last_outputted_best_move_node_ GUARDED_BY(nodes_mutex_) = nullptr;
-  ThinkingInfo uci_info_ GUARDED_BY(nodes_mutex_);
-  uint64_t total_playouts_ GUARDED_BY(nodes_mutex_) = 0;
-  int remaining_playouts_ GUARDED_BY(nodes_mutex_) =
-      std::numeric_limits<int>::max();
+  // The node statistics are atomic, so the tree itself needs no lock.
+  std::atomic<Node*> best_move_node_{nullptr};
+  Node* last_outputted_best_move_node_ GUARDED_BY(counters_mutex_) = nullptr;
+  ThinkingInfo uci_info_ GUARDED_BY(counters_mutex_);
+  std::atomic<uint64_t> total_playouts_{0};
+  std::atomic<int> remaining_playouts_{std::numeric_limits<int>::max()};
+  // Playouts per second over the last windows of UpdateLiveNps(), 0 until
+  // the first one ends.
+  int64_t live_nps_ = 0;
+  uint64_t nps_window_start_ms_ = 0;
+  uint64_t nps_window_playouts_ = 0;
+
+  // Prefetch budget per batch and depth limit, adapted while searching. The
+  // budget starts at the option, the depth unlimited.
+  std::atomic<int> prefetch_batch_;
+  std::atomic<int> prefetch_depth_{std::numeric_limits<int>::max()};
+  // Of the whole search, and since the last adaptation.
+  PrefetchStats prefetch_stats_ GUARDED_BY(counters_mutex_);
+  PrefetchStats prefetch_window_ GUARDED_BY(counters_mutex_);
+  int prefetch_window_batches_ GUARDED_BY(counters_mutex_) = 0;
+  PerfCounters perf_counters_ GUARDED_BY(counters_mutex_);
+
+  // Counts backups and stops, so that workers which found nothing to do can
+  // sleep until something changes.
+  std::atomic<uint64_t> progress_epoch_{0};
+  std::atomic<int> idle_workers_{0};
+  std::mutex progress_mutex_;
+  std::condition_variable progress_cv_;
+
+  // The first node extended in this search for every position (by
+  // HashLast(1)). Nodes aren't released while the search runs.
+  Mutex transpositions_mutex_{"Search::transpositions_mutex_"};
+  std::unordered_map<uint64_t, Node*> transpositions_
+      GUARDED_BY(transpositions_mutex_);
 
   BestMoveInfo::Callback best_move_callback_;
   ThinkingInfo::Callback info_callback_;
@@ -152,6 +294,13 @@ class Search {
   const float kVirtualLossBug;
   const float kFpuReduction;
   const bool kCacheHistoryLength;
+  const bool kPinThreads;
+  const int kBatchesInFlight;
+  const bool kTranspositions;
+  const bool kSearchStats;
+  const int kAllowedCollisions;
+  // In bytes, 0 for no limit.
+  const size_t kTreeMemory;
 };
 
 }  // namespace lczero
\ No newline at end of file
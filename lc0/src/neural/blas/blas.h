@@ -0,0 +1,45 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+// The CBLAS of MKL with USE_MKL, else OpenBLAS or any other CBLAS.
+#ifdef USE_MKL
+#include <mkl.h>
+#else
+#include <cblas.h>
+#endif
+
+#ifdef USE_OPENBLAS
+extern "C" void openblas_set_num_threads(int num_threads);
+#endif
+
+namespace lczero {
+
+// The backend splits batches between its own threads, so the BLAS library
+// is better off not starting more.
+inline void SetBlasSingleThreaded() {
+#ifdef USE_MKL
+  mkl_set_num_threads(1);
+#endif
+#ifdef USE_OPENBLAS
+  openblas_set_num_threads(1);
+#endif
+}
+
+}  // namespace lczero
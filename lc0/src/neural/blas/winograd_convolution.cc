@@ -0,0 +1,185 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/blas/winograd_convolution.h"
+
+#include <array>
+
+#include "neural/blas/blas.h"
+
+namespace lczero {
+
+namespace {
+const int kWidth = 8;
+const int kHeight = 8;
+const int kSquares = kWidth * kHeight;
+const int kWinogradAlpha = 4;
+const int kWinogradTile = kWinogradAlpha * kWinogradAlpha;
+const int kWTiles = kWidth / 2;
+// Tiles on a board.
+const int kTiles = kWTiles * kWTiles;
+}  // namespace
+
+std::vector<float> WinogradConvolution3::TransformF(const std::vector<float>& f,
+                                                    int outputs, int channels) {
+  // transpose(G.dot(f).dot(G.transpose())), U is [xi][nu][channel][output]
+  // for the SGEMM.
+  std::vector<float> U(kWinogradTile * outputs * channels);
+  const std::array<float, 12> G = {1.0, 0.0,  0.0, 0.5, 0.5, 0.5,
+                                   0.5, -0.5, 0.5, 0.0, 0.0, 1.0};
+  std::array<float, 12> temp;
+
+  for (int o = 0; o < outputs; o++) {
+    for (int c = 0; c < channels; c++) {
+      for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 3; j++) {
+          float acc = 0.0f;
+          for (int k = 0; k < 3; k++) {
+            acc += G[i * 3 + k] * f[o * channels * 9 + c * 9 + k * 3 + j];
+          }
+          temp[i * 3 + j] = acc;
+        }
+      }
+
+      for (int xi = 0; xi < kWinogradAlpha; xi++) {
+        for (int nu = 0; nu < kWinogradAlpha; nu++) {
+          float acc = 0.0f;
+          for (int k = 0; k < 3; k++) {
+            acc += temp[xi * 3 + k] * G[nu * 3 + k];
+          }
+          U[xi * (kWinogradAlpha * outputs * channels) +
+            nu * (outputs * channels) + c * outputs + o] = acc;
+        }
+      }
+    }
+  }
+  return U;
+}
+
+WinogradConvolution3::WinogradConvolution3(int max_batch_size,
+                                           int max_channels)
+    : V_(kWinogradTile * max_channels * max_batch_size * kTiles),
+      M_(kWinogradTile * max_channels * max_batch_size * kTiles) {}
+
+void WinogradConvolution3::Forward(int batch_size, int input_channels,
+                                   int output_channels, const float* input,
+                                   const float* weights, float* output) {
+  TransformIn(batch_size, input, input_channels);
+  Sgemm(batch_size, weights, input_channels, output_channels);
+  TransformOut(batch_size, output, output_channels);
+}
+
+void WinogradConvolution3::TransformIn(int batch_size, const float* input,
+                                       int channels) {
+  // V is [xi][nu][channel][tile], the tiles of the positions one after the
+  // other.
+  const int P = batch_size * kTiles;
+  const int CP = channels * P;
+  for (int batch = 0; batch < batch_size; batch++) {
+    for (int ch = 0; ch < channels; ch++) {
+      const float* plane = &input[(batch * channels + ch) * kSquares];
+      for (int block_y = 0; block_y < kWTiles; block_y++) {
+        for (int block_x = 0; block_x < kWTiles; block_x++) {
+          // Tiles overlap by 2.
+          const int yin = 2 * block_y - 1;
+          const int xin = 2 * block_x - 1;
+
+          float x[4][4];
+          for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+              const int y = yin + i;
+              const int xx = xin + j;
+              x[i][j] = (y >= 0 && xx >= 0 && y < kHeight && xx < kWidth)
+                            ? plane[y * kWidth + xx]
+                            : 0.0f;
+            }
+          }
+
+          // transpose(B).x.B
+          float T1[4][4];
+          for (int j = 0; j < 4; j++) {
+            T1[0][j] = x[0][j] - x[2][j];
+            T1[1][j] = x[1][j] + x[2][j];
+            T1[2][j] = x[2][j] - x[1][j];
+            T1[3][j] = x[1][j] - x[3][j];
+          }
+
+          float* v = &V_[ch * P + batch * kTiles + block_y * kWTiles + block_x];
+          for (int i = 0; i < 4; i++) {
+            v[(i * 4 + 0) * CP] = T1[i][0] - T1[i][2];
+            v[(i * 4 + 1) * CP] = T1[i][1] + T1[i][2];
+            v[(i * 4 + 2) * CP] = T1[i][2] - T1[i][1];
+            v[(i * 4 + 3) * CP] = T1[i][1] - T1[i][3];
+          }
+        }
+      }
+    }
+  }
+}
+
+void WinogradConvolution3::Sgemm(int batch_size, const float* weights,
+                                 int input_channels, int output_channels) {
+  const int P = batch_size * kTiles;
+  const int C = input_channels;
+  const int K = output_channels;
+  for (int b = 0; b < kWinogradTile; b++) {
+    // M[b] = transpose(U[b]) V[b], [output][tile].
+    cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans, K, P, C, 1.0f,
+                &weights[b * K * C], K, &V_[b * C * P], P, 0.0f,
+                &M_[b * K * P], P);
+  }
+}
+
+void WinogradConvolution3::TransformOut(int batch_size, float* output,
+                                        int channels) {
+  const int P = batch_size * kTiles;
+  const int KP = channels * P;
+  for (int batch = 0; batch < batch_size; batch++) {
+    for (int k = 0; k < channels; k++) {
+      float* plane = &output[(batch * channels + k) * kSquares];
+      for (int block_y = 0; block_y < kWTiles; block_y++) {
+        for (int block_x = 0; block_x < kWTiles; block_x++) {
+          const float* m =
+              &M_[k * P + batch * kTiles + block_y * kWTiles + block_x];
+          float t[16];
+          for (int i = 0; i < 16; i++) t[i] = m[i * KP];
+
+          // transpose(A).m.A
+          const float o11 = t[0] + t[1] + t[2] + t[4] + t[5] + t[6] + t[8] +
+                            t[9] + t[10];
+          const float o12 = t[1] - t[2] - t[3] + t[5] - t[6] - t[7] + t[9] -
+                            t[10] - t[11];
+          const float o21 = t[4] + t[5] + t[6] - t[8] - t[9] - t[10] - t[12] -
+                            t[13] - t[14];
+          const float o22 = t[5] - t[6] - t[7] - t[9] + t[10] + t[11] - t[13] +
+                            t[14] + t[15];
+
+          // The board is a multiple of the output tiles.
+          const int y = 2 * block_y;
+          const int x = 2 * block_x;
+          plane[y * kWidth + x] = o11;
+          plane[y * kWidth + x + 1] = o12;
+          plane[(y + 1) * kWidth + x] = o21;
+          plane[(y + 1) * kWidth + x + 1] = o22;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace lczero
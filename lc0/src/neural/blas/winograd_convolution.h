@@ -0,0 +1,54 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+
+namespace lczero {
+
+// 3x3 convolutions of 8x8 planes as F(2x2, 3x3) Winograd: 4x4 input tiles,
+// 16 of them on a board, and one SGEMM per element of the tile over the
+// tiles of all positions of the batch.
+class WinogradConvolution3 {
+ public:
+  // Transforms the weights of a convolution, [output][channel][3][3], into
+  // the layout Forward() takes.
+  static std::vector<float> TransformF(const std::vector<float>& f,
+                                       int outputs, int channels);
+
+  // The buffers are for up to @max_batch_size positions and @max_channels
+  // channels of input and output.
+  WinogradConvolution3(int max_batch_size, int max_channels);
+
+  // Convolves @batch_size positions of @input_channels planes (NCHW) into
+  // @output_channels planes each, without biases.
+  void Forward(int batch_size, int input_channels, int output_channels,
+               const float* input, const float* weights, float* output);
+
+ private:
+  void TransformIn(int batch_size, const float* input, int channels);
+  void Sgemm(int batch_size, const float* weights, int input_channels,
+             int output_channels);
+  void TransformOut(int batch_size, float* output, int channels);
+
+  std::vector<float> V_;
+  std::vector<float> M_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,104 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/blas/winograd_convolution.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+namespace lczero {
+
+namespace {
+// The 3x3 convolution with zero padding, the way the weights say.
+std::vector<float> DirectConvolution(int batch_size, int channels, int outputs,
+                                     const std::vector<float>& input,
+                                     const std::vector<float>& weights) {
+  std::vector<float> output(batch_size * outputs * 64);
+  for (int b = 0; b < batch_size; b++) {
+    for (int o = 0; o < outputs; o++) {
+      for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+          float sum = 0.0f;
+          for (int c = 0; c < channels; c++) {
+            for (int i = 0; i < 3; i++) {
+              for (int j = 0; j < 3; j++) {
+                const int yy = y + i - 1;
+                const int xx = x + j - 1;
+                if (yy < 0 || yy >= 8 || xx < 0 || xx >= 8) continue;
+                sum += input[((b * channels + c) * 8 + yy) * 8 + xx] *
+                       weights[((o * channels + c) * 3 + i) * 3 + j];
+              }
+            }
+          }
+          output[((b * outputs + o) * 8 + y) * 8 + x] = sum;
+        }
+      }
+    }
+  }
+  return output;
+}
+}  // namespace
+
+TEST(WinogradConvolution3, MatchesDirectConvolution) {
+  const int kBatchSize = 3;
+  const int kChannels = 5;
+  const int kOutputs = 7;
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  std::vector<float> input(kBatchSize * kChannels * 64);
+  std::vector<float> weights(kOutputs * kChannels * 9);
+  for (auto& x : input) x = dist(rng);
+  for (auto& x : weights) x = dist(rng);
+
+  const auto expected =
+      DirectConvolution(kBatchSize, kChannels, kOutputs, input, weights);
+
+  const auto U = WinogradConvolution3::TransformF(weights, kOutputs, kChannels);
+  WinogradConvolution3 convolution(kBatchSize, kOutputs);
+  std::vector<float> output(kBatchSize * kOutputs * 64);
+  convolution.Forward(kBatchSize, kChannels, kOutputs, input.data(), U.data(),
+                      output.data());
+
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_NEAR(expected[i], output[i], 1e-4f) << "at " << i;
+  }
+}
+
+// A smaller batch than the buffers are for.
+TEST(WinogradConvolution3, PartialBatch) {
+  std::vector<float> input(2 * 64, 0.0f);
+  // A single one in the corner of the second plane.
+  input[64] = 1.0f;
+  std::vector<float> weights(2 * 9, 0.0f);
+  // Output 0 is channel 1 shifted down and right by one square.
+  weights[9 + 0] = 1.0f;
+  const auto U = WinogradConvolution3::TransformF(weights, 1, 2);
+  WinogradConvolution3 convolution(4, 2);
+  std::vector<float> output(64);
+  convolution.Forward(1, 2, 1, input.data(), U.data(), output.data());
+  for (int sq = 0; sq < 64; sq++) {
+    EXPECT_NEAR(output[sq], sq == 9 ? 1.0f : 0.0f, 1e-6f) << "at " << sq;
+  }
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
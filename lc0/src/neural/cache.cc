@@ -16,8 +16,12 @@
   along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "neural/cache.h"
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include "neural/encoder.h"
+#include "neural/shared_cache.h"
+#include "utils/fp16_utils.h"
 
 namespace lczero {
 CachingComputation::CachingComputation(
@@ -30,9 +34,47 @@ int CachingComputation::GetCacheMisses() const {
 
 int CachingComputation::GetBatchSize() const { return batch_.size(); }
 
-bool CachingComputation::AddInputByHash(uint64_t hash) {
+namespace {
+int PrefetchDepthIndex(int depth) {
+  return std::min(depth, PrefetchStats::kMaxDepth) - 1;
+}
+}  // namespace
+
+void PrefetchStats::Add(const PrefetchStats& other) {
+  for (int i = 0; i < kMaxDepth; ++i) {
+    computed[i] += other.computed[i];
+    hits[i] += other.hits[i];
+  }
+}
+
+int PrefetchStats::TotalComputed() const {
+  int total = 0;
+  for (int x : computed) total += x;
+  return total;
+}
+
+int PrefetchStats::TotalHits() const {
+  int total = 0;
+  for (int x : hits) total += x;
+  return total;
+}
+
+bool CachingComputation::AddInputByHash(uint64_t hash, bool prefetch) {
   NNCacheLock lock(cache_, hash);
-  if (!lock) return false;
+  if (!lock) {
+    // Another process may have computed it.
+    SharedNNCache* shared = cache_->GetShared();
+    if (!shared) return false;
+    auto req = shared->Lookup(hash);
+    if (!req) return false;
+    cache_->Insert(hash, std::move(req));
+    lock = NNCacheLock(cache_, hash);
+    if (!lock) return false;
+  }
+  if (!prefetch) {
+    const int depth = lock->prefetch_depth.exchange(0);
+    if (depth > 0) ++prefetch_stats_.hits[PrefetchDepthIndex(depth)];
+  }
   batch_.emplace_back();
   batch_.back().lock = std::move(lock);
   batch_.back().hash = hash;
@@ -40,14 +82,33 @@ bool CachingComputation::AddInputByHash(uint64_t hash) {
 }
 
 void CachingComputation::AddInput(
-    uint64_t hash, InputPlanes&& input,
-    std::vector<uint16_t>&& probabilities_to_cache) {
-  if (AddInputByHash(hash)) return;
+    uint64_t hash, const PositionHistory& history,
+    std::vector<uint16_t>&& probabilities_to_cache, int prefetch_depth) {
+  if (AddInputByHash(hash, prefetch_depth > 0)) return;
   batch_.emplace_back();
   batch_.back().hash = hash;
+  // A transposition, or a prefetch of a position already in the batch.
+  const auto it = idx_in_parent_by_hash_.find(hash);
+  if (it != idx_in_parent_by_hash_.end()) {
+    batch_.back().idx_in_parent = it->second;
+    batch_.back().is_duplicate = true;
+    return;
+  }
+  idx_in_parent_by_hash_.emplace(hash, parent_->GetBatchSize());
   batch_.back().idx_in_parent = parent_->GetBatchSize();
-  batch_.back().probabilities_to_cache = probabilities_to_cache;
-  parent_->AddInput(std::move(input));
+  batch_.back().probabilities_to_cache = std::move(probabilities_to_cache);
+  batch_.back().prefetch_depth = prefetch_depth;
+  if (prefetch_depth > 0) {
+    ++prefetch_stats_.computed[PrefetchDepthIndex(prefetch_depth)];
+  }
+  if (auto planes = parent_->AddInputInPlace()) {
+    EncodePositionForNN(history, planes);
+  } else {
+    parent_->AddInput(EncodePositionForNN(history));
+  }
+  // Only these are ever read, to fill the cache and by the search.
+  const auto& moves = batch_.back().probabilities_to_cache;
+  parent_->SetLegalMoves(moves.data(), moves.size());
 }
 
 void CachingComputation::PopLastInputHit() {
@@ -62,14 +123,17 @@ void CachingComputation::ComputeBlocking() {
 
   // Fill cache with data from NN.
   for (const auto& item : batch_) {
-    if (item.idx_in_parent == -1) continue;
+    if (item.idx_in_parent == -1 || item.is_duplicate) continue;
     auto req =
         std::make_unique<CachedNNRequest>(item.probabilities_to_cache.size());
     req->q = parent_->GetQVal(item.idx_in_parent);
     int idx = 0;
     for (auto x : item.probabilities_to_cache) {
-      req->p[idx++] =
-          std::make_pair(x, parent_->GetPVal(item.idx_in_parent, x));
+      req->p[idx++] = FP32toFP16(parent_->GetPVal(item.idx_in_parent, x));
+    }
+    req->prefetch_depth = std::min(item.prefetch_depth, 255);
+    if (SharedNNCache* shared = cache_->GetShared()) {
+      shared->Insert(item.hash, *req);
     }
     cache_->Insert(item.hash, std::move(req));
   }
@@ -85,18 +149,26 @@ float CachingComputation::GetPVal(int sample, int move_id) const {
   auto& item = batch_[sample];
   if (item.idx_in_parent >= 0)
     return parent_->GetPVal(item.idx_in_parent, move_id);
-  const auto& moves = item.lock->p;
-
-  int total_count = 0;
-  while (total_count < moves.size()) {
-    // Optimization: usually moves are stored in the same order as queried.
-    const auto& move = moves[item.last_idx++];
-    if (item.last_idx == moves.size()) item.last_idx = 0;
-    if (move.first == move_id) return move.second;
-    ++total_count;
+  const auto& priors = item.lock->p;
+  // Priors are stored in the order the moves are queried.
+  if (item.last_idx >= priors.size()) {
+    assert(false);  // More moves than were cached.
+    return 0;
+  }
+  return FP16toFP32(priors[item.last_idx++]);
+}
+
+void CachingComputation::GetPVals(int sample, const uint16_t* move_ids,
+                                  int count, float* out) const {
+  const auto& item = batch_[sample];
+  if (item.idx_in_parent >= 0) {
+    parent_->GetPVals(item.idx_in_parent, move_ids, count, out);
+    return;
   }
-  assert(false);  // Move not found.
-  return 0;
+  const auto& priors = item.lock->p;
+  assert(count == priors.size());
+  count = std::min(count, priors.size());
+  for (int i = 0; i < count; ++i) out[i] = FP16toFP32(priors[i]);
 }
 
 }  // namespace lczero
\ No newline at end of file
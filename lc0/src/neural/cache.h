@@ -17,6 +17,10 @@
 */
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include "chess/position.h"
 #include "neural/network.h"
 #include "utils/cache.h"
 #include "utils/smallarray.h"
@@ -25,14 +29,47 @@ namespace lczero {
 
 struct CachedNNRequest {
   CachedNNRequest(size_t size) : p(size) {}
-  typedef std::pair<uint16_t, float> IdxAndProb;
   float q;
-  // TODO(mooskagh) Don't really need index if using perfect hash.
-  SmallArray<IdxAndProb> p;
+  // Priors as fp16, in the order of the moves they were computed for, which
+  // is the order of the children of the node.
+  SmallArray<uint16_t> p;
+  // For a prefetched entry, how far from the root of the search it was,
+  // until its first lookup. 0 otherwise.
+  std::atomic<uint8_t> prefetch_depth{0};
 };
 
-typedef LruCache<uint64_t, CachedNNRequest> NNCache;
-typedef LruCacheLock<uint64_t, CachedNNRequest> NNCacheLock;
+// How many entries were prefetched and how many of them were looked up
+// later, by their prefetch depth.
+struct PrefetchStats {
+  static const int kMaxDepth = 16;
+  // Index is the depth - 1, deeper prefetches count as kMaxDepth.
+  int computed[kMaxDepth] = {};
+  int hits[kMaxDepth] = {};
+
+  void Add(const PrefetchStats& other);
+  int TotalComputed() const;
+  int TotalHits() const;
+};
+
+class SharedNNCache;
+
+// The cache of NN evaluations of a process, optionally in front of one
+// shared by the processes on the host.
+class NNCache : public ShardedLruCache<uint64_t, CachedNNRequest> {
+ public:
+  using ShardedLruCache::ShardedLruCache;
+
+  // Evaluations missing here are looked up in @shared, and new ones are
+  // inserted into it too. nullptr not to share.
+  void SetShared(std::shared_ptr<SharedNNCache> shared) {
+    shared_ = std::move(shared);
+  }
+  SharedNNCache* GetShared() const { return shared_.get(); }
+
+ private:
+  std::shared_ptr<SharedNNCache> shared_;
+};
+typedef ShardedLruCacheLock<uint64_t, CachedNNRequest> NNCacheLock;
 
 // Wraps around NetworkComputation and caches result.
 // While it mostly repeats NetworkComputation interface, it's not derived
@@ -43,18 +80,27 @@ class CachingComputation {
                      NNCache* cache);
 
   // How many inputs are not found in cache and will be forwarded to a wrapped
-  // computation.
+  // computation, counting inputs of the same position once.
   int GetCacheMisses() const;
   // Total number of timea AddInput/AddInputByHash were (successfully) called.
   int GetBatchSize() const;
   // Adds input by hash only. If that hash is not in cache, returns false
   // and does nothing. Otherwise adds.
-  bool AddInputByHash(uint64_t hash);
+  bool AddInputByHash(uint64_t hash) { return AddInputByHash(hash, false); }
   // Adds a sample to the batch.
   // @hash is a hash to store/lookup it in the cache.
-  // @probabilities_to_cache is which indices of policy head to store.
-  void AddInput(uint64_t hash, InputPlanes&& input,
-                std::vector<uint16_t>&& probabilities_to_cache);
+  // @probabilities_to_cache is which indices of policy head to store. They
+  // must be the legal moves of the position in the order of the children of
+  // its node, as the cache only keeps the priors in that order.
+  // The last position of @history is only encoded if it's not in the cache,
+  // straight into the input buffer of the backend if it has one.
+  // A @prefetch_depth above 0 marks an input which is prefetched rather than
+  // needed, so that its later use is counted.
+  // An input with the @hash of an earlier one in the batch is not computed
+  // again, but shares the result of the earlier one.
+  void AddInput(uint64_t hash, const PositionHistory& history,
+                std::vector<uint16_t>&& probabilities_to_cache,
+                int prefetch_depth = 0);
   // Undos last AddInput. If it was a cache miss, the it's actually not removed
   // from parent's batch.
   void PopLastInputHit();
@@ -62,8 +108,17 @@ class CachingComputation {
   void ComputeBlocking();
   // Returns Q value of @sample.
   float GetQVal(int sample) const;
-  // Returns P value @move_id of @sample.
+  // Returns P value @move_id of @sample. If @sample was found in the cache,
+  // the moves have to be queried in the order of the children of its node.
   float GetPVal(int sample, int move_id) const;
+  // Writes P values of @count moves @move_ids of @sample to @out. For samples
+  // from the cache, the moves have to be all the children of its node, in
+  // order.
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const;
+  // Prefetched inputs of this computation, and lookups of this computation
+  // which found earlier prefetches.
+  const PrefetchStats& GetPrefetchStats() const { return prefetch_stats_; }
 
  private:
   struct WorkItem {
@@ -71,12 +126,21 @@ class CachingComputation {
     NNCacheLock lock;
     int idx_in_parent = -1;
     std::vector<uint16_t> probabilities_to_cache;
+    int prefetch_depth = 0;
+    // Shares idx_in_parent with an earlier item of the same hash, which
+    // fills the cache.
+    bool is_duplicate = false;
     mutable int last_idx = 0;
   };
 
+  bool AddInputByHash(uint64_t hash, bool prefetch);
+
   std::unique_ptr<NetworkComputation> parent_;
   NNCache* cache_;
   std::vector<WorkItem> batch_;
+  // idx_in_parent of the inputs forwarded to the wrapped computation.
+  std::unordered_map<uint64_t, int> idx_in_parent_by_hash_;
+  PrefetchStats prefetch_stats_;
 };
 
 }  // namespace lczero
\ No newline at end of file
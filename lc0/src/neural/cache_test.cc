@@ -0,0 +1,105 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "neural/cache.h"
+#include <gtest/gtest.h>
+#include "chess/position.h"
+
+namespace lczero {
+
+namespace {
+// Q of a sample is its index in the batch, and P of a move its id.
+class IndexComputation : public NetworkComputation {
+ public:
+  void AddInput(InputPlanes&&) override {
+    ++batch_size_;
+    legal_moves_.emplace_back();
+  }
+  void SetLegalMoves(const std::uint16_t* move_ids, int count) override {
+    legal_moves_.back().assign(move_ids, move_ids + count);
+  }
+  void ComputeBlocking() override { ++computed_; }
+  int GetBatchSize() const override { return batch_size_; }
+  float GetQVal(int sample) const override { return sample; }
+  float GetPVal(int, int move_id) const override { return move_id; }
+  int GetComputed() const { return computed_; }
+  const std::vector<std::uint16_t>& GetLegalMoves(int sample) const {
+    return legal_moves_[sample];
+  }
+
+ private:
+  int batch_size_ = 0;
+  int computed_ = 0;
+  std::vector<std::vector<std::uint16_t>> legal_moves_;
+};
+}  // namespace
+
+TEST(CachingComputation, SamePositionIsComputedOnce) {
+  NNCache cache(100);
+  auto parent = std::make_unique<IndexComputation>();
+  const auto* network = parent.get();
+  CachingComputation computation(std::move(parent), &cache);
+  ChessBoard board;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  PositionHistory history;
+  history.Reset(board, 0, 1);
+
+  computation.AddInput(1, history, {10, 20});
+  computation.AddInput(2, history, {30});
+  computation.AddInput(1, history, {10, 20});
+  EXPECT_EQ(computation.GetBatchSize(), 3);
+  EXPECT_EQ(computation.GetCacheMisses(), 2);
+  EXPECT_EQ(network->GetBatchSize(), 2);
+
+  computation.ComputeBlocking();
+  EXPECT_EQ(network->GetComputed(), 1);
+  EXPECT_EQ(computation.GetQVal(0), 0.0f);
+  EXPECT_EQ(computation.GetQVal(1), 1.0f);
+  EXPECT_EQ(computation.GetQVal(2), 0.0f);
+  EXPECT_EQ(computation.GetPVal(2, 20), 20.0f);
+
+  NNCacheLock lock(&cache, 1);
+  ASSERT_TRUE(lock);
+  EXPECT_EQ(lock->p.size(), 2);
+}
+
+TEST(CachingComputation, MissesDeclareTheirMoves) {
+  NNCache cache(100);
+  auto parent = std::make_unique<IndexComputation>();
+  const auto* network = parent.get();
+  CachingComputation computation(std::move(parent), &cache);
+  ChessBoard board;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  PositionHistory history;
+  history.Reset(board, 0, 1);
+
+  computation.AddInput(1, history, {10, 20});
+  computation.AddInput(2, history, {30});
+  computation.AddInput(1, history, {10, 20});
+  ASSERT_EQ(network->GetBatchSize(), 2);
+  EXPECT_EQ(network->GetLegalMoves(0), (std::vector<std::uint16_t>{10, 20}));
+  EXPECT_EQ(network->GetLegalMoves(1), std::vector<std::uint16_t>{30});
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
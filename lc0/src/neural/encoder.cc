@@ -18,17 +18,20 @@
 
 #include "neural/encoder.h"
 
+#include <algorithm>
+
 namespace lczero {
 
 namespace {
 const int kMoveHistory = 8;
 const int kPlanesPerBoard = 13;
 const int kAuxPlaneBase = kPlanesPerBoard * kMoveHistory;
-}  // namespace
-
-InputPlanes EncodePositionForNN(const PositionHistory& history) {
-  InputPlanes result(kAuxPlaneBase + 8);
+static_assert(kAuxPlaneBase + 8 == kInputPlanes, "Unexpected number of planes");
 
+// Encodes into @result, which has to be all empty planes: zero masks and
+// values of 1. Its operator[] gives planes with a mask, SetAll() and Fill().
+template <class Planes>
+void Encode(const PositionHistory& history, Planes& result) {
   {
     const ChessBoard& board = history.Last().GetBoard();
     const bool we_are_black = board.flipped();
@@ -48,7 +51,7 @@ InputPlanes EncodePositionForNN(const PositionHistory& history) {
   for (int i = 0; i < kMoveHistory; ++i, flip = !flip, --history_idx) {
     if (history_idx < 0) break;
     const Position& position = history.GetPositionAt(history_idx);
-    const ChessBoard& board =
+    const ChessBoard board =
         flip ? position.GetThemBoard() : position.GetBoard();
 
     const int base = i * kPlanesPerBoard;
@@ -69,8 +72,40 @@ InputPlanes EncodePositionForNN(const PositionHistory& history) {
     const int repetitions = position.GetRepetitions();
     if (repetitions >= 1) result[base + 12].SetAll();
   }
+}
+
+// Plane of an InputPlanesRef, as InputPlane.
+struct PlaneRef {
+  void SetAll() { mask = ~0ull; }
+  void Fill(float val) {
+    SetAll();
+    value = val;
+  }
+  std::uint64_t& mask;
+  float& value;
+};
 
+struct PlanesRef {
+  PlaneRef operator[](int idx) const {
+    return {planes.masks[idx], planes.values[idx]};
+  }
+  InputPlanesRef planes;
+};
+}  // namespace
+
+InputPlanes EncodePositionForNN(const PositionHistory& history) {
+  InputPlanes result;
+  Encode(history, result);
   return result;
 }
 
-}  // namespace lczero
\ No newline at end of file
+void EncodePositionForNN(const PositionHistory& history,
+                         InputPlanesRef planes) {
+  // The buffer may hold an earlier sample.
+  std::fill(planes.masks, planes.masks + kInputPlanes, 0ull);
+  std::fill(planes.values, planes.values + kInputPlanes, 1.0f);
+  PlanesRef result{planes};
+  Encode(history, result);
+}
+
+}  // namespace lczero
@@ -26,4 +26,7 @@ namespace lczero {
 // Encodes the last position in history for the neural network request.
 InputPlanes EncodePositionForNN(const PositionHistory& history);
 
+// Same, writing all planes to @planes.
+void EncodePositionForNN(const PositionHistory& history, InputPlanesRef planes);
+
 }  // namespace lczero
\ No newline at end of file
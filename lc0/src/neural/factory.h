@@ -80,11 +80,17 @@ class NetworkFactory {
 // @cls -- class name of a backend.
 // @priority -- numeric priority of a backend. Higher is higher, highest number
 // is the default backend.
-#define REGISTER_NETWORK(name, cls, priority)             \
-  static NetworkFactory::Register regH38fhs##__COUNTER__( \
-      name,                                               \
-      [](const Weights& w, const OptionsDict& o) {        \
-        return std::make_unique<cls>(w, o);               \
-      },                                                  \
+#define REGISTER_NETWORK_WITH_COUNTER2(name, cls, priority, counter) \
+  static NetworkFactory::Register regH38fhs##counter(                \
+      name,                                                          \
+      [](const Weights& w, const OptionsDict& o) {                   \
+        return std::make_unique<cls>(w, o);                          \
+      },                                                             \
       priority)
+// Expands __COUNTER__ before it's pasted, so that a file can register more
+// than one backend.
+#define REGISTER_NETWORK_WITH_COUNTER(name, cls, priority, counter) \
+  REGISTER_NETWORK_WITH_COUNTER2(name, cls, priority, counter)
+#define REGISTER_NETWORK(name, cls, priority) \
+  REGISTER_NETWORK_WITH_COUNTER(name, cls, priority, __COUNTER__)
 }  // namespace lczero
@@ -17,61 +17,281 @@
 */
 
 #include "neural/loader.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 #include <algorithm>
-#include <cctype>
-#include <cstdio>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <experimental/filesystem>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
 #include "utils/commandline.h"
 #include "utils/exception.h"
+#include "utils/fp16_utils.h"
 
 namespace lczero {
 
-FloatVectors LoadFloatsFromFile(const std::string& filename) {
-  const int kStartingSize = 8 * 1024 * 1024;  // 8M
-  std::vector<char> buffer(kStartingSize);
-  int bytes_read = 0;
+namespace {
+const char kBinaryMagic[4] = {'L', 'C', 'Z', 'W'};
+const uint32_t kBinaryVersion = 2;
+const uint32_t kEncodingFloat32 = 0;
+const uint32_t kEncodingFloat16 = 1;
+
+bool IsBinaryWeightsFile(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  char magic[sizeof(kBinaryMagic)];
+  return file.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, kBinaryMagic, sizeof(kBinaryMagic)) == 0;
+}
+
+uint32_t ReadUint32(const char* data) {
+  uint32_t value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Files smaller than this are parsed on one thread.
+const size_t kMinParallelParseSize = 1024 * 1024;
 
-  // Read whole file into a buffer.
-  FILE* file = std::fopen(filename.c_str(), "rb");
+// Reads the whole file. gzip compressed files are decompressed on the fly,
+// other files are read as they are.
+std::string ReadFile(const std::string& filename) {
+  gzFile file = gzopen(filename.c_str(), "rb");
   if (!file) throw Exception("Cannot read weights from " + filename);
+  gzbuffer(file, 1024 * 1024);
+  std::string buffer;
+  const size_t kChunkSize = 8 * 1024 * 1024;
   while (true) {
-    auto sz = fread(&buffer[bytes_read], 1, buffer.size() - bytes_read, file);
-    if (sz == buffer.size() - bytes_read) {
-      bytes_read = buffer.size();
-      buffer.resize(buffer.size() * 2);
+    const size_t size = buffer.size();
+    buffer.resize(size + kChunkSize);
+    const int bytes_read = gzread(file, &buffer[size], kChunkSize);
+    if (bytes_read < 0) {
+      gzclose(file);
+      throw Exception("Cannot read weights from " + filename);
+    }
+    buffer.resize(size + bytes_read);
+    if (bytes_read == 0) break;
+  }
+  gzclose(file);
+  return buffer;
+}
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+// Parses one float of [@begin, @end) the way strtod does, without its locale
+// lookups. Returns false for what it doesn't handle exactly.
+bool ParseFloatFast(const char* begin, const char* end, float* out) {
+  // Powers of ten which are exact doubles.
+  static const double kPowersOfTen[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const int kMaxPower = 22;
+  // Integers up to this many digits are exact doubles.
+  const int kMaxDigits = 15;
+
+  const char* c = begin;
+  const bool negative = c != end && *c == '-';
+  if (c != end && (*c == '-' || *c == '+')) ++c;
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool seen_digit = false;
+  for (; c != end && *c >= '0' && *c <= '9'; ++c) {
+    seen_digit = true;
+    if (mantissa == 0 && *c == '0') continue;
+    mantissa = mantissa * 10 + (*c - '0');
+    ++digits;
+  }
+  if (c != end && *c == '.') {
+    for (++c; c != end && *c >= '0' && *c <= '9'; ++c) {
+      seen_digit = true;
+      --exponent;
+      if (mantissa == 0 && *c == '0') continue;
+      mantissa = mantissa * 10 + (*c - '0');
+      ++digits;
+    }
+  }
+  if (!seen_digit || digits > kMaxDigits) return false;
+  if (c != end && (*c == 'e' || *c == 'E')) {
+    ++c;
+    const bool negative_exponent = c != end && *c == '-';
+    if (c != end && (*c == '-' || *c == '+')) ++c;
+    if (c == end) return false;
+    int value = 0;
+    for (; c != end && *c >= '0' && *c <= '9'; ++c) {
+      if (value > 1000) return false;
+      value = value * 10 + (*c - '0');
+    }
+    exponent += negative_exponent ? -value : value;
+  }
+  if (c != end) return false;
+
+  double result = mantissa;
+  if (mantissa != 0) {
+    if (exponent < -kMaxPower || exponent > kMaxPower) return false;
+    if (exponent < 0) {
+      result /= kPowersOfTen[-exponent];
     } else {
-      bytes_read += sz;
-      buffer.resize(bytes_read);
-      // Add newline in the end for the case it was not there.
-      buffer.push_back('\n');
-      break;
+      result *= kPowersOfTen[exponent];
+    }
+  }
+  *out = negative ? -result : result;
+  return true;
+}
+
+// Appends the whitespace separated floats of [@begin, @end) to @out.
+void ParseFloats(const char* begin, const char* end, FloatVector* out) {
+  const char* c = begin;
+  while (true) {
+    while (c != end && IsSpace(*c)) ++c;
+    if (c == end) break;
+    const char* token = c;
+    while (c != end && !IsSpace(*c)) ++c;
+    float value;
+    if (!ParseFloatFast(token, c, &value)) {
+      // Anything unusual goes through the C library, like it used to.
+      value = std::atof(std::string(token, c).c_str());
     }
+    out->push_back(value);
   }
-  std::fclose(file);
+}
 
-  // Parse buffer.
+// Parses the binary format of src/WeightsFile.h. Version 2 files have an
+// encoding field, which tells whether the floats are in half precision.
+FloatVectors ParseBinaryWeights(const char* data, size_t size) {
+  const char* end = data + size;
+  const size_t header_size = sizeof(kBinaryMagic) + 3 * sizeof(uint32_t);
+  if (size < header_size) throw Exception("Truncated weights file");
+  const char* pos = data + sizeof(kBinaryMagic);
+  const uint32_t version = ReadUint32(pos);
+  if (version < 1 || version > kBinaryVersion) {
+    throw Exception("Binary weights version " +
+                    std::to_string(kBinaryVersion) + " or older expected");
+  }
   FloatVectors result;
-  FloatVector line;
-  int start = 0;
-  for (int i = 0; i < buffer.size(); ++i) {
-    char& c = buffer[i];
-    const bool is_newline = (c == '\n' || c == '\r');
-    if (!std::isspace(c)) continue;
-    if (start < i) {
-      // If previous character was not space too.
-      c = '\0';
-      line.push_back(std::atof(&buffer[start]));
+  // The first vector is the format version, like the first text line.
+  result.push_back({static_cast<float>(ReadUint32(pos + 4))});
+  const size_t count = ReadUint32(pos + 8);
+  pos += 3 * sizeof(uint32_t);
+  uint32_t encoding = kEncodingFloat32;
+  if (version >= 2) {
+    if (end - pos < 4) throw Exception("Truncated weights file");
+    encoding = ReadUint32(pos);
+    pos += sizeof(uint32_t);
+  }
+  if (encoding != kEncodingFloat32 && encoding != kEncodingFloat16) {
+    throw Exception("Unknown binary weights encoding");
+  }
+  const size_t element_size =
+      encoding == kEncodingFloat16 ? sizeof(uint16_t) : sizeof(float);
+  if ((end - pos) / sizeof(uint32_t) < count) {
+    throw Exception("Truncated weights file");
+  }
+  const char* floats = pos + count * sizeof(uint32_t);
+  for (size_t i = 0; i < count; ++i) {
+    const size_t line_size = ReadUint32(pos + i * sizeof(uint32_t));
+    if ((end - floats) / element_size < line_size) {
+      throw Exception("Truncated weights file");
     }
-    if (is_newline && !line.empty()) {
-      result.emplace_back();
-      result.back().swap(line);
+    result.emplace_back(line_size);
+    if (encoding == kEncodingFloat16) {
+      for (size_t j = 0; j < line_size; ++j) {
+        uint16_t half;
+        std::memcpy(&half, floats + j * sizeof(half), sizeof(half));
+        result.back()[j] = FP16toFP32(half);
+      }
+    } else {
+      std::memcpy(result.back().data(), floats, line_size * sizeof(float));
     }
-    start = i + 1;
+    floats += line_size * element_size;
+  }
+  return result;
+}
+
+// The binary file is mapped rather than read, so the only pass over the
+// floats is the copy into the vectors. Where it can't be mapped, e.g. on file
+// systems without mmap, it is read.
+FloatVectors LoadFloatsFromBinaryFile(const std::string& filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) throw Exception("Cannot read weights from " + filename);
+  struct stat st;
+  const bool ok = fstat(fd, &st) == 0;
+  const size_t size = ok ? st.st_size : 0;
+  void* mapped = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                      : MAP_FAILED;
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    const std::string buffer = ReadFile(filename);
+    return ParseBinaryWeights(buffer.data(), buffer.size());
+  }
+
+  FloatVectors result;
+  try {
+    result = ParseBinaryWeights(static_cast<const char*>(mapped), size);
+  } catch (...) {
+    munmap(mapped, size);
+    throw;
+  }
+  munmap(mapped, size);
+  return result;
+}
+}  // namespace
+
+FloatVectors LoadFloatsFromFile(const std::string& filename) {
+  if (IsBinaryWeightsFile(filename)) return LoadFloatsFromBinaryFile(filename);
+
+  const std::string buffer = ReadFile(filename);
+  // The training pipeline uploads gzipped binary files.
+  if (buffer.size() >= sizeof(kBinaryMagic) &&
+      std::memcmp(buffer.data(), kBinaryMagic, sizeof(kBinaryMagic)) == 0) {
+    return ParseBinaryWeights(buffer.data(), buffer.size());
   }
 
+  // Split into lines first, so that they can be parsed in parallel.
+  std::vector<std::pair<const char*, const char*>> lines;
+  const char* line_start = buffer.data();
+  const char* const buffer_end = buffer.data() + buffer.size();
+  for (const char* c = line_start; c != buffer_end; ++c) {
+    if (*c != '\n' && *c != '\r') continue;
+    if (line_start < c) lines.emplace_back(line_start, c);
+    line_start = c + 1;
+  }
+  if (line_start < buffer_end) lines.emplace_back(line_start, buffer_end);
+
+  // Lines differ in size by orders of magnitude, so threads take the next
+  // line when they are done rather than a fixed share.
+  FloatVectors result(lines.size());
+  std::atomic<size_t> next_line(0);
+  const auto parse_lines = [&]() {
+    for (size_t i = next_line++; i < lines.size(); i = next_line++) {
+      ParseFloats(lines[i].first, lines[i].second, &result[i]);
+    }
+  };
+  const size_t threads =
+      buffer.size() < kMinParallelParseSize
+          ? 1
+          : std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u),
+                             lines.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i) workers.emplace_back(parse_lines);
+  parse_lines();
+  for (auto& worker : workers) worker.join();
+
+  // Lines of spaces only are not vectors.
+  result.erase(std::remove_if(result.begin(), result.end(),
+                              [](const FloatVector& v) { return v.empty(); }),
+               result.end());
   return result;
 }
 
@@ -124,6 +344,19 @@ Weights LoadWeightsFromFile(const std::string& filename) {
   return result;
 }
 
+void FoldBatchNorm(Weights::ConvBlock* block) {
+  const float epsilon = 1e-5f;
+  const int outputs = block->biases.size();
+  const int weights_per_output = block->weights.size() / outputs;
+  for (int o = 0; o < outputs; o++) {
+    const float scale = 1.0f / std::sqrt(block->bn_stddivs[o] + epsilon);
+    for (int i = 0; i < weights_per_output; i++) {
+      block->weights[o * weights_per_output + i] *= scale;
+    }
+    block->biases[o] = (block->biases[o] - block->bn_means[o]) * scale;
+  }
+}
+
 std::string DiscoveryWeightsFile() {
   const int kMinFileSize = 30000000;
 
@@ -141,10 +374,17 @@ std::string DiscoveryWeightsFile() {
   std::sort(candidates.rbegin(), candidates.rend());
 
   for (const auto& candidate : candidates) {
-    std::ifstream file(candidate.second.c_str());
-    int val = 0;
-    file >> val;
-    if (!file.fail() && val == 2) {
+    if (IsBinaryWeightsFile(candidate.second)) {
+      std::cerr << "Found network file: " << candidate.second << std::endl;
+      return candidate.second;
+    }
+    // Reads compressed files too.
+    gzFile file = gzopen(candidate.second.c_str(), "rb");
+    if (!file) continue;
+    char header[16] = {};
+    const int header_size = gzread(file, header, sizeof(header) - 1);
+    gzclose(file);
+    if (header_size > 0 && std::atoi(header) == 2) {
       std::cerr << "Found network file: " << candidate.second << std::endl;
       return candidate.second;
     }
@@ -29,11 +29,20 @@ using FloatVector = std::vector<float>;
 using FloatVectors = std::vector<FloatVector>;
 
 // Read space separated file of floats and return it as a vector of vectors.
+// The file may be gzip compressed. Lines are parsed on all cores.
+// Also reads the binary weights format written by lczero --convert-weights
+// and the training pipeline, gzipped or not, whose first vector is the
+// weights format version.
 FloatVectors LoadFloatsFromFile(const std::string& filename);
 
 // Read v2 weights file and fill the weights structure.
 Weights LoadWeightsFromFile(const std::string& filename);
 
+// Folds the batchnorm of a convolution into its weights and biases, the same
+// as the cudnn backend does: the convolution then gives the normalized output
+// by itself. bn_means and bn_stddivs are left as they are.
+void FoldBatchNorm(Weights::ConvBlock* block);
+
 // Tries to find a file which looks like a weights file, and located in
 // directory of binary_name or one of subdirectories. If there are several such
 // files, returns one which has the latest modification date.
@@ -0,0 +1,173 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/loader.h"
+#include <gtest/gtest.h>
+#include <zlib.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace lczero {
+
+namespace {
+const char* kWeightsText =
+    "2\n"
+    "0.5 -1.25 3e-2\r\n"
+    "  \n"
+    "\t-0.000123456789 +7 1.5E+3 123456789012345678901234 1e-40 -0\n"
+    "0.1234567";
+
+std::string TempFileName(const char* suffix) {
+  return std::string(testing::TempDir()) + "loader_test" + suffix;
+}
+
+void ExpectWeightsText(const FloatVectors& vecs) {
+  const FloatVectors expected = {
+      {2.0f},
+      {0.5f, -1.25f, static_cast<float>(std::atof("3e-2"))},
+      {static_cast<float>(std::atof("-0.000123456789")), 7.0f, 1500.0f,
+       static_cast<float>(std::atof("123456789012345678901234")),
+       static_cast<float>(std::atof("1e-40")), -0.0f},
+      {static_cast<float>(std::atof("0.1234567"))}};
+  EXPECT_EQ(vecs, expected);
+  ASSERT_EQ(vecs.size(), 4);
+  EXPECT_TRUE(std::signbit(vecs[2][5]));
+}
+}  // namespace
+
+TEST(LoadFloatsFromFile, Text) {
+  const std::string filename = TempFileName(".txt");
+  std::ofstream(filename) << kWeightsText;
+  ExpectWeightsText(LoadFloatsFromFile(filename));
+  std::remove(filename.c_str());
+}
+
+TEST(LoadFloatsFromFile, Gzip) {
+  const std::string filename = TempFileName(".txt.gz");
+  gzFile file = gzopen(filename.c_str(), "wb");
+  ASSERT_TRUE(file);
+  gzputs(file, kWeightsText);
+  gzclose(file);
+  ExpectWeightsText(LoadFloatsFromFile(filename));
+  std::remove(filename.c_str());
+}
+
+TEST(LoadFloatsFromFile, SameAsAtof) {
+  // Enough to be parsed on several threads.
+  const std::string filename = TempFileName(".txt");
+  std::string text;
+  std::vector<float> expected;
+  char number[32];
+  std::srand(42);
+  for (int i = 0; i < 200000; ++i) {
+    const double value = (std::rand() - RAND_MAX / 2) / 1e7;
+    std::snprintf(number, sizeof(number), i % 2 ? "%.9g " : "%.17g ", value);
+    text += number;
+    expected.push_back(std::atof(number));
+    if (i % 1000 == 999) text += '\n';
+  }
+  std::ofstream(filename) << text;
+  const FloatVectors vecs = LoadFloatsFromFile(filename);
+  std::vector<float> floats;
+  for (const auto& vec : vecs) {
+    floats.insert(floats.end(), vec.begin(), vec.end());
+  }
+  EXPECT_EQ(vecs.size(), 200);
+  EXPECT_EQ(floats, expected);
+  std::remove(filename.c_str());
+}
+
+namespace {
+// A version 2 binary file of format 2 with the lines {0.5, -1.25} and {},
+// in half precision when @half.
+std::string BinaryWeights(bool half) {
+  std::string data = "LCZW";
+  const auto append = [&data](const void* value, size_t size) {
+    data.append(static_cast<const char*>(value), size);
+  };
+  for (uint32_t value : {2u, 2u, 2u, half ? 1u : 0u, 2u, 0u}) {
+    append(&value, sizeof(value));
+  }
+  if (half) {
+    for (uint16_t value : {0x3800, 0xbd00}) append(&value, sizeof(value));
+  } else {
+    for (float value : {0.5f, -1.25f}) append(&value, sizeof(value));
+  }
+  return data;
+}
+
+const FloatVectors kBinaryLines = {{2.0f}, {0.5f, -1.25f}, {}};
+}  // namespace
+
+TEST(LoadFloatsFromFile, Binary) {
+  const std::string filename = TempFileName(".bin");
+  for (bool half : {false, true}) {
+    std::ofstream(filename, std::ios::binary) << BinaryWeights(half);
+    EXPECT_EQ(LoadFloatsFromFile(filename), kBinaryLines);
+  }
+  const std::string data = BinaryWeights(false);
+  std::ofstream(filename, std::ios::binary) << data.substr(0, data.size() - 1);
+  EXPECT_ANY_THROW(LoadFloatsFromFile(filename));
+  std::remove(filename.c_str());
+}
+
+TEST(LoadFloatsFromFile, GzipBinary) {
+  const std::string filename = TempFileName(".bin.gz");
+  const std::string data = BinaryWeights(true);
+  gzFile file = gzopen(filename.c_str(), "wb");
+  ASSERT_TRUE(file);
+  gzwrite(file, data.data(), data.size());
+  gzclose(file);
+  EXPECT_EQ(LoadFloatsFromFile(filename), kBinaryLines);
+  std::remove(filename.c_str());
+}
+
+TEST(FoldBatchNorm, NormalizesOutputs) {
+  // Two outputs of two weights each.
+  Weights::ConvBlock block;
+  block.weights = {1.0f, -2.0f, 0.5f, 4.0f};
+  block.biases = {0.25f, -1.0f};
+  block.bn_means = {1.0f, -3.0f};
+  block.bn_stddivs = {4.0f, 0.25f};
+  const Weights::ConvBlock original = block;
+  FoldBatchNorm(&block);
+
+  const float x[] = {0.75f, -1.5f};
+  for (int o = 0; o < 2; o++) {
+    float raw = original.biases[o];
+    float folded = block.biases[o];
+    for (int i = 0; i < 2; i++) {
+      raw += original.weights[o * 2 + i] * x[i];
+      folded += block.weights[o * 2 + i] * x[i];
+    }
+    const float expected = (raw - original.bn_means[o]) /
+                           std::sqrt(original.bn_stddivs[o] + 1e-5f);
+    EXPECT_NEAR(folded, expected, 1e-5f);
+  }
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <memory>
 #include <vector>
 
@@ -71,13 +73,33 @@ struct InputPlane {
   std::uint64_t mask = 0ull;
   float value = 1.0f;
 };
-using InputPlanes = std::vector<InputPlane>;
+// Fixed size, so that encoding a position doesn't allocate.
+using InputPlanes = std::array<InputPlane, kInputPlanes>;
+
+// Planes of a sample in an input buffer owned by a backend: the mask and value
+// of plane i are masks[i] and values[i].
+struct InputPlanesRef {
+  std::uint64_t* masks;
+  float* values;
+  explicit operator bool() const { return masks != nullptr; }
+};
 
 // An interface to implement by computing backends.
 class NetworkComputation {
  public:
   // Adds a sample to the batch.
   virtual void AddInput(InputPlanes&& input) = 0;
+  // Adds a sample to the batch and returns where in the input buffer of the
+  // backend to write its planes, all of them before ComputeBlocking(). This
+  // saves copying InputPlanes into the buffer. Returns a null ref, and adds
+  // nothing, if the backend has no such buffer; AddInput() is for them.
+  virtual InputPlanesRef AddInputInPlace() { return {nullptr, nullptr}; }
+  // Declares the policy outputs the caller is going to read for the sample
+  // added last, the @count moves @move_ids, in the order of GetPVals(). A
+  // backend may then compute or copy only those, so GetPVal()/GetPVals() of
+  // the sample must not ask for other moves. Backends which can't do better
+  // ignore it.
+  virtual void SetLegalMoves(const std::uint16_t* move_ids, int count) {}
   // Do the computation.
   virtual void ComputeBlocking() = 0;
   // Returns how many times AddInput() was called.
@@ -86,12 +108,36 @@ class NetworkComputation {
   virtual float GetQVal(int sample) const = 0;
   // Returns P value @move_id of @sample.
   virtual float GetPVal(int sample, int move_id) const = 0;
+  // Writes P values of @count moves @move_ids of @sample to @out. Backends
+  // override it when they can do better than calling GetPVal() for each.
+  virtual void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                        float* out) const {
+    for (int i = 0; i < count; ++i) out[i] = GetPVal(sample, move_ids[i]);
+  }
   virtual ~NetworkComputation() {}
 };
 
 class Network {
  public:
   virtual std::unique_ptr<NetworkComputation> NewComputation() = 0;
+  // Computes a batch of @batch_size dummy inputs, so that what the backend
+  // sets up on its first computations (handles, algorithm selection, memory)
+  // is done before a search needs it.
+  virtual void Warmup(int batch_size) {
+    auto computation = NewComputation();
+    for (int i = 0; i < batch_size; ++i) computation->AddInput(InputPlanes{});
+    computation->ComputeBlocking();
+  }
+  // Tells apart networks created with the same weights which evaluate
+  // differently, e.g. with other networks for some positions, so that caches
+  // shared between engines keep their evaluations apart. 0 if the weights
+  // are all there is to it.
+  virtual uint64_t GetCacheNamespace() const { return 0; }
+  // Prepares the calling thread to compute, e.g. makes the GPU of the backend
+  // its current device. NewComputation() does so for its caller, so only
+  // threads which compute what other threads created need to call it, once
+  // before they start.
+  virtual void InitThread() {}
   virtual ~Network(){};
 };
 
@@ -0,0 +1,306 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "neural/blas/blas.h"
+#include "neural/blas/winograd_convolution.h"
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "utils/bititer.h"
+#include "utils/exception.h"
+#include "utils/trace.h"
+#include "utils/worker_pool.h"
+
+namespace lczero {
+namespace {
+
+const int kNumOutputPolicy = 1858;
+const int kSquares = 64;
+
+// data = relu(data + biases + residual) for @batch_size positions of
+// @channels planes.
+void BiasRelu(int batch_size, int channels, float* data, const float* biases,
+              const float* residual = nullptr) {
+  for (int i = 0; i < batch_size * channels; i++) {
+    const float bias = biases[i % channels];
+    float* plane = &data[i * kSquares];
+    for (int sq = 0; sq < kSquares; sq++) {
+      float value = plane[sq] + bias;
+      if (residual) value += residual[i * kSquares + sq];
+      plane[sq] = value > 0.0f ? value : 0.0f;
+    }
+  }
+}
+
+// A 1x1 convolution, one GEMM per position.
+void Convolve1(int batch_size, int channels, int outputs, const float* input,
+               const Weights::ConvBlock& block, float* output) {
+  for (int i = 0; i < batch_size; i++) {
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, outputs, kSquares,
+                channels, 1.0f, block.weights.data(), channels,
+                &input[i * channels * kSquares], kSquares, 0.0f,
+                &output[i * outputs * kSquares], kSquares);
+  }
+  BiasRelu(batch_size, outputs, output, block.biases.data());
+}
+
+// A fully connected layer for all positions of the batch.
+void InnerProduct(int batch_size, int inputs, int outputs, const float* input,
+                  const Weights::Vec& weights, const Weights::Vec& biases,
+                  bool relu, float* output) {
+  cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, batch_size, outputs,
+              inputs, 1.0f, input, inputs, weights.data(), inputs, 0.0f,
+              output, outputs);
+  for (int i = 0; i < batch_size; i++) {
+    float* out = &output[i * outputs];
+    for (int o = 0; o < outputs; o++) {
+      out[o] += biases[o];
+      if (relu && out[o] < 0.0f) out[o] = 0.0f;
+    }
+  }
+}
+
+class BlasNetwork;
+
+class BlasComputation : public NetworkComputation {
+ public:
+  BlasComputation(BlasNetwork* network) : network_(network) {}
+
+  void AddInput(InputPlanes&& input) override {
+    const InputPlanesRef planes = AddInputInPlace();
+    for (int i = 0; i < kInputPlanes; ++i) {
+      planes.masks[i] = input[i].mask;
+      planes.values[i] = input[i].value;
+    }
+  }
+
+  InputPlanesRef AddInputInPlace() override {
+    masks_.resize(masks_.size() + kInputPlanes);
+    values_.resize(values_.size() + kInputPlanes);
+    return {&masks_[masks_.size() - kInputPlanes],
+            &values_[values_.size() - kInputPlanes]};
+  }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return masks_.size() / kInputPlanes; }
+
+  float GetQVal(int sample) const override { return q_values_[sample]; }
+  float GetPVal(int sample, int move_id) const override {
+    return policy_[sample * kNumOutputPolicy + move_id];
+  }
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    const float* policy = &policy_[sample * kNumOutputPolicy];
+    for (int i = 0; i < count; ++i) out[i] = policy[move_ids[i]];
+  }
+
+ private:
+  BlasNetwork* network_;
+  std::vector<std::uint64_t> masks_;
+  std::vector<float> values_;
+  std::vector<float> policy_;
+  std::vector<float> q_values_;
+};
+
+class BlasNetwork : public Network {
+ public:
+  BlasNetwork(const Weights& weights, const OptionsDict& options)
+      : weights_(weights) {
+    threads_ = options.GetOrDefault<int>(
+        "threads", std::max(1u, std::thread::hardware_concurrency()));
+    if (threads_ < 1) throw Exception("BLAS threads must be positive.");
+    SetBlasSingleThreaded();
+
+    channels_ = weights_.input.biases.size();
+    pol_planes_ = weights_.policy.biases.size();
+    val_planes_ = weights_.value.biases.size();
+    value_hidden_ = weights_.ip1_val_b.size();
+    if (static_cast<int>(weights_.ip_pol_b.size()) != kNumOutputPolicy) {
+      throw Exception("Unexpected policy size of the network for BLAS.");
+    }
+
+    FoldBatchNorm(&weights_.input);
+    weights_.input.weights = WinogradConvolution3::TransformF(
+        weights_.input.weights, channels_, kInputPlanes);
+    for (auto& residual : weights_.residual) {
+      for (auto* conv : {&residual.conv1, &residual.conv2}) {
+        FoldBatchNorm(conv);
+        conv->weights = WinogradConvolution3::TransformF(conv->weights,
+                                                         channels_, channels_);
+      }
+    }
+    FoldBatchNorm(&weights_.policy);
+    FoldBatchNorm(&weights_.value);
+
+    pool_ = std::make_unique<WorkerPool>(threads_ - 1);
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<BlasComputation>(this);
+  }
+
+  // Splits the batch between the calling thread and the workers, a part
+  // each.
+  void Forward(int batch_size, const std::uint64_t* masks,
+               const float* values, float* policy, float* q_values) {
+    const int parts = std::min(threads_, batch_size);
+    std::vector<std::function<void()>> work(parts);
+    int start = 0;
+    for (int part = 0; part < parts; part++) {
+      // The first batch_size % parts parts have one more position.
+      const int size = batch_size / parts + (part < batch_size % parts);
+      work[part] = [=]() {
+        ForwardPart(size, masks + start * kInputPlanes,
+                    values + start * kInputPlanes,
+                    policy + start * kNumOutputPolicy, q_values + start);
+      };
+      start += size;
+    }
+    pool_->Run(work);
+  }
+
+ private:
+  // The scratch space of ForwardPart(). Each thread which runs it keeps its
+  // own, grown to the largest part it has run, so a batch allocates nothing.
+  struct Buffers {
+    int batch_size = 0;
+    int channels = 0;
+    std::unique_ptr<WinogradConvolution3> convolution;
+    std::vector<float> input;
+    std::vector<float> flow;
+    std::vector<float> mid;
+    std::vector<float> out;
+    std::vector<float> head;
+    std::vector<float> hidden;
+  };
+
+  void ForwardPart(int batch_size, const std::uint64_t* masks,
+                   const float* values, float* policy, float* q_values) const {
+    thread_local Buffers buffers;
+    const int max_channels = std::max(channels_, kInputPlanes);
+    if (buffers.batch_size < batch_size || buffers.channels < max_channels) {
+      buffers.batch_size = std::max(buffers.batch_size, batch_size);
+      buffers.channels = std::max(buffers.channels, max_channels);
+      buffers.convolution = std::make_unique<WinogradConvolution3>(
+          buffers.batch_size, buffers.channels);
+    }
+    WinogradConvolution3& convolution = *buffers.convolution;
+    const int planes = batch_size * channels_ * kSquares;
+    std::vector<float>& input = buffers.input;
+    input.assign(batch_size * kInputPlanes * kSquares, 0.0f);
+    std::vector<float>& flow = buffers.flow;
+    std::vector<float>& mid = buffers.mid;
+    std::vector<float>& out = buffers.out;
+    flow.resize(planes);
+    mid.resize(planes);
+    out.resize(planes);
+
+    for (int i = 0; i < batch_size * kInputPlanes; i++) {
+      for (auto sq : IterateBits(masks[i])) {
+        input[i * kSquares + sq] = values[i];
+      }
+    }
+
+    convolution.Forward(batch_size, kInputPlanes, channels_, input.data(),
+                        weights_.input.weights.data(), flow.data());
+    BiasRelu(batch_size, channels_, flow.data(),
+             weights_.input.biases.data());
+
+    for (const auto& residual : weights_.residual) {
+      convolution.Forward(batch_size, channels_, channels_, flow.data(),
+                          residual.conv1.weights.data(), mid.data());
+      BiasRelu(batch_size, channels_, mid.data(),
+               residual.conv1.biases.data());
+      convolution.Forward(batch_size, channels_, channels_, mid.data(),
+                          residual.conv2.weights.data(), out.data());
+      BiasRelu(batch_size, channels_, out.data(),
+               residual.conv2.biases.data(), flow.data());
+      std::swap(flow, out);
+    }
+
+    // Policy head, with the softmax.
+    std::vector<float>& head = buffers.head;
+    head.resize(batch_size * std::max(pol_planes_, val_planes_) * kSquares);
+    Convolve1(batch_size, channels_, pol_planes_, flow.data(), weights_.policy,
+              head.data());
+    InnerProduct(batch_size, pol_planes_ * kSquares, kNumOutputPolicy,
+                 head.data(), weights_.ip_pol_w, weights_.ip_pol_b, false,
+                 policy);
+    for (int i = 0; i < batch_size; i++) {
+      float* p = &policy[i * kNumOutputPolicy];
+      const float max = *std::max_element(p, p + kNumOutputPolicy);
+      float sum = 0.0f;
+      for (int j = 0; j < kNumOutputPolicy; j++) {
+        p[j] = std::exp(p[j] - max);
+        sum += p[j];
+      }
+      for (int j = 0; j < kNumOutputPolicy; j++) p[j] /= sum;
+    }
+
+    // Value head.
+    std::vector<float>& hidden = buffers.hidden;
+    hidden.resize(batch_size * value_hidden_);
+    Convolve1(batch_size, channels_, val_planes_, flow.data(), weights_.value,
+              head.data());
+    InnerProduct(batch_size, val_planes_ * kSquares, value_hidden_,
+                 head.data(), weights_.ip1_val_w, weights_.ip1_val_b, true,
+                 hidden.data());
+    for (int i = 0; i < batch_size; i++) {
+      float sum = weights_.ip2_val_b[0];
+      for (int j = 0; j < value_hidden_; j++) {
+        sum += weights_.ip2_val_w[j] * hidden[i * value_hidden_ + j];
+      }
+      q_values[i] = std::tanh(sum);
+    }
+  }
+
+  // With batchnorm folded in and the 3x3 convolutions Winograd transformed.
+  Weights weights_;
+  int threads_;
+  int channels_;
+  int pol_planes_;
+  int val_planes_;
+  int value_hidden_;
+
+  // threads_ - 1 workers. Computations of several search threads share
+  // them.
+  std::unique_ptr<WorkerPool> pool_;
+};
+
+void BlasComputation::ComputeBlocking() {
+  TraceScope trace("blas backend");
+  const int batch_size = GetBatchSize();
+  policy_.resize(batch_size * kNumOutputPolicy);
+  q_values_.resize(batch_size);
+  if (batch_size == 0) return;
+  network_->Forward(batch_size, masks_.data(), values_.data(), policy_.data(),
+                    q_values_.data());
+}
+
+}  // namespace
+
+REGISTER_NETWORK("blas", BlasNetwork, 50);
+
+}  // namespace lczero
@@ -0,0 +1,236 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "neural/factory.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "neural/loader.h"
+#include "neural/remote.h"
+#include "utils/exception.h"
+#include "utils/hashcat.h"
+#include "utils/worker_pool.h"
+
+namespace lczero {
+namespace {
+
+// Planes of the pieces of both sides in the current position, the first of
+// the encoded history.
+const int kPiecePlanes = 12;
+const int kMaxPieces = 32;
+
+int CountPieces(const InputPlanes& planes) {
+  int count = 0;
+  for (int i = 0; i < kPiecePlanes; ++i) {
+    for (auto mask = planes[i].mask; mask; mask &= mask - 1) ++count;
+  }
+  return count;
+}
+
+class CascadeNetwork;
+class CascadeComputation : public NetworkComputation {
+ public:
+  CascadeComputation(CascadeNetwork* network);
+
+  void AddInput(InputPlanes&& input) override;
+
+  void SetLegalMoves(const std::uint16_t* move_ids, int count) override {
+    children_[samples_.back().child]->SetLegalMoves(move_ids, count);
+  }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return samples_.size(); }
+
+  float GetQVal(int sample) const override {
+    const auto& s = samples_[sample];
+    return children_[s.child]->GetQVal(s.idx_in_child);
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    const auto& s = samples_[sample];
+    return children_[s.child]->GetPVal(s.idx_in_child, move_id);
+  }
+
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    const auto& s = samples_[sample];
+    children_[s.child]->GetPVals(s.idx_in_child, move_ids, count, out);
+  }
+
+ private:
+  struct Sample {
+    int child;
+    int idx_in_child;
+  };
+
+  CascadeNetwork* const network_;
+  // One for each network of the cascade.
+  std::vector<std::unique_ptr<NetworkComputation>> children_;
+  std::vector<Sample> samples_;
+};
+
+// Evaluates each position with the network of the fewest max_pieces which
+// it has at most, e.g. a small network for simple endgames and the main one
+// for everything else. The network of the most max_pieces takes what none of
+// them wants. Each is a backend of its own, with the weights of the cascade
+// unless it has a weights file of its own. The stages of a batch are
+// computed in parallel, by the calling thread and up to `workers` (one less
+// than the stages by default) helper threads:
+//   --backend=cascade
+//   --backend-opts=small(backend=blas,weights="small.pb.gz",max_pieces=7),
+//                  main(backend=cudnn)
+class CascadeNetwork : public Network {
+ public:
+  CascadeNetwork(const Weights& weights, const OptionsDict& options) {
+    const auto names = options.ListSubdicts();
+    if (names.empty()) {
+      throw Exception("Empty list of backends passed to a cascade backend");
+    }
+    // The stages inherit the options of the cascade, so it only has options
+    // no backend reads.
+    const int workers = options.GetOrDefault<int>("workers", names.size() - 1);
+    if (workers < 0) {
+      throw Exception("workers of a cascade backend must not be negative");
+    }
+    for (const auto& name : names) {
+      const auto& opts = options.GetSubdict(name);
+      const auto backend = opts.GetOrDefault<std::string>("backend", name);
+      const auto path = opts.GetOrDefault<std::string>("weights", "");
+      Stage stage;
+      stage.max_pieces = opts.GetOrDefault<int>("max_pieces", kMaxPieces);
+      if (path.empty()) {
+        stage.network = NetworkFactory::Get()->Create(backend, weights, opts);
+      } else {
+        const Weights stage_weights = LoadWeightsFromFile(path);
+        stage.network =
+            NetworkFactory::Get()->Create(backend, stage_weights, opts);
+        stage.weights_hash = HashWeights(stage_weights);
+      }
+      stages_.emplace_back(std::move(stage));
+    }
+    // Subdicts are listed by name, not in the order they were given.
+    std::stable_sort(stages_.begin(), stages_.end(),
+                     [](const Stage& a, const Stage& b) {
+                       return a.max_pieces < b.max_pieces;
+                     });
+    cache_namespace_ = HashCat(0, stages_.size());
+    for (const auto& stage : stages_) {
+      cache_namespace_ =
+          HashCat({cache_namespace_, stage.weights_hash,
+                   static_cast<uint64_t>(stage.max_pieces)});
+    }
+    pool_ = std::make_unique<WorkerPool>(workers);
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<CascadeComputation>(this);
+  }
+
+  void Warmup(int batch_size) override {
+    for (auto& stage : stages_) stage.network->Warmup(batch_size);
+  }
+
+  // Which networks evaluate which positions.
+  uint64_t GetCacheNamespace() const override { return cache_namespace_; }
+
+  int GetStageCount() const { return stages_.size(); }
+
+  Network* GetStageNetwork(int stage) const {
+    return stages_[stage].network.get();
+  }
+
+  // The stage which evaluates a position with @pieces pieces.
+  int GetStage(int pieces) const {
+    for (size_t i = 0; i + 1 < stages_.size(); ++i) {
+      if (pieces <= stages_[i].max_pieces) return i;
+    }
+    return stages_.size() - 1;
+  }
+
+  // Computes all of @computations, each with the stage it belongs to, at
+  // once on the calling thread and the workers, see WorkerPool::Run().
+  void ComputeAll(
+      const std::vector<std::pair<int, NetworkComputation*>>& computations);
+
+ private:
+  struct Stage {
+    std::unique_ptr<Network> network;
+    int max_pieces;
+    // Of its own weights file, 0 with the weights of the cascade.
+    uint64_t weights_hash = 0;
+  };
+
+  std::vector<Stage> stages_;
+  uint64_t cache_namespace_;
+
+  // Declared last, so that the workers stop before the stages go.
+  std::unique_ptr<WorkerPool> pool_;
+};
+
+void CascadeNetwork::ComputeAll(
+    const std::vector<std::pair<int, NetworkComputation*>>& computations) {
+  std::vector<std::function<void()>> parts;
+  for (const auto& computation : computations) {
+    Network* network = stages_[computation.first].network.get();
+    NetworkComputation* child = computation.second;
+    // Stages may be on different devices, so whichever thread computes a
+    // stage selects its device first.
+    parts.emplace_back([network, child]() {
+      network->InitThread();
+      child->ComputeBlocking();
+    });
+  }
+  pool_->Run(parts);
+}
+
+CascadeComputation::CascadeComputation(CascadeNetwork* network)
+    : network_(network) {
+  for (int i = 0; i < network->GetStageCount(); ++i) {
+    children_.emplace_back(network->GetStageNetwork(i)->NewComputation());
+  }
+}
+
+// A small network for the endgames is usually done long before the main
+// one, but on another device the two overlap completely.
+void CascadeComputation::ComputeBlocking() {
+  std::vector<std::pair<int, NetworkComputation*>> computations;
+  for (size_t i = 0; i < children_.size(); ++i) {
+    if (children_[i]->GetBatchSize() > 0) {
+      computations.emplace_back(i, children_[i].get());
+    }
+  }
+  network_->ComputeAll(computations);
+}
+
+void CascadeComputation::AddInput(InputPlanes&& input) {
+  const int child = network_->GetStage(CountPieces(input));
+  samples_.push_back({child, children_[child]->GetBatchSize()});
+  children_[child]->AddInput(std::move(input));
+}
+
+}  // namespace
+
+REGISTER_NETWORK("cascade", CascadeNetwork, -1000);
+
+}  // namespace lczero
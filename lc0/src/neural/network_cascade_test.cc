@@ -0,0 +1,146 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "neural/factory.h"
+
+namespace lczero {
+
+namespace {
+// Q of a sample is 100 times the tag of its network plus its index in the
+// batch of that network, and P of a move 100 times the pieces of the sample
+// plus the move id.
+class TagComputation : public NetworkComputation {
+ public:
+  TagComputation(int tag) : tag_(tag) {}
+  void AddInput(InputPlanes&& input) override {
+    int pieces = 0;
+    for (int i = 0; i < 12; ++i) {
+      for (auto mask = input[i].mask; mask; mask &= mask - 1) ++pieces;
+    }
+    pieces_.push_back(pieces);
+  }
+  void ComputeBlocking() override;
+  int GetBatchSize() const override { return pieces_.size(); }
+  float GetQVal(int sample) const override { return tag_ * 100 + sample; }
+  float GetPVal(int sample, int move_id) const override {
+    return pieces_[sample] * 100 + move_id;
+  }
+
+ private:
+  const int tag_;
+  std::vector<int> pieces_;
+};
+
+// Set once a network with tag 1 starts computing. A network with tag 2 waits
+// for it, so that the two stages of a cascade only both finish quickly when
+// they are computed at the same time.
+std::atomic<bool> tag1_started{false};
+
+void TagComputation::ComputeBlocking() {
+  if (tag_ == 1) tag1_started = true;
+  if (tag_ != 2) return;
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!tag1_started && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+}
+
+class TagNetwork : public Network {
+ public:
+  TagNetwork(const Weights&, const OptionsDict& options)
+      : tag_(options.Get<int>("tag")) {}
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<TagComputation>(tag_);
+  }
+
+ private:
+  const int tag_;
+};
+
+REGISTER_NETWORK("tag", TagNetwork, -1000);
+
+// A position with @pieces pieces spread over the piece planes.
+InputPlanes WithPieces(int pieces) {
+  InputPlanes planes;
+  for (int i = 0; i < pieces; ++i) planes[i % 12].mask |= 1ull << i;
+  return planes;
+}
+
+std::unique_ptr<Network> NewCascade(const std::string& options) {
+  const auto dict = OptionsDict::FromString(options);
+  return NetworkFactory::Get()->Create("cascade", Weights(), dict);
+}
+}  // namespace
+
+TEST(CascadeNetwork, RoutesByPieceCount) {
+  auto network =
+      NewCascade("small(backend=tag,tag=1,max_pieces=5),"
+                 "medium(backend=tag,tag=3,max_pieces=10),"
+                 "main(backend=tag,tag=4)");
+  auto computation = network->NewComputation();
+  for (int pieces : {32, 5, 2, 6, 10, 11, 3}) {
+    computation->AddInput(WithPieces(pieces));
+  }
+  ASSERT_EQ(computation->GetBatchSize(), 7);
+  computation->ComputeBlocking();
+
+  // Subdicts are listed by name, but stages go by max_pieces.
+  EXPECT_EQ(computation->GetQVal(0), 400.0f);
+  EXPECT_EQ(computation->GetQVal(1), 100.0f);
+  EXPECT_EQ(computation->GetQVal(2), 101.0f);
+  EXPECT_EQ(computation->GetQVal(3), 300.0f);
+  EXPECT_EQ(computation->GetQVal(4), 301.0f);
+  EXPECT_EQ(computation->GetQVal(5), 401.0f);
+  EXPECT_EQ(computation->GetQVal(6), 102.0f);
+
+  // Policies come from the same sample of the same network.
+  EXPECT_EQ(computation->GetPVal(0, 7), 3207.0f);
+  EXPECT_EQ(computation->GetPVal(3, 1), 601.0f);
+  float pvals[2];
+  const std::uint16_t moves[] = {4, 9};
+  computation->GetPVals(6, moves, 2, pvals);
+  EXPECT_EQ(pvals[0], 304.0f);
+  EXPECT_EQ(pvals[1], 309.0f);
+}
+
+TEST(CascadeNetwork, ComputesStagesInParallel) {
+  auto network = NewCascade(
+      "small(backend=tag,tag=1,max_pieces=5),main(backend=tag,tag=2)");
+  auto computation = network->NewComputation();
+  computation->AddInput(WithPieces(20));
+  computation->AddInput(WithPieces(4));
+  const auto start = std::chrono::steady_clock::now();
+  computation->ComputeBlocking();
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+  EXPECT_TRUE(tag1_started);
+  EXPECT_EQ(computation->GetQVal(0), 200.0f);
+  EXPECT_EQ(computation->GetQVal(1), 100.0f);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
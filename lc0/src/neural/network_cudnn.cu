@@ -15,16 +15,30 @@
   You should have received a copy of the GNU General Public License
   along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <functional>
+#include <iostream>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
 #include "neural/factory.h"
 #include "utils/bititer.h"
 #include "utils/exception.h"
+#include "utils/trace.h"
 
 #include <cublas_v2.h>
+#include <cuda_fp16.h>
 #include <cudnn.h>
 
 #define DEBUG_RAW_NPS 0
@@ -98,9 +112,119 @@ static constexpr int kMaxBatchSize = 1024;
 
 static constexpr int kNumOutputPolicy = 1858;
 
+// More than any position has legal moves, and the block size of the kernel
+// gathering their policy.
+static constexpr int kMaxLegalMoves = 256;
+
+// Convolution algorithms are tuned for batch sizes in buckets of powers of two.
+static constexpr int kNumBatchBuckets = 11;
+static_assert(1 << (kNumBatchBuckets - 1) == kMaxBatchSize,
+              "the largest batch bucket must be kMaxBatchSize");
+
+// Index of the smallest bucket that holds a batch of N.
+int batchBucket(int N) {
+  int bucket = 0;
+  while ((1 << bucket) < N) bucket++;
+  return bucket;
+}
+
+// The fastest convolution algorithm for each layer shape and batch bucket, as
+// measured by cudnnFindConvolutionForwardAlgorithm. Measurements are kept in a
+// file across runs, one per line:
+//   version;shape;algorithm;device;cudnn version
+// and are only reused with the same device and cudnn version.
+class ConvAlgoTuner {
+ public:
+  explicit ConvAlgoTuner(int gpuId) : gpuId_(gpuId) {
+    cudaDeviceProp prop;
+    reportCUDAErrors(cudaGetDeviceProperties(&prop, gpuId));
+    prefix_ = std::to_string(kVersion) + ";";
+    suffix_ = std::string(";") + prop.name + ";" +
+              std::to_string(cudnnGetVersion());
+
+    std::ifstream file(kFileName);
+    std::string line;
+    while (std::getline(file, line)) {
+      const auto algo_pos = line.rfind(';', line.size() - suffix_.size() - 1);
+      if (line.size() <= prefix_.size() + suffix_.size() ||
+          line.compare(0, prefix_.size(), prefix_) != 0 ||
+          line.compare(line.size() - suffix_.size(), suffix_.size(),
+                       suffix_) != 0 ||
+          algo_pos == std::string::npos || algo_pos < prefix_.size()) {
+        // Another device, or from another version.
+        other_lines_.push_back(line);
+        continue;
+      }
+      algos_[line.substr(prefix_.size(), algo_pos - prefix_.size())] =
+          std::atoi(line.c_str() + algo_pos + 1);
+    }
+  }
+
+  bool Lookup(const std::string &shape, int *algo) const {
+    const auto iter = algos_.find(shape);
+    if (iter == algos_.end()) return false;
+    *algo = iter->second;
+    return true;
+  }
+
+  void Store(const std::string &shape, int algo) {
+    algos_[shape] = algo;
+    changed_ = true;
+  }
+
+  // Writes the file back if anything was tuned. It is written aside and
+  // renamed over the old one, so that a crash or another process reading it
+  // meanwhile never sees half of it.
+  void Save() const {
+    if (!changed_) return;
+    const std::string temp_name =
+        std::string(kFileName) + ".tmp" + std::to_string(gpuId_);
+    {
+      std::ofstream file(temp_name);
+      for (const auto &line : other_lines_) file << line << '\n';
+      for (const auto &entry : algos_) {
+        file << prefix_ << entry.first << ";" << entry.second << suffix_
+             << '\n';
+      }
+      file.close();
+      if (file.fail()) {
+        std::cerr << "Could not save the cudnn tuning to " << temp_name
+                  << std::endl;
+        std::remove(temp_name.c_str());
+        return;
+      }
+    }
+    // Windows doesn't rename over an existing file.
+    if (std::rename(temp_name.c_str(), kFileName) != 0 &&
+        (std::remove(kFileName) != 0 ||
+         std::rename(temp_name.c_str(), kFileName) != 0)) {
+      std::cerr << "Could not save the cudnn tuning to " << kFileName
+                << std::endl;
+      std::remove(temp_name.c_str());
+    }
+  }
+
+ private:
+  static constexpr int kVersion = 1;
+  static constexpr const char *kFileName = "lc0_cudnn_tuning";
+
+  // Of the tuned device, so that networks on other devices don't write the
+  // same temporary file.
+  const int gpuId_;
+  std::string prefix_;
+  std::string suffix_;
+  std::map<std::string, int> algos_;
+  std::vector<std::string> other_lines_;
+  bool changed_ = false;
+};
+
 // the Layer objects only hold memory for weights, biases, etc
 // memory for input and output tensors is provided by caller of Eval
+//
+// DataType is float or half. Float tensors are NCHW, half tensors NHWC so
+// that convolutions can use tensor cores.
 
+template <typename DataType>
 class BaseLayer {
  public:
   int GetC() const { return C; }
@@ -108,16 +232,22 @@ class BaseLayer {
   int GetW() const { return W; }
 
   BaseLayer(int c, int h, int w, BaseLayer *ip);
+  virtual ~BaseLayer() = default;
   size_t GetOutputSize(int N) const { return bpe_ * N * C * H * W; }
 
   // input2 is optional (skip connection)
-  virtual void Eval(int N, float *output, const float *input,
-                    const float *input2, float *scratch, cudnnHandle_t cudnn,
+  virtual void Eval(int N, DataType *output, const DataType *input,
+                    const DataType *input2, void *scratch, cudnnHandle_t cudnn,
                     cublasHandle_t cublas) = 0;
 
  protected:
-  static bool fp16_;
-  static size_t bpe_;  // size of each element
+  static constexpr bool fp16_ = std::is_same<half, DataType>::value;
+  static constexpr size_t bpe_ = sizeof(DataType);  // size of each element
+  static constexpr cudnnDataType_t kDataType =
+      fp16_ ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT;
+  static constexpr cudnnTensorFormat_t kTensorFormat =
+      fp16_ ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW;
+
   BaseLayer *input_;
 
   int C;  // output tensor dimensions
@@ -125,14 +255,26 @@ class BaseLayer {
   int W;
 };
 
-class ConvLayer : public BaseLayer {
+template <typename DataType>
+class ConvLayer : public BaseLayer<DataType> {
+  using Base = BaseLayer<DataType>;
+  using Base::C;
+  using Base::H;
+  using Base::W;
+  using Base::GetC;
+  using Base::GetH;
+  using Base::GetW;
+
  public:
-  ConvLayer(BaseLayer *ip, int C, int H, int W, int size, int Cin,
+  ConvLayer(Base *ip, int C, int H, int W, int size, int Cin,
             bool relu = false, bool bias = false);
   ~ConvLayer();
   void LoadWeights(float *pfilter, float *pBias = nullptr);
-  void Eval(int N, float *output, const float *input, const float *input2,
-            float *scratch, cudnnHandle_t cudnn,
+  // Picks the fastest algorithm for every batch bucket, measured with cudnn
+  // unless the tuner already knows it.
+  void Tune(ConvAlgoTuner *tuner, cudnnHandle_t cudnn);
+  void Eval(int N, DataType *output, const DataType *input,
+            const DataType *input2, void *scratch, cudnnHandle_t cudnn,
             cublasHandle_t cublas) override;
 
  private:
@@ -141,63 +283,89 @@ class ConvLayer : public BaseLayer {
   const bool use_relu_;
   const bool use_bias_;
 
-  float *biases = nullptr;
-  float *weights = nullptr;
+  DataType *biases = nullptr;
+  DataType *weights = nullptr;
 
   cudnnFilterDescriptor_t filter_desc_;
   cudnnConvolutionDescriptor_t conv_desc_;
-  cudnnConvolutionFwdAlgo_t convAlgo;
+  // For each batch bucket.
+  cudnnConvolutionFwdAlgo_t convAlgos[kNumBatchBuckets];
 
   cudnnTensorDescriptor_t bias_desc_;
+  // Set for the batch size of each Eval(), which computations on other
+  // streams may call at the same time.
+  std::mutex tensor_desc_mutex_;
   cudnnTensorDescriptor_t in_tensor_desc_;
   cudnnTensorDescriptor_t out_tensor_desc_;
   cudnnActivationDescriptor_t activation_;
 };
 
-class SoftMaxLayer : public BaseLayer {
+template <typename DataType>
+class SoftMaxLayer : public BaseLayer<DataType> {
+  using Base = BaseLayer<DataType>;
+  using Base::GetC;
+  using Base::GetH;
+  using Base::GetW;
+
  public:
-  SoftMaxLayer(BaseLayer *ip);
-  void Eval(int N, float *output, const float *input, const float *input2,
-            float *scratch, cudnnHandle_t cudnn,
+  SoftMaxLayer(Base *ip);
+  void Eval(int N, DataType *output, const DataType *input,
+            const DataType *input2, void *scratch, cudnnHandle_t cudnn,
             cublasHandle_t cublas) override;
 
  private:
+  // Set for the batch size of each Eval(), see ConvLayer.
+  std::mutex tensor_desc_mutex_;
   cudnnTensorDescriptor_t out_tensor_desc_;
 };
 
-class BNLayer : public BaseLayer {
+template <typename DataType>
+class BNLayer : public BaseLayer<DataType> {
+  using Base = BaseLayer<DataType>;
+  using Base::C;
+  using Base::H;
+  using Base::W;
+
  public:
-  BNLayer(BaseLayer *ip, bool relu);
+  BNLayer(Base *ip, bool relu);
   ~BNLayer();
 
   void LoadWeights(float *cpuMeans, float *cpuVar);
-  void Eval(int N, float *output, const float *input, const float *input2,
-            float *scratch, cudnnHandle_t cudnn,
+  void Eval(int N, DataType *output, const DataType *input,
+            const DataType *input2, void *scratch, cudnnHandle_t cudnn,
             cublasHandle_t cublas) override;
 
  private:
   const bool use_relu_;
+  // Kept as float in both modes, there are only C of them.
   float *means_ = nullptr;
   float *variances_ = nullptr;
 };
 
-class FCLayer : public BaseLayer {
+template <typename DataType>
+class FCLayer : public BaseLayer<DataType> {
+  using Base = BaseLayer<DataType>;
+  using Base::C;
+  using Base::H;
+  using Base::W;
+  using Base::input_;
+
  public:
-  FCLayer(BaseLayer *ip, int C, int H, int W, bool relu, bool bias,
+  FCLayer(Base *ip, int C, int H, int W, bool relu, bool bias,
           bool tanh = false);
   ~FCLayer();
 
   void LoadWeights(float *cpuWeight, float *cpuBias);
-  void Eval(int N, float *output, const float *input, const float *input2,
-            float *scratch, cudnnHandle_t cudnn,
+  void Eval(int N, DataType *output, const DataType *input,
+            const DataType *input2, void *scratch, cudnnHandle_t cudnn,
             cublasHandle_t cublas) override;
 
  private:
   const bool use_bias_;
   const bool use_relu_;
   const bool use_tanh_;
-  float *weights_ = nullptr;
-  float *biases_ = nullptr;
+  DataType *weights_ = nullptr;
+  DataType *biases_ = nullptr;
 };
 
 // Need memory for 3 data buffers
@@ -205,31 +373,59 @@ class FCLayer : public BaseLayer {
 //  2. output of the layer
 //  3. data from old layer for skip connection
 
-/////////////////////////////////////////////////////////////////////////////
-//                      Static variable Definations                        //
-/////////////////////////////////////////////////////////////////////////////
+int divUp(int a, int b) { return (a + b - 1) / b; }
 
-// TODO: fp16 support
-bool BaseLayer::fp16_ = false;
-size_t BaseLayer::bpe_ = sizeof(float);
+// The stream of the computation a layer is evaluated for.
+cudaStream_t getStream(cudnnHandle_t cudnn) {
+  cudaStream_t stream;
+  reportCUDNNErrors(cudnnGetStream(cudnn, &stream));
+  return stream;
+}
 
-int divUp(int a, int b) { return (a + b - 1) / b; }
+// Copies @size floats from host @src to device @dst, converting them to
+// DataType on the way.
+void copyToDevice(float *dst, const float *src, size_t size) {
+  reportCUDAErrors(
+      cudaMemcpy(dst, src, size * sizeof(float), cudaMemcpyHostToDevice));
+}
+
+void copyToDevice(half *dst, const float *src, size_t size) {
+  std::vector<half> converted(size);
+  for (size_t i = 0; i < size; ++i) converted[i] = __float2half(src[i]);
+  reportCUDAErrors(cudaMemcpy(dst, converted.data(), size * sizeof(half),
+                              cudaMemcpyHostToDevice));
+}
+
+// Reorders @count blocks of NCHW data into NHWC, on the host.
+std::vector<float> nchwToNhwc(const float *src, int count, int C, int HW) {
+  std::vector<float> result(static_cast<size_t>(count) * C * HW);
+  for (int n = 0; n < count; ++n) {
+    for (int c = 0; c < C; ++c) {
+      for (int hw = 0; hw < HW; ++hw) {
+        result[(static_cast<size_t>(n) * HW + hw) * C + c] =
+            src[(static_cast<size_t>(n) * C + c) * HW + hw];
+      }
+    }
+  }
+  return result;
+}
 
 /////////////////////////////////////////////////////////////////////////////
 //          Simple CUDA kernels used by certain layers                     //
 /////////////////////////////////////////////////////////////////////////////
 
+// Arithmetic is done in float for both data types.
 template <typename T>
 __global__ void addVectors_kernel(T *c, T *a, T *b, int size, int asize,
                                   int bsize, bool relu, bool useTanh) {
   int i = threadIdx.x + blockDim.x * blockIdx.x;
   if (i < size) {
-    T aVal = 0;
-    T bVal = 0;
-    if (a) aVal = a[i % asize];
-    if (b) bVal = b[i % bsize];
+    float aVal = 0;
+    float bVal = 0;
+    if (a) aVal = (float)a[i % asize];
+    if (b) bVal = (float)b[i % bsize];
 
-    T cVal = aVal + bVal;
+    float cVal = aVal + bVal;
 
     if (relu && (cVal < 0)) cVal = 0;
 
@@ -242,7 +438,7 @@ __global__ void addVectors_kernel(T *c, T *a, T *b, int size, int asize,
       cVal = tanh(cVal);
     }
 
-    c[i] = cVal;
+    c[i] = (T)cVal;
   }
 }
 
@@ -250,24 +446,26 @@ __global__ void addVectors_kernel(T *c, T *a, T *b, int size, int asize,
 // activation_
 template <typename T>
 void addVectors(T *c, T *a, T *b, int size, int asize, int bsize, bool relu,
-                bool useTanh) {
+                bool useTanh, cudaStream_t stream) {
   const int blockSize = 256;
   int blocks = divUp(size, blockSize);
 
-  addVectors_kernel<<<blocks, blockSize>>>(c, a, b, size, asize, bsize, relu,
-                                           useTanh);
+  addVectors_kernel<<<blocks, blockSize, 0, stream>>>(c, a, b, size, asize,
+                                                      bsize, relu, useTanh);
   reportCUDAErrors(cudaGetLastError());
 }
 
-__global__ void batchNormForward_kernel(float *output, const float *input,
-                                        const float *skipInput, int N, int C,
+template <typename T>
+__global__ void batchNormForward_kernel(T *output, const T *input,
+                                        const T *skipInput, int N, int C,
                                         int H, int W, const float *means,
                                         const float *varMultipliers,
-                                        bool relu) {
+                                        bool relu, bool nhwc) {
   int index = threadIdx.x + blockDim.x * blockIdx.x;
-  int wIndex = (index / (H * W)) % C;
+  if (index >= N * C * H * W) return;
+  int wIndex = nhwc ? index % C : (index / (H * W)) % C;
 
-  float el = input[index];
+  float el = (float)input[index];
   float mean = means[wIndex];
   float varMulti = varMultipliers[wIndex];
 
@@ -275,24 +473,26 @@ __global__ void batchNormForward_kernel(float *output, const float *input,
   el *= varMulti;
 
   // TODO: figure out order of relu and skip connection
-  if (skipInput) el += skipInput[index];
+  if (skipInput) el += (float)skipInput[index];
 
   if (relu && (el < 0)) el = 0;
 
-  output[index] = el;
+  output[index] = (T)el;
 }
 
-// works only on NCHW tensors
+// works on NCHW float and NHWC half tensors
 // each thread processes single element
-void batchNormForward(float *output, const float *input, const float *skipInput,
-                      int N, int C, int H, int W, float *means,
-                      float *varMultipliers, bool relu) {
+template <typename T>
+void batchNormForward(T *output, const T *input, const T *skipInput, int N,
+                      int C, int H, int W, float *means, float *varMultipliers,
+                      bool relu, cudaStream_t stream) {
   int totalElements = N * C * H * W;
   const int blockSize = 256;
   int blocks = divUp(totalElements, blockSize);
 
-  batchNormForward_kernel<<<blocks, blockSize>>>(
-      output, input, skipInput, N, C, H, W, means, varMultipliers, relu);
+  batchNormForward_kernel<<<blocks, blockSize, 0, stream>>>(
+      output, input, skipInput, N, C, H, W, means, varMultipliers, relu,
+      std::is_same<half, T>::value);
 
   reportCUDAErrors(cudaGetLastError());
 }
@@ -307,17 +507,17 @@ __global__ void expandPlanes_kernel(float *output, const uint64_t *masks,
 
   int index = threadIdx.x + blockDim.x * blockIdx.x;
 
-  int planeIndex = index >> 6;
-
-  if (planeIndex >= n) return;
-
-  // load inputs to shared memory
-  if (threadIdx.x < kNumShmemElments) {
-    shMasks[threadIdx.x] = masks[planeIndex + threadIdx.x];
-    shVals[threadIdx.x] = values[planeIndex + threadIdx.x];
+  // load the planes of this block to shared memory, all threads have to reach
+  // the barrier
+  const int firstPlane = (blockDim.x * blockIdx.x) >> 6;
+  if (threadIdx.x < kNumShmemElments && firstPlane + threadIdx.x < n) {
+    shMasks[threadIdx.x] = masks[firstPlane + threadIdx.x];
+    shVals[threadIdx.x] = values[firstPlane + threadIdx.x];
   }
   __syncthreads();
 
+  if ((index >> 6) >= n) return;
+
   uint64_t mask = shMasks[threadIdx.x >> 6];
 
   int sqIndex = index & 0x3F;
@@ -329,52 +529,144 @@ __global__ void expandPlanes_kernel(float *output, const uint64_t *masks,
   }
   output[index] = op;
 }
+
+// NHWC: consecutive threads write the planes of one square.
+__global__ void expandPlanes_kernel_NHWC(half *output, const uint64_t *masks,
+                                         const float *values, int n) {
+  int index = threadIdx.x + blockDim.x * blockIdx.x;
+  if (index >= n * 8 * 8) return;
+
+  const int planeIndex = index % kInputPlanes;
+  const int sqIndex = (index / kInputPlanes) & 0x3F;
+  const int sample = index / (kInputPlanes * 64);
+  const int maskIndex = sample * kInputPlanes + planeIndex;
+
+  float op = 0;
+  if (masks[maskIndex] & (1ull << sqIndex)) op = values[maskIndex];
+  output[index] = __float2half(op);
+}
+
 void expandPlanes(float *output, const uint64_t *masks, const float *values,
-                  int n) {
+                  int n, cudaStream_t stream) {
   int threads = n * 8 * 8;  // each thread writes a single element
   const int blockSize = 256;
   int blocks = divUp(threads, blockSize);
 
-  expandPlanes_kernel<<<blocks, blockSize>>>(output, masks, values, n);
+  expandPlanes_kernel<<<blocks, blockSize, 0, stream>>>(output, masks, values,
+                                                        n);
 
   reportCUDAErrors(cudaGetLastError());
 }
 
-BaseLayer::BaseLayer(int c, int h, int w, BaseLayer *ip)
+void expandPlanes(half *output, const uint64_t *masks, const float *values,
+                  int n, cudaStream_t stream) {
+  int threads = n * 8 * 8;  // each thread writes a single element
+  const int blockSize = 256;
+  int blocks = divUp(threads, blockSize);
+
+  expandPlanes_kernel_NHWC<<<blocks, blockSize, 0, stream>>>(output, masks,
+                                                             values, n);
+
+  reportCUDAErrors(cudaGetLastError());
+}
+
+template <typename DstT, typename SrcT>
+__global__ void copyTypeConverted_kernel(DstT *op, const SrcT *ip, int n) {
+  int index = threadIdx.x + blockDim.x * blockIdx.x;
+  if (index >= n) return;
+  op[index] = (DstT)(float)ip[index];
+}
+
+template <typename DstT, typename SrcT>
+void copyTypeConverted(DstT *op, const SrcT *ip, int n, cudaStream_t stream) {
+  const int blockSize = 256;
+  int blocks = divUp(n, blockSize);
+  copyTypeConverted_kernel<<<blocks, blockSize, 0, stream>>>(op, ip, n);
+  reportCUDAErrors(cudaGetLastError());
+}
+
+// One block per sample: output[i] = policy[ids[i]] of the sample for its
+// range offsets[sample] to offsets[sample + 1] of ids, scaled to add up to 1
+// if normalize.
+__global__ void gatherPolicy_kernel(float *output, const float *policy,
+                                    const uint16_t *ids, const int *offsets,
+                                    bool normalize) {
+  __shared__ float shSum[kMaxLegalMoves];
+
+  const int sample = blockIdx.x;
+  const int begin = offsets[sample];
+  const int end = offsets[sample + 1];
+  const float *samplePolicy = policy + sample * kNumOutputPolicy;
+
+  float sum = 0;
+  for (int i = begin + threadIdx.x; i < end; i += blockDim.x) {
+    const float p = samplePolicy[ids[i]];
+    output[i] = p;
+    sum += p;
+  }
+  if (!normalize) return;
+
+  shSum[threadIdx.x] = sum;
+  __syncthreads();
+  for (int stride = blockDim.x / 2; stride > 0; stride >>= 1) {
+    if (threadIdx.x < stride) shSum[threadIdx.x] += shSum[threadIdx.x + stride];
+    __syncthreads();
+  }
+  const float total = shSum[0];
+  if (total <= 0) return;
+  for (int i = begin + threadIdx.x; i < end; i += blockDim.x) {
+    output[i] /= total;
+  }
+}
+
+void gatherPolicy(float *output, const float *policy, const uint16_t *ids,
+                  const int *offsets, int N, bool normalize,
+                  cudaStream_t stream) {
+  gatherPolicy_kernel<<<N, kMaxLegalMoves, 0, stream>>>(output, policy, ids,
+                                                        offsets, normalize);
+  reportCUDAErrors(cudaGetLastError());
+}
+
+template <typename DataType>
+BaseLayer<DataType>::BaseLayer(int c, int h, int w, BaseLayer *ip)
     : C(c), H(h), W(w), input_(ip) {}
 
-SoftMaxLayer::SoftMaxLayer(BaseLayer *ip)
-    : BaseLayer(ip->GetC(), ip->GetH(), ip->GetW(), ip) {
+template <typename DataType>
+SoftMaxLayer<DataType>::SoftMaxLayer(Base *ip)
+    : Base(ip->GetC(), ip->GetH(), ip->GetW(), ip) {
   cudnnCreateTensorDescriptor(&out_tensor_desc_);
 }
 
-void SoftMaxLayer::Eval(int N, float *output, const float *input,
-                        const float *input2, float *scratch,
-                        cudnnHandle_t cudnn, cublasHandle_t cublas) {
+template <typename DataType>
+void SoftMaxLayer<DataType>::Eval(int N, DataType *output,
+                                  const DataType *input,
+                                  const DataType *input2, void *scratch,
+                                  cudnnHandle_t cudnn, cublasHandle_t cublas) {
   float alpha = 1.0f, beta = 0.0f;
 
+  std::lock_guard<std::mutex> lock(tensor_desc_mutex_);
   // need to call this at Eval as 'N' changes :-/
-  cudnnSetTensor4dDescriptor(
-      out_tensor_desc_, fp16_ ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
-      fp16_ ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, GetC(), GetH(), GetW());
+  cudnnSetTensor4dDescriptor(out_tensor_desc_, Base::kTensorFormat,
+                             Base::kDataType, N, GetC(), GetH(), GetW());
 
   cudnnSoftmaxForward(cudnn, CUDNN_SOFTMAX_ACCURATE,
                       CUDNN_SOFTMAX_MODE_INSTANCE, &alpha, out_tensor_desc_,
                       input, &beta, out_tensor_desc_, output);
 }
 
-ConvLayer::ConvLayer(BaseLayer *ip, int C, int H, int W, int filter, int Cin,
-                     bool relu, bool bias)
-    : BaseLayer(C, H, W, ip),
+template <typename DataType>
+ConvLayer<DataType>::ConvLayer(Base *ip, int C, int H, int W, int filter,
+                               int Cin, bool relu, bool bias)
+    : Base(C, H, W, ip),
       filter_size_(filter),
       c_input_(Cin),
       use_relu_(relu),
       use_bias_(bias) {
   // allocate memory for weights (filter tensor) and biases
-  size_t weightSize = bpe_ * Cin * C * filter_size_ * filter_size_;
+  size_t weightSize = Base::bpe_ * Cin * C * filter_size_ * filter_size_;
   reportCUDAErrors(cudaMalloc(&weights, weightSize));
 
-  size_t biasSize = bpe_ * C;
+  size_t biasSize = Base::bpe_ * C;
   reportCUDAErrors(cudaMalloc(&biases, biasSize));
 
   // create cudnn objects for various tensors, algorithms, etc
@@ -385,15 +677,12 @@ ConvLayer::ConvLayer(BaseLayer *ip, int C, int H, int W, int filter, int Cin,
   cudnnCreateTensorDescriptor(&bias_desc_);
   cudnnCreateActivationDescriptor(&activation_);
 
-  cudnnSetFilter4dDescriptor(
-      filter_desc_, fp16_ ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT,
-      fp16_ ? CUDNN_TENSOR_NHWC
-            : CUDNN_TENSOR_NCHW,  // TODO: support fp16 evaluation
-      GetC(), Cin, filter_size_, filter_size_);
+  cudnnSetFilter4dDescriptor(filter_desc_, Base::kDataType,
+                             Base::kTensorFormat, GetC(), Cin, filter_size_,
+                             filter_size_);
 
   reportCUDNNErrors(cudnnSetTensor4dDescriptor(
-      bias_desc_, fp16_ ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
-      fp16_ ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, 1, C, 1, 1));
+      bias_desc_, Base::kTensorFormat, Base::kDataType, 1, C, 1, 1));
 
   int padding = filter_size_ / 2;
   const bool crossCorr = 1;
@@ -401,14 +690,20 @@ ConvLayer::ConvLayer(BaseLayer *ip, int C, int H, int W, int filter, int Cin,
   cudnnSetConvolution2dDescriptor(
       conv_desc_, padding, padding, 1, 1, 1, 1,
       crossCorr ? CUDNN_CROSS_CORRELATION : CUDNN_CONVOLUTION,
-      fp16_ ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT);
-
-  // TODO: dynamic selection of algorithm!
-  if (C > 32) {
-    convAlgo = CUDNN_CONVOLUTION_FWD_ALGO_WINOGRAD_NONFUSED;
+      Base::kDataType);
+
+  if (Base::fp16_) {
+    // Tensor cores, which need NHWC half tensors and this algorithm.
+    reportCUDNNErrors(
+        cudnnSetConvolutionMathType(conv_desc_, CUDNN_TENSOR_OP_MATH));
+    convAlgos[0] = CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_PRECOMP_GEMM;
+  } else if (C > 32) {
+    // Until Tune() measures something better.
+    convAlgos[0] = CUDNN_CONVOLUTION_FWD_ALGO_WINOGRAD_NONFUSED;
   } else {
-    convAlgo = CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_PRECOMP_GEMM;
+    convAlgos[0] = CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_PRECOMP_GEMM;
   }
+  std::fill(convAlgos + 1, convAlgos + kNumBatchBuckets, convAlgos[0]);
 
   if (use_relu_) {
     cudnnSetActivationDescriptor(activation_, CUDNN_ACTIVATION_RELU,
@@ -419,32 +714,42 @@ ConvLayer::ConvLayer(BaseLayer *ip, int C, int H, int W, int filter, int Cin,
   }
 }
 
-void ConvLayer::LoadWeights(float *pfilter, float *pBias) {
-  size_t weightSize = bpe_ * c_input_ * C * filter_size_ * filter_size_;
-  reportCUDAErrors(
-      cudaMemcpyAsync(weights, pfilter, weightSize, cudaMemcpyHostToDevice));
+template <typename DataType>
+void ConvLayer<DataType>::LoadWeights(float *pfilter, float *pBias) {
+  const size_t weightCount = c_input_ * C * filter_size_ * filter_size_;
+  if (Base::fp16_) {
+    // Filters are KCRS in the weights file, NHWC filters are KRSC.
+    copyToDevice(weights,
+                 nchwToNhwc(pfilter, C, c_input_, filter_size_ * filter_size_)
+                     .data(),
+                 weightCount);
+  } else {
+    copyToDevice(weights, pfilter, weightCount);
+  }
 
-  size_t biasSize = bpe_ * C;
   if (pBias) {
-    reportCUDAErrors(
-        cudaMemcpyAsync(biases, pBias, biasSize, cudaMemcpyHostToDevice));
+    copyToDevice(biases, pBias, C);
   } else {
-    reportCUDAErrors(cudaMemset(biases, biasSize, 0));
+    reportCUDAErrors(cudaMemset(biases, 0, Base::bpe_ * C));
   }
 }
 
-void ConvLayer::Eval(int N, float *output, const float *input,
-                     const float *input2, float *scratch, cudnnHandle_t cudnn,
-                     cublasHandle_t cublas) {
+template <typename DataType>
+void ConvLayer<DataType>::Eval(int N, DataType *output, const DataType *input,
+                               const DataType *input2, void *scratch,
+                               cudnnHandle_t cudnn, cublasHandle_t cublas) {
+  std::lock_guard<std::mutex> lock(tensor_desc_mutex_);
   reportCUDNNErrors(cudnnSetTensor4dDescriptor(
-      out_tensor_desc_, fp16_ ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
-      fp16_ ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, C, H, W));
+      out_tensor_desc_, Base::kTensorFormat, Base::kDataType, N, C, H, W));
 
-  reportCUDNNErrors(cudnnSetTensor4dDescriptor(
-      in_tensor_desc_, fp16_ ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
-      fp16_ ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, c_input_, H, W));
+  reportCUDNNErrors(cudnnSetTensor4dDescriptor(in_tensor_desc_,
+                                               Base::kTensorFormat,
+                                               Base::kDataType, N, c_input_,
+                                               H, W));
 
+  // Scaling factors are float for half tensors too.
   float alpha = 1.0f, beta = 0.0f;
+  const cudnnConvolutionFwdAlgo_t convAlgo = convAlgos[batchBucket(N)];
 
   if (!(use_relu_ || use_bias_)) {
     reportCUDNNErrors(cudnnConvolutionForward(
@@ -467,47 +772,88 @@ void ConvLayer::Eval(int N, float *output, const float *input,
   }
 }
 
-ConvLayer::~ConvLayer() {
+template <typename DataType>
+void ConvLayer<DataType>::Tune(ConvAlgoTuner *tuner, cudnnHandle_t cudnn) {
+  std::lock_guard<std::mutex> lock(tensor_desc_mutex_);
+  for (int bucket = 0; bucket < kNumBatchBuckets; bucket++) {
+    const int N = 1 << bucket;
+    std::ostringstream shape;
+    shape << (Base::fp16_ ? "half" : "float") << ";" << N << ";" << C << ";"
+          << c_input_ << ";" << H << "x" << W << ";" << filter_size_;
+    int algo;
+    if (tuner->Lookup(shape.str(), &algo)) {
+      convAlgos[bucket] = static_cast<cudnnConvolutionFwdAlgo_t>(algo);
+      continue;
+    }
+
+    reportCUDNNErrors(cudnnSetTensor4dDescriptor(
+        out_tensor_desc_, Base::kTensorFormat, Base::kDataType, N, C, H, W));
+    reportCUDNNErrors(cudnnSetTensor4dDescriptor(in_tensor_desc_,
+                                                 Base::kTensorFormat,
+                                                 Base::kDataType, N, c_input_,
+                                                 H, W));
+    cudnnConvolutionFwdAlgoPerf_t perf[CUDNN_CONVOLUTION_FWD_ALGO_COUNT];
+    int returned = 0;
+    reportCUDNNErrors(cudnnFindConvolutionForwardAlgorithm(
+        cudnn, in_tensor_desc_, filter_desc_, conv_desc_, out_tensor_desc_,
+        CUDNN_CONVOLUTION_FWD_ALGO_COUNT, &returned, perf));
+    // Fastest first, take the first one that works with our scratch memory.
+    for (int i = 0; i < returned; i++) {
+      if (perf[i].status == CUDNN_STATUS_SUCCESS &&
+          perf[i].memory <= kCudaScratchSize) {
+        convAlgos[bucket] = perf[i].algo;
+        break;
+      }
+    }
+    tuner->Store(shape.str(), convAlgos[bucket]);
+  }
+}
+
+template <typename DataType>
+ConvLayer<DataType>::~ConvLayer() {
   reportCUDAErrors(cudaFree(weights));
   reportCUDAErrors(cudaFree(biases));
 }
 
-BNLayer::BNLayer(BaseLayer *ip, bool relu)
-    : BaseLayer(ip->GetC(), ip->GetH(), ip->GetW(), ip), use_relu_(relu) {
-  size_t weightSize = bpe_ * C;
+template <typename DataType>
+BNLayer<DataType>::BNLayer(Base *ip, bool relu)
+    : Base(ip->GetC(), ip->GetH(), ip->GetW(), ip), use_relu_(relu) {
+  size_t weightSize = sizeof(float) * C;
 
   reportCUDAErrors(cudaMalloc(&means_, weightSize));
   reportCUDAErrors(cudaMalloc(&variances_, weightSize));
 }
 
-void BNLayer::LoadWeights(float *cpuMeans, float *cpuVar) {
-  size_t weightSize = bpe_ * C;
-  reportCUDAErrors(
-      cudaMemcpyAsync(means_, cpuMeans, weightSize, cudaMemcpyHostToDevice));
-  reportCUDAErrors(
-      cudaMemcpyAsync(variances_, cpuVar, weightSize, cudaMemcpyHostToDevice));
+template <typename DataType>
+void BNLayer<DataType>::LoadWeights(float *cpuMeans, float *cpuVar) {
+  copyToDevice(means_, cpuMeans, C);
+  copyToDevice(variances_, cpuVar, C);
 }
 
-void BNLayer::Eval(int N, float *output, const float *input,
-                   const float *input2, float *scratch, cudnnHandle_t cudnn,
-                   cublasHandle_t cublas) {
+template <typename DataType>
+void BNLayer<DataType>::Eval(int N, DataType *output, const DataType *input,
+                             const DataType *input2, void *scratch,
+                             cudnnHandle_t cudnn, cublasHandle_t cublas) {
   batchNormForward(output, input, input2, N, C, H, W, means_, variances_,
-                   use_relu_);
+                   use_relu_, getStream(cudnn));
 }
 
-BNLayer::~BNLayer() {
+template <typename DataType>
+BNLayer<DataType>::~BNLayer() {
   reportCUDAErrors(cudaFree(means_));
   reportCUDAErrors(cudaFree(variances_));
 }
 
-FCLayer::FCLayer(BaseLayer *ip, int C, int H, int W, bool relu, bool bias,
-                 bool tanh)
-    : BaseLayer(C, H, W, ip),
+template <typename DataType>
+FCLayer<DataType>::FCLayer(Base *ip, int C, int H, int W, bool relu,
+                           bool bias, bool tanh)
+    : Base(C, H, W, ip),
       use_relu_(relu),
       use_bias_(bias),
       use_tanh_(tanh) {
-  size_t weightSize = bpe_ * C * H * W * ip->GetC() * ip->GetH() * ip->GetW();
-  size_t biasSize = bpe_ * C * H * W;
+  size_t weightSize =
+      Base::bpe_ * C * H * W * ip->GetC() * ip->GetH() * ip->GetW();
+  size_t biasSize = Base::bpe_ * C * H * W;
   reportCUDAErrors(cudaMalloc(&weights_, weightSize));
   if (use_bias_) {
     reportCUDAErrors(cudaMalloc(&biases_, biasSize));
@@ -516,110 +862,237 @@ FCLayer::FCLayer(BaseLayer *ip, int C, int H, int W, bool relu, bool bias,
   }
 }
 
-void FCLayer::LoadWeights(float *cpuWeight, float *cpuBias) {
-  size_t weightSize =
-      bpe_ * C * H * W * input_->GetC() * input_->GetH() * input_->GetW();
-
-  reportCUDAErrors(
-      cudaMemcpyAsync(weights_, cpuWeight, weightSize, cudaMemcpyHostToDevice));
-  if (use_bias_) {
-    size_t biasSize = bpe_ * C * H * W;
-    reportCUDAErrors(
-        cudaMemcpyAsync(biases_, cpuBias, biasSize, cudaMemcpyHostToDevice));
+template <typename DataType>
+void FCLayer<DataType>::LoadWeights(float *cpuWeight, float *cpuBias) {
+  const int numOutputs = C * H * W;
+  const int inputHW = input_->GetH() * input_->GetW();
+  const size_t weightCount =
+      static_cast<size_t>(numOutputs) * input_->GetC() * inputHW;
+
+  if (Base::fp16_) {
+    // The rows of weights are in the NCHW order of the input, which is NHWC
+    // in fp16 mode.
+    copyToDevice(weights_,
+                 nchwToNhwc(cpuWeight, numOutputs, input_->GetC(), inputHW)
+                     .data(),
+                 weightCount);
+  } else {
+    copyToDevice(weights_, cpuWeight, weightCount);
   }
+  if (use_bias_) copyToDevice(biases_, cpuBias, numOutputs);
 }
 
-void FCLayer::Eval(int N, float *outputTensor, const float *inputTensor,
-                   const float *input2, float *scratch, cudnnHandle_t cudnn,
-                   cublasHandle_t cublas) {
+template <>
+void FCLayer<float>::Eval(int N, float *outputTensor, const float *inputTensor,
+                          const float *input2, void *scratch,
+                          cudnnHandle_t cudnn, cublasHandle_t cublas) {
   float alpha = 1.0f, beta = 0.0f;
   int numOutputs = C * H * W;
   int numInputs = input_->GetC() * input_->GetH() * input_->GetW();
 
-  if (fp16_) {
-    // TODO: implement this!
-    assert(0);
-  } else {
-    reportCUBLASErrors(cublasSgemm(cublas, CUBLAS_OP_T, CUBLAS_OP_N, numOutputs,
-                                   N, numInputs, &alpha, weights_, numInputs,
-                                   inputTensor, numInputs, &beta, outputTensor,
-                                   numOutputs));
+  reportCUBLASErrors(cublasSgemm(cublas, CUBLAS_OP_T, CUBLAS_OP_N, numOutputs,
+                                 N, numInputs, &alpha, weights_, numInputs,
+                                 inputTensor, numInputs, &beta, outputTensor,
+                                 numOutputs));
 
-    if (use_bias_ || use_relu_ || use_tanh_) {
-      addVectors(outputTensor, biases_, outputTensor, numOutputs * N,
-                 numOutputs, numOutputs * N, use_relu_, use_tanh_);
-    }
+  if (use_bias_ || use_relu_ || use_tanh_) {
+    addVectors(outputTensor, biases_, outputTensor, numOutputs * N,
+               numOutputs, numOutputs * N, use_relu_, use_tanh_,
+               getStream(cudnn));
   }
 }
 
-FCLayer::~FCLayer() {
+template <>
+void FCLayer<half>::Eval(int N, half *outputTensor, const half *inputTensor,
+                         const half *input2, void *scratch,
+                         cudnnHandle_t cudnn, cublasHandle_t cublas) {
+  const half alpha = __float2half(1.0f), beta = __float2half(0.0f);
+  int numOutputs = C * H * W;
+  int numInputs = input_->GetC() * input_->GetH() * input_->GetW();
+
+  reportCUBLASErrors(cublasHgemm(cublas, CUBLAS_OP_T, CUBLAS_OP_N, numOutputs,
+                                 N, numInputs, &alpha, weights_, numInputs,
+                                 inputTensor, numInputs, &beta, outputTensor,
+                                 numOutputs));
+
+  if (use_bias_ || use_relu_ || use_tanh_) {
+    addVectors(outputTensor, biases_, outputTensor, numOutputs * N,
+               numOutputs, numOutputs * N, use_relu_, use_tanh_,
+               getStream(cudnn));
+  }
+}
+
+template <typename DataType>
+FCLayer<DataType>::~FCLayer() {
   reportCUDAErrors(cudaFree(weights_));
   reportCUDAErrors(cudaFree(biases_));
 }
-
+template <typename DataType>
 class CudnnNetwork;
 
 struct InputsOutputs {
   InputsOutputs() {
+    // Only the packed planes are uploaded, they are expanded on the GPU.
+    // Pinned so that the upload is a single DMA on the computation's stream.
     reportCUDAErrors(cudaHostAlloc(
         &input_masks_mem_, kMaxBatchSize * kInputPlanes * sizeof(uint64_t),
-        cudaHostAllocMapped));
-    reportCUDAErrors(
-        cudaHostGetDevicePointer(&input_masks_mem_gpu_, input_masks_mem_, 0));
-
+        cudaHostAllocDefault));
     reportCUDAErrors(cudaHostAlloc(&input_val_mem_,
                                    kMaxBatchSize * kInputPlanes * sizeof(float),
-                                   cudaHostAllocMapped));
-    reportCUDAErrors(
-        cudaHostGetDevicePointer(&input_val_mem_gpu_, input_val_mem_, 0));
+                                   cudaHostAllocDefault));
 
+    // Outputs are downloaded the same way.
     reportCUDAErrors(cudaHostAlloc(
         &op_policy_mem_, kMaxBatchSize * kNumOutputPolicy * sizeof(float),
-        cudaHostAllocMapped));
-    reportCUDAErrors(
-        cudaHostGetDevicePointer(&op_policy_mem_gpu_, op_policy_mem_, 0));
+        cudaHostAllocDefault));
+    reportCUDAErrors(cudaHostAlloc(
+        &op_value_mem_, kMaxBatchSize * sizeof(float), cudaHostAllocDefault));
 
+    // With the legal moves of every sample, only their policy is downloaded.
     reportCUDAErrors(cudaHostAlloc(
-        &op_value_mem_, kMaxBatchSize * sizeof(float), cudaHostAllocMapped));
-    reportCUDAErrors(
-        cudaHostGetDevicePointer(&op_value_mem_gpu_, op_value_mem_, 0));
+        &legal_ids_mem_, kMaxBatchSize * kMaxLegalMoves * sizeof(uint16_t),
+        cudaHostAllocDefault));
+    reportCUDAErrors(cudaHostAlloc(&legal_offsets_mem_,
+                                   (kMaxBatchSize + 1) * sizeof(int),
+                                   cudaHostAllocDefault));
+    reportCUDAErrors(cudaHostAlloc(
+        &op_legal_policy_mem_, kMaxBatchSize * kMaxLegalMoves * sizeof(float),
+        cudaHostAllocDefault));
+    legal_offsets_mem_[0] = 0;
   }
   ~InputsOutputs() {
     reportCUDAErrors(cudaFreeHost(input_masks_mem_));
     reportCUDAErrors(cudaFreeHost(input_val_mem_));
     reportCUDAErrors(cudaFreeHost(op_policy_mem_));
     reportCUDAErrors(cudaFreeHost(op_value_mem_));
+    reportCUDAErrors(cudaFreeHost(legal_ids_mem_));
+    reportCUDAErrors(cudaFreeHost(legal_offsets_mem_));
+    reportCUDAErrors(cudaFreeHost(op_legal_policy_mem_));
   }
   uint64_t *input_masks_mem_;
   float *input_val_mem_;
   float *op_policy_mem_;
   float *op_value_mem_;
+  // The legal moves of sample i are legal_ids_mem_[legal_offsets_mem_[i]]
+  // up to legal_offsets_mem_[i + 1], op_legal_policy_mem_ their policy.
+  uint16_t *legal_ids_mem_;
+  int *legal_offsets_mem_;
+  float *op_legal_policy_mem_;
+};
+
+// What a computation needs on the GPU while it runs: its own stream, handles
+// bound to it and memory for activations and cudnn scratch. With several of
+// them, computations overlap on the GPU.
+//
+// The network only touches memory of the context, so that its launches for a
+// batch size can be captured once in a CUDA graph and replayed with a single
+// launch.
+struct ExecutionContext {
+  ExecutionContext(size_t tensor_size, bool fp16, int max_graph_batch)
+      : graphs(max_graph_batch + 1, nullptr) {
+    reportCUDAErrors(cudaStreamCreate(&stream));
+    reportCUDNNErrors(cudnnCreate(&cudnn));
+    reportCUDNNErrors(cudnnSetStream(cudnn, stream));
+    reportCUBLASErrors(cublasCreate(&cublas));
+    reportCUBLASErrors(cublasSetStream(cublas, stream));
+    if (fp16) {
+      reportCUBLASErrors(cublasSetMathMode(cublas, CUBLAS_TENSOR_OP_MATH));
+    }
+
+    //    - three buffers of max size are enough (one to hold input, second to
+    //    hold output and third to hold skip connection's input)
+    for (auto &mem : tensor_mem) {
+      reportCUDAErrors(cudaMalloc(&mem, tensor_size));
+      reportCUDAErrors(cudaMemset(mem, 0, tensor_size));
+    }
+    // scratch space (used internally by cudnn to run convolutions)
+    reportCUDAErrors(cudaMalloc(&scratch_mem, kCudaScratchSize));
+    // packed input planes, copied from the host before expansion
+    reportCUDAErrors(cudaMalloc(
+        &input_masks_mem, kMaxBatchSize * kInputPlanes * sizeof(uint64_t)));
+    reportCUDAErrors(cudaMalloc(&input_val_mem,
+                                kMaxBatchSize * kInputPlanes * sizeof(float)));
+    // outputs, copied to the host after the network
+    reportCUDAErrors(cudaMalloc(
+        &op_policy_mem, kMaxBatchSize * kNumOutputPolicy * sizeof(float)));
+    reportCUDAErrors(cudaMalloc(&op_value_mem, kMaxBatchSize * sizeof(float)));
+    // legal moves, and their policy gathered from op_policy_mem
+    reportCUDAErrors(cudaMalloc(
+        &legal_ids_mem, kMaxBatchSize * kMaxLegalMoves * sizeof(uint16_t)));
+    reportCUDAErrors(
+        cudaMalloc(&legal_offsets_mem, (kMaxBatchSize + 1) * sizeof(int)));
+    reportCUDAErrors(cudaMalloc(
+        &op_legal_policy_mem, kMaxBatchSize * kMaxLegalMoves * sizeof(float)));
+  }
+  ~ExecutionContext() {
+    for (auto mem : tensor_mem) reportCUDAErrors(cudaFree(mem));
+    reportCUDAErrors(cudaFree(scratch_mem));
+    reportCUDAErrors(cudaFree(input_masks_mem));
+    reportCUDAErrors(cudaFree(input_val_mem));
+    reportCUDAErrors(cudaFree(op_policy_mem));
+    reportCUDAErrors(cudaFree(op_value_mem));
+    reportCUDAErrors(cudaFree(legal_ids_mem));
+    reportCUDAErrors(cudaFree(legal_offsets_mem));
+    reportCUDAErrors(cudaFree(op_legal_policy_mem));
+    for (auto graph : graphs) {
+      if (graph) cudaGraphExecDestroy(graph);
+    }
+    cudnnDestroy(cudnn);
+    cublasDestroy(cublas);
+    cudaStreamDestroy(stream);
+  }
 
-  // GPU pointers for the above allocations
-  uint64_t *input_masks_mem_gpu_;
-  float *input_val_mem_gpu_;
-  float *op_policy_mem_gpu_;
-  float *op_value_mem_gpu_;
+  cudaStream_t stream;
+  cudnnHandle_t cudnn;
+  cublasHandle_t cublas;
+  void *tensor_mem[3];
+  void *scratch_mem;
+  uint64_t *input_masks_mem;
+  float *input_val_mem;
+  float *op_policy_mem;
+  float *op_value_mem;
+  uint16_t *legal_ids_mem;
+  int *legal_offsets_mem;
+  float *op_legal_policy_mem;
+  // The network for each batch size up to max_graph_batch, captured on first
+  // use.
+  std::vector<cudaGraphExec_t> graphs;
 };
 
+template <typename DataType>
 class CudnnNetworkComputation : public NetworkComputation {
  public:
-  CudnnNetworkComputation(CudnnNetwork *network);
+  CudnnNetworkComputation(CudnnNetwork<DataType> *network);
   ~CudnnNetworkComputation();
 
   void AddInput(InputPlanes &&input) override {
-    auto iterMask =
-        &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
-    auto iterVal = &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
+    const InputPlanesRef planes = AddInputInPlace();
 
     int i = 0;
     for (const auto &plane : input) {
-      iterMask[i] = plane.mask;
-      iterVal[i] = plane.value;
+      planes.masks[i] = plane.mask;
+      planes.values[i] = plane.value;
       i++;
     }
+  }
 
+  // Inputs are written straight into the mapped host memory the GPU reads.
+  InputPlanesRef AddInputInPlace() override {
+    const InputPlanesRef planes{
+        &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes],
+        &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes]};
     batch_size_++;
+    return planes;
+  }
+
+  // The policy is only gathered if every sample has its legal moves.
+  void SetLegalMoves(const std::uint16_t *move_ids, int count) override {
+    if (legal_samples_ != batch_size_ - 1 || count > kMaxLegalMoves) return;
+    int *offsets = inputs_outputs_->legal_offsets_mem_;
+    std::copy(move_ids, move_ids + count,
+              &inputs_outputs_->legal_ids_mem_[offsets[legal_samples_]]);
+    offsets[legal_samples_ + 1] = offsets[legal_samples_] + count;
+    legal_samples_++;
   }
 
   void ComputeBlocking() override;
@@ -630,21 +1103,60 @@ class CudnnNetworkComputation : public NetworkComputation {
     return inputs_outputs_->op_value_mem_[sample];
   }
   float GetPVal(int sample, int move_id) const override {
-    return inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy + move_id];
+    if (!IsGathered()) {
+      return inputs_outputs_
+          ->op_policy_mem_[sample * kNumOutputPolicy + move_id];
+    }
+    const int *offsets = inputs_outputs_->legal_offsets_mem_;
+    for (int i = offsets[sample]; i < offsets[sample + 1]; ++i) {
+      if (inputs_outputs_->legal_ids_mem_[i] == move_id) {
+        return inputs_outputs_->op_legal_policy_mem_[i];
+      }
+    }
+    assert(false);  // Not one of the legal moves.
+    return 0.0f;
+  }
+  void GetPVals(int sample, const std::uint16_t *move_ids, int count,
+                float *out) const override {
+    if (!IsGathered()) {
+      const float *policy =
+          &inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy];
+      for (int i = 0; i < count; ++i) out[i] = policy[move_ids[i]];
+      return;
+    }
+    // Usually asked for in the order they were given.
+    const int *offsets = inputs_outputs_->legal_offsets_mem_;
+    const int begin = offsets[sample];
+    const int legal = offsets[sample + 1] - begin;
+    const uint16_t *ids = &inputs_outputs_->legal_ids_mem_[begin];
+    const float *policy = &inputs_outputs_->op_legal_policy_mem_[begin];
+    for (int i = 0; i < count; ++i) {
+      out[i] = i < legal && ids[i] == move_ids[i]
+                   ? policy[i]
+                   : GetPVal(sample, move_ids[i]);
+    }
   }
 
  private:
+  bool IsGathered() const {
+    return batch_size_ > 0 && legal_samples_ == batch_size_;
+  }
+
   // memory holding inputs, outputs
   std::unique_ptr<InputsOutputs> inputs_outputs_;
   int batch_size_;
+  // The first samples, which have their legal moves.
+  int legal_samples_ = 0;
 
-  CudnnNetwork *network_;
+  CudnnNetwork<DataType> *network_;
 };
 
+template <typename DataType>
 class CudnnNetwork : public Network {
  public:
   CudnnNetwork(Weights weights, const OptionsDict &options) {
     gpuId_ = options.GetOrDefault<int>("gpu", 0);
+    legal_softmax_ = options.GetOrDefault<bool>("legal_softmax", false);
 
     int totalGPUs;
     reportCUDAErrors(cudaGetDeviceCount(&totalGPUs));
@@ -655,8 +1167,10 @@ class CudnnNetwork : public Network {
     // select GPU to run on (for *the current* thread)
     reportCUDAErrors(cudaSetDevice(gpuId_));
 
-    reportCUDNNErrors(cudnnCreate(&cudnn_));
-    reportCUBLASErrors(cublasCreate(&cublas_));
+    // Processing below changes the weights, the check needs the originals.
+    const bool check = fp16_ && options.GetOrDefault<bool>("check", true);
+    std::unique_ptr<Weights> original_weights;
+    if (check) original_weights = std::make_unique<Weights>(weights);
 
     const int numInputPlanes = kInputPlanes;
     const int numFilters = weights.input.biases.size();
@@ -669,14 +1183,14 @@ class CudnnNetwork : public Network {
       processConvBlock(weights.residual[i].conv1, true);
       processConvBlock(weights.residual[i].conv2, true);
     }
-    processConvBlock(weights.policy);
-    processConvBlock(weights.value);
+    processConvBlock(weights.policy, true);
+    processConvBlock(weights.value, true);
 
     // 1. build the network, and copy the weights to GPU memory
     // input
     {
-      auto inputConv = std::make_unique<ConvLayer>(nullptr, numFilters, 8, 8, 3,
-                                                   numInputPlanes, true, true);
+      auto inputConv = std::make_unique<ConvLayer<DataType>>(
+          nullptr, numFilters, 8, 8, 3, numInputPlanes, true, true);
       inputConv->LoadWeights(&weights.input.weights[0],
                              &weights.input.biases[0]);
       network_.emplace_back(std::move(inputConv));
@@ -684,14 +1198,14 @@ class CudnnNetwork : public Network {
 
     // residual block
     for (int block = 0; block < weights.residual.size(); block++) {
-      auto conv1 = std::make_unique<ConvLayer>(getLastLayer(), numFilters, 8, 8,
-                                               3, numFilters, true, true);
+      auto conv1 = std::make_unique<ConvLayer<DataType>>(
+          getLastLayer(), numFilters, 8, 8, 3, numFilters, true, true);
       conv1->LoadWeights(&weights.residual[block].conv1.weights[0],
                          &weights.residual[block].conv1.biases[0]);
       network_.emplace_back(std::move(conv1));
 
-      auto conv2 = std::make_unique<ConvLayer>(getLastLayer(), numFilters, 8, 8,
-                                               3, numFilters, true, true);
+      auto conv2 = std::make_unique<ConvLayer<DataType>>(
+          getLastLayer(), numFilters, 8, 8, 3, numFilters, true, true);
       conv2->LoadWeights(&weights.residual[block].conv2.weights[0],
                          &weights.residual[block].conv2.biases[0]);
       network_.emplace_back(std::move(conv2));
@@ -701,121 +1215,136 @@ class CudnnNetwork : public Network {
 
     // policy head
     {
-      auto convPol = std::make_unique<ConvLayer>(
-          resi_last_, weights.policy.bn_means.size(), 8, 8, 1, numFilters);
-      convPol->LoadWeights(&weights.policy.weights[0]);
+      auto convPol = std::make_unique<ConvLayer<DataType>>(
+          resi_last_, weights.policy.bn_means.size(), 8, 8, 1, numFilters,
+          true, true);
+      convPol->LoadWeights(&weights.policy.weights[0],
+                           &weights.policy.biases[0]);
       network_.emplace_back(std::move(convPol));
 
-      auto BNPol = std::make_unique<BNLayer>(getLastLayer(), true);
-      BNPol->LoadWeights(&weights.policy.bn_means[0],
-                         &weights.policy.bn_stddivs[0]);
-      network_.emplace_back(std::move(BNPol));
-
-      auto FCPol = std::make_unique<FCLayer>(
+      auto FCPol = std::make_unique<FCLayer<DataType>>(
           getLastLayer(), weights.ip_pol_b.size(), 1, 1, false, true);
       FCPol->LoadWeights(&weights.ip_pol_w[0], &weights.ip_pol_b[0]);
       network_.emplace_back(std::move(FCPol));
 
-      auto softmaxPol = std::make_unique<SoftMaxLayer>(getLastLayer());
+      auto softmaxPol =
+          std::make_unique<SoftMaxLayer<DataType>>(getLastLayer());
       network_.emplace_back(std::move(softmaxPol));
     }
     policy_out_ = getLastLayer();
 
     // Value head
     {
-      auto convVal = std::make_unique<ConvLayer>(
-          resi_last_, weights.value.bn_means.size(), 8, 8, 1, numFilters);
-      convVal->LoadWeights(&weights.value.weights[0]);
+      auto convVal = std::make_unique<ConvLayer<DataType>>(
+          resi_last_, weights.value.bn_means.size(), 8, 8, 1, numFilters,
+          true, true);
+      convVal->LoadWeights(&weights.value.weights[0],
+                           &weights.value.biases[0]);
       network_.emplace_back(std::move(convVal));
 
-      auto BNVal = std::make_unique<BNLayer>(getLastLayer(), true);
-      BNVal->LoadWeights(&weights.value.bn_means[0],
-                         &weights.value.bn_stddivs[0]);
-      network_.emplace_back(std::move(BNVal));
-
-      auto FCVal1 = std::make_unique<FCLayer>(
+      auto FCVal1 = std::make_unique<FCLayer<DataType>>(
           getLastLayer(), weights.ip1_val_b.size(), 1, 1, true, true);
       FCVal1->LoadWeights(&weights.ip1_val_w[0], &weights.ip1_val_b[0]);
       network_.emplace_back(std::move(FCVal1));
 
-      auto FCVal2 =
-          std::make_unique<FCLayer>(getLastLayer(), 1, 1, 1, false, true, true);
+      auto FCVal2 = std::make_unique<FCLayer<DataType>>(getLastLayer(), 1, 1,
+                                                        1, false, true, true);
       FCVal2->LoadWeights(&weights.ip2_val_w[0], &weights.ip2_val_b[0]);
       network_.emplace_back(std::move(FCVal2));
     }
     value_out_ = getLastLayer();
 
-    // 2. allocate GPU memory for running the network
-    //    - three buffers of max size are enough (one to hold input, second to
-    //    hold output and third to hold skip connection's input)
-    size_t maxSize = resi_last_->GetOutputSize(kMaxBatchSize);
-    for (auto &mem : tensor_mem_) {
-      reportCUDAErrors(cudaMalloc(&mem, maxSize));
-      reportCUDAErrors(cudaMemset(mem, 0, maxSize));
+    // 2. allocate GPU memory and streams for running the network, one
+    //    context for each computation that can run at the same time
+    const int streams = options.GetOrDefault<int>("streams", 2);
+    // Small batches are dominated by the launch overhead of the layers, which
+    // a graph saves. Larger ones aren't worth a graph each.
+    max_graph_batch_ = std::min(
+        std::max(options.GetOrDefault<int>("max_graph_batch", 64), 0),
+        kMaxBatchSize);
+    const size_t maxSize = resi_last_->GetOutputSize(kMaxBatchSize);
+    for (int i = 0; i < std::max(streams, 1); ++i) {
+      contexts_.emplace_back(std::make_unique<ExecutionContext>(
+          maxSize, fp16_, max_graph_batch_));
+      free_contexts_.push_back(contexts_.back().get());
     }
 
-    // printf("Allocated %d bytes of GPU memory to run the network\n", 3 *
-    // maxSize);
+    // 3. pick the fastest convolution algorithms, from earlier runs if they
+    //    measured them
+    if (options.GetOrDefault<bool>("tune", true)) {
+      ConvAlgoTuner tuner(gpuId_);
+      for (const auto &layer : network_) {
+        auto conv = dynamic_cast<ConvLayer<DataType> *>(layer.get());
+        if (conv) conv->Tune(&tuner, contexts_[0]->cudnn);
+      }
+      tuner.Save();
+    }
 
-    // 3. allocate scratch space (used internally by cudnn to run convolutions)
-    reportCUDAErrors(cudaMalloc(&scratch_mem_, kCudaScratchSize));
+    if (check) CheckAgainstFp32(*original_weights, options);
   }
 
-  void forwardEval(InputsOutputs *io, int batchSize) {
-    std::lock_guard<std::mutex> lock(lock_);
+  // With legalOnly, only the policy of the legal moves in io->legal_*_mem_
+  // is downloaded, to io->op_legal_policy_mem_.
+  void forwardEval(InputsOutputs *io, int batchSize, bool legalOnly = false) {
+    // Waits while as many computations as there are contexts run.
+    ExecutionContext *ctx = AcquireContext();
 
 #if DEBUG_RAW_NPS == 1
     auto t_start = std::chrono::high_resolution_clock::now();
 #endif
 
-    // expand packed planes to full planes
-    uint64_t *ipDataMasks = io->input_masks_mem_gpu_;
-    float *ipDataValues = io->input_val_mem_gpu_;
-    expandPlanes(tensor_mem_[0], ipDataMasks, ipDataValues,
-                 batchSize * kInputPlanes);
-
-    float *opPol = io->op_policy_mem_gpu_;
-    float *opVal = io->op_value_mem_gpu_;
-
-    int l = 0;
-    // input
-    network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0], nullptr,
-                        scratch_mem_, cudnn_, cublas_);  // input conv
-
-    // residual block
-    for (int block = 0; block < numBlocks_; block++) {
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                          scratch_mem_, cudnn_, cublas_);  // conv1
-      network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0],
-                          tensor_mem_[2], scratch_mem_, cudnn_,
-                          cublas_);  // conv2
+    // upload packed planes (12 bytes per plane instead of 256), the network
+    // expands them to full planes on the GPU
+    const int numPlanes = batchSize * kInputPlanes;
+    reportCUDAErrors(cudaMemcpyAsync(ctx->input_masks_mem,
+                                     io->input_masks_mem_,
+                                     numPlanes * sizeof(uint64_t),
+                                     cudaMemcpyHostToDevice, ctx->stream));
+    reportCUDAErrors(cudaMemcpyAsync(ctx->input_val_mem, io->input_val_mem_,
+                                     numPlanes * sizeof(float),
+                                     cudaMemcpyHostToDevice, ctx->stream));
+    const int numLegal = legalOnly ? io->legal_offsets_mem_[batchSize] : 0;
+    if (legalOnly) {
+      reportCUDAErrors(cudaMemcpyAsync(
+          ctx->legal_offsets_mem, io->legal_offsets_mem_,
+          (batchSize + 1) * sizeof(int), cudaMemcpyHostToDevice, ctx->stream));
+      reportCUDAErrors(cudaMemcpyAsync(
+          ctx->legal_ids_mem, io->legal_ids_mem_, numLegal * sizeof(uint16_t),
+          cudaMemcpyHostToDevice, ctx->stream));
     }
 
-    // policy head
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                        scratch_mem_, cudnn_, cublas_);  // pol conv
-    network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                        scratch_mem_, cudnn_, cublas_);  // pol BN
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[1], nullptr,
-                        scratch_mem_, cudnn_, cublas_);  // pol FC
-    network_[l++]->Eval(batchSize, opPol, tensor_mem_[0], nullptr, scratch_mem_,
-                        cudnn_,
-                        cublas_);  // pol softmax  // POLICY
+    if (batchSize <= max_graph_batch_ && ctx->graphs[batchSize]) {
+      reportCUDAErrors(cudaGraphLaunch(ctx->graphs[batchSize], ctx->stream));
+    } else {
+      enqueueNetwork(ctx, batchSize);
+      // Only captured after a run, so that cudnn and cublas have done their
+      // lazy allocations, which are not allowed while capturing.
+      if (batchSize <= max_graph_batch_) captureNetwork(ctx, batchSize);
+    }
 
-    // value head
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                        scratch_mem_, cudnn_, cublas_);  // value conv
-    network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0], nullptr,
-                        scratch_mem_, cudnn_, cublas_);  // value BN
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                        scratch_mem_, cudnn_, cublas_);  // value FC1
-    network_[l++]->Eval(batchSize, opVal, tensor_mem_[0], nullptr, scratch_mem_,
-                        cudnn_,
-                        cublas_);  // value FC2    // VALUE
-
-    reportCUDAErrors(cudaDeviceSynchronize());
+    if (legalOnly) {
+      // Outside of the graphs, which don't depend on the moves.
+      gatherPolicy(ctx->op_legal_policy_mem, ctx->op_policy_mem,
+                   ctx->legal_ids_mem, ctx->legal_offsets_mem, batchSize,
+                   legal_softmax_, ctx->stream);
+      reportCUDAErrors(cudaMemcpyAsync(
+          io->op_legal_policy_mem_, ctx->op_legal_policy_mem,
+          numLegal * sizeof(float), cudaMemcpyDeviceToHost, ctx->stream));
+    } else {
+      reportCUDAErrors(cudaMemcpyAsync(
+          io->op_policy_mem_, ctx->op_policy_mem,
+          batchSize * kNumOutputPolicy * sizeof(float),
+          cudaMemcpyDeviceToHost, ctx->stream));
+    }
+    reportCUDAErrors(cudaMemcpyAsync(io->op_value_mem_, ctx->op_value_mem,
+                                     batchSize * sizeof(float),
+                                     cudaMemcpyDeviceToHost, ctx->stream));
+    reportCUDAErrors(cudaStreamSynchronize(ctx->stream));
+    ReleaseContext(ctx);
 
 #if DEBUG_RAW_NPS == 1
+    static std::mutex stats_mutex;
+    std::lock_guard<std::mutex> lock(stats_mutex);
     const int reportingCalls = 100;
     static int numCalls = 0;
     static int sumBatchSize = 0;
@@ -839,21 +1368,15 @@ class CudnnNetwork : public Network {
 #endif
   }
 
-  ~CudnnNetwork() {
-    for (auto mem : tensor_mem_) {
-      if (mem) reportCUDAErrors(cudaFree(mem));
-    }
-    if (scratch_mem_) reportCUDAErrors(cudaFree(scratch_mem_));
-    cudnnDestroy(cudnn_);
-    cublasDestroy(cublas_);
-  }
+  ~CudnnNetwork() = default;
 
   std::unique_ptr<NetworkComputation> NewComputation() override {
     // set correct gpu id for this computation (as it might have been called
     // from a different thread)
     reportCUDAErrors(cudaSetDevice(gpuId_));
-    return std::make_unique<CudnnNetworkComputation>(this);
+    return std::make_unique<CudnnNetworkComputation<DataType>>(this);
   }
+  void InitThread() override { reportCUDAErrors(cudaSetDevice(gpuId_)); }
 
   std::unique_ptr<InputsOutputs> GetInputsOutputs() {
     std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
@@ -873,24 +1396,172 @@ class CudnnNetwork : public Network {
   }
 
  private:
-  cudnnHandle_t cudnn_;
-  cublasHandle_t cublas_;
-  int gpuId_;
+  static constexpr bool fp16_ = std::is_same<half, DataType>::value;
+
+  // Runs the same inputs through an fp32 network with the same weights and
+  // warns if the outputs differ by more than half precision explains.
+  void CheckAgainstFp32(const Weights &weights, const OptionsDict &options) {
+    constexpr int kBatchSize = 16;
+    constexpr float kMaxValueError = 0.02f;
+    constexpr float kMaxPolicyError = 0.01f;
+
+    CudnnNetwork<float> reference(weights, options);
+    std::unique_ptr<InputsOutputs> io = GetInputsOutputs();
+    std::unique_ptr<InputsOutputs> reference_io = reference.GetInputsOutputs();
+
+    // Sparse pseudorandom planes, about as many pieces as in a real position.
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    auto next = [&state]() {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      return state;
+    };
+    for (int i = 0; i < kBatchSize * kInputPlanes; ++i) {
+      const uint64_t mask = next() & next() & next();
+      io->input_masks_mem_[i] = reference_io->input_masks_mem_[i] = mask;
+      io->input_val_mem_[i] = reference_io->input_val_mem_[i] = 1.0f;
+    }
 
-  // currently only one NN Eval can happen a time (we can fix this if needed by
-  // allocating more memory)
-  mutable std::mutex lock_;
+    forwardEval(io.get(), kBatchSize);
+    reference.forwardEval(reference_io.get(), kBatchSize);
 
-  int numBlocks_;
-  std::vector<std::unique_ptr<BaseLayer>> network_;
-  BaseLayer *getLastLayer() { return network_.back().get(); }
+    float value_error = 0.0f;
+    float policy_error = 0.0f;
+    for (int i = 0; i < kBatchSize; ++i) {
+      value_error = std::max(value_error,
+                             std::abs(io->op_value_mem_[i] -
+                                      reference_io->op_value_mem_[i]));
+    }
+    for (int i = 0; i < kBatchSize * kNumOutputPolicy; ++i) {
+      policy_error = std::max(policy_error,
+                              std::abs(io->op_policy_mem_[i] -
+                                       reference_io->op_policy_mem_[i]));
+    }
+    reference.ReleaseInputsOutputs(std::move(reference_io));
+    ReleaseInputsOutputs(std::move(io));
+
+    if (value_error > kMaxValueError || policy_error > kMaxPolicyError) {
+      std::cerr << "WARNING: fp16 results differ from fp32, value by "
+                << value_error << ", policy by " << policy_error
+                << std::endl;
+    }
+  }
+
+  // Launches the network on the context's stream, from the packed planes in
+  // ctx->input_*_mem to the outputs in ctx->op_*_mem.
+  void enqueueNetwork(ExecutionContext *ctx, int batchSize) {
+    DataType *tensor_mem[3];
+    for (int i = 0; i < 3; ++i) {
+      tensor_mem[i] = static_cast<DataType *>(ctx->tensor_mem[i]);
+    }
 
-  BaseLayer *resi_last_;
-  BaseLayer *policy_out_;
-  BaseLayer *value_out_;
+    expandPlanes(tensor_mem[0], ctx->input_masks_mem, ctx->input_val_mem,
+                 batchSize * kInputPlanes, ctx->stream);
+
+    float *opPol = ctx->op_policy_mem;
+    float *opVal = ctx->op_value_mem;
+    // Half outputs go to tensor_mem[0] first and are converted to the float
+    // output buffers.
+    DataType *outPol =
+        fp16_ ? tensor_mem[0] : reinterpret_cast<DataType *>(opPol);
+    DataType *outVal =
+        fp16_ ? tensor_mem[0] : reinterpret_cast<DataType *>(opVal);
+
+    int l = 0;
+    // input
+    network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0], nullptr,
+                        ctx->scratch_mem, ctx->cudnn,
+                        ctx->cublas);  // input conv
+
+    // residual block
+    for (int block = 0; block < numBlocks_; block++) {
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          ctx->scratch_mem, ctx->cudnn,
+                          ctx->cublas);  // conv1
+      network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0],
+                          tensor_mem[2], ctx->scratch_mem, ctx->cudnn,
+                          ctx->cublas);  // conv2
+    }
+
+    // policy head
+    network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                        ctx->scratch_mem, ctx->cudnn,
+                        ctx->cublas);  // pol conv (BN folded in)
+    network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                        ctx->scratch_mem, ctx->cudnn,
+                        ctx->cublas);  // pol FC
+    network_[l++]->Eval(batchSize, outPol, tensor_mem[1], nullptr,
+                        ctx->scratch_mem, ctx->cudnn,
+                        ctx->cublas);  // pol softmax  // POLICY
+    if (fp16_) {
+      copyTypeConverted(opPol, outPol, batchSize * kNumOutputPolicy,
+                        ctx->stream);
+    }
+
+    // value head
+    network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                        ctx->scratch_mem, ctx->cudnn,
+                        ctx->cublas);  // value conv (BN folded in)
+    network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                        ctx->scratch_mem, ctx->cudnn,
+                        ctx->cublas);  // value FC1
+    network_[l++]->Eval(batchSize, outVal, tensor_mem[1], nullptr,
+                        ctx->scratch_mem, ctx->cudnn,
+                        ctx->cublas);  // value FC2    // VALUE
+    if (fp16_) copyTypeConverted(opVal, outVal, batchSize, ctx->stream);
+  }
+
+  // Records what enqueueNetwork() launches into ctx->graphs[batchSize]. Other
+  // threads keep using their own contexts meanwhile.
+  void captureNetwork(ExecutionContext *ctx, int batchSize) {
+    cudaGraph_t graph;
+    reportCUDAErrors(
+        cudaStreamBeginCapture(ctx->stream, cudaStreamCaptureModeThreadLocal));
+    enqueueNetwork(ctx, batchSize);
+    reportCUDAErrors(cudaStreamEndCapture(ctx->stream, &graph));
+    reportCUDAErrors(cudaGraphInstantiate(&ctx->graphs[batchSize], graph,
+                                          nullptr, nullptr, 0));
+    reportCUDAErrors(cudaGraphDestroy(graph));
+  }
+
+  ExecutionContext *AcquireContext() {
+    std::unique_lock<std::mutex> lock(contexts_mutex_);
+    contexts_cv_.wait(lock, [this]() { return !free_contexts_.empty(); });
+    ExecutionContext *ctx = free_contexts_.back();
+    free_contexts_.pop_back();
+    return ctx;
+  }
+
+  void ReleaseContext(ExecutionContext *ctx) {
+    {
+      std::lock_guard<std::mutex> lock(contexts_mutex_);
+      free_contexts_.push_back(ctx);
+    }
+    contexts_cv_.notify_one();
+  }
+
+  int gpuId_;
+  // Whether the gathered policy of the legal moves is scaled to add up to 1,
+  // the softmax over the legal moves only.
+  bool legal_softmax_;
+
+  // As many NN evals as there are contexts can run at a time, each on its
+  // own stream.
+  std::vector<std::unique_ptr<ExecutionContext>> contexts_;
+  std::vector<ExecutionContext *> free_contexts_;
+  std::mutex contexts_mutex_;
+  std::condition_variable contexts_cv_;
+  // Batches up to this size run as CUDA graphs.
+  int max_graph_batch_;
+
+  int numBlocks_;
+  std::vector<std::unique_ptr<BaseLayer<DataType>>> network_;
+  BaseLayer<DataType> *getLastLayer() { return network_.back().get(); }
 
-  float *tensor_mem_[3];
-  float *scratch_mem_;
+  BaseLayer<DataType> *resi_last_;
+  BaseLayer<DataType> *policy_out_;
+  BaseLayer<DataType> *value_out_;
 
   mutable std::mutex inputs_outputs_lock_;
   std::list<std::unique_ptr<InputsOutputs>> free_inputs_outputs_;
@@ -919,13 +1590,12 @@ class CudnnNetwork : public Network {
     // leela go zero
     if (foldBNLayer) {
       const int outputs = block.biases.size();
-      const int channels = block.weights.size() / (outputs * 3 * 3);
+      // channels * filter size * filter size
+      const int weightsPerOutput = block.weights.size() / outputs;
 
       for (auto o = 0; o < outputs; o++) {
-        for (auto c = 0; c < channels; c++) {
-          for (auto i = 0; i < 9; i++) {
-            block.weights[o * channels * 9 + c * 9 + i] *= block.bn_stddivs[o];
-          }
+        for (auto i = 0; i < weightsPerOutput; i++) {
+          block.weights[o * weightsPerOutput + i] *= block.bn_stddivs[o];
         }
 
         block.bn_means[o] *= block.bn_stddivs[o];
@@ -939,22 +1609,28 @@ class CudnnNetwork : public Network {
   }
 };
 
-CudnnNetworkComputation::CudnnNetworkComputation(CudnnNetwork *network)
+template <typename DataType>
+CudnnNetworkComputation<DataType>::CudnnNetworkComputation(
+    CudnnNetwork<DataType> *network)
     : network_(network) {
   batch_size_ = 0;
   inputs_outputs_ = network_->GetInputsOutputs();
 }
 
-CudnnNetworkComputation::~CudnnNetworkComputation() {
+template <typename DataType>
+CudnnNetworkComputation<DataType>::~CudnnNetworkComputation() {
   network_->ReleaseInputsOutputs(std::move(inputs_outputs_));
 }
 
-void CudnnNetworkComputation::ComputeBlocking() {
-  network_->forwardEval(inputs_outputs_.get(), GetBatchSize());
+template <typename DataType>
+void CudnnNetworkComputation<DataType>::ComputeBlocking() {
+  TraceScope trace("cudnn backend");
+  network_->forwardEval(inputs_outputs_.get(), GetBatchSize(), IsGathered());
 }
 
 }  // namespace
 
-REGISTER_NETWORK("cudnn", CudnnNetwork, 110);
+REGISTER_NETWORK("cudnn", CudnnNetwork<float>, 110);
+REGISTER_NETWORK("cudnn-fp16", CudnnNetwork<half>, 105);
 
 }  // namespace lczero
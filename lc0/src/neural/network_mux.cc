@@ -18,10 +18,20 @@
 
 #include "neural/factory.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <queue>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
 #include <thread>
 #include "utils/exception.h"
+#include "utils/mpmc_queue.h"
+#include "utils/trace.h"
 
 namespace lczero {
 namespace {
@@ -31,49 +41,109 @@ class MuxingComputation : public NetworkComputation {
  public:
   MuxingComputation(MuxingNetwork* network) : network_(network) {}
 
-  void AddInput(InputPlanes&& input) override { planes_.emplace_back(input); }
+  void AddInput(InputPlanes&& input) override {
+    planes_.emplace_back(std::move(input));
+    legal_moves_.emplace_back();
+  }
+
+  void SetLegalMoves(const std::uint16_t* move_ids, int count) override {
+    legal_moves_.back().assign(move_ids, move_ids + count);
+  }
 
   void ComputeBlocking() override;
 
   int GetBatchSize() const override { return planes_.size(); }
 
   float GetQVal(int sample) const override {
-    return parent_->GetQVal(sample + idx_in_parent_);
+    const auto& slice = SliceOf(&sample);
+    return slice.parent_->GetQVal(sample + slice.idx_in_parent_);
   }
 
   float GetPVal(int sample, int move_id) const override {
-    return parent_->GetPVal(sample + idx_in_parent_, move_id);
+    const auto& slice = SliceOf(&sample);
+    return slice.parent_->GetPVal(sample + slice.idx_in_parent_, move_id);
+  }
+
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    const auto& slice = SliceOf(&sample);
+    slice.parent_->GetPVals(sample + slice.idx_in_parent_, move_ids, count,
+                            out);
   }
 
   void PopulateToParent(std::shared_ptr<NetworkComputation> parent) {
     // Populate our batch into batch of batches.
     parent_ = parent;
     idx_in_parent_ = parent->GetBatchSize();
-    for (auto& x : planes_) parent_->AddInput(std::move(x));
+    for (size_t i = 0; i < planes_.size(); ++i) {
+      parent_->AddInput(std::move(planes_[i]));
+      const auto& moves = legal_moves_[i];
+      if (!moves.empty()) parent_->SetLegalMoves(moves.data(), moves.size());
+    }
   }
 
+  // The computation may be gone once this returns, and must not be touched
+  // after the state says it's ready.
   void NotifyReady() {
-    {
-      std::unique_lock<std::mutex> lock(mutex_);
-      dataready_ = true;
-    }
+    int expected = kComputing;
+    // Still spinning, it sees the change itself.
+    if (state_.compare_exchange_strong(expected, kReady)) return;
+    // Asleep, and can't wake up before the lock is released.
+    std::lock_guard<std::mutex> lock(mutex_);
+    state_ = kReady;
     dataready_cv_.notify_one();
   }
 
  private:
+  // Waits until NotifyReady() is called.
+  void WaitReady();
+
+  // Moves the inputs into slices of at most @max_slice, of equal size but
+  // for the last one.
+  void Split(int max_slice);
+
+  // The computation which computed @sample, which is changed to its index
+  // there.
+  const MuxingComputation& SliceOf(int* sample) const {
+    if (slices_.empty()) return *this;
+    const auto& slice = *slices_[*sample / slice_size_];
+    *sample %= slice_size_;
+    return slice;
+  }
+
   std::vector<InputPlanes> planes_;
+  // Of each of planes_, empty if not given.
+  std::vector<std::vector<std::uint16_t>> legal_moves_;
   MuxingNetwork* network_;
   std::shared_ptr<NetworkComputation> parent_;
   int idx_in_parent_ = 0;
-
+  // A computation too large for one backend is computed in slices, in
+  // parallel by several workers. Empty otherwise.
+  std::vector<std::unique_ptr<MuxingComputation>> slices_;
+  int slice_size_ = 0;
+
+  // Results come back within microseconds for small batches on a fast
+  // backend, so ComputeBlocking() spins for a while before it sleeps.
+  static constexpr int kSpinCount = 100;
+  enum State { kComputing, kSleeping, kReady };
+  std::atomic<int> state_{kComputing};
   std::mutex mutex_;
   std::condition_variable dataready_cv_;
-  bool dataready_ = false;
 };
 
 class MuxingNetwork : public Network {
  public:
-  MuxingNetwork(const Weights& weights, const OptionsDict& options) {
+  // How each backend forms its batches from the queued computations.
+  struct BatchLimits {
+    int max_batch;
+    // Wait up to max_wait for at least this many inputs, adapted to the
+    // arrival rate and the latency of the backend.
+    int min_batch;
+    std::chrono::microseconds max_wait;
+  };
+
+  MuxingNetwork(const Weights& weights, const OptionsDict& options)
+      : queue_(options.GetOrDefault<int>("queue_size", 1024)) {
     // int threads, int max_batch)
     //: network_(std::move(network)), max_batch_(max_batch) {
 
@@ -81,21 +151,50 @@ class MuxingNetwork : public Network {
     if (parents.empty()) {
       throw Exception("Empty list of backends passed to a Muxing backend");
     }
+    stats_interval_ =
+        std::chrono::seconds(options.GetOrDefault<int>("stats_interval", 0));
+    start_time_ = last_stats_ = std::chrono::steady_clock::now();
 
+    int min_max_batch = std::numeric_limits<int>::max();
     for (const auto& name : parents) {
       const auto& opts = options.GetSubdict(name);
       const int nn_threads = opts.GetOrDefault<int>("threads", 1);
-      const int max_batch = opts.GetOrDefault<int>("max_batch", 256);
+      BatchLimits limits;
+      limits.max_batch = opts.GetOrDefault<int>("max_batch", 256);
+      // By default, compute whatever is queued right away.
+      limits.min_batch =
+          std::min(opts.GetOrDefault<int>("min_batch", 1), limits.max_batch);
+      limits.max_wait =
+          std::chrono::microseconds(opts.GetOrDefault<int>("max_wait_us", 0));
       const std::string backend =
           opts.GetOrDefault<std::string>("backend", name);
 
-      networks_.emplace_back(
-          NetworkFactory::Get()->Create(backend, weights, opts));
-      Network* net = networks_.back().get();
+      backends_.emplace_back(std::make_unique<Backend>());
+      Backend* parent = backends_.back().get();
+      parent->name = name;
+      parent->backend = backend;
+      parent->limits = limits;
+      parent->threads = nn_threads;
+      min_max_batch = std::min(min_max_batch, limits.max_batch);
+    }
+    // By default, any backend can take any slice whole.
+    split_batch_ = options.GetOrDefault<int>("split_batch", min_max_batch);
+    if (split_batch_ < 1) {
+      throw Exception("split_batch of a Muxing backend must be positive");
+    }
 
-      for (int i = 0; i < nn_threads; ++i) {
-        threads_.emplace_back(
-            [this, net, max_batch]() { Worker(net, max_batch); });
+    // Backends can take seconds to set up each, so create them all at once.
+    ForEachBackend([&weights, &options](Backend* parent) {
+      parent->network = NetworkFactory::Get()->Create(
+          parent->backend, weights, options.GetSubdict(parent->name));
+    });
+
+    // Only start the workers once all backends exist, as they look at each
+    // other.
+    for (auto& backend : backends_) {
+      Backend* parent = backend.get();
+      for (int i = 0; i < parent->threads; ++i) {
+        threads_.emplace_back([this, parent]() { Worker(parent); });
       }
     }
   }
@@ -104,58 +203,266 @@ class MuxingNetwork : public Network {
     return std::make_unique<MuxingComputation>(this);
   }
 
+  // Warms up all backends at once, each up to its own max_batch.
+  void Warmup(int batch_size) override {
+    ForEachBackend([batch_size](Backend* backend) {
+      backend->network->Warmup(
+          std::min(batch_size, backend->limits.max_batch));
+    });
+  }
+
+  // The backends all evaluate alike, only with different hardware.
+  uint64_t GetCacheNamespace() const override {
+    return backends_.front()->network->GetCacheNamespace();
+  }
+
+  // Computations with more inputs are split into slices for several workers.
+  int GetSplitBatch() const { return split_batch_; }
+
+  // Lock-free unless a worker is waiting for work, then it has to be woken.
   void Enqueue(MuxingComputation* computation) {
+    // Every search thread waits for one computation at a time, but that
+    // can be split into many slices, so a small queue_size can fill up. Then
+    // the workers make room soon enough.
+    while (!queue_.TryPush(computation)) std::this_thread::yield();
+    // Pairs with the fence in WaitForWork(): either the worker sees the
+    // computation, or this sees the worker waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_workers_.load(std::memory_order_relaxed) == 0) return;
     std::lock_guard<std::mutex> lock(mutex_);
-    queue_.push(computation);
-    cv_.notify_one();
+    // Everyone, so that the fastest idle backend can take it.
+    cv_.notify_all();
   }
 
   ~MuxingNetwork() {
     Abort();
     Wait();
     // Unstuck waiting computations.
-    while (!queue_.empty()) {
-      queue_.front()->NotifyReady();
-      queue_.pop();
+    if (pending_) pending_->NotifyReady();
+    MuxingComputation* computation;
+    while (queue_.TryPop(&computation)) computation->NotifyReady();
+    if (stats_interval_.count() > 0) std::cerr << StatsString();
+  }
+
+ private:
+  // A backend and what its worker threads measure about it.
+  struct Backend {
+    std::string name;
+    std::string backend;
+    std::unique_ptr<Network> network;
+    BatchLimits limits;
+    int threads = 1;
+
+    // Guarded by MuxingNetwork::mutex_.
+    // Inputs per second of one worker thread, 0 until a batch is computed.
+    double throughput = 0.0;
+    // Worker threads waiting for the queue.
+    int idle_workers = 0;
+
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> inputs{0};
+    std::atomic<uint64_t> busy_us{0};
+  };
+
+  // Calls @func for every backend, each on its own thread, and rethrows the
+  // first exception any of them threw.
+  template <typename Func>
+  void ForEachBackend(Func func) {
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(backends_.size());
+    for (size_t i = 0; i < backends_.size(); ++i) {
+      threads.emplace_back([this, &func, &errors, i]() {
+        try {
+          func(backends_[i].get());
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    for (const auto& error : errors) {
+      if (error) std::rethrow_exception(error);
     }
   }
 
-  void Worker(Network* network, const int max_batch) {
+  // Backends are considered faster than others only by this margin, so that
+  // measurement noise doesn't make them pass work back and forth.
+  static constexpr double kFasterMargin = 1.2;
+
+  // Whether a backend that computes more inputs per second than @backend has
+  // a worker waiting. Then that one should take the queued work, and
+  // @backend only gets work while the faster backends are all busy.
+  // Must be called with mutex_ held.
+  bool FasterBackendIdle(const Backend& backend) const {
+    for (const auto& other : backends_) {
+      if (other->idle_workers > 0 &&
+          other->throughput > backend.throughput * kFasterMargin) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Worker(Backend* backend) {
+    const BatchLimits& limits = backend->limits;
+    // Batch size worth waiting for, lowered while inputs arrive too slowly to
+    // reach limits.min_batch in time and raised back once they fill up.
+    int target_batch = limits.min_batch;
+    // Running average of how long the backend takes for a batch, 0 until
+    // the first one is computed.
+    std::chrono::microseconds latency(0);
+
     // While Abort() is not called (and it can only be called from destructor).
     while (!abort_) {
       std::vector<MuxingComputation*> children;
       // Create new computation in "upstream" network, to gather batch into
       // there.
-      std::shared_ptr<NetworkComputation> parent(network->NewComputation());
+      std::shared_ptr<NetworkComputation> parent(
+          backend->network->NewComputation());
       {
         std::unique_lock<std::mutex> lock(mutex_);
-        // Wait until there's come work to compute.
-        cv_.wait(lock, [&] { return abort_ || !queue_.empty(); });
+        // Wait until there's come work to compute, and no faster backend is
+        // waiting for it.
+        ++backend->idle_workers;
+        WaitForWork(&lock, [&] {
+          return abort_ || (HasQueued() && !FasterBackendIdle(*backend));
+        });
+        --backend->idle_workers;
         if (abort_) break;
-
-        // While there is a work in queue, add it.
-        while (!queue_.empty()) {
-          // If we are reaching batch size limit, stop adding.
-          // However, if a single input batch is larger than output batch limit,
-          // we still have to add it.
-          if (parent->GetBatchSize() != 0 &&
-              parent->GetBatchSize() + queue_.front()->GetBatchSize() >
-                  max_batch) {
+        TraceScope trace("mux batching");
+
+        // Waiting for more inputs makes the first ones wait as well, so never
+        // wait longer than half of what a computation takes.
+        auto max_wait = limits.max_wait;
+        if (latency.count() > 0) max_wait = std::min(max_wait, latency / 2);
+        const auto deadline = std::chrono::steady_clock::now() + max_wait;
+
+        bool timed_out = false;
+        while (true) {
+          const bool full = TakeQueued(parent, limits.max_batch, &children);
+          if (full || abort_ || parent->GetBatchSize() >= target_batch) break;
+          if (!WaitForWork(&lock, [&] { return abort_ || HasQueued(); },
+                           &deadline)) {
+            timed_out = true;
             break;
           }
-          // Remember which of "input" computations we serve.
-          children.push_back(queue_.front());
-          queue_.pop();
-          // Make "input" computation populate data into output batch.
-          children.back()->PopulateToParent(parent);
         }
+
+        if (timed_out) {
+          target_batch =
+              std::max(1, (target_batch + parent->GetBatchSize()) / 2);
+        } else {
+          target_batch = std::min(limits.min_batch, target_batch * 2);
+        }
+        // Whatever didn't fit may have been left for us by a slower backend.
+        if (HasQueued()) cv_.notify_all();
       }
 
       // Compute.
-      parent->ComputeBlocking();
+      const auto start = std::chrono::steady_clock::now();
+      {
+        TraceScope trace("mux compute");
+        parent->ComputeBlocking();
+      }
+      const auto elapsed =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - start);
+      latency = latency.count() > 0 ? (latency * 7 + elapsed) / 8 : elapsed;
       // Notify children that data is ready!
       for (auto child : children) child->NotifyReady();
+
+      const int batch_size = parent->GetBatchSize();
+      ++backend->batches;
+      backend->inputs += batch_size;
+      backend->busy_us += elapsed.count();
+      std::string stats;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const double throughput =
+            batch_size * 1e6 / std::max<int64_t>(elapsed.count(), 1);
+        backend->throughput = backend->throughput > 0.0
+                                  ? (backend->throughput * 7 + throughput) / 8
+                                  : throughput;
+        const auto now = std::chrono::steady_clock::now();
+        if (stats_interval_.count() > 0 &&
+            now - last_stats_ >= stats_interval_) {
+          last_stats_ = now;
+          stats = StatsString();
+        }
+      }
+      if (!stats.empty()) std::cerr << stats;
+    }
+  }
+
+  // Whether there is a computation to take. Must be called with mutex_ held.
+  bool HasQueued() const { return pending_ || !queue_.Empty(); }
+
+  // Waits on cv_ for @pred, until @deadline if given. Returns @pred. Workers
+  // only wait like this, so that Enqueue() knows when to wake them.
+  template <typename Pred>
+  bool WaitForWork(std::unique_lock<std::mutex>* lock, Pred pred,
+                   const std::chrono::steady_clock::time_point* deadline =
+                       nullptr) {
+    waiting_workers_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool result;
+    if (deadline) {
+      result = cv_.wait_until(*lock, *deadline, pred);
+    } else {
+      cv_.wait(*lock, pred);
+      result = true;
     }
+    waiting_workers_.fetch_sub(1, std::memory_order_relaxed);
+    return result;
+  }
+
+  // Moves queued computations into @parent while they fit in @max_batch.
+  // Returns whether the next one doesn't fit. Must be called with mutex_ held,
+  // which makes the workers take computations from the queue one at a time.
+  bool TakeQueued(const std::shared_ptr<NetworkComputation>& parent,
+                  int max_batch, std::vector<MuxingComputation*>* children) {
+    // While there is a work in queue, add it.
+    while (true) {
+      MuxingComputation* next = pending_;
+      pending_ = nullptr;
+      if (!next && !queue_.TryPop(&next)) return false;
+      // If we are reaching batch size limit, stop adding.
+      // However, if a single input batch is larger than output batch limit,
+      // which only happens with split_batch above it, we still have to add
+      // it. The one that didn't fit goes first into the
+      // next batch of whichever worker.
+      if (parent->GetBatchSize() != 0 &&
+          parent->GetBatchSize() + next->GetBatchSize() > max_batch) {
+        pending_ = next;
+        return true;
+      }
+      // Remember which of "input" computations we serve.
+      children->push_back(next);
+      // Make "input" computation populate data into output batch.
+      children->back()->PopulateToParent(parent);
+    }
+  }
+
+  // Utilization of every backend since the start: the share of the time
+  // its threads were computing, and how many inputs it computed.
+  std::string StatsString() const {
+    const double elapsed_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start_time_)
+            .count();
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1);
+    for (const auto& backend : backends_) {
+      const uint64_t batches = backend->batches;
+      const uint64_t inputs = backend->inputs;
+      const double busy = 100.0 * backend->busy_us /
+                          std::max(elapsed_us * backend->threads, 1.0);
+      oss << "Backend [" << backend->name << "]: " << busy << "% busy, "
+          << batches << " batches, " << inputs << " inputs, "
+          << (batches ? double(inputs) / batches : 0.0) << " per batch, "
+          << inputs * 1e6 / std::max(elapsed_us, 1.0) << " inputs/s\n";
+    }
+    return oss.str();
   }
 
   void Abort() {
@@ -173,21 +480,62 @@ class MuxingNetwork : public Network {
     }
   }
 
- private:
-  std::vector<std::unique_ptr<Network>> networks_;
-  std::queue<MuxingComputation*> queue_;
+  std::vector<std::unique_ptr<Backend>> backends_;
+  // Computations to compute, pushed without a lock.
+  MpmcQueue<MuxingComputation*> queue_;
+  // Taken from the queue, but didn't fit into the batch. Guarded by mutex_.
+  MuxingComputation* pending_ = nullptr;
+  // Workers in WaitForWork().
+  std::atomic<int> waiting_workers_{0};
   bool abort_ = false;
 
   std::mutex mutex_;
   std::condition_variable cv_;
 
   std::vector<std::thread> threads_;
+  int split_batch_;
+
+  // Print the utilization of the backends this often, never if 0.
+  std::chrono::seconds stats_interval_;
+  std::chrono::steady_clock::time_point start_time_;
+  std::chrono::steady_clock::time_point last_stats_;
 };
 
 void MuxingComputation::ComputeBlocking() {
-  network_->Enqueue(this);
+  if (GetBatchSize() <= network_->GetSplitBatch()) {
+    network_->Enqueue(this);
+    WaitReady();
+    return;
+  }
+  Split(network_->GetSplitBatch());
+  // All of them first, so that idle workers start on them right away.
+  for (auto& slice : slices_) network_->Enqueue(slice.get());
+  for (auto& slice : slices_) slice->WaitReady();
+}
+
+void MuxingComputation::Split(int max_slice) {
+  const int size = GetBatchSize();
+  const int count = (size + max_slice - 1) / max_slice;
+  slice_size_ = (size + count - 1) / count;
+  for (int start = 0; start < size; start += slice_size_) {
+    slices_.emplace_back(std::make_unique<MuxingComputation>(network_));
+    auto& slice = *slices_.back();
+    for (int i = start; i < std::min(start + slice_size_, size); ++i) {
+      slice.planes_.emplace_back(std::move(planes_[i]));
+      slice.legal_moves_.emplace_back(std::move(legal_moves_[i]));
+    }
+  }
+}
+
+void MuxingComputation::WaitReady() {
+  for (int i = 0; i < kSpinCount; ++i) {
+    if (state_.load(std::memory_order_acquire) == kReady) return;
+    std::this_thread::yield();
+  }
   std::unique_lock<std::mutex> lock(mutex_);
-  dataready_cv_.wait(lock, [this]() { return dataready_; });
+  int expected = kComputing;
+  if (!state_.compare_exchange_strong(expected, kSleeping)) return;
+  dataready_cv_.wait(lock, [this]() { return state_ == kReady; });
 }
 
 }  // namespace
@@ -0,0 +1,135 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include "neural/factory.h"
+
+namespace lczero {
+
+namespace {
+// Q of a sample is the mask of its first plane, and P of a move that plus the
+// move id, wherever the sample is in the batch of the backend. P of a move
+// which wasn't among the legal moves given for the sample is -1.
+class MaskComputation : public NetworkComputation {
+ public:
+  void AddInput(InputPlanes&& input) override {
+    masks_.push_back(input[0].mask);
+    legal_moves_.emplace_back();
+  }
+  void SetLegalMoves(const std::uint16_t* move_ids, int count) override {
+    legal_moves_.back().assign(move_ids, move_ids + count);
+  }
+  void ComputeBlocking() override {}
+  int GetBatchSize() const override { return masks_.size(); }
+  float GetQVal(int sample) const override { return masks_[sample]; }
+  float GetPVal(int sample, int move_id) const override {
+    const auto& moves = legal_moves_[sample];
+    if (!moves.empty() &&
+        std::find(moves.begin(), moves.end(), move_id) == moves.end()) {
+      return -1.0f;
+    }
+    return masks_[sample] + move_id;
+  }
+
+ private:
+  std::vector<std::uint64_t> masks_;
+  std::vector<std::vector<std::uint16_t>> legal_moves_;
+};
+
+class MaskNetwork : public Network {
+ public:
+  MaskNetwork(const Weights&, const OptionsDict&) {}
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<MaskComputation>();
+  }
+};
+
+REGISTER_NETWORK("mask", MaskNetwork, -1000);
+}  // namespace
+
+TEST(MuxingNetwork, SplitBatchesKeepTheirSamples) {
+  // Seven samples in slices of at most three: 3, 3 and a shorter last one.
+  const auto options = OptionsDict::FromString(
+      "split_batch=3, a(backend=mask,threads=2), b(backend=mask)");
+  auto network =
+      NetworkFactory::Get()->Create("multiplexing", Weights(), options);
+  auto computation = network->NewComputation();
+  for (int i = 0; i < 7; ++i) {
+    InputPlanes planes;
+    planes[0].mask = 10 * (i + 1);
+    computation->AddInput(std::move(planes));
+  }
+  computation->ComputeBlocking();
+  ASSERT_EQ(computation->GetBatchSize(), 7);
+  for (int i = 0; i < 7; ++i) {
+    EXPECT_EQ(computation->GetQVal(i), 10.0f * (i + 1));
+    EXPECT_EQ(computation->GetPVal(i, 3), 10.0f * (i + 1) + 3);
+  }
+  float pvals[2];
+  const std::uint16_t moves[] = {1, 2};
+  computation->GetPVals(6, moves, 2, pvals);
+  EXPECT_EQ(pvals[0], 71.0f);
+  EXPECT_EQ(pvals[1], 72.0f);
+}
+
+TEST(MuxingNetwork, SmallBatchesAreNotSplit) {
+  const auto options =
+      OptionsDict::FromString("split_batch=4, a(backend=mask)");
+  auto network =
+      NetworkFactory::Get()->Create("multiplexing", Weights(), options);
+  auto computation = network->NewComputation();
+  for (int i = 0; i < 4; ++i) {
+    InputPlanes planes;
+    planes[0].mask = i;
+    computation->AddInput(std::move(planes));
+  }
+  computation->ComputeBlocking();
+  for (int i = 0; i < 4; ++i) EXPECT_EQ(computation->GetQVal(i), i);
+}
+
+TEST(MuxingNetwork, LegalMovesStayWithTheirSamples) {
+  const auto options = OptionsDict::FromString(
+      "split_batch=2, a(backend=mask,threads=2), b(backend=mask)");
+  auto network =
+      NetworkFactory::Get()->Create("multiplexing", Weights(), options);
+  auto computation = network->NewComputation();
+  for (int i = 0; i < 5; ++i) {
+    InputPlanes planes;
+    planes[0].mask = 10 * (i + 1);
+    computation->AddInput(std::move(planes));
+    // Every other sample has its moves, i and i + 1.
+    const std::uint16_t moves[] = {static_cast<std::uint16_t>(i),
+                                   static_cast<std::uint16_t>(i + 1)};
+    if (i % 2 == 0) computation->SetLegalMoves(moves, 2);
+  }
+  computation->ComputeBlocking();
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(computation->GetPVal(i, i + 1), 10.0f * (i + 1) + i + 1);
+    EXPECT_EQ(computation->GetPVal(i, 100), i % 2 ? 10.0f * (i + 1) + 100
+                                                  : -1.0f);
+  }
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
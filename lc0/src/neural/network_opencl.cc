@@ -0,0 +1,251 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "neural/opencl/OpenCL.h"
+#include "neural/opencl/OpenCLParams.h"
+#include "utils/exception.h"
+#include "utils/trace.h"
+
+namespace lczero {
+namespace {
+
+const int kNumOutputPolicy = 1858;
+
+// F(2x2, 3x3) Winograd filter transformation,
+// transpose(G.dot(f).dot(G.transpose())). U is [xi][nu][channel][output], the
+// layout of the SGEMM, and padded with zeros to @outputs_pad and
+// @channels_pad as the tuned kernel needs.
+std::vector<float> WinogradTransformF(const std::vector<float>& f, int outputs,
+                                      int channels, int outputs_pad,
+                                      int channels_pad) {
+  std::vector<float> U(kWinogradTile * outputs_pad * channels_pad);
+  const std::array<float, 12> G = {1.0, 0.0,  0.0, 0.5, 0.5, 0.5,
+                                   0.5, -0.5, 0.5, 0.0, 0.0, 1.0};
+  std::array<float, 12> temp;
+
+  for (int o = 0; o < outputs; o++) {
+    for (int c = 0; c < channels; c++) {
+      for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 3; j++) {
+          float acc = 0.0f;
+          for (int k = 0; k < 3; k++) {
+            acc += G[i * 3 + k] * f[o * channels * 9 + c * 9 + k * 3 + j];
+          }
+          temp[i * 3 + j] = acc;
+        }
+      }
+
+      for (int xi = 0; xi < kWinogradAlpha; xi++) {
+        for (int nu = 0; nu < kWinogradAlpha; nu++) {
+          float acc = 0.0f;
+          for (int k = 0; k < 3; k++) {
+            acc += temp[xi * 3 + k] * G[nu * 3 + k];
+          }
+          U[xi * (kWinogradAlpha * outputs_pad * channels_pad) +
+            nu * (outputs_pad * channels_pad) + c * outputs_pad + o] = acc;
+        }
+      }
+    }
+  }
+  return U;
+}
+
+class OpenCLNetwork;
+
+class OpenCLComputation : public NetworkComputation {
+ public:
+  OpenCLComputation(const OpenCLNetwork* network) : network_(network) {}
+
+  void AddInput(InputPlanes&& input) override {
+    const InputPlanesRef planes = AddInputInPlace();
+    for (int i = 0; i < kInputPlanes; ++i) {
+      planes.masks[i] = input[i].mask;
+      planes.values[i] = input[i].value;
+    }
+  }
+
+  InputPlanesRef AddInputInPlace() override {
+    masks_.resize(masks_.size() + kInputPlanes);
+    values_.resize(values_.size() + kInputPlanes);
+    return {&masks_[masks_.size() - kInputPlanes],
+            &values_[values_.size() - kInputPlanes]};
+  }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return masks_.size() / kInputPlanes; }
+
+  float GetQVal(int sample) const override { return q_values_[sample]; }
+  float GetPVal(int sample, int move_id) const override {
+    return policy_[sample * kNumOutputPolicy + move_id];
+  }
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    const float* policy = &policy_[sample * kNumOutputPolicy];
+    for (int i = 0; i < count; ++i) out[i] = policy[move_ids[i]];
+  }
+
+ private:
+  const OpenCLNetwork* network_;
+  std::vector<std::uint64_t> masks_;
+  std::vector<float> values_;
+  std::vector<float> policy_;
+  // The output of the first value layer, then the Q values.
+  std::vector<float> value_hidden_;
+  std::vector<float> q_values_;
+};
+
+class OpenCLNetwork : public Network {
+ public:
+  OpenCLNetwork(const Weights& weights, const OptionsDict& options)
+      : weights_(weights), opencl_net_(opencl_) {
+    OpenCLParams params;
+    params.gpu_id = options.GetOrDefault<int>("gpu", -1);
+    params.max_batch_size = options.GetOrDefault<int>("batch_size", 16);
+    params.verbose = options.GetOrDefault<bool>("verbose", false);
+    params.force_tune = options.GetOrDefault<bool>("force_tune", false);
+    params.tune_exhaustive =
+        options.GetOrDefault<bool>("tune_exhaustive", false);
+    params.profile = options.GetOrDefault<bool>("profile", false);
+    params.profile_interval =
+        options.GetOrDefault<int>("profile_interval", 0);
+    if (params.max_batch_size < 1) {
+      throw Exception("OpenCL batch_size must be positive.");
+    }
+
+    const int channels = weights_.input.biases.size();
+    const int residual_blocks = weights_.residual.size();
+    const int pol_planes = weights_.policy.biases.size();
+    const int val_planes = weights_.value.biases.size();
+    const int value_hidden = weights_.ip1_val_b.size();
+    if (static_cast<int>(weights_.ip_pol_b.size()) != kNumOutputPolicy) {
+      throw Exception("Unexpected policy size of the network for OpenCL.");
+    }
+
+    FoldBatchNorm(&weights_.input);
+    for (auto& residual : weights_.residual) {
+      FoldBatchNorm(&residual.conv1);
+      FoldBatchNorm(&residual.conv2);
+    }
+    FoldBatchNorm(&weights_.policy);
+    FoldBatchNorm(&weights_.value);
+
+    opencl_.initialize(channels, params);
+
+    const auto tuners = opencl_.get_sgemm_tuners();
+    const auto mwg = tuners[0];
+    const auto kwg = tuners[2];
+    const auto vwm = tuners[3];
+    const int m_ceil = ceilMultiple(ceilMultiple(channels, mwg), vwm);
+    const int k_ceil_input =
+        ceilMultiple(ceilMultiple(kInputPlanes, kwg), vwm);
+    const int k_ceil = ceilMultiple(ceilMultiple(channels, kwg), vwm);
+
+    // Winograd filter transformation changes filter size to 4x4.
+    opencl_net_.push_input_convolution(
+        kWinogradAlpha, kInputPlanes, channels,
+        WinogradTransformF(weights_.input.weights, channels, kInputPlanes,
+                           m_ceil, k_ceil_input),
+        weights_.input.biases);
+
+    for (int i = 0; i < residual_blocks; i++) {
+      const auto& residual = weights_.residual[i];
+      opencl_net_.push_residual(
+          kWinogradAlpha, channels, channels,
+          WinogradTransformF(residual.conv1.weights, channels, channels,
+                             m_ceil, k_ceil),
+          residual.conv1.biases,
+          WinogradTransformF(residual.conv2.weights, channels, channels,
+                             m_ceil, k_ceil),
+          residual.conv2.biases);
+    }
+
+    opencl_net_.push_policy(channels, pol_planes, pol_planes * 8 * 8,
+                            kNumOutputPolicy, weights_.policy.weights,
+                            weights_.policy.biases, weights_.ip_pol_w,
+                            weights_.ip_pol_b);
+    opencl_net_.push_value(channels, val_planes, val_planes * 8 * 8,
+                           value_hidden, weights_.value.weights,
+                           weights_.value.biases, weights_.ip1_val_w,
+                           weights_.ip1_val_b);
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<OpenCLComputation>(this);
+  }
+
+  void Forward(const std::uint64_t* masks, const float* values,
+               float* output_pol, float* output_val, int batch_size) const {
+    opencl_net_.forward(masks, values, output_pol, output_val, batch_size);
+  }
+
+  // The last fully connected layer and tanh of the value head, which are too
+  // small to be worth a kernel.
+  float ValueOutput(const float* hidden) const {
+    const auto& w = weights_.ip2_val_w;
+    float sum = weights_.ip2_val_b[0];
+    for (size_t i = 0; i < w.size(); i++) sum += w[i] * hidden[i];
+    return std::tanh(sum);
+  }
+
+  int ValueHiddenSize() const { return weights_.ip1_val_b.size(); }
+
+ private:
+  Weights weights_;
+  OpenCL opencl_;
+  OpenCL_Network opencl_net_;
+};
+
+void OpenCLComputation::ComputeBlocking() {
+  TraceScope trace("opencl backend");
+  const int batch_size = GetBatchSize();
+  const int hidden = network_->ValueHiddenSize();
+  policy_.resize(batch_size * kNumOutputPolicy);
+  value_hidden_.resize(batch_size * hidden);
+  q_values_.resize(batch_size);
+  if (batch_size == 0) return;
+
+  network_->Forward(masks_.data(), values_.data(), policy_.data(),
+                    value_hidden_.data(), batch_size);
+
+  for (int i = 0; i < batch_size; i++) {
+    float* policy = &policy_[i * kNumOutputPolicy];
+    const float max = *std::max_element(policy, policy + kNumOutputPolicy);
+    float sum = 0.0f;
+    for (int j = 0; j < kNumOutputPolicy; j++) {
+      policy[j] = std::exp(policy[j] - max);
+      sum += policy[j];
+    }
+    for (int j = 0; j < kNumOutputPolicy; j++) policy[j] /= sum;
+    q_values_[i] = network_->ValueOutput(&value_hidden_[i * hidden]);
+  }
+}
+
+}  // namespace
+
+REGISTER_NETWORK("opencl", OpenCLNetwork, 102);
+
+}  // namespace lczero
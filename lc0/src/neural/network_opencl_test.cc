@@ -0,0 +1,126 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <memory>
+#include <random>
+#include "neural/factory.h"
+#include "utils/exception.h"
+
+namespace lczero {
+
+namespace {
+const int kNumOutputPolicy = 1858;
+
+// A small network of random weights, the shapes of the loader.
+Weights RandomWeights(int channels, int blocks) {
+  std::mt19937 gen(42);
+  auto random = [&gen](size_t size, float low, float high) {
+    std::uniform_real_distribution<float> dist(low, high);
+    Weights::Vec vec(size);
+    for (auto& x : vec) x = dist(gen);
+    return vec;
+  };
+  auto conv = [&random](int outputs, int inputs, int filter_size) {
+    Weights::ConvBlock block;
+    const float scale = 1.0f / std::sqrt(inputs * filter_size);
+    block.weights = random(outputs * inputs * filter_size, -scale, scale);
+    block.biases = random(outputs, -0.1f, 0.1f);
+    block.bn_means = random(outputs, -0.1f, 0.1f);
+    block.bn_stddivs = random(outputs, 0.5f, 1.5f);
+    return block;
+  };
+
+  const int pol_planes = 32;
+  const int val_planes = 32;
+  const int value_hidden = 128;
+  Weights weights;
+  weights.input = conv(channels, kInputPlanes, 9);
+  for (int i = 0; i < blocks; ++i) {
+    Weights::Residual residual;
+    residual.conv1 = conv(channels, channels, 9);
+    residual.conv2 = conv(channels, channels, 9);
+    weights.residual.emplace_back(std::move(residual));
+  }
+  weights.policy = conv(pol_planes, channels, 1);
+  weights.ip_pol_w = random(kNumOutputPolicy * pol_planes * 64, -0.02f, 0.02f);
+  weights.ip_pol_b = random(kNumOutputPolicy, -0.1f, 0.1f);
+  weights.value = conv(val_planes, channels, 1);
+  weights.ip1_val_w = random(value_hidden * val_planes * 64, -0.02f, 0.02f);
+  weights.ip1_val_b = random(value_hidden, -0.1f, 0.1f);
+  weights.ip2_val_w = random(value_hidden, -0.1f, 0.1f);
+  weights.ip2_val_b = random(1, -0.1f, 0.1f);
+  return weights;
+}
+
+// Planes of a made up position, different for every @seed.
+InputPlanes RandomPlanes(int seed) {
+  std::mt19937_64 gen(seed);
+  InputPlanes planes;
+  for (auto& plane : planes) {
+    plane.mask = gen() & gen();
+    plane.value = 1.0f;
+  }
+  planes[kInputPlanes - 1].Fill(1.0f);
+  planes[kInputPlanes - 3].Fill(0.25f);
+  return planes;
+}
+}  // namespace
+
+TEST(OpenCLNetwork, MatchesBlas) {
+  const Weights weights = RandomWeights(16, 2);
+  std::unique_ptr<Network> opencl;
+  try {
+    opencl = NetworkFactory::Get()->Create("opencl", weights, OptionsDict());
+  } catch (const Exception& e) {
+    // Built with OpenCL, but the machine has no device.
+    std::cerr << e.what() << std::endl;
+    return;
+  }
+  auto blas = NetworkFactory::Get()->Create("blas", weights, OptionsDict());
+
+  // More than fits into one batch of the OpenCL backend.
+  const int kBatchSize = 20;
+  auto expected = blas->NewComputation();
+  auto actual = opencl->NewComputation();
+  for (int i = 0; i < kBatchSize; ++i) {
+    expected->AddInput(RandomPlanes(i));
+    actual->AddInput(RandomPlanes(i));
+  }
+  expected->ComputeBlocking();
+  actual->ComputeBlocking();
+
+  for (int i = 0; i < kBatchSize; ++i) {
+    EXPECT_NEAR(actual->GetQVal(i), expected->GetQVal(i), 1e-3f)
+        << "sample " << i;
+    for (int move = 0; move < kNumOutputPolicy; ++move) {
+      ASSERT_NEAR(actual->GetPVal(i, move), expected->GetPVal(i, move),
+                  1e-6f + 1e-2f * expected->GetPVal(i, move))
+          << "sample " << i << " move " << move;
+    }
+  }
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
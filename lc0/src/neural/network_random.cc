@@ -16,17 +16,44 @@
   along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <chrono>
 #include <functional>
+#include <mutex>
 #include <thread>
 #include "neural/factory.h"
 #include "utils/hashcat.h"
+#include "utils/random.h"
+#include "utils/trace.h"
 
 namespace lczero {
 
+// Simulated computation time: per batch plus per sample, with random jitter.
+// With a queue, computations take turns on one simulated device the way they
+// would on a GPU, otherwise any number of them run at once.
+struct RandomNetworkLatency {
+  std::chrono::microseconds per_batch{0};
+  std::chrono::microseconds per_sample{0};
+  // Up to that much is added or removed at random.
+  std::chrono::microseconds jitter{0};
+  bool queue = false;
+  // Busy waits instead of sleeping, to take a core like a backend which
+  // polls the device.
+  bool spin = false;
+};
+
+// The simulated device of a queue.
+struct RandomNetworkDevice {
+  std::mutex mutex;
+  // When the computations queued so far are done.
+  std::chrono::steady_clock::time_point free_at;
+};
+
 class RandomNetworkComputation : public NetworkComputation {
  public:
-  RandomNetworkComputation(int delay) : delay_ms_(delay) {}
+  RandomNetworkComputation(const RandomNetworkLatency& latency,
+                           RandomNetworkDevice* device)
+      : latency_(latency), device_(device) {}
   void AddInput(InputPlanes&& input) override {
     std::uint64_t hash = 0;
     for (const auto& plane : input) {
@@ -35,8 +62,25 @@ class RandomNetworkComputation : public NetworkComputation {
     inputs_.push_back(hash);
   }
   void ComputeBlocking() override {
-    if (delay_ms_) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
+    TraceScope trace("random backend");
+    auto duration = latency_.per_batch + latency_.per_sample * inputs_.size();
+    if (latency_.jitter.count() > 0) {
+      duration += std::chrono::microseconds(Random::Get().GetInt(
+          -latency_.jitter.count(), latency_.jitter.count()));
+    }
+    if (duration.count() <= 0) return;
+
+    auto done = std::chrono::steady_clock::now() + duration;
+    if (latency_.queue) {
+      std::lock_guard<std::mutex> lock(device_->mutex);
+      done = std::max(done, device_->free_at + duration);
+      device_->free_at = done;
+    }
+    if (latency_.spin) {
+      while (std::chrono::steady_clock::now() < done) {
+      }
+    } else {
+      std::this_thread::sleep_until(done);
     }
   }
 
@@ -52,19 +96,37 @@ class RandomNetworkComputation : public NetworkComputation {
 
  private:
   std::vector<std::uint64_t> inputs_;
-  int delay_ms_ = 0;
+  const RandomNetworkLatency& latency_;
+  RandomNetworkDevice* const device_;
 };
 
+// Options:
+//   delay: milliseconds per batch,
+//   delay_us: microseconds per batch, added to delay,
+//   sample_us: microseconds per sample,
+//   jitter_us: up to that many microseconds added or removed at random,
+//   queue: whether batches wait for each other,
+//   spin: whether to busy wait rather than sleep.
 class RandomNetwork : public Network {
  public:
-  RandomNetwork(const Weights& weights, const OptionsDict& options)
-      : delay_ms_(options.GetOrDefault<int>("delay", 0)) {}
+  RandomNetwork(const Weights& weights, const OptionsDict& options) {
+    latency_.per_batch =
+        std::chrono::milliseconds(options.GetOrDefault<int>("delay", 0)) +
+        std::chrono::microseconds(options.GetOrDefault<int>("delay_us", 0));
+    latency_.per_sample =
+        std::chrono::microseconds(options.GetOrDefault<int>("sample_us", 0));
+    latency_.jitter =
+        std::chrono::microseconds(options.GetOrDefault<int>("jitter_us", 0));
+    latency_.queue = options.GetOrDefault<bool>("queue", false);
+    latency_.spin = options.GetOrDefault<bool>("spin", false);
+  }
   std::unique_ptr<NetworkComputation> NewComputation() override {
-    return std::make_unique<RandomNetworkComputation>(delay_ms_);
+    return std::make_unique<RandomNetworkComputation>(latency_, &device_);
   }
 
  private:
-  int delay_ms_ = 0;
+  RandomNetworkLatency latency_;
+  RandomNetworkDevice device_;
 };
 
 REGISTER_NETWORK("random", RandomNetwork, -900);
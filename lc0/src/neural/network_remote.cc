@@ -0,0 +1,145 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "neural/factory.h"
+#include "neural/remote.h"
+#include "utils/exception.h"
+#include "utils/fp16_utils.h"
+#include "utils/trace.h"
+
+namespace lczero {
+
+class RemoteNetwork;
+
+class RemoteComputation : public NetworkComputation {
+ public:
+  explicit RemoteComputation(RemoteNetwork* network) : network_(network) {}
+
+  void AddInput(InputPlanes&& input) override {
+    for (const auto& plane : input) {
+      masks_.push_back(plane.mask);
+      values_.push_back(plane.value);
+    }
+  }
+  void ComputeBlocking() override;
+  int GetBatchSize() const override { return masks_.size() / kInputPlanes; }
+  float GetQVal(int sample) const override { return q_[sample]; }
+  float GetPVal(int sample, int move_id) const override {
+    return FP16toFP32(policy_[sample * kRemotePolicySize + move_id]);
+  }
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    const uint16_t* policy = &policy_[sample * kRemotePolicySize];
+    for (int i = 0; i < count; ++i) out[i] = FP16toFP32(policy[move_ids[i]]);
+  }
+
+ private:
+  RemoteNetwork* const network_;
+  std::vector<uint64_t> masks_;
+  std::vector<float> values_;
+  std::vector<float> q_;
+  std::vector<uint16_t> policy_;
+};
+
+// Computes on a server started with "lc0 serve", which has the network on
+// its GPUs. Computations in flight at the same time go over connections of
+// their own, so the server computes them at the same time too.
+// Options:
+//   host: of the server, localhost by default,
+//   port: of the server, 9790 by default.
+class RemoteNetwork : public Network {
+ public:
+  RemoteNetwork(const Weights& weights, const OptionsDict& options)
+      : host_(options.GetOrDefault<std::string>("host", "localhost")),
+        port_(options.GetOrDefault<int>("port", 9790)),
+        weights_hash_(HashWeights(weights)) {
+    // Fails early for a wrong address or network.
+    ReleaseSocket(AcquireSocket());
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<RemoteComputation>(this);
+  }
+
+  // An idle connection, or a new one.
+  Socket AcquireSocket() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        Socket socket = std::move(idle_.back());
+        idle_.pop_back();
+        return socket;
+      }
+    }
+    Socket socket = Socket::Connect(host_, port_);
+    RemoteHello hello;
+    if (!socket.RecvAll(&hello, sizeof(hello)) ||
+        hello.magic != kRemoteMagic || hello.version != kRemoteVersion) {
+      throw Exception("No lc0 server of this version at " + host_ + ":" +
+                      std::to_string(port_));
+    }
+    if (hello.weights_hash != weights_hash_) {
+      throw Exception("The server at " + host_ + ":" + std::to_string(port_) +
+                      " has another network");
+    }
+    return socket;
+  }
+
+  void ReleaseSocket(Socket socket) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(std::move(socket));
+  }
+
+ private:
+  const std::string host_;
+  const int port_;
+  const uint64_t weights_hash_;
+  std::mutex mutex_;
+  std::vector<Socket> idle_;
+};
+
+void RemoteComputation::ComputeBlocking() {
+  TraceScope trace("remote backend");
+  const int batch_size = GetBatchSize();
+  if (batch_size == 0) return;
+  Socket socket = network_->AcquireSocket();
+
+  RemoteBatchHeader header{kRemoteMagic, static_cast<uint32_t>(batch_size)};
+  socket.SendAll(&header, sizeof(header));
+  socket.SendAll(masks_.data(), masks_.size() * sizeof(masks_[0]));
+  socket.SendAll(values_.data(), values_.size() * sizeof(values_[0]));
+
+  q_.resize(batch_size);
+  policy_.resize(batch_size * kRemotePolicySize);
+  if (!socket.RecvAll(&header, sizeof(header)) ||
+      header.magic != kRemoteMagic ||
+      header.batch_size != static_cast<uint32_t>(batch_size) ||
+      !socket.RecvAll(q_.data(), q_.size() * sizeof(q_[0])) ||
+      !socket.RecvAll(policy_.data(), policy_.size() * sizeof(policy_[0]))) {
+    throw Exception("Bad response from the lc0 server");
+  }
+  // Only a connection which is in sync goes back, so errors close theirs.
+  network_->ReleaseSocket(std::move(socket));
+}
+
+REGISTER_NETWORK("remote", RemoteNetwork, -950);
+
+}  // namespace lczero
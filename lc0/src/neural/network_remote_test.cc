@@ -0,0 +1,134 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <thread>
+#include "neural/factory.h"
+#include "neural/remote.h"
+#include "neural/server.h"
+#include "utils/exception.h"
+
+namespace lczero {
+
+namespace {
+// Q of a sample is the number of squares of its first plane plus the value
+// of that plane, and P of a move its id times the value of the second plane.
+// The values are chosen to survive the fp16 policy of the protocol.
+class EchoComputation : public NetworkComputation {
+ public:
+  void AddInput(InputPlanes&& input) override {
+    inputs_.emplace_back(std::move(input));
+  }
+  void ComputeBlocking() override {}
+  int GetBatchSize() const override { return inputs_.size(); }
+  float GetQVal(int sample) const override {
+    const auto& plane = inputs_[sample][0];
+    int squares = 0;
+    for (auto mask = plane.mask; mask; mask &= mask - 1) ++squares;
+    return squares + plane.value;
+  }
+  float GetPVal(int sample, int move_id) const override {
+    return move_id * inputs_[sample][1].value;
+  }
+
+ private:
+  std::vector<InputPlanes> inputs_;
+};
+
+class EchoNetwork : public Network {
+ public:
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<EchoComputation>();
+  }
+};
+
+InputPlanes Input(uint64_t mask, float value, float policy_scale) {
+  InputPlanes input;
+  input[0].mask = mask;
+  input[0].value = value;
+  input[1].mask = ~0ULL;
+  input[1].value = policy_scale;
+  return input;
+}
+
+// Serves @network to one client on a free port of localhost.
+class LoopbackServer {
+ public:
+  LoopbackServer(Network* network, uint64_t weights_hash)
+      : listener_(Socket::Listen(0)),
+        thread_([this, network, weights_hash]() {
+          ServeRemoteConnection(network, weights_hash, listener_.Accept());
+        }) {}
+  ~LoopbackServer() { thread_.join(); }
+
+  OptionsDict ClientOptions() const {
+    OptionsDict options;
+    options.Set<std::string>("host", "localhost");
+    options.Set<int>("port", listener_.GetPort());
+    return options;
+  }
+
+ private:
+  Socket listener_;
+  std::thread thread_;
+};
+}  // namespace
+
+TEST(RemoteNetwork, ComputesOnTheServer) {
+  const Weights weights;
+  EchoNetwork served;
+  LoopbackServer server(&served, HashWeights(weights));
+  auto network =
+      NetworkFactory::Get()->Create("remote", weights, server.ClientOptions());
+
+  // Two batches over the same connection.
+  for (int round = 0; round < 2; ++round) {
+    auto computation = network->NewComputation();
+    computation->AddInput(Input(0xff, 0.25f, 1.0f));
+    computation->AddInput(Input(0x1, 0.5f + round, 0.5f));
+    computation->ComputeBlocking();
+    ASSERT_EQ(computation->GetBatchSize(), 2);
+    EXPECT_EQ(computation->GetQVal(0), 8.25f);
+    EXPECT_EQ(computation->GetQVal(1), 1.5f + round);
+    EXPECT_EQ(computation->GetPVal(0, 1857), 1857.0f);
+    EXPECT_EQ(computation->GetPVal(1, 3), 1.5f);
+    const uint16_t move_ids[] = {0, 10, 1001};
+    float policy[3];
+    computation->GetPVals(1, move_ids, 3, policy);
+    EXPECT_EQ(policy[0], 0.0f);
+    EXPECT_EQ(policy[1], 5.0f);
+    EXPECT_EQ(policy[2], 500.5f);
+  }
+}
+
+TEST(RemoteNetwork, RefusesAServerWithOtherWeights) {
+  Weights weights;
+  EchoNetwork served;
+  LoopbackServer server(&served, HashWeights(weights));
+  weights.ip2_val_b.push_back(1.0f);
+  EXPECT_THROW(
+      NetworkFactory::Get()->Create("remote", weights, server.ClientOptions()),
+      Exception);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
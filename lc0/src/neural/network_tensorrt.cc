@@ -0,0 +1,704 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The network as a TensorRT engine. TensorRT fuses the layers (convolution,
+// bias, ReLU and the residual add into one kernel) and picks the kernels for
+// each batch size profile, in fp32, fp16 or int8.
+//
+// Building an engine takes minutes, so built engines are kept in files named
+// after a hash of the weights and what else the engine depends on (GPU,
+// TensorRT version, precision, profiles), and loaded from there next time.
+// For int8, the calibration on positions of random games is kept in a file
+// as well.
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "chess/board.h"
+#include "chess/position.h"
+#include "neural/encoder.h"
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "utils/bititer.h"
+#include "utils/exception.h"
+#include "utils/hashcat.h"
+#include "utils/string.h"
+#include "utils/trace.h"
+
+#include <NvInfer.h>
+#include <cuda_runtime_api.h>
+
+namespace lczero {
+namespace {
+
+void cudaError(cudaError_t status, const char* file, const int& line) {
+  if (status != cudaSuccess) {
+    char message[128];
+    sprintf(message, "CUDA error: %s (%s:%d) ", cudaGetErrorString(status),
+            file, line);
+    throw Exception(message);
+  }
+}
+
+#define reportCUDAErrors(status) cudaError(status, __FILE__, __LINE__)
+
+// Largest batch of any profile, as in the cudnn backend.
+static constexpr int kMaxBatchSize = 1024;
+static constexpr int kNumOutputPolicy = 1858;
+static constexpr int kInputSize = kInputPlanes * 8 * 8;
+
+static constexpr const char* kInputName = "input";
+static constexpr const char* kPolicyName = "policy";
+static constexpr const char* kValueName = "value";
+
+class Logger : public nvinfer1::ILogger {
+  void log(Severity severity, const char* msg) override {
+    if (severity <= Severity::kWARNING) {
+      std::cerr << "TensorRT: " << msg << std::endl;
+    }
+  }
+};
+
+Logger& GetLogger() {
+  static Logger logger;
+  return logger;
+}
+
+// TensorRT objects are released with destroy().
+struct TrtDeleter {
+  template <typename T>
+  void operator()(T* object) const {
+    if (object) object->destroy();
+  }
+};
+template <typename T>
+using TrtPtr = std::unique_ptr<T, TrtDeleter>;
+
+enum class Precision { kFp32, kFp16, kInt8 };
+
+Precision ParsePrecision(const std::string& precision) {
+  if (precision == "fp32") return Precision::kFp32;
+  if (precision == "fp16") return Precision::kFp16;
+  if (precision == "int8") return Precision::kInt8;
+  throw Exception("Unknown TensorRT precision: " + precision);
+}
+
+uint64_t HashWeights(uint64_t hash, const Weights::Vec& vec) {
+  hash = HashCat(hash, vec.size());
+  for (float value : vec) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    hash = HashCat(hash, bits);
+  }
+  return hash;
+}
+
+uint64_t HashWeights(uint64_t hash, const Weights::ConvBlock& block) {
+  hash = HashWeights(hash, block.weights);
+  hash = HashWeights(hash, block.biases);
+  hash = HashWeights(hash, block.bn_means);
+  return HashWeights(hash, block.bn_stddivs);
+}
+
+// Stands in for the sha of the network, which the weights don't carry.
+uint64_t HashWeights(const Weights& weights) {
+  uint64_t hash = HashWeights(0, weights.input);
+  for (const auto& residual : weights.residual) {
+    hash = HashWeights(hash, residual.conv1);
+    hash = HashWeights(hash, residual.conv2);
+  }
+  hash = HashWeights(hash, weights.policy);
+  hash = HashWeights(hash, weights.ip_pol_w);
+  hash = HashWeights(hash, weights.ip_pol_b);
+  hash = HashWeights(hash, weights.value);
+  hash = HashWeights(hash, weights.ip1_val_w);
+  hash = HashWeights(hash, weights.ip1_val_b);
+  hash = HashWeights(hash, weights.ip2_val_w);
+  return HashWeights(hash, weights.ip2_val_b);
+}
+
+std::string HexHash(uint64_t hash) {
+  char hex[17];
+  sprintf(hex, "%016llx", static_cast<unsigned long long>(hash));
+  return hex;
+}
+
+bool ReadFile(const std::string& path, std::vector<char>* data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) return false;
+  data->assign(std::istreambuf_iterator<char>(file),
+               std::istreambuf_iterator<char>());
+  return !data->empty();
+}
+
+void WriteFile(const std::string& path, const void* data, size_t size) {
+  std::ofstream file(path, std::ios::binary);
+  file.write(static_cast<const char*>(data), size);
+  if (file.fail()) {
+    std::cerr << "Could not save " << path << std::endl;
+  }
+}
+
+// Writes the planes of @batch_size samples as the network input, NCHW.
+void ExpandPlanes(float* output, const uint64_t* masks, const float* values,
+                  int batch_size) {
+  std::fill(output, output + batch_size * kInputSize, 0.0f);
+  for (int i = 0; i < batch_size * kInputPlanes; ++i) {
+    for (auto bit : IterateBits(masks[i])) output[i * 64 + bit] = values[i];
+  }
+}
+
+// Feeds TensorRT positions of random games to find the int8 ranges of the
+// activations. The result is kept in the calibration cache, and the
+// positions are only played out if there is none.
+class Calibrator : public nvinfer1::IInt8EntropyCalibrator2 {
+ public:
+  static constexpr int kBatchSize = 64;
+
+  Calibrator(const std::string& cache_path, int batches)
+      : cache_path_(cache_path), batches_(batches) {
+    reportCUDAErrors(
+        cudaMalloc(&input_mem_, kBatchSize * kInputSize * sizeof(float)));
+  }
+  ~Calibrator() { cudaFree(input_mem_); }
+
+  int getBatchSize() const override { return kBatchSize; }
+
+  bool getBatch(void* bindings[], const char* names[],
+                int nbBindings) override {
+    if (batch_ == batches_) return false;
+    if (batch_ == 0) PlayGames();
+    const float* input = &inputs_[batch_ * kBatchSize * kInputSize];
+    reportCUDAErrors(cudaMemcpy(input_mem_, input,
+                                kBatchSize * kInputSize * sizeof(float),
+                                cudaMemcpyHostToDevice));
+    bindings[0] = input_mem_;
+    batch_++;
+    return true;
+  }
+
+  const void* readCalibrationCache(size_t& length) override {
+    if (!ReadFile(cache_path_, &cache_)) return nullptr;
+    length = cache_.size();
+    return cache_.data();
+  }
+
+  void writeCalibrationCache(const void* cache, size_t length) override {
+    WriteFile(cache_path_, cache, length);
+  }
+
+ private:
+  // Samples positions of games of random moves, up to 60 plies into each.
+  void PlayGames() {
+    std::mt19937 rng(0);
+    const int samples = batches_ * kBatchSize;
+    std::vector<uint64_t> masks(samples * kInputPlanes);
+    std::vector<float> values(samples * kInputPlanes);
+    ChessBoard start;
+    start.SetFromFen(ChessBoard::kStartingFen);
+    PositionHistory history;
+    for (int i = 0; i < samples; ++i) {
+      if (i % 8 == 0) history.Reset(start, 0, 1);
+      const int plies = std::uniform_int_distribution<int>(1, 8)(rng);
+      for (int ply = 0; ply < plies; ++ply) {
+        if (history.ComputeGameResult() != GameResult::UNDECIDED) break;
+        const auto moves = history.Last().GetBoard().GenerateLegalMoves();
+        history.Append(moves[std::uniform_int_distribution<int>(
+            0, moves.size() - 1)(rng)]);
+      }
+      EncodePositionForNN(history, {&masks[i * kInputPlanes],
+                                    &values[i * kInputPlanes]});
+    }
+    inputs_.resize(samples * kInputSize);
+    ExpandPlanes(inputs_.data(), masks.data(), values.data(), samples);
+  }
+
+  const std::string cache_path_;
+  const int batches_;
+  int batch_ = 0;
+  std::vector<float> inputs_;
+  std::vector<char> cache_;
+  void* input_mem_;
+};
+
+// Host memory of a computation. The planes are expanded into the pinned
+// input, from where they go to the GPU in one copy.
+struct InputsOutputs {
+  InputsOutputs()
+      : input_masks_(kMaxBatchSize * kInputPlanes),
+        input_values_(kMaxBatchSize * kInputPlanes) {
+    reportCUDAErrors(cudaHostAlloc(&input_mem_,
+                                   kMaxBatchSize * kInputSize * sizeof(float),
+                                   cudaHostAllocDefault));
+    reportCUDAErrors(cudaHostAlloc(
+        &op_policy_mem_, kMaxBatchSize * kNumOutputPolicy * sizeof(float),
+        cudaHostAllocDefault));
+    reportCUDAErrors(cudaHostAlloc(
+        &op_value_mem_, kMaxBatchSize * sizeof(float), cudaHostAllocDefault));
+  }
+  ~InputsOutputs() {
+    reportCUDAErrors(cudaFreeHost(input_mem_));
+    reportCUDAErrors(cudaFreeHost(op_policy_mem_));
+    reportCUDAErrors(cudaFreeHost(op_value_mem_));
+  }
+  std::vector<uint64_t> input_masks_;
+  std::vector<float> input_values_;
+  float* input_mem_;
+  float* op_policy_mem_;
+  float* op_value_mem_;
+};
+
+// A stream with the device memory of one computation, and a TensorRT
+// context for each batch size profile. A profile can only be used by one
+// context, so the engine has the profiles once for each stream. Only one
+// context of a stream runs at a time, so they share one buffer for their
+// activations, of the size the largest profile needs.
+struct ExecutionContext {
+  ExecutionContext(size_t scratch_size) {
+    reportCUDAErrors(cudaStreamCreate(&stream));
+    reportCUDAErrors(
+        cudaMalloc(&scratch_mem, std::max<size_t>(scratch_size, 1)));
+    reportCUDAErrors(
+        cudaMalloc(&input_mem, kMaxBatchSize * kInputSize * sizeof(float)));
+    reportCUDAErrors(cudaMalloc(
+        &op_policy_mem, kMaxBatchSize * kNumOutputPolicy * sizeof(float)));
+    reportCUDAErrors(cudaMalloc(&op_value_mem, kMaxBatchSize * sizeof(float)));
+  }
+  ~ExecutionContext() {
+    contexts.clear();
+    reportCUDAErrors(cudaFree(input_mem));
+    reportCUDAErrors(cudaFree(op_policy_mem));
+    reportCUDAErrors(cudaFree(op_value_mem));
+    reportCUDAErrors(cudaFree(scratch_mem));
+    cudaStreamDestroy(stream);
+  }
+
+  cudaStream_t stream;
+  void* scratch_mem;
+  float* input_mem;
+  float* op_policy_mem;
+  float* op_value_mem;
+  std::vector<TrtPtr<nvinfer1::IExecutionContext>> contexts;
+};
+
+class TensorRTNetwork;
+
+class TensorRTNetworkComputation : public NetworkComputation {
+ public:
+  TensorRTNetworkComputation(TensorRTNetwork* network);
+  ~TensorRTNetworkComputation();
+
+  void AddInput(InputPlanes&& input) override {
+    const InputPlanesRef planes = AddInputInPlace();
+    for (int i = 0; i < kInputPlanes; ++i) {
+      planes.masks[i] = input[i].mask;
+      planes.values[i] = input[i].value;
+    }
+  }
+
+  InputPlanesRef AddInputInPlace() override {
+    const InputPlanesRef planes{
+        &inputs_outputs_->input_masks_[batch_size_ * kInputPlanes],
+        &inputs_outputs_->input_values_[batch_size_ * kInputPlanes]};
+    batch_size_++;
+    return planes;
+  }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  float GetQVal(int sample) const override {
+    return inputs_outputs_->op_value_mem_[sample];
+  }
+  float GetPVal(int sample, int move_id) const override {
+    return inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy + move_id];
+  }
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    const float* policy =
+        &inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy];
+    for (int i = 0; i < count; ++i) out[i] = policy[move_ids[i]];
+  }
+
+ private:
+  std::unique_ptr<InputsOutputs> inputs_outputs_;
+  int batch_size_ = 0;
+  TensorRTNetwork* network_;
+};
+
+class TensorRTNetwork : public Network {
+ public:
+  TensorRTNetwork(const Weights& weights, const OptionsDict& options) {
+    gpu_id_ = options.GetOrDefault<int>("gpu", 0);
+    const Precision precision =
+        ParsePrecision(options.GetOrDefault<std::string>("precision", "fp16"));
+    // A batch runs with the profile of the smallest of these which is at
+    // least its size.
+    batch_sizes_ = ParseIntList(options.GetOrDefault<std::string>(
+        "batch_sizes", "1,8,32,128,512,1024"));
+    std::sort(batch_sizes_.begin(), batch_sizes_.end());
+    if (batch_sizes_.empty() || batch_sizes_.front() < 1 ||
+        batch_sizes_.back() > kMaxBatchSize) {
+      throw Exception("TensorRT batch_sizes must be within 1 and " +
+                      std::to_string(kMaxBatchSize));
+    }
+    const int streams = std::max(options.GetOrDefault<int>("streams", 2), 1);
+
+    int total_gpus;
+    reportCUDAErrors(cudaGetDeviceCount(&total_gpus));
+    if (gpu_id_ >= total_gpus) {
+      throw Exception("Invalid GPU Id: " + std::to_string(gpu_id_));
+    }
+    reportCUDAErrors(cudaSetDevice(gpu_id_));
+
+    // Everything the engine depends on goes into its file name.
+    cudaDeviceProp prop;
+    reportCUDAErrors(cudaGetDeviceProperties(&prop, gpu_id_));
+    const uint64_t weights_hash = HashWeights(weights);
+    uint64_t key = HashCat({weights_hash, static_cast<uint64_t>(precision),
+                            static_cast<uint64_t>(streams),
+                            static_cast<uint64_t>(getInferLibVersion()),
+                            static_cast<uint64_t>(prop.major),
+                            static_cast<uint64_t>(prop.minor)});
+    for (const char* c = prop.name; *c; ++c) key = HashCat(key, *c);
+    for (int size : batch_sizes_) key = HashCat(key, size);
+    const std::string prefix =
+        options.GetOrDefault<std::string>("engine_cache", "lc0_tensorrt");
+    const std::string engine_path = prefix + "_" + HexHash(key) + ".engine";
+
+    runtime_.reset(nvinfer1::createInferRuntime(GetLogger()));
+    std::vector<char> serialized;
+    if (ReadFile(engine_path, &serialized)) {
+      engine_.reset(runtime_->deserializeCudaEngine(
+          serialized.data(), serialized.size(), nullptr));
+      if (!engine_) {
+        std::cerr << "Rebuilding the TensorRT engine " << engine_path
+                  << std::endl;
+      }
+    }
+    if (!engine_) {
+      const std::string calibration_path =
+          prefix + "_" + HexHash(weights_hash) + ".calibration";
+      BuildEngine(weights, options, precision, streams, calibration_path);
+      TrtPtr<nvinfer1::IHostMemory> memory(engine_->serialize());
+      WriteFile(engine_path, memory->data(), memory->size());
+    }
+
+    // Bindings come once for each profile: input, policy and value.
+    const int profiles = engine_->getNbOptimizationProfiles();
+    if (profiles != streams * static_cast<int>(batch_sizes_.size())) {
+      throw Exception("TensorRT engine has unexpected profiles");
+    }
+    bindings_per_profile_ = engine_->getNbBindings() / profiles;
+    input_binding_ = engine_->getBindingIndex(kInputName);
+    policy_binding_ = engine_->getBindingIndex(kPolicyName);
+    value_binding_ = engine_->getBindingIndex(kValueName);
+
+    // What the context of any profile needs.
+    const size_t scratch_size = engine_->getDeviceMemorySize();
+    for (int s = 0; s < streams; ++s) {
+      auto ctx = std::make_unique<ExecutionContext>(scratch_size);
+      for (size_t i = 0; i < batch_sizes_.size(); ++i) {
+        TrtPtr<nvinfer1::IExecutionContext> context(
+            engine_->createExecutionContextWithoutDeviceMemory());
+        if (!context ||
+            !context->setOptimizationProfile(s * batch_sizes_.size() + i)) {
+          throw Exception("Could not create a TensorRT context");
+        }
+        context->setDeviceMemory(ctx->scratch_mem);
+        ctx->contexts.emplace_back(std::move(context));
+      }
+      free_contexts_.push_back(ctx.get());
+      contexts_.emplace_back(std::move(ctx));
+    }
+  }
+
+  ~TensorRTNetwork() {
+    // Before the engine they were created from.
+    contexts_.clear();
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    reportCUDAErrors(cudaSetDevice(gpu_id_));
+    return std::make_unique<TensorRTNetworkComputation>(this);
+  }
+  void InitThread() override { reportCUDAErrors(cudaSetDevice(gpu_id_)); }
+
+  void forwardEval(InputsOutputs* io, int batch_size) {
+    ExpandPlanes(io->input_mem_, io->input_masks_.data(),
+                 io->input_values_.data(), batch_size);
+
+    ExecutionContext* ctx = AcquireContext();
+    const int profile = std::lower_bound(batch_sizes_.begin(),
+                                         batch_sizes_.end(), batch_size) -
+                        batch_sizes_.begin();
+    if (profile == static_cast<int>(batch_sizes_.size())) {
+      ReleaseContext(ctx);
+      throw Exception("Batch of " + std::to_string(batch_size) +
+                      " is larger than the TensorRT profiles");
+    }
+    nvinfer1::IExecutionContext* context = ctx->contexts[profile].get();
+    const int offset = context->getOptimizationProfile() *
+                       bindings_per_profile_;
+    std::vector<void*> bindings(engine_->getNbBindings(), nullptr);
+    bindings[offset + input_binding_] = ctx->input_mem;
+    bindings[offset + policy_binding_] = ctx->op_policy_mem;
+    bindings[offset + value_binding_] = ctx->op_value_mem;
+
+    reportCUDAErrors(cudaMemcpyAsync(
+        ctx->input_mem, io->input_mem_, batch_size * kInputSize * sizeof(float),
+        cudaMemcpyHostToDevice, ctx->stream));
+    context->setBindingDimensions(
+        offset + input_binding_,
+        nvinfer1::Dims4(batch_size, kInputPlanes, 8, 8));
+    if (!context->enqueueV2(bindings.data(), ctx->stream, nullptr)) {
+      ReleaseContext(ctx);
+      throw Exception("TensorRT engine failed to run");
+    }
+    reportCUDAErrors(cudaMemcpyAsync(
+        io->op_policy_mem_, ctx->op_policy_mem,
+        batch_size * kNumOutputPolicy * sizeof(float), cudaMemcpyDeviceToHost,
+        ctx->stream));
+    reportCUDAErrors(cudaMemcpyAsync(io->op_value_mem_, ctx->op_value_mem,
+                                     batch_size * sizeof(float),
+                                     cudaMemcpyDeviceToHost, ctx->stream));
+    reportCUDAErrors(cudaStreamSynchronize(ctx->stream));
+    ReleaseContext(ctx);
+  }
+
+  std::unique_ptr<InputsOutputs> GetInputsOutputs() {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    if (free_inputs_outputs_.empty()) return std::make_unique<InputsOutputs>();
+    std::unique_ptr<InputsOutputs> resource =
+        std::move(free_inputs_outputs_.front());
+    free_inputs_outputs_.pop_front();
+    return resource;
+  }
+
+  void ReleaseInputsOutputs(std::unique_ptr<InputsOutputs> resource) {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    free_inputs_outputs_.push_back(std::move(resource));
+  }
+
+ private:
+  void BuildEngine(Weights weights, const OptionsDict& options,
+                   Precision precision, int streams,
+                   const std::string& calibration_path) {
+    TrtPtr<nvinfer1::IBuilder> builder(
+        nvinfer1::createInferBuilder(GetLogger()));
+    TrtPtr<nvinfer1::INetworkDefinition> network(builder->createNetworkV2(
+        1U << static_cast<uint32_t>(
+            nvinfer1::NetworkDefinitionCreationFlag::kEXPLICIT_BATCH)));
+    TrtPtr<nvinfer1::IBuilderConfig> config(builder->createBuilderConfig());
+
+    // The folded weights have to live until the engine is built.
+    FoldBatchNorm(&weights.input);
+    for (auto& residual : weights.residual) {
+      FoldBatchNorm(&residual.conv1);
+      FoldBatchNorm(&residual.conv2);
+    }
+    FoldBatchNorm(&weights.policy);
+    FoldBatchNorm(&weights.value);
+    DefineNetwork(network.get(), weights);
+
+    config->setMaxWorkspaceSize(
+        static_cast<size_t>(options.GetOrDefault<int>("workspace_mb", 1024))
+        << 20);
+    if (precision != Precision::kFp32) {
+      if (!builder->platformHasFastFp16()) {
+        std::cerr << "WARNING: the GPU has no fast fp16" << std::endl;
+      }
+      // Also what int8 falls back to for layers without int8 kernels.
+      config->setFlag(nvinfer1::BuilderFlag::kFP16);
+    }
+
+    for (int s = 0; s < streams; ++s) {
+      int min_batch = 1;
+      for (int size : batch_sizes_) {
+        nvinfer1::IOptimizationProfile* profile =
+            builder->createOptimizationProfile();
+        profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kMIN,
+                               nvinfer1::Dims4(min_batch, kInputPlanes, 8, 8));
+        profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kOPT,
+                               nvinfer1::Dims4(size, kInputPlanes, 8, 8));
+        profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kMAX,
+                               nvinfer1::Dims4(size, kInputPlanes, 8, 8));
+        config->addOptimizationProfile(profile);
+        min_batch = size + 1;
+      }
+    }
+
+    std::unique_ptr<Calibrator> calibrator;
+    if (precision == Precision::kInt8) {
+      if (!builder->platformHasFastInt8()) {
+        std::cerr << "WARNING: the GPU has no fast int8" << std::endl;
+      }
+      config->setFlag(nvinfer1::BuilderFlag::kINT8);
+      calibrator = std::make_unique<Calibrator>(
+          calibration_path,
+          options.GetOrDefault<int>("calibration_batches", 32));
+      config->setInt8Calibrator(calibrator.get());
+      nvinfer1::IOptimizationProfile* profile =
+          builder->createOptimizationProfile();
+      const nvinfer1::Dims4 dims(Calibrator::kBatchSize, kInputPlanes, 8, 8);
+      profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kMIN,
+                             dims);
+      profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kOPT,
+                             dims);
+      profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kMAX,
+                             dims);
+      config->setCalibrationProfile(profile);
+    }
+
+    std::cerr << "Building the TensorRT engine, this takes a while"
+              << std::endl;
+    engine_.reset(builder->buildEngineWithConfig(*network, *config));
+    if (!engine_) throw Exception("Could not build the TensorRT engine");
+  }
+
+  // The layers of the network. Convolutions take the folded batchnorm as
+  // their bias, which TensorRT fuses with the ReLU and the residual add.
+  static void DefineNetwork(nvinfer1::INetworkDefinition* network,
+                            const Weights& weights) {
+    auto trt_weights = [](const Weights::Vec& vec) {
+      return nvinfer1::Weights{nvinfer1::DataType::kFLOAT, vec.data(),
+                               static_cast<int64_t>(vec.size())};
+    };
+    auto conv = [&](nvinfer1::ITensor* input, const Weights::ConvBlock& block,
+                    int filter_size) {
+      nvinfer1::IConvolutionLayer* layer = network->addConvolutionNd(
+          *input, block.biases.size(),
+          nvinfer1::DimsHW(filter_size, filter_size),
+          trt_weights(block.weights), trt_weights(block.biases));
+      layer->setPaddingNd(nvinfer1::DimsHW(filter_size / 2, filter_size / 2));
+      return layer->getOutput(0);
+    };
+    auto activation = [&](nvinfer1::ITensor* input,
+                          nvinfer1::ActivationType type) {
+      return network->addActivation(*input, type)->getOutput(0);
+    };
+    auto relu = [&](nvinfer1::ITensor* input) {
+      return activation(input, nvinfer1::ActivationType::kRELU);
+    };
+    auto fc = [&](nvinfer1::ITensor* input, const Weights::Vec& w,
+                  const Weights::Vec& b) {
+      return network
+          ->addFullyConnected(*input, b.size(), trt_weights(w), trt_weights(b))
+          ->getOutput(0);
+    };
+
+    nvinfer1::ITensor* input =
+        network->addInput(kInputName, nvinfer1::DataType::kFLOAT,
+                          nvinfer1::Dims4(-1, kInputPlanes, 8, 8));
+    nvinfer1::ITensor* flow = relu(conv(input, weights.input, 3));
+    for (const auto& residual : weights.residual) {
+      nvinfer1::ITensor* block = relu(conv(flow, residual.conv1, 3));
+      block = conv(block, residual.conv2, 3);
+      flow = relu(network
+                      ->addElementWise(*block, *flow,
+                                       nvinfer1::ElementWiseOperation::kSUM)
+                      ->getOutput(0));
+    }
+
+    nvinfer1::ITensor* policy = relu(conv(flow, weights.policy, 1));
+    policy = fc(policy, weights.ip_pol_w, weights.ip_pol_b);
+    nvinfer1::ISoftMaxLayer* softmax = network->addSoftMax(*policy);
+    softmax->setAxes(1U << 1);
+    policy = softmax->getOutput(0);
+    policy->setName(kPolicyName);
+    network->markOutput(*policy);
+
+    nvinfer1::ITensor* value = relu(conv(flow, weights.value, 1));
+    value = relu(fc(value, weights.ip1_val_w, weights.ip1_val_b));
+    value = activation(fc(value, weights.ip2_val_w, weights.ip2_val_b),
+                       nvinfer1::ActivationType::kTANH);
+    value->setName(kValueName);
+    network->markOutput(*value);
+  }
+
+  ExecutionContext* AcquireContext() {
+    std::unique_lock<std::mutex> lock(contexts_mutex_);
+    contexts_cv_.wait(lock, [this]() { return !free_contexts_.empty(); });
+    ExecutionContext* ctx = free_contexts_.back();
+    free_contexts_.pop_back();
+    return ctx;
+  }
+
+  void ReleaseContext(ExecutionContext* ctx) {
+    {
+      std::lock_guard<std::mutex> lock(contexts_mutex_);
+      free_contexts_.push_back(ctx);
+    }
+    contexts_cv_.notify_one();
+  }
+
+  int gpu_id_;
+  std::vector<int> batch_sizes_;
+
+  TrtPtr<nvinfer1::IRuntime> runtime_;
+  TrtPtr<nvinfer1::ICudaEngine> engine_;
+  int bindings_per_profile_;
+  // Of the first profile.
+  int input_binding_;
+  int policy_binding_;
+  int value_binding_;
+
+  // As many computations as there are streams run at a time.
+  std::vector<std::unique_ptr<ExecutionContext>> contexts_;
+  std::vector<ExecutionContext*> free_contexts_;
+  std::mutex contexts_mutex_;
+  std::condition_variable contexts_cv_;
+
+  std::mutex inputs_outputs_lock_;
+  std::list<std::unique_ptr<InputsOutputs>> free_inputs_outputs_;
+};
+
+TensorRTNetworkComputation::TensorRTNetworkComputation(
+    TensorRTNetwork* network)
+    : network_(network) {
+  inputs_outputs_ = network_->GetInputsOutputs();
+}
+
+TensorRTNetworkComputation::~TensorRTNetworkComputation() {
+  network_->ReleaseInputsOutputs(std::move(inputs_outputs_));
+}
+
+void TensorRTNetworkComputation::ComputeBlocking() {
+  TraceScope trace("tensorrt backend");
+  network_->forwardEval(inputs_outputs_.get(), batch_size_);
+}
+
+}  // namespace
+
+REGISTER_NETWORK("tensorrt", TensorRTNetwork, 104);
+
+}  // namespace lczero
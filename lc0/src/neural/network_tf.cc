@@ -18,12 +18,19 @@
 
 #include "neural/factory.h"
 #include "utils/bititer.h"
+#include "utils/exception.h"
 #include "utils/optionsdict.h"
+#include "utils/string.h"
+#include "utils/trace.h"
 #include "utils/transpose.h"
 
 #include <tensorflow/cc/client/client_session.h>
 #include <tensorflow/cc/ops/standard_ops.h>
 #include <tensorflow/core/framework/tensor.h>
+#include <tensorflow/core/protobuf/config.pb.h>
+#include <tensorflow/core/public/session_options.h>
+
+#include <algorithm>
 
 namespace lczero {
 
@@ -132,6 +139,18 @@ std::pair<Output, Output> MakeNetwork(const Scope& scope, Input input,
   return {policy_head, value_head};
 }
 
+SessionOptions MakeSessionOptions(const OptionsDict& options) {
+  SessionOptions session_options;
+  if (options.GetOrDefault<bool>("xla", false)) {
+    // Compiles the graph into fused kernels for each input shape it sees, so
+    // it works best together with batch buckets.
+    session_options.config.mutable_graph_options()
+        ->mutable_optimizer_options()
+        ->set_global_jit_level(OptimizerOptions::ON_1);
+  }
+  return session_options;
+}
+
 class TFNetworkComputation;
 class TFNetwork : public Network {
  public:
@@ -142,7 +161,14 @@ class TFNetwork : public Network {
   tensorflow::Status Compute(tensorflow::Tensor& input,
                              std::vector<tensorflow::Tensor>* outputs) const;
 
+  // Batches are padded to this size, so that tensorflow only ever sees a few
+  // input shapes.
+  int GetPaddedBatchSize(int batch_size) const;
+
  private:
+  // Sorted, each is computed once at startup. Larger batches aren't padded.
+  std::vector<int> batch_buckets_;
+
   tensorflow::Scope scope_;
   tensorflow::ClientSession session_;
 
@@ -155,9 +181,10 @@ class TFNetworkComputation : public NetworkComputation {
  public:
   TFNetworkComputation(const TFNetwork* network) : network_(network) {}
   void AddInput(InputPlanes&& input) override {
-    raw_input_.emplace_back(input);
+    raw_input_.emplace_back(std::move(input));
   }
   void ComputeBlocking() override {
+    TraceScope trace("tensorflow backend");
     PrepareInput();
     status_ = network_->Compute(input_, &output_);
     CHECK(status_.ok()) << status_.ToString();
@@ -170,12 +197,18 @@ class TFNetworkComputation : public NetworkComputation {
   float GetPVal(int sample, int move_id) const override {
     return output_[1].matrix<float>()(sample, move_id);
   }
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    const auto policy = output_[1].matrix<float>();
+    for (int i = 0; i < count; ++i) out[i] = policy(sample, move_ids[i]);
+  }
 
  private:
   void PrepareInput() {
+    // Padding samples stay zero.
     input_ = tensorflow::Tensor(
         tensorflow::DataType::DT_FLOAT,
-        {static_cast<int>(raw_input_.size()), kInputPlanes, 8, 8});
+        {network_->GetPaddedBatchSize(raw_input_.size()), kInputPlanes, 8, 8});
 
     auto flat = input_.flat<float>();
     memset(flat.data(), 0, flat.size() * sizeof(*flat.data()));
@@ -200,7 +233,15 @@ class TFNetworkComputation : public NetworkComputation {
 };
 
 TFNetwork::TFNetwork(const Weights& weights, const OptionsDict& options)
-    : scope_(Scope::NewRootScope()), session_(scope_) {
+    : batch_buckets_(ParseIntList(options.GetOrDefault<std::string>(
+          "batch_buckets", "1,2,4,8,16,32,64,128,256"))),
+      scope_(Scope::NewRootScope()),
+      session_(scope_, MakeSessionOptions(options)) {
+  std::sort(batch_buckets_.begin(), batch_buckets_.end());
+  if (!batch_buckets_.empty() && batch_buckets_.front() < 1) {
+    throw Exception("Batch buckets of the tensorflow backend must be positive");
+  }
+
   input_ = std::make_unique<Placeholder>(
       scope_, DataType::DT_FLOAT, Placeholder::Shape({-1, kInputPlanes, 8, 8}));
 
@@ -210,11 +251,23 @@ TFNetwork::TFNetwork(const Weights& weights, const OptionsDict& options)
   policy_head_ = std::make_unique<Output>(output.first);
   value_head_ = std::make_unique<Output>(output.second);
 
-  // First request to tensorflow is slow (0.6s), so doing an empty request for
-  // preheating.
+  // First request to tensorflow for each input shape is slow (0.6s, more with
+  // XLA), so doing an empty request for every bucket for preheating.
   auto fake_request = NewComputation();
-  fake_request->AddInput(InputPlanes(kInputPlanes));
+  fake_request->AddInput(InputPlanes());
   fake_request->ComputeBlocking();
+  for (const int bucket : batch_buckets_) {
+    if (bucket == 1) continue;
+    fake_request = NewComputation();
+    for (int i = 0; i < bucket; ++i) fake_request->AddInput(InputPlanes());
+    fake_request->ComputeBlocking();
+  }
+}
+
+int TFNetwork::GetPaddedBatchSize(int batch_size) const {
+  const auto iter = std::lower_bound(batch_buckets_.begin(),
+                                     batch_buckets_.end(), batch_size);
+  return iter == batch_buckets_.end() ? batch_size : *iter;
 }
 
 tensorflow::Status TFNetwork::Compute(tensorflow::Tensor& input,
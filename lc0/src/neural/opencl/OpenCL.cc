@@ -0,0 +1,1152 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2017 Gian-Carlo Pascutto
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/opencl/OpenCL.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <string>
+
+#include "utils/exception.h"
+
+namespace lczero {
+
+// Kernels of the Leela Zero OpenCL backend, with the positions of a batch in
+// one more dimension of the launches. The Winograd tiles of all positions
+// are side by side in the matrices of the SGEMM, so a batch is one launch of
+// each kernel.
+
+static const std::string cl_args =
+    "-cl-mad-enable -cl-fast-relaxed-math -cl-no-signed-zeros "
+    "-cl-denorms-are-zero";
+
+static const std::string sourceCode_input = R"(
+    // Expands the input planes, a 64 bit mask of the squares that are set
+    // and the value of those squares for each plane.
+    __kernel void expand_input(
+                   __global const ulong * restrict masks,
+                   __global const float * restrict values,
+                   __global float * restrict out) {
+        // cl::NDRange global(batch_size * channels, 8*8);
+        const int i = get_global_id(0);
+        const int sq = get_global_id(1);
+        const int boardsize = 8 * 8;
+        out[i * boardsize + sq] = ((masks[i] >> sq) & 1) ? values[i] : 0.0f;
+    }
+)";
+
+static const std::string sourceCode_heads = R"(
+    // The 1x1 convolutions of both heads over the tower output, with their
+    // biases and ReLU, in one launch. The policy planes of a position are
+    // stored first and its value planes after them, ready for the fully
+    // connected layers.
+    __kernel void convolve1_heads(
+                   __global const float * restrict in,
+                   __global float * restrict out,
+                   __global const float * restrict pol_weights,
+                   __constant const float * restrict pol_biases,
+                   __global const float * restrict val_weights,
+                   __constant const float * restrict val_biases,
+                   __private const int channels,
+                   __private const int pol_outputs) {
+        // cl::NDRange global(pol_outputs + val_outputs, 8*8, batch_size);
+        const int o = get_global_id(0);
+        const int b = get_global_id(1);
+        const int batch = get_global_id(2);
+        const int outputs = get_global_size(0);
+        const int width = 8;
+        const int height = 8;
+        const int boardsize = width * height;
+        in += batch * channels * boardsize;
+        out += batch * outputs * boardsize;
+        const bool is_pol = o < pol_outputs;
+        const int head_o = is_pol ? o : o - pol_outputs;
+        __global const float * restrict weights =
+            is_pol ? pol_weights : val_weights;
+        float sum = 0;
+        for (int c = 0; c < channels; c++) {
+            sum += in[c * boardsize + b] * weights[head_o * channels + c];
+        }
+        sum += is_pol ? pol_biases[head_o] : val_biases[head_o];
+        sum = sum > 0 ? sum : 0.0f;
+        out[o * boardsize + b] = sum;
+    }
+)";
+
+static const std::string sourceCode_convolve3 = R"(
+void __in_transform_eq(float x[4][4], __global float * restrict V, int offset, int CPpad) {
+    float T1[4][4];
+
+    T1[0][0] = x[0][0] - x[2][0];
+    T1[0][1] = x[0][1] - x[2][1];
+    T1[0][2] = x[0][2] - x[2][2];
+    T1[0][3] = x[0][3] - x[2][3];
+    T1[1][0] = x[1][0] + x[2][0];
+    T1[1][1] = x[1][1] + x[2][1];
+    T1[1][2] = x[1][2] + x[2][2];
+    T1[1][3] = x[1][3] + x[2][3];
+    T1[2][0] = x[2][0] - x[1][0];
+    T1[2][1] = x[2][1] - x[1][1];
+    T1[2][2] = x[2][2] - x[1][2];
+    T1[2][3] = x[2][3] - x[1][3];
+    T1[3][0] = x[1][0] - x[3][0];
+    T1[3][1] = x[1][1] - x[3][1];
+    T1[3][2] = x[1][2] - x[3][2];
+    T1[3][3] = x[1][3] - x[3][3];
+
+    V[(0*4 + 0)*CPpad + offset] = T1[0][0] - T1[0][2];
+    V[(0*4 + 1)*CPpad + offset] = T1[0][1] + T1[0][2];
+    V[(0*4 + 2)*CPpad + offset] = T1[0][2] - T1[0][1];
+    V[(0*4 + 3)*CPpad + offset] = T1[0][1] - T1[0][3];
+    V[(1*4 + 0)*CPpad + offset] = T1[1][0] - T1[1][2];
+    V[(1*4 + 1)*CPpad + offset] = T1[1][1] + T1[1][2];
+    V[(1*4 + 2)*CPpad + offset] = T1[1][2] - T1[1][1];
+    V[(1*4 + 3)*CPpad + offset] = T1[1][1] - T1[1][3];
+    V[(2*4 + 0)*CPpad + offset] = T1[2][0] - T1[2][2];
+    V[(2*4 + 1)*CPpad + offset] = T1[2][1] + T1[2][2];
+    V[(2*4 + 2)*CPpad + offset] = T1[2][2] - T1[2][1];
+    V[(2*4 + 3)*CPpad + offset] = T1[2][1] - T1[2][3];
+    V[(3*4 + 0)*CPpad + offset] = T1[3][0] - T1[3][2];
+    V[(3*4 + 1)*CPpad + offset] = T1[3][1] + T1[3][2];
+    V[(3*4 + 2)*CPpad + offset] = T1[3][2] - T1[3][1];
+    V[(3*4 + 3)*CPpad + offset] = T1[3][1] - T1[3][3];
+}
+
+// cl::NDRange global(wgs, C, batch_size);
+__kernel void in_transform(__global const float * restrict in, __global float * restrict V,
+                           const int C, const int Cpad,
+                           const int Ppad) {
+    const int W = 8;
+    const int H = 8;
+    const int T = W*H;
+    const int WTILES = (W + 1) / 2;
+    const int P = WTILES*WTILES;
+    const int CPpad = Ppad * Cpad;
+
+    const int block = get_global_id(0);
+    const int ch = get_global_id(1);
+    const int batch = get_global_id(2);
+    const int chT = (batch*C + ch)*(T);
+
+    const int block_x = block % WTILES;
+    const int block_y = block / WTILES;
+
+    // Tiles overlap by 2
+    const int yin = 2 * block_y - 1;
+    const int xin = 2 * block_x - 1;
+
+    if (block < P && ch < C) {
+        // Cache input tile and handle zero padding
+        float x[4][4];
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                int a = xin + j;
+                int b = yin + i;
+                if (b >= 0 && a >= 0 && b < H && a < W) {
+                    x[i][j] = in[chT + b*W + a];
+                } else {
+                    x[i][j] = 0.0f;
+                }
+            }
+        }
+
+        // The tiles of the positions follow each other.
+        const int offset = ch*Ppad + batch*P + block;
+        __in_transform_eq(x, V, offset, CPpad);
+    }
+}
+
+void __out_transform_eq(__global const float * restrict M, float o[4],
+                        int Kpad, int Ppad, int tile, int k)
+{
+    const int KPpad = Kpad * Ppad;
+    float temp_m[16];
+    for (int xn = 0, xnKPpad = tile*Kpad + k; xn < 16; xn++, xnKPpad += KPpad) {
+        temp_m[xn] = M[xnKPpad];
+    }
+
+    o[0] = temp_m[0*4 + 0] + temp_m[0*4 + 1] + temp_m[0*4 + 2] +
+           temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] +
+           temp_m[2*4 + 0] + temp_m[2*4 + 1] + temp_m[2*4 + 2];
+
+    o[1] = temp_m[0*4 + 1] - temp_m[0*4 + 2] - temp_m[0*4 + 3] +
+           temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] +
+           temp_m[2*4 + 1] - temp_m[2*4 + 2] - temp_m[2*4 + 3];
+
+    o[2] = temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] -
+           temp_m[2*4 + 0] - temp_m[2*4 + 1] - temp_m[2*4 + 2] -
+           temp_m[3*4 + 0] - temp_m[3*4 + 1] - temp_m[3*4 + 2];
+
+    o[3] = temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] -
+           temp_m[2*4 + 1] + temp_m[2*4 + 2] + temp_m[2*4 + 3] -
+           temp_m[3*4 + 1] + temp_m[3*4 + 2] + temp_m[3*4 + 3];
+}
+
+// cl::NDRange global(K, wgs, batch_size);
+__kernel void out_transform_fused_bias(__global const float * restrict M,
+                                       __global float * restrict Y,
+                                       const int K,
+                                       const int Kpad, const int Ppad,
+                                       __global const float * restrict residual,
+                                       __constant const float * restrict biases) {
+    const int W = 8;
+    const int H = 8;
+    const int WTILES = (W + 1) / 2;
+    const int P = WTILES * WTILES;
+
+    int k = get_global_id(0);
+    int block = get_global_id(1);
+    int batch = get_global_id(2);
+
+    const int block_x = block % WTILES;
+    const int block_y = block / WTILES;
+
+    int x = 2*block_x;
+    int y = 2*block_y;
+    int a_ind = (y)*W + (x);
+    if (k < K && block < P) {
+        const int kHW = (batch*K + k) * W * H;
+        float o[4];
+        __out_transform_eq(M, o, Kpad, Ppad, batch*P + block, k);
+
+        const float bias = biases[k];
+
+        const bool pred[4] = { 1, x+1 < W, y+1 < H, x+1 < W & y+1 < H};
+
+        const int a[4] = {a_ind, a_ind+1, a_ind+W, a_ind+W+1};
+
+        for (int i = 0; i < 4; i++) {
+            if (pred[i]) {
+                o[i] += bias;
+                if (residual) {
+                    o[i] += residual[kHW + a[i]];
+                }
+                o[i] = o[i] > 0 ? o[i] : 0.0f;
+                Y[kHW + a[i]] = o[i];
+            }
+        }
+    }
+}
+
+// cl::NDRange global(K, wgs, batch_size), local(dim_size, wgs, 1): a work
+// group has all tiles of a position, which the input transform of the next
+// convolution needs.
+__kernel void out_transform_fused_bias_in(
+                                     __global const float * restrict M,
+                                     __global float * restrict Y,
+                                     __global float * restrict V,
+                                     const int K,
+                                     const int Kpad, const int Ppad, const int Cpad,
+                                     __global const float * restrict residual,
+                                     __constant const float * restrict biases,
+                                     __local float * ybuf) {
+    const int W = 8;
+    const int H = 8;
+    const int T = W*H;
+    const int WTILES = (W + 1) / 2;
+    const int P = WTILES * WTILES;
+
+    const int k = get_global_id(0);
+    const int kg = get_local_id(0);
+    const int block = get_global_id(1);
+    const int batch = get_global_id(2);
+
+    const int block_x = block % WTILES;
+    const int block_y = block / WTILES;
+
+    const int yin = 2 * block_y - 1;
+    const int xin = 2 * block_x - 1;
+
+
+    const int x = 2*block_x;
+    const int y = 2*block_y;
+    int a_ind = (y)*W + (x);
+
+
+    if (k < K && block < P) {
+        const int a[4] = {a_ind, a_ind+1, a_ind+W, a_ind+W+1};
+        const bool pred[4] = { 1, x+1 < W, y+1 < H, x+1 < W & y+1 < H};
+        const int kHW = (batch*K + k) * W * H;
+
+        float o[4];
+        __out_transform_eq(M, o, Kpad, Ppad, batch*P + block, k);
+
+        const float bias = biases[k];
+
+        for (int i = 0; i < 4; i++) {
+            if (pred[i]) {
+                o[i] += bias;
+                if (residual) {
+                    o[i] += residual[kHW + a[i]];
+                }
+                o[i] = o[i] > 0 ? o[i] : 0.0f;
+                ybuf[kg * T + a[i]] = o[i];
+                if (Y) {
+                    Y[kHW + a[i]] = o[i];
+                }
+            }
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (block < P && k < K) {
+        const int CPpad = Ppad * Cpad;
+        // Cache input tile and handle zero padding
+        float xx[4][4];
+        for (int i = 0; i < 4; i++) {
+            int b = yin + i;
+            for (int j = 0; j < 4; j++) {
+                int a = xin + j;
+                if (b >= 0 && a >= 0 && b < H && a < W) {
+                    xx[i][j] = ybuf[kg * T + b*W + a];
+                } else {
+                    xx[i][j] = 0.0f;
+                }
+            }
+        }
+
+        const int offset = k*Ppad + batch*P + block;
+        __in_transform_eq(xx, V, offset, CPpad);
+    }
+}
+)";
+
+const std::string sourceCode_sgemm =
+#include "clblast_level3/common.opencl"
+#include "clblast_level3/xgemm_part1.opencl"
+#include "clblast_level3/xgemm_part2.opencl"
+#include "clblast_level3/xgemm_part3.opencl"
+#include "clblast_level3/xgemm_batched.opencl"
+    ;
+
+static const std::string sourceCode_sgemv =
+#include "clblast_level3/xgemv.opencl"
+    ;
+
+OpenCLBuffers::OpenCLBuffers(const OpenCL_Network& opencl_net)
+    : m_opencl_net(opencl_net), m_opencl(opencl_net.m_opencl) {
+  const auto& program = m_opencl.m_program;
+  const auto& context = m_opencl.m_context;
+  m_expand_input_kernel = cl::Kernel(program, "expand_input");
+  m_heads_kernel = cl::Kernel(program, "convolve1_heads");
+  m_in_transform_kernel = cl::Kernel(program, "in_transform");
+  m_sgemm_kernel = cl::Kernel(program, "XgemmBatched");
+  m_out_transform_bias_kernel = cl::Kernel(program, "out_transform_fused_bias");
+  m_out_transform_bias_in_kernel =
+      cl::Kernel(program, "out_transform_fused_bias_in");
+  m_sgemv_kernel = cl::Kernel(program, "Xgemv");
+  m_commandqueue = cl::CommandQueue(
+      context, m_opencl.m_device,
+      m_opencl.m_params.profile ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+  const auto& layers = m_opencl_net.m_layers;
+  const auto& pol_layer = layers[layers.size() - 2];
+  const auto& val_layer = layers.back();
+  const auto max_batch_size = m_opencl.get_max_batch_size();
+
+  auto max_channels = pol_layer.outputs + val_layer.outputs;
+  for (const auto& layer : layers) {
+    max_channels = std::max(max_channels, std::max(layer.channels, layer.outputs));
+  }
+
+  const auto& tuners = m_opencl.m_sgemm_tuners;
+  const auto c_ceil = std::max(
+      ceilMultiple(ceilMultiple(max_channels, tuners.mwg), tuners.vwm),
+      ceilMultiple(ceilMultiple(max_channels, tuners.kwg), tuners.vwm));
+  const auto n_ceil = ceilMultiple(
+      ceilMultiple(max_batch_size * kWinogradP, tuners.nwg), tuners.vwn);
+
+  const auto alloc_inSize = max_batch_size * 8 * 8 * max_channels * sizeof(float);
+  const auto alloc_vm_size = kWinogradTile * c_ceil * n_ceil * sizeof(float);
+
+  auto v_zeros = std::vector<float>(alloc_vm_size / sizeof(float));
+
+  m_inBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, alloc_inSize);
+  m_inBuffer2 = cl::Buffer(context, CL_MEM_READ_WRITE, alloc_inSize);
+  m_VBuffer = cl::Buffer(
+      context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+      alloc_vm_size, v_zeros.data(), nullptr);
+  m_MBuffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+                         alloc_vm_size);
+
+  const auto input_planes = max_batch_size * layers.front().channels;
+  m_masksBuffer =
+      cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY,
+                 input_planes * sizeof(std::uint64_t));
+  m_valuesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY,
+                              input_planes * sizeof(float));
+  m_expandedInput =
+      cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+                 input_planes * 8 * 8 * sizeof(float));
+
+  const auto out_size = pol_layer.ip_out_size + val_layer.ip_out_size;
+  m_out.resize(max_batch_size * out_size);
+  m_outBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
+                           m_out.size() * sizeof(float));
+}
+
+void OpenCLBuffers::forward(const std::uint64_t* masks, const float* values,
+                            float* output_pol, float* output_val,
+                            int batch_size) {
+  const auto& layers = m_opencl_net.m_layers;
+  // The heads are the last two layers, policy first.
+  const auto& pol_layer = layers[layers.size() - 2];
+  const auto& val_layer = layers.back();
+  assert(pol_layer.is_policy && val_layer.is_value);
+  assert(pol_layer.channels == val_layer.channels);
+  assert(batch_size <= m_opencl.get_max_batch_size());
+
+  const auto pol_size = pol_layer.ip_out_size;
+  const auto val_size = val_layer.ip_out_size;
+  const auto out_size = pol_size + val_size;
+  const auto input_channels = layers.front().channels;
+  const auto input_planes = batch_size * input_channels;
+
+  cl::CommandQueue& queue = m_commandqueue;
+  m_profiled.clear();
+  m_profile_layer = 0;
+  queue.enqueueWriteBuffer(m_masksBuffer, CL_FALSE, 0,
+                           input_planes * sizeof(std::uint64_t), masks,
+                           nullptr, profile_event("write_buffer"));
+  queue.enqueueWriteBuffer(m_valuesBuffer, CL_FALSE, 0,
+                           input_planes * sizeof(float), values, nullptr,
+                           profile_event("write_buffer"));
+  expand_input(input_channels, batch_size);
+
+  auto skip_in_trans = false;
+  for (auto iter = layers.cbegin(); iter != layers.cend(); iter++) {
+    const auto& layer = *iter;
+    const auto niter = std::next(iter);
+    m_profile_layer = iter - layers.cbegin();
+
+    if (layer.is_input_convolution) {
+      assert(niter != layers.cend());
+      auto conv_weights = layer.weights.cbegin();
+      auto conv_biases = layer.weights.cbegin() + 1;
+      auto skip_next_in_trans = niter->is_residual_block;
+      convolve3(layer.channels, layer.outputs, batch_size, m_expandedInput,
+                m_inBuffer, m_VBuffer, m_MBuffer, conv_weights, nullptr,
+                conv_biases, skip_in_trans, skip_next_in_trans, true);
+      skip_in_trans = skip_next_in_trans;
+    } else if (layer.is_residual_block) {
+      assert(layer.channels == layer.outputs);
+      assert(niter != layers.cend());
+      auto conv1_weights = layer.weights.cbegin();
+      auto conv1_biases = layer.weights.cbegin() + 1;
+      auto conv2_weights = layer.weights.cbegin() + 2;
+      auto conv2_biases = layer.weights.cbegin() + 3;
+      convolve3(layer.channels, layer.outputs, batch_size, m_inBuffer,
+                m_inBuffer2, m_VBuffer, m_MBuffer, conv1_weights, nullptr,
+                conv1_biases, skip_in_trans, true, false);
+
+      auto skip_next_in_trans = niter->is_residual_block;
+      convolve3(layer.channels, layer.outputs, batch_size, m_inBuffer2,
+                m_inBuffer, m_VBuffer, m_MBuffer, conv2_weights, &m_inBuffer,
+                conv2_biases, true, skip_next_in_trans, true);
+      skip_in_trans = skip_next_in_trans;
+    } else {
+      assert(layer.is_policy);
+      const auto heads_size = (pol_layer.outputs + val_layer.outputs) * 8 * 8;
+      heads(layer.channels, pol_layer.outputs, val_layer.outputs, batch_size,
+            m_inBuffer, m_inBuffer2, pol_layer.weights.cbegin(),
+            val_layer.weights.cbegin());
+
+      innerproduct(m_inBuffer2, 0, heads_size,
+                   pol_layer.weights.cbegin() + 2,
+                   pol_layer.weights.cbegin() + 3, m_outBuffer, 0, out_size,
+                   pol_layer.ip_in_size, pol_layer.ip_out_size, false,
+                   batch_size);
+      innerproduct(m_inBuffer2, pol_layer.ip_in_size, heads_size,
+                   val_layer.weights.cbegin() + 2,
+                   val_layer.weights.cbegin() + 3, m_outBuffer, pol_size,
+                   out_size, val_layer.ip_in_size, val_layer.ip_out_size, true,
+                   batch_size);
+      // Both heads are done.
+      break;
+    }
+  }
+
+  queue.enqueueReadBuffer(m_outBuffer, CL_FALSE, 0,
+                          batch_size * out_size * sizeof(float), m_out.data(),
+                          nullptr, profile_event("read_buffer"));
+  {
+    // Waiting for the queue is usually a busy wait, and having a lot of
+    // threads wait here is counterproductive CPU-wise.
+    std::lock_guard<std::mutex> lock(m_opencl_net.m_queue_finish_mutex);
+    queue.finish();
+  }
+  if (!m_profiled.empty()) m_opencl_net.add_profile(m_profiled, batch_size);
+
+  for (auto batch = 0; batch < batch_size; batch++) {
+    const auto out = &m_out[batch * out_size];
+    std::copy(out, out + pol_size, output_pol + batch * pol_size);
+    std::copy(out + pol_size, out + out_size, output_val + batch * val_size);
+  }
+}
+
+void OpenCLBuffers::convolve3(int channels, int outputs, int batch_size,
+                              cl::Buffer& bufferIn, cl::Buffer& bufferOut,
+                              cl::Buffer& bufferV, cl::Buffer& bufferM,
+                              weight_slice_t weights,
+                              cl::Buffer* bufferResidual,
+                              weight_slice_t biases, bool skip_in_transform,
+                              bool fuse_in_transform, bool store_inout) {
+  auto mwg = m_opencl.m_sgemm_tuners.mwg;
+  auto nwg = m_opencl.m_sgemm_tuners.nwg;
+  auto kwg = m_opencl.m_sgemm_tuners.kwg;
+  auto vwm = m_opencl.m_sgemm_tuners.vwm;
+  auto vwn = m_opencl.m_sgemm_tuners.vwn;
+  auto mdimc = m_opencl.m_sgemm_tuners.mdimc;
+  auto ndimc = m_opencl.m_sgemm_tuners.ndimc;
+  auto wavefront_size = m_opencl.m_wavefront_size;
+
+  assert(mwg != 0);
+  assert(nwg != 0);
+  assert(kwg != 0);
+  assert(mdimc != 0);
+  assert(ndimc != 0);
+  assert(vwm != 0);
+  assert(vwn != 0);
+  assert(wavefront_size != 0);
+
+  constexpr auto tiles = kWinogradP;
+  constexpr auto width = 8;
+  constexpr auto height = 8;
+
+  // The tiles of all positions side by side.
+  auto wgs = ceilMultiple(tiles, wavefront_size);
+  auto m_ceil = int(ceilMultiple(ceilMultiple(outputs, mwg), vwm));
+  auto n_ceil = int(ceilMultiple(ceilMultiple(batch_size * tiles, nwg), vwn));
+  auto k_ceil = int(ceilMultiple(ceilMultiple(channels, kwg), vwm));
+
+  cl::CommandQueue& queue = m_commandqueue;
+
+  if (!skip_in_transform) {
+    try {
+      m_in_transform_kernel.setArg(0, bufferIn);
+      m_in_transform_kernel.setArg(1, bufferV);
+      m_in_transform_kernel.setArg(2, channels);
+      m_in_transform_kernel.setArg(3, k_ceil);
+      m_in_transform_kernel.setArg(4, n_ceil);
+
+      queue.enqueueNDRangeKernel(m_in_transform_kernel, cl::NullRange,
+                                 cl::NDRange(wgs, channels, batch_size),
+                                 cl::NullRange, nullptr,
+                                 profile_event("in_transform"));
+    } catch (const cl::Error& e) {
+      std::cerr << "Error in convolve3: " << e.what() << ": " << e.err()
+                << std::endl;
+      throw;
+    }
+  }
+
+  try {
+    m_sgemm_kernel.setArg(0, m_ceil);
+    m_sgemm_kernel.setArg(1, n_ceil);
+    m_sgemm_kernel.setArg(2, k_ceil);
+    m_sgemm_kernel.setArg(3, weights[0]);
+    m_sgemm_kernel.setArg(4, bufferV);
+    m_sgemm_kernel.setArg(5, bufferM);
+
+    cl::NDRange local_sgemm = {mdimc, ndimc, 1};
+
+    cl::NDRange size_sgemm = {(m_ceil * mdimc) / mwg, (n_ceil * ndimc) / nwg,
+                              (cl::size_type)kWinogradTile};
+
+    queue.enqueueNDRangeKernel(m_sgemm_kernel, cl::NullRange, size_sgemm,
+                               local_sgemm, nullptr,
+                               profile_event("XgemmBatched"));
+  } catch (const cl::Error& e) {
+    std::cerr << "Error in convolve3: " << e.what() << ": " << e.err()
+              << std::endl;
+    throw;
+  }
+
+  try {
+    if (fuse_in_transform) {
+      // TODO : Eventually this might also be something tuneable?
+      constexpr auto dim_size = 2;
+      m_out_transform_bias_in_kernel.setArg(0, bufferM);
+      if (store_inout) {
+        m_out_transform_bias_in_kernel.setArg(1, bufferOut);
+      } else {
+        m_out_transform_bias_in_kernel.setArg(1, nullptr);
+      }
+      m_out_transform_bias_in_kernel.setArg(2, bufferV);
+      m_out_transform_bias_in_kernel.setArg(3, outputs);
+      m_out_transform_bias_in_kernel.setArg(4, m_ceil);
+      m_out_transform_bias_in_kernel.setArg(5, n_ceil);
+      // k_ceil of the next convolution
+      auto k_ceil2 = int(ceilMultiple(ceilMultiple(outputs, kwg), vwm));
+      m_out_transform_bias_in_kernel.setArg(6, k_ceil2);
+      if (bufferResidual) {
+        m_out_transform_bias_in_kernel.setArg(7, *bufferResidual);
+      } else {
+        m_out_transform_bias_in_kernel.setArg(7, nullptr);
+      }
+      m_out_transform_bias_in_kernel.setArg(8, biases[0]);
+      m_out_transform_bias_in_kernel.setArg(
+          9, cl::Local(dim_size * width * height * sizeof(float)));
+
+      queue.enqueueNDRangeKernel(m_out_transform_bias_in_kernel, cl::NullRange,
+                                 cl::NDRange(outputs, wgs, batch_size),
+                                 cl::NDRange(dim_size, wgs, 1), nullptr,
+                                 profile_event("out_transform_fused_bias_in"));
+    } else {
+      m_out_transform_bias_kernel.setArg(0, bufferM);
+      m_out_transform_bias_kernel.setArg(1, bufferOut);
+      m_out_transform_bias_kernel.setArg(2, outputs);
+      m_out_transform_bias_kernel.setArg(3, m_ceil);
+      m_out_transform_bias_kernel.setArg(4, n_ceil);
+      if (bufferResidual) {
+        m_out_transform_bias_kernel.setArg(5, *bufferResidual);
+      } else {
+        m_out_transform_bias_kernel.setArg(5, nullptr);
+      }
+      m_out_transform_bias_kernel.setArg(6, biases[0]);
+
+      queue.enqueueNDRangeKernel(m_out_transform_bias_kernel, cl::NullRange,
+                                 cl::NDRange(outputs, wgs, batch_size),
+                                 cl::NullRange, nullptr,
+                                 profile_event("out_transform_fused_bias"));
+    }
+  } catch (const cl::Error& e) {
+    std::cerr << "Error in convolve3: " << e.what() << ": " << e.err()
+              << std::endl;
+    throw;
+  }
+}
+
+void OpenCLBuffers::expand_input(int channels, int batch_size) {
+  constexpr int boardsize = 8 * 8;
+  try {
+    m_expand_input_kernel.setArg(0, m_masksBuffer);
+    m_expand_input_kernel.setArg(1, m_valuesBuffer);
+    m_expand_input_kernel.setArg(2, m_expandedInput);
+
+    m_commandqueue.enqueueNDRangeKernel(
+        m_expand_input_kernel, cl::NullRange,
+        cl::NDRange(batch_size * channels, boardsize),
+        cl::NDRange(1, boardsize), nullptr, profile_event("expand_input"));
+  } catch (const cl::Error& e) {
+    std::cerr << "Error in expand_input: " << e.what() << ": " << e.err()
+              << std::endl;
+    throw;
+  }
+}
+
+void OpenCLBuffers::heads(int channels, int pol_outputs, int val_outputs,
+                          int batch_size, cl::Buffer& bufferInput,
+                          cl::Buffer& bufferOutput, weight_slice_t pol_weights,
+                          weight_slice_t val_weights) {
+  constexpr int boardsize = 8 * 8;
+  try {
+    m_heads_kernel.setArg(0, bufferInput);
+    m_heads_kernel.setArg(1, bufferOutput);
+    m_heads_kernel.setArg(2, pol_weights[0]);
+    m_heads_kernel.setArg(3, pol_weights[1]);
+    m_heads_kernel.setArg(4, val_weights[0]);
+    m_heads_kernel.setArg(5, val_weights[1]);
+    m_heads_kernel.setArg(6, channels);
+    m_heads_kernel.setArg(7, pol_outputs);
+
+    m_commandqueue.enqueueNDRangeKernel(
+        m_heads_kernel, cl::NullRange,
+        cl::NDRange(pol_outputs + val_outputs, boardsize, batch_size),
+        cl::NDRange(1, boardsize, 1), nullptr,
+        profile_event("convolve1_heads"));
+  } catch (const cl::Error& e) {
+    std::cerr << "Error in heads: " << e.what() << ": " << e.err()
+              << std::endl;
+    throw;
+  }
+}
+
+void OpenCLBuffers::innerproduct(cl::Buffer& input, int input_offset,
+                                 int input_stride, weight_slice_t weights,
+                                 weight_slice_t biases, cl::Buffer& output,
+                                 int output_offset, int output_stride,
+                                 int inputs, int outputs, bool relu,
+                                 int batch_size) {
+  // TODO: Tune these
+  size_t wgs1 = 64;
+  size_t wpt1 = 1;
+
+  auto m_ceil = int(ceilMultiple(outputs, wgs1 * wpt1));
+  auto global_size = m_ceil / wpt1;
+  auto local_size = wgs1;
+
+  try {
+    m_sgemv_kernel.setArg(0, outputs);
+    m_sgemv_kernel.setArg(1, inputs);
+    m_sgemv_kernel.setArg(2, weights[0]);
+    m_sgemv_kernel.setArg(3, 0);
+    m_sgemv_kernel.setArg(4, inputs);
+    m_sgemv_kernel.setArg(5, input);
+    m_sgemv_kernel.setArg(6, input_offset);
+    m_sgemv_kernel.setArg(7, output);
+    m_sgemv_kernel.setArg(8, output_offset);
+    m_sgemv_kernel.setArg(9, biases[0]);
+    m_sgemv_kernel.setArg(10, static_cast<int>(relu));
+    m_sgemv_kernel.setArg(11, input_stride);
+    m_sgemv_kernel.setArg(12, output_stride);
+
+    // A matrix-vector product for each position.
+    m_commandqueue.enqueueNDRangeKernel(m_sgemv_kernel, cl::NullRange,
+                                        cl::NDRange(global_size, batch_size),
+                                        cl::NDRange(local_size, 1), nullptr,
+                                        profile_event("Xgemv"));
+  } catch (const cl::Error& e) {
+    std::cerr << "Error in innerproduct: " << e.what() << ": " << e.err()
+              << std::endl;
+    throw;
+  }
+}
+
+cl::Event* OpenCLBuffers::profile_event(const char* name) {
+  if (!m_opencl.m_params.profile) return nullptr;
+  // The event is set before the next command is added.
+  m_profiled.push_back({name, m_profile_layer, cl::Event()});
+  return &m_profiled.back().event;
+}
+
+OpenCL_Network::~OpenCL_Network() {
+  std::lock_guard<std::mutex> lock(m_profile_mutex);
+  if (m_profiled_batches > 0) std::cerr << profile_string();
+}
+
+void OpenCL_Network::add_weights(size_t layer, size_t size,
+                                 const float* weights) {
+  if (layer >= m_layers.size()) {
+    m_layers.push_back(Layer());
+  }
+
+  m_layers.back().weights.emplace_back(
+      m_opencl.m_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+      size * sizeof(float), const_cast<float*>(weights));
+}
+
+void OpenCL_Network::forward(const std::uint64_t* masks, const float* values,
+                             float* output_pol, float* output_val,
+                             int batch_size) const {
+  const auto input_channels = m_layers.front().channels;
+  const auto pol_size = m_layers[m_layers.size() - 2].ip_out_size;
+  const auto val_size = m_layers.back().ip_out_size;
+  const auto max_batch_size = m_opencl.get_max_batch_size();
+
+  auto buffers = acquire_buffers();
+  for (auto start = 0; start < batch_size; start += max_batch_size) {
+    const auto size = std::min(batch_size - start, max_batch_size);
+    buffers->forward(masks + start * input_channels,
+                     values + start * input_channels,
+                     output_pol + start * pol_size,
+                     output_val + start * val_size, size);
+  }
+  release_buffers(std::move(buffers));
+}
+
+void OpenCL_Network::add_profile(const std::vector<ProfiledCommand>& commands,
+                                 int batch_size) const {
+  std::string profile;
+  {
+    std::lock_guard<std::mutex> lock(m_profile_mutex);
+    m_layer_profile.resize(m_layers.size());
+    for (const auto& command : commands) {
+      // Nanoseconds of the device clock.
+      const auto start =
+          command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      const auto end =
+          command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+      const double us = (end - start) / 1000.0;
+      auto& layer = m_layer_profile[command.layer];
+      layer.total_us += us;
+      layer.count++;
+      auto& kernel = m_kernel_profile[command.name];
+      kernel.total_us += us;
+      kernel.count++;
+    }
+    m_profiled_batches++;
+    m_profiled_positions += batch_size;
+
+    const auto interval = m_opencl.m_params.profile_interval;
+    const auto now = std::chrono::steady_clock::now();
+    if (interval > 0 &&
+        now - m_last_profile >= std::chrono::seconds(interval)) {
+      m_last_profile = now;
+      profile = profile_string();
+    }
+  }
+  if (!profile.empty()) std::cerr << profile;
+}
+
+std::string OpenCL_Network::profile_string() const {
+  const double batches = std::max<std::uint64_t>(m_profiled_batches, 1);
+  double total_us = 0.0;
+  for (const auto& layer : m_layer_profile) total_us += layer.total_us;
+  total_us = std::max(total_us, 1e-9);
+
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(1);
+  oss << "OpenCL profile of " << m_profiled_batches << " batches, "
+      << m_profiled_positions / batches << " positions and "
+      << total_us / batches << " us on the device per batch:\n";
+  for (size_t i = 0; i < m_layer_profile.size(); i++) {
+    const auto& time = m_layer_profile[i];
+    if (time.count == 0) continue;
+    const auto& layer = m_layers[i];
+    std::string name;
+    if (layer.is_input_convolution) {
+      name = "input";
+    } else if (layer.is_residual_block) {
+      name = "residual " + std::to_string(i);
+    } else {
+      name = "heads";
+    }
+    oss << "  layer " << std::left << std::setw(28) << name << std::right
+        << std::setw(10) << time.total_us / batches << " us per batch "
+        << std::setw(5) << 100.0 * time.total_us / total_us << "%\n";
+  }
+  for (const auto& entry : m_kernel_profile) {
+    const auto& time = entry.second;
+    oss << "  kernel " << std::left << std::setw(27) << entry.first
+        << std::right << std::setw(10) << time.total_us / batches
+        << " us per batch " << std::setw(5)
+        << 100.0 * time.total_us / total_us << "%, "
+        << time.count / batches << " launches of "
+        << time.total_us / time.count << " us\n";
+  }
+  return oss.str();
+}
+
+std::unique_ptr<OpenCLBuffers> OpenCL_Network::acquire_buffers() const {
+  std::lock_guard<std::mutex> lock(m_pool_mutex);
+  if (m_free_buffers.empty()) return std::make_unique<OpenCLBuffers>(*this);
+  auto buffers = std::move(m_free_buffers.front());
+  m_free_buffers.pop_front();
+  return buffers;
+}
+
+void OpenCL_Network::release_buffers(
+    std::unique_ptr<OpenCLBuffers> buffers) const {
+  std::lock_guard<std::mutex> lock(m_pool_mutex);
+  m_free_buffers.push_back(std::move(buffers));
+}
+
+namespace {
+
+template <class T>
+std::string opencl_dev_type_to_string(T type) {
+  if (type == CL_DEVICE_TYPE_CPU) {
+    return "CPU";
+  } else if (type == CL_DEVICE_TYPE_GPU) {
+    return "GPU";
+  } else if (type == CL_DEVICE_TYPE_ACCELERATOR) {
+    return "Accelerator";
+  } else {
+    return "Unknown";
+  }
+}
+
+std::string trim(std::string trim_me) {
+  const auto space = [](unsigned char c) { return std::isspace(c); };
+  trim_me.erase(trim_me.begin(),
+                std::find_if_not(trim_me.begin(), trim_me.end(), space));
+  trim_me.erase(std::find_if_not(trim_me.rbegin(), trim_me.rend(), space).base(),
+                trim_me.end());
+  return trim_me;
+}
+
+bool icontains(std::string haystack, std::string needle) {
+  const auto lower = [](unsigned char c) { return std::tolower(c); };
+  std::transform(haystack.begin(), haystack.end(), haystack.begin(), lower);
+  std::transform(needle.begin(), needle.end(), needle.begin(), lower);
+  return haystack.find(needle) != std::string::npos;
+}
+
+}  // namespace
+
+void OpenCL::process_tuners(const std::string& tuners) {
+  std::string buf;
+  std::stringstream ss(tuners);
+  std::size_t found;
+
+  auto mwg = false;
+  auto nwg = false;
+  auto kwg = false;
+  auto ndimc = false;
+  auto mdimc = false;
+  auto vwm = false;
+  auto vwn = false;
+  while (ss >> buf) {
+    found = buf.find("=");
+    if (found == std::string::npos) {
+      throw Exception("Invalid tuner string: " + tuners);
+    }
+    std::string name = buf.substr(0, found);
+    auto value = std::stoi(buf.substr(found + 1, std::string::npos));
+    if (name == "-DMWG") {
+      m_sgemm_tuners.mwg = value;
+      mwg = true;
+    }
+    if (name == "-DNWG") {
+      m_sgemm_tuners.nwg = value;
+      nwg = true;
+    }
+    if (name == "-DKWG") {
+      m_sgemm_tuners.kwg = value;
+      kwg = true;
+    }
+    if (name == "-DMDIMC") {
+      m_sgemm_tuners.mdimc = value;
+      mdimc = true;
+    }
+    if (name == "-DNDIMC") {
+      m_sgemm_tuners.ndimc = value;
+      ndimc = true;
+    }
+    if (name == "-DVWM") {
+      m_sgemm_tuners.vwm = value;
+      vwm = true;
+    }
+    if (name == "-DVWN") {
+      m_sgemm_tuners.vwn = value;
+      vwn = true;
+    }
+  }
+  if (!mwg || !nwg || !kwg || !mdimc || !ndimc || !vwm || !vwn) {
+    std::string missing;
+    if (!mwg) missing += " MWG";
+    if (!nwg) missing += " NWG";
+    if (!kwg) missing += " KWG";
+    if (!mdimc) missing += " MDIMC";
+    if (!ndimc) missing += " NDIMC";
+    if (!vwm) missing += " VWM";
+    if (!vwn) missing += " VWN";
+    throw Exception("Missing tuner parameters" + missing);
+  }
+}
+
+std::vector<size_t> OpenCL::get_sgemm_tuners() {
+  std::vector<size_t> tuners;
+
+  tuners.emplace_back(m_sgemm_tuners.mwg);
+  tuners.emplace_back(m_sgemm_tuners.nwg);
+  tuners.emplace_back(m_sgemm_tuners.kwg);
+  tuners.emplace_back(m_sgemm_tuners.vwm);
+  tuners.emplace_back(m_sgemm_tuners.vwn);
+  tuners.emplace_back(m_sgemm_tuners.mdimc);
+  tuners.emplace_back(m_sgemm_tuners.ndimc);
+
+  return tuners;
+}
+
+void OpenCL::initialize(const int channels, const OpenCLParams& params) {
+  m_params = params;
+  const auto verbose = params.verbose;
+
+  std::vector<cl::Platform> platforms;
+  try {
+    cl::Platform::get(&platforms);
+  } catch (const cl::Error& e) {
+    throw Exception(std::string("OpenCL: ") + e.what());
+  }
+
+  auto best_version = 0.0f;
+  cl::Platform best_platform;
+  cl::Device best_device;
+  std::string best_vendor;
+  auto best_score = 0;
+  auto found_device = false;
+  auto id = 0;
+
+  if (verbose) {
+    std::cerr << "Detected " << platforms.size() << " OpenCL platforms."
+              << std::endl;
+  }
+
+  for (const auto& p : platforms) {
+    std::string platvers = p.getInfo<CL_PLATFORM_VERSION>();
+    if (verbose) {
+      std::cerr << "Platform version: " << platvers << std::endl;
+      std::cerr << "Platform profile: " << p.getInfo<CL_PLATFORM_PROFILE>()
+                << std::endl;
+      std::cerr << "Platform name:    " << p.getInfo<CL_PLATFORM_NAME>()
+                << std::endl;
+      std::cerr << "Platform vendor:  " << p.getInfo<CL_PLATFORM_VENDOR>()
+                << std::endl;
+    }
+
+    std::istringstream versstream(platvers);
+    std::string tmp;
+    float opencl_version;
+    versstream >> tmp >> opencl_version;
+
+    std::vector<cl::Device> devices;
+    try {
+      p.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    } catch (const cl::Error& e) {
+      std::cerr << "Error getting device(s): " << e.what() << ": " << e.err()
+                << std::endl;
+      devices.clear();
+    }
+    for (auto& d : devices) {
+      if (verbose) {
+        std::cerr << "Device ID:     " << id << std::endl;
+        std::cerr << "Device name:   " << trim(d.getInfo<CL_DEVICE_NAME>())
+                  << std::endl;
+        std::cerr << "Device type:   "
+                  << opencl_dev_type_to_string(d.getInfo<CL_DEVICE_TYPE>())
+                  << std::endl;
+        std::cerr << "Device vendor: " << d.getInfo<CL_DEVICE_VENDOR>()
+                  << std::endl;
+        std::cerr << "Device driver: " << d.getInfo<CL_DRIVER_VERSION>()
+                  << std::endl;
+        std::cerr << "Device speed:  "
+                  << d.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>() << " MHz"
+                  << std::endl;
+        std::cerr << "Device cores:  "
+                  << d.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() << " CU"
+                  << std::endl;
+      }
+
+      // assign score, try to find best device
+      int this_score = 0;
+      std::string this_vendor = d.getInfo<CL_DEVICE_VENDOR>();
+      this_score += 1000 * icontains(this_vendor, "advanced micro devices");
+      this_score += 1000 * icontains(this_vendor, "amd");
+      this_score += 1000 * icontains(this_vendor, "nvidia");
+      this_score += 500 * icontains(this_vendor, "intel");
+      this_score += 100 * (d.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU);
+      this_score += opencl_version * 10;
+      if (verbose) {
+        std::cerr << "Device score:  " << this_score << std::endl;
+      }
+
+      bool preferred = params.gpu_id == id;
+
+      if ((this_score > best_score) || preferred) {
+        best_version = opencl_version;
+        best_platform = p;
+        best_device = d;
+        best_vendor = this_vendor;
+        if (preferred) {
+          best_score = std::numeric_limits<decltype(best_score)>::max();
+        } else {
+          best_score = this_score;
+        }
+        found_device = true;
+      }
+      id++;
+    }
+  }
+
+  if (!found_device) {
+    throw Exception("No suitable OpenCL device found.");
+  }
+
+  std::cerr << "Selected platform: "
+            << best_platform.getInfo<CL_PLATFORM_NAME>() << std::endl;
+  std::cerr << "Selected device: " << trim(best_device.getInfo<CL_DEVICE_NAME>())
+            << std::endl;
+  std::cerr << "with OpenCL " << best_version << " capability." << std::endl;
+
+  cl::Context context;
+  try {
+    context = cl::Context(best_device);
+  } catch (const cl::Error& e) {
+    throw Exception(std::string("Error creating OpenCL context: ") + e.what() +
+                    ": " + std::to_string(e.err()));
+  }
+  m_context = context;
+  m_device = best_device;
+
+  // Make program of the source code in the context
+  try {
+    m_program = cl::Program(m_context,
+                            sourceCode_input + sourceCode_heads +
+                                sourceCode_convolve3 + sourceCode_sgemm +
+                                sourceCode_sgemv);
+  } catch (const cl::Error& e) {
+    throw Exception(std::string("Error getting OpenCL kernels: ") + e.what() +
+                    ": " + std::to_string(e.err()));
+  }
+
+  m_cl_args = cl_args;
+
+  // The Winograd tiles of a whole batch go through the SGEMM at once, so it
+  // is tuned for the largest batch.
+  auto t = Tuner(*this, m_params);
+  auto sgemm_tuners = t.load_sgemm_tuners(
+      channels, params.max_batch_size * kWinogradP, channels, kWinogradTile);
+
+  // Build program for these specific devices
+  try {
+    std::string args = m_cl_args;
+    args += sgemm_tuners;
+    m_program.build(args.c_str());
+  } catch (const cl::Error&) {
+    std::cerr << "Error building kernels: "
+              << m_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_device)
+              << std::endl;
+    throw Exception("Error building OpenCL kernels.");
+  }
+
+  process_tuners(sgemm_tuners);
+
+  m_wavefront_size =
+      cl::Kernel(m_program, "XgemmBatched")
+          .getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
+              best_device);
+  m_max_workgroup_size = best_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+  m_max_workgroup_dims = best_device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+  if (verbose) {
+    std::cerr << "Wavefront/Warp size: " << m_wavefront_size << std::endl;
+    std::cerr << "Max workgroup size: " << m_max_workgroup_size << std::endl;
+    std::cerr << "Max workgroup dimensions:";
+    for (auto d : m_max_workgroup_dims) std::cerr << " " << d;
+    std::cerr << std::endl;
+  }
+
+  m_init_ok = true;
+}
+
+std::string OpenCL::get_device_name() {
+  std::stringstream ss;
+
+  ss << "OpenCL: ";
+  ss << m_device.getInfo<CL_DEVICE_VENDOR>() << " ";
+  ss << m_device.getInfo<CL_DEVICE_NAME>() << " @ ";
+  ss << m_device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>() << "MHz";
+
+  return ss.str();
+}
+
+std::string OpenCL::get_driver_version() {
+  return trim(m_device.getInfo<CL_DRIVER_VERSION>());
+}
+
+}  // namespace lczero
@@ -0,0 +1,308 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2017 Gian-Carlo Pascutto
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#define CL_HPP_MINIMUM_OPENCL_VERSION 110
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_ENABLE_EXCEPTIONS
+#include <CL/cl2.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "neural/opencl/OpenCLParams.h"
+#include "neural/opencl/OpenCLTuner.h"
+
+namespace lczero {
+
+// F(2x2, 3x3) Winograd convolutions: 4x4 input tiles, 2x2 output tiles and
+// 16 of those on a board.
+static constexpr auto kWinogradAlpha = 4;
+static constexpr auto kWinogradTile = kWinogradAlpha * kWinogradAlpha;
+static constexpr auto kWinogradP = 8 * 8 / 4;
+
+inline size_t ceilMultiple(size_t a, size_t b) {
+  if (a % b == 0) return a;
+  return a + (b - a % b);
+}
+
+class OpenCL;
+class OpenCL_Network;
+
+class Layer {
+  friend class OpenCL_Network;
+  friend class OpenCLBuffers;
+
+ private:
+  unsigned int channels{0};
+  unsigned int outputs{0};
+  unsigned int filter_size{0};
+  unsigned int ip_in_size{0};
+  unsigned int ip_out_size{0};
+  bool is_input_convolution{false};
+  bool is_residual_block{false};
+  bool is_policy{false};
+  bool is_value{false};
+  std::vector<cl::Buffer> weights;
+};
+
+// A command of a batch when profiling: kernel or transfer, and the index of
+// the layer it belongs to.
+struct ProfiledCommand {
+  const char* name;
+  int layer;
+  cl::Event event;
+};
+
+// What a computation needs on the device: its own queue, kernels (their
+// arguments are set per launch) and buffers for batches of up to
+// max_batch_size positions. With several of them, computations overlap on
+// the device.
+class OpenCLBuffers {
+  friend class OpenCL_Network;
+
+ public:
+  explicit OpenCLBuffers(const OpenCL_Network& opencl_net);
+
+  // Runs @batch_size positions, of kInputPlanes planes each, through the
+  // network: their policy to @output_pol and the output of the first value
+  // layer to @output_val.
+  void forward(const std::uint64_t* masks, const float* values,
+               float* output_pol, float* output_val, int batch_size);
+
+ private:
+  using weight_slice_t = std::vector<cl::Buffer>::const_iterator;
+
+  void convolve3(int channels, int outputs, int batch_size,
+                 cl::Buffer& bufferIn, cl::Buffer& bufferOut,
+                 cl::Buffer& bufferV, cl::Buffer& bufferM,
+                 weight_slice_t weights, cl::Buffer* bufferResidual,
+                 weight_slice_t biases, bool skip_in_transform,
+                 bool fuse_in_transform, bool store_inout);
+
+  // Expands the planes, a 64 bit mask of the set squares and the value of
+  // those squares for each plane.
+  void expand_input(int channels, int batch_size);
+
+  // The 1x1 convolutions of the policy and value heads.
+  void heads(int channels, int pol_outputs, int val_outputs, int batch_size,
+             cl::Buffer& bufferInput, cl::Buffer& bufferOutput,
+             weight_slice_t pol_weights, weight_slice_t val_weights);
+
+  void innerproduct(cl::Buffer& input, int input_offset, int input_stride,
+                    weight_slice_t weights, weight_slice_t biases,
+                    cl::Buffer& output, int output_offset, int output_stride,
+                    int inputs, int outputs, bool relu, int batch_size);
+
+  // The event to pass for the next command, which is @name of the current
+  // layer. nullptr when not profiling.
+  cl::Event* profile_event(const char* name);
+
+  const OpenCL_Network& m_opencl_net;
+  const OpenCL& m_opencl;
+
+  cl::CommandQueue m_commandqueue;
+  cl::Kernel m_expand_input_kernel;
+  cl::Kernel m_heads_kernel;
+  cl::Kernel m_in_transform_kernel;
+  cl::Kernel m_sgemm_kernel;
+  cl::Kernel m_sgemv_kernel;
+  cl::Kernel m_out_transform_bias_kernel;
+  cl::Kernel m_out_transform_bias_in_kernel;
+  cl::Buffer m_inBuffer;
+  cl::Buffer m_inBuffer2;
+  cl::Buffer m_VBuffer;
+  cl::Buffer m_MBuffer;
+  // The planes as computations add them, and expanded to the input of the
+  // network.
+  cl::Buffer m_masksBuffer;
+  cl::Buffer m_valuesBuffer;
+  cl::Buffer m_expandedInput;
+  // The policy and then the value of each position.
+  cl::Buffer m_outBuffer;
+  std::vector<float> m_out;
+
+  // The commands of the current batch, when profiling.
+  std::vector<ProfiledCommand> m_profiled;
+  int m_profile_layer{0};
+};
+
+class OpenCL_Network {
+ public:
+  OpenCL_Network(OpenCL& opencl) : m_opencl(opencl) {}
+  ~OpenCL_Network();
+  OpenCL& getOpenCL() { return m_opencl; }
+
+  void push_input_convolution(unsigned int filter_size, unsigned int channels,
+                              unsigned int outputs,
+                              const std::vector<float>& weights,
+                              const std::vector<float>& biases) {
+    size_t layer = get_layer_count();
+    push_weights(layer, weights);
+    push_weights(layer, biases);
+    m_layers[layer].is_input_convolution = true;
+    m_layers[layer].outputs = outputs;
+    m_layers[layer].filter_size = filter_size;
+    m_layers[layer].channels = channels;
+  }
+
+  void push_residual(unsigned int filter_size, unsigned int channels,
+                     unsigned int outputs, const std::vector<float>& weights_1,
+                     const std::vector<float>& biases_1,
+                     const std::vector<float>& weights_2,
+                     const std::vector<float>& biases_2) {
+    size_t layer = get_layer_count();
+    push_weights(layer, weights_1);
+    push_weights(layer, biases_1);
+    push_weights(layer, weights_2);
+    push_weights(layer, biases_2);
+    m_layers[layer].is_residual_block = true;
+    m_layers[layer].outputs = outputs;
+    m_layers[layer].filter_size = filter_size;
+    m_layers[layer].channels = channels;
+  }
+
+  void push_policy(unsigned int channels, unsigned int outputs,
+                   unsigned int ip_in, unsigned int ip_out,
+                   const std::vector<float>& weights,
+                   const std::vector<float>& biases,
+                   const std::vector<float>& fc_w,
+                   const std::vector<float>& fc_b) {
+    size_t layer = get_layer_count();
+    push_weights(layer, weights);
+    push_weights(layer, biases);
+    push_weights(layer, fc_w);
+    push_weights(layer, fc_b);
+    m_layers[layer].is_policy = true;
+    m_layers[layer].outputs = outputs;
+    m_layers[layer].channels = channels;
+    m_layers[layer].ip_in_size = ip_in;
+    m_layers[layer].ip_out_size = ip_out;
+  }
+
+  void push_value(unsigned int channels, unsigned int outputs,
+                  unsigned int ip_in, unsigned int ip_out,
+                  const std::vector<float>& weights,
+                  const std::vector<float>& biases,
+                  const std::vector<float>& fc_w,
+                  const std::vector<float>& fc_b) {
+    size_t layer = get_layer_count();
+    push_weights(layer, weights);
+    push_weights(layer, biases);
+    push_weights(layer, fc_w);
+    push_weights(layer, fc_b);
+    m_layers[layer].is_value = true;
+    m_layers[layer].outputs = outputs;
+    m_layers[layer].channels = channels;
+    m_layers[layer].ip_in_size = ip_in;
+    m_layers[layer].ip_out_size = ip_out;
+  }
+
+  size_t get_layer_count() const { return m_layers.size(); }
+
+  // Like OpenCLBuffers::forward(), for any batch size. Batches larger than
+  // max_batch_size go through in parts.
+  void forward(const std::uint64_t* masks, const float* values,
+               float* output_pol, float* output_val, int batch_size) const;
+
+ private:
+  friend class OpenCLBuffers;
+
+  void push_weights(size_t layer, const std::vector<float>& weights) {
+    add_weights(layer, weights.size(), weights.data());
+  }
+  void add_weights(size_t layer, size_t size, const float* weights);
+
+  std::unique_ptr<OpenCLBuffers> acquire_buffers() const;
+  void release_buffers(std::unique_ptr<OpenCLBuffers> buffers) const;
+
+  // Adds the times of the finished @commands of a batch to the profile.
+  void add_profile(const std::vector<ProfiledCommand>& commands,
+                   int batch_size) const;
+  // Average time of every layer and kernel per batch. Must be called with
+  // m_profile_mutex held.
+  std::string profile_string() const;
+
+  OpenCL& m_opencl;
+  std::vector<Layer> m_layers;
+
+  mutable std::mutex m_pool_mutex;
+  mutable std::list<std::unique_ptr<OpenCLBuffers>> m_free_buffers;
+  mutable std::mutex m_queue_finish_mutex;
+
+  struct ProfileTime {
+    double total_us{0.0};
+    std::uint64_t count{0};
+  };
+  mutable std::mutex m_profile_mutex;
+  mutable std::vector<ProfileTime> m_layer_profile;
+  mutable std::map<std::string, ProfileTime> m_kernel_profile;
+  mutable std::uint64_t m_profiled_batches{0};
+  mutable std::uint64_t m_profiled_positions{0};
+  mutable std::chrono::steady_clock::time_point m_last_profile{
+      std::chrono::steady_clock::now()};
+};
+
+class OpenCL {
+  friend class OpenCL_Network;
+  friend class OpenCLBuffers;
+  friend class Tuner;
+
+ public:
+  void initialize(int channels, const OpenCLParams& params);
+  std::string get_device_name();
+  std::string get_driver_version();
+
+  std::vector<size_t> get_sgemm_tuners();
+
+  int get_max_batch_size() const { return m_params.max_batch_size; }
+
+  cl::Device m_device;
+  cl::Context m_context;
+
+ private:
+  void process_tuners(const std::string& tuners);
+
+  OpenCLParams m_params;
+  cl::Program m_program;
+  std::string m_cl_args;
+
+  struct sgemm_tuners {
+    size_t mwg, nwg, kwg;
+    size_t vwm, vwn;
+    size_t mdimc, ndimc;
+  };
+  sgemm_tuners m_sgemm_tuners;
+  size_t m_wavefront_size{0};
+  size_t m_max_workgroup_size{0};
+  std::vector<size_t> m_max_workgroup_dims;
+  bool m_init_ok{false};
+};
+
+extern const std::string sourceCode_sgemm;
+
+}  // namespace lczero
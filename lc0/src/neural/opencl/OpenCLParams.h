@@ -0,0 +1,45 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+namespace lczero {
+
+// What the backend options of the OpenCL backend set, in place of the cfg_
+// globals of the Leela Zero code it comes from.
+struct OpenCLParams {
+  // The device to use, -1 for the best scoring one.
+  int gpu_id = -1;
+  // Largest batch that goes through the network in one go, and that the
+  // SGEMM is tuned for. Larger batches are split.
+  int max_batch_size = 256;
+  // Prints the platforms and devices found.
+  bool verbose = false;
+  // Tunes even if there is a tuning for the device.
+  bool force_tune = false;
+  // Tunes over all parameters rather than a subset.
+  bool tune_exhaustive = false;
+  // Times the kernels and transfers of every batch on the device, and prints
+  // their averages per layer and per kernel when the network goes away.
+  bool profile = false;
+  // Also prints the profile this often while profiling, in seconds. Never
+  // if 0.
+  int profile_interval = 0;
+};
+
+}  // namespace lczero
@@ -0,0 +1,70 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2017 Gian-Carlo Pascutto
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "neural/opencl/OpenCLParams.h"
+
+namespace lczero {
+
+using Configurations = std::pair<std::string, std::vector<size_t>>;
+using TuneParameters = std::map<std::string, size_t>;
+
+class OpenCL;
+
+// Finds the fastest parameters of the XgemmBatched kernel for a device, and
+// keeps them in a file across runs, one line per device and matrix size:
+//   version;kernel;m;n;k;batch_size;tuners;device;driver
+class Tuner {
+ public:
+  static constexpr auto kTunerVersion = 1;
+
+  Tuner(OpenCL& opencl, const OpenCLParams& params)
+      : opencl_(opencl), params_(params) {}
+
+  // The tuned parameters as compiler defines, "-DMWG=32 -DNWG=64 ...".
+  std::string load_sgemm_tuners(int m, int n, int k, int batch_size);
+
+ private:
+  std::string load_or_tune_sgemm(int m, int n, int k, int batch_size);
+  std::string tune_sgemm(int m, int n, int k, int batch_size, int runs = 4);
+  void store_sgemm_tuners(int m, int n, int k, int batch_size,
+                          const std::string& tuners);
+  bool valid_config_sgemm(TuneParameters p, bool exhaustive);
+  std::string parameters_to_defines(const TuneParameters& p);
+  std::string parameters_to_string(const TuneParameters& p);
+  TuneParameters get_parameters_by_int(const std::vector<Configurations>& opts,
+                                       int n);
+  std::string get_device_key();
+  std::string get_tuning_line_prefix(int m, int n, int k, int batch_size);
+  std::string sgemm_tuners_from_line(const std::string& line, int m, int n,
+                                     int k, int batch_size);
+  std::string sgemm_tuners_from_file(const std::string& filename, int m, int n,
+                                     int k, int batch_size);
+
+  OpenCL& opencl_;
+  const OpenCLParams& params_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,210 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/remote.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "utils/exception.h"
+
+namespace lczero {
+
+namespace {
+uint64_t HashVec(uint64_t hash, const Weights::Vec& vec) {
+  // FNV-1a over the bytes, with the size first so that the split of the
+  // weights into vectors counts too.
+  const auto add = [&hash](const void* data, size_t size) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+  };
+  const uint64_t size = vec.size();
+  add(&size, sizeof(size));
+  add(vec.data(), vec.size() * sizeof(float));
+  return hash;
+}
+
+uint64_t HashConvBlock(uint64_t hash, const Weights::ConvBlock& block) {
+  hash = HashVec(hash, block.weights);
+  hash = HashVec(hash, block.biases);
+  hash = HashVec(hash, block.bn_means);
+  return HashVec(hash, block.bn_stddivs);
+}
+
+[[noreturn]] void ThrowErrno(const std::string& what) {
+  throw Exception(what + ": " + std::strerror(errno));
+}
+
+// Sets the options of a connected socket.
+void SetConnectionOptions(int fd) {
+  // Batches are sent in one go and waited for, so don't hold them back.
+  const int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  // No SIGPIPE when the peer is gone, where send() has no MSG_NOSIGNAL.
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+// macOS, SO_NOSIGPIPE is set instead.
+const int kSendFlags = 0;
+#endif
+}  // namespace
+
+uint64_t HashWeights(const Weights& weights) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = HashConvBlock(hash, weights.input);
+  for (const auto& residual : weights.residual) {
+    hash = HashConvBlock(hash, residual.conv1);
+    hash = HashConvBlock(hash, residual.conv2);
+  }
+  hash = HashConvBlock(hash, weights.policy);
+  hash = HashVec(hash, weights.ip_pol_w);
+  hash = HashVec(hash, weights.ip_pol_b);
+  hash = HashConvBlock(hash, weights.value);
+  hash = HashVec(hash, weights.ip1_val_w);
+  hash = HashVec(hash, weights.ip1_val_b);
+  hash = HashVec(hash, weights.ip2_val_w);
+  return HashVec(hash, weights.ip2_val_b);
+}
+
+Socket& Socket::operator=(Socket&& other) {
+  if (this != &other) {
+    Close();
+    fd_ = other.fd_;
+    other.fd_ = -1;
+  }
+  return *this;
+}
+
+Socket Socket::Connect(const std::string& host, int port) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses = nullptr;
+  const int error = getaddrinfo(host.c_str(), std::to_string(port).c_str(),
+                                &hints, &addresses);
+  if (error != 0) {
+    throw Exception("Cannot resolve " + host + ": " + gai_strerror(error));
+  }
+  Socket result;
+  for (addrinfo* addr = addresses; addr; addr = addr->ai_next) {
+    Socket socket(::socket(addr->ai_family, addr->ai_socktype,
+                           addr->ai_protocol));
+    if (!socket.IsOpen()) continue;
+    if (connect(socket.fd_, addr->ai_addr, addr->ai_addrlen) == 0) {
+      result = std::move(socket);
+      break;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (!result.IsOpen()) {
+    ThrowErrno("Cannot connect to " + host + ":" + std::to_string(port));
+  }
+  SetConnectionOptions(result.fd_);
+  return result;
+}
+
+Socket Socket::Listen(int port) {
+  Socket socket(::socket(AF_INET6, SOCK_STREAM, 0));
+  if (!socket.IsOpen()) ThrowErrno("Cannot create socket");
+  const int one = 1;
+  setsockopt(socket.fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  // Takes IPv4 connections too.
+  const int zero = 0;
+  setsockopt(socket.fd_, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  sockaddr_in6 addr = {};
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if (bind(socket.fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    ThrowErrno("Cannot bind port " + std::to_string(port));
+  }
+  if (listen(socket.fd_, SOMAXCONN) != 0) ThrowErrno("Cannot listen");
+  return socket;
+}
+
+int Socket::GetPort() const {
+  sockaddr_in6 addr = {};
+  socklen_t size = sizeof(addr);
+  if (getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &size) != 0) {
+    ThrowErrno("Cannot get the port");
+  }
+  return ntohs(addr.sin6_port);
+}
+
+Socket Socket::Accept() {
+  while (true) {
+    Socket socket(accept(fd_, nullptr, nullptr));
+    if (socket.IsOpen()) {
+      SetConnectionOptions(socket.fd_);
+      return socket;
+    }
+    if (errno != EINTR && errno != ECONNABORTED) ThrowErrno("Cannot accept");
+  }
+}
+
+void Socket::SendAll(const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    // No SIGPIPE when the peer is gone, the error is thrown instead.
+    const ssize_t sent = send(fd_, bytes, size, kSendFlags);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      ThrowErrno("Cannot send");
+    }
+    bytes += sent;
+    size -= sent;
+  }
+}
+
+bool Socket::RecvAll(void* data, size_t size) {
+  char* bytes = static_cast<char*>(data);
+  bool received = false;
+  while (size > 0) {
+    const ssize_t count = recv(fd_, bytes, size, 0);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      ThrowErrno("Cannot receive");
+    }
+    if (count == 0) {
+      if (!received) return false;
+      throw Exception("Connection closed in the middle of a message");
+    }
+    received = true;
+    bytes += count;
+    size -= count;
+  }
+  return true;
+}
+
+void Socket::Close() {
+  if (fd_ >= 0) close(fd_);
+  fd_ = -1;
+}
+
+}  // namespace lczero
@@ -0,0 +1,86 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "neural/network.h"
+
+namespace lczero {
+
+// Protocol between the "remote" backend and "lc0 serve", over TCP. Both ends
+// have to be the same byte order.
+//
+// On connect the server sends a RemoteHello. Then the client sends requests
+// and the server answers each of them in turn:
+//   request:  RemoteBatchHeader, uint64 masks[batch_size * kInputPlanes],
+//             float values[batch_size * kInputPlanes],
+//   response: RemoteBatchHeader, float q[batch_size],
+//             fp16 policy[batch_size * kRemotePolicySize].
+const uint32_t kRemoteMagic = 0x5230434c;  // "LC0R"
+const uint32_t kRemoteVersion = 1;
+const int kRemotePolicySize = 1858;
+// Larger batches are taken for a broken stream.
+const uint32_t kRemoteMaxBatch = 65536;
+
+struct RemoteHello {
+  uint32_t magic;
+  uint32_t version;
+  // HashWeights() of the served network, so that a client doesn't search
+  // with another network than it loaded.
+  uint64_t weights_hash;
+};
+
+struct RemoteBatchHeader {
+  uint32_t magic;
+  uint32_t batch_size;
+};
+
+uint64_t HashWeights(const Weights& weights);
+
+// Thin wrappers of blocking sockets, which throw Exception on errors.
+class Socket {
+ public:
+  Socket() = default;
+  explicit Socket(int fd) : fd_(fd) {}
+  Socket(Socket&& other) : fd_(other.fd_) { other.fd_ = -1; }
+  Socket& operator=(Socket&& other);
+  ~Socket() { Close(); }
+
+  // Connects to @host:@port, with Nagle's algorithm off.
+  static Socket Connect(const std::string& host, int port);
+  // Listens on @port of all interfaces, or on a free one for 0.
+  static Socket Listen(int port);
+  // The port a listening socket is bound to.
+  int GetPort() const;
+  // Waits for a connection to a listening socket.
+  Socket Accept();
+
+  void SendAll(const void* data, size_t size);
+  // Returns false if the peer closed the connection before sending anything.
+  bool RecvAll(void* data, size_t size);
+  void Close();
+  bool IsOpen() const { return fd_ >= 0; }
+
+ private:
+  int fd_ = -1;
+};
+
+}  // namespace lczero
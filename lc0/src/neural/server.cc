@@ -0,0 +1,140 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/server.h"
+
+#include <iostream>
+#include <numeric>
+#include <thread>
+#include <vector>
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "utils/exception.h"
+#include "utils/fp16_utils.h"
+
+namespace lczero {
+namespace {
+const char* kWeightsStr = "Network weights file path";
+const char* kNnBackendStr = "NN backend to use";
+const char* kNnBackendOptionsStr = "NN backend parameters";
+const char* kPortStr = "TCP port to serve on";
+
+const char* kAutoDiscover = "<autodiscover>";
+}  // namespace
+
+InferenceServer::InferenceServer() {
+  options_parser_.Add<StringOption>(kWeightsStr, "weights", 'w') =
+      kAutoDiscover;
+  const auto backends = NetworkFactory::Get()->GetBackendsList();
+  options_parser_.Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
+      backends.empty() ? "<none>" : backends[0];
+  options_parser_.Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
+  options_parser_.Add<IntOption>(kPortStr, 1, 65535, "port") = 9790;
+}
+
+void InferenceServer::Run() {
+  if (!options_parser_.ProcessAllFlags()) return;
+  const OptionsDict& options = options_parser_.GetOptionsDict();
+
+  InitializeNetwork();
+  Socket listener = Socket::Listen(options.Get<int>(kPortStr));
+  std::cerr << "Serving on port " << options.Get<int>(kPortStr) << std::endl;
+  while (true) {
+    // Connections live as long as their clients, so they aren't joined.
+    std::thread(
+        [this](Socket socket) {
+          ServeRemoteConnection(network_.get(), weights_hash_,
+                                std::move(socket));
+        },
+        listener.Accept())
+        .detach();
+  }
+}
+
+void InferenceServer::InitializeNetwork() {
+  const OptionsDict& options = options_parser_.GetOptionsDict();
+  std::string net_path = options.Get<std::string>(kWeightsStr);
+  if (net_path == kAutoDiscover) net_path = DiscoveryWeightsFile();
+  Weights weights = LoadWeightsFromFile(net_path);
+  weights_hash_ = HashWeights(weights);
+
+  OptionsDict network_options = OptionsDict::FromString(
+      options.Get<std::string>(kNnBackendOptionsStr), &options);
+
+  network_ = NetworkFactory::Get()->Create(
+      options.Get<std::string>(kNnBackendStr), weights, network_options);
+}
+
+void ServeRemoteConnection(Network* network, uint64_t weights_hash,
+                           Socket socket) {
+  std::vector<uint16_t> move_ids(kRemotePolicySize);
+  std::iota(move_ids.begin(), move_ids.end(), 0);
+  std::vector<uint64_t> masks;
+  std::vector<float> values;
+  std::vector<float> q;
+  std::vector<float> policy(kRemotePolicySize);
+  std::vector<uint16_t> policy_fp16;
+  try {
+    const RemoteHello hello{kRemoteMagic, kRemoteVersion, weights_hash};
+    socket.SendAll(&hello, sizeof(hello));
+    RemoteBatchHeader header;
+    while (socket.RecvAll(&header, sizeof(header))) {
+      if (header.magic != kRemoteMagic || header.batch_size == 0 ||
+          header.batch_size > kRemoteMaxBatch) {
+        throw Exception("Bad request");
+      }
+      const int batch_size = header.batch_size;
+      masks.resize(batch_size * kInputPlanes);
+      values.resize(batch_size * kInputPlanes);
+      if (!socket.RecvAll(masks.data(), masks.size() * sizeof(masks[0])) ||
+          !socket.RecvAll(values.data(), values.size() * sizeof(values[0]))) {
+        throw Exception("Truncated request");
+      }
+
+      auto computation = network->NewComputation();
+      for (int i = 0; i < batch_size; ++i) {
+        InputPlanes planes;
+        for (int j = 0; j < kInputPlanes; ++j) {
+          planes[j].mask = masks[i * kInputPlanes + j];
+          planes[j].value = values[i * kInputPlanes + j];
+        }
+        computation->AddInput(std::move(planes));
+      }
+      computation->ComputeBlocking();
+
+      q.resize(batch_size);
+      policy_fp16.resize(batch_size * kRemotePolicySize);
+      for (int i = 0; i < batch_size; ++i) {
+        q[i] = computation->GetQVal(i);
+        computation->GetPVals(i, move_ids.data(), kRemotePolicySize,
+                              policy.data());
+        for (int j = 0; j < kRemotePolicySize; ++j) {
+          policy_fp16[i * kRemotePolicySize + j] = FP32toFP16(policy[j]);
+        }
+      }
+      socket.SendAll(&header, sizeof(header));
+      socket.SendAll(q.data(), q.size() * sizeof(q[0]));
+      socket.SendAll(policy_fp16.data(),
+                     policy_fp16.size() * sizeof(policy_fp16[0]));
+    }
+  } catch (const std::exception& ex) {
+    std::cerr << "Connection dropped: " << ex.what() << std::endl;
+  }
+}
+
+}  // namespace lczero
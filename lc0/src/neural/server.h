@@ -0,0 +1,49 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <memory>
+#include "neural/network.h"
+#include "neural/remote.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+
+// Answers the requests of a "remote" backend on @socket with @network, until
+// the client disconnects. @weights_hash is the HashWeights() of its weights.
+void ServeRemoteConnection(Network* network, uint64_t weights_hash,
+                           Socket socket);
+
+// Computes batches of "remote" backends of other lc0 processes with a local
+// backend, so that search hosts without a GPU can share the GPUs of this one.
+// Every connection is served by a thread of its own.
+class InferenceServer {
+ public:
+  InferenceServer();
+  void Run();
+
+ private:
+  void InitializeNetwork();
+
+  std::unique_ptr<Network> network_;
+  uint64_t weights_hash_ = 0;
+  OptionsParser options_parser_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,129 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/shared_cache.h"
+
+#include <cstring>
+#include <sstream>
+#include "neural/cache.h"
+#include "utils/exception.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+
+#ifdef _WIN32
+
+SharedNNCache::SharedNNCache(uint64_t, int) {
+  throw Exception("Shared NNCache needs POSIX shared memory.");
+}
+
+SharedNNCache::~SharedNNCache() {}
+
+#else
+
+SharedNNCache::SharedNNCache(uint64_t network_hash, int entries) {
+  if (entries <= 0) throw Exception("Shared NNCache size must be positive.");
+  std::ostringstream name;
+  // With the size of a slot, in case its layout changes.
+  name << "/lc0-nncache-" << sizeof(Slot) << "-" << std::hex << network_hash;
+  name_ = name.str();
+
+  const int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) throw Exception("Unable to open shared memory " + name_);
+  // Whoever comes first sets the size, the others take it as it is.
+  flock(fd, LOCK_EX);
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if (ok && st.st_size == 0) {
+    ok = ftruncate(fd, static_cast<off_t>(entries) * sizeof(Slot)) == 0 &&
+         fstat(fd, &st) == 0;
+  }
+  flock(fd, LOCK_UN);
+  if (!ok || st.st_size < static_cast<off_t>(sizeof(Slot))) {
+    close(fd);
+    throw Exception("Unable to size shared memory " + name_);
+  }
+
+  mapped_ = st.st_size;
+  void* data =
+      mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw Exception("Unable to map shared memory " + name_);
+  }
+  // Zeroed by ftruncate(), which is a free slot of version 0.
+  slots_ = static_cast<Slot*>(data);
+  num_slots_ = mapped_ / sizeof(Slot);
+}
+
+SharedNNCache::~SharedNNCache() { munmap(slots_, mapped_); }
+
+#endif
+
+std::unique_ptr<CachedNNRequest> SharedNNCache::Lookup(uint64_t hash) const {
+  const Slot& slot = SlotFor(hash);
+  const uint64_t version = slot.version.load(std::memory_order_acquire);
+  if (version & 1) return nullptr;
+  if (slot.hash.load(std::memory_order_relaxed) != hash) return nullptr;
+  const int num_moves = slot.num_moves.load(std::memory_order_relaxed);
+  if (num_moves > kMaxMoves) return nullptr;
+
+  auto request = std::make_unique<CachedNNRequest>(num_moves);
+  const uint32_t q = slot.q.load(std::memory_order_relaxed);
+  std::memcpy(&request->q, &q, sizeof(q));
+  for (int i = 0; i < num_moves; ++i) {
+    request->p[i] = slot.p[i].load(std::memory_order_relaxed);
+  }
+  // A writer that started meanwhile changed the version.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot.version.load(std::memory_order_relaxed) != version) return nullptr;
+  return request;
+}
+
+void SharedNNCache::Insert(uint64_t hash, const CachedNNRequest& request) {
+  const int num_moves = request.p.size();
+  if (num_moves > kMaxMoves) return;
+  Slot& slot = SlotFor(hash);
+  uint64_t version = slot.version.load(std::memory_order_relaxed);
+  if (version & 1) return;
+  if (!slot.version.compare_exchange_strong(version, version + 1,
+                                            std::memory_order_relaxed)) {
+    return;
+  }
+  // Readers must not see the new contents with the old version.
+  std::atomic_thread_fence(std::memory_order_release);
+
+  uint32_t q;
+  std::memcpy(&q, &request.q, sizeof(q));
+  slot.hash.store(hash, std::memory_order_relaxed);
+  slot.q.store(q, std::memory_order_relaxed);
+  slot.num_moves.store(num_moves, std::memory_order_relaxed);
+  for (int i = 0; i < num_moves; ++i) {
+    slot.p[i].store(request.p[i], std::memory_order_relaxed);
+  }
+  slot.version.store(version + 2, std::memory_order_release);
+}
+
+}  // namespace lczero
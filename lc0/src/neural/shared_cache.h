@@ -0,0 +1,77 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace lczero {
+
+struct CachedNNRequest;
+
+// NN evaluations in POSIX shared memory, for all processes on the host which
+// use the same network, behind their own NNCaches. A fixed table of slots,
+// one for each hash, which the last insert of a hash overwrites.
+//
+// No locks: a slot has a version, odd while someone writes it. A reader
+// copies the slot and only takes the copy if the version was even and
+// didn't change meanwhile. A writer skips a slot someone else is writing.
+//
+// The memory stays in /dev/shm until it's removed or the host restarts, so
+// that later processes still find it.
+class SharedNNCache {
+ public:
+  // Attaches to the cache of the network with @network_hash, or creates it
+  // with room for @entries if no process has. Throws Exception if shared
+  // memory isn't there.
+  SharedNNCache(uint64_t network_hash, int entries);
+  ~SharedNNCache();
+
+  // nullptr if the cache doesn't have @hash.
+  std::unique_ptr<CachedNNRequest> Lookup(uint64_t hash) const;
+  // Positions with more moves than a slot has room for are not stored.
+  void Insert(uint64_t hash, const CachedNNRequest& request);
+
+  int GetCapacity() const { return num_slots_; }
+  const std::string& GetName() const { return name_; }
+
+ private:
+  static const int kMaxMoves = 117;
+  // Atomics all the way, as other processes write while this one reads.
+  struct Slot {
+    std::atomic<uint64_t> version;
+    std::atomic<uint64_t> hash;
+    // Bits of the float.
+    std::atomic<uint32_t> q;
+    std::atomic<uint16_t> num_moves;
+    std::atomic<uint16_t> p[kMaxMoves];
+  };
+  static_assert(sizeof(Slot) == 256, "Slot must fit into 4 cache lines");
+
+  Slot& SlotFor(uint64_t hash) const { return slots_[hash % num_slots_]; }
+
+  std::string name_;
+  Slot* slots_ = nullptr;
+  int num_slots_ = 0;
+  size_t mapped_ = 0;
+};
+
+}  // namespace lczero
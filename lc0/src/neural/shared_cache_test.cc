@@ -0,0 +1,93 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/shared_cache.h"
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include "neural/cache.h"
+
+namespace lczero {
+
+namespace {
+// A network of its own for every run, so that the tests don't find old
+// entries.
+uint64_t TestNetworkHash() { return 0x7e57000000000000ULL + getpid(); }
+
+std::unique_ptr<CachedNNRequest> MakeRequest(int moves, float q) {
+  auto request = std::make_unique<CachedNNRequest>(moves);
+  request->q = q;
+  for (int i = 0; i < moves; ++i) request->p[i] = i + moves;
+  return request;
+}
+}  // namespace
+
+TEST(SharedNNCache, SharedBetweenAttachments) {
+  SharedNNCache cache(TestNetworkHash(), 1000);
+  // Attaches rather than creates, whatever the size.
+  SharedNNCache other(TestNetworkHash(), 10);
+  EXPECT_EQ(other.GetCapacity(), 1000);
+
+  EXPECT_EQ(other.Lookup(42), nullptr);
+  cache.Insert(42, *MakeRequest(20, 0.25f));
+  const auto found = other.Lookup(42);
+  ASSERT_NE(found, nullptr);
+  EXPECT_EQ(found->q, 0.25f);
+  ASSERT_EQ(found->p.size(), 20);
+  for (int i = 0; i < 20; ++i) EXPECT_EQ(found->p[i], i + 20);
+
+  // Same slot, other hash.
+  EXPECT_EQ(other.Lookup(1042), nullptr);
+  // Too many moves to store.
+  cache.Insert(43, *MakeRequest(200, 0.5f));
+  EXPECT_EQ(other.Lookup(43), nullptr);
+
+  shm_unlink(cache.GetName().c_str());
+}
+
+// Readers never see a half written slot.
+TEST(SharedNNCache, ConcurrentWriters) {
+  SharedNNCache cache(TestNetworkHash() + 1, 16);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&cache, t]() {
+      for (int i = 0; i < 20000; ++i) {
+        const uint64_t hash = i % 64;
+        const int moves = 1 + (i + t) % 50;
+        if (t % 2) {
+          cache.Insert(hash, *MakeRequest(moves, moves));
+        } else if (auto found = cache.Lookup(hash)) {
+          const int size = found->p.size();
+          ASSERT_EQ(found->q, size);
+          for (int j = 0; j < size; ++j) ASSERT_EQ(found->p[j], j + size);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  shm_unlink(cache.GetName().c_str());
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -18,15 +18,109 @@
 
 #include "neural/writer.h"
 
+#include <zlib.h>
+#include <algorithm>
 #include <experimental/filesystem>
 #include <iomanip>
+#include <iostream>
+#include <limits>
 #include <sstream>
 #include "utils/commandline.h"
+#include "utils/exception.h"
 #include "utils/random.h"
 
 namespace lczero {
 
-TrainingDataWriter::TrainingDataWriter(int game_id) {
+namespace {
+void WriteFile(const std::string& filename, const std::string& data) {
+  gzFile file = gzopen(filename.c_str(), "wb");
+  if (!file) throw Exception("Cannot write training data to " + filename);
+  // Records of a game are written at once, as the compressor works on large
+  // buffers best.
+  const char* pos = data.data();
+  size_t size = data.size();
+  while (size > 0) {
+    const unsigned int part =
+        std::min<size_t>(size, std::numeric_limits<int>::max());
+    if (gzwrite(file, pos, part) != static_cast<int>(part)) {
+      gzclose(file);
+      throw Exception("Cannot write training data to " + filename);
+    }
+    pos += part;
+    size -= part;
+  }
+  if (gzclose(file) != Z_OK) {
+    throw Exception("Cannot write training data to " + filename);
+  }
+}
+
+template <typename T>
+void Append(const T& value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+}  // namespace
+
+const uint32_t V4TrainingData::kVersion;
+
+TrainingDataWriteQueue::TrainingDataWriteQueue()
+    : thread_([this]() { Worker(); }) {}
+
+TrainingDataWriteQueue::~TrainingDataWriteQueue() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void TrainingDataWriteQueue::Enqueue(std::string filename, std::string&& data,
+                                     std::function<void()> done) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back({std::move(filename), std::move(data), std::move(done)});
+  }
+  cv_.notify_all();
+}
+
+void TrainingDataWriteQueue::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return queue_.empty() && writing_ == 0; });
+}
+
+void TrainingDataWriteQueue::Worker() {
+  while (true) {
+    std::vector<File> files;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      // Stops only once everything is written.
+      if (queue_.empty()) break;
+      // Everything finished meanwhile is written in one go.
+      files.swap(queue_);
+      writing_ = files.size();
+    }
+    for (auto& file : files) {
+      try {
+        WriteFile(file.filename, file.data);
+      } catch (Exception& ex) {
+        std::cerr << ex.what() << std::endl;
+      }
+      // Frees the memory before the next file.
+      file.data = {};
+      if (file.done) file.done();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      writing_ = 0;
+    }
+    cv_.notify_all();
+  }
+}
+
+TrainingDataWriter::TrainingDataWriter(int game_id,
+                                       TrainingDataWriteQueue* queue)
+    : queue_(queue) {
   using namespace std::experimental::filesystem;
   static std::string directory =
       CommandLine::BinaryDirectory() + "/data-" + Random::Get().GetString(12);
@@ -35,14 +129,27 @@ TrainingDataWriter::TrainingDataWriter(int game_id) {
 
   std::ostringstream oss;
   oss << directory << '/' << "game_" << std::setfill('0') << std::setw(6)
-      << game_id;
+      << game_id << ".gz";
 
   filename_ = oss.str();
-  fout_.open(filename_.c_str(), std::ios::binary);
 }
 
-void TrainingDataWriter::WriteChunk(const V3TrainingData& data) {
-  fout_.write(reinterpret_cast<const char*>(&data), sizeof(data));
+void TrainingDataWriter::WriteChunk(const V4TrainingData& data) {
+  Append(V4TrainingData::kVersion, &data_);
+  Append(static_cast<uint16_t>(data.probabilities.size()), &data_);
+  data_.append(reinterpret_cast<const char*>(data.probabilities.data()),
+               data.probabilities.size() * sizeof(V4Probability));
+  Append(data.position, &data_);
+}
+
+void TrainingDataWriter::Finalize(std::function<void()> done) {
+  if (queue_) {
+    queue_->Enqueue(filename_, std::move(data_), std::move(done));
+  } else {
+    WriteFile(filename_, data_);
+    if (done) done();
+  }
+  data_.clear();
 }
 
-}  // namespace lczero
\ No newline at end of file
+}  // namespace lczero
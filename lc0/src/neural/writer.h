@@ -16,7 +16,13 @@
   along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <fstream>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include "utils/cppattributes.h"
 
 #pragma once
@@ -25,9 +31,21 @@ namespace lczero {
 
 #pragma pack(push, 1)
 
-struct V3TrainingData {
-  uint32_t version;
-  float probabilities[1858];
+// A V4 record is
+//   uint32_t version, which is 4,
+//   uint16_t number of probabilities,
+//   that many V4Probability, sorted by index,
+//   V4TrainingPosition.
+// Only the moves of the position have a probability, the others are 0.
+
+struct V4Probability {
+  uint16_t index;
+  // IEEE half precision.
+  uint16_t probability;
+} PACKED_STRUCT;
+static_assert(sizeof(V4Probability) == 4, "Wrong struct size");
+
+struct V4TrainingPosition {
   uint64_t planes[104];
   uint8_t castling_us_ooo;
   uint8_t castling_us_oo;
@@ -38,28 +56,72 @@ struct V3TrainingData {
   uint8_t rule50_count;
   int8_t result;
 } PACKED_STRUCT;
-static_assert(sizeof(V3TrainingData) == 8276, "Wrong struct size");
+static_assert(sizeof(V4TrainingPosition) == 840, "Wrong struct size");
 
 #pragma pack(pop)
 
+struct V4TrainingData {
+  static const uint32_t kVersion = 4;
+  std::vector<V4Probability> probabilities;
+  V4TrainingPosition position;
+};
+
+// Compresses and writes the files of finished games on a background thread,
+// so that game threads only serialize the chunks.
+class TrainingDataWriteQueue {
+ public:
+  TrainingDataWriteQueue();
+  // Writes what is queued before returning.
+  ~TrainingDataWriteQueue();
+
+  // Writes @data to @filename and then calls @done, on the background
+  // thread.
+  void Enqueue(std::string filename, std::string&& data,
+               std::function<void()> done);
+
+  // Blocks until everything enqueued so far is written.
+  void Wait();
+
+ private:
+  struct File {
+    std::string filename;
+    std::string data;
+    std::function<void()> done;
+  };
+
+  void Worker();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Files to write, and how many are taken but not written yet.
+  std::vector<File> queue_;
+  int writing_ = 0;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
 class TrainingDataWriter {
  public:
   // Creates a new file to write in data directory. It will has @game_id
-  // somewhere in the filename.
-  TrainingDataWriter(int game_id);
+  // somewhere in the filename. The file is gzip compressed. With @queue,
+  // it's written there, otherwise by Finalize().
+  TrainingDataWriter(int game_id, TrainingDataWriteQueue* queue = nullptr);
 
   // Writes a chunk.
-  void WriteChunk(const V3TrainingData& data);
+  void WriteChunk(const V4TrainingData& data);
 
-  // Flushes file and closes it.
-  void Finalize() { fout_.close(); }
+  // Writes the file and closes it. With a queue, @done is called once the
+  // file is written, otherwise before returning.
+  void Finalize(std::function<void()> done = {});
 
   // Gets full filename of the file written.
   std::string GetFileName() const { return filename_; }
 
  private:
   std::string filename_;
-  std::ofstream fout_;
+  TrainingDataWriteQueue* const queue_;
+  // The records written so far.
+  std::string data_;
 };
 
 }  // namespace lczero
\ No newline at end of file
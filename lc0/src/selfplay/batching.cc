@@ -0,0 +1,176 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "selfplay/batching.h"
+
+namespace lczero {
+
+class GameBatchingComputation : public NetworkComputation {
+ public:
+  GameBatchingComputation(GameBatchingNetwork* network) : network_(network) {}
+
+  ~GameBatchingComputation() {
+    if (!planes_.empty() && !enqueued_) network_->Close();
+  }
+
+  void AddInput(InputPlanes&& input) override {
+    if (planes_.empty()) network_->Open();
+    planes_.emplace_back(std::move(input));
+    legal_moves_.emplace_back();
+  }
+
+  void SetLegalMoves(const std::uint16_t* move_ids, int count) override {
+    legal_moves_.back().assign(move_ids, move_ids + count);
+  }
+
+  void ComputeBlocking() override {
+    if (planes_.empty()) return;
+    enqueued_ = true;
+    network_->Enqueue(this);
+    std::unique_lock<std::mutex> lock(mutex_);
+    ready_cv_.wait(lock, [this]() { return ready_; });
+  }
+
+  int GetBatchSize() const override { return planes_.size(); }
+
+  float GetQVal(int sample) const override {
+    return parent_->GetQVal(sample + idx_in_parent_);
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return parent_->GetPVal(sample + idx_in_parent_, move_id);
+  }
+
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    parent_->GetPVals(sample + idx_in_parent_, move_ids, count, out);
+  }
+
+  void PopulateToParent(std::shared_ptr<NetworkComputation> parent) {
+    parent_ = parent;
+    idx_in_parent_ = parent->GetBatchSize();
+    for (size_t i = 0; i < planes_.size(); ++i) {
+      parent_->AddInput(std::move(planes_[i]));
+      const auto& moves = legal_moves_[i];
+      if (!moves.empty()) parent_->SetLegalMoves(moves.data(), moves.size());
+    }
+  }
+
+  void NotifyReady() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready_ = true;
+    }
+    ready_cv_.notify_one();
+  }
+
+ private:
+  GameBatchingNetwork* const network_;
+  std::vector<InputPlanes> planes_;
+  // Of each of planes_, empty if not given.
+  std::vector<std::vector<std::uint16_t>> legal_moves_;
+  bool enqueued_ = false;
+  std::shared_ptr<NetworkComputation> parent_;
+  int idx_in_parent_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable ready_cv_;
+  bool ready_ = false;
+};
+
+GameBatchingNetwork::GameBatchingNetwork(std::shared_ptr<Network> parent,
+                                         int max_batch)
+    : parent_(parent), max_batch_(max_batch) {
+  worker_ = std::thread([this]() { Worker(); });
+}
+
+GameBatchingNetwork::~GameBatchingNetwork() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    abort_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+  // Unstuck waiting computations.
+  for (auto* computation : queue_) computation->NotifyReady();
+}
+
+std::unique_ptr<NetworkComputation> GameBatchingNetwork::NewComputation() {
+  return std::make_unique<GameBatchingComputation>(this);
+}
+
+void GameBatchingNetwork::Open() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++open_;
+}
+
+void GameBatchingNetwork::Enqueue(GameBatchingComputation* computation) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(computation);
+    queued_inputs_ += computation->GetBatchSize();
+  }
+  cv_.notify_one();
+}
+
+void GameBatchingNetwork::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --open_;
+  }
+  // The others may be waiting for this one only.
+  cv_.notify_one();
+}
+
+bool GameBatchingNetwork::BatchReady() const {
+  if (queue_.empty()) return false;
+  return queued_inputs_ >= max_batch_ ||
+         static_cast<int>(queue_.size()) == open_;
+}
+
+void GameBatchingNetwork::Worker() {
+  while (true) {
+    std::vector<GameBatchingComputation*> children;
+    std::shared_ptr<NetworkComputation> parent(parent_->NewComputation());
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return abort_ || BatchReady(); });
+      if (abort_) break;
+      // Oldest first, while they fit. A computation larger than the batch
+      // goes alone.
+      size_t taken = 0;
+      for (; taken < queue_.size(); ++taken) {
+        const int size = queue_[taken]->GetBatchSize();
+        if (parent->GetBatchSize() != 0 &&
+            parent->GetBatchSize() + size > max_batch_) {
+          break;
+        }
+        queue_[taken]->PopulateToParent(parent);
+        children.push_back(queue_[taken]);
+        queued_inputs_ -= size;
+      }
+      queue_.erase(queue_.begin(), queue_.begin() + taken);
+      open_ -= taken;
+    }
+
+    parent->ComputeBlocking();
+    for (auto* child : children) child->NotifyReady();
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,72 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "neural/network.h"
+
+namespace lczero {
+
+class GameBatchingComputation;
+
+// Network which evaluates the positions of all games played in parallel in
+// shared batches. A batch is sent to the parent network once every
+// computation which has inputs is waiting for its result, or once
+// @max_batch inputs are waiting. So the searches of all games contribute to
+// every batch, instead of each of them computing its own small one.
+class GameBatchingNetwork : public Network {
+ public:
+  GameBatchingNetwork(std::shared_ptr<Network> parent, int max_batch);
+  ~GameBatchingNetwork();
+
+  std::unique_ptr<NetworkComputation> NewComputation() override;
+
+ private:
+  friend class GameBatchingComputation;
+
+  // Called by computations when they get their first input, when they start
+  // waiting for the result, and when they are destroyed without waiting.
+  void Open();
+  void Enqueue(GameBatchingComputation* computation);
+  void Close();
+
+  bool BatchReady() const;
+  void Worker();
+
+  const std::shared_ptr<Network> parent_;
+  const int max_batch_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Computations which have inputs and are not sent to the parent yet,
+  // whether they wait for the result or are still being filled.
+  int open_ = 0;
+  // Computations waiting for their result, and how many inputs they have.
+  std::vector<GameBatchingComputation*> queue_;
+  int queued_inputs_ = 0;
+  bool abort_ = false;
+
+  std::thread worker_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,195 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "selfplay/batching.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lczero {
+
+namespace {
+// Q of a sample is the mask of its first plane, and P of a move that plus the
+// move id, wherever the sample is in the batch. The network records the size
+// of every batch and the legal moves it was given.
+class RecordingNetwork : public Network {
+ public:
+  std::unique_ptr<NetworkComputation> NewComputation() override;
+
+  std::vector<int> BatchSizes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return batch_sizes_;
+  }
+  std::vector<std::vector<std::uint16_t>> LegalMoves() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return legal_moves_;
+  }
+
+ private:
+  friend class RecordingComputation;
+  std::mutex mutex_;
+  std::vector<int> batch_sizes_;
+  std::vector<std::vector<std::uint16_t>> legal_moves_;
+};
+
+class RecordingComputation : public NetworkComputation {
+ public:
+  RecordingComputation(RecordingNetwork* network) : network_(network) {}
+  void AddInput(InputPlanes&& input) override {
+    masks_.push_back(input[0].mask);
+  }
+  void SetLegalMoves(const std::uint16_t* move_ids, int count) override {
+    std::lock_guard<std::mutex> lock(network_->mutex_);
+    network_->legal_moves_.emplace_back(move_ids, move_ids + count);
+  }
+  void ComputeBlocking() override {
+    std::lock_guard<std::mutex> lock(network_->mutex_);
+    network_->batch_sizes_.push_back(masks_.size());
+  }
+  int GetBatchSize() const override { return masks_.size(); }
+  float GetQVal(int sample) const override { return masks_[sample]; }
+  float GetPVal(int sample, int move_id) const override {
+    return masks_[sample] + move_id;
+  }
+
+ private:
+  RecordingNetwork* const network_;
+  std::vector<std::uint64_t> masks_;
+};
+
+std::unique_ptr<NetworkComputation> RecordingNetwork::NewComputation() {
+  return std::make_unique<RecordingComputation>(this);
+}
+
+// Adds @count samples with the masks @first, @first + 1, ...
+void AddInputs(NetworkComputation* computation, int first, int count) {
+  for (int i = 0; i < count; ++i) {
+    InputPlanes planes;
+    planes[0].mask = first + i;
+    computation->AddInput(std::move(planes));
+  }
+}
+
+// Computes all @computations, each on a thread of its own.
+void ComputeInParallel(
+    const std::vector<std::unique_ptr<NetworkComputation>>& computations) {
+  std::vector<std::thread> threads;
+  for (const auto& computation : computations) {
+    threads.emplace_back([&computation]() { computation->ComputeBlocking(); });
+  }
+  for (auto& thread : threads) thread.join();
+}
+}  // namespace
+
+TEST(GameBatchingNetwork, WaitsForEveryOpenComputation) {
+  auto parent = std::make_shared<RecordingNetwork>();
+  GameBatchingNetwork network(parent, 100);
+  std::vector<std::unique_ptr<NetworkComputation>> computations;
+  for (int i = 0; i < 4; ++i) {
+    computations.push_back(network.NewComputation());
+    AddInputs(computations.back().get(), 10 * i, i + 1);
+  }
+  ComputeInParallel(computations);
+
+  // All of them had inputs before any was computed, so they share a batch.
+  EXPECT_EQ(parent->BatchSizes(), std::vector<int>{10});
+  for (int i = 0; i < 4; ++i) {
+    const auto& computation = computations[i];
+    ASSERT_EQ(computation->GetBatchSize(), i + 1);
+    for (int sample = 0; sample <= i; ++sample) {
+      EXPECT_EQ(computation->GetQVal(sample), 10.0f * i + sample);
+      EXPECT_EQ(computation->GetPVal(sample, 5), 10.0f * i + sample + 5);
+    }
+  }
+}
+
+TEST(GameBatchingNetwork, BatchesStayWithinTheLimit) {
+  auto parent = std::make_shared<RecordingNetwork>();
+  GameBatchingNetwork network(parent, 4);
+  std::vector<std::unique_ptr<NetworkComputation>> computations;
+  for (int i = 0; i < 5; ++i) {
+    computations.push_back(network.NewComputation());
+    AddInputs(computations.back().get(), 10 * i, 2);
+  }
+  // Larger than the limit, so it goes alone.
+  computations.push_back(network.NewComputation());
+  AddInputs(computations.back().get(), 100, 6);
+  ComputeInParallel(computations);
+
+  const auto sizes = parent->BatchSizes();
+  int total = 0;
+  for (const auto size : sizes) {
+    EXPECT_TRUE(size <= 4 || size == 6) << size;
+    total += size;
+  }
+  EXPECT_EQ(total, 16);
+  EXPECT_EQ(std::count(sizes.begin(), sizes.end(), 6), 1);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(computations[i]->GetQVal(1), 10.0f * i + 1);
+  }
+  EXPECT_EQ(computations[5]->GetQVal(5), 105.0f);
+}
+
+TEST(GameBatchingNetwork, DroppedComputationsAreNotWaitedFor) {
+  auto parent = std::make_shared<RecordingNetwork>();
+  GameBatchingNetwork network(parent, 100);
+  auto dropped = network.NewComputation();
+  AddInputs(dropped.get(), 0, 3);
+  auto computation = network.NewComputation();
+  AddInputs(computation.get(), 7, 1);
+  // Nothing waits for a computation without inputs either.
+  auto empty = network.NewComputation();
+
+  std::thread thread([&computation]() { computation->ComputeBlocking(); });
+  dropped.reset();
+  thread.join();
+  EXPECT_EQ(parent->BatchSizes(), std::vector<int>{1});
+  EXPECT_EQ(computation->GetQVal(0), 7.0f);
+
+  // A computation without inputs returns at once.
+  empty->ComputeBlocking();
+  EXPECT_EQ(parent->BatchSizes(), std::vector<int>{1});
+}
+
+TEST(GameBatchingNetwork, PassesTheLegalMovesOn) {
+  auto parent = std::make_shared<RecordingNetwork>();
+  GameBatchingNetwork network(parent, 100);
+  auto computation = network.NewComputation();
+  AddInputs(computation.get(), 0, 1);
+  const std::uint16_t moves[] = {3, 17, 400};
+  computation->SetLegalMoves(moves, 3);
+  AddInputs(computation.get(), 1, 1);
+  computation->ComputeBlocking();
+
+  // Only the sample which has them passes them on.
+  const std::vector<std::vector<std::uint16_t>> expected = {{3, 17, 400}};
+  EXPECT_EQ(parent->LegalMoves(), expected);
+  float pvals[3];
+  computation->GetPVals(0, moves, 3, pvals);
+  EXPECT_EQ(pvals[0], 3.0f);
+  EXPECT_EQ(pvals[2], 400.0f);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -18,14 +18,16 @@
 
 #include "selfplay/game.h"
 #include <algorithm>
+#include <cmath>
 
 #include "neural/writer.h"
 
 namespace lczero {
 
 SelfPlayGame::SelfPlayGame(PlayerOptions player1, PlayerOptions player2,
-                           bool shared_tree)
-    : options_{player1, player2} {
+                           bool shared_tree,
+                           const AdjudicationOptions& adjudication)
+    : options_{player1, player2}, adjudicator_(adjudication) {
   tree_[0] = std::make_shared<NodeTree>();
   tree_[0]->ResetToPosition(ChessBoard::kStartingFen, {});
 
@@ -47,6 +49,30 @@ void SelfPlayGame::Play(int white_threads, int black_threads) {
     // If endgame, stop.
     if (game_result_ != GameResult::UNDECIDED) break;
 
+    // Adjudicate when the tables know the result.
+    if (options_[0].syzygy_tb) {
+      const auto& position = tree_[0]->GetPositionHistory().Last();
+      ProbeState state = ProbeState::FAIL;
+      WDLScore wdl = WDL_DRAW;
+      // Only right after a capture or pawn move, like in the search.
+      if (position.GetNoCapturePly() == 0) {
+        wdl = options_[0].syzygy_tb->ProbeWdl(position.GetBoard(), &state);
+      }
+      if (state != ProbeState::FAIL) {
+        const bool black_to_move = position.IsBlackToMove();
+        if (wdl == WDL_WIN) {
+          game_result_ =
+              black_to_move ? GameResult::BLACK_WON : GameResult::WHITE_WON;
+        } else if (wdl == WDL_LOSS) {
+          game_result_ =
+              black_to_move ? GameResult::WHITE_WON : GameResult::BLACK_WON;
+        } else {
+          game_result_ = GameResult::DRAW;
+        }
+        break;
+      }
+    }
+
     // Initialize search.
     const int idx = blacks_move ? 1 : 0;
     {
@@ -55,7 +81,8 @@ void SelfPlayGame::Play(int white_threads, int black_threads) {
       search_ = std::make_unique<Search>(
           *tree_[idx], options_[idx].network, options_[idx].best_move_callback,
           options_[idx].info_callback, options_[idx].search_limits,
-          *options_[idx].uci_options, options_[idx].cache);
+          *options_[idx].uci_options, options_[idx].cache,
+          options_[idx].syzygy_tb);
     }
 
     // Do search.
@@ -63,17 +90,44 @@ void SelfPlayGame::Play(int white_threads, int black_threads) {
     if (abort_) break;
 
     // Append training data.
-    training_data_.push_back(tree_[idx]->GetCurrentHead()->GetV3TrainingData(
+    training_data_.push_back(tree_[idx]->GetCurrentHead()->GetV4TrainingData(
         GameResult::UNDECIDED, tree_[idx]->GetPositionHistory()));
 
-    // Add best move to the tree.
+    // Resign or adjudicate a draw on the Q of the best move, which is from
+    // the point of view of the side to move.
     Move move = search_->GetBestMove().first;
+    float q = 0.0f;
+    for (const auto& edge : tree_[idx]->GetCurrentHead()->Edges()) {
+      if (edge.GetMove(blacks_move) == move) q = edge.GetQ(0.0f);
+    }
+    const auto result = adjudicator_.OnBestMove(q, blacks_move);
+    if (result != GameResult::UNDECIDED) {
+      game_result_ = result;
+      adjudicated_ = true;
+      break;
+    }
+
+    // Add best move to the tree.
     tree_[0]->MakeMove(move);
     if (tree_[0] != tree_[1]) tree_[1]->MakeMove(move);
     blacks_move = !blacks_move;
   }
 }
 
+GameResult Adjudicator::OnBestMove(float q, bool blacks_move) {
+  if (!resigned_black_ && (q + 1.0f) * 50.0f < options_.resign_percentage) {
+    resigned_black_ = blacks_move;
+    if (options_.resign_allowed) {
+      return blacks_move ? GameResult::WHITE_WON : GameResult::BLACK_WON;
+    }
+  }
+  drawish_plies_ = std::abs(q) <= options_.draw_q ? drawish_plies_ + 1 : 0;
+  if (options_.draw_plies > 0 && drawish_plies_ >= options_.draw_plies) {
+    return GameResult::DRAW;
+  }
+  return GameResult::UNDECIDED;
+}
+
 std::vector<Move> SelfPlayGame::GetMoves() const {
   std::vector<Move> moves;
   for (Node* node = tree_[0]->GetCurrentHead();
@@ -94,12 +148,13 @@ void SelfPlayGame::WriteTrainingData(TrainingDataWriter* writer) const {
   bool black_to_move =
       tree_[0]->GetPositionHistory().Starting().IsBlackToMove();
   for (auto chunk : training_data_) {
+    int8_t& result = chunk.position.result;
     if (game_result_ == GameResult::WHITE_WON) {
-      chunk.result = black_to_move ? -1 : 1;
+      result = black_to_move ? -1 : 1;
     } else if (game_result_ == GameResult::BLACK_WON) {
-      chunk.result = black_to_move ? 1 : -1;
+      result = black_to_move ? 1 : -1;
     } else {
-      chunk.result = 0;
+      result = 0;
     }
     writer->WriteChunk(chunk);
     black_to_move = !black_to_move;
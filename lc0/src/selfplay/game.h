@@ -23,6 +23,8 @@
 #include "mcts/search.h"
 #include "neural/cache.h"
 #include "neural/network.h"
+#include "syzygy/syzygy.h"
+#include "utils/optional.h"
 #include "utils/optionsparser.h"
 
 namespace lczero {
@@ -36,12 +38,50 @@ struct PlayerOptions {
   ThinkingInfo::Callback info_callback;
   // NNcache to use.
   NNCache* cache;
+  // Tablebases to search and adjudicate with, null if none.
+  SyzygyTablebase* syzygy_tb;
   // User options dictionary.
   const OptionsDict* uci_options;
   // Limits to use for every move.
   SearchLimits search_limits;
 };
 
+// When to end a game before the rules do. The defaults never do.
+struct AdjudicationOptions {
+  // The side to move resigns when the winrate of its best move, (Q + 1) / 2,
+  // is below this percentage.
+  float resign_percentage = 0.0f;
+  // Whether resigning ends the game. If not, the game is played on and only
+  // remembers who would have resigned, to measure false positives.
+  bool resign_allowed = true;
+  // The game is a draw once |Q| of the best move has been at most draw_q for
+  // draw_plies plies in a row.
+  float draw_q = 0.0f;
+  int draw_plies = 0;
+};
+
+// Decides, move by move, whether to end a game by AdjudicationOptions.
+class Adjudicator {
+ public:
+  explicit Adjudicator(const AdjudicationOptions& options)
+      : options_(options) {}
+
+  // Takes the Q of the best move of the side to move, black if @blacks_move,
+  // from its point of view. Returns the result the game ends with, or
+  // UNDECIDED to play the move.
+  GameResult OnBestMove(float q, bool blacks_move);
+
+  // Whether black was the first to resign, also when the game was played on
+  // after it. Empty if nobody did.
+  optional<bool> GetResignedBlack() const { return resigned_black_; }
+
+ private:
+  const AdjudicationOptions options_;
+  // Plies in a row whose best move had a Q close enough to a draw.
+  int drawish_plies_ = 0;
+  optional<bool> resigned_black_;
+};
+
 // Plays a single game vs itself.
 class SelfPlayGame {
  public:
@@ -49,7 +89,8 @@ class SelfPlayGame {
   // If shared_tree is true, search tree is reused between players.
   // (useful for training games). Otherwise the tree is separate for black
   // and white (useful i.e. when they use different networks).
-  SelfPlayGame(PlayerOptions player1, PlayerOptions player2, bool shared_tree);
+  SelfPlayGame(PlayerOptions player1, PlayerOptions player2, bool shared_tree,
+               const AdjudicationOptions& adjudication);
 
   // Starts the game and blocks until the game is finished.
   void Play(int white_threads, int black_threads);
@@ -61,6 +102,13 @@ class SelfPlayGame {
   void WriteTrainingData(TrainingDataWriter* writer) const;
 
   GameResult GetGameResult() const { return game_result_; }
+  // Whether the game ended by resign or draw adjudication.
+  bool IsAdjudicated() const { return adjudicated_; }
+  // Whether black was the first to resign, also when the game was played on
+  // after it. Empty if nobody did.
+  optional<bool> GetResignedBlack() const {
+    return adjudicator_.GetResignedBlack();
+  }
   std::vector<Move> GetMoves() const;
 
  private:
@@ -75,10 +123,12 @@ class SelfPlayGame {
   std::unique_ptr<Search> search_;
   bool abort_ = false;
   GameResult game_result_ = GameResult::UNDECIDED;
+  Adjudicator adjudicator_;
+  bool adjudicated_ = false;
   std::mutex mutex_;
 
   // Training data to send.
-  std::vector<V3TrainingData> training_data_;
+  std::vector<V4TrainingData> training_data_;
 };
 
 }  // namespace lczero
\ No newline at end of file
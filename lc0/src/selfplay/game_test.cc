@@ -0,0 +1,89 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "selfplay/game.h"
+#include <gtest/gtest.h>
+
+namespace lczero {
+
+TEST(Adjudicator, DefaultsNeverEndTheGame) {
+  Adjudicator adjudicator{AdjudicationOptions()};
+  for (int ply = 0; ply < 100; ++ply) {
+    EXPECT_EQ(adjudicator.OnBestMove(ply % 2 ? -1.0f : 0.0f, ply % 2),
+              GameResult::UNDECIDED);
+  }
+  EXPECT_FALSE(adjudicator.GetResignedBlack());
+}
+
+TEST(Adjudicator, ResignsBelowThePercentage) {
+  AdjudicationOptions options;
+  options.resign_percentage = 10.0f;
+  Adjudicator adjudicator(options);
+  // A winrate of 15% plays on, one of 5% resigns.
+  EXPECT_EQ(adjudicator.OnBestMove(-0.7f, false), GameResult::UNDECIDED);
+  EXPECT_EQ(adjudicator.OnBestMove(-0.7f, true), GameResult::UNDECIDED);
+  EXPECT_EQ(adjudicator.OnBestMove(-0.9f, true), GameResult::WHITE_WON);
+  ASSERT_TRUE(adjudicator.GetResignedBlack());
+  EXPECT_TRUE(*adjudicator.GetResignedBlack());
+
+  Adjudicator white(options);
+  EXPECT_EQ(white.OnBestMove(-0.95f, false), GameResult::BLACK_WON);
+  ASSERT_TRUE(white.GetResignedBlack());
+  EXPECT_FALSE(*white.GetResignedBlack());
+}
+
+TEST(Adjudicator, PlaythroughRemembersTheFirstResign) {
+  AdjudicationOptions options;
+  options.resign_percentage = 10.0f;
+  options.resign_allowed = false;
+  Adjudicator adjudicator(options);
+  EXPECT_EQ(adjudicator.OnBestMove(-0.9f, false), GameResult::UNDECIDED);
+  EXPECT_EQ(adjudicator.OnBestMove(-0.9f, true), GameResult::UNDECIDED);
+  ASSERT_TRUE(adjudicator.GetResignedBlack());
+  EXPECT_FALSE(*adjudicator.GetResignedBlack());
+}
+
+TEST(Adjudicator, DrawAfterDrawishPliesInARow) {
+  AdjudicationOptions options;
+  options.draw_q = 0.05f;
+  options.draw_plies = 3;
+  Adjudicator adjudicator(options);
+  EXPECT_EQ(adjudicator.OnBestMove(0.04f, false), GameResult::UNDECIDED);
+  EXPECT_EQ(adjudicator.OnBestMove(-0.01f, true), GameResult::UNDECIDED);
+  // A ply further from a draw starts the count again.
+  EXPECT_EQ(adjudicator.OnBestMove(0.2f, false), GameResult::UNDECIDED);
+  EXPECT_EQ(adjudicator.OnBestMove(0.0f, true), GameResult::UNDECIDED);
+  EXPECT_EQ(adjudicator.OnBestMove(-0.04f, false), GameResult::UNDECIDED);
+  EXPECT_EQ(adjudicator.OnBestMove(0.03f, true), GameResult::DRAW);
+}
+
+TEST(Adjudicator, ResignComesBeforeTheDraw) {
+  AdjudicationOptions options;
+  options.resign_percentage = 100.0f;
+  options.draw_q = 1.0f;
+  options.draw_plies = 1;
+  Adjudicator adjudicator(options);
+  EXPECT_EQ(adjudicator.OnBestMove(0.0f, true), GameResult::WHITE_WON);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -18,11 +18,13 @@
 
 #include "selfplay/loop.h"
 #include "selfplay/tournament.h"
+#include "utils/trace.h"
 
 namespace lczero {
 
 namespace {
 const char* kInteractive = "Run in interactive mode with uci-like interface";
+const char* kTraceFileStr = "Write a timeline of the threads into file";
 }  // namespace
 
 SelfPlayLoop::SelfPlayLoop() {}
@@ -34,9 +36,12 @@ SelfPlayLoop::~SelfPlayLoop() {
 
 void SelfPlayLoop::RunLoop() {
   options_.Add<BoolOption>(kInteractive, "interactive") = false;
+  options_.Add<StringOption>(kTraceFileStr, "trace-file") = "";
   SelfPlayTournament::PopulateOptions(&options_);
 
   if (!options_.ProcessAllFlags()) return;
+  Tracer::Get().SetFilename(
+      options_.GetOptionsDict().Get<std::string>(kTraceFileStr));
   if (options_.GetOptionsDict().Get<bool>(kInteractive)) {
     UciLoop::RunLoop();
   } else {
@@ -86,6 +91,9 @@ void SelfPlayLoop::SendGameInfo(const GameInfo& info) {
                 : (info.game_result == GameResult::WHITE_WON) ? "whitewon"
                                                               : "blackwon");
   }
+  if (info.adjudicated) res += " adjudicated";
+  if (info.resigned_black)
+    res += " resigned " + std::string(*info.resigned_black ? "black" : "white");
   if (!info.moves.empty()) {
     res += " moves";
     for (const auto& move : info.moves) res += " " + move.as_string();
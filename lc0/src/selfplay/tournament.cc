@@ -20,7 +20,11 @@
 #include "mcts/search.h"
 #include "neural/factory.h"
 #include "neural/loader.h"
+#include "neural/remote.h"
+#include "neural/shared_cache.h"
+#include "selfplay/batching.h"
 #include "selfplay/game.h"
+#include "utils/hashcat.h"
 #include "utils/optionsparser.h"
 #include "utils/random.h"
 
@@ -32,6 +36,8 @@ const char* kTotalGamesStr = "Number of games to play";
 const char* kParallelGamesStr = "Number of games to play in parallel";
 const char* kThreadsStr = "Number of CPU threads for every game";
 const char* kNnCacheSizeStr = "NNCache size";
+const char* kSharedCacheStr =
+    "Shared NNCache size, for the engines of the host with the same network";
 const char* kNetFileStr = "Network weights file path";
 const char* kPlayoutsStr = "Number of playouts per move to search";
 const char* kVisitsStr = "Number of visits per move to search";
@@ -40,6 +46,17 @@ const char* kTrainingStr = "Write training data";
 const char* kNnBackendStr = "NN backend to use";
 const char* kNnBackendOptionsStr = "NN backend parameters";
 const char* kVerboseThinkingStr = "Show verbose thinking messages";
+const char* kGameBatchStr =
+    "Largest NN batch shared by the parallel games, 0 not to share";
+const char* kSyzygyTablebaseStr =
+    "List of Syzygy tablebase directories, to search and adjudicate with";
+const char* kResignPercentageStr =
+    "Resign when the winrate of the best move is below this percentage";
+const char* kResignPlaythroughStr =
+    "Percentage of games played on after a resign, to count false positives";
+const char* kDrawQStr = "Adjudicate a draw when |Q| stays at most this";
+const char* kDrawPliesStr =
+    "Plies of |Q| within the draw threshold to adjudicate a draw, 0 never";
 
 // Value for network autodiscover.
 const char* kAutoDiscover = "<autodiscover>";
@@ -53,8 +70,18 @@ void SelfPlayTournament::PopulateOptions(OptionsParser* options) {
   options->Add<BoolOption>(kShareTreesStr, "share-trees") = false;
   options->Add<IntOption>(kTotalGamesStr, -1, 999999, "games") = -1;
   options->Add<IntOption>(kParallelGamesStr, 1, 256, "parallelism") = 1;
+  options->Add<IntOption>(kGameBatchStr, 0, 4096, "game-batch") = 0;
+  options->Add<StringOption>(kSyzygyTablebaseStr, "syzygy-paths");
+  options->Add<FloatOption>(kResignPercentageStr, 0, 100,
+                            "resign-percentage") = 0.0f;
+  options->Add<FloatOption>(kResignPlaythroughStr, 0, 100,
+                            "resign-playthrough") = 0.0f;
+  options->Add<FloatOption>(kDrawQStr, 0, 1, "draw-adjudication-q") = 0.0f;
+  options->Add<IntOption>(kDrawPliesStr, 0, 999, "draw-adjudication-plies") =
+      0;
   options->Add<IntOption>(kThreadsStr, 1, 8, "threads", 't') = 1;
   options->Add<IntOption>(kNnCacheSizeStr, 0, 999999999, "nncache") = 200000;
+  options->Add<IntOption>(kSharedCacheStr, 0, 999999999, "shared-nncache") = 0;
   options->Add<StringOption>(kNetFileStr, "weights", 'w') = kAutoDiscover;
   options->Add<IntOption>(kPlayoutsStr, -1, 999999999, "playouts", 'p') = -1;
   options->Add<IntOption>(kVisitsStr, -1, 999999999, "visits", 'v') = -1;
@@ -87,13 +114,16 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
       kTotalGames(options.Get<int>(kTotalGamesStr)),
       kShareTree(options.Get<bool>(kShareTreesStr)),
       kParallelism(options.Get<int>(kParallelGamesStr)),
-      kTraining(options.Get<bool>(kTrainingStr)) {
+      kTraining(options.Get<bool>(kTrainingStr)),
+      kResignPlaythrough(options.Get<float>(kResignPlaythroughStr)) {
+  if (kTraining) training_queue_ = std::make_unique<TrainingDataWriteQueue>();
   // If playing just one game, the player1 is white, otherwise randomize.
   if (kTotalGames != 1) {
     next_game_black_ = Random::Get().GetBool();
   }
 
   static const char* kPlayerNames[2] = {"player1", "player2"};
+  uint64_t network_hashes[2] = {};
   // Initializing networks.
   for (int idx : {0, 1}) {
     // If two players have the same network, no need to load two.
@@ -109,6 +139,7 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
       }
       if (network_identical) {
         networks_[1] = networks_[0];
+        network_hashes[1] = network_hashes[0];
         break;
       }
     }
@@ -119,6 +150,7 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
       path = DiscoveryWeightsFile();
     }
     Weights weights = LoadWeightsFromFile(path);
+    network_hashes[idx] = HashWeights(weights);
     std::string backend =
         options.GetSubdict(kPlayerNames[idx]).Get<std::string>(kNnBackendStr);
     std::string backend_options = options.GetSubdict(kPlayerNames[idx])
@@ -129,6 +161,20 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
 
     networks_[idx] =
         NetworkFactory::Get()->Create(backend, weights, network_options);
+    if (const uint64_t ns = networks_[idx]->GetCacheNamespace()) {
+      network_hashes[idx] = HashCat(network_hashes[idx], ns);
+    }
+  }
+
+  // Batching across games, in front of each distinct network.
+  const int game_batch = options.Get<int>(kGameBatchStr);
+  if (game_batch > 0) {
+    const bool same_network = networks_[1] == networks_[0];
+    networks_[0] =
+        std::make_shared<GameBatchingNetwork>(networks_[0], game_batch);
+    networks_[1] = same_network ? networks_[0]
+                                : std::make_shared<GameBatchingNetwork>(
+                                      networks_[1], game_batch);
   }
 
   // Initializing cache.
@@ -140,6 +186,32 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
     cache_[1] = std::make_shared<NNCache>(
         options.GetSubdict("player2").Get<int>(kNnCacheSizeStr));
   }
+  // Shared with other processes, and between the players if they have the
+  // same network.
+  std::shared_ptr<SharedNNCache> shared_caches[2];
+  for (int idx : {0, 1}) {
+    const int size =
+        options.GetSubdict(kPlayerNames[idx]).Get<int>(kSharedCacheStr);
+    if (size == 0) continue;
+    if (idx == 1 && shared_caches[0] &&
+        network_hashes[1] == network_hashes[0]) {
+      shared_caches[1] = shared_caches[0];
+    } else {
+      shared_caches[idx] =
+          std::make_shared<SharedNNCache>(network_hashes[idx], size);
+    }
+    cache_[idx]->SetShared(shared_caches[idx]);
+  }
+
+  // Tablebases, shared by everything.
+  syzygy_tb_ = std::make_unique<SyzygyTablebase>();
+  if (!syzygy_tb_->Init(options.Get<std::string>(kSyzygyTablebaseStr))) {
+    syzygy_tb_.reset();
+  }
+
+  adjudication_.resign_percentage = options.Get<float>(kResignPercentageStr);
+  adjudication_.draw_q = options.Get<float>(kDrawQStr);
+  adjudication_.draw_plies = options.Get<int>(kDrawPliesStr);
 
   // SearchLimits.
   for (int idx : {0, 1}) {
@@ -172,6 +244,7 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
     PlayerOptions& opt = options[color_idx[pl_idx]];
     opt.network = networks_[pl_idx].get();
     opt.cache = cache_[pl_idx].get();
+    opt.syzygy_tb = syzygy_tb_.get();
     opt.uci_options = &player_options_[pl_idx];
     opt.search_limits = search_limits_[pl_idx];
 
@@ -211,10 +284,13 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
   // delete it. Need to expose it in games_ member variable only because
   // of possible Abort() that should stop them all.
   std::list<std::unique_ptr<SelfPlayGame>>::iterator game_iter;
+  AdjudicationOptions adjudication = adjudication_;
+  adjudication.resign_allowed =
+      Random::Get().GetDouble(100.0) >= kResignPlaythrough;
   {
     Mutex::Lock lock(mutex_);
-    games_.emplace_front(
-        std::make_unique<SelfPlayGame>(options[0], options[1], kShareTree));
+    games_.emplace_front(std::make_unique<SelfPlayGame>(
+        options[0], options[1], kShareTree, adjudication));
     game_iter = games_.begin();
   }
   auto& game = **game_iter;
@@ -230,13 +306,17 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
     game_info.is_black = player1_black;
     game_info.game_id = game_number;
     game_info.moves = game.GetMoves();
+    game_info.adjudicated = game.IsAdjudicated();
+    game_info.resigned_black = game.GetResignedBlack();
     if (kTraining) {
-      TrainingDataWriter writer(game_number);
+      // The game is reported once its file is written.
+      TrainingDataWriter writer(game_number, training_queue_.get());
       game.WriteTrainingData(&writer);
-      writer.Finalize();
       game_info.training_filename = writer.GetFileName();
+      writer.Finalize([this, game_info]() { game_callback_(game_info); });
+    } else {
+      game_callback_(game_info);
     }
-    game_callback_(game_info);
 
     // Update tournament stats.
     {
@@ -281,6 +361,7 @@ void SelfPlayTournament::RunBlocking() {
   if (kParallelism == 1) {
     // No need for multiple threads if there is one worker.
     Worker();
+    if (training_queue_) training_queue_->Wait();
     Mutex::Lock lock(mutex_);
     if (!abort_) {
       tournament_info_.finished = true;
@@ -300,6 +381,8 @@ void SelfPlayTournament::Wait() {
       threads_.pop_back();
     }
   }
+  // The games are reported before the tournament is.
+  if (training_queue_) training_queue_->Wait();
   {
     Mutex::Lock lock(mutex_);
     if (!abort_) {
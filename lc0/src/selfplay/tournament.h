@@ -19,6 +19,7 @@
 #pragma once
 
 #include <list>
+#include "neural/writer.h"
 #include "selfplay/game.h"
 #include "utils/mutex.h"
 #include "utils/optionsdict.h"
@@ -77,8 +78,12 @@ class SelfPlayTournament {
   // Shared pointers for both players may point to the same object.
   std::shared_ptr<Network> networks_[2];
   std::shared_ptr<NNCache> cache_[2];
+  // Null without tables.
+  std::unique_ptr<SyzygyTablebase> syzygy_tb_;
   const OptionsDict player_options_[2];
   SearchLimits search_limits_[2];
+  // The same for every game, except for resign_allowed.
+  AdjudicationOptions adjudication_;
 
   BestMoveInfo::Callback best_move_callback_;
   ThinkingInfo::Callback info_callback_;
@@ -89,6 +94,11 @@ class SelfPlayTournament {
   const bool kShareTree;
   const int kParallelism;
   const bool kTraining;
+  const float kResignPlaythrough;
+
+  // Writes the training data of finished games, if kTraining. Last, as it
+  // calls game_callback_ until destroyed.
+  std::unique_ptr<TrainingDataWriteQueue> training_queue_;
 };
 
 }  // namespace lczero
@@ -0,0 +1,1163 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+  Copyright (c) 2013 Ronald de Man
+  Copyright (C) 2016-2018 Marco Costalba, Lucas Braesch
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "syzygy/syzygy.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lczero {
+namespace {
+
+// Max number of supported pieces.
+const int kMaxPieces = 6;
+
+// Piece types and pieces as the table files store them. The side to move is
+// always WHITE, ChessBoard is from its point of view.
+enum PieceType { NO_PIECE_TYPE, PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING };
+enum Color { WHITE, BLACK };
+const int kBlackPiece = 8;
+const char kPieceToChar[] = " PNBRQK";
+
+// The only flag of the tables which WDL tables use, the others are for DTZ.
+enum TBFlag { SINGLE_VALUE = 128 };
+
+WDLScore operator-(WDLScore d) { return WDLScore(-int(d)); }
+
+// Undoes SyzygyTablebaseImpl::Map(). @mapping is the size of the file, or
+// the handle of the file mapping on Windows.
+void Unmap(void* base_address, uint64_t mapping) {
+#ifndef _WIN32
+  munmap(base_address, mapping);
+#else
+  UnmapViewOfFile(base_address);
+  CloseHandle(reinterpret_cast<HANDLE>(mapping));
+#endif
+}
+
+int FileOf(int sq) { return sq & 7; }
+int RankOf(int sq) { return sq >> 3; }
+int OffA1H8(int sq) { return RankOf(sq) - FileOf(sq); }
+
+int PopCount(uint64_t value) { return __builtin_popcountll(value); }
+
+int PopLsb(uint64_t* value) {
+  const int sq = __builtin_ctzll(*value);
+  *value &= *value - 1;
+  return sq;
+}
+
+int MapPawns[64];
+int MapB1H1H7[64];
+int MapA1D1D4[64];
+int MapKK[10][64];  // [MapA1D1D4][square]
+
+int Binomial[6][64];     // [k][n] k elements from a set of n elements
+int LeadPawnIdx[5][64];  // [leadPawnsCnt][square]
+int LeadPawnsSize[5][4];  // [leadPawnsCnt][FILE_A..FILE_D]
+
+// Comparison function to sort leading pawns in ascending MapPawns[] order.
+bool PawnsComp(int i, int j) { return MapPawns[i] < MapPawns[j]; }
+
+void InitIndexTables() {
+  // MapB1H1H7[] encodes a square below a1-h8 diagonal to 0..27.
+  int code = 0;
+  for (int s = 0; s < 64; ++s) {
+    if (OffA1H8(s) < 0) MapB1H1H7[s] = code++;
+  }
+
+  // MapA1D1D4[] encodes a square in the a1-d1-d4 triangle to 0..9.
+  std::vector<int> diagonal;
+  code = 0;
+  for (int s = 0; s <= 27; ++s) {
+    if (OffA1H8(s) < 0 && FileOf(s) <= 3) {
+      MapA1D1D4[s] = code++;
+    } else if (!OffA1H8(s) && FileOf(s) <= 3) {
+      diagonal.push_back(s);
+    }
+  }
+  // Diagonal squares are encoded as last ones.
+  for (int s : diagonal) MapA1D1D4[s] = code++;
+
+  // MapKK[] encodes all the 461 possible legal positions of two kings where
+  // the first is in the a1-d1-d4 triangle. If the first king is on the a1-d4
+  // diagonal, the other one shall not to be above the a1-h8 diagonal.
+  std::vector<std::pair<int, int>> both_on_diagonal;
+  code = 0;
+  for (int idx = 0; idx < 10; idx++) {
+    for (int s1 = 0; s1 <= 27; ++s1) {
+      // B1 is mapped to 0.
+      if (MapA1D1D4[s1] != idx || (!idx && s1 != 1)) continue;
+      for (int s2 = 0; s2 < 64; ++s2) {
+        if (std::abs(RankOf(s1) - RankOf(s2)) <= 1 &&
+            std::abs(FileOf(s1) - FileOf(s2)) <= 1) {
+          continue;  // Illegal position.
+        } else if (!OffA1H8(s1) && OffA1H8(s2) > 0) {
+          continue;  // First on diagonal, second above.
+        } else if (!OffA1H8(s1) && !OffA1H8(s2)) {
+          both_on_diagonal.emplace_back(idx, s2);
+        } else {
+          MapKK[idx][s2] = code++;
+        }
+      }
+    }
+  }
+  // Legal positions with both kings on diagonal are encoded as last ones.
+  for (const auto& p : both_on_diagonal) MapKK[p.first][p.second] = code++;
+
+  // Binomial[] stores the Binomial Coefficents using Pascal rule. There are
+  // Binomial[k][n] ways to choose k elements from a set of n elements.
+  Binomial[0][0] = 1;
+  for (int n = 1; n < 64; n++) {    // Squares
+    for (int k = 0; k < 6 && k <= n; ++k) {  // Pieces
+      Binomial[k][n] = (k > 0 ? Binomial[k - 1][n - 1] : 0) +
+                       (k < n ? Binomial[k][n - 1] : 0);
+    }
+  }
+
+  // MapPawns[s] encodes squares a2-h7 to 0..47. This is the number of
+  // possible available squares when the leading one is in 's'. Moreover the
+  // pawn with highest MapPawns[] is the leading pawn, the one nearest the
+  // edge and, among pawns with same file, the one with lowest rank.
+  int available_squares = 47;  // Available squares when lead pawn is in a2.
+
+  // Init the tables for the encoding of leading pawns group: with 6-men TB
+  // we can have up to 4 leading pawns (KPPPPK).
+  for (int lead_pawns_cnt = 1; lead_pawns_cnt <= 4; ++lead_pawns_cnt) {
+    for (int f = 0; f <= 3; ++f) {
+      // Restart the index at every file because TB table is splitted by
+      // file, so we can reuse the same index for different files.
+      int idx = 0;
+      // Sum all possible combinations for a given file, starting with the
+      // leading pawn on rank 2 and increasing the rank.
+      for (int r = 1; r <= 6; ++r) {
+        const int sq = r * 8 + f;
+        // Compute MapPawns[] at first pass. If sq is the leading pawn
+        // square, any other pawn cannot be below or more toward the edge of
+        // sq. There are 47 available squares when sq = a2 and reduced by 2
+        // for any rank increase due to mirroring: sq == a3 -> no a2, h2, so
+        // MapPawns[a3] = 45.
+        if (lead_pawns_cnt == 1) {
+          MapPawns[sq] = available_squares--;
+          MapPawns[sq ^ 7] = available_squares--;  // Horizontal flip
+        }
+        LeadPawnIdx[lead_pawns_cnt][sq] = idx;
+        idx += Binomial[lead_pawns_cnt - 1][MapPawns[sq]];
+      }
+      // After a file is traversed, store the cumulated per-file index.
+      LeadPawnsSize[lead_pawns_cnt][f] = idx;
+    }
+  }
+}
+
+std::once_flag index_tables_once;
+
+// Numbers in the files are little endian, except the Huffman code.
+template <typename T>
+T ReadLittleEndian(const void* addr) {
+  const uint8_t* p = static_cast<const uint8_t*>(addr);
+  T v = 0;
+  for (int i = sizeof(T) - 1; i >= 0; --i) v = (v << 8) | p[i];
+  return v;
+}
+
+template <typename T>
+T ReadBigEndian(const void* addr) {
+  const uint8_t* p = static_cast<const uint8_t*>(addr);
+  T v = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) v = (v << 8) | p[i];
+  return v;
+}
+
+// Numbers in little endian used by sparseIndex[] to point into
+// blockLength[].
+struct SparseEntry {
+  char block[4];   // Number of block
+  char offset[2];  // Offset within the block
+};
+static_assert(sizeof(SparseEntry) == 6, "SparseEntry must be 6 bytes");
+
+typedef uint16_t Sym;  // Huffman symbol
+
+struct LR {
+  enum Side { LEFT, RIGHT, VALUE };
+
+  uint8_t lr[3];  // The first 12 bits is the left-hand symbol, the second 12
+                  // bits is the right-hand symbol. If symbol has length 1,
+                  // then the first byte is the stored value.
+  template <Side S>
+  Sym Get() const {
+    return S == LEFT ? ((lr[1] & 0xF) << 8) | lr[0]
+                     : S == RIGHT ? (lr[2] << 4) | (lr[1] >> 4) : lr[0];
+  }
+};
+static_assert(sizeof(LR) == 3, "LR tree entry must be 3 bytes");
+
+// Contains low level indexing information to access TB data. There are 8
+// or 2 PairsData records for each table, according to if positions have
+// pawns or not. It is populated at first access.
+struct PairsData {
+  uint8_t flags;          // Table flags, see enum TBFlag
+  uint8_t max_sym_len;    // Maximum length in bits of the Huffman symbols
+  uint8_t min_sym_len;    // Minimum length in bits of the Huffman symbols
+  uint32_t blocks_num;    // Number of blocks in the TB file
+  size_t sizeof_block;    // Block size in bytes
+  size_t span;            // About every span values there is a SparseIndex[]
+                          // entry
+  Sym* lowest_sym;        // lowest_sym[l] is the symbol of length l with the
+                          // lowest value
+  LR* btree;              // btree[sym] stores the left and right symbols
+                          // that expand sym
+  uint16_t* block_length;  // Number of stored positions (minus one) for each
+                           // block: 1..65536
+  uint32_t block_length_size;  // Size of block_length[] table: padded so it's
+                               // bigger than blocks_num
+  SparseEntry* sparse_index;   // Partial indices into block_length[]
+  size_t sparse_index_size;    // Size of sparse_index[] table
+  uint8_t* data;               // Start of Huffman compressed data
+  std::vector<uint64_t> base64;  // base64[l - min_sym_len] is the 64bit-padded
+                                 // lowest symbol of length l
+  std::vector<uint8_t> symlen;  // Number of values (-1) represented by a
+                                // given Huffman symbol: 1..256
+  int pieces[kMaxPieces];       // Position pieces: the order of pieces
+                                // defines the groups
+  uint64_t group_idx[kMaxPieces + 1];  // Start index used for the encoding of
+                                       // the group's pieces
+  int group_len[kMaxPieces + 1];  // Number of pieces in a given group:
+                                  // KRKN -> (3, 1)
+};
+
+// Material of a position, 4 bits for the count of every non-king piece.
+uint64_t MaterialKey(const int counts[2][7]) {
+  uint64_t key = 0;
+  for (int c = WHITE; c <= BLACK; ++c) {
+    for (int pt = PAWN; pt < KING; ++pt) {
+      key |= static_cast<uint64_t>(counts[c][pt]) << (4 * (c * 5 + pt - 1));
+    }
+  }
+  return key;
+}
+
+// The board in the form the probing code wants it.
+struct TbPosition {
+  explicit TbPosition(const ChessBoard& board) {
+    by_color[WHITE] = board.ours().as_int();
+    by_color[BLACK] = board.theirs().as_int();
+    by_type[NO_PIECE_TYPE] = 0;
+    by_type[PAWN] = board.pawns().as_int();
+    by_type[KNIGHT] =
+        board.our_knights().as_int() | board.their_knights().as_int();
+    by_type[BISHOP] = board.bishops().as_int();
+    by_type[ROOK] = board.rooks().as_int();
+    by_type[QUEEN] = board.queens().as_int();
+    by_type[KING] = board.our_king().as_int() | board.their_king().as_int();
+    int counts[2][7];
+    for (int c = WHITE; c <= BLACK; ++c) {
+      for (int pt = PAWN; pt <= KING; ++pt) {
+        counts[c][pt] = PopCount(pieces(c, pt));
+      }
+    }
+    material_key = MaterialKey(counts);
+  }
+
+  uint64_t occupied() const { return by_color[WHITE] | by_color[BLACK]; }
+  uint64_t pieces(int c, int pt) const { return by_color[c] & by_type[pt]; }
+  int piece_on(int sq) const {
+    const int color = (by_color[BLACK] >> sq) & 1;
+    for (int pt = PAWN; pt <= KING; ++pt) {
+      if ((by_type[pt] >> sq) & 1) return pt + color * kBlackPiece;
+    }
+    return 0;
+  }
+
+  uint64_t by_color[2];
+  uint64_t by_type[7];
+  uint64_t material_key;
+};
+
+// Indexing information of a .rtbw file. Populated when the file is found,
+// but the nested PairsData records are populated at first access, when the
+// file is memory mapped.
+struct WdlTable {
+  // @code is like "KRvK".
+  explicit WdlTable(const std::string& code) : code(code) {
+    int counts[2][7] = {};
+    int color = WHITE;
+    for (char c : code) {
+      if (c == 'v') {
+        color = BLACK;
+        continue;
+      }
+      const int pt = std::strchr(kPieceToChar, c) - kPieceToChar;
+      ++counts[color][pt];
+      ++piece_count;
+    }
+    has_pawns = counts[WHITE][PAWN] || counts[BLACK][PAWN];
+    for (int c = WHITE; c <= BLACK; ++c) {
+      for (int pt = PAWN; pt < KING; ++pt) {
+        if (counts[c][pt] == 1) has_unique_pieces = true;
+      }
+    }
+
+    // Set the leading color. In case both sides have pawns the leading color
+    // is the side with less pawns because this leads to better compression.
+    const int white_pawns = counts[WHITE][PAWN];
+    const int black_pawns = counts[BLACK][PAWN];
+    const bool c =
+        !black_pawns || (white_pawns && black_pawns >= white_pawns);
+    pawn_count[0] = c ? white_pawns : black_pawns;
+    pawn_count[1] = c ? black_pawns : white_pawns;
+
+    // The same table with the colors swapped.
+    key = MaterialKey(counts);
+    std::swap(counts[WHITE], counts[BLACK]);
+    key2 = MaterialKey(counts);
+  }
+
+  ~WdlTable() {
+    if (base_address) Unmap(base_address, mapping);
+  }
+
+  PairsData* get(int stm, int f) { return &items[stm % 2][has_pawns ? f : 0]; }
+
+  const std::string code;
+  std::atomic<bool> ready{false};
+  void* base_address = nullptr;
+  uint64_t mapping = 0;
+  uint64_t key;
+  uint64_t key2;
+  int piece_count = 0;
+  bool has_pawns = false;
+  bool has_unique_pieces = false;
+  uint8_t pawn_count[2];  // [Lead color / other color]
+  PairsData items[2][4];  // [wtm / btm][FILE_A..FILE_D or 0]
+};
+
+// TB tables are compressed with canonical Huffman code. The compressed data
+// is divided into blocks of size d->sizeof_block, and each block stores a
+// variable number of symbols. Each symbol represents either a WDL value, or a
+// pair of other symbols (recursively). If you keep expanding the symbols in a
+// block, you end up with up to 65536 WDL values. Each symbol represents up to
+// 256 values and will correspond after Huffman coding to at least 1 bit. So a
+// block of 32 bytes corresponds to at most 32 x 8 x 256 = 65536 values. This
+// maximum is only reached for tables that consist mostly of draws or mostly
+// of wins, but such tables are actually quite common. In principle, the
+// blocks in WDL tables are 64 bytes long (and will be aligned on cache
+// lines). But for mostly-draw or mostly-win tables this can leave many
+// 64-byte blocks only half-filled, so in such cases blocks are 32 bytes long.
+// The generator picks the size that leads to the smallest table. The "book"
+// of symbols and Huffman codes is the same for all blocks in the table. A
+// non-symmetric pawnless TB file will have one table for wtm and one for btm,
+// a TB file with pawns will have tables per file a,b,c,d also in this case
+// one set for wtm and one for btm.
+int DecompressPairs(PairsData* d, uint64_t idx) {
+  // Special case where all table positions store the same value.
+  if (d->flags & SINGLE_VALUE) return d->min_sym_len;
+
+  // First we need to locate the right block that stores the value at index
+  // "idx". Because each block n stores block_length[n] + 1 values, the index
+  // i of the block that contains the value at position idx is:
+  //
+  //   for (i = -1, sum = 0; sum <= idx; i++)
+  //     sum += block_length[i + 1] + 1;
+  //
+  // This can be slow, so we use sparse_index[] populated with a set of
+  // SparseEntry that point to known indices into block_length[]. Namely
+  // sparse_index[k] is a SparseEntry that stores the block_length[] index and
+  // the offset within that block of the value with index I(k), where:
+  //
+  //   I(k) = k * d->span + d->span / 2      (1)
+
+  // First step is to get the 'k' of the I(k) nearest to our idx, using
+  // definition (1).
+  const uint32_t k = idx / d->span;
+
+  // Then we read the corresponding sparse_index[] entry.
+  uint32_t block = ReadLittleEndian<uint32_t>(&d->sparse_index[k].block);
+  int offset = ReadLittleEndian<uint16_t>(&d->sparse_index[k].offset);
+
+  // Now compute the difference idx - I(k). From definition of k we know that
+  //
+  //   idx = k * d->span + idx % d->span    (2)
+  //
+  // So from (1) and (2) we can compute idx - I(K):
+  const int diff = idx % d->span - d->span / 2;
+
+  // Sum the above to offset to find the offset corresponding to our idx.
+  offset += diff;
+
+  // Move to previous/next block, until we reach the correct block that
+  // contains idx, that is when 0 <= offset <= d->block_length[block].
+  while (offset < 0) offset += d->block_length[--block] + 1;
+  while (offset > d->block_length[block]) {
+    offset -= d->block_length[block++] + 1;
+  }
+
+  // Finally, we find the start address of our block of canonical Huffman
+  // symbols.
+  const uint32_t* ptr =
+      reinterpret_cast<uint32_t*>(d->data + block * d->sizeof_block);
+
+  // Read the first 64 bits in our block, this is a (truncated) sequence of
+  // unknown number of symbols of unknown length but we know the first one is
+  // at the beginning of this 64 bits sequence.
+  uint64_t buf64 = ReadBigEndian<uint64_t>(ptr);
+  ptr += 2;
+  int buf64_size = 64;
+  Sym sym;
+
+  while (true) {
+    int len = 0;  // This is the symbol length - d->min_sym_len
+
+    // Now get the symbol length. For any symbol s64 of length l right-padded
+    // to 64 bits we know that d->base64[l-1] >= s64 >= d->base64[l] so we can
+    // find the symbol length iterating through base64[].
+    while (buf64 < d->base64[len]) ++len;
+
+    // All the symbols of a given length are consecutive integers (numerical
+    // sequence property), so we can compute the offset of our symbol of
+    // length len, stored at the beginning of buf64.
+    sym = (buf64 - d->base64[len]) >> (64 - len - d->min_sym_len);
+
+    // Now add the value of the lowest symbol of length len to get our symbol.
+    sym += ReadLittleEndian<Sym>(&d->lowest_sym[len]);
+
+    // If our offset is within the number of values represented by symbol sym
+    // we are done...
+    if (offset < d->symlen[sym] + 1) break;
+
+    // ...otherwise update the offset and continue to iterate.
+    offset -= d->symlen[sym] + 1;
+    len += d->min_sym_len;  // Get the real length
+    buf64 <<= len;          // Consume the just processed symbol
+    buf64_size -= len;
+
+    if (buf64_size <= 32) {  // Refill the buffer
+      buf64_size += 32;
+      buf64 |= static_cast<uint64_t>(ReadBigEndian<uint32_t>(ptr++))
+               << (64 - buf64_size);
+    }
+  }
+
+  // Ok, now we have our symbol that expands into d->symlen[sym] + 1 symbols.
+  // We binary-search for our value recursively expanding into the left and
+  // right child symbols until we reach a leaf node where symlen[sym] + 1 == 1
+  // that will store the value we need.
+  while (d->symlen[sym]) {
+    const Sym left = d->btree[sym].Get<LR::LEFT>();
+
+    // If a symbol contains 36 sub-symbols (d->symlen[sym] + 1 = 36) and
+    // expands in a pair (d->symlen[left] = 23, d->symlen[right] = 11), then we
+    // know that, for instance the ten-th value (offset = 10) will be on the
+    // left side because in Recursive Pairing child symbols are adjacent.
+    if (offset < d->symlen[left] + 1) {
+      sym = left;
+    } else {
+      offset -= d->symlen[left] + 1;
+      sym = d->btree[sym].Get<LR::RIGHT>();
+    }
+  }
+
+  return d->btree[sym].Get<LR::VALUE>();
+}
+
+// Computes a unique index out of a position and uses it to probe the TB
+// file. To encode k pieces of same type and color, first sort the pieces by
+// square in ascending order s1 <= s2 <= ... <= sk then compute the unique
+// index as:
+//
+//   idx = Binomial[1][s1] + Binomial[2][s2] + ... + Binomial[k][sk]
+//
+WDLScore DoProbeTable(const TbPosition& pos, WdlTable* entry) {
+  int squares[kMaxPieces];
+  int pieces[kMaxPieces];
+  uint64_t idx;
+  int next = 0, size = 0, lead_pawns_cnt = 0;
+  uint64_t b, lead_pawns = 0;
+  int tb_file = 0;
+
+  // TB files are calculated for white as stronger side. For instance we have
+  // KRvK, not KvKR. A position where stronger side is white will have its
+  // material key == entry->key, otherwise we have to switch the color and
+  // flip the squares before to lookup. The side to move is always white
+  // here, so symmetric tables, which only store white to move, need nothing.
+  const bool black_stronger = (pos.material_key != entry->key);
+
+  const int flip_color = black_stronger * kBlackPiece;
+  const int flip_squares = black_stronger * 070;
+  const int stm = black_stronger;
+
+  // For pawns, TB files store 4 separate tables according if leading pawn is
+  // on file a, b, c or d after reordering. The leading pawn is the one with
+  // maximum MapPawns[] value, that is the one most toward the edges and with
+  // lowest rank.
+  if (entry->has_pawns) {
+    // In all the 4 tables, pawns are at the beginning of the piece sequence
+    // and their color is the reference one. So we just pick the first one.
+    const int pc = entry->get(0, 0)->pieces[0] ^ flip_color;
+
+    lead_pawns = b = pos.pieces(pc >= kBlackPiece ? BLACK : WHITE, PAWN);
+    do {
+      squares[size++] = PopLsb(&b) ^ flip_squares;
+    } while (b);
+
+    lead_pawns_cnt = size;
+
+    std::swap(squares[0], *std::max_element(squares, squares + lead_pawns_cnt,
+                                            PawnsComp));
+
+    tb_file = FileOf(squares[0]);
+    if (tb_file > 3) tb_file = FileOf(squares[0] ^ 7);  // Horizontal flip
+  }
+
+  // Now we are ready to get all the position pieces (but the lead pawns) and
+  // directly map them to the correct color and square.
+  b = pos.occupied() ^ lead_pawns;
+  do {
+    const int s = PopLsb(&b);
+    squares[size] = s ^ flip_squares;
+    pieces[size++] = pos.piece_on(s) ^ flip_color;
+  } while (b);
+
+  PairsData* d = entry->get(stm, tb_file);
+
+  // Then we reorder the pieces to have the same sequence as the one stored in
+  // pieces[i]: the sequence that ensures the best compression.
+  for (int i = lead_pawns_cnt; i < size; ++i) {
+    for (int j = i; j < size; ++j) {
+      if (d->pieces[i] == pieces[j]) {
+        std::swap(pieces[i], pieces[j]);
+        std::swap(squares[i], squares[j]);
+        break;
+      }
+    }
+  }
+
+  // Now we map again the squares so that the square of the lead piece is in
+  // the triangle A1-D1-D4.
+  if (FileOf(squares[0]) > 3) {
+    for (int i = 0; i < size; ++i) squares[i] ^= 7;  // Horizontal flip
+  }
+
+  if (entry->has_pawns) {
+    // Encode leading pawns starting with the one with minimum MapPawns[] and
+    // proceeding in ascending order.
+    idx = LeadPawnIdx[lead_pawns_cnt][squares[0]];
+    std::sort(squares + 1, squares + lead_pawns_cnt, PawnsComp);
+    for (int i = 1; i < lead_pawns_cnt; ++i) {
+      idx += Binomial[i][MapPawns[squares[i]]];
+    }
+  } else {
+    // In positions withouth pawns, we further flip the squares to ensure
+    // leading piece is below RANK_5.
+    if (RankOf(squares[0]) > 3) {
+      for (int i = 0; i < size; ++i) squares[i] ^= 070;  // Vertical flip
+    }
+
+    // Look for the first piece of the leading group not on the A1-D4 diagonal
+    // and ensure it is mapped below the diagonal.
+    for (int i = 0; i < d->group_len[0]; ++i) {
+      if (!OffA1H8(squares[i])) continue;
+      if (OffA1H8(squares[i]) > 0) {  // A1-H8 diagonal flip: A3 -> C3
+        for (int j = i; j < size; ++j) {
+          squares[j] = ((squares[j] >> 3) | (squares[j] << 3)) & 63;
+        }
+      }
+      break;
+    }
+
+    // Encode the leading group.
+    //
+    // Suppose we have KRvK. Let's say the pieces are on square numbers wK, wR
+    // and bK (each 0...63). The simplest way to map this position to an index
+    // is like this:
+    //
+    //   index = wK * 64 * 64 + wR * 64 + bK;
+    //
+    // But this way the TB is going to have 64*64*64 = 262144 positions, with
+    // lots of positions being equivalent (because they are mirrors of each
+    // other) and lots of positions being invalid (two pieces on one square,
+    // adjacent kings, etc.). Usually the first step is to take the wK and bK
+    // together. There are just 462 ways legal and not-mirrored ways to place
+    // the wK and bK on the board. Once we have placed the wK and bK, there are
+    // 62 squares left for the wR. Mapping its square from 0..63 to available
+    // squares 0..61 can be done like:
+    //
+    //   wR -= (wR > wK) + (wR > bK);
+    //
+    // In words: if wR "comes later" than wK, we deduct 1, and the same if wR
+    // "comes later" than bK. In case of two same pieces like KRRvK we want to
+    // place the two Rs "together". If we have 62 squares left, we can place
+    // two Rs "together" in 62 * 61 / 2 ways (we divide by 2 because rooks can
+    // be swapped and still get the same position.)
+    //
+    // In case we have at least 3 unique pieces (inlcuded kings) we encode
+    // them together.
+    if (entry->has_unique_pieces) {
+      const int adjust1 = squares[1] > squares[0];
+      const int adjust2 =
+          (squares[2] > squares[0]) + (squares[2] > squares[1]);
+
+      if (OffA1H8(squares[0])) {
+        // First piece is below a1-h8 diagonal. MapA1D1D4[] maps the b1-d1-d3
+        // triangle to 0...5. There are 63 squares for second piece and and 62
+        // (mapped to 0...61) for the third.
+        idx = (MapA1D1D4[squares[0]] * 63 + (squares[1] - adjust1)) * 62 +
+              squares[2] - adjust2;
+      } else if (OffA1H8(squares[1])) {
+        // First piece is on a1-h8 diagonal, second below: map this occurence
+        // to 6 to differentiate from the above case, RankOf() maps a1-d4
+        // diagonal to 0...3 and finally MapB1H1H7[] maps the b1-h1-h7
+        // triangle to 0..27.
+        idx = (6 * 63 + RankOf(squares[0]) * 28 + MapB1H1H7[squares[1]]) *
+                  62 +
+              squares[2] - adjust2;
+      } else if (OffA1H8(squares[2])) {
+        // First two pieces are on a1-h8 diagonal, third below.
+        idx = 6 * 63 * 62 + 4 * 28 * 62 + RankOf(squares[0]) * 7 * 28 +
+              (RankOf(squares[1]) - adjust1) * 28 + MapB1H1H7[squares[2]];
+      } else {
+        // All 3 pieces on the diagonal a1-h8.
+        idx = 6 * 63 * 62 + 4 * 28 * 62 + 4 * 7 * 28 +
+              RankOf(squares[0]) * 7 * 6 + (RankOf(squares[1]) - adjust1) * 6 +
+              (RankOf(squares[2]) - adjust2);
+      }
+    } else {
+      // We don't have at least 3 unique pieces, like in KRRvKBB, just map the
+      // kings.
+      idx = MapKK[MapA1D1D4[squares[0]]][squares[1]];
+    }
+  }
+
+  idx *= d->group_idx[0];
+  int* group_sq = squares + d->group_len[0];
+
+  // Encode remainig pawns then pieces according to square, in ascending
+  // order.
+  bool remaining_pawns = entry->has_pawns && entry->pawn_count[1];
+
+  while (d->group_len[++next]) {
+    std::sort(group_sq, group_sq + d->group_len[next]);
+    uint64_t n = 0;
+
+    // Map down a square if "comes later" than a square in the previous
+    // groups (similar to what done earlier for leading group pieces).
+    for (int i = 0; i < d->group_len[next]; ++i) {
+      const auto adjust = std::count_if(
+          squares, group_sq, [&](int s) { return group_sq[i] > s; });
+      n += Binomial[i + 1][group_sq[i] - adjust - 8 * remaining_pawns];
+    }
+
+    remaining_pawns = false;
+    idx += n * d->group_idx[next];
+    group_sq += d->group_len[next];
+  }
+
+  // Now that we have the index, decompress the pair and get the score.
+  return WDLScore(DecompressPairs(d, idx) - 2);
+}
+
+// Group together pieces that will be encoded together. The general rule is
+// that a group contains pieces of same type and color. The exception is the
+// leading group that, in case of positions withouth pawns, can be formed by 3
+// different pieces (default) or by the king pair when there is not a unique
+// piece apart from the kings. When there are pawns, pawns are always first in
+// pieces[].
+//
+// As example KRKN -> KRK + N, KNNK -> KK + NN, KPPKP -> P + PP + K + K
+//
+// The actual grouping depends on the TB generator and can be inferred from
+// the sequence of pieces in piece[] array.
+void SetGroups(const WdlTable& e, PairsData* d, int order[], int f) {
+  int n = 0;
+  int first_len = e.has_pawns ? 0 : e.has_unique_pieces ? 3 : 2;
+  d->group_len[n] = 1;
+
+  // Number of pieces per group is stored in group_len[], for instance in
+  // KRKN the encoder will default on '111', so group_len[] will be (3, 1).
+  for (int i = 1; i < e.piece_count; ++i) {
+    if (--first_len > 0 || d->pieces[i] == d->pieces[i - 1]) {
+      d->group_len[n]++;
+    } else {
+      d->group_len[++n] = 1;
+    }
+  }
+
+  d->group_len[++n] = 0;  // Zero-terminated
+
+  // The sequence in pieces[] defines the groups, but not the order in which
+  // they are encoded. If the pieces in a group g can be combined on the board
+  // in N(g) different ways, then the position encoding will be of the form:
+  //
+  //   g1 * N(g2) * N(g3) + g2 * N(g3) + g3
+  //
+  // This ensures unique encoding for the whole position. The order of the
+  // groups is a per-table parameter and could not follow the canonical
+  // leading pawns/pieces -> remainig pawns -> remaining pieces. In particular
+  // the first group is at order[0] position and the remaining pawns, when
+  // present, are at order[1] position.
+  const bool pp = e.has_pawns && e.pawn_count[1];  // Pawns on both sides
+  int next = pp ? 2 : 1;
+  int free_squares = 64 - d->group_len[0] - (pp ? d->group_len[1] : 0);
+  uint64_t idx = 1;
+
+  for (int k = 0; next < n || k == order[0] || k == order[1]; ++k) {
+    if (k == order[0]) {
+      // Leading pawns or pieces.
+      d->group_idx[0] = idx;
+      idx *= e.has_pawns ? LeadPawnsSize[d->group_len[0]][f]
+                         : e.has_unique_pieces ? 31332 : 462;
+    } else if (k == order[1]) {
+      // Remaining pawns.
+      d->group_idx[1] = idx;
+      idx *= Binomial[d->group_len[1]][48 - d->group_len[0]];
+    } else {
+      // Remainig pieces.
+      d->group_idx[next] = idx;
+      idx *= Binomial[d->group_len[next]][free_squares];
+      free_squares -= d->group_len[next++];
+    }
+  }
+
+  d->group_idx[n] = idx;
+}
+
+// In Recursive Pairing each symbol represents a pair of childern symbols. So
+// read d->btree[] symbols data and expand each one in his left and right
+// child symbol until reaching the leafs that represent the symbol value.
+uint8_t SetSymlen(PairsData* d, Sym s, std::vector<bool>& visited) {
+  visited[s] = true;  // We can set it now because tree is acyclic
+  const Sym sr = d->btree[s].Get<LR::RIGHT>();
+  if (sr == 0xFFF) return 0;
+
+  const Sym sl = d->btree[s].Get<LR::LEFT>();
+  if (!visited[sl]) d->symlen[sl] = SetSymlen(d, sl, visited);
+  if (!visited[sr]) d->symlen[sr] = SetSymlen(d, sr, visited);
+
+  return d->symlen[sl] + d->symlen[sr] + 1;
+}
+
+uint8_t* SetSizes(PairsData* d, uint8_t* data) {
+  d->flags = *data++;
+
+  if (d->flags & SINGLE_VALUE) {
+    d->blocks_num = d->block_length_size = 0;
+    d->span = d->sparse_index_size = 0;
+    d->min_sym_len = *data++;  // Here we store the single value
+    return data;
+  }
+
+  // group_len[] is a zero-terminated list of group lengths, the last
+  // group_idx[] element stores the biggest index that is the tb size.
+  const uint64_t tb_size =
+      d->group_idx[std::find(d->group_len, d->group_len + 7, 0) -
+                   d->group_len];
+
+  d->sizeof_block = 1ULL << *data++;
+  d->span = 1ULL << *data++;
+  d->sparse_index_size = (tb_size + d->span - 1) / d->span;  // Round up
+  const auto padding = ReadLittleEndian<uint8_t>(data++);
+  d->blocks_num = ReadLittleEndian<uint32_t>(data);
+  data += sizeof(uint32_t);
+  // Padded to ensure sparse_index[] does not point out of range.
+  d->block_length_size = d->blocks_num + padding;
+  d->max_sym_len = *data++;
+  d->min_sym_len = *data++;
+  d->lowest_sym = reinterpret_cast<Sym*>(data);
+  d->base64.resize(d->max_sym_len - d->min_sym_len + 1);
+
+  // The canonical code is ordered such that longer symbols (in terms of the
+  // number of bits of their Huffman code) have lower numeric value, so that
+  // d->lowest_sym[i] >= d->lowest_sym[i+1] (when read as little endian).
+  // Starting from this we compute a base64[] table indexed by symbol length
+  // and containing 64 bit values so that d->base64[i] >= d->base64[i+1]. See
+  // http://www.eecs.harvard.edu/~michaelm/E210/huffman.pdf
+  for (int i = d->base64.size() - 2; i >= 0; --i) {
+    d->base64[i] = (d->base64[i + 1] +
+                    ReadLittleEndian<Sym>(&d->lowest_sym[i]) -
+                    ReadLittleEndian<Sym>(&d->lowest_sym[i + 1])) /
+                   2;
+  }
+
+  // Now left-shift by an amount so that d->base64[i] gets shifted 1 bit more
+  // than d->base64[i+1] and given the above condition, we ensure that
+  // d->base64[i] >= d->base64[i+1]. Moreover for any symbol s64 of length i
+  // and right-padded to 64 bits holds d->base64[i-1] >= s64 >= d->base64[i].
+  for (size_t i = 0; i < d->base64.size(); ++i) {
+    d->base64[i] <<= 64 - i - d->min_sym_len;  // Right-padding to 64 bits
+  }
+
+  data += d->base64.size() * sizeof(Sym);
+  d->symlen.resize(ReadLittleEndian<uint16_t>(data));
+  data += sizeof(uint16_t);
+  d->btree = reinterpret_cast<LR*>(data);
+
+  // The compression scheme used is "Recursive Pairing", that replaces the
+  // most frequent adjacent pair of symbols in the source message by a new
+  // symbol, reevaluating the frequencies of all of the symbol pairs with
+  // respect to the extended alphabet, and then repeating the process. See
+  // http://www.larsson.dogma.net/dcc99.pdf
+  std::vector<bool> visited(d->symlen.size());
+  for (Sym sym = 0; sym < d->symlen.size(); ++sym) {
+    if (!visited[sym]) d->symlen[sym] = SetSymlen(d, sym, visited);
+  }
+
+  return data + d->symlen.size() * sizeof(LR) + (d->symlen.size() & 1);
+}
+
+// Populates entry's PairsData records with data from the just memory mapped
+// file. Called at first access.
+void Set(WdlTable& e, uint8_t* data) {
+  data++;  // First byte stores flags
+
+  const int sides = e.key != e.key2 ? 2 : 1;
+  const int max_file = e.has_pawns ? 3 : 0;
+  const bool pp = e.has_pawns && e.pawn_count[1];  // Pawns on both sides
+
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; i++) *e.get(i, f) = PairsData();
+
+    int order[][2] = {{*data & 0xF, pp ? *(data + 1) & 0xF : 0xF},
+                      {*data >> 4, pp ? *(data + 1) >> 4 : 0xF}};
+    data += 1 + pp;
+
+    for (int k = 0; k < e.piece_count; ++k, ++data) {
+      for (int i = 0; i < sides; i++) {
+        e.get(i, f)->pieces[k] = i ? *data >> 4 : *data & 0xF;
+      }
+    }
+
+    for (int i = 0; i < sides; ++i) SetGroups(e, e.get(i, f), order[i], f);
+  }
+
+  data += reinterpret_cast<uintptr_t>(data) & 1;  // Word alignment
+
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; i++) data = SetSizes(e.get(i, f), data);
+  }
+
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; i++) {
+      PairsData* d = e.get(i, f);
+      d->sparse_index = reinterpret_cast<SparseEntry*>(data);
+      data += d->sparse_index_size * sizeof(SparseEntry);
+    }
+  }
+
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; i++) {
+      PairsData* d = e.get(i, f);
+      d->block_length = reinterpret_cast<uint16_t*>(data);
+      data += d->block_length_size * sizeof(uint16_t);
+    }
+  }
+
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; i++) {
+      // 64 byte alignment.
+      data = reinterpret_cast<uint8_t*>(
+          (reinterpret_cast<uintptr_t>(data) + 0x3F) & ~0x3F);
+      PairsData* d = e.get(i, f);
+      d->data = data;
+      data += d->blocks_num * d->sizeof_block;
+    }
+  }
+}
+
+}  // namespace
+
+class SyzygyTablebaseImpl {
+ public:
+  explicit SyzygyTablebaseImpl(const std::string& paths) {
+#ifndef _WIN32
+    const char kSeparator = ':';
+#else
+    const char kSeparator = ';';
+#endif
+    std::stringstream ss(paths);
+    std::string path;
+    while (std::getline(ss, path, kSeparator)) {
+      if (!path.empty()) paths_.push_back(path);
+    }
+  }
+
+  // Adds the table of @pieces if its file exists.
+  void Add(const std::vector<int>& pieces) {
+    std::string code;
+    for (int pt : pieces) code += kPieceToChar[pt];
+    code.insert(code.find('K', 1), "v");  // KRK -> KRvK
+    if (FindFile(code).empty()) return;
+
+    max_cardinality_ = std::max<int>(pieces.size(), max_cardinality_);
+    tables_.emplace_back(code);
+    // Both colors point to the table: KRvK with KR white and black.
+    keys_[tables_.back().key] = &tables_.back();
+    keys_[tables_.back().key2] = &tables_.back();
+  }
+
+  int max_cardinality() const { return max_cardinality_; }
+  size_t size() const { return tables_.size(); }
+
+  // For a position where the side to move has a winning capture it is not
+  // necessary to store a winning value so the generator treats such
+  // positions as "don't cares" and tries to assign to it a value that
+  // improves the compression ratio. Similarly, if the side to move has a
+  // drawing capture, then the position is at least drawn. If the position is
+  // won, then the TB needs to store a win value. But if the position is
+  // drawn, the TB may store a loss value if that is better for compression.
+  // All of this means that during probing, the engine must look at captures
+  // and probe their results and must probe the position itself. The "best"
+  // result of these probes is the correct result for the position.
+  WDLScore Search(const ChessBoard& board, ProbeState* result) {
+    WDLScore value, best_value = WDL_LOSS;
+    const auto moves = board.GenerateLegalMoves();
+    size_t move_count = 0;
+
+    for (const auto& move : moves) {
+      const bool capture =
+          board.theirs().get(move.to()) ||
+          (board.pawns().get(move.from()) &&
+           move.from().col() != move.to().col());
+      if (!capture) continue;
+      move_count++;
+
+      ChessBoard new_board = board;
+      new_board.ApplyMove(move);
+      new_board.Mirror();
+      value = -Search(new_board, result);
+
+      if (*result == ProbeState::FAIL) return WDL_DRAW;
+
+      if (value > best_value) {
+        best_value = value;
+        if (value >= WDL_WIN) {
+          *result = ProbeState::ZEROING_BEST_MOVE;  // Winning capture
+          return value;
+        }
+      }
+    }
+
+    // In case we have already searched all the legal moves we don't have to
+    // probe the TB because the stored score could be wrong. For instance TB
+    // tables do not contain information on position with ep rights, so in
+    // this case the result of the table probe is wrong. Also in case of only
+    // capture moves, for instance here 4K3/4q3/6p1/2k5/6p1/8/8/8 w - - 0 7,
+    // we have to return with ZEROING_BEST_MOVE set.
+    const bool no_more_moves = move_count && move_count == moves.size();
+
+    if (no_more_moves) {
+      value = best_value;
+    } else {
+      value = ProbeTable(board, result);
+      if (*result == ProbeState::FAIL) return WDL_DRAW;
+    }
+
+    if (best_value >= value) {
+      *result = best_value > WDL_DRAW || no_more_moves
+                    ? ProbeState::ZEROING_BEST_MOVE
+                    : ProbeState::OK;
+      return best_value;
+    }
+    *result = ProbeState::OK;
+    return value;
+  }
+
+ private:
+  WDLScore ProbeTable(const ChessBoard& board, ProbeState* result) {
+    const TbPosition pos(board);
+    if (PopCount(pos.occupied()) == 2) return WDL_DRAW;  // KvK
+
+    const auto iter = keys_.find(pos.material_key);
+    if (iter == keys_.end() || !Mapped(iter->second)) {
+      *result = ProbeState::FAIL;
+      return WDL_DRAW;
+    }
+    return DoProbeTable(pos, iter->second);
+  }
+
+  // If the file of the table is already memory mapped then returns its base
+  // address, otherwise tries to memory map and init it. Called at every
+  // probe, memory maps and inits only at first access.
+  void* Mapped(WdlTable* e) {
+    // Acquire so that a thread doesn't see ready == true while another is
+    // still filling the table in.
+    if (e->ready.load(std::memory_order_acquire)) return e->base_address;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (e->ready.load(std::memory_order_relaxed)) return e->base_address;
+
+    uint8_t* data = Map(FindFile(e->code), &e->base_address, &e->mapping);
+    if (data) Set(*e, data);
+
+    e->ready.store(true, std::memory_order_release);
+    return e->base_address;
+  }
+
+  // Returns the path of the .rtbw file of @code, empty if there is none.
+  std::string FindFile(const std::string& code) const {
+    for (const auto& path : paths_) {
+      const std::string filename = path + "/" + code + ".rtbw";
+      if (std::ifstream(filename).is_open()) return filename;
+    }
+    return {};
+  }
+
+  // Memory maps the file and checks it. Returns where the tables start, or
+  // nullptr if the file is not usable.
+  static uint8_t* Map(const std::string& filename, void** base_address,
+                      uint64_t* mapping) {
+    *base_address = nullptr;
+    if (filename.empty()) return nullptr;
+#ifndef _WIN32
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    const bool ok = fstat(fd, &st) == 0 && st.st_size >= 4;
+    void* mapped = ok ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0)
+                      : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      std::cerr << "Could not mmap() " << filename << std::endl;
+      return nullptr;
+    }
+    const uint64_t map_handle = st.st_size;
+#else
+    const HANDLE fd =
+        CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fd == INVALID_HANDLE_VALUE) return nullptr;
+    DWORD size_high;
+    const DWORD size_low = GetFileSize(fd, &size_high);
+    const HANDLE file_mapping =
+        size_high || size_low >= 4
+            ? CreateFileMapping(fd, nullptr, PAGE_READONLY, size_high,
+                                size_low, nullptr)
+            : nullptr;
+    CloseHandle(fd);
+    if (!file_mapping) {
+      std::cerr << "CreateFileMapping() failed for " << filename << std::endl;
+      return nullptr;
+    }
+    void* mapped = MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mapped) {
+      std::cerr << "MapViewOfFile() failed, name = " << filename
+                << ", error = " << GetLastError() << std::endl;
+      CloseHandle(file_mapping);
+      return nullptr;
+    }
+    const uint64_t map_handle = reinterpret_cast<uint64_t>(file_mapping);
+#endif
+
+    const uint8_t kMagic[] = {0x71, 0xE8, 0x23, 0x5D};
+    uint8_t* data = static_cast<uint8_t*>(mapped);
+    if (std::memcmp(data, kMagic, sizeof(kMagic))) {
+      std::cerr << "Corrupted table in file " << filename << std::endl;
+      Unmap(mapped, map_handle);
+      return nullptr;
+    }
+    *base_address = mapped;
+    *mapping = map_handle;
+    return data + sizeof(kMagic);
+  }
+
+  std::vector<std::string> paths_;
+  int max_cardinality_ = 0;
+  // Deque, the tables are pointed to.
+  std::deque<WdlTable> tables_;
+  std::unordered_map<uint64_t, WdlTable*> keys_;
+  std::mutex mutex_;
+};
+
+SyzygyTablebase::SyzygyTablebase() {
+  std::call_once(index_tables_once, InitIndexTables);
+}
+
+SyzygyTablebase::~SyzygyTablebase() = default;
+
+bool SyzygyTablebase::Init(const std::string& paths) {
+  impl_.reset();
+  max_cardinality_ = 0;
+  if (paths.empty()) return false;
+
+  std::unique_ptr<SyzygyTablebaseImpl> impl(new SyzygyTablebaseImpl(paths));
+  // Add entries in TB tables if the corresponding ".rtbw" file exists.
+  for (int p1 = PAWN; p1 < KING; ++p1) {
+    impl->Add({KING, p1, KING});
+    for (int p2 = PAWN; p2 <= p1; ++p2) {
+      impl->Add({KING, p1, p2, KING});
+      impl->Add({KING, p1, KING, p2});
+      for (int p3 = PAWN; p3 < KING; ++p3) impl->Add({KING, p1, p2, KING, p3});
+      for (int p3 = PAWN; p3 <= p2; ++p3) {
+        impl->Add({KING, p1, p2, p3, KING});
+        for (int p4 = PAWN; p4 <= p3; ++p4) {
+          impl->Add({KING, p1, p2, p3, p4, KING});
+        }
+        for (int p4 = PAWN; p4 < KING; ++p4) {
+          impl->Add({KING, p1, p2, p3, KING, p4});
+        }
+      }
+      for (int p3 = PAWN; p3 <= p1; ++p3) {
+        for (int p4 = PAWN; p4 <= (p1 == p3 ? p2 : p3); ++p4) {
+          impl->Add({KING, p1, p2, KING, p3, p4});
+        }
+      }
+    }
+  }
+  std::cerr << "Found " << impl->size() << " Syzygy WDL tablebases in "
+            << paths << std::endl;
+  if (!impl->size()) return false;
+  max_cardinality_ = impl->max_cardinality();
+  impl_ = std::move(impl);
+  return true;
+}
+
+WDLScore SyzygyTablebase::ProbeWdl(const ChessBoard& board,
+                                   ProbeState* result) {
+  if (!impl_ || board.castlings().as_int() != 0 ||
+      PopCount(board.ours().as_int() | board.theirs().as_int()) >
+          max_cardinality_) {
+    *result = ProbeState::FAIL;
+    return WDL_DRAW;
+  }
+  *result = ProbeState::OK;
+  return impl_->Search(board, result);
+}
+
+}  // namespace lczero
@@ -0,0 +1,77 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+  Copyright (c) 2013 Ronald de Man
+  Copyright (C) 2016-2018 Marco Costalba, Lucas Braesch
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include "chess/board.h"
+
+namespace lczero {
+
+enum WDLScore {
+  WDL_LOSS = -2,          // Loss
+  WDL_BLESSED_LOSS = -1,  // Loss, but draw under 50-move rule
+  WDL_DRAW = 0,           // Draw
+  WDL_CURSED_WIN = 1,     // Win, but draw under 50-move rule
+  WDL_WIN = 2,            // Win
+};
+
+// Possible states after a probing operation.
+enum class ProbeState {
+  FAIL,               // Probe failed (missing file table)
+  OK,                 // Probe succesful
+  ZEROING_BEST_MOVE,  // Best move zeroes DTZ (capture or pawn move)
+};
+
+class SyzygyTablebaseImpl;
+
+// Probes Syzygy WDL tablebases (.rtbw files). The probing code is the one of
+// src/syzygy/tbprobe.cpp, working on ChessBoard instead of the Position of
+// the old engine. DTZ tables are not read.
+class SyzygyTablebase {
+ public:
+  SyzygyTablebase();
+  ~SyzygyTablebase();
+
+  // Finds the tables in @paths, directories separated by ':', or by ';' on
+  // Windows. Files are memory mapped at their first probe. Returns whether
+  // any table was found. Not thread safe.
+  bool Init(const std::string& paths);
+
+  // Largest number of pieces, kings included, of the tables found.
+  int max_cardinality() const { return max_cardinality_; }
+
+  // Probes the position for the side to move. The castling rights must be
+  // gone, the tables don't know them. Sets @result to FAIL when a table is
+  // missing. Thread safe.
+  //  -2 : loss
+  //  -1 : loss, but draw under 50-move rule
+  //   0 : draw
+  //   1 : win, but draw under 50-move rule
+  //   2 : win
+  WDLScore ProbeWdl(const ChessBoard& board, ProbeState* result);
+
+ private:
+  std::unique_ptr<SyzygyTablebaseImpl> impl_;
+  int max_cardinality_ = 0;
+};
+
+}  // namespace lczero
@@ -0,0 +1,136 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "syzygy/syzygy.h"
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+
+namespace lczero {
+
+namespace {
+#ifndef _WIN32
+const char kSeparator[] = ":";
+#else
+const char kSeparator[] = ";";
+#endif
+const char kTable[] = "KQvK.rtbw";
+
+// Writes a KQvK table that doesn't start with the magic of WDL tables.
+class SyzygyTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    std::ofstream(kTable, std::ios::binary) << "not a table";
+  }
+  void TearDown() override { std::remove(kTable); }
+};
+
+// Writes a KQvK table in the format of the generator, whose two sides are
+// stored as single values instead of compressed: the side with the queen wins
+// and the other one loses. That is the real table but for positions where
+// the queen is lost or stalemate, which the probe has to find by itself.
+class SyzygyKQvKTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const unsigned char kData[] = {
+        0x71, 0xE8, 0x23, 0x5D,  // Magic of WDL tables.
+        0x01,                    // Both sides to move are stored.
+        0x00,                    // Encoding order of the groups.
+        0x55, 0x66, 0xEE,        // wQ, wK, bK for both sides.
+        0x00,                    // Word alignment.
+        0x80, 4,                 // Queen to move, single value: win.
+        0x80, 0,                 // King to move, single value: loss.
+    };
+    std::ofstream(kTable, std::ios::binary)
+        .write(reinterpret_cast<const char*>(kData), sizeof(kData));
+  }
+  void TearDown() override { std::remove(kTable); }
+};
+
+WDLScore Probe(SyzygyTablebase* tablebase, const std::string& fen,
+               ProbeState* result) {
+  ChessBoard board;
+  board.SetFromFen(fen);
+  return tablebase->ProbeWdl(board, result);
+}
+}  // namespace
+
+TEST_F(SyzygyTest, FindsTablesInEveryPath) {
+  SyzygyTablebase tablebase;
+  EXPECT_FALSE(tablebase.Init("no_such_directory"));
+  EXPECT_TRUE(
+      tablebase.Init(std::string("no_such_directory") + kSeparator + "."));
+  EXPECT_EQ(tablebase.max_cardinality(), 3);
+}
+
+TEST_F(SyzygyTest, KingsOnlyIsADraw) {
+  SyzygyTablebase tablebase;
+  ASSERT_TRUE(tablebase.Init("."));
+  ProbeState result;
+  EXPECT_EQ(Probe(&tablebase, "8/8/8/4k3/8/8/8/K7 w - - 0 1", &result),
+            WDL_DRAW);
+  EXPECT_EQ(result, ProbeState::OK);
+}
+
+TEST_F(SyzygyTest, CorruptedTableFailsTheProbe) {
+  SyzygyTablebase tablebase;
+  ASSERT_TRUE(tablebase.Init("."));
+  ProbeState result;
+  Probe(&tablebase, "8/8/8/4k3/8/8/8/KQ6 w - - 0 1", &result);
+  EXPECT_EQ(result, ProbeState::FAIL);
+  // Positions with more pieces than the tables aren't looked up.
+  Probe(&tablebase, "8/8/8/4k3/8/8/8/KQR5 w - - 0 1", &result);
+  EXPECT_EQ(result, ProbeState::FAIL);
+}
+
+TEST_F(SyzygyKQvKTest, ProbesBothSidesToMove) {
+  SyzygyTablebase tablebase;
+  ASSERT_TRUE(tablebase.Init("."));
+  ProbeState result;
+  EXPECT_EQ(Probe(&tablebase, "8/8/8/4k3/8/8/8/KQ6 w - - 0 1", &result),
+            WDL_WIN);
+  EXPECT_EQ(result, ProbeState::OK);
+  EXPECT_EQ(Probe(&tablebase, "8/8/8/4k3/8/8/8/KQ6 b - - 0 1", &result),
+            WDL_LOSS);
+  EXPECT_EQ(result, ProbeState::OK);
+  // Black stronger is the same table with the colors swapped.
+  EXPECT_EQ(Probe(&tablebase, "kq6/8/8/8/4K3/8/8/8 b - - 0 1", &result),
+            WDL_WIN);
+  EXPECT_EQ(Probe(&tablebase, "kq6/8/8/8/4K3/8/8/8 w - - 0 1", &result),
+            WDL_LOSS);
+}
+
+TEST_F(SyzygyKQvKTest, CapturingTheQueenDraws) {
+  SyzygyTablebase tablebase;
+  ASSERT_TRUE(tablebase.Init("."));
+  ProbeState result;
+  // Kxd1 leaves the kings only, better than the loss of the table.
+  EXPECT_EQ(Probe(&tablebase, "8/8/8/8/8/8/2k5/K2Q4 b - - 0 1", &result),
+            WDL_DRAW);
+  EXPECT_EQ(result, ProbeState::OK);
+  // The queen is protected.
+  EXPECT_EQ(Probe(&tablebase, "8/8/8/8/8/8/2kQ4/4K3 b - - 0 1", &result),
+            WDL_LOSS);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
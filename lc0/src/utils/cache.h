@@ -18,10 +18,15 @@
 
 #pragma once
 
+#include <array>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <vector>
+#include "utils/hugepages.h"
 #include "utils/mutex.h"
 
 namespace lczero {
@@ -32,10 +37,23 @@ class LruCache {
   static const double constexpr kLoadFactor = 1.33;
 
  public:
+  // An element of the cache. Pinned items are handed out so that they can be
+  // unpinned without a search, their fields are only for the cache itself.
+  struct Item {
+    Item(K key, std::unique_ptr<V> value, int pins)
+        : key(key), value(std::move(value)), pins(pins) {}
+    K key;
+    std::unique_ptr<V> value;
+    int pins = 0;
+    // Evicted but still pinned, deleted when unpinned.
+    bool evicted = false;
+    Item* next_in_hash = nullptr;
+    Item* prev_in_queue = nullptr;
+    Item* next_in_queue = nullptr;
+  };
+
   LruCache(int capacity = 128)
-      : capacity_(capacity), hash_(capacity * kLoadFactor + 1) {
-    std::memset(&hash_[0], 0, sizeof(hash_[0]) * hash_.size());
-  }
+      : capacity_(capacity), hash_(capacity * kLoadFactor + 1) {}
 
   ~LruCache() {
     ShrinkToCapacity(0);
@@ -46,9 +64,11 @@ class LruCache {
   // Inserts the element under key @key with value @val.
   // If the element is pinned, old value is still kept (until fully unpinned),
   // but new lookups will return updated value.
-  // If @pinned, pins inserted element, Unpin has to be called to unpin.
+  // If @pinned, pins inserted element and returns it, Unpin has to be called
+  // to unpin. Otherwise the returned item may be evicted by the time it's
+  // used.
   // In any case, puts element to front of the queue (makes it last to evict).
-  V* Insert(K key, std::unique_ptr<V> val, bool pinned = false) {
+  Item* Insert(K key, std::unique_ptr<V> val, bool pinned = false) {
     Mutex::Lock lock(mutex_);
 
     auto hash = hasher_(key) % hash_.size();
@@ -63,11 +83,11 @@ class LruCache {
     ShrinkToCapacity(capacity_ - 1);
     ++size_;
     ++allocated_;
-    Item* new_item = new Item(key, std::move(val), pinned ? 1 : 0);
+    Item* new_item = NewItem(key, std::move(val), pinned ? 1 : 0);
     new_item->next_in_hash = hash_head;
     hash_head = new_item;
     InsertIntoLru(new_item);
-    return new_item->value.get();
+    return new_item;
   }
 
   // Checks whether a key exists. Doesn't lock. Of course the next moment the
@@ -84,7 +104,7 @@ class LruCache {
   // Looks up and pins the element by key. Returns nullptr if not found.
   // If found, brings the element to the head of the queue (makes it last to
   // evict).
-  V* Lookup(K key) {
+  Item* Lookup(K key) {
     Mutex::Lock lock(mutex_);
 
     auto hash = hasher_(key) % hash_.size();
@@ -92,40 +112,21 @@ class LruCache {
       if (key == iter->key) {
         // BringToFront(iter);
         ++iter->pins;
-        return iter->value.get();
+        return iter;
       }
     }
     return nullptr;
   }
 
-  // Unpins the element given key and value.
-  void Unpin(K key, V* value) {
+  // Unpins an item returned by Lookup() or a pinned Insert(). Constant time,
+  // also when the item has been evicted in the meantime.
+  void Unpin(Item* item) {
     Mutex::Lock lock(mutex_);
-
-    // Checking evicted list first.
-    Item** cur = &evicted_head_;
-    for (Item* el = evicted_head_; el; el = el->next_in_hash) {
-      if (key == el->key && value == el->value.get()) {
-        if (--el->pins == 0) {
-          *cur = el->next_in_hash;
-          --allocated_;
-          delete el;
-        }
-        return;
-      }
-      cur = &el->next_in_hash;
-    }
-
-    // Now lookup in actve list.
-    auto hash = hasher_(key) % hash_.size();
-    for (Item* iter = hash_[hash]; iter; iter = iter->next_in_hash) {
-      if (key == iter->key && value == iter->value.get()) {
-        assert(iter->pins > 0);
-        --iter->pins;
-        return;
-      }
+    assert(item->pins > 0);
+    if (--item->pins == 0 && item->evicted) {
+      --allocated_;
+      DeleteItem(item);
     }
-    assert(false);
   }
 
   // Sets the capacity of the cache. If new capacity is less than current size
@@ -138,15 +139,16 @@ class LruCache {
     ShrinkToCapacity(capacity);
     capacity_ = capacity;
 
-    std::vector<Item*> new_hash(capacity * kLoadFactor + 1);
-    std::memset(&new_hash[0], 0, sizeof(new_hash[0]) * new_hash.size());
+    HugePageArray<Item*> new_hash(capacity * kLoadFactor + 1);
 
     if (size_ != 0) {
       for (Item* head : hash_) {
-        for (Item* iter = head; head; head = head->next_in_hash) {
+        for (Item* iter = head; iter;) {
+          Item* next = iter->next_in_hash;
           auto& new_hash_head = new_hash[hasher_(iter->key) % new_hash.size()];
           iter->next_in_hash = new_hash_head;
           new_hash_head = iter;
+          iter = next;
         }
       }
     }
@@ -163,17 +165,36 @@ class LruCache {
   }
 
  private:
-  struct Item {
-    Item(K key, std::unique_ptr<V> value, int pins)
-        : key(key), value(std::move(value)), pins(pins) {}
-    K key;
-    std::unique_ptr<V> value;
-    int pins = 0;
-    Item* next_in_hash = nullptr;
-    Item* prev_in_queue = nullptr;
-    Item* next_in_queue = nullptr;
+  // Items are allocated this many at a time.
+  static constexpr int kItemsPerSlab = 256;
+
+  using ItemStorage =
+      typename std::aligned_storage<sizeof(Item), alignof(Item)>::type;
+  // What a free slot of a slab holds.
+  struct FreeItem {
+    FreeItem* next;
   };
 
+  // Constructs an item in a free slot of the slabs, adding a slab if there
+  // is none. Slabs are only freed with the cache, so its memory doesn't
+  // shrink with its capacity.
+  Item* NewItem(K key, std::unique_ptr<V> val, int pins) REQUIRES(mutex_) {
+    if (!free_items_) {
+      slabs_.emplace_back(new ItemStorage[kItemsPerSlab]);
+      for (int i = 0; i < kItemsPerSlab; ++i) {
+        free_items_ = new (&slabs_.back()[i]) FreeItem{free_items_};
+      }
+    }
+    void* storage = free_items_;
+    free_items_ = free_items_->next;
+    return new (storage) Item(key, std::move(val), pins);
+  }
+
+  void DeleteItem(Item* item) REQUIRES(mutex_) {
+    item->~Item();
+    free_items_ = new (item) FreeItem{free_items_};
+  }
+
   void EvictItem(Item* iter) REQUIRES(mutex_) {
     --size_;
 
@@ -189,17 +210,17 @@ class LruCache {
       iter->next_in_queue->prev_in_queue = iter->prev_in_queue;
     }
 
-    // Destroy or move into evicted list dependending on whether it's pinned.
+    // Destroy or leave to the last Unpin() dependending on whether it's
+    // pinned.
     Item** cur = &hash_[hasher_(iter->key) % hash_.size()];
     for (Item* el = *cur; el; el = el->next_in_hash) {
       if (el == iter) {
         *cur = el->next_in_hash;
         if (el->pins == 0) {
           --allocated_;
-          delete el;
+          DeleteItem(el);
         } else {
-          el->next_in_hash = evicted_head_;
-          evicted_head_ = el;
+          el->evicted = true;
         }
         return;
       }
@@ -250,12 +271,13 @@ class LruCache {
   int allocated_ GUARDED_BY(mutex_) = 0;
   Item* lru_head_ GUARDED_BY(mutex_) = nullptr;  // Newest elements.
   Item* lru_tail_ GUARDED_BY(mutex_) = nullptr;  // Oldest elements.
-  Item* evicted_head_ GUARDED_BY(mutex_) =
-      nullptr;  // Evicted but pinned elements.
-  std::vector<Item*> hash_ GUARDED_BY(mutex_);
+  // Where most lookups miss the CPU caches, so on huge pages if possible.
+  HugePageArray<Item*> hash_ GUARDED_BY(mutex_);
+  std::vector<std::unique_ptr<ItemStorage[]>> slabs_ GUARDED_BY(mutex_);
+  FreeItem* free_items_ GUARDED_BY(mutex_) = nullptr;
   std::hash<K> hasher_ GUARDED_BY(mutex_);
 
-  mutable Mutex mutex_;
+  mutable Mutex mutex_{"LruCache"};
 };
 
 // Convenience class for pinning cache items.
@@ -264,36 +286,128 @@ class LruCacheLock {
  public:
   // Looks up the value in @cache by @key and pins it if found.
   LruCacheLock(LruCache<K, V>* cache, K key)
-      : cache_(cache), key_(key), value_(cache->Lookup(key_)) {}
+      : cache_(cache), item_(cache->Lookup(key)) {}
 
   // Unpins the cache entry (if holds).
   ~LruCacheLock() {
-    if (value_) cache_->Unpin(key_, value_);
+    if (item_) cache_->Unpin(item_);
   }
 
   // Returns whether lock holds any value.
-  operator bool() const { return value_; }
+  operator bool() const { return item_; }
 
   // Gets the value.
-  V* operator->() const { return value_; }
-  V* operator*() const { return value_; }
+  V* operator->() const { return item_->value.get(); }
+  V* operator*() const { return item_->value.get(); }
 
   LruCacheLock() {}
   LruCacheLock(LruCacheLock&& other)
-      : cache_(other.cache_), key_(other.key_), value_(other.value_) {
-    other.value_ = nullptr;
+      : cache_(other.cache_), item_(other.item_) {
+    other.item_ = nullptr;
   }
   void operator=(LruCacheLock&& other) {
+    if (item_) cache_->Unpin(item_);
     cache_ = other.cache_;
-    key_ = other.key_;
-    value_ = other.value_;
-    other.value_ = nullptr;
+    item_ = other.item_;
+    other.item_ = nullptr;
   }
 
  private:
   LruCache<K, V>* cache_ = nullptr;
-  K key_;
-  V* value_ = nullptr;
+  typename LruCache<K, V>::Item* item_ = nullptr;
+};
+
+// LRU cache split into shards by key, each with its own lock, LRU list and
+// part of the capacity, so that threads working on different keys don't
+// contend. Entries are evicted in LRU order within their shard only.
+// Thread-safe.
+template <class K, class V>
+class ShardedLruCache {
+ public:
+  static constexpr int kNumShards = 16;
+  using Item = typename LruCache<K, V>::Item;
+
+  ShardedLruCache(int capacity = 128) {
+    for (auto& shard : shards_) {
+      shard = std::make_unique<LruCache<K, V>>(ShardCapacity(capacity));
+    }
+  }
+
+  // Same as LruCache::Insert() of the shard of @key.
+  Item* Insert(K key, std::unique_ptr<V> val, bool pinned = false) {
+    return GetShard(key)->Insert(key, std::move(val), pinned);
+  }
+
+  // Same as LruCache::ContainsKey() of the shard of @key.
+  bool ContainsKey(K key) { return GetShard(key)->ContainsKey(key); }
+
+  // Same as LruCache::Lookup() of the shard of @key.
+  Item* Lookup(K key) { return GetShard(key)->Lookup(key); }
+
+  // Same as LruCache::Unpin() of the shard of @key, the key @item was
+  // returned for.
+  void Unpin(K key, Item* item) { GetShard(key)->Unpin(item); }
+
+  // Splits @capacity evenly between the shards.
+  void SetCapacity(int capacity) {
+    for (auto& shard : shards_) shard->SetCapacity(ShardCapacity(capacity));
+  }
+
+  // Sums of the shards, each locked in turn, so not a consistent snapshot
+  // while other threads insert.
+  int GetSize() const {
+    int size = 0;
+    for (const auto& shard : shards_) size += shard->GetSize();
+    return size;
+  }
+  int GetCapacity() const {
+    int capacity = 0;
+    for (const auto& shard : shards_) capacity += shard->GetCapacity();
+    return capacity;
+  }
+
+  // The shard which holds @key.
+  LruCache<K, V>* GetShard(K key) {
+    // Shards pick the top bits of the mixed hash, while each shard indexes
+    // its table by the hash modulo the table size, so that keys of one
+    // shard still spread over all of its buckets.
+    const uint64_t hash =
+        static_cast<uint64_t>(hasher_(key)) * 0x9E3779B97F4A7C15ULL;
+    return shards_[(hash >> 32) % kNumShards].get();
+  }
+
+ private:
+  static int ShardCapacity(int capacity) {
+    return (capacity + kNumShards - 1) / kNumShards;
+  }
+
+  std::array<std::unique_ptr<LruCache<K, V>>, kNumShards> shards_;
+  std::hash<K> hasher_;
+};
+
+// Convenience class for pinning items of a ShardedLruCache.
+template <class K, class V>
+class ShardedLruCacheLock {
+ public:
+  // Looks up the value in @cache by @key and pins it if found.
+  ShardedLruCacheLock(ShardedLruCache<K, V>* cache, K key)
+      : lock_(cache->GetShard(key), key) {}
+
+  // Returns whether lock holds any value.
+  operator bool() const { return static_cast<bool>(lock_); }
+
+  // Gets the value.
+  V* operator->() const { return *lock_; }
+  V* operator*() const { return *lock_; }
+
+  ShardedLruCacheLock() {}
+  ShardedLruCacheLock(ShardedLruCacheLock&& other) = default;
+  void operator=(ShardedLruCacheLock&& other) {
+    lock_ = std::move(other.lock_);
+  }
+
+ private:
+  LruCacheLock<K, V> lock_;
 };
 
 }  // namespace lczero
\ No newline at end of file
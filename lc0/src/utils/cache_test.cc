@@ -0,0 +1,104 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/cache.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace lczero {
+
+TEST(ShardedLruCache, InsertLookup) {
+  ShardedLruCache<uint64_t, int> cache(1000);
+  for (uint64_t i = 0; i < 100; ++i) {
+    cache.Insert(i, std::make_unique<int>(i));
+  }
+  EXPECT_EQ(cache.GetSize(), 100);
+  for (uint64_t i = 0; i < 100; ++i) {
+    ShardedLruCacheLock<uint64_t, int> lock(&cache, i);
+    ASSERT_TRUE(lock);
+    EXPECT_EQ(**lock, static_cast<int>(i));
+  }
+  ShardedLruCacheLock<uint64_t, int> lock(&cache, 1000);
+  EXPECT_FALSE(lock);
+}
+
+TEST(ShardedLruCache, CapacitySplitAcrossShards) {
+  ShardedLruCache<uint64_t, int> cache(160);
+  EXPECT_EQ(cache.GetCapacity(), 160);
+  for (uint64_t i = 0; i < 10000; ++i) {
+    cache.Insert(i, std::make_unique<int>(i));
+  }
+  EXPECT_LE(cache.GetSize(), 160);
+  cache.SetCapacity(32);
+  EXPECT_EQ(cache.GetCapacity(), 32);
+  EXPECT_LE(cache.GetSize(), 32);
+}
+
+TEST(ShardedLruCache, PinnedSurvivesEviction) {
+  ShardedLruCache<uint64_t, int> cache(16);
+  cache.Insert(42, std::make_unique<int>(42));
+  {
+    ShardedLruCacheLock<uint64_t, int> lock(&cache, 42);
+    ASSERT_TRUE(lock);
+    for (uint64_t i = 0; i < 1000; ++i) {
+      cache.Insert(i + 100, std::make_unique<int>(i));
+    }
+    EXPECT_FALSE(cache.ContainsKey(42));
+    EXPECT_EQ(**lock, 42);
+  }
+}
+
+TEST(LruCache, UnpinManyEvicted) {
+  LruCache<uint64_t, int> cache(4);
+  std::vector<LruCacheLock<uint64_t, int>> locks;
+  for (uint64_t i = 0; i < 100; ++i) {
+    cache.Insert(i, std::make_unique<int>(i));
+    locks.emplace_back(&cache, i);
+  }
+  EXPECT_EQ(cache.GetSize(), 4);
+  for (uint64_t i = 0; i < 100; ++i) {
+    EXPECT_EQ(**locks[i], static_cast<int>(i));
+  }
+  // Unpinning deletes the evicted items, the cache asserts none is left.
+  locks.clear();
+}
+
+TEST(ShardedLruCache, ConcurrentAccess) {
+  ShardedLruCache<uint64_t, int> cache(256);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&cache, t]() {
+      for (uint64_t i = 0; i < 10000; ++i) {
+        const uint64_t key = (i * 7 + t) % 1000;
+        cache.Insert(key, std::make_unique<int>(key));
+        ShardedLruCacheLock<uint64_t, int> lock(&cache, key);
+        if (lock) EXPECT_EQ(**lock, static_cast<int>(key));
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  EXPECT_LE(cache.GetSize(), 256);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
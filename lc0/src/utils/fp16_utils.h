@@ -0,0 +1,87 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace lczero {
+
+// Converts to IEEE half precision, rounding to nearest even. Values too
+// large for it become infinity, NaNs stay NaNs.
+inline uint16_t FP32toFP16(float f) {
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  const uint16_t sign = (x >> 16) & 0x8000;
+  const uint32_t abs = x & 0x7FFFFFFF;
+
+  if (abs >= 0x7F800000) {
+    // Infinity or NaN.
+    return sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0);
+  }
+  if (abs >= 0x477FF000) {
+    // Rounds to above the largest half, 65504.
+    return sign | 0x7C00;
+  }
+  if (abs < 0x38800000) {
+    // Subnormal half, or zero when below half of its smallest value.
+    if (abs < 0x33000000) return sign;
+    const int shift = 126 - (abs >> 23);
+    const uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) ++half;
+    return sign | half;
+  }
+  // Normal half. Rebias the exponent from 127 to 15 and round the mantissa
+  // from 23 to 10 bits, a carry into the exponent is still correct.
+  uint32_t half = (abs - 0x38000000) >> 13;
+  const uint32_t rest = abs & 0x1FFF;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+  return sign | half;
+}
+
+inline float FP16toFP32(uint16_t h) {
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1F;
+  uint32_t mantissa = h & 0x3FF;
+  uint32_t x;
+  if (exponent == 0x1F) {
+    // Infinity or NaN.
+    x = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {
+    // Subnormal half, normalize it.
+    exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    x = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+  }
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+}  // namespace lczero
@@ -0,0 +1,130 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/hugepages.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <fstream>
+#include <string>
+#endif
+
+namespace lczero {
+
+namespace {
+std::atomic<size_t> total_bytes{0};
+std::atomic<size_t> huge_bytes{0};
+
+#ifdef __linux__
+// Whether the kernel hands out transparent huge pages on madvise().
+bool TransparentHugePagesEnabled() {
+  static const bool enabled = []() {
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string modes;
+    std::getline(file, modes);
+    return modes.find("[always]") != std::string::npos ||
+           modes.find("[madvise]") != std::string::npos;
+  }();
+  return enabled;
+}
+
+void* MapAnonymous(size_t size, int flags) {
+  void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  return data == MAP_FAILED ? nullptr : data;
+}
+#endif
+}  // namespace
+
+HugePageBuffer::HugePageBuffer(size_t size) : size_(size) {
+  if (size == 0) return;
+#ifdef __linux__
+  const size_t kHuge = kHugePageSize;
+  if (size >= kHuge) {
+    mapped_ = (size + kHuge - 1) / kHuge * kHuge;
+#ifdef MAP_HUGETLB
+    data_ = MapAnonymous(mapped_, MAP_HUGETLB);
+    if (data_) pages_ = Pages::kReserved;
+#endif
+    if (!data_ && TransparentHugePagesEnabled()) {
+      // Transparent huge pages have to be aligned, so map a page more and
+      // cut off what is outside of the aligned range.
+      char* raw = static_cast<char*>(MapAnonymous(mapped_ + kHuge, 0));
+      if (raw) {
+        const uintptr_t address = reinterpret_cast<uintptr_t>(raw);
+        char* aligned = raw + (kHuge - address % kHuge) % kHuge;
+        if (aligned != raw) munmap(raw, aligned - raw);
+        munmap(aligned + mapped_, raw + kHuge - aligned);
+        data_ = aligned;
+        if (madvise(data_, mapped_, MADV_HUGEPAGE) == 0) {
+          pages_ = Pages::kTransparent;
+        }
+      }
+    }
+  } else {
+    mapped_ = size;
+  }
+  if (!data_) data_ = MapAnonymous(mapped_, 0);
+#else
+  data_ = std::calloc(size, 1);
+#endif
+  if (!data_) throw std::bad_alloc();
+  total_bytes += size_;
+  if (pages_ != Pages::kNormal) huge_bytes += size_;
+}
+
+HugePageBuffer::~HugePageBuffer() { Free(); }
+
+HugePageBuffer& HugePageBuffer::operator=(HugePageBuffer&& other) {
+  if (this == &other) return *this;
+  Free();
+  data_ = other.data_;
+  size_ = other.size_;
+  mapped_ = other.mapped_;
+  pages_ = other.pages_;
+  other.data_ = nullptr;
+  other.size_ = 0;
+  other.mapped_ = 0;
+  other.pages_ = Pages::kNormal;
+  return *this;
+}
+
+void HugePageBuffer::Free() {
+  if (!data_) return;
+  total_bytes -= size_;
+  if (pages_ != Pages::kNormal) huge_bytes -= size_;
+#ifdef __linux__
+  munmap(data_, mapped_);
+#else
+  std::free(data_);
+#endif
+  data_ = nullptr;
+}
+
+HugePageStats GetHugePageStats() {
+  HugePageStats stats;
+  stats.total = total_bytes;
+  stats.huge = huge_bytes;
+  return stats;
+}
+
+}  // namespace lczero
@@ -0,0 +1,105 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace lczero {
+
+// Zeroed memory for big arrays which are accessed at random, like the node
+// pool and the caches. From 2 MB pages where the system has them, so that a
+// TLB entry covers 512 times as much of it: reserved ones (MAP_HUGETLB)
+// first, then transparent ones (MADV_HUGEPAGE). Otherwise, and for less
+// than kHugePageSize, from normal pages.
+class HugePageBuffer {
+ public:
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+  enum class Pages { kNormal, kTransparent, kReserved };
+
+  HugePageBuffer() = default;
+  // Throws std::bad_alloc if there isn't even normal memory.
+  explicit HugePageBuffer(size_t size);
+  ~HugePageBuffer();
+  HugePageBuffer(HugePageBuffer&& other) { *this = std::move(other); }
+  HugePageBuffer& operator=(HugePageBuffer&& other);
+
+  void* data() const { return data_; }
+  size_t size() const { return size_; }
+  Pages pages() const { return pages_; }
+
+ private:
+  void Free();
+
+  void* data_ = nullptr;
+  size_t size_ = 0;
+  // What was mapped, size_ rounded up to whole pages.
+  size_t mapped_ = 0;
+  Pages pages_ = Pages::kNormal;
+};
+
+// Of all HugePageBuffers alive, in bytes.
+struct HugePageStats {
+  size_t total = 0;
+  size_t huge = 0;
+};
+HugePageStats GetHugePageStats();
+
+// Fixed size array of value initialized elements in a HugePageBuffer.
+template <typename T>
+class HugePageArray {
+ public:
+  HugePageArray() = default;
+  explicit HugePageArray(size_t size)
+      : buffer_(size * sizeof(T)), size_(size) {
+    T* data = this->data();
+    for (size_t i = 0; i < size_; ++i) new (data + i) T();
+  }
+  ~HugePageArray() {
+    T* data = this->data();
+    for (size_t i = 0; i < size_; ++i) data[i].~T();
+  }
+  HugePageArray(HugePageArray&& other)
+      : buffer_(std::move(other.buffer_)), size_(other.size_) {
+    other.size_ = 0;
+  }
+  HugePageArray& operator=(HugePageArray&& other) {
+    swap(other);
+    return *this;
+  }
+  void swap(HugePageArray& other) {
+    std::swap(buffer_, other.buffer_);
+    std::swap(size_, other.size_);
+  }
+
+  T* data() const { return static_cast<T*>(buffer_.data()); }
+  size_t size() const { return size_; }
+  T& operator[](size_t idx) const { return data()[idx]; }
+  T* begin() const { return data(); }
+  T* end() const { return data() + size_; }
+  HugePageBuffer::Pages pages() const { return buffer_.pages(); }
+
+ private:
+  HugePageBuffer buffer_;
+  size_t size_ = 0;
+};
+
+}  // namespace lczero
@@ -0,0 +1,130 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/hugepages.h"
+#include <gtest/gtest.h>
+#include <cstdint>
+
+namespace lczero {
+
+namespace {
+// Whether all of @buffer is zero, writing to every page of it on the way.
+bool ZeroedAndWritable(const HugePageBuffer& buffer) {
+  char* data = static_cast<char*>(buffer.data());
+  bool zeroed = true;
+  for (size_t i = 0; i < buffer.size(); i += 4096) {
+    zeroed &= data[i] == 0;
+    data[i] = 1;
+  }
+  zeroed &= data[buffer.size() - 1] == 0;
+  data[buffer.size() - 1] = 1;
+  return zeroed;
+}
+}  // namespace
+
+TEST(HugePageBuffer, SmallBuffersUseNormalPages) {
+  const auto before = GetHugePageStats();
+  {
+    HugePageBuffer buffer(HugePageBuffer::kHugePageSize - 1);
+    ASSERT_NE(buffer.data(), nullptr);
+    EXPECT_EQ(buffer.pages(), HugePageBuffer::Pages::kNormal);
+    EXPECT_TRUE(ZeroedAndWritable(buffer));
+    EXPECT_EQ(GetHugePageStats().total,
+              before.total + HugePageBuffer::kHugePageSize - 1);
+    EXPECT_EQ(GetHugePageStats().huge, before.huge);
+  }
+  EXPECT_EQ(GetHugePageStats().total, before.total);
+}
+
+TEST(HugePageBuffer, LargeBuffersFallBackToWhatThereIs) {
+  // Without reserved huge pages, as on most machines, this gets transparent
+  // or normal ones. Whichever it is, the buffer has to work.
+  const auto before = GetHugePageStats();
+  const size_t size = 3 * HugePageBuffer::kHugePageSize + 100;
+  {
+    HugePageBuffer buffer(size);
+    ASSERT_NE(buffer.data(), nullptr);
+    EXPECT_EQ(buffer.size(), size);
+    EXPECT_TRUE(ZeroedAndWritable(buffer));
+    const bool huge = buffer.pages() != HugePageBuffer::Pages::kNormal;
+    if (huge) {
+      EXPECT_EQ(reinterpret_cast<std::uintptr_t>(buffer.data()) %
+                    HugePageBuffer::kHugePageSize,
+                0u);
+    }
+    EXPECT_EQ(GetHugePageStats().total, before.total + size);
+    EXPECT_EQ(GetHugePageStats().huge, before.huge + (huge ? size : 0));
+  }
+  EXPECT_EQ(GetHugePageStats().total, before.total);
+  EXPECT_EQ(GetHugePageStats().huge, before.huge);
+}
+
+TEST(HugePageBuffer, MovesHandOverTheMemory) {
+  const auto before = GetHugePageStats();
+  const size_t size = 2 * HugePageBuffer::kHugePageSize;
+  HugePageBuffer buffer(size);
+  void* data = buffer.data();
+  const auto pages = buffer.pages();
+  static_cast<char*>(data)[42] = 7;
+
+  HugePageBuffer moved(std::move(buffer));
+  EXPECT_EQ(buffer.data(), nullptr);
+  EXPECT_EQ(buffer.size(), 0u);
+  EXPECT_EQ(moved.data(), data);
+  EXPECT_EQ(moved.size(), size);
+  EXPECT_EQ(moved.pages(), pages);
+  EXPECT_EQ(static_cast<char*>(moved.data())[42], 7);
+  EXPECT_EQ(GetHugePageStats().total, before.total + size);
+
+  // Assigning frees what the target had.
+  HugePageBuffer other(1000);
+  EXPECT_EQ(GetHugePageStats().total, before.total + size + 1000);
+  other = std::move(moved);
+  EXPECT_EQ(moved.data(), nullptr);
+  EXPECT_EQ(other.data(), data);
+  EXPECT_EQ(GetHugePageStats().total, before.total + size);
+
+  auto& self = other;
+  other = std::move(self);
+  EXPECT_EQ(other.data(), data);
+
+  other = HugePageBuffer();
+  EXPECT_EQ(other.data(), nullptr);
+  EXPECT_EQ(GetHugePageStats().total, before.total);
+  EXPECT_EQ(GetHugePageStats().huge, before.huge);
+}
+
+TEST(HugePageArray, ElementsAreValueInitializedAndMoved) {
+  HugePageArray<int> array(1000);
+  ASSERT_EQ(array.size(), 1000u);
+  for (const int value : array) EXPECT_EQ(value, 0);
+  array[999] = 5;
+
+  HugePageArray<int> moved(std::move(array));
+  EXPECT_EQ(array.size(), 0u);
+  EXPECT_EQ(array.begin(), array.end());
+  ASSERT_EQ(moved.size(), 1000u);
+  EXPECT_EQ(moved[999], 5);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,83 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/mpmc_queue.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace lczero {
+
+TEST(MpmcQueue, FifoAndCapacity) {
+  MpmcQueue<int> queue(5);
+  EXPECT_EQ(queue.GetCapacity(), 8u);
+  EXPECT_TRUE(queue.Empty());
+  for (int i = 0; i < 8; ++i) EXPECT_TRUE(queue.TryPush(i));
+  EXPECT_FALSE(queue.TryPush(8));
+  EXPECT_FALSE(queue.Empty());
+  int value;
+  for (int i = 0; i < 8; ++i) {
+    ASSERT_TRUE(queue.TryPop(&value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(queue.TryPop(&value));
+  EXPECT_TRUE(queue.Empty());
+  // Around the ring again.
+  EXPECT_TRUE(queue.TryPush(42));
+  ASSERT_TRUE(queue.TryPop(&value));
+  EXPECT_EQ(value, 42);
+}
+
+TEST(MpmcQueue, ManyProducersAndConsumers) {
+  const int kThreads = 4;
+  const int kPerThread = 100000;
+  MpmcQueue<int> queue(64);
+  std::atomic<long long> sum{0};
+  std::atomic<int> popped{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&queue, t]() {
+      for (int i = 0; i < kPerThread; ++i) {
+        while (!queue.TryPush(t * kPerThread + i)) std::this_thread::yield();
+      }
+    });
+    threads.emplace_back([&]() {
+      int value;
+      while (popped < kThreads * kPerThread) {
+        if (queue.TryPop(&value)) {
+          sum += value;
+          ++popped;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  const long long n = kThreads * kPerThread;
+  EXPECT_EQ(sum, n * (n - 1) / 2);
+  EXPECT_TRUE(queue.Empty());
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,73 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/mutex.h"
+
+#ifdef LC0_MUTEX_STATS
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+namespace lczero {
+
+namespace {
+// Not a Mutex, as that would count itself.
+std::mutex& RegistryMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::map<std::string, std::unique_ptr<LockStats>>& Registry() {
+  static auto* registry =
+      new std::map<std::string, std::unique_ptr<LockStats>>();
+  return *registry;
+}
+}  // namespace
+
+LockStats* GetLockStats(const char* name) {
+  if (!name) return nullptr;
+  std::lock_guard<std::mutex> lock(RegistryMutex());
+  auto& stats = Registry()[name];
+  if (!stats) stats = std::make_unique<LockStats>();
+  return stats.get();
+}
+
+void DumpLockStats() {
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(1);
+  std::lock_guard<std::mutex> lock(RegistryMutex());
+  for (const auto& entry : Registry()) {
+    LockStats& stats = *entry.second;
+    const uint64_t acquires = stats.acquires.exchange(0);
+    const uint64_t contended = stats.contended.exchange(0);
+    const uint64_t wait_ns = stats.wait_ns.exchange(0);
+    const uint64_t hold_ns = stats.hold_ns.exchange(0);
+    if (acquires == 0) continue;
+    oss << "lock " << entry.first << ": " << acquires << " acquires, "
+        << 100.0 * contended / acquires << "% contended, wait "
+        << wait_ns / 1e6 << "ms (" << wait_ns / acquires << "ns avg), hold "
+        << hold_ns / 1e6 << "ms\n";
+  }
+  std::cerr << oss.str();
+}
+
+}  // namespace lczero
+#endif
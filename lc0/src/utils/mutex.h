@@ -19,12 +19,56 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <mutex>
 #include <shared_mutex>
 #include "utils/cppattributes.h"
 
 namespace lczero {
 
+// Building with -DLC0_MUTEX_STATS makes the named Mutex and SharedMutex
+// instances count how often and how long they are waited for and held.
+// Instances with the same name add up. Without it the names are ignored.
+#ifdef LC0_MUTEX_STATS
+struct LockStats {
+  std::atomic<uint64_t> acquires{0};
+  // Acquires which found the lock taken.
+  std::atomic<uint64_t> contended{0};
+  std::atomic<uint64_t> wait_ns{0};
+  // Of exclusive acquires only.
+  std::atomic<uint64_t> hold_ns{0};
+};
+
+// The stats of the locks named @name, nullptr for no name. They live as long
+// as the program.
+LockStats* GetLockStats(const char* name);
+// Writes the stats of all named locks to stderr and clears them.
+void DumpLockStats();
+
+namespace internal {
+inline uint64_t LockClockNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Takes a lock through @try_lock, or @lock when that fails, counting into
+// @stats. Returns the time it got the lock.
+template <class TryLock, class Lock>
+uint64_t LockCounted(LockStats* stats, TryLock try_lock, Lock lock) {
+  ++stats->acquires;
+  if (try_lock()) return LockClockNs();
+  ++stats->contended;
+  const uint64_t start = LockClockNs();
+  lock();
+  const uint64_t acquired = LockClockNs();
+  stats->wait_ns += acquired - start;
+  return acquired;
+}
+}  // namespace internal
+#endif
+
 // Implementation of reader-preferenced shared mutex. Based on fair shared
 // mutex.
 class CAPABILITY("mutex") RpSharedMutex {
@@ -56,56 +100,115 @@ class CAPABILITY("mutex") RpSharedMutex {
 // std::mutex wrapper for clang thread safety annotation.
 class CAPABILITY("mutex") Mutex {
  public:
+  // Names the mutex for the LC0_MUTEX_STATS report.
+  explicit Mutex(const char* name = nullptr)
+#ifdef LC0_MUTEX_STATS
+      : stats_(GetLockStats(name))
+#endif
+  {
+    (void)name;
+  }
+
   // std::unique_lock<std::mutex> wrapper.
   class SCOPED_CAPABILITY Lock {
    public:
-    Lock(Mutex& m) ACQUIRE(m) : lock_(m.get_raw()) {}
+    Lock(Mutex& m) ACQUIRE(m) : lock_(m) {}
     ~Lock() RELEASE() {}
 
    private:
-    std::unique_lock<std::mutex> lock_;
+    std::unique_lock<Mutex> lock_;
   };
 
+#ifdef LC0_MUTEX_STATS
+  void lock() ACQUIRE() {
+    if (!stats_) return mutex_.lock();
+    locked_ns_ = internal::LockCounted(
+        stats_, [this]() { return mutex_.try_lock(); },
+        [this]() { mutex_.lock(); });
+  }
+  void unlock() RELEASE() {
+    if (stats_) stats_->hold_ns += internal::LockClockNs() - locked_ns_;
+    mutex_.unlock();
+  }
+#else
   void lock() ACQUIRE() { mutex_.lock(); }
   void unlock() RELEASE() { mutex_.unlock(); }
+#endif
   std::mutex& get_raw() { return mutex_; }
 
  private:
   std::mutex mutex_;
+#ifdef LC0_MUTEX_STATS
+  LockStats* const stats_;
+  // When the current holder got it.
+  uint64_t locked_ns_ = 0;
+#endif
 };
 
 // std::shared_mutex wrapper for clang thread safety annotation.
 class CAPABILITY("mutex") SharedMutex {
  public:
+  // Names the mutex for the LC0_MUTEX_STATS report.
+  explicit SharedMutex(const char* name = nullptr)
+#ifdef LC0_MUTEX_STATS
+      : stats_(GetLockStats(name))
+#endif
+  {
+    (void)name;
+  }
+
   // std::unique_lock<std::shared_mutex> wrapper.
   class SCOPED_CAPABILITY Lock {
    public:
-    Lock(SharedMutex& m) ACQUIRE(m) : lock_(m.get_raw()) {}
+    Lock(SharedMutex& m) ACQUIRE(m) : lock_(m) {}
     ~Lock() RELEASE() {}
 
    private:
-    std::unique_lock<std::shared_timed_mutex> lock_;
+    std::unique_lock<SharedMutex> lock_;
   };
 
   // std::shared_lock<std::shared_mutex> wrapper.
   class SCOPED_CAPABILITY SharedLock {
    public:
-    SharedLock(SharedMutex& m) ACQUIRE_SHARED(m) : lock_(m.get_raw()) {}
+    SharedLock(SharedMutex& m) ACQUIRE_SHARED(m) : lock_(m) {}
     ~SharedLock() RELEASE() {}
 
    private:
-    std::shared_lock<std::shared_timed_mutex> lock_;
+    std::shared_lock<SharedMutex> lock_;
   };
 
+#ifdef LC0_MUTEX_STATS
+  void lock() ACQUIRE() {
+    if (!stats_) return mutex_.lock();
+    locked_ns_ = internal::LockCounted(
+        stats_, [this]() { return mutex_.try_lock(); },
+        [this]() { mutex_.lock(); });
+  }
+  void unlock() RELEASE() {
+    if (stats_) stats_->hold_ns += internal::LockClockNs() - locked_ns_;
+    mutex_.unlock();
+  }
+  void lock_shared() ACQUIRE_SHARED() {
+    if (!stats_) return mutex_.lock_shared();
+    internal::LockCounted(stats_,
+                          [this]() { return mutex_.try_lock_shared(); },
+                          [this]() { mutex_.lock_shared(); });
+  }
+#else
   void lock() ACQUIRE() { mutex_.lock(); }
   void unlock() RELEASE() { mutex_.unlock(); }
   void lock_shared() ACQUIRE_SHARED() { mutex_.lock_shared(); }
+#endif
   void unlock_shared() RELEASE_SHARED() { mutex_.unlock_shared(); }
 
   std::shared_timed_mutex& get_raw() { return mutex_; }
 
  private:
   std::shared_timed_mutex mutex_;
+#ifdef LC0_MUTEX_STATS
+  LockStats* const stats_;
+  uint64_t locked_ns_ = 0;
+#endif
 };
 
-}  // namespace lczero
\ No newline at end of file
+}  // namespace lczero
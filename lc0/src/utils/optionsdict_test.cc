@@ -0,0 +1,45 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "utils/optionsdict.h"
+#include <gtest/gtest.h>
+
+namespace lczero {
+
+TEST(OptionsDict, QuotedStringsAfterOtherOptions) {
+  const auto dict = OptionsDict::FromString(
+      "threads=2, weights=\"a b.pb.gz\", sub(backend='blas', path=\"x,y\")");
+  EXPECT_EQ(dict.Get<int>("threads"), 2);
+  EXPECT_EQ(dict.Get<std::string>("weights"), "a b.pb.gz");
+  const auto& sub = dict.GetSubdict("sub");
+  EXPECT_EQ(sub.Get<std::string>("backend"), "blas");
+  EXPECT_EQ(sub.Get<std::string>("path"), "x,y");
+}
+
+TEST(OptionsDict, EmptyQuotedString) {
+  const auto dict = OptionsDict::FromString("a=1,b=\"\"");
+  EXPECT_EQ(dict.Get<std::string>("b"), "");
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
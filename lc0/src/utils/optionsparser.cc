@@ -34,12 +34,18 @@ OptionsParser::OptionsParser() : values_(*defaults_.AddSubdict("values")) {}
 std::vector<std::string> OptionsParser::ListOptionsUci() const {
   std::vector<std::string> result;
   for (const auto& iter : options_) {
+    if (iter->hidden_) continue;
     result.emplace_back("option name " + iter->GetName() + " " +
                         iter->GetOptionString(defaults_));
   }
   return result;
 }
 
+void OptionsParser::HideOption(const std::string& name) {
+  auto option = FindOptionByName(name);
+  if (option) option->hidden_ = true;
+}
+
 void OptionsParser::SetOption(const std::string& name, const std::string& value,
                               const std::string& context) {
   auto option = FindOptionByName(name);
@@ -100,6 +106,7 @@ bool OptionsParser::ProcessAllFlags() {
       }
       bool processed = false;
       for (auto& option : options_) {
+        if (option->hidden_) continue;
         if (option->ProcessLongFlag(param, value, GetMutableOptions(context))) {
           processed = true;
           break;
@@ -120,6 +127,7 @@ bool OptionsParser::ProcessAllFlags() {
         value = *(iter + 1);
       }
       for (auto& option : options_) {
+        if (option->hidden_) continue;
         if (option->ProcessShortFlag(param[1], GetMutableOptions(context))) {
           processed = true;
           break;
@@ -200,7 +208,9 @@ void OptionsParser::ShowHelp() const {
   }
   std::cerr << "\nAllowed command line flags for current mode:\n";
   std::cerr << FormatFlag('h', "help", "Show help and exit");
-  for (const auto& option : options_) std::cerr << option->GetHelp(defaults_);
+  for (const auto& option : options_) {
+    if (!option->hidden_) std::cerr << option->GetHelp(defaults_);
+  }
 }
 
 /////////////////////////////////////////////////////////////////
@@ -64,6 +64,7 @@ class OptionsParser {
     std::string name_;
     std::string long_flag_;
     char short_flag_;
+    bool hidden_ = false;
     friend class OptionsParser;
   };
 
@@ -79,6 +80,9 @@ class OptionsParser {
         options_.back()->GetName());
   }
 
+  // Hides the option from the help, the UCI options and the command line
+  // flags. It keeps its default value.
+  void HideOption(const std::string& name);
   // Returns list of options in UCI format.
   std::vector<std::string> ListOptionsUci() const;
 
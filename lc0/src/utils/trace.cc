@@ -0,0 +1,109 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/trace.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+namespace lczero {
+
+Tracer::Tracer() : start_(std::chrono::steady_clock::now()) {}
+
+Tracer& Tracer::Get() {
+  static Tracer tracer;
+  return tracer;
+}
+
+void Tracer::SetFilename(const std::string& filename) {
+  Mutex::Lock lock(mutex_);
+  filename_ = filename;
+  enabled_ = !filename.empty();
+}
+
+Tracer::ThreadEvents* Tracer::GetThreadEvents() {
+  // Gives the ring back when the thread exits.
+  struct Holder {
+    ThreadEvents* events = nullptr;
+    ~Holder() {
+      if (events) Tracer::Get().ReleaseThreadEvents(events);
+    }
+  };
+  thread_local Holder holder;
+  if (!holder.events) {
+    Mutex::Lock lock(mutex_);
+    if (!free_threads_.empty()) {
+      holder.events = free_threads_.back();
+      free_threads_.pop_back();
+    } else {
+      threads_.emplace_back(std::make_unique<ThreadEvents>());
+      holder.events = threads_.back().get();
+      holder.events->tid = threads_.size();
+    }
+  }
+  return holder.events;
+}
+
+void Tracer::ReleaseThreadEvents(ThreadEvents* events) {
+  Mutex::Lock lock(mutex_);
+  free_threads_.push_back(events);
+}
+
+void Tracer::Record(const char* name,
+                    std::chrono::steady_clock::time_point begin,
+                    std::chrono::steady_clock::time_point end) {
+  ThreadEvents* events = GetThreadEvents();
+  const uint64_t count = events->count.load(std::memory_order_relaxed);
+  Event& event = events->events[count % ThreadEvents::kCapacity];
+  event.name = name;
+  event.begin_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(begin - start_)
+          .count();
+  event.end_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start_)
+          .count();
+  events->count.store(count + 1, std::memory_order_release);
+}
+
+void Tracer::Write() {
+  Mutex::Lock lock(mutex_);
+  if (filename_.empty()) return;
+  std::ofstream out(filename_);
+  if (!out) {
+    std::cerr << "Cannot write trace to " << filename_ << std::endl;
+    return;
+  }
+  out << "{\"traceEvents\":[";
+  bool first = true;
+  for (const auto& thread : threads_) {
+    const uint64_t count = thread->count.load(std::memory_order_acquire);
+    const uint64_t size =
+        std::min<uint64_t>(count, ThreadEvents::kCapacity);
+    for (uint64_t i = count - size; i < count; ++i) {
+      const Event& event = thread->events[i % ThreadEvents::kCapacity];
+      out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name
+          << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread->tid
+          << ",\"ts\":" << event.begin_us
+          << ",\"dur\":" << event.end_us - event.begin_us << "}";
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+}
+
+}  // namespace lczero
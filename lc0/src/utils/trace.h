@@ -0,0 +1,102 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "utils/mutex.h"
+
+namespace lczero {
+
+// Records when threads run which phase, so that search threads, multiplexer
+// workers and backends can be seen overlapping in time. The events are
+// written as Chrome trace event JSON, which chrome://tracing and Perfetto
+// open.
+class Tracer {
+ public:
+  static Tracer& Get();
+
+  // Starts recording, for Write() to write into @filename. Empty stops.
+  void SetFilename(const std::string& filename);
+  bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Records that the calling thread ran @name from @begin to @end. @name is
+  // kept as a pointer, so it must be a literal. Only the latest events of
+  // every thread are kept.
+  void Record(const char* name, std::chrono::steady_clock::time_point begin,
+              std::chrono::steady_clock::time_point end);
+
+  // Writes what is recorded to the file, if there is one. Events recorded
+  // while it writes may come out garbled, so it's for when threads are done.
+  void Write();
+
+ private:
+  struct Event {
+    const char* name;
+    int64_t begin_us;
+    int64_t end_us;
+  };
+  // Written by its thread only, without locks.
+  struct ThreadEvents {
+    static const int kCapacity = 1 << 16;
+    int tid;
+    Event events[kCapacity];
+    // Total recorded, the latest kCapacity of which are in the ring.
+    std::atomic<uint64_t> count{0};
+  };
+
+  Tracer();
+  ThreadEvents* GetThreadEvents();
+  // Called when the thread recording into @events exits.
+  void ReleaseThreadEvents(ThreadEvents* events);
+
+  const std::chrono::steady_clock::time_point start_;
+  std::atomic<bool> enabled_{false};
+  Mutex mutex_;
+  std::string filename_ GUARDED_BY(mutex_);
+  // Kept after their threads exit, for Write().
+  std::vector<std::unique_ptr<ThreadEvents>> threads_ GUARDED_BY(mutex_);
+  // Rings of exited threads, which new threads record into, under the same
+  // tid, rather than allocating new ones.
+  std::vector<ThreadEvents*> free_threads_ GUARDED_BY(mutex_);
+};
+
+// Records its lifetime as an event named @name, when tracing is enabled.
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name)
+      : name_(Tracer::Get().IsEnabled() ? name : nullptr) {
+    if (name_) begin_ = std::chrono::steady_clock::now();
+  }
+  ~TraceScope() {
+    if (name_) {
+      Tracer::Get().Record(name_, begin_, std::chrono::steady_clock::now());
+    }
+  }
+
+ private:
+  const char* const name_;
+  std::chrono::steady_clock::time_point begin_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,77 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/trace.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <thread>
+
+namespace lczero {
+
+namespace {
+const char kTraceFile[] = "trace_test.json";
+
+// Returns the tids of the events named @name in the written trace.
+std::set<int> WrittenTids(const std::string& name) {
+  Tracer::Get().Write();
+  std::ifstream in(kTraceFile);
+  std::set<int> tids;
+  std::string line;
+  const std::string prefix = "{\"name\":\"" + name + "\"";
+  while (std::getline(in, line)) {
+    if (line.compare(0, prefix.size(), prefix) != 0) continue;
+    const auto pos = line.find("\"tid\":");
+    tids.insert(std::stoi(line.substr(pos + 6)));
+  }
+  return tids;
+}
+}  // namespace
+
+TEST(Tracer, ReusesRingsOfExitedThreads) {
+  Tracer::Get().SetFilename(kTraceFile);
+  for (int i = 0; i < 5; ++i) {
+    std::thread([]() { TraceScope scope("sequential"); }).join();
+  }
+  const auto tids = WrittenTids("sequential");
+  EXPECT_EQ(tids.size(), 1u);
+
+  // Threads that are alive at the same time record into separate rings.
+  std::atomic<int> recorded{0};
+  auto record = [&recorded]() {
+    { TraceScope scope("concurrent"); }
+    ++recorded;
+    while (recorded < 2) std::this_thread::yield();
+  };
+  std::thread a(record);
+  std::thread b(record);
+  a.join();
+  b.join();
+  EXPECT_EQ(WrittenTids("concurrent").size(), 2u);
+  std::remove(kTraceFile);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,98 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/worker_pool.h"
+#include <algorithm>
+#include <exception>
+
+namespace lczero {
+
+WorkerPool::WorkerPool(int workers) {
+  for (int i = 0; i < workers; ++i) {
+    workers_.emplace_back([this]() { Worker(); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    abort_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& worker : workers_) worker.join();
+}
+
+void WorkerPool::RunJob(Job* job) {
+  try {
+    (*job->work)();
+  } catch (...) {
+    job->error = std::current_exception();
+  }
+}
+
+void WorkerPool::Worker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this]() { return abort_ || !queue_.empty(); });
+    if (abort_) return;
+    Job* job = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+    RunJob(job);
+    lock.lock();
+    job->done = true;
+    done_cv_.notify_all();
+  }
+}
+
+void WorkerPool::Run(const std::vector<std::function<void()>>& parts) {
+  if (parts.empty()) return;
+  std::vector<Job> jobs(parts.size());
+  for (size_t i = 0; i < jobs.size(); ++i) jobs[i].work = &parts[i];
+
+  if (jobs.size() == 1 || workers_.empty()) {
+    for (auto& job : jobs) RunJob(&job);
+  } else {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t i = 0; i + 1 < jobs.size(); ++i) queue_.push_back(&jobs[i]);
+    }
+    work_cv_.notify_all();
+    RunJob(&jobs.back());
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (size_t i = 0; i + 1 < jobs.size(); ++i) {
+      auto iter = std::find(queue_.begin(), queue_.end(), &jobs[i]);
+      if (iter == queue_.end()) continue;
+      queue_.erase(iter);
+      lock.unlock();
+      RunJob(&jobs[i]);
+      lock.lock();
+      jobs[i].done = true;
+    }
+    done_cv_.wait(lock, [&jobs]() {
+      return std::all_of(jobs.begin(), jobs.end() - 1,
+                         [](const Job& job) { return job.done; });
+    });
+  }
+  for (const auto& job : jobs) {
+    if (job.error) std::rethrow_exception(job.error);
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,69 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lczero {
+
+// Helper threads, started once, for callers which split their work into
+// parts. Run() hands all parts but the last one to the workers and runs the
+// last one on the calling thread. Parts no worker has taken by then, because
+// the workers are busy with the parts of other callers, the caller runs
+// itself: a pool shared by many callers is never slower than running the
+// parts in a row.
+class WorkerPool {
+ public:
+  // With no @workers, Run() runs every part on the calling thread.
+  explicit WorkerPool(int workers);
+  ~WorkerPool();
+
+  int GetWorkerCount() const { return workers_.size(); }
+
+  // Runs all of @parts and returns once they are done. If parts throw, the
+  // exception of the first of them is rethrown then.
+  void Run(const std::vector<std::function<void()>>& parts);
+
+ private:
+  struct Job {
+    const std::function<void()>* work;
+    std::exception_ptr error;
+    // Guarded by mutex_.
+    bool done = false;
+  };
+
+  static void RunJob(Job* job);
+  void Worker();
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  // Jobs no worker has taken yet. Guarded by mutex_.
+  std::deque<Job*> queue_;
+  bool abort_ = false;
+};
+
+}  // namespace lczero
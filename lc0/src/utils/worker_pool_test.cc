@@ -0,0 +1,79 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "utils/worker_pool.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace lczero {
+
+TEST(WorkerPool, RunsEveryPart) {
+  for (int workers : {0, 1, 3}) {
+    WorkerPool pool(workers);
+    EXPECT_EQ(pool.GetWorkerCount(), workers);
+    std::vector<int> done(10);
+    std::vector<std::function<void()>> parts;
+    for (size_t i = 0; i < done.size(); ++i) {
+      parts.emplace_back([&done, i]() { ++done[i]; });
+    }
+    pool.Run(parts);
+    for (int count : done) EXPECT_EQ(count, 1);
+  }
+}
+
+TEST(WorkerPool, CallerRunsTheLastPart) {
+  WorkerPool pool(2);
+  std::thread::id last;
+  pool.Run({[]() {}, [&last]() { last = std::this_thread::get_id(); }});
+  EXPECT_EQ(last, std::this_thread::get_id());
+}
+
+TEST(WorkerPool, SharedByCallers) {
+  WorkerPool pool(2);
+  std::atomic<int> sum{0};
+  std::vector<std::thread> callers;
+  for (int i = 0; i < 4; ++i) {
+    callers.emplace_back([&pool, &sum]() {
+      for (int j = 0; j < 100; ++j) {
+        pool.Run({[&sum]() { ++sum; }, [&sum]() { ++sum; },
+                  [&sum]() { ++sum; }});
+      }
+    });
+  }
+  for (auto& caller : callers) caller.join();
+  EXPECT_EQ(sum, 4 * 100 * 3);
+}
+
+TEST(WorkerPool, RethrowsAfterAllParts) {
+  WorkerPool pool(1);
+  std::atomic<int> done{0};
+  EXPECT_THROW(pool.Run({[]() { throw std::runtime_error("part"); },
+                         [&done]() { ++done; }, [&done]() { ++done; }}),
+               std::runtime_error);
+  EXPECT_EQ(done, 2);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
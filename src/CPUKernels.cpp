@@ -0,0 +1,873 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "CPUKernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPUKERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit vector instructions in functions that are
+// marked for them. MSVC accepts the intrinsics anywhere.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define TARGET_AVX512VNNI __attribute__((target("avx512f,avx512vnni")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define TARGET_AVX512VNNI
+#endif
+
+namespace {
+    // fixed for 8x8
+    constexpr auto W = 8;
+    constexpr auto H = 8;
+    constexpr auto WINOGRAD_ALPHA = 4;
+    constexpr auto WINOGRAD_TILE = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
+    constexpr auto WTILES = (W + 1) / 2;
+    constexpr auto P = WTILES * WTILES;
+    // Input plane with a border of zeros, so tiles don't need bounds checks.
+    constexpr auto PADDED = W + 2;
+
+    void winograd_transform_in_scalar(const float* in, float* V, int C) {
+        for (auto ch = 0; ch < C; ch++) {
+            for (auto block_y = 0; block_y < WTILES; block_y++) {
+                for (auto block_x = 0; block_x < WTILES; block_x++) {
+
+                    // Tiles overlap by 2
+                    const auto yin = 2 * block_y - 1;
+                    const auto xin = 2 * block_x - 1;
+
+                    // Cache input tile and handle zero padding
+                    using WinogradTile =
+                        std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
+                    WinogradTile x;
+
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            if ((yin + i) >= 0 && (xin + j) >= 0
+                                && (yin + i) < H && (xin + j) < W) {
+                                x[i][j] = in[ch*(W*H) + (yin+i)*W + (xin+j)];
+                            } else {
+                                x[i][j] = 0.0f;
+                            }
+                        }
+                    }
+
+                    const auto offset = ch*P + block_y*WTILES + block_x;
+
+                    // Calculates transpose(B).x.B
+                    // B = [[ 1.0,  0.0,  0.0,  0.0],
+                    //      [ 0.0,  1.0, -1.0,  1.0],
+                    //      [-1.0,  1.0,  1.0,  0.0],
+                    //      [ 0.0,  0.0,  0.0, -1.0]]
+
+                    WinogradTile T1, T2;
+
+                    T1[0][0] = x[0][0] - x[2][0];
+                    T1[0][1] = x[0][1] - x[2][1];
+                    T1[0][2] = x[0][2] - x[2][2];
+                    T1[0][3] = x[0][3] - x[2][3];
+                    T1[1][0] = x[1][0] + x[2][0];
+                    T1[1][1] = x[1][1] + x[2][1];
+                    T1[1][2] = x[1][2] + x[2][2];
+                    T1[1][3] = x[1][3] + x[2][3];
+                    T1[2][0] = x[2][0] - x[1][0];
+                    T1[2][1] = x[2][1] - x[1][1];
+                    T1[2][2] = x[2][2] - x[1][2];
+                    T1[2][3] = x[2][3] - x[1][3];
+                    T1[3][0] = x[1][0] - x[3][0];
+                    T1[3][1] = x[1][1] - x[3][1];
+                    T1[3][2] = x[1][2] - x[3][2];
+                    T1[3][3] = x[1][3] - x[3][3];
+
+                    T2[0][0] = T1[0][0] - T1[0][2];
+                    T2[0][1] = T1[0][1] + T1[0][2];
+                    T2[0][2] = T1[0][2] - T1[0][1];
+                    T2[0][3] = T1[0][1] - T1[0][3];
+                    T2[1][0] = T1[1][0] - T1[1][2];
+                    T2[1][1] = T1[1][1] + T1[1][2];
+                    T2[1][2] = T1[1][2] - T1[1][1];
+                    T2[1][3] = T1[1][1] - T1[1][3];
+                    T2[2][0] = T1[2][0] - T1[2][2];
+                    T2[2][1] = T1[2][1] + T1[2][2];
+                    T2[2][2] = T1[2][2] - T1[2][1];
+                    T2[2][3] = T1[2][1] - T1[2][3];
+                    T2[3][0] = T1[3][0] - T1[3][2];
+                    T2[3][1] = T1[3][1] + T1[3][2];
+                    T2[3][2] = T1[3][2] - T1[3][1];
+                    T2[3][3] = T1[3][1] - T1[3][3];
+
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            V[(i*WINOGRAD_ALPHA + j)*C*P + offset] = T2[i][j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void winograd_transform_out_scalar(const float* M, float* Y, int K) {
+        for (auto k = 0; k < K; k++) {
+            for (auto block_x = 0; block_x < WTILES; block_x++) {
+                for (auto block_y = 0; block_y < WTILES; block_y++) {
+
+                    const auto x = 2 * block_x;
+                    const auto y = 2 * block_y;
+
+                    const auto b = block_y * WTILES + block_x;
+                    std::array<float, WINOGRAD_TILE> temp_m;
+                    for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
+                        for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                            temp_m[xi*WINOGRAD_ALPHA + nu] =
+                                M[xi*(WINOGRAD_ALPHA*K*P) + nu*(K*P)+ k*P + b];
+                        }
+                    }
+
+                    // Calculates transpose(A).temp_m.A
+                    //    A = [1.0,  0.0],
+                    //        [1.0,  1.0],
+                    //        [1.0, -1.0],
+                    //        [0.0, -1.0]]
+
+                    auto o11 =
+                        temp_m[0*4 + 0] + temp_m[0*4 + 1] + temp_m[0*4 + 2] +
+                        temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] +
+                        temp_m[2*4 + 0] + temp_m[2*4 + 1] + temp_m[2*4 + 2];
+
+                    auto o12 =
+                        temp_m[0*4 + 1] - temp_m[0*4 + 2] - temp_m[0*4 + 3] +
+                        temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] +
+                        temp_m[2*4 + 1] - temp_m[2*4 + 2] - temp_m[2*4 + 3];
+
+                    auto o21 =
+                        temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] -
+                        temp_m[2*4 + 0] - temp_m[2*4 + 1] - temp_m[2*4 + 2] -
+                        temp_m[3*4 + 0] - temp_m[3*4 + 1] - temp_m[3*4 + 2];
+
+                    auto o22 =
+                        temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] -
+                        temp_m[2*4 + 1] + temp_m[2*4 + 2] + temp_m[2*4 + 3] -
+                        temp_m[3*4 + 1] + temp_m[3*4 + 2] + temp_m[3*4 + 3];
+
+                    Y[k*(H*W) + (y)*W + (x)] = o11;
+                    if (x + 1 < W) {
+                        Y[k*(H*W) + (y)*W + (x+1)] = o12;
+                    }
+                    if (y + 1 < H) {
+                        Y[k*(H*W) + (y+1)*W + (x)] = o21;
+                        if (x + 1 < W) {
+                            Y[k*(H*W) + (y+1)*W + (x+1)] = o22;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // F(4x4, 3x3): 6x6 tiles overlapping by 2, so 2x2 of them cover the
+    // board.
+    constexpr auto WINOGRAD4_ALPHA = 6;
+    constexpr auto WINOGRAD4_TILE = WINOGRAD4_ALPHA * WINOGRAD4_ALPHA;
+    constexpr auto WTILES4 = 2;
+    constexpr auto P4 = WTILES4 * WTILES4;
+    // The transforms work on this many tiles at a time, a tile per lane,
+    // so that the compiler can vectorize across tiles.
+    constexpr auto CHUNK = 64;
+    static_assert(CHUNK % P4 == 0, "chunks must hold whole planes");
+
+    // y = transpose(B).x for count lanes, element i of the vector x of a
+    // lane at x[i * x_stride + lane], the same for y.
+    //  transpose(B) = [[4,  0, -5,  0, 1, 0],
+    //                  [0, -4, -4,  1, 1, 0],
+    //                  [0,  4, -4, -1, 1, 0],
+    //                  [0, -2, -1,  2, 1, 0],
+    //                  [0,  2, -1, -2, 1, 0],
+    //                  [0,  4,  0, -5, 0, 1]]
+    void winograd4_bt(const float* x, int x_stride, float* y, int y_stride,
+                      int count) {
+        for (auto l = 0; l < count; l++) {
+            const auto x0 = x[l];
+            const auto x1 = x[x_stride + l];
+            const auto x2 = x[2 * x_stride + l];
+            const auto x3 = x[3 * x_stride + l];
+            const auto x4 = x[4 * x_stride + l];
+            const auto x5 = x[5 * x_stride + l];
+            y[l] = 4.0f * x0 - 5.0f * x2 + x4;
+            y[y_stride + l] = -4.0f * (x1 + x2) + x3 + x4;
+            y[2 * y_stride + l] = 4.0f * (x1 - x2) - x3 + x4;
+            y[3 * y_stride + l] = 2.0f * (x3 - x1) - x2 + x4;
+            y[4 * y_stride + l] = 2.0f * (x1 - x3) - x2 + x4;
+            y[5 * y_stride + l] = 4.0f * x1 - 5.0f * x3 + x5;
+        }
+    }
+
+    // y = transpose(A).x in the layout of winograd4_bt().
+    //  transpose(A) = [[1, 1,  1, 1,  1, 0],
+    //                  [0, 1, -1, 2, -2, 0],
+    //                  [0, 1,  1, 4,  4, 0],
+    //                  [0, 1, -1, 8, -8, 1]]
+    void winograd4_at(const float* x, int x_stride, float* y, int y_stride,
+                      int count) {
+        for (auto l = 0; l < count; l++) {
+            const auto sum12 = x[x_stride + l] + x[2 * x_stride + l];
+            const auto diff12 = x[x_stride + l] - x[2 * x_stride + l];
+            const auto sum34 = x[3 * x_stride + l] + x[4 * x_stride + l];
+            const auto diff34 = x[3 * x_stride + l] - x[4 * x_stride + l];
+            y[l] = x[l] + sum12 + sum34;
+            y[y_stride + l] = diff12 + 2.0f * diff34;
+            y[2 * y_stride + l] = sum12 + 4.0f * sum34;
+            y[3 * y_stride + l] = diff12 + 8.0f * diff34 + x[5 * x_stride + l];
+        }
+    }
+
+    void winograd4_transform_in_scalar(const float* in, float* V, int C) {
+        constexpr auto A = WINOGRAD4_ALPHA;
+        // Tiles are numbered ch * P4 + tile, like the columns of V.
+        const auto N = C * P4;
+        float x[WINOGRAD4_TILE][CHUNK];
+        float T1[WINOGRAD4_TILE][CHUNK];
+        std::array<float, PADDED * PADDED> padded{};
+        for (auto n0 = 0; n0 < N; n0 += CHUNK) {
+            const auto count = std::min(CHUNK, N - n0);
+            // A chunk holds the tiles of whole planes.
+            for (auto l = 0; l < count; l += P4) {
+                const auto ch = (n0 + l) / P4;
+                for (auto y = 0; y < H; y++) {
+                    std::copy(&in[ch*(W*H) + y*W], &in[ch*(W*H) + (y + 1)*W],
+                              &padded[(y + 1)*PADDED + 1]);
+                }
+                for (auto tile = 0; tile < P4; tile++) {
+                    const auto yin = 4 * (tile / WTILES4);
+                    const auto xin = 4 * (tile % WTILES4);
+                    for (auto i = 0; i < A; i++) {
+                        for (auto j = 0; j < A; j++) {
+                            x[i*A + j][l + tile] =
+                                padded[(yin + i)*PADDED + xin + j];
+                        }
+                    }
+                }
+            }
+            // transpose(B).x.B, the columns and then the rows, which go
+            // straight into V.
+            for (auto j = 0; j < A; j++) {
+                winograd4_bt(x[j], A * CHUNK, T1[j], A * CHUNK, count);
+            }
+            for (auto i = 0; i < A; i++) {
+                winograd4_bt(T1[i * A], CHUNK, &V[i*A*N + n0], N, count);
+            }
+        }
+    }
+
+    void winograd4_transform_out_scalar(const float* M, float* Y, int K) {
+        constexpr auto A = WINOGRAD4_ALPHA;
+        const auto N = K * P4;
+        float T1[4 * A][CHUNK];
+        float out[4 * 4][CHUNK];
+        for (auto n0 = 0; n0 < N; n0 += CHUNK) {
+            const auto count = std::min(CHUNK, N - n0);
+            // transpose(A).m.A, the columns straight from M, then the rows.
+            for (auto j = 0; j < A; j++) {
+                winograd4_at(&M[j*N + n0], A * N, T1[j], A * CHUNK, count);
+            }
+            for (auto i = 0; i < 4; i++) {
+                winograd4_at(T1[i * A], CHUNK, out[i * 4], CHUNK, count);
+            }
+            for (auto l = 0; l < count; l++) {
+                const auto k = (n0 + l) / P4;
+                const auto tile = (n0 + l) % P4;
+                const auto y = 4 * (tile / WTILES4);
+                const auto x = 4 * (tile % WTILES4);
+                for (auto i = 0; i < 4; i++) {
+                    for (auto j = 0; j < 4; j++) {
+                        Y[k*(H*W) + (y + i)*W + x + j] = out[i*4 + j][l];
+                    }
+                }
+            }
+        }
+    }
+
+    void bias_relu_scalar(size_t channels, size_t spatial_size, float* data,
+                          const float* biases, const float* eltwise) {
+        for (auto c = size_t{0}; c < channels; ++c) {
+            const auto bias = biases[c];
+            auto arr = &data[c * spatial_size];
+            auto res = eltwise ? &eltwise[c * spatial_size] : nullptr;
+            for (auto b = size_t{0}; b < spatial_size; b++) {
+                auto val = arr[b] + bias;
+                if (res) {
+                    val += res[b];
+                }
+                arr[b] = val > 0.0f ? val : 0.0f;
+            }
+        }
+    }
+
+    void add_bias_scalar(size_t outputs, float* data, const float* biases,
+                         bool relu) {
+        for (auto o = size_t{0}; o < outputs; o++) {
+            auto val = biases[o] + data[o];
+            if (relu && val < 0.0f) {
+                val = 0.0f;
+            }
+            data[o] = val;
+        }
+    }
+
+    void int8_gemm_scalar(int M, int N, int K4, const int8_t* A,
+                          const uint8_t* B, const float* scales, float* C) {
+        auto sums = std::vector<int32_t>(N);
+        for (auto m = 0; m < M; m++) {
+            std::fill(begin(sums), end(sums), 0);
+            const auto a = &A[m * K4 * 4];
+            for (auto k = 0; k < K4; k++) {
+                const auto b = &B[k * N * 4];
+                for (auto n = 0; n < N; n++) {
+                    for (auto i = 0; i < 4; i++) {
+                        sums[n] += a[k * 4 + i] * b[n * 4 + i];
+                    }
+                }
+            }
+            for (auto n = 0; n < N; n++) {
+                C[m * N + n] = scales[m] * sums[n];
+            }
+        }
+    }
+
+    void puct_scores_scalar(size_t count, const float* prior,
+                            const float* visits, const float* virtual_loss,
+                            const float* white_wins, bool white,
+                            float fpu_eval, float puct_scale, float* scores) {
+        for (auto i = size_t{0}; i < count; i++) {
+            auto eval = fpu_eval;
+            if (visits[i] > 0.0f) {
+                auto wins = white ? white_wins[i] : visits[i] - white_wins[i];
+                eval = wins / (visits[i] + virtual_loss[i]);
+            }
+            scores[i] = eval + puct_scale * prior[i] / (1.0f + visits[i]);
+        }
+    }
+
+    // The four weights that multiply one 32 bit lane of B.
+    int32_t weight_quad(const int8_t* a) {
+        int32_t quad;
+        std::memcpy(&quad, a, sizeof(quad));
+        return quad;
+    }
+
+#ifdef CPUKERNELS_X86
+    // The transforms work on whole rows of tiles at a time. Every 128 bit
+    // lane of a vector holds the four tiles of one tile row, so the (also
+    // per lane) shuffles can split the even and odd columns of a row.
+    // Window w of a padded row starts at column WINDOW[w]: the even and
+    // odd columns of the first two windows are the first and second
+    // columns of the tiles, of the last two the third and fourth.
+    constexpr int WINDOW[4] = {0, 4, 2, 6};
+
+    TARGET_AVX2
+    void winograd_transform_in_avx2(const float* in, float* V, int C) {
+        const auto CP = C * P;
+        float pad[PADDED * PADDED] = {};
+
+        for (auto ch = 0; ch < C; ch++) {
+            for (auto y = 0; y < H; y++) {
+                _mm256_storeu_ps(&pad[(y + 1) * PADDED + 1],
+                                 _mm256_loadu_ps(&in[ch * W * H + y * W]));
+            }
+            // Tile rows 2 * pair and 2 * pair + 1, in the low and high lane.
+            for (auto pair = 0; pair < 2; pair++) {
+                __m256 T1[WINOGRAD_ALPHA][4];
+                for (auto w = 0; w < 4; w++) {
+                    __m256 x[WINOGRAD_ALPHA];
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        const auto lo = &pad[(4 * pair + i) * PADDED + WINDOW[w]];
+                        const auto hi = lo + 2 * PADDED;
+                        x[i] = _mm256_insertf128_ps(
+                            _mm256_castps128_ps256(_mm_loadu_ps(lo)),
+                            _mm_loadu_ps(hi), 1);
+                    }
+                    T1[0][w] = _mm256_sub_ps(x[0], x[2]);
+                    T1[1][w] = _mm256_add_ps(x[1], x[2]);
+                    T1[2][w] = _mm256_sub_ps(x[2], x[1]);
+                    T1[3][w] = _mm256_sub_ps(x[1], x[3]);
+                }
+                for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                    const auto x0 = _mm256_shuffle_ps(T1[i][0], T1[i][1],
+                                                      _MM_SHUFFLE(2, 0, 2, 0));
+                    const auto x1 = _mm256_shuffle_ps(T1[i][0], T1[i][1],
+                                                      _MM_SHUFFLE(3, 1, 3, 1));
+                    const auto x2 = _mm256_shuffle_ps(T1[i][2], T1[i][3],
+                                                      _MM_SHUFFLE(2, 0, 2, 0));
+                    const auto x3 = _mm256_shuffle_ps(T1[i][2], T1[i][3],
+                                                      _MM_SHUFFLE(3, 1, 3, 1));
+                    const auto out = &V[i * WINOGRAD_ALPHA * CP + ch * P + 8 * pair];
+                    _mm256_storeu_ps(out + 0 * CP, _mm256_sub_ps(x0, x2));
+                    _mm256_storeu_ps(out + 1 * CP, _mm256_add_ps(x1, x2));
+                    _mm256_storeu_ps(out + 2 * CP, _mm256_sub_ps(x2, x1));
+                    _mm256_storeu_ps(out + 3 * CP, _mm256_sub_ps(x1, x3));
+                }
+            }
+        }
+    }
+
+    TARGET_AVX2
+    void winograd_transform_out_avx2(const float* M, float* Y, int K) {
+        const auto KP = K * P;
+
+        for (auto k = 0; k < K; k++) {
+            // Tile rows 2 * pair and 2 * pair + 1, in the low and high lane.
+            for (auto pair = 0; pair < 2; pair++) {
+                __m256 m[WINOGRAD_TILE];
+                for (auto xn = 0; xn < WINOGRAD_TILE; xn++) {
+                    m[xn] = _mm256_loadu_ps(&M[xn * KP + k * P + 8 * pair]);
+                }
+                // Rows of transpose(A).m, then their columns.
+                __m256 t[2][WINOGRAD_ALPHA];
+                for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                    const auto m12 = _mm256_add_ps(m[1*4 + j], m[2*4 + j]);
+                    const auto m12d = _mm256_sub_ps(m[1*4 + j], m[2*4 + j]);
+                    t[0][j] = _mm256_add_ps(m[0*4 + j], m12);
+                    t[1][j] = _mm256_sub_ps(m12d, m[3*4 + j]);
+                }
+                __m256 o[2][2];
+                for (auto i = 0; i < 2; i++) {
+                    const auto t12 = _mm256_add_ps(t[i][1], t[i][2]);
+                    const auto t12d = _mm256_sub_ps(t[i][1], t[i][2]);
+                    o[i][0] = _mm256_add_ps(t[i][0], t12);
+                    o[i][1] = _mm256_sub_ps(t12d, t[i][3]);
+                }
+                // Interleave the two output columns of each tile into rows.
+                for (auto i = 0; i < 2; i++) {
+                    const auto lo = _mm256_unpacklo_ps(o[i][0], o[i][1]);
+                    const auto hi = _mm256_unpackhi_ps(o[i][0], o[i][1]);
+                    const auto out = &Y[k * W * H + (4 * pair + i) * W];
+                    _mm256_storeu_ps(out,
+                                     _mm256_permute2f128_ps(lo, hi, 0x20));
+                    _mm256_storeu_ps(out + 2 * W,
+                                     _mm256_permute2f128_ps(lo, hi, 0x31));
+                }
+            }
+        }
+    }
+
+    TARGET_AVX2
+    void bias_relu_avx2(size_t channels, size_t spatial_size, float* data,
+                        const float* biases, const float* eltwise) {
+        const auto zero = _mm256_setzero_ps();
+        for (auto c = size_t{0}; c < channels; ++c) {
+            const auto bias = _mm256_set1_ps(biases[c]);
+            auto arr = &data[c * spatial_size];
+            auto res = eltwise ? &eltwise[c * spatial_size] : nullptr;
+            auto b = size_t{0};
+            for (; b + 8 <= spatial_size; b += 8) {
+                auto val = _mm256_add_ps(_mm256_loadu_ps(&arr[b]), bias);
+                if (res) {
+                    val = _mm256_add_ps(_mm256_loadu_ps(&res[b]), val);
+                }
+                _mm256_storeu_ps(&arr[b], _mm256_max_ps(val, zero));
+            }
+            if (b < spatial_size) {
+                bias_relu_scalar(1, spatial_size - b, &arr[b], &biases[c],
+                                 res ? &res[b] : nullptr);
+            }
+        }
+    }
+
+    TARGET_AVX2
+    void add_bias_avx2(size_t outputs, float* data, const float* biases,
+                       bool relu) {
+        const auto zero = _mm256_setzero_ps();
+        auto o = size_t{0};
+        for (; o + 8 <= outputs; o += 8) {
+            auto val = _mm256_add_ps(_mm256_loadu_ps(&biases[o]),
+                                     _mm256_loadu_ps(&data[o]));
+            if (relu) {
+                val = _mm256_max_ps(val, zero);
+            }
+            _mm256_storeu_ps(&data[o], val);
+        }
+        add_bias_scalar(outputs - o, &data[o], &biases[o], relu);
+    }
+
+    TARGET_AVX2
+    void puct_scores_avx2(size_t count, const float* prior,
+                          const float* visits, const float* virtual_loss,
+                          const float* white_wins, bool white,
+                          float fpu_eval, float puct_scale, float* scores) {
+        const auto zero = _mm256_setzero_ps();
+        const auto one = _mm256_set1_ps(1.0f);
+        const auto fpu = _mm256_set1_ps(fpu_eval);
+        const auto scale = _mm256_set1_ps(puct_scale);
+        auto i = size_t{0};
+        for (; i + 8 <= count; i += 8) {
+            const auto n = _mm256_loadu_ps(&visits[i]);
+            auto wins = _mm256_loadu_ps(&white_wins[i]);
+            if (!white) {
+                wins = _mm256_sub_ps(n, wins);
+            }
+            // Unvisited children divide by their virtual loss or zero,
+            // the blend replaces whatever that gives with the FPU.
+            const auto eval = _mm256_blendv_ps(
+                fpu,
+                _mm256_div_ps(wins,
+                              _mm256_add_ps(n, _mm256_loadu_ps(&virtual_loss[i]))),
+                _mm256_cmp_ps(n, zero, _CMP_GT_OQ));
+            const auto puct = _mm256_div_ps(
+                _mm256_mul_ps(scale, _mm256_loadu_ps(&prior[i])),
+                _mm256_add_ps(one, n));
+            _mm256_storeu_ps(&scores[i], _mm256_add_ps(eval, puct));
+        }
+        puct_scores_scalar(count - i, &prior[i], &visits[i], &virtual_loss[i],
+                           &white_wins[i], white, fpu_eval, puct_scale,
+                           &scores[i]);
+    }
+
+    // GCC 12 warns about _mm512_undefined_ps inside its own intrinsics.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+    TARGET_AVX512
+    void winograd_transform_out_avx512(const float* M, float* Y, int K) {
+        const auto KP = K * P;
+        // Rows 4 * half and 4 * half + 2 of the output, from the low and
+        // high parts of the interleaved columns of tile rows 2 * half and
+        // 2 * half + 1.
+        const __m512i rows[2] = {
+            _mm512_setr_epi32(0, 1, 2, 3, 16, 17, 18, 19,
+                              4, 5, 6, 7, 20, 21, 22, 23),
+            _mm512_setr_epi32(8, 9, 10, 11, 24, 25, 26, 27,
+                              12, 13, 14, 15, 28, 29, 30, 31)
+        };
+
+        for (auto k = 0; k < K; k++) {
+            __m512 m[WINOGRAD_TILE];
+            for (auto xn = 0; xn < WINOGRAD_TILE; xn++) {
+                m[xn] = _mm512_loadu_ps(&M[xn * KP + k * P]);
+            }
+            // Rows of transpose(A).m, then their columns.
+            __m512 t[2][WINOGRAD_ALPHA];
+            for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                const auto m12 = _mm512_add_ps(m[1*4 + j], m[2*4 + j]);
+                const auto m12d = _mm512_sub_ps(m[1*4 + j], m[2*4 + j]);
+                t[0][j] = _mm512_add_ps(m[0*4 + j], m12);
+                t[1][j] = _mm512_sub_ps(m12d, m[3*4 + j]);
+            }
+            for (auto i = 0; i < 2; i++) {
+                const auto t12 = _mm512_add_ps(t[i][1], t[i][2]);
+                const auto t12d = _mm512_sub_ps(t[i][1], t[i][2]);
+                const auto o1 = _mm512_add_ps(t[i][0], t12);
+                const auto o2 = _mm512_sub_ps(t12d, t[i][3]);
+                // Interleave the two output columns of each tile into rows.
+                const auto lo = _mm512_unpacklo_ps(o1, o2);
+                const auto hi = _mm512_unpackhi_ps(o1, o2);
+                for (auto half = 0; half < 2; half++) {
+                    const auto r = _mm512_castps_pd(
+                        _mm512_permutex2var_ps(lo, rows[half], hi));
+                    const auto out = &Y[k * W * H + (4 * half + i) * W];
+                    _mm256_storeu_ps(out, _mm256_castpd_ps(
+                        _mm512_castpd512_pd256(r)));
+                    _mm256_storeu_ps(out + 2 * W, _mm256_castpd_ps(
+                        _mm512_extractf64x4_pd(r, 1)));
+                }
+            }
+        }
+    }
+
+    TARGET_AVX512
+    void bias_relu_avx512(size_t channels, size_t spatial_size, float* data,
+                          const float* biases, const float* eltwise) {
+        const auto zero = _mm512_setzero_ps();
+        for (auto c = size_t{0}; c < channels; ++c) {
+            const auto bias = _mm512_set1_ps(biases[c]);
+            auto arr = &data[c * spatial_size];
+            auto res = eltwise ? &eltwise[c * spatial_size] : nullptr;
+            auto b = size_t{0};
+            for (; b + 16 <= spatial_size; b += 16) {
+                auto val = _mm512_add_ps(_mm512_loadu_ps(&arr[b]), bias);
+                if (res) {
+                    val = _mm512_add_ps(_mm512_loadu_ps(&res[b]), val);
+                }
+                _mm512_storeu_ps(&arr[b], _mm512_max_ps(val, zero));
+            }
+            if (b < spatial_size) {
+                bias_relu_scalar(1, spatial_size - b, &arr[b], &biases[c],
+                                 res ? &res[b] : nullptr);
+            }
+        }
+    }
+
+    TARGET_AVX512
+    void add_bias_avx512(size_t outputs, float* data, const float* biases,
+                         bool relu) {
+        const auto zero = _mm512_setzero_ps();
+        auto o = size_t{0};
+        for (; o + 16 <= outputs; o += 16) {
+            auto val = _mm512_add_ps(_mm512_loadu_ps(&biases[o]),
+                                     _mm512_loadu_ps(&data[o]));
+            if (relu) {
+                val = _mm512_max_ps(val, zero);
+            }
+            _mm512_storeu_ps(&data[o], val);
+        }
+        add_bias_scalar(outputs - o, &data[o], &biases[o], relu);
+    }
+
+    // Rows of C are done MB at a time, 32 columns at a time, so every
+    // load of B feeds 2 * MB multiply-adds of four.
+    template <int MB>
+    TARGET_AVX512VNNI
+    void int8_gemm_rows_vnni(int N, int K4, const int8_t* A,
+                             const uint8_t* B, const float* scales,
+                             float* C) {
+        for (auto n = 0; n < N; n += 32) {
+            __m512i acc[MB][2];
+            for (auto j = 0; j < MB; j++) {
+                acc[j][0] = _mm512_setzero_si512();
+                acc[j][1] = _mm512_setzero_si512();
+            }
+            for (auto k = 0; k < K4; k++) {
+                const auto b = &B[(k * N + n) * 4];
+                const auto b0 = _mm512_loadu_si512(b);
+                const auto b1 = _mm512_loadu_si512(b + 64);
+                for (auto j = 0; j < MB; j++) {
+                    const auto a = _mm512_set1_epi32(
+                        weight_quad(&A[(j * K4 + k) * 4]));
+                    acc[j][0] = _mm512_dpbusd_epi32(acc[j][0], b0, a);
+                    acc[j][1] = _mm512_dpbusd_epi32(acc[j][1], b1, a);
+                }
+            }
+            for (auto j = 0; j < MB; j++) {
+                const auto scale = _mm512_set1_ps(scales[j]);
+                _mm512_storeu_ps(&C[j * N + n], _mm512_mul_ps(scale,
+                                 _mm512_cvtepi32_ps(acc[j][0])));
+                _mm512_storeu_ps(&C[j * N + n + 16], _mm512_mul_ps(scale,
+                                 _mm512_cvtepi32_ps(acc[j][1])));
+            }
+        }
+    }
+
+    void int8_gemm_vnni(int M, int N, int K4, const int8_t* A,
+                        const uint8_t* B, const float* scales, float* C) {
+        assert(N % 32 == 0);
+        auto m = 0;
+        for (; m + 8 <= M; m += 8) {
+            int8_gemm_rows_vnni<8>(N, K4, &A[m * K4 * 4], B, &scales[m],
+                                   &C[m * N]);
+        }
+        for (; m < M; m++) {
+            int8_gemm_rows_vnni<1>(N, K4, &A[m * K4 * 4], B, &scales[m],
+                                   &C[m * N]);
+        }
+    }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+    CPUKernels::Isa detect_isa() {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            if (__builtin_cpu_supports("avx512vnni")) {
+                return CPUKernels::Isa::AVX512VNNI;
+            }
+            return CPUKernels::Isa::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return CPUKernels::Isa::AVX2;
+        }
+#elif defined(_MSC_VER)
+        int regs[4];
+        __cpuid(regs, 0);
+        const auto max_leaf = regs[0];
+        __cpuid(regs, 1);
+        const auto fma = (regs[2] & (1 << 12)) != 0;
+        const auto osxsave = (regs[2] & (1 << 27)) != 0;
+        if (max_leaf >= 7 && osxsave) {
+            // The OS has to save the vector registers on context switches.
+            const auto xcr0 = _xgetbv(0);
+            const auto ymm = (xcr0 & 0x6) == 0x6;
+            const auto zmm = (xcr0 & 0xe6) == 0xe6;
+            __cpuidex(regs, 7, 0);
+            const auto avx2 = (regs[1] & (1 << 5)) != 0;
+            const auto avx512f = (regs[1] & (1 << 16)) != 0;
+            const auto avx512vnni = (regs[2] & (1 << 11)) != 0;
+            if (avx512f && zmm) {
+                if (avx512vnni) {
+                    return CPUKernels::Isa::AVX512VNNI;
+                }
+                return CPUKernels::Isa::AVX512;
+            }
+            if (avx2 && fma && ymm) {
+                return CPUKernels::Isa::AVX2;
+            }
+        }
+#endif
+        return CPUKernels::Isa::Scalar;
+    }
+#else
+    CPUKernels::Isa detect_isa() {
+        return CPUKernels::Isa::Scalar;
+    }
+#endif
+
+    struct Kernels {
+        CPUKernels::Isa isa;
+        void (*transform_in)(const float*, float*, int);
+        void (*transform_out)(const float*, float*, int);
+        void (*bias_relu)(size_t, size_t, float*, const float*,
+                          const float*);
+        void (*add_bias)(size_t, float*, const float*, bool);
+        void (*int8_gemm)(int, int, int, const int8_t*, const uint8_t*,
+                          const float*, float*);
+        void (*puct_scores)(size_t, const float*, const float*, const float*,
+                            const float*, bool, float, float, float*);
+    };
+
+    const Kernels* kernels_for(CPUKernels::Isa isa) {
+        static const Kernels scalar = {
+            CPUKernels::Isa::Scalar,
+            winograd_transform_in_scalar, winograd_transform_out_scalar,
+            bias_relu_scalar, add_bias_scalar, int8_gemm_scalar,
+            puct_scores_scalar
+        };
+#ifdef CPUKERNELS_X86
+        static const Kernels avx2 = {
+            CPUKernels::Isa::AVX2,
+            winograd_transform_in_avx2, winograd_transform_out_avx2,
+            bias_relu_avx2, add_bias_avx2, int8_gemm_scalar, puct_scores_avx2
+        };
+        // Gathering four tile rows into one 512 bit vector takes more
+        // shuffling than it saves, so the input transform stays at AVX2.
+        // Without VNNI an int8 convolution is no faster than the fp32
+        // winograd one, so only the reference int8 GEMM is there. A node
+        // has a few dozen children, too few for 512 bit PUCT scoring.
+        static const Kernels avx512 = {
+            CPUKernels::Isa::AVX512,
+            winograd_transform_in_avx2, winograd_transform_out_avx512,
+            bias_relu_avx512, add_bias_avx512, int8_gemm_scalar,
+            puct_scores_avx2
+        };
+        static const Kernels avx512vnni = {
+            CPUKernels::Isa::AVX512VNNI,
+            winograd_transform_in_avx2, winograd_transform_out_avx512,
+            bias_relu_avx512, add_bias_avx512, int8_gemm_vnni,
+            puct_scores_avx2
+        };
+        switch (isa) {
+        case CPUKernels::Isa::AVX512VNNI:
+            return &avx512vnni;
+        case CPUKernels::Isa::AVX512:
+            return &avx512;
+        case CPUKernels::Isa::AVX2:
+            return &avx2;
+        default:
+            break;
+        }
+#endif
+        (void)isa;
+        return &scalar;
+    }
+
+    const Kernels*& active_kernels() {
+        static const Kernels* kernels = kernels_for(CPUKernels::get_best_isa());
+        return kernels;
+    }
+}
+
+CPUKernels::Isa CPUKernels::get_best_isa() {
+    static const auto best = detect_isa();
+    return best;
+}
+
+CPUKernels::Isa CPUKernels::get_isa() {
+    return active_kernels()->isa;
+}
+
+void CPUKernels::set_isa(Isa isa) {
+    assert(isa <= get_best_isa());
+    active_kernels() = kernels_for(isa);
+}
+
+const char* CPUKernels::get_isa_name(Isa isa) {
+    switch (isa) {
+    case Isa::AVX512VNNI:
+        return "AVX-512 VNNI";
+    case Isa::AVX512:
+        return "AVX-512";
+    case Isa::AVX2:
+        return "AVX2";
+    default:
+        return "scalar";
+    }
+}
+
+void CPUKernels::winograd_transform_in(const float* in, float* V, int C) {
+    active_kernels()->transform_in(in, V, C);
+}
+
+void CPUKernels::winograd_transform_out(const float* M, float* Y, int K) {
+    active_kernels()->transform_out(M, Y, K);
+}
+
+void CPUKernels::winograd4_transform_in(const float* in, float* V, int C) {
+    winograd4_transform_in_scalar(in, V, C);
+}
+
+void CPUKernels::winograd4_transform_out(const float* M, float* Y, int K) {
+    winograd4_transform_out_scalar(M, Y, K);
+}
+
+void CPUKernels::bias_relu(size_t channels, size_t spatial_size, float* data,
+                           const float* biases, const float* eltwise) {
+    active_kernels()->bias_relu(channels, spatial_size, data, biases, eltwise);
+}
+
+void CPUKernels::add_bias(size_t outputs, float* data, const float* biases,
+                          bool relu) {
+    active_kernels()->add_bias(outputs, data, biases, relu);
+}
+
+void CPUKernels::int8_gemm(int M, int N, int K4, const int8_t* A,
+                           const uint8_t* B, const float* scales, float* C) {
+    assert(N % 64 == 0);
+    active_kernels()->int8_gemm(M, N, K4, A, B, scales, C);
+}
+
+void CPUKernels::puct_scores(size_t count, const float* prior,
+                             const float* visits, const float* virtual_loss,
+                             const float* white_wins, bool white,
+                             float fpu_eval, float puct_scale, float* scores) {
+    active_kernels()->puct_scores(count, prior, visits, virtual_loss,
+                                  white_wins, white, fpu_eval, puct_scale,
+                                  scores);
+}
@@ -0,0 +1,83 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CPUKERNELS_H_INCLUDED
+#define CPUKERNELS_H_INCLUDED
+
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// The element wise parts of the CPU forward pass: the winograd input and
+// output transforms of the 8x8 board and bias with ReLU. All
+// the heavy lifting in between is done by BLAS, so these are written with
+// intrinsics for the vector extensions of the CPU we run on, which is
+// detected at runtime so one binary serves every machine. BLAS has no
+// integer GEMM, so the one of the int8 convolutions lives here too, as does
+// the PUCT scoring of the children of a node during selection.
+namespace CPUKernels {
+    enum class Isa {
+        Scalar,
+        AVX2,
+        AVX512,
+        AVX512VNNI
+    };
+
+    // The best instruction set this CPU and build support.
+    Isa get_best_isa();
+    // The kernels in use, get_best_isa() unless overridden.
+    Isa get_isa();
+    // Select the kernels, isa must not be better than get_best_isa().
+    void set_isa(Isa isa);
+    const char* get_isa_name(Isa isa);
+
+    // V = transpose(B).in.B for every 4x4 tile of the C input planes.
+    void winograd_transform_in(const float* in, float* V, int C);
+    // Y = transpose(A).M.A for every tile of the K output planes.
+    void winograd_transform_out(const float* M, float* Y, int K);
+    // The same for F(4x4, 3x3), with 6x6 tiles, 2x2 of them per plane.
+    // There are a quarter as many tiles, so only a scalar version.
+    void winograd4_transform_in(const float* in, float* V, int C);
+    void winograd4_transform_out(const float* M, float* Y, int K);
+    // data = ReLU(data + biases [+ eltwise]) with a bias per channel.
+    void bias_relu(size_t channels, size_t spatial_size, float* data,
+                   const float* biases, const float* eltwise = nullptr);
+    // data = data + biases, optionally followed by a ReLU.
+    void add_bias(size_t outputs, float* data, const float* biases,
+                  bool relu);
+    // C = scales * A.B with signed int8 weights A, M rows of K4 * 4, and
+    // unsigned int8 activations B, K4 * 4 rows of N columns. B is stored in
+    // groups of four rows, B[(k / 4 * N + n) * 4 + k % 4], so one 32 bit
+    // lane holds the four values a lane of weights multiplies. N has to be
+    // a multiple of 64, a column per square of every board. Only VNNI
+    // makes this worth using, other CPUs get the scalar version.
+    void int8_gemm(int M, int N, int K4, const int8_t* A, const uint8_t* B,
+                   const float* scales, float* C);
+    // scores = Q + puct_scale * prior / (1 + visits) for count children,
+    // where Q is the winrate of the side to move counting virtual losses,
+    // wins / (visits + virtual_loss), or fpu_eval for unvisited children.
+    // prior, visits, virtual_loss and white_wins are one array per
+    // statistic, white_wins from white's point of view.
+    void puct_scores(size_t count, const float* prior, const float* visits,
+                     const float* virtual_loss, const float* white_wins,
+                     bool white, float fpu_eval, float puct_scale,
+                     float* scores);
+}
+
+#endif
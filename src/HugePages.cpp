@@ -0,0 +1,149 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "HugePages.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#endif
+
+static std::atomic<size_t> s_total_bytes{0};
+static std::atomic<size_t> s_huge_bytes{0};
+
+#ifdef __linux__
+// Whether madvise() can get us transparent huge pages.
+static bool transparent_huge_pages() {
+    static const bool enabled = [] {
+        std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+        auto modes = std::string{};
+        std::getline(file, modes);
+        return modes.find("[always]") != std::string::npos
+            || modes.find("[madvise]") != std::string::npos;
+    }();
+    return enabled;
+}
+
+static char* map_anonymous(size_t size, int flags) {
+    auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return data == MAP_FAILED ? nullptr : static_cast<char*>(data);
+}
+#endif
+
+HugePages::HugePages(size_t size) : m_size(size) {
+    if (size == 0) {
+        return;
+    }
+#ifdef __linux__
+    if (size >= HUGE_PAGE_SIZE) {
+        m_mapped = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+        m_data = map_anonymous(m_mapped, MAP_HUGETLB);
+        if (m_data) {
+            m_kind = Kind::RESERVED;
+        }
+#endif
+        if (!m_data && transparent_huge_pages()) {
+            // Only aligned ranges can be backed by huge pages, so map one
+            // more and unmap what is outside of the aligned part.
+            auto raw = map_anonymous(m_mapped + HUGE_PAGE_SIZE, 0);
+            if (raw) {
+                auto address = reinterpret_cast<std::uintptr_t>(raw);
+                auto aligned = raw + (HUGE_PAGE_SIZE - address % HUGE_PAGE_SIZE)
+                                     % HUGE_PAGE_SIZE;
+                if (aligned != raw) {
+                    munmap(raw, aligned - raw);
+                }
+                munmap(aligned + m_mapped, raw + HUGE_PAGE_SIZE - aligned);
+                m_data = aligned;
+                if (madvise(m_data, m_mapped, MADV_HUGEPAGE) == 0) {
+                    m_kind = Kind::TRANSPARENT;
+                }
+            }
+        }
+    } else {
+        m_mapped = size;
+    }
+    if (!m_data) {
+        m_data = map_anonymous(m_mapped, 0);
+    }
+#else
+    m_data = static_cast<char*>(std::calloc(size, 1));
+#endif
+    if (!m_data) {
+        throw std::bad_alloc();
+    }
+    s_total_bytes += m_size;
+    if (m_kind != Kind::NORMAL) {
+        s_huge_bytes += m_size;
+    }
+}
+
+HugePages::~HugePages() {
+    release();
+}
+
+HugePages::HugePages(HugePages&& other) {
+    *this = std::move(other);
+}
+
+HugePages& HugePages::operator=(HugePages&& other) {
+    if (this != &other) {
+        release();
+        m_data = other.m_data;
+        m_size = other.m_size;
+        m_mapped = other.m_mapped;
+        m_kind = other.m_kind;
+        other.m_data = nullptr;
+        other.m_size = 0;
+        other.m_mapped = 0;
+        other.m_kind = Kind::NORMAL;
+    }
+    return *this;
+}
+
+void HugePages::release() {
+    if (!m_data) {
+        return;
+    }
+    s_total_bytes -= m_size;
+    if (m_kind != Kind::NORMAL) {
+        s_huge_bytes -= m_size;
+    }
+#ifdef __linux__
+    munmap(m_data, m_mapped);
+#else
+    std::free(m_data);
+#endif
+    m_data = nullptr;
+}
+
+size_t HugePages::get_total_bytes() {
+    return s_total_bytes;
+}
+
+size_t HugePages::get_huge_bytes() {
+    return s_huge_bytes;
+}
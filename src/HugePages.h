@@ -0,0 +1,68 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HUGEPAGES_H_INCLUDED
+#define HUGEPAGES_H_INCLUDED
+
+#include "config.h"
+
+#include <cstddef>
+
+// Zeroed memory for the big arrays the search reads at random, the node
+// slabs and the NN cache. Where the system has them it comes from 2 MB
+// pages, so that one TLB entry covers 512 times as much of it: reserved
+// ones (MAP_HUGETLB) if there are enough, else transparent ones
+// (MADV_HUGEPAGE). Smaller allocations, and all of them outside of Linux,
+// get normal pages.
+class HugePages {
+public:
+    static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    enum class Kind {
+        NORMAL,
+        TRANSPARENT,
+        RESERVED
+    };
+
+    HugePages() = default;
+    // Throws std::bad_alloc if there isn't even normal memory.
+    explicit HugePages(size_t size);
+    ~HugePages();
+
+    HugePages(HugePages&& other);
+    HugePages& operator=(HugePages&& other);
+
+    char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    Kind kind() const { return m_kind; }
+
+    // Bytes of all allocations alive, and the part of them on huge pages.
+    static size_t get_total_bytes();
+    static size_t get_huge_bytes();
+
+private:
+    void release();
+
+    char* m_data{nullptr};
+    size_t m_size{0};
+    // m_size rounded up to whole pages.
+    size_t m_mapped{0};
+    Kind m_kind{Kind::NORMAL};
+};
+
+#endif
@@ -20,6 +20,7 @@
 #define IM2COL_H_INCLUDED
 
 #include <cassert>
+#include <cstdint>
 #include <vector>
 #include <algorithm>
 
@@ -74,4 +75,46 @@ void im2col<1>(const int channels,
     std::copy(begin(input), begin(input) + outSize, begin(output));
 }
 
+// im2col of quantized planes for the int8 convolutions. The input is
+// stored in groups of four channels, every board of the batch in a group
+// with a border of zeros, input[((c / 4 * batch_size + n) * padded_size
+// + (y + pad) * padded_width + x + pad) * 4 + c % 4]. The rows go filter
+// tap by filter tap with all channels of a tap together, so every group
+// of four rows is one group of channels and a board row is a plain copy
+// of 8 * 4 values. The columns of all boards are laid out side by side,
+// as CPUKernels::int8_gemm wants them.
+template <unsigned long filter_size>
+void im2col_int8(const int channel_groups, const int batch_size,
+                 const std::vector<uint8_t>& input,
+                 std::vector<uint8_t>& output) {
+    constexpr int height = 8;
+    constexpr int width = 8;
+    constexpr int pad = (filter_size / 2);
+    constexpr int padded_width = width + 2 * pad;
+    constexpr int padded_size = padded_width * (height + 2 * pad);
+    constexpr int row_size = width * 4;
+
+    assert(input.size() == size_t(channel_groups * batch_size * padded_size * 4));
+    assert(output.size() == size_t(filter_size * filter_size * channel_groups
+                                   * batch_size * height * row_size));
+    auto data_col = output.data();
+    for (auto kernel_row = 0; kernel_row < int(filter_size); kernel_row++) {
+        for (auto kernel_col = 0; kernel_col < int(filter_size); kernel_col++) {
+            for (auto group = 0; group < channel_groups; group++) {
+                for (auto board = 0; board < batch_size; board++) {
+                    const auto data_im = input.data()
+                        + ((group * batch_size + board) * padded_size
+                           + kernel_row * padded_width + kernel_col) * 4;
+                    for (auto output_row = 0; output_row < height; output_row++) {
+                        std::copy(data_im + output_row * padded_width * 4,
+                                  data_im + output_row * padded_width * 4 + row_size,
+                                  data_col);
+                        data_col += row_size;
+                    }
+                }
+            }
+        }
+    }
+}
+
 #endif
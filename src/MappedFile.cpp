@@ -0,0 +1,142 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& filename) {
+#ifdef _WIN32
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ,
+                         FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        return;
+    }
+    auto size = LARGE_INTEGER{};
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+        return;
+    }
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY,
+                                   0, 0, nullptr);
+    if (!m_mapping) {
+        return;
+    }
+    auto data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data) {
+        m_data = static_cast<char*>(data);
+        m_size = static_cast<size_t>(size.QuadPart);
+    }
+#else
+    auto fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE,
+                         fd, 0);
+        if (data != MAP_FAILED) {
+            m_data = static_cast<char*>(data);
+            m_size = static_cast<size_t>(st.st_size);
+            // Readers go through the file front to back.
+            madvise(data, m_size, MADV_SEQUENTIAL);
+        }
+    }
+    // The mapping stays valid without the descriptor.
+    close(fd);
+#endif
+}
+
+MappedFile::MappedFile(const std::string& filename, size_t size) {
+    if (size == 0) {
+        return;
+    }
+#ifdef _WIN32
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        return;
+    }
+    auto end = LARGE_INTEGER{};
+    end.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFilePointerEx(m_file, end, nullptr, FILE_BEGIN)
+        || !SetEndOfFile(m_file)) {
+        return;
+    }
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE,
+                                   0, 0, nullptr);
+    if (!m_mapping) {
+        return;
+    }
+    auto data = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (data) {
+        m_data = static_cast<char*>(data);
+        m_size = size;
+        m_writable = true;
+    }
+#else
+    auto fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0
+        && (static_cast<size_t>(st.st_size) == size
+            || ftruncate(fd, static_cast<off_t>(size)) == 0)) {
+        auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+        if (data != MAP_FAILED) {
+            m_data = static_cast<char*>(data);
+            m_size = size;
+            m_writable = true;
+            // Writers are expected to hop around, like in a hash table.
+            madvise(data, m_size, MADV_RANDOM);
+        }
+    }
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+    }
+    if (m_file) {
+        CloseHandle(m_file);
+    }
+#else
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+#endif
+}
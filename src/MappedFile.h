@@ -0,0 +1,57 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPEDFILE_H_INCLUDED
+#define MAPPEDFILE_H_INCLUDED
+
+#include "config.h"
+
+#include <cstddef>
+#include <string>
+
+// A view of a whole file. data() is null if the file could not be opened
+// or is empty.
+class MappedFile {
+public:
+    // Maps @filename read only.
+    explicit MappedFile(const std::string& filename);
+    // Maps @filename for reading and writing, shared with other processes.
+    // The file is created, or resized to @size bytes, first.
+    MappedFile(const std::string& filename, size_t size);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return m_data; }
+    // Null unless the file is mapped for writing.
+    char* writable_data() const { return m_writable ? m_data : nullptr; }
+    size_t size() const { return m_size; }
+
+private:
+    char* m_data{nullptr};
+    size_t m_size{0};
+    bool m_writable{false};
+#ifdef _WIN32
+    // HANDLEs, kept as void* so that users need not include windows.h.
+    void* m_file{nullptr};
+    void* m_mapping{nullptr};
+#endif
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "NNBatchQueue.h"
+#include "Network.h"
+#include "Parameters.h"
+#include "SMP.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+NNBatchQueue& NNBatchQueue::get_NNBatchQueue(void) {
+    static NNBatchQueue queue{Network::forward};
+    return queue;
+}
+
+NNBatchQueue::NNBatchQueue(Evaluator evaluator)
+    : m_evaluator(std::move(evaluator)) {
+}
+
+NNBatchQueue::~NNBatchQueue() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_worker_cv.notify_all();
+    if (m_worker.joinable()) {
+        m_worker.join();
+    }
+}
+
+void NNBatchQueue::forward(Key key, const Network::NNPlanes& input,
+                           std::vector<float>& output_pol,
+                           std::vector<float>& output_val) {
+    Request request;
+    request.key = key;
+    request.input = &input;
+    request.output_pol = &output_pol;
+    request.output_val = &output_val;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_worker.joinable()) {
+        m_worker = std::thread([this] {
+            SMP::pin_thread();
+            worker();
+        });
+    }
+    m_queue.push_back(&request);
+    m_worker_cv.notify_one();
+
+    m_done_cv.wait(lock, [&request] { return request.done; });
+    if (request.error) {
+        std::rethrow_exception(request.error);
+    }
+}
+
+void NNBatchQueue::worker() {
+    auto batch = std::vector<Request*>{};
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_worker_cv.wait(lock, [this] { return m_exit || !m_queue.empty(); });
+            if (m_exit) {
+                return;
+            }
+
+            // There can never be more positions queued than there are
+            // search threads of all self-play games, so don't wait for a
+            // batch that can't fill up.
+            const auto max_batch = static_cast<size_t>(std::max(1, cfg_batch_size));
+            const auto search_threads = std::max(1, cfg_num_threads)
+                                        * std::max(1, cfg_selfplay_games);
+            const auto wanted = std::min(max_batch,
+                static_cast<size_t>(search_threads));
+            m_worker_cv.wait_for(lock, std::chrono::microseconds(MAX_WAIT_US),
+                [this, wanted] { return m_exit || m_queue.size() >= wanted; });
+
+            const auto count = std::min(m_queue.size(), max_batch);
+            batch.assign(begin(m_queue), begin(m_queue) + count);
+            m_queue.erase(begin(m_queue), begin(m_queue) + count);
+        }
+
+        const auto evaluated = run_batch(batch);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto request : batch) {
+                request->done = true;
+            }
+            m_batches++;
+            m_positions += batch.size();
+            m_duplicates += batch.size() - evaluated;
+        }
+        m_done_cv.notify_all();
+    }
+}
+
+int NNBatchQueue::run_batch(std::vector<Request*>& batch) {
+    // Every request is sized for the network.
+    const auto pol_size = batch.front()->output_pol->size();
+    const auto val_size = batch.front()->output_val->size();
+
+    // Each position once, in the order of the first request for it.
+    m_batch_index.clear();
+    m_request_index.clear();
+    for (auto request : batch) {
+        const auto index = static_cast<int>(m_batch_index.size());
+        m_request_index.push_back(
+            m_batch_index.emplace(request->key, index).first->second);
+    }
+    const auto batch_size = static_cast<int>(m_batch_index.size());
+
+    m_batch_input.resize(batch_size);
+    m_batch_pol.resize(batch_size * pol_size);
+    m_batch_val.resize(batch_size * val_size);
+
+    auto copied = 0;
+    for (auto i = size_t{0}; i < batch.size(); i++) {
+        // Indices are handed out in order, so the first request of a
+        // position has the next one.
+        if (m_request_index[i] != copied) {
+            continue;
+        }
+        m_batch_input[copied++] = *batch[i]->input;
+    }
+
+    try {
+        m_evaluator(m_batch_input, m_batch_pol, m_batch_val, batch_size);
+    } catch (...) {
+        auto error = std::current_exception();
+        for (auto request : batch) {
+            request->error = error;
+        }
+        return batch_size;
+    }
+
+    for (auto i = size_t{0}; i < batch.size(); i++) {
+        const auto index = m_request_index[i];
+        auto pol_begin = begin(m_batch_pol) + index * pol_size;
+        auto val_begin = begin(m_batch_val) + index * val_size;
+        std::copy(pol_begin, pol_begin + pol_size, begin(*batch[i]->output_pol));
+        std::copy(val_begin, val_begin + val_size, begin(*batch[i]->output_val));
+    }
+    return batch_size;
+}
+
+void NNBatchQueue::dump_stats() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_batches) {
+        return;
+    }
+    myprintf("NNBatchQueue: %lld positions in %lld batches, %.1f positions/batch, %lld duplicates\n",
+             m_positions, m_batches, double(m_positions) / m_batches, m_duplicates);
+}
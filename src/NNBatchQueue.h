@@ -0,0 +1,111 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NNBATCHQUEUE_H_INCLUDED
+#define NNBATCHQUEUE_H_INCLUDED
+
+#include "config.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Network.h"
+#include "Types.h"
+
+// Sits between the search threads and the Network. Every search thread
+// that needs an evaluation queues its input planes here and blocks, while
+// a single worker thread drains the queue and runs the collected positions
+// through the backend as one batch.
+class NNBatchQueue {
+public:
+    // How long the worker waits for a batch to fill up before it runs
+    // whatever has been queued so far.
+    static constexpr auto MAX_WAIT_US = 1000;
+
+    // Evaluates a batch of positions like Network::forward.
+    using Evaluator = std::function<void(
+        const std::vector<Network::NNPlanes>& input,
+        std::vector<float>& output_pol,
+        std::vector<float>& output_val,
+        int batch_size)>;
+
+    // return the global NNBatchQueue
+    static NNBatchQueue& get_NNBatchQueue(void);
+
+    // A queue of its own in front of evaluator instead of the Network.
+    explicit NNBatchQueue(Evaluator evaluator);
+
+    ~NNBatchQueue();
+
+    // Queue one position and block until the batch it ended up in has been
+    // evaluated. Output vectors must be sized like for Network::forward.
+    // Positions of a batch with the same key, transpositions searched by
+    // two threads at once, are evaluated once.
+    void forward(Key key, const Network::NNPlanes& input,
+                 std::vector<float>& output_pol,
+                 std::vector<float>& output_val);
+
+    void dump_stats();
+
+private:
+
+    struct Request {
+        Key key;
+        const Network::NNPlanes* input;
+        std::vector<float>* output_pol;
+        std::vector<float>* output_val;
+        std::exception_ptr error;
+        bool done{false};
+    };
+
+    Evaluator m_evaluator;
+
+    void worker();
+    // Returns how many positions were evaluated.
+    int run_batch(std::vector<Request*>& batch);
+
+    std::mutex m_mutex;
+    // Signals the worker that requests were queued.
+    std::condition_variable m_worker_cv;
+    // Signals the search threads that a batch has been evaluated.
+    std::condition_variable m_done_cv;
+    std::deque<Request*> m_queue;
+    std::thread m_worker;
+    bool m_exit{false};
+
+    // Batch buffers, only touched by the worker thread.
+    std::vector<Network::NNPlanes> m_batch_input;
+    std::vector<float> m_batch_pol;
+    std::vector<float> m_batch_val;
+    // Index in the batch buffers of each key, and of each request.
+    std::unordered_map<Key, int> m_batch_index;
+    std::vector<int> m_request_index;
+
+    // Statistics
+    int64 m_batches{0};
+    int64 m_positions{0};
+    int64 m_duplicates{0};
+};
+
+#endif
@@ -17,77 +17,167 @@
 */
 
 #include "config.h"
+#include <algorithm>
+#include <cmath>
 #include <functional>
+#include <limits>
+#include <new>
 
 #include "NNCache.h"
+#include "Parameters.h"
 #include "Utils.h"
 
-NNCache::NNCache(int size) : m_size(size) {}
+// Priors are in [0, 1], so this conversion only deals with positive
+// values. NaN and negative inputs are stored as zero and large values are
+// clamped to the largest half float.
+static std::uint16_t prior_to_half(float f) {
+    if (!(f > 0.0f)) {
+        return 0;
+    }
+    return Utils::float_to_half(std::min(f, 65504.0f));
+}
+
+NNCache::NNCache(int size) {
+    resize(size);
+}
 
 NNCache& NNCache::get_NNCache(void) {
     static NNCache cache;
     return cache;
 }
 
-bool NNCache::lookup(Key hash, Network::Netresult & result) {
-    std::lock_guard<std::mutex> lock(m_mutex);
+bool NNCache::lookup(std::uint64_t hash, Network::Netresult & result) {
+    const auto bucket = bucket_index(hash);
+    auto& s = stripe(bucket);
+    LOCK(s.mutex, lock);
 #ifndef NDEBUG
-    if (m_lookups % 10000 == 0) {
+    if (s.lookups % 10000 == 0 && &s == &m_stripes[0]) {
+        lock.unlock();
         dump_stats();
+        lock.lock();
     }
 #endif
-    ++m_lookups;
-
-    auto iter = m_cache.find(hash);
-    if (iter == m_cache.end()) {
-        return false;  // Not found.
+    ++s.lookups;
+
+    const auto first = m_entries + bucket * BUCKET_SIZE;
+    for (auto entry = first; entry != first + BUCKET_SIZE; ++entry) {
+        if (entry->num_moves && entry->hash == hash) {
+            // Found it.
+            ++s.hits;
+            result.first.clear();
+            result.first.reserve(entry->num_moves);
+            for (auto i = 0; i < entry->num_moves; i++) {
+                result.first.emplace_back(Utils::half_to_float(entry->priors[i]),
+                                          Move(entry->moves[i]));
+            }
+            result.second = entry->eval;
+            return true;
+        }
     }
-
-    const auto& entry = iter->second;
-
-    // Found it.
-    ++m_hits;
-    result = entry->result;
-    return true;
+    return false;  // Not found.
 }
 
-void NNCache::insert(Key hash,
+void NNCache::insert(std::uint64_t hash,
                      const Network::Netresult& result) {
-    std::lock_guard<std::mutex> lock(m_mutex);
-
-    if (m_cache.find(hash) != m_cache.end()) {
-        return;  // Already in the cache.
+    const auto num_moves = result.first.size();
+    if (num_moves == 0 || num_moves > MAX_CACHED_MOVES) {
+        return;
     }
 
-    m_cache.emplace(hash, std::make_unique<Entry>(result));
-    m_order.push_back(hash);
-    ++m_inserts;
+    const auto bucket = bucket_index(hash);
+    auto& s = stripe(bucket);
+    LOCK(s.mutex, lock);
+
+    // Replace the oldest entry of the bucket, empty slots have age 0.
+    const auto first = m_entries + bucket * BUCKET_SIZE;
+    auto victim = first;
+    for (auto entry = first; entry != first + BUCKET_SIZE; ++entry) {
+        if (entry->num_moves && entry->hash == hash) {
+            return;  // Already in the cache.
+        }
+        if (entry->age < victim->age) {
+            victim = entry;
+        }
+    }
 
-    // If the cache is too large, remove the oldest entry.
-    if (m_order.size() > m_size) {
-        m_cache.erase(m_order.front());
-        m_order.pop_front();
+    if (!victim->num_moves) {
+        ++s.used;
     }
+    victim->hash = hash;
+    victim->age = ++s.age;
+    victim->num_moves = static_cast<std::uint16_t>(num_moves);
+    victim->eval = result.second;
+    for (auto i = size_t{0}; i < num_moves; i++) {
+        victim->priors[i] = prior_to_half(result.first[i].first);
+        victim->moves[i] = static_cast<std::uint16_t>(result.first[i].second);
+    }
+    ++s.inserts;
 }
 
 void NNCache::resize(int size) {
-    m_size = size;
-    while (m_order.size() > m_size) {
-        m_cache.erase(m_order.front());
-        m_order.pop_front();
+    // The thread that first touches the entries decides the NUMA node they
+    // are allocated on. Callers aren't pinned, so hand that to a pool thread.
+    if (cfg_pin_threads && thread_pool.size() > 0) {
+        thread_pool.add_task([this, size] { allocate(size); }).get();
+    } else {
+        allocate(size);
     }
 }
 
-void NNCache::set_size_from_playouts(int max_playouts) {
-    // cache hits are generally from last several moves so setting cache
-    // size based on playouts increases the hit rate while balancing memory
-    // usage for low playout instances. 50'000 cache entries is ~250 MB
-    auto max_size = std::min(50'000, std::max(6'000, 3 * max_playouts));
-    NNCache::get_NNCache().resize(max_size);
+void NNCache::allocate(int size) {
+    m_buckets = std::max(1, size / BUCKET_SIZE);
+    m_num_entries = m_buckets * BUCKET_SIZE;
+    // Unmap the old entries first, there may not be room for both.
+    m_memory = HugePages();
+    m_memory = HugePages(m_num_entries * sizeof(Entry));
+    m_entries = reinterpret_cast<Entry*>(m_memory.data());
+    for (auto i = size_t{0}; i < m_num_entries; i++) {
+        new (m_entries + i) Entry();
+    }
+    for (auto& s : m_stripes) {
+        s.used = 0;
+    }
+}
+
+void NNCache::clear() {
+    resize(static_cast<int>(m_num_entries));
+    for (auto& s : m_stripes) {
+        s.hits = 0;
+        s.lookups = 0;
+        s.inserts = 0;
+        s.age = 0;
+    }
+}
+
+void NNCache::set_size_mb(int megabytes) {
+    auto entries = size_t(megabytes) * 1024 * 1024 / sizeof(Entry);
+    resize(static_cast<int>(std::min<size_t>(entries, std::numeric_limits<int>::max())));
+}
+
+std::pair<int, int> NNCache::hit_rate() const {
+    auto hits = 0;
+    auto lookups = 0;
+    for (const auto& s : m_stripes) {
+        hits += s.hits;
+        lookups += s.lookups;
+    }
+    return {hits, lookups};
 }
 
 void NNCache::dump_stats() {
-    Utils::myprintf("NNCache: %d/%d hits/lookups = %.1f%% hitrate, %d inserts, %u size\n",
-        m_hits, m_lookups, 100. * m_hits / (m_lookups + 1),
-        m_inserts, m_cache.size());
+    auto hits = 0;
+    auto lookups = 0;
+    auto inserts = 0;
+    auto used = 0;
+    for (auto& s : m_stripes) {
+        LOCK(s.mutex, lock);
+        hits += s.hits;
+        lookups += s.lookups;
+        inserts += s.inserts;
+        used += s.used;
+    }
+    Utils::myprintf("NNCache: %d/%d hits/lookups = %.1f%% hitrate, %d inserts, %d size, %.1f MB%s\n",
+        hits, lookups, 100. * hits / (lookups + 1),
+        inserts, used, m_num_entries * sizeof(Entry) / (1024.0 * 1024.0),
+        m_memory.kind() != HugePages::Kind::NORMAL ? " on huge pages" : "");
 }
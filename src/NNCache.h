@@ -21,23 +21,42 @@
 
 #include "config.h"
 
-#include <deque>
-#include <mutex>
-#include <unordered_map>
+#include <array>
+#include <cstdint>
+#include <vector>
 
+#include "HugePages.h"
 #include "Network.h"
-
+#include "SMP.h"
+
+// Fixed size hash table of NN results. Every entry is stored inline in its
+// slot, so neither lookups nor inserts allocate. Slots are grouped in
+// buckets of BUCKET_SIZE, and buckets are protected by a set of striped
+// locks, so threads only contend when they touch the same stripe.
+// Moves are stored as 16 bit Stockfish moves and priors as IEEE half
+// floats, so a slot costs 4 bytes per move.
 class NNCache {
 public:
+    // Results with more moves than this are not cached. Chess positions
+    // with that many legal moves are too rare to be worth the memory.
+    static constexpr auto MAX_CACHED_MOVES = 96;
+    static constexpr auto BUCKET_SIZE = 2;
+    static constexpr auto NUM_STRIPES = 256;
+
     // return the global NNCache
     static NNCache& get_NNCache(void);
 
-    // Set a reasonable size gives max number of playouts
-    void set_size_from_playouts(int max_playouts);
-
-    // Resize NNCache
+    // Resize NNCache, dropping all entries. Must not be called while
+    // other threads use the cache.
     void resize(int size);
 
+    // Drop all entries and statistics, keeping the size. Must not be
+    // called while other threads use the cache.
+    void clear();
+
+    // Resize NNCache to use about the given amount of memory.
+    void set_size_mb(int megabytes);
+
     // Try and find an existing entry.
     bool lookup(std::uint64_t hash, Network::Netresult & result);
 
@@ -46,34 +65,50 @@ public:
                 const Network::Netresult& result);
 
     // Return the hit rate ratio.
-    std::pair<int, int> hit_rate() const {
-        return {m_hits, m_lookups};
-    }
+    std::pair<int, int> hit_rate() const;
 
     void dump_stats();
 
 private:
-    NNCache(int size = 50000);  // ~ 250MB for LZGo - TODO for LZChess
-
-    std::mutex m_mutex;
+    NNCache(int size = 50000);  // ~ 20MB
 
-    size_t m_size;
-
-    // Statistics
-    int m_hits{0};
-    int m_lookups{0};
-    int m_inserts{0};
+    void allocate(int size);
 
     struct Entry {
-        Entry( const Network::Netresult& r)
-            : result(r) {}
-        Network::Netresult result;  // ~ 3KB for LZGo - TODO for LZChess
+        std::uint64_t hash{0};
+        float eval{0.0f};
+        // Insertion order, to replace the oldest entry of a bucket.
+        std::uint32_t age{0};
+        // 0 for an empty slot.
+        std::uint16_t num_moves{0};
+        std::array<std::uint16_t, MAX_CACHED_MOVES> moves;
+        std::array<std::uint16_t, MAX_CACHED_MOVES> priors;
+    };
+
+    struct alignas(64) Stripe {
+        SMP::Mutex mutex;
+        // Statistics, guarded by mutex.
+        int hits{0};
+        int lookups{0};
+        int inserts{0};
+        int used{0};
+        std::uint32_t age{0};
     };
 
-    // Map from hash to {features, result}
-    std::unordered_map<std::uint64_t, std::unique_ptr<const Entry>> m_cache;
-    // Order entries were added to the map.
-    std::deque<size_t> m_order;
+    size_t bucket_index(std::uint64_t hash) const {
+        return hash % m_buckets;
+    }
+    Stripe& stripe(size_t bucket) {
+        return m_stripes[bucket % NUM_STRIPES];
+    }
+
+    size_t m_buckets;
+    // m_num_entries entries in m_memory, which is on huge pages if it can
+    // be, as lookups go all over it.
+    HugePages m_memory;
+    Entry* m_entries{nullptr};
+    size_t m_num_entries{0};
+    std::array<Stripe, NUM_STRIPES> m_stripes;
 };
 
 #endif
@@ -0,0 +1,217 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include <algorithm>
+#include <cstring>
+
+#include "NNDiskCache.h"
+#include "Parameters.h"
+#include "Utils.h"
+
+namespace {
+
+constexpr char MAGIC[8] = {'L', 'C', 'Z', 'N', 'N', 'D', 'C', '\0'};
+// Bump when the entries or the keys change meaning.
+constexpr std::uint32_t VERSION = 1;
+
+// As in NNCache, priors are in [0, 1].
+std::uint16_t prior_to_half(float f) {
+    if (!(f > 0.0f)) {
+        return 0;
+    }
+    return Utils::float_to_half(std::min(f, 65504.0f));
+}
+
+}
+
+NNDiskCache& NNDiskCache::get_NNDiskCache(void) {
+    static NNDiskCache cache;
+    return cache;
+}
+
+NNDiskCache::~NNDiskCache() {
+    close();
+}
+
+bool NNDiskCache::open(const std::string& filename, int megabytes,
+                       const std::string& weightsfile) {
+    close();
+
+    auto network_id = std::uint64_t{};
+    if (!Utils::hash_file(weightsfile, network_id)) {
+        return false;
+    }
+    // The cached priors went through the softmax.
+    network_id = Utils::fnv1a(reinterpret_cast<const char*>(&cfg_softmax_temp),
+                       sizeof(cfg_softmax_temp), network_id);
+
+    const auto num_entries =
+        std::max(size_t{1}, size_t(megabytes) * 1024 * 1024 / sizeof(Entry));
+    m_file = std::make_unique<MappedFile>(
+        filename, HEADER_SIZE + num_entries * sizeof(Entry));
+    auto data = m_file->writable_data();
+    if (!data) {
+        m_file.reset();
+        return false;
+    }
+
+    auto header = Header{};
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+        || header.version != VERSION
+        || header.entry_size != sizeof(Entry)
+        || header.network_id != network_id
+        || header.num_entries != num_entries) {
+        // Zeroed entries have no moves, so they are never found.
+        std::memset(data, 0, m_file->size());
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.entry_size = sizeof(Entry);
+        header.network_id = network_id;
+        header.num_entries = num_entries;
+        std::memcpy(data, &header, sizeof(header));
+        Utils::myprintf("Started NN disk cache %s.\n", filename.c_str());
+    } else {
+        Utils::myprintf("Reusing NN disk cache %s.\n", filename.c_str());
+    }
+
+    m_entries = reinterpret_cast<Entry*>(data + HEADER_SIZE);
+    m_num_entries = num_entries;
+    m_exit = false;
+    m_writer = std::thread(&NNDiskCache::writer, this);
+    return true;
+}
+
+void NNDiskCache::close() {
+    if (!m_writer.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_cv.notify_all();
+    m_writer.join();
+    m_entries = nullptr;
+    m_num_entries = 0;
+    m_file.reset();
+}
+
+std::uint64_t NNDiskCache::digest(const Entry& entry) {
+    // Everything after the check word, a word at a time.
+    constexpr auto WORDS = (sizeof(Entry) - sizeof(entry.check)) / 8;
+    static_assert(sizeof(Entry) % 8 == 0, "Entry isn't made of words");
+    const auto bytes = reinterpret_cast<const char*>(&entry) + sizeof(entry.check);
+    auto hash = std::uint64_t{0};
+    for (auto i = size_t{0}; i < WORDS; i++) {
+        auto word = std::uint64_t{};
+        std::memcpy(&word, bytes + i * 8, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+bool NNDiskCache::lookup(std::uint64_t hash, Network::Netresult & result) {
+    if (!m_entries) {
+        return false;
+    }
+    ++m_lookups;
+
+    // The writer may be halfway through this entry, so work on a copy.
+    auto entry = Entry{};
+    std::memcpy(&entry, &m_entries[hash % m_num_entries], sizeof(entry));
+    if ((entry.check ^ digest(entry)) != hash
+        || entry.num_moves == 0 || entry.num_moves > MAX_CACHED_MOVES) {
+        return false;
+    }
+    ++m_hits;
+    result.first.clear();
+    result.first.reserve(entry.num_moves);
+    for (auto i = 0; i < entry.num_moves; i++) {
+        result.first.emplace_back(Utils::half_to_float(entry.priors[i]),
+                                  Move(entry.moves[i]));
+    }
+    result.second = entry.eval;
+    return true;
+}
+
+void NNDiskCache::insert(std::uint64_t hash,
+                         const Network::Netresult& result) {
+    const auto num_moves = result.first.size();
+    if (!m_entries || num_moves == 0 || num_moves > MAX_CACHED_MOVES) {
+        return;
+    }
+
+    auto entry = Entry{};
+    entry.eval = result.second;
+    entry.num_moves = static_cast<std::uint16_t>(num_moves);
+    for (auto i = size_t{0}; i < num_moves; i++) {
+        entry.priors[i] = prior_to_half(result.first[i].first);
+        entry.moves[i] = static_cast<std::uint16_t>(result.first[i].second);
+    }
+    entry.check = hash ^ digest(entry);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_pending.size() >= MAX_PENDING) {
+            ++m_dropped;
+            return;
+        }
+        m_pending.emplace_back(hash % m_num_entries, entry);
+    }
+    m_cv.notify_all();
+}
+
+void NNDiskCache::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this] { return m_pending.empty() && m_writing == 0; });
+}
+
+void NNDiskCache::writer() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_cv.wait(lock, [this] { return m_exit || !m_pending.empty(); });
+        if (m_pending.empty()) {
+            return;  // Exiting, and everything is written.
+        }
+        auto pending = std::move(m_pending);
+        m_pending.clear();
+        m_writing = static_cast<int>(pending.size());
+        lock.unlock();
+        for (const auto& slot_entry : pending) {
+            std::memcpy(&m_entries[slot_entry.first], &slot_entry.second,
+                        sizeof(Entry));
+        }
+        m_writes += static_cast<int>(pending.size());
+        lock.lock();
+        m_writing = 0;
+        m_cv.notify_all();
+    }
+}
+
+void NNDiskCache::dump_stats() {
+    if (!m_entries) {
+        return;
+    }
+    Utils::myprintf("NNDiskCache: %d/%d hits/lookups = %.1f%% hitrate, %d writes, %d dropped, %.1f MB\n",
+        m_hits.load(), m_lookups.load(), 100. * m_hits / (m_lookups + 1),
+        m_writes.load(), m_dropped.load(),
+        m_num_entries * sizeof(Entry) / (1024.0 * 1024.0));
+}
@@ -0,0 +1,126 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NNDISKCACHE_H_INCLUDED
+#define NNDISKCACHE_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "MappedFile.h"
+#include "Network.h"
+
+// NN results kept in a memory mapped file, so that they survive the
+// engine. It backs the NNCache when the same positions are analysed over
+// and over. The file is a direct mapped hash table by history key, with a
+// header naming the network it was filled by; opening it with another
+// network starts it afresh.
+// Inserts are written by a background thread, as touching the file can
+// wait for the disk. Entries carry a check word, the key xor a digest of
+// the rest, so lookups need no locks: an entry which is being written, or
+// was written by a crashed engine, doesn't match its key.
+class NNDiskCache {
+public:
+    static constexpr auto MAX_CACHED_MOVES = 96;
+    // Inserts waiting for the writer, more are dropped.
+    static constexpr auto MAX_PENDING = 1024;
+
+    // return the global NNDiskCache
+    static NNDiskCache& get_NNDiskCache(void);
+
+    // Maps @filename with room for about @megabytes of entries, for the
+    // results of the network in @weightsfile. Returns false if the file
+    // can't be mapped, the cache is closed then. Must not be called while
+    // other threads use the cache.
+    bool open(const std::string& filename, int megabytes,
+              const std::string& weightsfile);
+
+    // Writes what is queued and unmaps the file. Must not be called while
+    // other threads use the cache.
+    void close();
+
+    bool is_open() const { return m_entries != nullptr; }
+
+    // Try and find an existing entry.
+    bool lookup(std::uint64_t hash, Network::Netresult & result);
+
+    // Queue a new entry for writing.
+    void insert(std::uint64_t hash, const Network::Netresult& result);
+
+    // Blocks until the queued entries are written.
+    void flush();
+
+    void dump_stats();
+
+private:
+    NNDiskCache() = default;
+    ~NNDiskCache();
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t entry_size;
+        // The network and the settings the results depend on.
+        std::uint64_t network_id;
+        std::uint64_t num_entries;
+    };
+    static constexpr auto HEADER_SIZE = 64;
+    static_assert(sizeof(Header) <= HEADER_SIZE, "Header too large");
+
+    struct Entry {
+        std::uint64_t check;
+        float eval;
+        std::uint16_t num_moves;
+        std::uint16_t padding;
+        std::array<std::uint16_t, MAX_CACHED_MOVES> moves;
+        std::array<std::uint16_t, MAX_CACHED_MOVES> priors;
+    };
+
+    static std::uint64_t digest(const Entry& entry);
+    void writer();
+
+    std::unique_ptr<MappedFile> m_file;
+    Entry* m_entries{nullptr};
+    size_t m_num_entries{0};
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    // Entries to write, with their slots, and how many are taken but not
+    // written yet.
+    std::deque<std::pair<size_t, Entry>> m_pending;
+    int m_writing{0};
+    bool m_exit{false};
+    std::thread m_writer;
+
+    std::atomic<int> m_hits{0};
+    std::atomic<int> m_lookups{0};
+    std::atomic<int> m_writes{0};
+    std::atomic<int> m_dropped{0};
+};
+
+#endif
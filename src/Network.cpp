@@ -21,13 +21,20 @@
 #include "UCI.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
 #include <stack>
 #include <iostream>
 #include <fstream>
 #include <iterator>
 #include <string>
 #include <sstream>
+#include <stdexcept>
 #include <memory>
 #include <cmath>
 #include <array>
@@ -51,15 +58,21 @@
 #include "UCTNode.h"
 #endif
 
+#include "CPUKernels.h"
 #include "Random.h"
 #include "Network.h"
+#include "NNBatchQueue.h"
 #include "NNCache.h"
+#include "NNDiskCache.h"
 #include "Utils.h"
 #include "Parameters.h"
+#include "PhaseTimer.h"
+#include "SMP.h"
 #include "Timing.h"
 #include "Movegen.h"
 #include "ThreadPool.h"
 #include "Im2Col.h"
+#include "WeightsFile.h"
 
 namespace x3 = boost::spirit::x3;
 using namespace Utils;
@@ -67,14 +80,133 @@ using namespace Utils;
 // Seems this is required for the Darwin compiler.
 // Not sure why only T_HISTORY and not all the others.
 constexpr int Network::T_HISTORY;
+static_assert(Network::T_HISTORY == BoardHistory::HISTORY_KEY_PLIES,
+              "The NN cache key has to cover the history the network sees.");
 
 bool Network::initialized = false;
 size_t Network::m_format_version{0};
-std::unordered_map<Move, int, std::hash<int>> Network::old_move_lookup;
-std::unordered_map<Move, int, std::hash<int>> Network::new_move_lookup;
+
+// The policy output has an entry for every queen and knight move between
+// two squares, followed by the promotions to a queen, rook or bishop. The
+// first format also has the black promotions, the second plays black as
+// white on a flipped board. These tables map a move to its entry. They are
+// indexed by the promotion piece and the two squares, so that looking up a
+// move is one load. -1 means the move has no entry.
+namespace {
+    constexpr auto MOVE_INDEX_SIZE = 4 * 64 * 64;
+
+    struct MoveIndexTable {
+        std::int16_t index[MOVE_INDEX_SIZE];
+        int size;
+    };
+
+    // promotion is the PieceType minus KNIGHT, like in Move, so that a
+    // knight promotion has the slot of the plain pawn move.
+    constexpr int move_index(int from, int to, int promotion) {
+        return (promotion << 12) | (from << 6) | to;
+    }
+
+    constexpr bool is_policy_move(int from, int to) {
+        auto files = to % 8 - from % 8;
+        auto ranks = to / 8 - from / 8;
+        files = files < 0 ? -files : files;
+        ranks = ranks < 0 ? -ranks : ranks;
+        auto queen = from != to && (files == 0 || ranks == 0 || files == ranks);
+        auto knight = (files == 1 && ranks == 2) || (files == 2 && ranks == 1);
+        return queen || knight;
+    }
+
+    constexpr MoveIndexTable make_move_index(bool black_promotions) {
+        auto table = MoveIndexTable{};
+        for (auto i = 0; i < MOVE_INDEX_SIZE; i++) {
+            table.index[i] = -1;
+        }
+        auto next = 0;
+        for (auto from = 0; from < 64; from++) {
+            for (auto to = 0; to < 64; to++) {
+                if (is_policy_move(from, to)) {
+                    table.index[move_index(from, to, 0)] = next++;
+                }
+            }
+        }
+        for (auto black = 0; black <= (black_promotions ? 1 : 0); black++) {
+            for (auto from_file = 0; from_file < 8; from_file++) {
+                for (auto to_file = from_file - 1; to_file <= from_file + 1; to_file++) {
+                    if (to_file < 0 || to_file >= 8) {
+                        continue;
+                    }
+                    auto from = black ? 8 + from_file : 48 + from_file;
+                    auto to = black ? to_file : 56 + to_file;
+                    // A knight promotion is the pawn move to the last rank.
+                    table.index[move_index(from, to, QUEEN - KNIGHT)] = next++;
+                    table.index[move_index(from, to, ROOK - KNIGHT)] = next++;
+                    table.index[move_index(from, to, BISHOP - KNIGHT)] = next++;
+                }
+            }
+        }
+        table.size = next;
+        return table;
+    }
+
+    constexpr auto OLD_MOVE_INDEX = make_move_index(true);
+    constexpr auto NEW_MOVE_INDEX = make_move_index(false);
+    static_assert(OLD_MOVE_INDEX.size == Network::V1_NUM_OUTPUT_POLICY,
+                  "The old move table must cover the policy output.");
+    static_assert(NEW_MOVE_INDEX.size == Network::V2_NUM_OUTPUT_POLICY,
+                  "The new move table must cover the policy output.");
+}
+
+// The input planes of recently evaluated positions, keyed like the NNCache.
+// A child's history is its parent's shifted by one ply, so when a node is
+// expanded shortly after its parent, which is the common case, the planes
+// of its parent are still here.
+class NNPlanesCache {
+public:
+    static constexpr auto SIZE = 8192;
+    static constexpr auto NUM_STRIPES = 64;
+
+    bool lookup(std::uint64_t hash, Network::NNPlanes& planes) {
+        auto index = hash % SIZE;
+        LOCK(m_stripes[index % NUM_STRIPES].mutex, lock);
+        const auto& entry = m_entries[index];
+        if (entry.hash != hash) {
+            return false;
+        }
+        planes = entry.planes;
+        return true;
+    }
+
+    void insert(std::uint64_t hash, const Network::NNPlanes& planes) {
+        auto index = hash % SIZE;
+        LOCK(m_stripes[index % NUM_STRIPES].mutex, lock);
+        auto& entry = m_entries[index];
+        entry.hash = hash;
+        entry.planes = planes;
+    }
+
+private:
+    struct Entry {
+        std::uint64_t hash{0};
+        Network::NNPlanes planes;
+    };
+    struct alignas(64) Stripe {
+        SMP::Mutex mutex;
+    };
+
+    std::vector<Entry> m_entries = std::vector<Entry>(SIZE);
+    std::array<Stripe, NUM_STRIPES> m_stripes;
+};
+
+static NNPlanesCache planes_cache;
+
+static std::atomic<std::int64_t> eval_count{0};
+static std::atomic<std::int64_t> eval_micros{0};
 
 // Input + residual block tower
 static std::vector<std::vector<float>> conv_weights;
+// The 3x3 convolutions of the CPU are F(4x4, 3x3) winograd rather than
+// F(2x2, 3x3), see select_winograd().
+static bool winograd4 = false;
 static std::vector<std::vector<float>> conv_biases;
 static std::vector<std::vector<float>> batchnorm_means;
 static std::vector<std::vector<float>> batchnorm_stddivs;
@@ -106,10 +238,59 @@ static std::array<float, Network::NUM_VALUE_CHANNELS> ip1_val_b;
 static std::array<float, Network::NUM_VALUE_CHANNELS> ip2_val_w;
 static std::array<float, 1> ip2_val_b;
 
+#ifdef USE_BLAS
+// Int8 copies of the residual tower convolutions, indexed like conv_weights.
+// The input convolution stays in fp32, its move counters have no fixed range.
+struct Int8Convolution {
+    // Weights of an output in the row order of im2col_int8, filter tap by
+    // filter tap, the channels padded to a multiple of 4.
+    std::vector<int8_t> weights;
+    std::vector<float> weight_scales;
+    // Inputs are quantized to round(x / input_scale), at most 255.
+    float input_scale{1.0f};
+    // weight_scales * input_scale, to turn the sums back into floats.
+    std::vector<float> output_scales;
+};
+static std::vector<Int8Convolution> int8_convs;
+
+// Symmetric quantization with a scale per output channel.
+static Int8Convolution quantize_convolution(const std::vector<float>& weights,
+                                            const size_t outputs,
+                                            const size_t channels) {
+    constexpr auto filter_len = size_t{3 * 3};
+    const auto padded_channels = ceilMultiple(channels, 4);
+    const auto rows = filter_len * padded_channels;
+    auto conv = Int8Convolution{};
+    conv.weights.resize(outputs * rows);
+    conv.weight_scales.resize(outputs);
+    for (auto o = size_t{0}; o < outputs; o++) {
+        const auto w = &weights[o * channels * filter_len];
+        auto max_abs = 0.0f;
+        for (auto i = size_t{0}; i < channels * filter_len; i++) {
+            max_abs = std::max(max_abs, std::fabs(w[i]));
+        }
+        const auto scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+        conv.weight_scales[o] = scale;
+        for (auto c = size_t{0}; c < channels; c++) {
+            for (auto tap = size_t{0}; tap < filter_len; tap++) {
+                conv.weights[o * rows + tap * padded_channels + c] =
+                    static_cast<int8_t>(std::lround(w[c * filter_len + tap] / scale));
+            }
+        }
+    }
+    return conv;
+}
+#endif
+
 size_t Network::get_format_version() {
     return m_format_version;
 }
 
+void Network::set_format_version(size_t format_version) {
+    assert(!initialized);
+    m_format_version = format_version;
+}
+
 size_t Network::get_input_channels() {
     return m_format_version == 1 ? V1_INPUT_CHANNELS : V2_INPUT_CHANNELS;
 }
@@ -128,6 +309,21 @@ void Network::process_bn_var(std::vector<float>& weights, const float epsilon) {
     }
 }
 
+void Network::fold_batchnorm(std::vector<float>& weights,
+                             std::vector<float>& biases,
+                             const float* means, const float* stddivs) {
+    // stddivs * (W.x + biases - means) = (stddivs * W).x
+    //                                  + stddivs * (biases - means)
+    const auto outputs = biases.size();
+    const auto filter_dim = weights.size() / outputs;
+    for (auto o = size_t{0}; o < outputs; o++) {
+        for (auto i = size_t{0}; i < filter_dim; i++) {
+            weights[o * filter_dim + i] *= stddivs[o];
+        }
+        biases[o] = stddivs[o] * (biases[o] - means[o]);
+    }
+}
+
 std::vector<float> Network::winograd_transform_f(const std::vector<float>& f,
                                                  const int outputs,
                                                  const int channels) {
@@ -171,22 +367,69 @@ std::vector<float> Network::winograd_transform_f(const std::vector<float>& f,
     return U;
 }
 
+std::vector<float> Network::winograd4_transform_f(const std::vector<float>& f,
+                                                  const int outputs,
+                                                  const int channels) {
+    // F(4x4, 3x3) Winograd filter transformation, in the layout of
+    // winograd_transform_f().
+    constexpr auto alpha = WINOGRAD4_ALPHA;
+    auto U = std::vector<float>(WINOGRAD4_TILE * outputs * channels);
+    const auto G = std::array<float, alpha * 3>{
+         1.0f / 4,   0.0f,       0.0f,
+        -1.0f / 6,  -1.0f / 6,  -1.0f / 6,
+        -1.0f / 6,   1.0f / 6,  -1.0f / 6,
+         1.0f / 24,  1.0f / 12,  1.0f / 6,
+         1.0f / 24, -1.0f / 12,  1.0f / 6,
+         0.0f,       0.0f,       1.0f};
+    auto temp = std::array<float, alpha * 3>{};
+
+    for (auto o = 0; o < outputs; o++) {
+        for (auto c = 0; c < channels; c++) {
+            for (auto i = 0; i < alpha; i++){
+                for (auto j = 0; j < 3; j++) {
+                    auto acc = 0.0f;
+                    for (auto k = 0; k < 3; k++) {
+                        acc += G[i*3 + k] * f[o*channels*9 + c*9 + k*3 + j];
+                    }
+                    temp[i*3 + j] = acc;
+                }
+            }
+
+            for (auto xi = 0; xi < alpha; xi++) {
+                for (auto nu = 0; nu < alpha; nu++) {
+                    auto acc = 0.0f;
+                    for (int k = 0; k < 3; k++) {
+                        acc += temp[xi*3 + k] * G[nu*3 + k];
+                    }
+                    U[xi * (alpha * outputs * channels)
+                      + nu * (outputs * channels)
+                      + c * outputs
+                      + o] = acc;
+                }
+            }
+        }
+    }
+
+    return U;
+}
+
 std::vector<float> Network::zeropad_U(const std::vector<float>& U,
                                       const int outputs, const int channels,
                                       const int outputs_pad,
-                                      const int channels_pad) {
+                                      const int channels_pad,
+                                      const int alpha) {
     // Fill with zeroes
-    auto Upad = std::vector<float>(WINOGRAD_TILE * outputs_pad * channels_pad);
+    auto Upad = std::vector<float>(alpha * alpha * outputs_pad * channels_pad);
 
     for(auto o = 0; o < outputs; o++) {
         for(auto c = 0; c < channels; c++) {
-            for(auto xi = 0; xi < WINOGRAD_ALPHA; xi++){
-                for(auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
-                    Upad[xi * (WINOGRAD_ALPHA * outputs_pad * channels_pad)
+            for(auto xi = 0; xi < alpha; xi++){
+                for(auto nu = 0; nu < alpha; nu++) {
+                    Upad[xi * (alpha * outputs_pad * channels_pad)
                          + nu * (outputs_pad * channels_pad)
                          + c * outputs_pad +
                           o] =
-                    U[xi * (WINOGRAD_ALPHA * outputs * channels)
+                    U[xi * (alpha * outputs * channels)
                       + nu * (outputs * channels)
                       + c * outputs
                       + o];
@@ -200,90 +443,125 @@ std::vector<float> Network::zeropad_U(const std::vector<float>& U,
 
 extern "C" void openblas_set_num_threads(int num_threads);
 
-std::pair<int, int> Network::load_network(std::istream& wtfile) {
-    // Read format version
+// Read the format version and the lines of floats of a text weights file.
+static bool read_text_weights(std::istream& wtfile, int& format_version,
+                              std::vector<std::vector<float>>& lines) {
     auto line = std::string{};
     if (std::getline(wtfile, line)) {
         auto iss = std::stringstream{ line };
         // First line is the file format version id
-        iss >> m_format_version;
-        if (iss.fail()
-            || m_format_version > MAX_FORMAT_VERSION
-            || m_format_version < 1) {
+        iss >> format_version;
+        if (iss.fail()) {
             myprintf("Weights file is the wrong version.\n");
-            return {0, 0};
-        } else {
-            assert(m_format_version <= MAX_FORMAT_VERSION);
+            return false;
         }
     } else {
         myprintf("Weights file is empty.\n");
+        return false;
+    }
+    lines.clear();
+    while (std::getline(wtfile, line)) {
+        std::vector<float> weights;
+        auto it_line = cbegin(line);
+        const auto ok = phrase_parse(it_line, cend(line),
+                                     *x3::float_, x3::space, weights);
+        if (!ok || it_line != cend(line)) {
+            myprintf("\nFailed to parse weight file. Error on line %d.\n",
+                    lines.size() + 2); //+1 from version line, +1 from 0-indexing
+            return false;
+        }
+        lines.emplace_back(std::move(weights));
+    }
+    return true;
+}
+
+// Read a text or binary weights file, either may be gzipped.
+static bool read_weights_file(const std::string& filename, int& format_version,
+                              std::vector<std::vector<float>>& lines) {
+    if (WeightsFile::is_binary(filename)) {
+        return WeightsFile::read_binary(filename, format_version, lines);
+    }
+    // gzopen supports both gz and non-gz files, will decompress or just read directly as needed.
+    auto gzhandle = gzopen(filename.c_str(), "rb");
+    if (gzhandle == nullptr) {
+        myprintf("Could not open weights file: %s\n", filename.c_str());
+        return false;
+    }
+    // Stream the gz file in to a memory buffer stream.
+    std::stringstream buffer;
+    const int chunkBufferSize = 64 * 1024;
+    std::vector<char> chunkBuffer(chunkBufferSize);
+    while (true) {
+        int bytesRead = gzread(gzhandle, chunkBuffer.data(), chunkBufferSize);
+        if (bytesRead == 0) break;
+        if (bytesRead < 0) {
+            myprintf("Failed to decompress or read: %s\n", filename.c_str());
+            gzclose(gzhandle);
+            return false;
+        }
+        assert(bytesRead <= chunkBufferSize);
+        buffer.write(chunkBuffer.data(), bytesRead);
+    }
+    gzclose(gzhandle);
+    // The training pipeline uploads gzipped binary files.
+    char magic[4];
+    buffer.read(magic, sizeof(magic));
+    const auto magic_size = static_cast<size_t>(buffer.gcount());
+    buffer.clear();
+    buffer.seekg(0);
+    if (WeightsFile::is_binary(magic, magic_size)) {
+        const auto data = buffer.str();
+        return WeightsFile::parse_binary(data.data(), data.size(),
+                                         format_version, lines);
+    }
+    return read_text_weights(buffer, format_version, lines);
+}
+
+std::pair<int, int> Network::load_network(
+        const int format_version, std::vector<std::vector<float>>& lines) {
+    if (format_version > MAX_FORMAT_VERSION || format_version < 1) {
+        myprintf("Weights file is the wrong version.\n");
         return {0, 0};
     }
+    m_format_version = format_version;
     // Count size of the network
     myprintf("Detecting residual layers...");
     myprintf("v%d...", m_format_version);
-    // First line was the version number
-    auto linecount = size_t{1};
-    auto channels = 0;
-    while (std::getline(wtfile, line)) {
-        auto iss = std::stringstream{line};
-        // Third line of parameters are the convolution layer biases,
-        // so this tells us the amount of channels in the residual layers.
-        // We are assuming all layers have the same amount of filters.
-        if (linecount == 2) {
-            auto count = std::distance(std::istream_iterator<std::string>(iss),
-                                       std::istream_iterator<std::string>());
-            myprintf("%d channels...", count);
-            channels = count;
-        }
-        linecount++;
-    }
-    // 1 format id, 1 input layer (4 x weights), 14 ending weights,
+    // Second line of parameters are the convolution layer biases,
+    // so this tells us the amount of channels in the residual layers.
+    // We are assuming all layers have the same amount of filters.
+    auto channels = lines.size() > 1 ? static_cast<int>(lines[1].size()) : 0;
+    myprintf("%d channels...", channels);
+    // 1 input layer (4 x weights), 14 ending weights,
     // the rest are residuals, every residual has 8 x weight lines
     // Note: 14 ending weights is for value/policy head.
     //     It's a coincidence it's the same number of input features
     //     for V1 networks.
-    auto residual_blocks = linecount - (1 + 4 + 14);
-    if (residual_blocks % 8 != 0) {
+    if (lines.size() < 4 + 14 || (lines.size() - (4 + 14)) % 8 != 0) {
         myprintf("\nInconsistent number of weights in the file.\n");
-        myprintf("%d %d %d %d\n", m_format_version, residual_blocks, linecount, get_hist_planes());
+        myprintf("%d %d %d\n", m_format_version, lines.size() + 1,
+                 get_hist_planes());
         return {0, 0};
     }
-    residual_blocks /= 8;
+    auto residual_blocks = static_cast<int>((lines.size() - (4 + 14)) / 8);
     myprintf("%d blocks.\n", residual_blocks);
 
-    // Re-read file and process
-    wtfile.clear();
-    wtfile.seekg(0, std::ios::beg);
-
-    // Get the file format id out of the way
-    std::getline(wtfile, line);
-
     auto plain_conv_layers = 1 + (residual_blocks * 2);
-    auto plain_conv_wts = plain_conv_layers * 4;
-    linecount = 0;
-    while (std::getline(wtfile, line)) {
-        std::vector<float> weights;
-        auto it_line = cbegin(line);
-        const auto ok = phrase_parse(it_line, cend(line),
-                                     *x3::float_, x3::space, weights);
-        if (!ok || it_line != cend(line)) {
-            myprintf("\nFailed to parse weight file. Error on line %d.\n",
-                    linecount + 2); //+1 from version line, +1 from 0-indexing
-            return {0, 0};
-        }
+    auto plain_conv_wts = size_t(plain_conv_layers * 4);
+    for (auto linecount = size_t{0}; linecount < lines.size(); linecount++) {
+        auto& weights = lines[linecount];
         if (linecount < plain_conv_wts) {
             if (linecount % 4 == 0) {
-                conv_weights.emplace_back(weights);
+                conv_weights.emplace_back(std::move(weights));
             } else if (linecount % 4 == 1) {
                 // Redundant in our model, but they encode the
                 // number of outputs so we have to read them in.
-                conv_biases.emplace_back(weights);
+                conv_biases.emplace_back(std::move(weights));
             } else if (linecount % 4 == 2) {
-                batchnorm_means.emplace_back(weights);
+                batchnorm_means.emplace_back(std::move(weights));
             } else if (linecount % 4 == 3) {
                 process_bn_var(weights);
-                batchnorm_stddivs.emplace_back(weights);
+                batchnorm_stddivs.emplace_back(std::move(weights));
             }
         } else if (linecount == plain_conv_wts) {
             conv_pol_w = std::move(weights);
@@ -324,45 +602,39 @@ std::pair<int, int> Network::load_network(std::istream& wtfile) {
         } else if (linecount == plain_conv_wts + 13) {
             std::copy(begin(weights), end(weights), begin(ip2_val_b));
         }
-        linecount++;
     }
 
     return {channels, residual_blocks};
 }
 
 std::pair<int, int> Network::load_network_file(std::string filename) {
-    // gzopen supports both gz and non-gz files, will decompress or just read directly as needed.
-    auto gzhandle = gzopen(filename.c_str(), "rb");
-    if (gzhandle == nullptr) {
-        myprintf("Could not open weights file: %s\n", filename.c_str());
+    auto format_version = 0;
+    auto lines = std::vector<std::vector<float>>{};
+    if (!read_weights_file(filename, format_version, lines)) {
         return {0, 0};
     }
-    // Stream the gz file in to a memory buffer stream.
-    std::stringstream buffer;
-    const int chunkBufferSize = 64 * 1024;
-    std::vector<char> chunkBuffer(chunkBufferSize);
-    while (true) {
-        int bytesRead = gzread(gzhandle, chunkBuffer.data(), chunkBufferSize);
-        if (bytesRead == 0) break;
-        if (bytesRead < 0) {
-            myprintf("Failed to decompress or read: %s\n", filename.c_str());
-            gzclose(gzhandle);
-            return {0, 0};
-        }
-        assert(bytesRead <= chunkBufferSize);
-        buffer.write(chunkBuffer.data(), bytesRead);
+    return load_network(format_version, lines);
+}
+
+bool Network::convert_network_file(std::string filename,
+                                   std::string binary_filename) {
+    auto format_version = 0;
+    auto lines = std::vector<std::vector<float>>{};
+    if (!read_weights_file(filename, format_version, lines)) {
+        return false;
     }
-    auto result = load_network(buffer);
-    gzclose(gzhandle);
-    return result;
+    if (!WeightsFile::write_binary(binary_filename, format_version, lines)) {
+        return false;
+    }
+    myprintf("Wrote %d lines of v%d weights to %s.\n", lines.size() + 1,
+             format_version, binary_filename.c_str());
+    return true;
 }
 
 void Network::initialize(void) {
     if (initialized) return;
     initialized = true;
 
-    init_move_map();
-
     // Load network from file
     size_t channels, residual_blocks;
     assert(m_format_version == 0);
@@ -372,52 +644,74 @@ void Network::initialize(void) {
         exit(EXIT_FAILURE);
     }
 
+    if ((bn_val_w1.size() != conv_val_b.size()) ||
+        (bn_pol_w1.size() != conv_pol_b.size()) ) {
+            throw std::runtime_error("Weights are malformed. Incorrect number "
+             "of policy/value output planes.");
+    }
+
+    // Every convolution is followed by batchnorm, fold it into the weights
+    // and biases so all backends only have to add a bias before the ReLU.
+    for (auto i = size_t{0}; i < conv_weights.size(); i++) {
+        fold_batchnorm(conv_weights[i], conv_biases[i],
+                       batchnorm_means[i].data(), batchnorm_stddivs[i].data());
+    }
+    batchnorm_means.clear();
+    batchnorm_stddivs.clear();
+    fold_batchnorm(conv_pol_w, conv_pol_b, bn_pol_w1.data(), bn_pol_w2.data());
+    fold_batchnorm(conv_val_w, conv_val_b, bn_val_w1.data(), bn_val_w2.data());
+
+#ifdef USE_OPENCL
+    // The OpenCL devices transform the filters for the winograd variant
+    // their Tuner picked.
+    const auto cl_conv_weights = conv_weights;
+#endif
+    if (residual_blocks > 0) {
+        select_winograd(conv_weights[1], channels);
+    }
+    const auto transform_f = winograd4 ? winograd4_transform_f
+                                       : winograd_transform_f;
+
     auto weight_index = size_t{0};
     // Input convolution
     // Winograd transform convolution weights
     conv_weights[weight_index] =
-        winograd_transform_f(conv_weights[weight_index],
-                             channels, get_input_channels());
+        transform_f(conv_weights[weight_index],
+                    channels, get_input_channels());
     weight_index++;
 
+#ifndef USE_OPENCL
+    if (cfg_int8 && CPUKernels::get_isa() < CPUKernels::Isa::AVX512VNNI) {
+        myprintf("Int8 needs a CPU with AVX-512 VNNI, using fp32.\n");
+        cfg_int8 = false;
+    }
+    if (cfg_int8) {
+        int8_convs.resize(conv_weights.size());
+    }
+#endif
     // Residual block convolutions
     for (auto i = size_t{0}; i < residual_blocks * 2; i++) {
+#ifndef USE_OPENCL
+        if (cfg_int8) {
+            int8_convs[weight_index] =
+                quantize_convolution(conv_weights[weight_index],
+                                     channels, channels);
+        }
+#endif
 		conv_weights[weight_index] =
-            winograd_transform_f(conv_weights[weight_index],
-                                 channels, channels);
+            transform_f(conv_weights[weight_index], channels, channels);
         weight_index++;
     }
 
-    // Biases are not calculated and are typically zero but some networks might
-    // still have non-zero biases.
-    // Move biases to batchnorm means to make the output match without having
-    // to separately add the biases.
-    for (auto i = size_t{0}; i < conv_biases.size(); i++) {
-        for (auto j = size_t{0}; j < batchnorm_means[i].size(); j++) {
-            batchnorm_means[i][j] -= conv_biases[i][j];
-            conv_biases[i][j] = 0.0f;
-        }
-    }
-
-    if ((bn_val_w1.size() != conv_val_b.size()) ||
-        (bn_pol_w1.size() != conv_pol_b.size()) ) {
-            throw std::runtime_error("Weights are malformed. Incorrect number "
-             "of policy/value output planes.");
-    }
-
-    for (auto i = size_t{0}; i < bn_val_w1.size(); i++) {
-        bn_val_w1[i] -= conv_val_b[i];
-        conv_val_b[i] = 0.0f;
-    }
-
-    for (auto i = size_t{0}; i < bn_pol_w1.size(); i++) {
-        bn_pol_w1[i] -= conv_pol_b[i];
-        conv_pol_b[i] = 0.0f;
-    }
-
 #ifdef USE_OPENCL
     myprintf("Initializing OpenCL.\n");
-    opencl.initialize(channels);
+    opencl.initialize(channels, cfg_cpu_workers,
+                      [](const std::vector<NNPlanes>& input,
+                         std::vector<net_t>& output_pol,
+                         std::vector<net_t>& output_val,
+                         const int batch_size) {
+                          forward_cpu(input, output_pol, output_val, batch_size);
+                      });
 
     for(auto & opencl_net : opencl.get_networks()) {
         auto tuners = opencl_net->getOpenCL().get_sgemm_tuners();
@@ -426,45 +720,45 @@ void Network::initialize(void) {
         auto kwg = tuners[2];
         auto vwm = tuners[3];
 
+        const auto winograd_m = opencl_net->getOpenCL().get_winograd_m();
+        const auto alpha = winograd_m + 2;
+        const auto cl_transform_f = winograd_m == 4 ? winograd4_transform_f
+                                                    : winograd_transform_f;
+
         weight_index = 0;
 
         size_t m_ceil = ceilMultiple(ceilMultiple(channels, mwg), vwm);
         size_t k_ceil = ceilMultiple(ceilMultiple(get_input_channels(), kwg), vwm);
 
-        auto Upad = zeropad_U(conv_weights[weight_index],
+        auto Upad = zeropad_U(cl_transform_f(cl_conv_weights[weight_index],
+                                             channels, get_input_channels()),
                               channels, get_input_channels(),
-                              m_ceil, k_ceil);
+                              m_ceil, k_ceil, alpha);
 
-        // Winograd filter transformation changes filter size to 4x4
-        opencl_net->push_input_convolution(WINOGRAD_ALPHA, get_input_channels(), channels,
-                Upad, batchnorm_means[weight_index], batchnorm_stddivs[weight_index]);
+        // Winograd filter transformation changes filter size to alpha x alpha
+        opencl_net->push_input_convolution(alpha, get_input_channels(), channels,
+                Upad, conv_biases[weight_index]);
         weight_index++;
 
         // residual blocks
         for (auto i = size_t{0}; i < residual_blocks; i++) {
-            auto Upad1 = zeropad_U(conv_weights[weight_index],
+            auto Upad1 = zeropad_U(cl_transform_f(cl_conv_weights[weight_index],
+                                                  channels, channels),
                                    channels, channels,
-                                   m_ceil, m_ceil);
-            auto Upad2 = zeropad_U(conv_weights[weight_index + 1],
+                                   m_ceil, m_ceil, alpha);
+            auto Upad2 = zeropad_U(cl_transform_f(cl_conv_weights[weight_index + 1],
+                                                  channels, channels),
                                    channels, channels,
-                                   m_ceil, m_ceil);
-            opencl_net->push_residual(WINOGRAD_ALPHA, channels, channels,
+                                   m_ceil, m_ceil, alpha);
+            opencl_net->push_residual(alpha, channels, channels,
                                       Upad1,
-                                      batchnorm_means[weight_index],
-                                      batchnorm_stddivs[weight_index],
+                                      conv_biases[weight_index],
                                       Upad2,
-                                      batchnorm_means[weight_index + 1],
-                                      batchnorm_stddivs[weight_index + 1]);
+                                      conv_biases[weight_index + 1]);
             weight_index += 2;
         }
 
         // Output head convolutions
-        std::vector<float> bn_pol_means(bn_pol_w1.begin(), bn_pol_w1.end());
-        std::vector<float> bn_pol_stddivs(bn_pol_w2.begin(), bn_pol_w2.end());
-
-        std::vector<float> bn_val_means(bn_val_w1.begin(), bn_val_w1.end());
-        std::vector<float> bn_val_stddivs(bn_val_w2.begin(), bn_val_w2.end());
-
         std::vector<float> ip_pol_w_vec;
         std::vector<float> ip_pol_b_vec;
         if (m_format_version == 1) {
@@ -483,18 +777,18 @@ void Network::initialize(void) {
 
         opencl_net->push_policy(channels, NUM_POLICY_INPUT_PLANES,
                 NUM_POLICY_INPUT_PLANES*width*height, get_num_output_policy(),
-                conv_pol_w,
-                bn_pol_means, bn_pol_stddivs,
+                conv_pol_w, conv_pol_b,
                 ip_pol_w_vec, ip_pol_b_vec);
 
         opencl_net->push_value(channels, NUM_VALUE_INPUT_PLANES,
                 NUM_VALUE_INPUT_PLANES*width*height, NUM_VALUE_CHANNELS,
-                conv_val_w,
-                bn_val_means, bn_val_stddivs,
+                conv_val_w, conv_val_b,
                 ip_val_w_vec, ip_val_b_vec);
     }
 #endif
 #ifdef USE_BLAS
+    myprintf("CPU kernels: %s\n",
+             CPUKernels::get_isa_name(CPUKernels::get_isa()));
 #ifndef __APPLE__
 #ifdef USE_OPENBLAS
     openblas_set_num_threads(1);
@@ -508,175 +802,88 @@ void Network::initialize(void) {
     myprintf("BLAS core: MKL %s\n", Version.Processor);
 #endif
 #endif
+#ifndef USE_OPENCL
+    if (cfg_int8) {
+        calibrate_int8();
+    }
+#endif
 #endif
-}
 
-void Network::init_move_map() {
-  // old includes black promotions from 2nd to 1st rank
-  // new excludes those
-  std::vector<Move> old_moves;
-  std::vector<Move> new_moves;
-  for (Square s = SQ_A1; s <= SQ_H8; ++s) {
-    // Queen and knight moves
-    Bitboard b = attacks_bb(QUEEN, s, 0) | attacks_bb(KNIGHT, s, 0);
-    while (b) {
-      old_moves.push_back(make_move(s, pop_lsb(&b)));
-      new_moves.push_back(old_moves.back());
-    }
-  }
+    warmup();
 
-  // Pawn promotions
-  for (Color c = WHITE; c <= BLACK; ++c) {
-    for (int c_from = 0; c_from < 8; ++c_from) {
-      for (int c_to = c_from - 1; c_to <= c_from + 1; ++c_to) {
-        if (c_to < 0 || c_to >= 8) {
-          continue;
-        }
-        Square from = make_square(File(c_from), c == WHITE? RANK_7 : RANK_2);
-        Square to = make_square(File(c_to), c == WHITE ? RANK_8 : RANK_1);
-        // push both black and white promotions for old
-        old_moves.push_back(make<PROMOTION>(from, to, QUEEN));
-        old_moves.push_back(make<PROMOTION>(from, to, ROOK));
-        old_moves.push_back(make<PROMOTION>(from, to, BISHOP));
-        // Don't need knight, as it's equivalent to pawn push to final rank.
-        if (c == WHITE) {
-          // only push white promotions (7th to 8th rank) for new
-          new_moves.push_back(make<PROMOTION>(from, to, QUEEN));
-          new_moves.push_back(make<PROMOTION>(from, to, ROOK));
-          new_moves.push_back(make<PROMOTION>(from, to, BISHOP));
-        }
-      }
+    if (!cfg_cache_file.empty()
+        && !NNDiskCache::get_NNDiskCache().open(cfg_cache_file,
+                                               cfg_cache_file_mb,
+                                               cfg_weightsfile)) {
+        myprintf("Could not map NN cache file %s, not using it.\n",
+                 cfg_cache_file.c_str());
     }
-  }
+}
 
-  for (size_t i = 0; i < old_moves.size(); ++i) {
-    old_move_lookup[old_moves[i]] = i;
-  }
-  for (size_t i = 0; i < new_moves.size(); ++i) {
-    new_move_lookup[new_moves[i]] = i;
-  }
+void Network::warmup() {
+    const auto start = std::chrono::steady_clock::now();
+    auto batch_sizes = std::vector<int>{1};
+    if (cfg_batch_size > 1) {
+        batch_sizes.push_back(cfg_batch_size);
+    }
+    for (auto batch_size : batch_sizes) {
+        // Empty boards are as good as any for this.
+        std::vector<NNPlanes> input(batch_size);
+        std::vector<float> output_pol(batch_size * get_num_output_policy());
+        std::vector<float> output_val(batch_size * NUM_VALUE_CHANNELS);
+        forward(input, output_pol, output_val, batch_size);
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    myprintf("Warmed up the network in %lld ms.\n",
+             static_cast<long long>(std::chrono::duration_cast<
+                 std::chrono::milliseconds>(elapsed).count()));
 }
 
 int Network::lookup(Move move, Color c) {
-    if (type_of(move) != PROMOTION || promotion_type(move) == KNIGHT) {
-        // Mask off the special move flags,
-        // in particular en passant and castling
-        move = Move(move & 0xfff);
-    }
+    // Castling and en passant use the entry of the king or pawn move.
+    auto index = type_of(move) == PROMOTION ? move & 0x3fff : move & 0xfff;
+    int result;
     if (m_format_version == 1) {
-        return old_move_lookup.at(move);
+        result = OLD_MOVE_INDEX.index[index];
     } else {
-        if (c == WHITE) {
-            return new_move_lookup.at(move);
-        } else {
-            Move flipped_move;
-            if (type_of(move) == PROMOTION) {
-                flipped_move = make<PROMOTION>(~from_sq(move), ~to_sq(move), promotion_type(move));
-            } else {
-                flipped_move = make_move(~from_sq(move), ~to_sq(move));
-            }
-            // The NN plays BLACK with the board flipped vertically,
-            // And outputs the moves as if BLACK is moving up.
-            // Flip the policy so the moves are normal.
-            return new_move_lookup.at(flipped_move);
+        // The NN plays BLACK with the board flipped vertically,
+        // And outputs the moves as if BLACK is moving up.
+        // Flip both squares so the moves are normal.
+        if (c == BLACK) {
+            index ^= move_index(SQ_A8, SQ_A8, 0);
         }
+        result = NEW_MOVE_INDEX.index[index];
     }
+    if (result < 0) {
+        throw std::out_of_range("Move has no policy output.");
+    }
+    return result;
 }
 
 #ifdef USE_BLAS
+// With the planes of a batch stored channel by channel (CNHW), the tiles
+// of all positions are contiguous for every channel, and the transforms can
+// treat the batch as batch_size times as many planes.
 void Network::winograd_transform_in(const std::vector<float>& in,
                                     std::vector<float>& V,
-                                    const int C) {
-    constexpr auto W = 8;
-    constexpr auto H = 8;
-    constexpr auto wtiles = (W + 1) / 2;
-    constexpr auto P = wtiles * wtiles;
-
-    for (auto ch = 0; ch < C; ch++) {
-        for (auto block_y = 0; block_y < wtiles; block_y++) {
-            for (auto block_x = 0; block_x < wtiles; block_x++) {
-
-                // Tiles overlap by 2
-                const auto yin = 2 * block_y - 1;
-                const auto xin = 2 * block_x - 1;
-
-                // Cache input tile and handle zero padding
-                using WinogradTile =
-                    std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
-                WinogradTile x;
-
-                for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
-                    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
-                        if ((yin + i) >= 0 && (xin + j) >= 0
-                            && (yin + i) < H && (xin + j) < W) {
-                            x[i][j] = in[ch*(W*H) + (yin+i)*W + (xin+j)];
-                        } else {
-                            x[i][j] = 0.0f;
-                        }
-                    }
-                }
-
-                const auto offset = ch*P + block_y*wtiles + block_x;
-
-                // Calculates transpose(B).x.B
-                // B = [[ 1.0,  0.0,  0.0,  0.0],
-                //      [ 0.0,  1.0, -1.0,  1.0],
-                //      [-1.0,  1.0,  1.0,  0.0],
-                //      [ 0.0,  0.0,  0.0, -1.0]]
-
-                WinogradTile T1, T2;
-
-                T1[0][0] = x[0][0] - x[2][0];
-                T1[0][1] = x[0][1] - x[2][1];
-                T1[0][2] = x[0][2] - x[2][2];
-                T1[0][3] = x[0][3] - x[2][3];
-                T1[1][0] = x[1][0] + x[2][0];
-                T1[1][1] = x[1][1] + x[2][1];
-                T1[1][2] = x[1][2] + x[2][2];
-                T1[1][3] = x[1][3] + x[2][3];
-                T1[2][0] = x[2][0] - x[1][0];
-                T1[2][1] = x[2][1] - x[1][1];
-                T1[2][2] = x[2][2] - x[1][2];
-                T1[2][3] = x[2][3] - x[1][3];
-                T1[3][0] = x[1][0] - x[3][0];
-                T1[3][1] = x[1][1] - x[3][1];
-                T1[3][2] = x[1][2] - x[3][2];
-                T1[3][3] = x[1][3] - x[3][3];
-
-                T2[0][0] = T1[0][0] - T1[0][2];
-                T2[0][1] = T1[0][1] + T1[0][2];
-                T2[0][2] = T1[0][2] - T1[0][1];
-                T2[0][3] = T1[0][1] - T1[0][3];
-                T2[1][0] = T1[1][0] - T1[1][2];
-                T2[1][1] = T1[1][1] + T1[1][2];
-                T2[1][2] = T1[1][2] - T1[1][1];
-                T2[1][3] = T1[1][1] - T1[1][3];
-                T2[2][0] = T1[2][0] - T1[2][2];
-                T2[2][1] = T1[2][1] + T1[2][2];
-                T2[2][2] = T1[2][2] - T1[2][1];
-                T2[2][3] = T1[2][1] - T1[2][3];
-                T2[3][0] = T1[3][0] - T1[3][2];
-                T2[3][1] = T1[3][1] + T1[3][2];
-                T2[3][2] = T1[3][2] - T1[3][1];
-                T2[3][3] = T1[3][1] - T1[3][3];
-
-                for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
-                    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
-                        V[(i*WINOGRAD_ALPHA + j)*C*P + offset] = T2[i][j];
-                    }
-                }
-            }
-        }
+                                    const int C, const int batch_size) {
+    if (winograd4) {
+        CPUKernels::winograd4_transform_in(in.data(), V.data(), C * batch_size);
+    } else {
+        CPUKernels::winograd_transform_in(in.data(), V.data(), C * batch_size);
     }
 }
 
 void Network::winograd_sgemm(const std::vector<float>& U,
                              std::vector<float>& V,
                              std::vector<float>& M,
-                             const int C, const int K) {
-    constexpr auto P = 8 * 8 / WINOGRAD_ALPHA;
+                             const int C, const int K,
+                             const int batch_size) {
+    // One GEMM per tile element, over the tiles of all positions.
+    const auto tile_len = winograd4 ? WINOGRAD4_TILE : WINOGRAD_TILE;
+    const auto P = batch_size * (winograd4 ? 2 * 2 : 4 * 4);
 
-    for (auto b = 0; b < WINOGRAD_TILE; b++) {
+    for (auto b = 0; b < tile_len; b++) {
         auto offset_u = b * K * C;
         auto offset_v = b * C * P;
         auto offset_m = b * K * P;
@@ -693,66 +900,11 @@ void Network::winograd_sgemm(const std::vector<float>& U,
 
 void Network::winograd_transform_out(const std::vector<float>& M,
                                      std::vector<float>& Y,
-                                     const int K) {
-    constexpr auto W = 8;
-    constexpr auto H = 8;
-    constexpr auto wtiles = (W + 1) / 2;
-    constexpr auto P = wtiles * wtiles;
-
-    for (auto k = 0; k < K; k++) {
-        for (auto block_x = 0; block_x < wtiles; block_x++) {
-            for (auto block_y = 0; block_y < wtiles; block_y++) {
-
-                const auto x = 2 * block_x;
-                const auto y = 2 * block_y;
-
-                const auto b = block_y * wtiles + block_x;
-                std::array<float, WINOGRAD_TILE> temp_m;
-                for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
-                    for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
-                        temp_m[xi*WINOGRAD_ALPHA + nu] =
-                            M[xi*(WINOGRAD_ALPHA*K*P) + nu*(K*P)+ k*P + b];
-                    }
-                }
-
-                // Calculates transpose(A).temp_m.A
-                //    A = [1.0,  0.0],
-                //        [1.0,  1.0],
-                //        [1.0, -1.0],
-                //        [0.0, -1.0]]
-
-                auto o11 =
-                    temp_m[0*4 + 0] + temp_m[0*4 + 1] + temp_m[0*4 + 2] +
-                    temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] +
-                    temp_m[2*4 + 0] + temp_m[2*4 + 1] + temp_m[2*4 + 2];
-
-                auto o12 =
-                    temp_m[0*4 + 1] - temp_m[0*4 + 2] - temp_m[0*4 + 3] +
-                    temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] +
-                    temp_m[2*4 + 1] - temp_m[2*4 + 2] - temp_m[2*4 + 3];
-
-                auto o21 =
-                    temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] -
-                    temp_m[2*4 + 0] - temp_m[2*4 + 1] - temp_m[2*4 + 2] -
-                    temp_m[3*4 + 0] - temp_m[3*4 + 1] - temp_m[3*4 + 2];
-
-                auto o22 =
-                    temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] -
-                    temp_m[2*4 + 1] + temp_m[2*4 + 2] + temp_m[2*4 + 3] -
-                    temp_m[3*4 + 1] + temp_m[3*4 + 2] + temp_m[3*4 + 3];
-
-                Y[k*(H*W) + (y)*W + (x)] = o11;
-                if (x + 1 < W) {
-                    Y[k*(H*W) + (y)*W + (x+1)] = o12;
-                }
-                if (y + 1 < H) {
-                    Y[k*(H*W) + (y+1)*W + (x)] = o21;
-                    if (x + 1 < W) {
-                        Y[k*(H*W) + (y+1)*W + (x+1)] = o22;
-                    }
-                }
-            }
-        }
+                                     const int K, const int batch_size) {
+    if (winograd4) {
+        CPUKernels::winograd4_transform_out(M.data(), Y.data(), K * batch_size);
+    } else {
+        CPUKernels::winograd_transform_out(M.data(), Y.data(), K * batch_size);
     }
 }
 
@@ -761,14 +913,58 @@ void Network::winograd_convolve3(const int outputs,
                                  const std::vector<float>& U,
                                  std::vector<float>& V,
                                  std::vector<float>& M,
-                                 std::vector<float>& output) {
+                                 std::vector<float>& output,
+                                 const int batch_size) {
 
-    constexpr unsigned int filter_len = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
+    const auto filter_len = winograd4 ? WINOGRAD4_TILE : WINOGRAD_TILE;
     const auto input_channels = U.size() / (outputs * filter_len);
 
-    winograd_transform_in(input, V, input_channels);
-    winograd_sgemm(U, V, M, input_channels, outputs);
-    winograd_transform_out(M, output, outputs);
+    winograd_transform_in(input, V, input_channels, batch_size);
+    winograd_sgemm(U, V, M, input_channels, outputs, batch_size);
+    winograd_transform_out(M, output, outputs, batch_size);
+}
+
+static void int8_convolve3(const Int8Convolution& conv,
+                           const size_t outputs,
+                           const std::vector<float>& input,
+                           std::vector<float>& output,
+                           const int batch_size) {
+    constexpr auto width = 8;
+    constexpr auto height = 8;
+    constexpr auto padded_width = width + 2;
+    constexpr auto padded_size = padded_width * (height + 2);
+    const auto batch_squares = size_t(batch_size * width * height);
+    const auto channels = input.size() / batch_squares;
+    const auto groups = ceilMultiple(channels, 4) / 4;
+
+    // Into the layout of im2col_int8. The tower inputs come out of a ReLU,
+    // so they are never negative.
+    const auto inv_scale = 1.0f / conv.input_scale;
+    auto quantized = std::vector<uint8_t>(groups * batch_size * padded_size * 4);
+    for (auto g = size_t{0}; g < groups; g++) {
+        const auto group_channels = std::min(size_t{4}, channels - g * 4);
+        for (auto b = 0; b < batch_size; b++) {
+            const auto plane = &input[(g * 4 * batch_size + b) * width * height];
+            const auto padded = &quantized[((g * batch_size + b) * padded_size
+                                            + padded_width + 1) * 4];
+            for (auto y = 0; y < height; y++) {
+                for (auto x = 0; x < width; x++) {
+                    for (auto c = size_t{0}; c < group_channels; c++) {
+                        const auto val = plane[c * batch_squares + y * width + x];
+                        padded[(y * padded_width + x) * 4 + c] =
+                            static_cast<uint8_t>(std::min(val * inv_scale + 0.5f,
+                                                          255.0f));
+                    }
+                }
+            }
+        }
+    }
+    const auto rows = conv.weights.size() / outputs;
+    auto columns = std::vector<uint8_t>(rows * batch_squares);
+    im2col_int8<3>(groups, batch_size, quantized, columns);
+    CPUKernels::int8_gemm(outputs, batch_squares, rows / 4,
+                          conv.weights.data(), columns.data(),
+                          conv.output_scales.data(), output.data());
 }
 
 template<unsigned int filter_size>
@@ -776,18 +972,26 @@ void convolve(size_t outputs,
               const std::vector<net_t>& input,
               const std::vector<float>& weights,
               const std::vector<float>& biases,
-              std::vector<float>& output) {
+              std::vector<float>& output,
+              const int batch_size = 1) {
     // fixed for 8x8
     constexpr unsigned int width = 8;
     constexpr unsigned int height = 8;
-    constexpr unsigned int board_squares = width * height;
+    const auto board_squares = width * height * batch_size;
     constexpr unsigned int filter_len = filter_size * filter_size;
     const auto input_channels = weights.size() / (biases.size() * filter_len);
     const auto filter_dim = filter_len * input_channels;
     assert(outputs * board_squares == output.size());
 
-    std::vector<float> col(filter_dim * width * height);
-    im2col<filter_size>(input_channels, input, col);
+    // A 1x1 filter needs no im2col, and then the squares of all positions
+    // of a CNHW batch can go through a single GEMM.
+    assert(filter_size == 1 || batch_size == 1);
+    std::vector<float> col;
+    if (filter_size != 1) {
+        col.resize(filter_dim * width * height);
+        im2col<filter_size>(input_channels, input, col);
+    }
+    const auto& in = filter_size == 1 ? input : col;
 
     // Weight shape (output, input, filter_size, filter_size)
     // 96 22 3 3
@@ -805,13 +1009,37 @@ void convolve(size_t outputs,
                 // M        N            K
                 outputs, board_squares, filter_dim,
                 1.0f, &weights[0], filter_dim,
-                &col[0], board_squares,
+                &in[0], board_squares,
                 0.0f, &output[0], board_squares);
 
-    for (unsigned int o = 0; o < outputs; o++) {
-        for (unsigned int b = 0; b < board_squares; b++) {
-            output[(o * board_squares) + b] =
-                biases[o] + output[(o * board_squares) + b];
+    CPUKernels::bias_relu(outputs, board_squares, output.data(), biases.data());
+}
+
+// output[ROWS][outputs] = input[ROWS][inputs] x transpose(weights). Every
+// row of the weights is read once for all the input rows, and the trip
+// counts are known at compile time so that the loops vectorize.
+template<unsigned int inputs, unsigned int outputs, int ROWS>
+void innerproduct_rows(const float* input, const float* weights,
+                       float* output) {
+    constexpr auto lanes = 16;
+    static_assert(inputs % lanes == 0, "inputs must fill the lanes");
+
+    for (auto o = 0u; o < outputs; o++) {
+        const auto w = weights + o * inputs;
+        float acc[ROWS][lanes] = {};
+        for (auto i = 0u; i < inputs; i += lanes) {
+            for (auto r = 0; r < ROWS; r++) {
+                for (auto l = 0; l < lanes; l++) {
+                    acc[r][l] += w[i + l] * input[r * inputs + i + l];
+                }
+            }
+        }
+        for (auto r = 0; r < ROWS; r++) {
+            auto sum = 0.0f;
+            for (auto l = 0; l < lanes; l++) {
+                sum += acc[r][l];
+            }
+            output[r * outputs + o] = sum;
         }
     }
 }
@@ -822,67 +1050,91 @@ template<unsigned int inputs,
 void innerproduct(const std::vector<float>& input,
                   const std::array<float, W>& weights,
                   const std::array<float, B>& biases,
-                  std::vector<float>& output) {
+                  std::vector<float>& output,
+                  const int batch_size = 1) {
     assert(B == outputs);
-
-    cblas_sgemv(CblasRowMajor, CblasNoTrans,
-                // M     K
-                outputs, inputs,
-                1.0f, &weights[0], inputs,
-                &input[0], 1,
-                0.0f, &output[0], 1);
-
-    auto lambda_ReLU = [](float val) { return (val > 0.0f) ?
-                                       val : 0.0f; };
-
-    for (unsigned int o = 0; o < outputs; o++) {
-        float val = biases[o] + output[o];
-        if (outputs == Network::NUM_VALUE_CHANNELS) {
-            val = lambda_ReLU(val);
+    // Below this BLAS reads all the weights again for every position, which
+    // is most of the time of the forward pass for small batches.
+    constexpr auto small_batch = 8;
+
+    if (batch_size == 1) {
+        cblas_sgemv(CblasRowMajor, CblasNoTrans,
+                    // M     K
+                    outputs, inputs,
+                    1.0f, &weights[0], inputs,
+                    &input[0], 1,
+                    0.0f, &output[0], 1);
+    } else if (batch_size < small_batch) {
+        auto b = 0;
+        for (; b + 4 <= batch_size; b += 4) {
+            innerproduct_rows<inputs, outputs, 4>(&input[b * inputs],
+                                                  &weights[0],
+                                                  &output[b * outputs]);
         }
-        output[o] = val;
+        const auto in = &input[b * inputs];
+        const auto out = &output[b * outputs];
+        switch (batch_size - b) {
+        case 3:
+            innerproduct_rows<inputs, outputs, 3>(in, &weights[0], out);
+            break;
+        case 2:
+            innerproduct_rows<inputs, outputs, 2>(in, &weights[0], out);
+            break;
+        case 1:
+            innerproduct_rows<inputs, outputs, 1>(in, &weights[0], out);
+            break;
+        }
+    } else {
+        // output[batch, outputs] = input[batch, inputs] x transpose(weights)
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                    batch_size, outputs, inputs,
+                    1.0f, &input[0], inputs,
+                    &weights[0], inputs,
+                    0.0f, &output[0], outputs);
+    }
+
+    for (auto b = 0; b < batch_size; b++) {
+        CPUKernels::add_bias(outputs, &output[b * outputs], &biases[0],
+                             outputs == Network::NUM_VALUE_CHANNELS);
     }
 }
 
-template <size_t spatial_size>
-void batchnorm(size_t channels,
+void bias_relu(size_t channels,
+               size_t spatial_size,
                std::vector<float>& data,
-               const float* means,
-               const float* stddivs,
+               const std::vector<float>& biases,
                const float* eltwise = nullptr)
 {
-    auto lambda_ReLU = [](float val) { return (val > 0.0f) ?
-                                       val : 0.0f; };
-
-    for (auto c = size_t{0}; c < channels; ++c) {
-        auto mean = means[c];
-        auto scale_stddiv = stddivs[c];
-
-        if (eltwise == nullptr) {
-            // Classical BN
-            auto arr = &data[c * spatial_size];
-            for (auto b = size_t{0}; b < spatial_size; b++) {
-                arr[b] = lambda_ReLU(scale_stddiv * (arr[b] - mean));
-            }
-        } else {
-            // BN + residual add
-            auto arr = &data[c * spatial_size];
-            auto res = &eltwise[c * spatial_size];
-            for (auto b = size_t{0}; b < spatial_size; b++) {
-                arr[b] = lambda_ReLU(res[b] +
-                                     (scale_stddiv * (arr[b] - mean)));
-            }
+    CPUKernels::bias_relu(channels, spatial_size, data.data(),
+                          biases.data(), eltwise);
+}
+
+// Reorders [rows][cols] planes of 8x8 into [cols][rows], e.g. to go
+// between one position after the other (NCHW) and CNHW.
+static void transpose_planes(const std::vector<float>& in,
+                             std::vector<float>& out,
+                             const size_t rows, const size_t cols) {
+    constexpr auto plane = size_t{8 * 8};
+    for (auto r = size_t{0}; r < rows; r++) {
+        for (auto c = size_t{0}; c < cols; c++) {
+            auto src = begin(in) + (r * cols + c) * plane;
+            std::copy(src, src + plane, begin(out) + (c * rows + r) * plane);
         }
     }
 }
 
-void Network::forward_cpu(std::vector<float>& input,
+void Network::forward_cpu(const std::vector<NNPlanes>& input,
                           std::vector<float>& output_pol,
-                          std::vector<float>& output_val) {
+                          std::vector<float>& output_val,
+                          const int batch_size,
+                          std::vector<float>* tower_input_max) {
     // Input convolution
     constexpr int width = 8;
     constexpr int height = 8;
     constexpr int tiles = width * height / 4;
+    // The tower works on all positions at once, with the planes stored
+    // channel by channel (CNHW) so that every layer is one GEMM.
+    const auto batch_squares = size_t(batch_size * width * height);
     // Calculate output channels
     const auto output_channels = conv_biases[0].size();
     //input_channels is the maximum number of input channels of any convolution.
@@ -891,53 +1143,78 @@ void Network::forward_cpu(std::vector<float>& input,
     const auto input_channels = std::max(
             static_cast<size_t>(output_channels),
             static_cast<size_t>(get_input_channels()));
-    auto conv_out = std::vector<float>(output_channels * width * height);
+    auto conv_out = std::vector<float>(output_channels * batch_squares);
 
-    auto V = std::vector<float>(WINOGRAD_TILE * input_channels * tiles);
-    auto M = std::vector<float>(WINOGRAD_TILE * output_channels * tiles);
+    // Sized for F(2x2, 3x3), F(4x4, 3x3) needs less.
+    auto V = std::vector<float>(WINOGRAD_TILE * input_channels * tiles * batch_size);
+    auto M = std::vector<float>(WINOGRAD_TILE * output_channels * tiles * batch_size);
 
-    std::vector<float> policy_data(Network::NUM_POLICY_INPUT_PLANES * width * height);
-    std::vector<float> value_data(Network::NUM_VALUE_INPUT_PLANES * width * height);
+    std::vector<float> policy_data(Network::NUM_POLICY_INPUT_PLANES * batch_squares);
+    std::vector<float> value_data(Network::NUM_VALUE_INPUT_PLANES * batch_squares);
 
-    winograd_convolve3(output_channels, input, conv_weights[0], V, M, conv_out);
-    batchnorm<64>(output_channels, conv_out,
-                  batchnorm_means[0].data(),
-                  batchnorm_stddivs[0].data());
+    auto conv_input = std::vector<float>(get_input_channels() * batch_squares);
+    for (auto b = 0; b < batch_size; b++) {
+        expand_planes(input[b], conv_input.data() + b * width * height,
+                      batch_squares);
+    }
+
+    winograd_convolve3(output_channels, conv_input, conv_weights[0], V, M, conv_out,
+                       batch_size);
+    bias_relu(output_channels, batch_squares, conv_out, conv_biases[0]);
 
     // Residual tower
-    auto conv_in = std::vector<float>(output_channels * width * height);
-    auto res = std::vector<float>(output_channels * width * height);
+    auto conv_in = std::vector<float>(output_channels * batch_squares);
+    auto res = std::vector<float>(output_channels * batch_squares);
+    // Calibration needs the fp32 activations.
+    const auto use_int8 = !int8_convs.empty() && !tower_input_max;
+    auto convolve3 = [&](const size_t index, const size_t outputs) {
+        if (tower_input_max) {
+            auto& input_max = (*tower_input_max)[index];
+            input_max = std::max(input_max,
+                                 *std::max_element(begin(conv_in), end(conv_in)));
+        }
+        if (use_int8) {
+            int8_convolve3(int8_convs[index], outputs, conv_in, conv_out,
+                           batch_size);
+        } else {
+            winograd_convolve3(outputs, conv_in, conv_weights[index],
+                               V, M, conv_out, batch_size);
+        }
+    };
     for (auto i = size_t{1}; i < conv_weights.size(); i += 2) {
         auto output_channels = conv_biases[i].size();
         std::swap(conv_out, conv_in);
         std::copy(begin(conv_in), end(conv_in), begin(res));
-        winograd_convolve3(output_channels, conv_in,
-                           conv_weights[i], V, M, conv_out);
-        batchnorm<64>(output_channels, conv_out,
-                      batchnorm_means[i].data(),
-                      batchnorm_stddivs[i].data());
+        convolve3(i, output_channels);
+        bias_relu(output_channels, batch_squares, conv_out, conv_biases[i]);
 
         output_channels = conv_biases[i + 1].size();
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           conv_weights[i + 1], V, M, conv_out);
-        batchnorm<64>(output_channels, conv_out,
-                      batchnorm_means[i + 1].data(),
-                      batchnorm_stddivs[i + 1].data(),
-                      res.data());
+        convolve3(i + 1, output_channels);
+        bias_relu(output_channels, batch_squares, conv_out, conv_biases[i + 1],
+                  res.data());
+    }
+    convolve<1>(NUM_POLICY_INPUT_PLANES, conv_out, conv_pol_w, conv_pol_b, policy_data,
+                batch_size);
+    convolve<1>(NUM_VALUE_INPUT_PLANES, conv_out, conv_val_w, conv_val_b, value_data,
+                batch_size);
+
+    // The fully connected layers want the planes of a position together.
+    if (batch_size > 1) {
+        auto heads = std::vector<float>(policy_data.size());
+        transpose_planes(policy_data, heads, NUM_POLICY_INPUT_PLANES, batch_size);
+        std::swap(policy_data, heads);
+        heads.resize(value_data.size());
+        transpose_planes(value_data, heads, NUM_VALUE_INPUT_PLANES, batch_size);
+        std::swap(value_data, heads);
     }
-    convolve<1>(NUM_POLICY_INPUT_PLANES, conv_out, conv_pol_w, conv_pol_b, policy_data);
-    convolve<1>(NUM_VALUE_INPUT_PLANES, conv_out, conv_val_w, conv_val_b, value_data);
-    batchnorm<width*height>(NUM_POLICY_INPUT_PLANES, policy_data, bn_pol_w1.data(), bn_pol_w2.data());
-
-    batchnorm<width*height>(NUM_VALUE_INPUT_PLANES, value_data, bn_val_w1.data(), bn_val_w2.data());
 
     if (m_format_version == 1) {
-        innerproduct<NUM_POLICY_INPUT_PLANES*width*height, V1_NUM_OUTPUT_POLICY>(policy_data, v1_ip_pol_w, v1_ip_pol_b, output_pol);
+        innerproduct<NUM_POLICY_INPUT_PLANES*width*height, V1_NUM_OUTPUT_POLICY>(policy_data, v1_ip_pol_w, v1_ip_pol_b, output_pol, batch_size);
     } else {
-        innerproduct<NUM_POLICY_INPUT_PLANES*width*height, V2_NUM_OUTPUT_POLICY>(policy_data, v2_ip_pol_w, v2_ip_pol_b, output_pol);
+        innerproduct<NUM_POLICY_INPUT_PLANES*width*height, V2_NUM_OUTPUT_POLICY>(policy_data, v2_ip_pol_w, v2_ip_pol_b, output_pol, batch_size);
     }
-    innerproduct<NUM_VALUE_INPUT_PLANES*width*height, NUM_VALUE_CHANNELS>(value_data, ip1_val_w, ip1_val_b, output_val);
+    innerproduct<NUM_VALUE_INPUT_PLANES*width*height, NUM_VALUE_CHANNELS>(value_data, ip1_val_w, ip1_val_b, output_val, batch_size);
 }
 
 template<typename T>
@@ -990,7 +1267,7 @@ bool compare_net_outputs(std::vector<float>& data,
                 info.c_str(), idx, data[idx], ref[idx], err);
         } else if (err > relative_error) {
             almost_equal = false;
-            myprintf("Error in OpenCL calculation: expected %f got %f (%lli"
+            myprintf("Error in net calculation: expected %f got %f (%lli"
                        "(error=%f%%)\n", ref[idx], data[idx], num_expansions.load(), err * 100.0);
             if (num_expansions < min_correct_expansions) {
                 fatal = true;
@@ -1002,6 +1279,311 @@ bool compare_net_outputs(std::vector<float>& data,
     }
     return almost_equal;
 }
+
+#ifdef USE_OPENCL_SELFCHECK
+namespace {
+
+// Sampled OpenCL evaluations waiting to be checked on the CPU. A single low
+// priority thread does the checks, so the search only pays for the copies.
+class SelfCheckQueue {
+public:
+    struct Sample {
+        std::vector<Network::NNPlanes> input;
+        std::vector<float> policy;
+        std::vector<float> value;
+        std::string pgn;
+    };
+    using Check = void (*)(const std::vector<Network::NNPlanes>&,
+                           std::vector<float>&,
+                           std::vector<float>&, const std::string&);
+
+    explicit SelfCheckQueue(Check check) : m_check(check) {}
+
+    ~SelfCheckQueue() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+        m_cv.notify_one();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    // Samples are dropped while the CPU is behind, there's no point in
+    // letting them pile up.
+    void push(Sample&& sample) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_error || m_samples.size() >= MAX_PENDING) {
+                return;
+            }
+            if (!m_thread.joinable()) {
+                m_thread = std::thread(&SelfCheckQueue::worker, this);
+            }
+            m_samples.emplace_back(std::move(sample));
+        }
+        m_cv.notify_one();
+    }
+
+    // Throws on the calling thread what the last failed check threw.
+    void rethrow_error() {
+        if (!m_failed.load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::rethrow_exception(m_error);
+    }
+
+private:
+    static constexpr size_t MAX_PENDING = 16;
+
+    void worker() {
+        Utils::lower_thread_priority();
+        while (true) {
+            Sample sample;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_exit || !m_samples.empty(); });
+                if (m_exit) {
+                    return;
+                }
+                sample = std::move(m_samples.front());
+                m_samples.pop_front();
+            }
+            try {
+                m_check(sample.input, sample.policy, sample.value, sample.pgn);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_error = std::current_exception();
+                m_samples.clear();
+                m_failed = true;
+                return;
+            }
+        }
+    }
+
+    const Check m_check;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Sample> m_samples;
+    std::exception_ptr m_error;
+    std::atomic<bool> m_failed{false};
+    bool m_exit{false};
+    std::thread m_thread;
+};
+
+}
+
+void Network::self_check(const std::vector<NNPlanes>& input,
+                         std::vector<float>& policy_data,
+                         std::vector<float>& value_data,
+                         const std::string& pgn) {
+    auto cpu_policy_data = std::vector<float>(policy_data.size());
+    auto cpu_value_data = std::vector<float>(value_data.size());
+    auto fatal = false;
+    forward_cpu(input, cpu_policy_data, cpu_value_data);
+    auto almost_equal = compare_net_outputs(policy_data, cpu_policy_data, fatal);
+    almost_equal &= compare_net_outputs(value_data, cpu_value_data, fatal);
+    if (!almost_equal) {
+        myprintf("PGN\n%s\nEND\n", pgn.c_str());
+        // Compare again but with debug info
+        compare_net_outputs(policy_data, cpu_policy_data, fatal, true, "orig policy");
+        compare_net_outputs(value_data, cpu_value_data, fatal, true, "orig value");
+        // Call opencl.forward again to see if the error is reproduceable.
+        std::vector<float> value_data_retry(value_data.size());
+        std::vector<float> policy_data_retry(policy_data.size());
+        opencl.forward(input, policy_data_retry, value_data_retry);
+        auto almost_equal_retry = compare_net_outputs(policy_data_retry, policy_data, fatal, true, "retry policy");
+        almost_equal_retry &= compare_net_outputs(value_data_retry, value_data, fatal, true, "retry value");
+        if (!almost_equal_retry) {
+            throw std::runtime_error("OpenCL retry self-check mismatch.");
+        } else {
+            myprintf("compare_net_outputs retry was ok\n");
+        }
+        if (fatal) {
+            myprintf_so("Update your GPU drivers or reduce the amount of games "
+                       "played simultaneously.\n");
+            throw std::runtime_error("OpenCL self-check mismatch.");
+        }
+    }
+}
+#endif
+
+void Network::select_winograd(const std::vector<float>& weights,
+                              const size_t channels) {
+    constexpr auto width = 8;
+    constexpr auto height = 8;
+    constexpr auto tiles = width * height / 4;
+    const auto batch_size = std::max(cfg_batch_size, 1);
+    const auto batch_squares = size_t(batch_size * width * height);
+
+    // Tower inputs come out of a ReLU.
+    auto rng = Random{42};
+    auto input = std::vector<float>(channels * batch_squares);
+    for (auto& x : input) {
+        x = rng.RandFlt(1.0f);
+    }
+    auto biases = std::vector<float>(channels);
+    auto V = std::vector<float>(WINOGRAD_TILE * channels * tiles * batch_size);
+    auto M = std::vector<float>(WINOGRAD_TILE * channels * tiles * batch_size);
+    auto output = std::vector<float>(channels * batch_squares);
+
+    // The first position against the reference convolution.
+    auto first = std::vector<float>(begin(input),
+                                    begin(input) + channels * width * height);
+    auto ref = std::vector<float>(channels * width * height);
+    convolve<3>(channels, first, weights, biases, ref);
+    auto scale = 0.0f;
+    for (auto x : ref) {
+        scale = std::max(scale, std::fabs(x));
+    }
+
+    // The largest error relative to the largest output, and how long a
+    // convolution of a batch takes in microseconds.
+    auto measure = [&](const bool use_winograd4) {
+        winograd4 = use_winograd4;
+        const auto U = use_winograd4
+            ? winograd4_transform_f(weights, channels, channels)
+            : winograd_transform_f(weights, channels, channels);
+        auto Y = std::vector<float>(ref.size());
+        winograd_convolve3(channels, first, U, V, M, Y, 1);
+        bias_relu(channels, width * height, Y, biases);
+        auto error = 0.0f;
+        for (auto i = size_t{0}; i < Y.size(); i++) {
+            error = std::max(error, std::fabs(Y[i] - ref[i]));
+        }
+
+        constexpr auto runs = 20;
+        const auto start = std::chrono::steady_clock::now();
+        for (auto i = 0; i < runs; i++) {
+            winograd_convolve3(channels, input, U, V, M, output, batch_size);
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto micros = std::chrono::duration_cast<
+            std::chrono::microseconds>(elapsed).count() / float(runs);
+        return std::make_pair(error / std::max(scale, 1e-6f), micros);
+    };
+    const auto winograd2_stats = measure(false);
+    const auto winograd4_stats = measure(true);
+    myprintf("Winograd convolution of a batch of %d: F(2x2, 3x3) %.0f us, "
+             "F(4x4, 3x3) %.0f us, largest error %.2g and %.2g.\n",
+             batch_size, winograd2_stats.second, winograd4_stats.second,
+             winograd2_stats.first, winograd4_stats.first);
+
+    if (cfg_winograd != 0) {
+        winograd4 = cfg_winograd == 4;
+    } else {
+        winograd4 = winograd4_stats.second < winograd2_stats.second;
+    }
+    // Its constants are larger, make sure that costs no precision that
+    // matters.
+    constexpr auto max_error = 1e-3f;
+    if (winograd4 && winograd4_stats.first > max_error) {
+        myprintf("F(4x4, 3x3) is too far off the reference convolution.\n");
+        winograd4 = false;
+    }
+    myprintf("Using F(%dx%d, 3x3) winograd convolutions.\n",
+             winograd4 ? 4 : 2, winograd4 ? 4 : 2);
+}
+
+#ifndef USE_OPENCL
+void Network::calibrate_int8() {
+    // Openings, middlegames and endgames, for the range of activations.
+    static const std::array<const char*, 8> fens = {
+        "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+        "r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3",
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+        "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 b - - 0 10",
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        "8/8/1p6/p1p5/P1P2k2/1P3p2/5K2/8 b - - 0 50",
+        "4k3/8/8/8/8/8/4P3/4K3 w - - 5 39"
+    };
+    const auto batch_size = static_cast<int>(fens.size());
+    auto input = std::vector<NNPlanes>{};
+    // The policy outputs the search looks at.
+    auto legal_moves = std::vector<std::vector<int>>{};
+    for (auto fen : fens) {
+        BoardHistory bh;
+        bh.set(fen);
+        input.emplace_back();
+        gather_features(bh, input.back());
+        legal_moves.emplace_back();
+        for (Move move : MoveList<LEGAL>(bh.cur())) {
+            legal_moves.back().emplace_back(lookup(move, bh.cur().side_to_move()));
+        }
+    }
+
+    const auto policy_size = get_num_output_policy();
+    auto policy = std::vector<float>(policy_size * batch_size);
+    auto value = std::vector<float>(NUM_VALUE_CHANNELS * batch_size);
+    auto input_max = std::vector<float>(conv_weights.size());
+    forward_cpu(input, policy, value, batch_size, &input_max);
+    for (auto i = size_t{1}; i < int8_convs.size(); i++) {
+        auto& conv = int8_convs[i];
+        conv.input_scale = input_max[i] > 0.0f ? input_max[i] / 255.0f : 1.0f;
+        conv.output_scales.resize(conv.weight_scales.size());
+        for (auto o = size_t{0}; o < conv.weight_scales.size(); o++) {
+            conv.output_scales[o] = conv.weight_scales[o] * conv.input_scale;
+        }
+    }
+
+    // Compare what the search gets out of both on the same positions.
+    auto int8_policy = std::vector<float>(policy.size());
+    auto int8_value = std::vector<float>(value.size());
+    forward_cpu(input, int8_policy, int8_value, batch_size);
+    auto probabilities = [&](const std::vector<float>& data) {
+        auto result = std::vector<float>{};
+        auto logits = std::vector<float>(policy_size);
+        auto probs = std::vector<float>(policy_size);
+        for (auto b = 0; b < batch_size; b++) {
+            auto first = begin(data) + b * policy_size;
+            std::copy(first, first + policy_size, begin(logits));
+            softmax(logits, probs);
+            for (auto idx : legal_moves[b]) {
+                result.emplace_back(probs[idx]);
+            }
+        }
+        return result;
+    };
+    auto winrates = [&](const std::vector<float>& data) {
+        auto result = std::vector<float>(batch_size);
+        auto hidden = std::vector<float>(NUM_VALUE_CHANNELS);
+        auto out = std::vector<float>(1);
+        for (auto b = 0; b < batch_size; b++) {
+            auto first = begin(data) + b * NUM_VALUE_CHANNELS;
+            std::copy(first, first + NUM_VALUE_CHANNELS, begin(hidden));
+            innerproduct<NUM_VALUE_CHANNELS, 1>(hidden, ip2_val_w, ip2_val_b, out);
+            result[b] = (1.0f + std::tanh(out[0])) / 2.0f;
+        }
+        return result;
+    };
+    auto ref_probs = probabilities(policy);
+    auto ref_winrates = winrates(value);
+    auto probs = probabilities(int8_policy);
+    auto int8_winrates = winrates(int8_value);
+    auto max_difference = [](const std::vector<float>& a,
+                             const std::vector<float>& b) {
+        auto diff = 0.0f;
+        for (auto i = size_t{0}; i < a.size(); i++) {
+            diff = std::max(diff, std::fabs(a[i] - b[i]));
+        }
+        return diff;
+    };
+    myprintf("Int8 residual tower, largest error on %d positions: "
+             "policy %.4f, winrate %.4f.\n", batch_size,
+             max_difference(probs, ref_probs),
+             max_difference(int8_winrates, ref_winrates));
+    auto fatal = false;
+    auto almost_equal = compare_net_outputs(probs, ref_probs, fatal);
+    almost_equal &= compare_net_outputs(int8_winrates, ref_winrates, fatal);
+    if (!almost_equal) {
+        myprintf("Int8 results are more than 10%% off, consider running "
+                 "without --int8.\n");
+    }
+}
+#endif
 #endif
 
 void Network::softmax(const std::vector<float>& input,
@@ -1025,35 +1607,97 @@ void Network::softmax(const std::vector<float>& input,
     }
 }
 
-Network::Netresult Network::get_scored_moves(const BoardHistory& pos, DebugRawData* debug_data, bool skip_cache) {
+void Network::forward(const std::vector<NNPlanes>& input,
+                      std::vector<float>& output_pol,
+                      std::vector<float>& output_val,
+                      const int batch_size) {
+#ifdef USE_OPENCL
+    opencl.forward(input, output_pol, output_val, batch_size);
+#elif defined(USE_BLAS) && !defined(USE_OPENCL)
+    forward_cpu(input, output_pol, output_val, batch_size);
+#endif
+}
+
+Network::Netresult Network::get_scored_moves(const BoardHistory& pos, DebugRawData* debug_data, bool skip_cache,
+                                             const MoveList<LEGAL>* legal_moves) {
     Netresult result;
-    auto full_key = pos.cur().full_key();
-    // Mix in the history to try and ensure no false positive lookups where
-    // the cached values would differ from the NN evals.
     int history_count = pos.positions.size();
-    for (int i = history_count - 2; i >= std::max(0, history_count - T_HISTORY); i--) {
-        full_key *= 31;
-        full_key ^= pos.positions[i].full_key();
-    }
+    auto full_key = pos.history_key();
 
     // See if we already have this in the cache.
     if (!skip_cache) {
         if (NNCache::get_NNCache().lookup(full_key, result)) {
             return result;
         }
+        if (NNDiskCache::get_NNDiskCache().lookup(full_key, result)) {
+            NNCache::get_NNCache().insert(full_key, result);
+            return result;
+        }
     }
 
+    // The parent was most likely evaluated a short while ago, in which
+    // case only the newest board has to be encoded.
     NNPlanes planes;
-    gather_features(pos, planes);
-    result = get_scored_moves_internal(pos, planes, debug_data);
+    {
+        PHASE_TIMER(FEATURES);
+        NNPlanes parent_planes;
+        if (history_count > 1
+            && planes_cache.lookup(pos.history_keys[history_count - 2],
+                                   parent_planes)) {
+            gather_features(pos, planes, &parent_planes);
+        } else {
+            gather_features(pos, planes);
+        }
+        planes_cache.insert(full_key, planes);
+    }
+    result = get_scored_moves_internal(pos, planes, debug_data, legal_moves);
 
     // Insert result into cache.
     NNCache::get_NNCache().insert(full_key, result);
+    NNDiskCache::get_NNDiskCache().insert(full_key, result);
 
     return result;
 }
 
-Network::Netresult Network::get_scored_moves_internal(const BoardHistory& pos, NNPlanes& planes, DebugRawData* debug_data) {
+std::int64_t Network::get_eval_count() {
+    return eval_count;
+}
+
+std::int64_t Network::get_eval_micros() {
+    return eval_micros;
+}
+
+std::vector<net_t> Network::get_input_data(const NNPlanes& planes) {
+    PHASE_TIMER(FEATURES);
+    constexpr int width = 8;
+    constexpr int height = 8;
+    // Data layout is input_data[(c * height + h) * width + w]
+    auto input_data = std::vector<net_t>(get_input_channels() * width * height);
+    expand_planes(planes, input_data.data(), width * height);
+    return input_data;
+}
+
+void Network::expand_planes(const NNPlanes& planes, net_t* out,
+                            size_t plane_stride) {
+    constexpr int boardsize = 8 * 8;
+    const int channels = get_input_channels();
+    for (int c = 0; c < channels - 3; ++c) {
+        for (int i = 0; i < boardsize; ++i) {
+            out[c * plane_stride + i] = net_t(planes.bit[c][i]);
+        }
+    }
+    std::fill_n(out + (channels - 3) * plane_stride, boardsize,
+                net_t(planes.rule50_count));
+    std::fill_n(out + (channels - 2) * plane_stride, boardsize,
+                net_t(planes.move_count));
+    // TODO: I changed this to a plane of ones for V2.
+    // To help see the edge of the board
+    std::fill_n(out + (channels - 1) * plane_stride, boardsize,
+                net_t(m_format_version == 1 ? 0.0 : 1.0));
+}
+
+Network::Netresult Network::get_scored_moves_internal(const BoardHistory& pos, NNPlanes& planes, DebugRawData* debug_data,
+                                                      const MoveList<LEGAL>* legal_moves) {
     // NNPlanes is sized to support either version, so this assert uses
     // MAX_INPUT_CHANNELS. The rest of the code uses get_input_channels()
     // to match the actual number of bits expected by each network.
@@ -1061,69 +1705,33 @@ Network::Netresult Network::get_scored_moves_internal(const BoardHistory& pos, N
     constexpr int width = 8;
     constexpr int height = 8;
     const auto convolve_channels = conv_pol_w.size() / conv_pol_b.size();
-    std::vector<net_t> input_data;
     std::vector<net_t> output_data(convolve_channels * width * height);
     std::vector<float> value_data(Network::NUM_VALUE_INPUT_PLANES * width * height);
     std::vector<float> policy_data(get_num_output_policy());
     std::vector<float> softmax_data(get_num_output_policy());
     std::vector<float> winrate_data(Network::NUM_VALUE_CHANNELS);
     std::vector<float> winrate_out(1);
-    // Data layout is input_data[(c * height + h) * width + w]
-    input_data.reserve(get_input_channels() * width * height);
-    for (int c = 0; c < get_input_channels() - 3; ++c) {
-        for (int i = 0; i < 64; ++i) {
-            input_data.emplace_back(net_t(planes.bit[c][i]));
+    {
+        PHASE_TIMER(NNEVAL);
+        auto start = std::chrono::steady_clock::now();
+        if (cfg_batch_size > 1) {
+            NNBatchQueue::get_NNBatchQueue().forward(pos.history_key(), planes,
+                                                     policy_data, value_data);
+        } else {
+            forward({planes}, policy_data, value_data);
         }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        eval_micros += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        eval_count++;
     }
-    for (int i = 0; i < 64; ++i) {
-        input_data.emplace_back(net_t(planes.rule50_count));
-    }
-    for (int i = 0; i < 64; ++i) {
-        input_data.emplace_back(net_t(planes.move_count));
-    }
-    // TODO: I changed this to a plane of ones for V2.
-    // To help see the edge of the board
-    for (int i = 0; i < 64; ++i) {
-        input_data.emplace_back(net_t(m_format_version == 1 ? 0.0 : 1.0));
-    }
-    assert(input_data.size() == get_input_channels() * width * height);
-#ifdef USE_OPENCL
-    opencl.forward(input_data, policy_data, value_data);
-#elif defined(USE_BLAS) && !defined(USE_OPENCL)
-    forward_cpu(input_data, policy_data, value_data);
-#endif
 #ifdef USE_OPENCL_SELFCHECK
-    // Both implementations are available, self-check the OpenCL driver by
-    // running both with a probability of 1/2000.
+    // Both implementations are available, self-check the OpenCL driver with
+    // a probability of 1/2000. The CPU evaluation runs on a background
+    // thread, a mismatch is reported on a later evaluation.
+    static SelfCheckQueue self_check_queue(&Network::self_check);
+    self_check_queue.rethrow_error();
     if (Random::GetRng().RandInt(SELFCHECK_PROBABILITY) == 0) {
-        auto cpu_policy_data = std::vector<float>(policy_data.size());
-        auto cpu_value_data = std::vector<float>(value_data.size());
-        auto fatal = false;
-        forward_cpu(input_data, cpu_policy_data, cpu_value_data);
-        auto almost_equal = compare_net_outputs(policy_data, cpu_policy_data, fatal);
-        almost_equal &= compare_net_outputs(value_data, cpu_value_data, fatal);
-        if (!almost_equal) {
-            myprintf("PGN\n%s\nEND\n", pos.pgn().c_str());
-            // Compare again but with debug info
-            compare_net_outputs(policy_data, cpu_policy_data, fatal, true, "orig policy");
-            compare_net_outputs(value_data, cpu_value_data, fatal, true, "orig value");
-            // Call opencl.forward again to see if the error is reproduceable.
-            std::vector<float> value_data_retry(Network::NUM_VALUE_INPUT_PLANES * width * height);
-            std::vector<float> policy_data_retry(get_num_output_policy());
-            opencl.forward(input_data, policy_data_retry, value_data_retry);
-            auto almost_equal_retry = compare_net_outputs(policy_data_retry, policy_data, fatal, true, "retry policy");
-            almost_equal_retry &= compare_net_outputs(value_data_retry, value_data, fatal, true, "retry value");
-            if (!almost_equal_retry) {
-                throw std::runtime_error("OpenCL retry self-check mismatch.");
-            } else {
-                myprintf("compare_net_outputs retry was ok\n");
-            }
-            if (fatal) {
-                myprintf_so("Update your GPU drivers or reduce the amount of games "
-                           "played simultaneously.\n");
-                throw std::runtime_error("OpenCL self-check mismatch.");
-            }
-        }
+        self_check_queue.push({{planes}, policy_data, value_data, pos.pgn()});
     }
 #endif
 
@@ -1137,14 +1745,22 @@ Network::Netresult Network::get_scored_moves_internal(const BoardHistory& pos, N
     // Sigmoid
     auto winrate_sig = (1.0f + std::tanh(winrate_out[0])) / 2.0f;
 
-    MoveList<LEGAL> moves(pos.cur());
     std::vector<scored_node> result;
-    for (Move move : moves) {
-        result.emplace_back(outputs[lookup(move, pos.cur().side_to_move())], move);
+    auto map_policy = [&](const MoveList<LEGAL>& moves) {
+        result.reserve(moves.size());
+        for (Move move : moves) {
+            result.emplace_back(outputs[lookup(move, pos.cur().side_to_move())], move);
+        }
+    };
+    if (legal_moves) {
+        map_policy(*legal_moves);
+    } else {
+        PHASE_TIMER(MOVEGEN);
+        map_policy(MoveList<LEGAL>(pos.cur()));
     }
 
     if (debug_data) {
-      debug_data->input = input_data;
+      debug_data->input = get_input_data(planes);
       debug_data->policy_output = outputs;
       debug_data->value_output = winrate_sig;
       debug_data->filtered_output = result;
@@ -1162,7 +1778,39 @@ void addPieces(const Position* pos, Color side, Network::NNPlanes& planes, int p
   }
 }
 
-void Network::gather_features(const BoardHistory& bh, NNPlanes& planes) {
+// The board seen from the other side, the ranks in reverse order.
+static Network::BoardPlane mirror(const Network::BoardPlane& plane) {
+    auto b = uint64_t{plane.to_ullong()};
+    b = ((b >> 8) & 0x00FF00FF00FF00FFULL) | ((b & 0x00FF00FF00FF00FFULL) << 8);
+    b = ((b >> 16) & 0x0000FFFF0000FFFFULL) | ((b & 0x0000FFFF0000FFFFULL) << 16);
+    return Network::BoardPlane((b >> 32) | (b << 32));
+}
+
+void Network::shift_history(const NNPlanes& parent, NNPlanes& planes) {
+    // Every board of the parent is one ply further back for us.
+    // Version 2 encodes the boards from the side to move, which is
+    // the other side now, so their pieces are our pieces and the boards
+    // are mirrored.
+    const int hist_planes = get_hist_planes();
+    for (int i = T_HISTORY - 1; i >= 1; --i) {
+        auto dst = i * hist_planes;
+        auto src = (i - 1) * hist_planes;
+        if (m_format_version == 1) {
+            for (int p = 0; p < hist_planes; ++p) {
+                planes.bit[dst + p] = parent.bit[src + p];
+            }
+        } else {
+            for (int p = 0; p < 6; ++p) {
+                planes.bit[dst + p] = mirror(parent.bit[src + 6 + p]);
+                planes.bit[dst + 6 + p] = mirror(parent.bit[src + p]);
+            }
+            planes.bit[dst + 12] = parent.bit[src + 12];
+        }
+    }
+}
+
+void Network::gather_features(const BoardHistory& bh, NNPlanes& planes,
+                              const NNPlanes* parent) {
     Color us = bh.cur().side_to_move();
     Color them = ~us;
     const Position* pos = &bh.cur();
@@ -1180,8 +1828,13 @@ void Network::gather_features(const BoardHistory& bh, NNPlanes& planes) {
     planes.move_count = 0;
 
     int mc = bh.positions.size() - 1;
+    int history = std::min(T_HISTORY, mc + 1);
+    if (parent) {
+        shift_history(*parent, planes);
+        history = std::min(history, 1);
+    }
     bool flip = us == BLACK;
-    for (int i = 0; i < std::min(T_HISTORY, mc + 1); ++i) {
+    for (int i = 0; i < history; ++i) {
         pos = &bh.positions[mc - i];
 
         if (m_format_version == 1) {
@@ -23,15 +23,16 @@
 #include <vector>
 #include <string>
 #include <bitset>
+#include <cstdint>
 #include <memory>
 #include <array>
-#include <unordered_map>
 
 #ifdef USE_OPENCL
 #include <atomic>
 class UCTNode;
 #endif
 
+#include "Movegen.h"
 #include "Position.h"
 
 class Network {
@@ -93,62 +94,138 @@ public:
       std::string getJson() const;
     };
 
+    // The policy is mapped to legal_moves, the legal moves of state, or if
+    // they aren't given to the ones generated here.
     static Netresult get_scored_moves(const BoardHistory& state,
                                       DebugRawData* debug_data=nullptr,
-                                      bool skip_cache = false);
+                                      bool skip_cache = false,
+                                      const MoveList<LEGAL>* legal_moves = nullptr);
 
     // Winograd filter transformation changes 3x3 filters to 4x4
     static constexpr auto WINOGRAD_ALPHA = 4;
     static constexpr auto WINOGRAD_TILE = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
+    // F(4x4, 3x3) has 6x6 filters.
+    static constexpr auto WINOGRAD4_ALPHA = 6;
+    static constexpr auto WINOGRAD4_TILE = WINOGRAD4_ALPHA * WINOGRAD4_ALPHA;
+    // The F(2x2, 3x3) filters U = G.f.transpose(G) of the 3x3 filters f, as
+    // WINOGRAD_TILE matrices of channels x outputs.
+    static std::vector<float> winograd_transform_f(const std::vector<float>& f,
+        const int outputs, const int channels);
+    // The same for F(4x4, 3x3), WINOGRAD4_TILE matrices.
+    static std::vector<float> winograd4_transform_f(const std::vector<float>& f,
+        const int outputs, const int channels);
+    // Pads the transformed filters U of alpha x alpha tiles with zeroes to
+    // the sizes the OpenCL GEMM works on.
+    static std::vector<float> zeropad_U(const std::vector<float>& U,
+        const int outputs, const int channels,
+        const int outputs_pad, const int channels_pad,
+        const int alpha = WINOGRAD_ALPHA);
 
     static void initialize();
+    // Write the weights of a text, gzipped or binary weights file in the
+    // binary format, which loads without parsing.
+    static bool convert_network_file(std::string filename,
+                                     std::string binary_filename);
+
+    // Evaluates the batch_size positions of input. Policy and value outputs
+    // are returned back to back, get_num_output_policy() and
+    // NUM_VALUE_CHANNELS values per position. The backends expand the
+    // planes themselves, the GPU ones on the device.
+    static void forward(const std::vector<NNPlanes>& input,
+                        std::vector<float>& output_pol,
+                        std::vector<float>& output_val,
+                        int batch_size = 1);
+
+    // Evaluations run so far, and the wall clock time they took in
+    // microseconds, including the wait for the rest of their batch.
+    static std::int64_t get_eval_count();
+    static std::int64_t get_eval_micros();
 
     static int lookup(Move move, Color c);
-    static void gather_features(const BoardHistory& pos, NNPlanes& planes);
+    // Encode the input planes of the current position. With the planes of
+    // the position before it only the newest board is encoded, the older
+    // ones are shifted over.
+    static void gather_features(const BoardHistory& pos, NNPlanes& planes,
+                                const NNPlanes* parent = nullptr);
+    // Fill the older boards of planes with the boards of parent, the
+    // planes of the position before it.
+    static void shift_history(const NNPlanes& parent, NNPlanes& planes);
     static size_t get_format_version();
+    // Encode positions in the format of a network version without loading
+    // one, e.g. for supervised training data. Only before initialize().
+    static void set_format_version(size_t format_version);
     static size_t get_input_channels();
     static size_t get_hist_planes();
     static size_t get_num_output_policy();
 
 private:
     static bool initialized;
-    static std::pair<int, int> load_network(std::istream& wtfile);
+    static std::pair<int, int> load_network(
+        int format_version, std::vector<std::vector<float>>& lines);
     static std::pair<int, int> load_network_file(std::string filename);
     static void process_bn_var(std::vector<float>& weights,
                                const float epsilon=1e-5f);
+    static void fold_batchnorm(std::vector<float>& weights,
+                               std::vector<float>& biases,
+                               const float* means, const float* stddivs);
     static size_t m_format_version;
-    static std::unordered_map<Move, int, std::hash<int>> old_move_lookup;
-    static std::unordered_map<Move, int, std::hash<int>> new_move_lookup;
 
     static void softmax(const std::vector<float>& input,
                         std::vector<float>& output,
                         float temperature = 1.0f);
-    static std::vector<float> winograd_transform_f(const std::vector<float>& f,
-        const int outputs, const int channels);
-    static std::vector<float> zeropad_U(const std::vector<float>& U,
-        const int outputs, const int channels,
-        const int outputs_pad, const int channels_pad);
     static void winograd_transform_in(const std::vector<float>& in,
                                       std::vector<float>& V,
-                                      const int C);
+                                      const int C, const int batch_size);
     static void winograd_transform_out(const std::vector<float>& M,
                                        std::vector<float>& Y,
-                                       const int K);
+                                       const int K, const int batch_size);
     static void winograd_convolve3(const int outputs,
                                    const std::vector<float>& input,
                                    const std::vector<float>& U,
                                    std::vector<float>& V,
                                    std::vector<float>& M,
-                                   std::vector<float>& output);
+                                   std::vector<float>& output,
+                                   const int batch_size);
     static void winograd_sgemm(const std::vector<float>& U,
                                std::vector<float>& V,
-                               std::vector<float>& M, const int C, const int K);
-    static void init_move_map();
-    static Netresult get_scored_moves_internal(const BoardHistory& state, NNPlanes& planes, DebugRawData* debug_data);
+                               std::vector<float>& M, const int C, const int K,
+                               const int batch_size);
+    static std::vector<net_t> get_input_data(const NNPlanes& planes);
+    // Writes plane c of planes to out + c * plane_stride, so that a batch
+    // can be expanded channel by channel (CNHW).
+    static void expand_planes(const NNPlanes& planes, net_t* out,
+                              size_t plane_stride);
+    static Netresult get_scored_moves_internal(const BoardHistory& state, NNPlanes& planes, DebugRawData* debug_data,
+                                               const MoveList<LEGAL>* legal_moves);
+    // Runs a forward pass at every batch size the search uses, so that
+    // the first search doesn't pay for what the backends set up lazily.
+    static void warmup();
+#ifdef USE_OPENCL_SELFCHECK
+    // Compares an OpenCL evaluation against the CPU. Runs on the self-check
+    // thread, throws if the driver can't be trusted.
+    static void self_check(const std::vector<NNPlanes>& input,
+                           std::vector<float>& policy,
+                           std::vector<float>& value,
+                           const std::string& pgn);
+#endif
 #if defined(USE_BLAS)
-    static void forward_cpu(std::vector<float>& input,
+    // Same layout of the batch as forward. With tower_input_max the
+    // residual tower runs in fp32 and records the largest input of every
+    // convolution, indexed like the weights.
+    static void forward_cpu(const std::vector<NNPlanes>& input,
                             std::vector<float>& output_pol,
-                            std::vector<float>& output_val);
+                            std::vector<float>& output_val,
+                            const int batch_size = 1,
+                            std::vector<float>* tower_input_max = nullptr);
+    // Times F(2x2, 3x3) and F(4x4, 3x3) on a tower convolution with
+    // weights, and picks the faster one or the one of --winograd. Checks
+    // F(4x4, 3x3) against the reference convolution, which it must match.
+    static void select_winograd(const std::vector<float>& weights,
+                                const size_t channels);
+#ifndef USE_OPENCL
+    // Sets the activation scales of the int8 tower from a few positions.
+    static void calibrate_int8();
+#endif
 
 #endif
 };
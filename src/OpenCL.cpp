@@ -21,6 +21,7 @@
 #ifdef USE_OPENCL
 
 #include <cstdio>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
@@ -45,117 +46,121 @@ using namespace Utils;
 static std::string cl_args =
     "-cl-mad-enable -cl-fast-relaxed-math -cl-no-signed-zeros -cl-denorms-are-zero";
 
-static std::string sourceCode_config = R"(
+const std::string sourceCode_config = R"(
+#ifdef USE_HALF
+    typedef half net_t;
+    #define vload_net_t(offset,p) vload_half(offset,p)
+    #define vstore_net_t(data,offset,p) vstore_half(data,offset,p)
+#else
     typedef float net_t;
     #define vload_net_t(offset,p) ((p)[(offset)])
     #define vstore_net_t(data,offset,p) (((p)[(offset)])=(data))
+#endif
 )";
 
-static std::string sourceCode_convolve1 = R"(
-    __kernel
-    __attribute__((work_group_size_hint(8, 16, 1)))
-    void convolve1(
-                   __global const net_t * restrict in,
-                   __global net_t * restrict merge,
-                   __global const net_t * restrict weights,
-                   __local float * channel_buff,
-                   __local float * row_buff) {
-        // cl::NDRange global(channels, outputs, row);
-        const int c   = get_global_id(0);  // channel
-        const int o   = get_global_id(1);  // output
-        const int row = get_global_id(2);  // row
+static std::string sourceCode_input = R"(
+    // Expands the packed input planes of the positions: a 64 bit mask of
+    // the squares set for each plane, then the value of the set squares of
+    // each plane, padded to a whole number of masks per position.
+    __kernel void expand_input(
+                   __global const ulong * restrict packed,
+                   __global net_t * restrict out) {
+        // cl::NDRange global(channels, 8*8, batch_size);
+        const int c = get_global_id(0);
+        const int sq = get_global_id(1);
+        const int batch = get_global_id(2);
         const int channels = get_global_size(0);
-        const int outputs  = get_global_size(1);
-        // cl::NDRange local(2, (1->32), 1);
-        const int lx = get_local_id(0);
-        const int ly = get_local_id(1);
-        const int chan_buff_size = 8;
-        const int out_buff_size  = get_local_size(1);
-        const int row_buff_size  = 7;
-        const int chan_shift     = 3;
-        // input = channels * height * width
-        // output = outputs * height * width
-        // weights = output * channels * filter
-        // merge = channels * outputs * height * width
-        const int width = 8;
-        const int height = 8;
-        const int strip_size = width;
-        // Copy the input channels (strips) locally
-        if (out_buff_size < 8 && ly == 0) {
-            // strip-row
-            for (int w = 0; w < width; w++) {
-                channel_buff[lx * width + w] =
-                    vload_net_t((c * height + row) * width + w, in);
-            }
-        } else if (out_buff_size >= 8 && ly < 8) {
-            // Every thread copies a column
-            channel_buff[lx * width + ly] = vload_net_t((c * height + row) * width + ly, in);
-        }
-        // Copy the filter we are applying locally
-        __private float filter_buff = vload_net_t((o * channels + c), weights);
-        barrier(CLK_LOCAL_MEM_FENCE);
-        int out_lane = 0;
-        int out_cw   = 0;
-        #pragma unroll
-        for (int cw = 0; cw < width; cw++) {
-            int fid = lx * strip_size;
-            float out  = channel_buff[fid + cw] * filter_buff;
-            row_buff[(ly * chan_buff_size + lx) * row_buff_size + out_lane] = out;
-            out_lane++;
-            // Row buffer full or last lane?
-            if (out_lane == row_buff_size || (cw == width - 1)) {
-                barrier(CLK_LOCAL_MEM_FENCE);
-                if (lx < out_lane) {
-                    float val;
-                    val  = row_buff[(ly * chan_buff_size + 0) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 1) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 2) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 3) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 4) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 5) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 6) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 7) * row_buff_size + lx];
-                    vstore_net_t(val, (((c >> chan_shift) * height + row) * width + out_cw + lx) * outputs + o, merge);
-                }
-                out_cw  += row_buff_size;
-                out_lane = 0;
-           }
-       }
+        const int boardsize = 8 * 8;
+        const int stride = (channels * (8 + 4) + 7) / 8;
+        __global const ulong * restrict masks = packed + batch * stride;
+        __global const float * restrict values =
+            (__global const float *)(masks + channels);
+        const float value = ((masks[c] >> sq) & 1) ? values[c] : 0.0f;
+        vstore_net_t(value, (batch * channels + c) * boardsize + sq, out);
     }
+)";
 
-__kernel void merge_bn(
-                        __global const net_t * restrict in,
-                        __global net_t * restrict out,
-                        __private const int channels,
-                        __constant const net_t * restrict means,
-                        __constant const net_t * restrict stddivs) {
-        // cl::NDRange global(outputs, 8*8);
-        const int gx = get_global_id(0);
-        const int gy = get_global_id(1);
-        const int output = gx;
-        const int b = gy;
+static std::string sourceCode_heads = R"(
+    // The 1x1 convolutions of both heads over the tower output, with their
+    // biases and ReLU, in one launch. The policy planes are stored first
+    // and the value planes after them, ready for the fully connected layers.
+    __kernel void convolve1_heads(
+                   __global const net_t * restrict in,
+                   __global net_t * restrict out,
+                   __global const net_t * restrict pol_weights,
+                   __constant const net_t * restrict pol_biases,
+                   __global const net_t * restrict val_weights,
+                   __constant const net_t * restrict val_biases,
+                   __private const int channels,
+                   __private const int pol_outputs) {
+        // cl::NDRange global(pol_outputs + val_outputs, 8*8, batch_size);
+        const int o = get_global_id(0);
+        const int b = get_global_id(1);
+        const int batch = get_global_id(2);
         const int outputs = get_global_size(0);
         const int width = 8;
         const int height = 8;
         const int boardsize = width * height;
-        const int o = output;
+        in += batch * channels * boardsize;
+        out += batch * outputs * boardsize;
+        const bool is_pol = o < pol_outputs;
+        const int head_o = is_pol ? o : o - pol_outputs;
+        __global const net_t * restrict weights =
+            is_pol ? pol_weights : val_weights;
         float sum = 0;
         for (int c = 0; c < channels; c++) {
-            sum += vload_net_t((c * boardsize + b) * outputs + o, in);
-        }
-        if (means) {
-            const float mean = vload_net_t(o, means);
-            const float scale_stddiv = vload_net_t(o, stddivs);
-
-            sum = scale_stddiv * (sum - mean);
-            sum = sum > 0 ? sum : 0.0f;
+            sum += vload_net_t(c * boardsize + b, in)
+                 * vload_net_t(head_o * channels + c, weights);
         }
+        sum += is_pol ? vload_net_t(head_o, pol_biases)
+                      : vload_net_t(head_o, val_biases);
+        sum = sum > 0 ? sum : 0.0f;
         vstore_net_t(sum, o * boardsize + b, out);
     }
 )";
 
-static std::string sourceCode_convolve3 = R"(
-void __in_transform_eq(float x[4][4], __global float * restrict V, int offset, int CPpad) {
+const std::string sourceCode_convolve3 = R"(
+// F(WINOGRAD_M x WINOGRAD_M, 3x3) winograd convolutions. WINOGRAD_M is 2 or
+// 4 and set by the Tuner, the tiles of the inputs are WINOGRAD_M + 2 wide
+// and overlap by 2. The tiles of all positions of a batch are columns of the
+// same GEMMs, tile b of position n is column n*P + b.
+#ifndef WINOGRAD_M
+#define WINOGRAD_M 2
+#endif
+#define WINOGRAD_ALPHA (WINOGRAD_M + 2)
+
+#if WINOGRAD_M == 4
+// V = transpose(B).x.B, see winograd4_bt() of the CPU kernels.
+void __in_transform_eq(float x[6][6], __global net_t * restrict V, int offset, int CPpad) {
+    float T1[6][6];
+
+    for (int j = 0; j < 6; j++) {
+        T1[0][j] = 4.0f * x[0][j] - 5.0f * x[2][j] + x[4][j];
+        T1[1][j] = -4.0f * (x[1][j] + x[2][j]) + x[3][j] + x[4][j];
+        T1[2][j] = 4.0f * (x[1][j] - x[2][j]) - x[3][j] + x[4][j];
+        T1[3][j] = 2.0f * (x[3][j] - x[1][j]) - x[2][j] + x[4][j];
+        T1[4][j] = 2.0f * (x[1][j] - x[3][j]) - x[2][j] + x[4][j];
+        T1[5][j] = 4.0f * x[1][j] - 5.0f * x[3][j] + x[5][j];
+    }
+
+    for (int i = 0; i < 6; i++) {
+        const int row = (i*6)*CPpad + offset;
+        vstore_net_t(4.0f * T1[i][0] - 5.0f * T1[i][2] + T1[i][4],
+                     row + 0*CPpad, V);
+        vstore_net_t(-4.0f * (T1[i][1] + T1[i][2]) + T1[i][3] + T1[i][4],
+                     row + 1*CPpad, V);
+        vstore_net_t(4.0f * (T1[i][1] - T1[i][2]) - T1[i][3] + T1[i][4],
+                     row + 2*CPpad, V);
+        vstore_net_t(2.0f * (T1[i][3] - T1[i][1]) - T1[i][2] + T1[i][4],
+                     row + 3*CPpad, V);
+        vstore_net_t(2.0f * (T1[i][1] - T1[i][3]) - T1[i][2] + T1[i][4],
+                     row + 4*CPpad, V);
+        vstore_net_t(4.0f * T1[i][1] - 5.0f * T1[i][3] + T1[i][5],
+                     row + 5*CPpad, V);
+    }
+}
+#else
+void __in_transform_eq(float x[4][4], __global net_t * restrict V, int offset, int CPpad) {
     float T1[4][4];
 
     T1[0][0] = x[0][0] - x[2][0];
@@ -175,50 +180,52 @@ void __in_transform_eq(float x[4][4], __global float * restrict V, int offset, i
     T1[3][2] = x[1][2] - x[3][2];
     T1[3][3] = x[1][3] - x[3][3];
 
-    V[(0*4 + 0)*CPpad + offset] = T1[0][0] - T1[0][2];
-    V[(0*4 + 1)*CPpad + offset] = T1[0][1] + T1[0][2];
-    V[(0*4 + 2)*CPpad + offset] = T1[0][2] - T1[0][1];
-    V[(0*4 + 3)*CPpad + offset] = T1[0][1] - T1[0][3];
-    V[(1*4 + 0)*CPpad + offset] = T1[1][0] - T1[1][2];
-    V[(1*4 + 1)*CPpad + offset] = T1[1][1] + T1[1][2];
-    V[(1*4 + 2)*CPpad + offset] = T1[1][2] - T1[1][1];
-    V[(1*4 + 3)*CPpad + offset] = T1[1][1] - T1[1][3];
-    V[(2*4 + 0)*CPpad + offset] = T1[2][0] - T1[2][2];
-    V[(2*4 + 1)*CPpad + offset] = T1[2][1] + T1[2][2];
-    V[(2*4 + 2)*CPpad + offset] = T1[2][2] - T1[2][1];
-    V[(2*4 + 3)*CPpad + offset] = T1[2][1] - T1[2][3];
-    V[(3*4 + 0)*CPpad + offset] = T1[3][0] - T1[3][2];
-    V[(3*4 + 1)*CPpad + offset] = T1[3][1] + T1[3][2];
-    V[(3*4 + 2)*CPpad + offset] = T1[3][2] - T1[3][1];
-    V[(3*4 + 3)*CPpad + offset] = T1[3][1] - T1[3][3];
+    vstore_net_t(T1[0][0] - T1[0][2], (0*4 + 0)*CPpad + offset, V);
+    vstore_net_t(T1[0][1] + T1[0][2], (0*4 + 1)*CPpad + offset, V);
+    vstore_net_t(T1[0][2] - T1[0][1], (0*4 + 2)*CPpad + offset, V);
+    vstore_net_t(T1[0][1] - T1[0][3], (0*4 + 3)*CPpad + offset, V);
+    vstore_net_t(T1[1][0] - T1[1][2], (1*4 + 0)*CPpad + offset, V);
+    vstore_net_t(T1[1][1] + T1[1][2], (1*4 + 1)*CPpad + offset, V);
+    vstore_net_t(T1[1][2] - T1[1][1], (1*4 + 2)*CPpad + offset, V);
+    vstore_net_t(T1[1][1] - T1[1][3], (1*4 + 3)*CPpad + offset, V);
+    vstore_net_t(T1[2][0] - T1[2][2], (2*4 + 0)*CPpad + offset, V);
+    vstore_net_t(T1[2][1] + T1[2][2], (2*4 + 1)*CPpad + offset, V);
+    vstore_net_t(T1[2][2] - T1[2][1], (2*4 + 2)*CPpad + offset, V);
+    vstore_net_t(T1[2][1] - T1[2][3], (2*4 + 3)*CPpad + offset, V);
+    vstore_net_t(T1[3][0] - T1[3][2], (3*4 + 0)*CPpad + offset, V);
+    vstore_net_t(T1[3][1] + T1[3][2], (3*4 + 1)*CPpad + offset, V);
+    vstore_net_t(T1[3][2] - T1[3][1], (3*4 + 2)*CPpad + offset, V);
+    vstore_net_t(T1[3][1] - T1[3][3], (3*4 + 3)*CPpad + offset, V);
 }
+#endif
 
-__kernel void in_transform(__global net_t * restrict in, __global float * restrict V,
+__kernel void in_transform(__global net_t * restrict in, __global net_t * restrict V,
                            const int C, const int Cpad,
                            const int Ppad) {
     const int W = 8;
     const int H = 8;
     const int T = W*H;
-    const int WTILES = (W + 1) / 2;
+    const int WTILES = (W + WINOGRAD_M - 1) / WINOGRAD_M;
     const int P = WTILES*WTILES;
     const int CPpad = Ppad * Cpad;
 
     const int block = get_global_id(0);
     const int ch = get_global_id(1);
-    const int chT = ch*(T);
+    const int batch = get_global_id(2);
+    const int chT = (batch*C + ch)*T;
 
     const int block_x = block % WTILES;
     const int block_y = block / WTILES;
 
     // Tiles overlap by 2
-    const int yin = 2 * block_y - 1;
-    const int xin = 2 * block_x - 1;
+    const int yin = WINOGRAD_M * block_y - 1;
+    const int xin = WINOGRAD_M * block_x - 1;
 
     if (block < P && ch < C) {
         // Cache input tile and handle zero padding
-        float x[4][4];
-        for (int i = 0; i < 4; i++) {
-            for (int j = 0; j < 4; j++) {
+        float x[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+        for (int i = 0; i < WINOGRAD_ALPHA; i++) {
+            for (int j = 0; j < WINOGRAD_ALPHA; j++) {
                 int a = xin + j;
                 int b = yin + i;
                 if (b >= 0 && a >= 0 && b < H && a < W) {
@@ -229,25 +236,44 @@ __kernel void in_transform(__global net_t * restrict in, __global float * restri
             }
         }
 
-        const int offset = ch*Ppad + block;
+        const int offset = ch*Ppad + batch*P + block;
         __in_transform_eq(x, V, offset, CPpad);
     }
 }
 
-void __out_transform_eq(__global const float * restrict M, float o[4],
-                        int Kpad, int Ppad, int block_x, int block_y)
+void __out_transform_eq(__global const net_t * restrict M,
+                        float o[WINOGRAD_M * WINOGRAD_M],
+                        int Kpad, int Ppad, int b)
 {
-    const int W = 8;
-    const int H = 8;
-    const int WTILES = (W + 1) / 2;
-    const int b = block_y * WTILES + block_x;
     const int KPpad = Kpad * Ppad;
     const int k = get_global_id(0);
-    float temp_m[16];
-    for (int xn = 0, xnKPpad = b*Kpad + k; xn < 16; xn++, xnKPpad += KPpad) {
-        temp_m[xn] = M[xnKPpad];
+    float temp_m[WINOGRAD_ALPHA * WINOGRAD_ALPHA];
+    for (int xn = 0, xnKPpad = b*Kpad + k; xn < WINOGRAD_ALPHA * WINOGRAD_ALPHA;
+         xn++, xnKPpad += KPpad) {
+        temp_m[xn] = vload_net_t(xnKPpad, M);
     }
 
+#if WINOGRAD_M == 4
+    // o = transpose(A).m.A, see winograd4_at() of the CPU kernels.
+    float T1[4][6];
+    for (int j = 0; j < 6; j++) {
+        const float m1 = temp_m[1*6 + j];
+        const float m2 = temp_m[2*6 + j];
+        const float m3 = temp_m[3*6 + j];
+        const float m4 = temp_m[4*6 + j];
+        T1[0][j] = temp_m[0*6 + j] + m1 + m2 + m3 + m4;
+        T1[1][j] = m1 - m2 + 2.0f * (m3 - m4);
+        T1[2][j] = m1 + m2 + 4.0f * (m3 + m4);
+        T1[3][j] = m1 - m2 + 8.0f * (m3 - m4) + temp_m[5*6 + j];
+    }
+    for (int i = 0; i < 4; i++) {
+        o[i*4 + 0] = T1[i][0] + T1[i][1] + T1[i][2] + T1[i][3] + T1[i][4];
+        o[i*4 + 1] = T1[i][1] - T1[i][2] + 2.0f * (T1[i][3] - T1[i][4]);
+        o[i*4 + 2] = T1[i][1] + T1[i][2] + 4.0f * (T1[i][3] + T1[i][4]);
+        o[i*4 + 3] = T1[i][1] - T1[i][2] + 8.0f * (T1[i][3] - T1[i][4])
+                     + T1[i][5];
+    }
+#else
     o[0] = temp_m[0*4 + 0] + temp_m[0*4 + 1] + temp_m[0*4 + 2] +
            temp_m[1*4 + 0] + temp_m[1*4 + 1] + temp_m[1*4 + 2] +
            temp_m[2*4 + 0] + temp_m[2*4 + 1] + temp_m[2*4 + 2];
@@ -263,108 +289,104 @@ void __out_transform_eq(__global const float * restrict M, float o[4],
     o[3] = temp_m[1*4 + 1] - temp_m[1*4 + 2] - temp_m[1*4 + 3] -
            temp_m[2*4 + 1] + temp_m[2*4 + 2] + temp_m[2*4 + 3] -
            temp_m[3*4 + 1] + temp_m[3*4 + 2] + temp_m[3*4 + 3];
+#endif
 }
 
-__kernel void out_transform_fused_bn(__global const float * restrict M,
-                                     __global net_t * restrict Y,
-                                     const int K,
-                                     const int Kpad, const int Ppad,
-                                     __global const net_t * restrict residual,
-                                     __constant const net_t * restrict means,
-                                     __constant const net_t * restrict stddivs) {
+__kernel void out_transform_fused_bias(__global const net_t * restrict M,
+                                       __global net_t * restrict Y,
+                                       const int K,
+                                       const int Kpad, const int Ppad,
+                                       __global const net_t * restrict residual,
+                                       __constant const net_t * restrict biases) {
     const int W = 8;
     const int H = 8;
-    const int WTILES = (W + 1) / 2;
+    const int WTILES = (W + WINOGRAD_M - 1) / WINOGRAD_M;
     const int P = WTILES * WTILES;
 
     int k = get_global_id(0);
     int block = get_global_id(1);
+    int batch = get_global_id(2);
 
     const int block_x = block % WTILES;
     const int block_y = block / WTILES;
 
-    int x = 2*block_x;
-    int y = 2*block_y;
-    int a_ind = (y)*W + (x);
+    int x = WINOGRAD_M*block_x;
+    int y = WINOGRAD_M*block_y;
     if (k < K && block < P) {
-        const int kHW = k * W * H;
-        float o[4];
-        __out_transform_eq(M, o, Kpad, Ppad, block_x, block_y);
-
-        const float mean = vload_net_t(k, means);
-        const float scale_stddiv = vload_net_t(k, stddivs);
-
-        const bool pred[4] = { 1, x+1 < W, y+1 < H, x+1 < W & y+1 < H};
-
-        const int a[4] = {a_ind, a_ind+1, a_ind+W, a_ind+W+1};
-
-        for (int i = 0; i < 4; i++) {
-            if (pred[i]) {
-                o[i] = scale_stddiv * (o[i] - mean);
-                if (residual) {
-                    o[i] += vload_net_t(kHW + a[i], residual);
+        const int kHW = (batch * K + k) * W * H;
+        float o[WINOGRAD_M * WINOGRAD_M];
+        __out_transform_eq(M, o, Kpad, Ppad, batch * P + block);
+
+        const float bias = vload_net_t(k, biases);
+
+        for (int i = 0; i < WINOGRAD_M; i++) {
+            for (int j = 0; j < WINOGRAD_M; j++) {
+                if (y + i < H && x + j < W) {
+                    const int a = (y + i)*W + x + j;
+                    float v = o[i*WINOGRAD_M + j] + bias;
+                    if (residual) {
+                        v += vload_net_t(kHW + a, residual);
+                    }
+                    v = v > 0 ? v : 0.0f;
+                    vstore_net_t(v, kHW + a, Y);
                 }
-                o[i] = o[i] > 0 ? o[i] : 0.0f;
-                vstore_net_t(o[i], kHW + a[i], Y);
             }
         }
     }
 }
 
-__kernel void out_transform_fused_bn_in(
-                                     __global const float * restrict M,
+__kernel void out_transform_fused_bias_in(
+                                     __global const net_t * restrict M,
                                      __global net_t * restrict Y,
                                      __global net_t * restrict V,
                                      const int K,
                                      const int Kpad, const int Ppad, const int Cpad,
                                      __global const net_t * restrict residual,
-                                     __constant const net_t * restrict means,
-                                     __constant const net_t * restrict stddivs,
+                                     __constant const net_t * restrict biases,
                                      __local float * ybuf) {
     const int W = 8;
     const int H = 8;
     const int T = W*H;
-    const int WTILES = (W + 1) / 2;
+    const int WTILES = (W + WINOGRAD_M - 1) / WINOGRAD_M;
     const int P = WTILES * WTILES;
-    const int KPpad = Kpad * Ppad;
 
     const int k = get_global_id(0);
     const int kg = get_local_id(0);
     const int block = get_global_id(1);
+    const int batch = get_global_id(2);
 
     const int block_x = block % WTILES;
     const int block_y = block / WTILES;
 
-    const int yin = 2 * block_y - 1;
-    const int xin = 2 * block_x - 1;
+    const int yin = WINOGRAD_M * block_y - 1;
+    const int xin = WINOGRAD_M * block_x - 1;
 
 
-    const int x = 2*block_x;
-    const int y = 2*block_y;
-    int a_ind = (y)*W + (x);
+    const int x = WINOGRAD_M*block_x;
+    const int y = WINOGRAD_M*block_y;
 
 
     if (k < K && block < P) {
-        const int a[4] = {a_ind, a_ind+1, a_ind+W, a_ind+W+1};
-        const bool pred[4] = { 1, x+1 < W, y+1 < H, x+1 < W & y+1 < H};
-        const int kHW = k * W * H;
-
-        float o[4];
-        __out_transform_eq(M, o, Kpad, Ppad, block_x, block_y);
-
-        const float mean = vload_net_t(k, means);
-        const float scale_stddiv = vload_net_t(k, stddivs);
-
-        for (int i = 0; i < 4; i++) {
-            if (pred[i]) {
-                o[i] = scale_stddiv * (o[i] - mean);
-                if (residual) {
-                    o[i] += vload_net_t(kHW + a[i], residual);
-                }
-                o[i] = o[i] > 0 ? o[i] : 0.0f;
-                ybuf[kg * T + a[i]] = o[i];
-                if (Y) {
-                    vstore_net_t(o[i], kHW + a[i], Y);
+        const int kHW = (batch * K + k) * W * H;
+
+        float o[WINOGRAD_M * WINOGRAD_M];
+        __out_transform_eq(M, o, Kpad, Ppad, batch * P + block);
+
+        const float bias = vload_net_t(k, biases);
+
+        for (int i = 0; i < WINOGRAD_M; i++) {
+            for (int j = 0; j < WINOGRAD_M; j++) {
+                if (y + i < H && x + j < W) {
+                    const int a = (y + i)*W + x + j;
+                    float v = o[i*WINOGRAD_M + j] + bias;
+                    if (residual) {
+                        v += vload_net_t(kHW + a, residual);
+                    }
+                    v = v > 0 ? v : 0.0f;
+                    ybuf[kg * T + a] = v;
+                    if (Y) {
+                        vstore_net_t(v, kHW + a, Y);
+                    }
                 }
             }
         }
@@ -375,10 +397,10 @@ __kernel void out_transform_fused_bn_in(
     if (block < P && k < K) {
         const int CPpad = Ppad * Cpad;
         // Cache input tile and handle zero padding
-        float xx[4][4];
-        for (int i = 0; i < 4; i++) {
+        float xx[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+        for (int i = 0; i < WINOGRAD_ALPHA; i++) {
             int b = yin + i;
-            for (int j = 0; j < 4; j++) {
+            for (int j = 0; j < WINOGRAD_ALPHA; j++) {
                 int a = xin + j;
                 if (b >= 0 && a >= 0 && b < H && a < W) {
                     xx[i][j] = ybuf[kg * T + b*W + a];
@@ -388,7 +410,7 @@ __kernel void out_transform_fused_bn_in(
             }
         }
 
-        const int offset = k*Ppad + block;
+        const int offset = k*Ppad + batch*P + block;
         __in_transform_eq(xx, V, offset, CPpad);
     }
 }
@@ -406,29 +428,20 @@ const std::string sourceCode_sgemv =
     #include "clblast_level3/xgemv.opencl"
 ;
 
-thread_local ThreadData opencl_thread_data;
-
-void OpenCL::ensure_thread_initialized() {
-    if (!opencl_thread_data.m_is_initialized) {
-        // Make kernels
-        opencl_thread_data.m_convolve1_kernel =
-            cl::Kernel(m_program, "convolve1");
-        opencl_thread_data.m_merge_kernel =
-            cl::Kernel(m_program, "merge_bn");
-        opencl_thread_data.m_in_transform_kernel =
-            cl::Kernel(m_program, "in_transform");
-        opencl_thread_data.m_sgemm_kernel =
-            cl::Kernel(m_program, "XgemmBatched");
-        opencl_thread_data.m_out_transform_bn_kernel =
-            cl::Kernel(m_program, "out_transform_fused_bn");
-        opencl_thread_data.m_out_transform_bn_in_kernel =
-            cl::Kernel(m_program, "out_transform_fused_bn_in");
-        opencl_thread_data.m_sgemv_kernel =
-            cl::Kernel(m_program, "Xgemv");
-        opencl_thread_data.m_commandqueue =
-            cl::CommandQueue(m_context, m_device);
-        opencl_thread_data.m_is_initialized = true;
-    }
+void OpenCL::initialize_context(ExecutionContext& context) {
+    // Make kernels
+    context.m_expand_input_kernel = cl::Kernel(m_program, "expand_input");
+    context.m_heads_kernel = cl::Kernel(m_program, "convolve1_heads");
+    context.m_in_transform_kernel = cl::Kernel(m_program, "in_transform");
+    context.m_sgemm_kernel = cl::Kernel(m_program, "XgemmBatched");
+    context.m_out_transform_bias_kernel =
+        cl::Kernel(m_program, "out_transform_fused_bias");
+    context.m_out_transform_bias_in_kernel =
+        cl::Kernel(m_program, "out_transform_fused_bias_in");
+    context.m_sgemv_kernel = cl::Kernel(m_program, "Xgemv");
+    const cl_command_queue_properties properties =
+        cfg_opencl_profile ? CL_QUEUE_PROFILING_ENABLE : 0;
+    context.m_commandqueue = cl::CommandQueue(m_context, m_device, properties);
 }
 
 void OpenCL_Network::add_weights(size_t layer,
@@ -438,217 +451,326 @@ void OpenCL_Network::add_weights(size_t layer,
         m_layers.push_back(Layer());
     }
 
-    auto converted_weights = std::vector<net_t>();
-    for(auto i = size_t{0}; i < size; i++) {
-        converted_weights.emplace_back(weights[i]);
-    }
+    auto weightSize = size * m_opencl.get_element_size();
+    auto converted_weights = std::vector<char>(weightSize);
+    m_opencl.to_device(weights, converted_weights.data(), size);
 
-    auto weightSize = size * sizeof(decltype(converted_weights)::value_type);
     m_layers.back().weights.emplace_back(
         m_opencl.m_context,
         CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
         weightSize,
-        const_cast<net_t*>(converted_weights.data()));
+        converted_weights.data());
 }
 
-void OpenCL_Network::forward(const std::vector<net_t>& input,
-                             std::vector<net_t>& output_pol,
-                             std::vector<net_t>& output_val) {
-    constexpr auto tiles = WINOGRAD_P;
+ExecutionContext& OpenCL_Network::acquire_context() {
+    std::unique_lock<std::mutex> lock(m_contexts_mutex);
+    if (m_free_contexts.empty()
+        && m_contexts.size() < size_t(cfg_gpu_contexts)) {
+        auto context = std::make_unique<ExecutionContext>();
+        m_opencl.initialize_context(*context);
+        m_contexts.emplace_back(std::move(context));
+        return *m_contexts.back();
+    }
+    m_contexts_cv.wait(lock, [this] { return !m_free_contexts.empty(); });
+    auto context = m_free_contexts.back();
+    m_free_contexts.pop_back();
+    return *context;
+}
 
-    auto finalSize_pol = m_layers[m_layers.size()-2].ip_out_size  * sizeof(net_t);
-    auto finalSize_val = m_layers.back().ip_out_size  * sizeof(net_t);
+void OpenCL_Network::release_context(ExecutionContext& context) {
+    {
+        std::lock_guard<std::mutex> lock(m_contexts_mutex);
+        m_free_contexts.push_back(&context);
+    }
+    m_contexts_cv.notify_one();
+}
+
+void OpenCL_Network::allocate_buffers(ExecutionContext& context,
+                                      const size_t input_channels,
+                                      const int batch_size) {
+    const auto tiles = winograd_p(m_opencl.m_winograd_m);
+    const auto elem_size = m_opencl.get_element_size();
+
+    // The heads are the last two layers, policy first.
+    const auto& pol_layer = m_layers[m_layers.size() - 2];
+    const auto& val_layer = m_layers.back();
+    auto max_channels = pol_layer.outputs + val_layer.outputs;
+    for (const auto& layer : m_layers) {
+        max_channels = std::max(max_channels,
+                                std::max(layer.channels, layer.outputs));
+    }
 
-    if (m_layers.back().is_policy) {
-        std::swap(finalSize_pol, finalSize_val);
+    const auto mwg = m_opencl.m_sgemm_tuners.mwg;
+    const auto nwg = m_opencl.m_sgemm_tuners.nwg;
+    const auto kwg = m_opencl.m_sgemm_tuners.kwg;
+    const auto vwm = m_opencl.m_sgemm_tuners.vwm;
+    const auto vwn = m_opencl.m_sgemm_tuners.vwn;
+
+    // V is read with the K padding, M written with the M padding.
+    const auto c_ceil = std::max(
+        ceilMultiple(ceilMultiple(max_channels, mwg), vwm),
+        ceilMultiple(ceilMultiple(max_channels, kwg), vwm));
+    const auto n_ceil = ceilMultiple(ceilMultiple(tiles * batch_size, nwg),
+                                     vwn);
+
+    const auto alloc_inSize =
+        batch_size * max_channels * 8 * 8 * elem_size;
+    const auto alloc_vm_size =
+        winograd_tile(m_opencl.m_winograd_m) * c_ceil * n_ceil * elem_size;
+    const auto packedSize = batch_size * packed_input_size(input_channels);
+    const auto expandedSize = batch_size * input_channels * 8 * 8 * elem_size;
+    const auto pol_size = size_t{pol_layer.ip_out_size};
+    const auto val_size = size_t{val_layer.ip_out_size};
+    const auto finalSize = batch_size * (pol_size + val_size) * elem_size;
+
+    cl::CommandQueue & queue = context.m_commandqueue;
+    if (context.m_pinnedIn) {
+        queue.enqueueUnmapMemObject(context.m_pinnedInBuffer,
+                                    context.m_pinnedIn);
+        queue.enqueueUnmapMemObject(context.m_pinnedOutBuffer,
+                                    context.m_pinnedOut);
+        queue.finish();
     }
 
-    m_opencl.ensure_thread_initialized();
+    // The GEMM reads the padding of V, which has to be finite.
+    auto v_zeros = std::vector<char>(alloc_vm_size);
 
-    if (!opencl_thread_data.m_buffers_allocated) {
-        auto max_channels = unsigned{0};
-        for (const auto& layer : m_layers) {
-            max_channels = std::max(max_channels,
-                                    std::max(layer.channels, layer.outputs));
+    context.m_inBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE, alloc_inSize);
+    context.m_inBuffer2 = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE, alloc_inSize);
+    context.m_VBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+        alloc_vm_size, v_zeros.data(), nullptr);
+    context.m_MBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_vm_size);
+
+    context.m_inputBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, packedSize);
+    context.m_pinnedInBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, packedSize);
+    context.m_expandedInput = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, expandedSize);
+
+    context.m_outBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, finalSize);
+    context.m_pinnedOutBuffer = cl::Buffer(
+        m_opencl.m_context,
+        CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, finalSize);
+
+    // The staging buffers stay mapped until the buffers grow again.
+    context.m_pinnedIn =
+        queue.enqueueMapBuffer(context.m_pinnedInBuffer, CL_TRUE,
+                               CL_MAP_WRITE, 0, packedSize);
+    context.m_pinnedOut =
+        queue.enqueueMapBuffer(context.m_pinnedOutBuffer, CL_TRUE,
+                               CL_MAP_READ, 0, finalSize);
+
+    context.m_buffers_batch_size = batch_size;
+}
+
+void OpenCL_Network::forward(const std::vector<Network::NNPlanes>& input,
+                             std::vector<net_t>& output_pol,
+                             std::vector<net_t>& output_val,
+                             const int batch_size) {
+    // The heads are the last two layers, policy first.
+    const auto& pol_layer = m_layers[m_layers.size() - 2];
+    const auto& val_layer = m_layers.back();
+    assert(pol_layer.is_policy && val_layer.is_value);
+    assert(pol_layer.channels == val_layer.channels);
+
+    const auto elem_size = m_opencl.get_element_size();
+    const auto pol_size = size_t{pol_layer.ip_out_size};
+    const auto val_size = size_t{val_layer.ip_out_size};
+    // The outputs of a position are next to each other.
+    const auto out_size = pol_size + val_size;
+    const auto heads_size = (pol_layer.outputs + val_layer.outputs) * 8 * 8;
+
+    // Gives the context back however the batch ends.
+    struct ContextLease {
+        OpenCL_Network& network;
+        ExecutionContext& context;
+        ~ContextLease() {
+            network.release_context(context);
         }
+    } lease{*this, acquire_context()};
+    auto& context = lease.context;
+    context.m_profiled.clear();
 
-        const auto mwg = m_opencl.m_sgemm_tuners.mwg;
-        const auto nwg = m_opencl.m_sgemm_tuners.nwg;
-        const auto vwm = m_opencl.m_sgemm_tuners.vwm;
-        const auto vwn = m_opencl.m_sgemm_tuners.vwn;
-
-        const auto m_ceil = ceilMultiple(ceilMultiple(max_channels, mwg), vwm);
-        const auto n_ceil = ceilMultiple(ceilMultiple(tiles, nwg), vwn);
-
-        const auto alloc_inSize =
-            m_ceil * m_ceil *  max_channels * sizeof(net_t);
-        const auto alloc_vm_size =
-            WINOGRAD_TILE * m_ceil * n_ceil * sizeof(net_t);
-
-        auto v_zeros = std::vector<float>(alloc_vm_size);
-
-        opencl_thread_data.m_inBuffer = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE, alloc_inSize);
-        opencl_thread_data.m_inBuffer2 = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE, alloc_inSize);
-        opencl_thread_data.m_VBuffer = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-            alloc_vm_size, v_zeros.data(), nullptr);
-        opencl_thread_data.m_MBuffer = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_vm_size);
-
-        opencl_thread_data.m_pinnedOutBuffer_pol = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, finalSize_pol);
-        opencl_thread_data.m_pinnedOutBuffer_val = cl::Buffer(
-            m_opencl.m_context,
-            CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, finalSize_val);
-
-        opencl_thread_data.m_buffers_allocated = true;
-    }
+    // The planes are uploaded packed, see pack_input().
+    const auto input_channels = Network::get_input_channels();
+    const auto packedSize = packed_input_size(input_channels);
 
-    cl::Buffer & inBuffer = opencl_thread_data.m_inBuffer;
-    cl::Buffer & inBuffer2 = opencl_thread_data.m_inBuffer2;
-    cl::Buffer & VBuffer = opencl_thread_data.m_VBuffer;
-    cl::Buffer & MBuffer = opencl_thread_data.m_MBuffer;
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
+    if (context.m_buffers_batch_size < batch_size) {
+        allocate_buffers(context, input_channels, batch_size);
+    }
 
-    const auto inSize = sizeof(net_t) * input.size();
-    queue.enqueueWriteBuffer(inBuffer, CL_FALSE, 0, inSize, input.data());
+    cl::CommandQueue & queue = context.m_commandqueue;
+    cl::Buffer & inputBuffer = context.m_expandedInput;
+    cl::Buffer & inBuffer = context.m_inBuffer;
+    cl::Buffer & inBuffer2 = context.m_inBuffer2;
+    cl::Buffer & VBuffer = context.m_VBuffer;
+    cl::Buffer & MBuffer = context.m_MBuffer;
+
+    // The whole batch goes through every layer at once, so each GEMM
+    // takes the tiles of all positions.
+    for (auto batch = 0; batch < batch_size; batch++) {
+        pack_input(input[batch], input_channels,
+                   static_cast<char*>(context.m_pinnedIn)
+                   + batch * packedSize);
+    }
+    context.m_profile_layer = 0;
+    queue.enqueueWriteBuffer(context.m_inputBuffer, CL_FALSE, 0,
+                             batch_size * packedSize, context.m_pinnedIn,
+                             nullptr, profile_event(context, "write_buffer"));
+    expand_input(context, input_channels, batch_size,
+                 context.m_inputBuffer, inputBuffer);
 
     auto skip_in_trans = false;
     for (auto iter = cbegin(m_layers); iter != cend(m_layers); iter++) {
         const auto& layer = *iter;
         const auto niter = std::next(iter);
+        context.m_profile_layer = iter - cbegin(m_layers);
 
         if (layer.is_input_convolution) {
             assert(niter != cend(m_layers));
             auto conv_weights = begin(layer.weights);
-            auto bn_weights = begin(layer.weights) + 1;
+            auto conv_biases = begin(layer.weights) + 1;
             auto skip_next_in_trans = false;
             if (niter->is_residual_block) {
                 skip_next_in_trans = true;
             }
-            convolve3(layer.channels,
-                     layer.outputs,
-                     inBuffer,
+            convolve3(context, layer.channels,
+                     layer.outputs, batch_size,
+                     inputBuffer,
                      inBuffer,
                      VBuffer,
                      MBuffer,
                      conv_weights,
                      nullptr,
-                     bn_weights,
+                     conv_biases,
                      skip_in_trans, skip_next_in_trans, true);
             skip_in_trans = skip_next_in_trans;
         } else if (layer.is_residual_block) {
             assert(layer.channels == layer.outputs);
             assert(niter != cend(m_layers));
             auto conv1_weights = begin(layer.weights);
-            auto bn1_weights   = begin(layer.weights) + 1;
-            auto conv2_weights = begin(layer.weights) + 3;
-            auto bn2_weights   = begin(layer.weights) + 4;
-            convolve3(layer.channels,
-                      layer.outputs,
+            auto conv1_biases  = begin(layer.weights) + 1;
+            auto conv2_weights = begin(layer.weights) + 2;
+            auto conv2_biases  = begin(layer.weights) + 3;
+            convolve3(context, layer.channels,
+                      layer.outputs, batch_size,
                       inBuffer,
                       inBuffer2,
                       VBuffer,
                       MBuffer,
                       conv1_weights,
                       nullptr,
-                      bn1_weights,
+                      conv1_biases,
                       skip_in_trans, true, false);
 
             auto skip_next_in_trans = false;
             if (niter->is_residual_block) {
                 skip_next_in_trans = true;
             }
-            convolve3(layer.channels,
-                      layer.outputs,
+            convolve3(context, layer.channels,
+                      layer.outputs, batch_size,
                       inBuffer2,
                       inBuffer,
                       VBuffer,
                       MBuffer,
                       conv2_weights,
                       &inBuffer,
-                      bn2_weights,
+                      conv2_biases,
                       true, skip_next_in_trans, true);
             skip_in_trans = skip_next_in_trans;
         } else {
-            assert(layer.is_value || layer.is_policy);
-
-            cl::Buffer out_buffer;
-            if (layer.is_policy) {
-                out_buffer = opencl_thread_data.m_pinnedOutBuffer_pol;
-            } else {
-                out_buffer = opencl_thread_data.m_pinnedOutBuffer_val;
+            assert(layer.is_policy);
+            heads(context, layer.channels,
+                  pol_layer.outputs, val_layer.outputs, batch_size,
+                  inBuffer,
+                  inBuffer2,
+                  begin(pol_layer.weights),
+                  begin(val_layer.weights));
+
+            for (auto batch = 0; batch < batch_size; batch++) {
+                innerproduct(context, inBuffer2,
+                        batch * heads_size,
+                        begin(pol_layer.weights) + 2,
+                        begin(pol_layer.weights) + 3,
+                        context.m_outBuffer,
+                        batch * out_size,
+                        pol_layer.ip_in_size,
+                        pol_layer.ip_out_size,
+                        false);
+                innerproduct(context, inBuffer2,
+                        batch * heads_size + pol_layer.ip_in_size,
+                        begin(val_layer.weights) + 2,
+                        begin(val_layer.weights) + 3,
+                        context.m_outBuffer,
+                        batch * out_size + pol_size,
+                        val_layer.ip_in_size,
+                        val_layer.ip_out_size,
+                        true);
             }
-
-            auto ip_w = begin(layer.weights) + 3;
-            auto ip_b = begin(layer.weights) + 4;
-
-            convolve1(layer.channels,
-                    layer.outputs,
-                    inBuffer,
-                    inBuffer2,
-                    VBuffer,
-                    begin(layer.weights));
-
-            innerproduct(inBuffer2,
-                    ip_w,
-                    ip_b,
-                    out_buffer,
-                    layer.ip_in_size,
-                    layer.ip_out_size,
-                    layer.is_value);
+            // Both heads are done.
+            break;
         }
     }
 
-    auto pinnedOutBufferHost_pol = queue.enqueueMapBuffer(
-        opencl_thread_data.m_pinnedOutBuffer_pol, CL_FALSE,
-        CL_MAP_READ, 0, finalSize_pol);
-    auto pinnedOutBufferHost_val = queue.enqueueMapBuffer(
-        opencl_thread_data.m_pinnedOutBuffer_val, CL_FALSE,
-        CL_MAP_READ, 0, finalSize_val);
+    auto readback = cl::Event{};
+    queue.enqueueReadBuffer(context.m_outBuffer, CL_FALSE, 0,
+                            batch_size * out_size * elem_size,
+                            context.m_pinnedOut, nullptr, &readback);
+    if (auto event = profile_event(context, "read_buffer")) {
+        *event = readback;
+    }
 
     {
-        // Finish call is usually a busy wait. When using multiple threads
-        // use the lock to avoid busy waiting with all threads.
         std::lock_guard<std::mutex> lock(m_queue_finish_mutex);
-        queue.finish();
+        readback.wait();
+    }
+    if (!context.m_profiled.empty()) {
+        add_profile(context, batch_size);
     }
 
-    std::memcpy(output_pol.data(), pinnedOutBufferHost_pol, finalSize_pol);
-    std::memcpy(output_val.data(), pinnedOutBufferHost_val, finalSize_val);
-
-    queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_pol,
-            pinnedOutBufferHost_pol);
-    queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_val,
-            pinnedOutBufferHost_val);
-
+    for (auto batch = 0; batch < batch_size; batch++) {
+        const auto out = static_cast<const char*>(context.m_pinnedOut)
+                         + batch * out_size * elem_size;
+        m_opencl.from_device(out, output_pol.data() + batch * pol_size,
+                             pol_size);
+        m_opencl.from_device(out + pol_size * elem_size,
+                             output_val.data() + batch * val_size, val_size);
+    }
 }
 
-void OpenCL_Network::convolve3(int channels, int outputs,
+void OpenCL_Network::convolve3(ExecutionContext& context,
+                              int channels, int outputs, int batch_size,
                               cl::Buffer& bufferIn,
                               cl::Buffer& bufferOut,
                               cl::Buffer& bufferV,
                               cl::Buffer& bufferM,
                               weight_slice_t weights,
                               cl::Buffer* bufferResidual,
-                              weight_slice_t bn_weights,
+                              weight_slice_t biases,
                               bool skip_in_transform,
                               bool fuse_in_transform,
                               bool store_inout) {
 
-    cl::Kernel & in_transform_kernel = opencl_thread_data.m_in_transform_kernel;
-    cl::Kernel & sgemm_kernel = opencl_thread_data.m_sgemm_kernel;
-    cl::Kernel & out_transform_bn_kernel =
-        opencl_thread_data.m_out_transform_bn_kernel;
-    cl::Kernel & out_transform_bn_in_kernel =
-        opencl_thread_data.m_out_transform_bn_in_kernel;
+    cl::Kernel & in_transform_kernel = context.m_in_transform_kernel;
+    cl::Kernel & sgemm_kernel = context.m_sgemm_kernel;
+    cl::Kernel & out_transform_bias_kernel =
+        context.m_out_transform_bias_kernel;
+    cl::Kernel & out_transform_bias_in_kernel =
+        context.m_out_transform_bias_in_kernel;
 
     auto mwg = m_opencl.m_sgemm_tuners.mwg;
     auto nwg = m_opencl.m_sgemm_tuners.nwg;
@@ -668,16 +790,17 @@ void OpenCL_Network::convolve3(int channels, int outputs,
     assert(vwn != 0);
     assert(wavefront_size != 0);
 
-    constexpr auto tiles = WINOGRAD_P;
+    const auto tiles = winograd_p(m_opencl.m_winograd_m);
     constexpr auto width = 8;
     constexpr auto height = 8;
 
     auto wgs = ceilMultiple(tiles, wavefront_size);
     auto m_ceil = int(ceilMultiple(ceilMultiple(outputs, mwg), vwm));
-    auto n_ceil = int(ceilMultiple(ceilMultiple(tiles, nwg), vwn));
+    auto n_ceil = int(ceilMultiple(ceilMultiple(tiles * batch_size, nwg),
+                                   vwn));
     auto k_ceil = int(ceilMultiple(ceilMultiple(channels, kwg), vwm));
 
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
+    cl::CommandQueue & queue = context.m_commandqueue;
 
     if (!skip_in_transform) {
         try {
@@ -688,7 +811,9 @@ void OpenCL_Network::convolve3(int channels, int outputs,
             in_transform_kernel.setArg(4, n_ceil);
 
             queue.enqueueNDRangeKernel(in_transform_kernel, cl::NullRange,
-                                       cl::NDRange(wgs, channels));
+                                       cl::NDRange(wgs, channels, batch_size),
+                                       cl::NullRange, nullptr,
+                                       profile_event(context, "in_transform"));
         } catch (const cl::Error &e) {
             std::cerr << "Error in convolve3: " << e.what() << ": "
                 << e.err() << std::endl;
@@ -708,10 +833,12 @@ void OpenCL_Network::convolve3(int channels, int outputs,
 
         cl::NDRange size_sgemm = {(m_ceil * mdimc) / mwg,
                                   (n_ceil * ndimc) / nwg,
-                                  (cl::size_type)WINOGRAD_TILE};
+                                  (cl::size_type)winograd_tile(
+                                      m_opencl.m_winograd_m)};
 
         queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
-                                   size_sgemm, local_sgemm);
+                                   size_sgemm, local_sgemm, nullptr,
+                                   profile_event(context, "XgemmBatched"));
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve3: " << e.what() << ": "
             << e.err() << std::endl;
@@ -722,49 +849,52 @@ void OpenCL_Network::convolve3(int channels, int outputs,
         if (fuse_in_transform) {
             // TODO : Eventually this might also be something tuneable?
             constexpr auto dim_size = 2;
-            out_transform_bn_in_kernel.setArg(0, bufferM);
+            out_transform_bias_in_kernel.setArg(0, bufferM);
             if (store_inout) {
-                out_transform_bn_in_kernel.setArg(1, bufferOut);
+                out_transform_bias_in_kernel.setArg(1, bufferOut);
             } else {
-                out_transform_bn_in_kernel.setArg(1, nullptr);
+                out_transform_bias_in_kernel.setArg(1, nullptr);
             }
-            out_transform_bn_in_kernel.setArg(2, bufferV);
-            out_transform_bn_in_kernel.setArg(3, outputs);
-            out_transform_bn_in_kernel.setArg(4, m_ceil);
-            out_transform_bn_in_kernel.setArg(5, n_ceil);
+            out_transform_bias_in_kernel.setArg(2, bufferV);
+            out_transform_bias_in_kernel.setArg(3, outputs);
+            out_transform_bias_in_kernel.setArg(4, m_ceil);
+            out_transform_bias_in_kernel.setArg(5, n_ceil);
             // k_ceil of the next convolution
             auto k_ceil2 = int(ceilMultiple(ceilMultiple(outputs, kwg), vwm));
-            out_transform_bn_in_kernel.setArg(6, k_ceil2);
+            out_transform_bias_in_kernel.setArg(6, k_ceil2);
             if (bufferResidual) {
-                out_transform_bn_in_kernel.setArg(7, *bufferResidual);
+                out_transform_bias_in_kernel.setArg(7, *bufferResidual);
             } else {
-                out_transform_bn_in_kernel.setArg(7, nullptr);
+                out_transform_bias_in_kernel.setArg(7, nullptr);
             }
-            out_transform_bn_in_kernel.setArg(8, bn_weights[0]);
-            out_transform_bn_in_kernel.setArg(9, bn_weights[1]);
-            out_transform_bn_in_kernel.setArg(10,
+            out_transform_bias_in_kernel.setArg(8, biases[0]);
+            out_transform_bias_in_kernel.setArg(9,
                 cl::Local(dim_size * width * height * sizeof(float)));
 
-            queue.enqueueNDRangeKernel(out_transform_bn_in_kernel,
+            queue.enqueueNDRangeKernel(out_transform_bias_in_kernel,
                                        cl::NullRange,
-                                       cl::NDRange(outputs, wgs),
-                                       cl::NDRange(dim_size, wgs));
+                                       cl::NDRange(outputs, wgs, batch_size),
+                                       cl::NDRange(dim_size, wgs, 1), nullptr,
+                                       profile_event(context,
+                                           "out_transform_fused_bias_in"));
         } else {
-            out_transform_bn_kernel.setArg(0, bufferM);
-            out_transform_bn_kernel.setArg(1, bufferOut);
-            out_transform_bn_kernel.setArg(2, outputs);
-            out_transform_bn_kernel.setArg(3, m_ceil);
-            out_transform_bn_kernel.setArg(4, n_ceil);
+            out_transform_bias_kernel.setArg(0, bufferM);
+            out_transform_bias_kernel.setArg(1, bufferOut);
+            out_transform_bias_kernel.setArg(2, outputs);
+            out_transform_bias_kernel.setArg(3, m_ceil);
+            out_transform_bias_kernel.setArg(4, n_ceil);
             if (bufferResidual) {
-                out_transform_bn_kernel.setArg(5, *bufferResidual);
+                out_transform_bias_kernel.setArg(5, *bufferResidual);
             } else {
-                out_transform_bn_kernel.setArg(5, nullptr);
+                out_transform_bias_kernel.setArg(5, nullptr);
             }
-            out_transform_bn_kernel.setArg(6, bn_weights[0]);
-            out_transform_bn_kernel.setArg(7, bn_weights[1]);
+            out_transform_bias_kernel.setArg(6, biases[0]);
 
-            queue.enqueueNDRangeKernel(out_transform_bn_kernel, cl::NullRange,
-                                       cl::NDRange(outputs, wgs));
+            queue.enqueueNDRangeKernel(out_transform_bias_kernel, cl::NullRange,
+                                       cl::NDRange(outputs, wgs, batch_size),
+                                       cl::NullRange, nullptr,
+                                       profile_event(context,
+                                           "out_transform_fused_bias"));
         }
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve3: " << e.what() << ": "
@@ -773,87 +903,106 @@ void OpenCL_Network::convolve3(int channels, int outputs,
     }
 }
 
-void OpenCL_Network::convolve1(int channels, int outputs,
-                              cl::Buffer& bufferInput,
-                              cl::Buffer& bufferOutput,
-                              cl::Buffer& bufferMerge,
-                              weight_slice_t weights) {
-    // fixed for 8x8
-    constexpr int width = 8;
-    constexpr int height = 8;
-    constexpr int boardsize = width * height;
-    constexpr int rowTiles = 8;
-
-    // Input channel grouping in multiples of 8
-    constexpr int channelGroup = 8;
-    constexpr int channelShift = 3;
-    constexpr int rowGroup = 1;
-    size_t outputGroup = std::min(outputs, 32);
-
-    auto m_convolve_kernel = &opencl_thread_data.m_convolve1_kernel;
-
-#ifndef NDEBUG
-    // Total output size after reducing
-    size_t outSize = width * height * outputs * sizeof(net_t);
-
-    // Produce channel * output planes and merge them at the end
-    size_t mergeSize = (channels >> channelShift) * outSize;
-    assert(mergeSize <= bufferMerge.getInfo<CL_MEM_SIZE>());
-#endif
+void OpenCL_Network::pack_input(const Network::NNPlanes& planes,
+                                size_t channels, void* packed) {
+    constexpr auto all_squares = ~std::uint64_t{0};
+    auto masks = static_cast<std::uint64_t*>(packed);
+    auto values = reinterpret_cast<float*>(masks + channels);
+    for (auto c = size_t{0}; c < channels - 3; c++) {
+        masks[c] = planes.bit[c].to_ullong();
+        values[c] = 1.0f;
+    }
+    // The rule50 count, the move count and the edge of the board fill
+    // their planes, like in Network::get_input_data().
+    masks[channels - 3] = all_squares;
+    values[channels - 3] = float(planes.rule50_count);
+    masks[channels - 2] = all_squares;
+    values[channels - 2] = float(planes.move_count);
+    masks[channels - 1] = all_squares;
+    values[channels - 1] = Network::get_format_version() == 1 ? 0.0f : 1.0f;
+}
 
-    // Copy the rows locally
-    size_t stripSize = width * sizeof(float);
+size_t OpenCL_Network::packed_input_size(size_t channels) {
+    // Padded so the masks of the next position are aligned.
+    return ceilMultiple(channels * (sizeof(std::uint64_t) + sizeof(float)),
+                        sizeof(std::uint64_t));
+}
 
-    int rowBuffer = std::min<int>(channelGroup, 7);
-    size_t rowSize = channelGroup * outputGroup * rowBuffer * sizeof(float);
+void OpenCL_Network::expand_input(ExecutionContext& context, int channels,
+                                  int batch_size,
+                                  cl::Buffer& bufferPacked,
+                                  cl::Buffer& bufferOutput) {
+    constexpr int boardsize = 8 * 8;
 
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
+    cl::Kernel & expand_kernel = context.m_expand_input_kernel;
+    cl::CommandQueue & queue = context.m_commandqueue;
 
     try {
-        m_convolve_kernel->setArg(0, bufferInput);
-        m_convolve_kernel->setArg(1, bufferMerge);
-        m_convolve_kernel->setArg(2, weights[0]);
-        m_convolve_kernel->setArg(3, cl::Local(stripSize * channelGroup * rowGroup));
-        m_convolve_kernel->setArg(4, cl::Local(rowSize));
-
-        queue.enqueueNDRangeKernel(*m_convolve_kernel, cl::NullRange,
-                                   cl::NDRange(channels, outputs, rowTiles),
-                                   cl::NDRange(channelGroup, outputGroup, rowGroup));
+        expand_kernel.setArg(0, bufferPacked);
+        expand_kernel.setArg(1, bufferOutput);
+
+        queue.enqueueNDRangeKernel(expand_kernel, cl::NullRange,
+                                   cl::NDRange(channels, boardsize,
+                                               batch_size),
+                                   cl::NDRange(1, boardsize, 1), nullptr,
+                                   profile_event(context, "expand_input"));
     } catch (const cl::Error &e) {
-        std::cerr << "Error in convolve1: " << e.what() << ": "
+        std::cerr << "Error in expand_input: " << e.what() << ": "
 	        << e.err() << std::endl;
         throw;
     }
+}
 
-    cl::Kernel & merge_kernel = opencl_thread_data.m_merge_kernel;
-    assert(channels % (1 << channelShift) == 0);
+void OpenCL_Network::heads(ExecutionContext& context,
+                           int channels,
+                           int pol_outputs, int val_outputs,
+                           int batch_size,
+                           cl::Buffer& bufferInput,
+                           cl::Buffer& bufferOutput,
+                           weight_slice_t pol_weights,
+                           weight_slice_t val_weights) {
+    // fixed for 8x8
+    constexpr int width = 8;
+    constexpr int height = 8;
+    constexpr int boardsize = width * height;
+
+    cl::Kernel & heads_kernel = context.m_heads_kernel;
+    cl::CommandQueue & queue = context.m_commandqueue;
 
     try {
-        merge_kernel.setArg(0, bufferMerge);
-        merge_kernel.setArg(1, bufferOutput);
-        merge_kernel.setArg(2, channels >> channelShift);
-        merge_kernel.setArg(3, weights[1]);
-        merge_kernel.setArg(4, weights[2]);
-
-        queue.enqueueNDRangeKernel(merge_kernel, cl::NullRange,
-                                   cl::NDRange(outputs, boardsize),
-                                   cl::NDRange(std::min(8, outputs), 8));
+        heads_kernel.setArg(0, bufferInput);
+        heads_kernel.setArg(1, bufferOutput);
+        heads_kernel.setArg(2, pol_weights[0]);
+        heads_kernel.setArg(3, pol_weights[1]);
+        heads_kernel.setArg(4, val_weights[0]);
+        heads_kernel.setArg(5, val_weights[1]);
+        heads_kernel.setArg(6, channels);
+        heads_kernel.setArg(7, pol_outputs);
+
+        queue.enqueueNDRangeKernel(heads_kernel, cl::NullRange,
+                                   cl::NDRange(pol_outputs + val_outputs,
+                                               boardsize, batch_size),
+                                   cl::NDRange(1, boardsize, 1), nullptr,
+                                   profile_event(context, "convolve1_heads"));
     } catch (const cl::Error &e) {
-        std::cerr << "Error in merge: " << e.what() << ": "
+        std::cerr << "Error in heads: " << e.what() << ": "
 	        << e.err() << std::endl;
         throw;
     }
 }
 
-void OpenCL_Network::innerproduct(cl::Buffer& input,
+void OpenCL_Network::innerproduct(ExecutionContext& context,
+                  cl::Buffer& input,
+                  const int input_offset,
                   weight_slice_t weights,
                   weight_slice_t biases,
                   cl::Buffer& output,
+                  const int output_offset,
                   const int inputs, const int outputs,
                   const int relu) {
 
-    auto sgemv_kernel = opencl_thread_data.m_sgemv_kernel;
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
+    auto& sgemv_kernel = context.m_sgemv_kernel;
+    cl::CommandQueue & queue = context.m_commandqueue;
 
     //TODO: Tune these
     size_t wgs1 = 64;
@@ -871,15 +1020,16 @@ void OpenCL_Network::innerproduct(cl::Buffer& input,
         sgemv_kernel.setArg(3, static_cast<int>(0));
         sgemv_kernel.setArg(4, static_cast<int>(inputs));
         sgemv_kernel.setArg(5, input);
-        sgemv_kernel.setArg(6, static_cast<int>(0));
+        sgemv_kernel.setArg(6, static_cast<int>(input_offset));
         sgemv_kernel.setArg(7, output);
-        sgemv_kernel.setArg(8, static_cast<int>(0));
+        sgemv_kernel.setArg(8, static_cast<int>(output_offset));
         sgemv_kernel.setArg(9, biases[0]);
         sgemv_kernel.setArg(10, static_cast<int>(relu));
 
         queue.enqueueNDRangeKernel(sgemv_kernel, cl::NullRange,
                                    cl::NDRange(global_size),
-                                   cl::NDRange(local_size));
+                                   cl::NDRange(local_size), nullptr,
+                                   profile_event(context, "Xgemv"));
     } catch (const cl::Error &e) {
         std::cerr << "Error in innerproduct: " << e.what() << ": "
 	        << e.err() << std::endl;
@@ -887,6 +1037,83 @@ void OpenCL_Network::innerproduct(cl::Buffer& input,
     }
 }
 
+cl::Event* OpenCL_Network::profile_event(ExecutionContext& context,
+                                         const char* name) {
+    if (!cfg_opencl_profile) {
+        return nullptr;
+    }
+    // The command sets the event before the next one is added.
+    context.m_profiled.push_back({name, context.m_profile_layer, cl::Event()});
+    return &context.m_profiled.back().event;
+}
+
+void OpenCL_Network::add_profile(ExecutionContext& context, int batch_size) {
+    std::lock_guard<std::mutex> lock(m_profile_mutex);
+    m_layer_profile.resize(m_layers.size());
+    for (const auto& command : context.m_profiled) {
+        // Nanoseconds of the device clock.
+        const auto start =
+            command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        const auto end =
+            command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        const auto us = (end - start) / 1000.0;
+        auto& layer = m_layer_profile[command.layer];
+        layer.total_us += us;
+        layer.count++;
+        auto& kernel = m_kernel_profile[command.name];
+        kernel.total_us += us;
+        kernel.count++;
+    }
+    m_profiled_batches++;
+    m_profiled_positions += batch_size;
+}
+
+void OpenCL_Network::dump_profile(const std::string& device) {
+    std::lock_guard<std::mutex> lock(m_profile_mutex);
+    if (!m_profiled_batches) {
+        return;
+    }
+    const auto batches = double(m_profiled_batches);
+    auto total_us = 0.0;
+    for (const auto& layer : m_layer_profile) {
+        total_us += layer.total_us;
+    }
+    total_us = std::max(total_us, 1e-9);
+
+    myprintf("OpenCL profile of %s: %lld batches, %.1f positions and "
+             "%.1f us on the device per batch\n",
+             device.c_str(), (long long)m_profiled_batches,
+             m_profiled_positions / batches, total_us / batches);
+    for (auto i = size_t{0}; i < m_layer_profile.size(); i++) {
+        const auto& time = m_layer_profile[i];
+        if (!time.count) {
+            continue;
+        }
+        const auto& layer = m_layers[i];
+        const auto name = layer.is_input_convolution ? std::string("input")
+                          : layer.is_residual_block
+                              ? "residual " + std::to_string(i)
+                              : std::string("heads");
+        myprintf("  layer  %-28s %10.1f us per batch %5.1f%%\n",
+                 name.c_str(), time.total_us / batches,
+                 100.0 * time.total_us / total_us);
+    }
+    for (const auto& kernel : m_kernel_profile) {
+        const auto& time = kernel.second;
+        myprintf("  kernel %-28s %10.1f us per batch %5.1f%%, "
+                 "%.1f us per call\n",
+                 kernel.first.c_str(), time.total_us / batches,
+                 100.0 * time.total_us / total_us,
+                 time.total_us / time.count);
+    }
+
+    // The next dump covers the next search.
+    m_layer_profile.clear();
+    m_kernel_profile.clear();
+    m_profiled_batches = 0;
+    m_profiled_positions = 0;
+}
+
 template<class T>
 static std::string opencl_dev_type_to_string(T type) {
     if (type == CL_DEVICE_TYPE_CPU) {
@@ -996,6 +1223,32 @@ std::vector<size_t> OpenCL::get_sgemm_tuners(void) {
     return tuners;
 }
 
+size_t OpenCL::get_element_size() const {
+    return m_use_half ? sizeof(std::uint16_t) : sizeof(float);
+}
+
+void OpenCL::to_device(const float* src, void* dst, size_t count) const {
+    if (!m_use_half) {
+        std::memcpy(dst, src, count * sizeof(float));
+        return;
+    }
+    auto half_dst = static_cast<std::uint16_t*>(dst);
+    for (auto i = size_t{0}; i < count; i++) {
+        half_dst[i] = float_to_half(src[i]);
+    }
+}
+
+void OpenCL::from_device(const void* src, float* dst, size_t count) const {
+    if (!m_use_half) {
+        std::memcpy(dst, src, count * sizeof(float));
+        return;
+    }
+    auto half_src = static_cast<const std::uint16_t*>(src);
+    for (auto i = size_t{0}; i < count; i++) {
+        dst[i] = half_to_float(half_src[i]);
+    }
+}
+
 void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
                         bool silent) {
     std::vector<cl::Platform> platforms;
@@ -1101,6 +1354,17 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
         trim(best_device.getInfo<CL_DEVICE_NAME>()).c_str());
     myprintf("with OpenCL %2.1f capability.\n", best_version);
 
+    if (cfg_use_half) {
+        auto extensions = best_device.getInfo<CL_DEVICE_EXTENSIONS>();
+        if (boost::contains(extensions, "cl_khr_fp16")) {
+            m_use_half = true;
+            myprintf("Using half precision.\n");
+        } else {
+            myprintf("Device doesn't support cl_khr_fp16, "
+                     "using single precision.\n");
+        }
+    }
+
     cl::Context context;
     try {
         context = cl::Context(best_device);
@@ -1115,7 +1379,8 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
     try {
         m_program = cl::Program(m_context,
                                   sourceCode_config
-                                + sourceCode_convolve1
+                                + sourceCode_input
+                                + sourceCode_heads
                                 + sourceCode_convolve3
                                 + sourceCode_sgemm
                                 + sourceCode_sgemv);
@@ -1125,21 +1390,36 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
     }
 
     m_cl_args = cl_args;
+    if (m_use_half) {
+        m_cl_args += " -DUSE_HALF -DPRECISION=16";
+    }
 
+    // The tiles of all positions of a batch are columns of the same GEMMs,
+    // so they are tuned for the batches the search sends.
+    const auto positions = std::max(cfg_batch_size, 1);
     auto t = Tuner(*this, m_context, m_device);
+    m_winograd_m = t.load_winograd_m(channels, positions);
     auto sgemm_tuners =
-        t.load_sgemm_tuners(channels, WINOGRAD_P, channels, WINOGRAD_TILE);
+        t.load_sgemm_tuners(channels, winograd_p(m_winograd_m) * positions,
+                            channels, winograd_tile(m_winograd_m));
 
-    // Exit immediately after tuning. Some NVIDIA drivers are buggy
-    // and will fail to compile the rest of the kernels after a tuning
-    // run. See #729.
+    // Don't build the kernels after a tuning run, the scheduler exits
+    // once all devices are tuned. The GEMMs have a different shape for
+    // every batch size, so a tuning run also covers the powers of two
+    // below --batchsize, for a tuning database shared by other setups.
     if (cfg_tune_only) {
-        exit(EXIT_SUCCESS);
+        for (auto batch = 1; batch < positions; batch *= 2) {
+            const auto m = t.load_winograd_m(channels, batch);
+            t.load_sgemm_tuners(channels, winograd_p(m) * batch,
+                                channels, winograd_tile(m));
+        }
+        return;
     }
 
     // Build program for these specific devices
     try {
-        std::string args = cl_args;
+        std::string args = m_cl_args;
+        args += " -DWINOGRAD_M=" + std::to_string(m_winograd_m);
         args += sgemm_tuners;
         m_program.build(args.c_str());
     } catch (const cl::Error&) {
@@ -1148,11 +1428,10 @@ void OpenCL::initialize(const int channels, const std::vector<int> & gpus,
         throw std::runtime_error("Error building OpenCL kernels.");
     }
 
-    ensure_thread_initialized();
     process_tuners(sgemm_tuners);
 
     m_wavefront_size =
-        opencl_thread_data.m_sgemm_kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
+        cl::Kernel(m_program, "XgemmBatched").getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
             best_device);
     myprintf("Wavefront/Warp size: %d\n", m_wavefront_size);
 
@@ -1179,4 +1458,8 @@ std::string OpenCL::get_device_name() {
 
     return ss.str();
 }
+
+std::string OpenCL::get_driver_version() {
+    return trim(m_device.getInfo<CL_DRIVER_VERSION>());
+}
 #endif
@@ -25,16 +25,27 @@
 #define CL_HPP_TARGET_OPENCL_VERSION    120
 #define CL_HPP_ENABLE_EXCEPTIONS
 #include <CL/cl2.hpp>
+#include <array>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
 #include <mutex>
 
+#include "Network.h"
 #include "Tuner.h"
 
-static constexpr auto WINOGRAD_P = 8 * 8 / 4;
-static constexpr auto WINOGRAD_TILE = 4 * 4;
+// The F(m x m, 3x3) winograd convolutions, m is 2 or 4, cover the board
+// with winograd_p(m) tiles that are transformed to winograd_tile(m) values.
+static constexpr int winograd_p(const int m) {
+    return ((8 + m - 1) / m) * ((8 + m - 1) / m);
+}
+static constexpr int winograd_tile(const int m) {
+    return (m + 2) * (m + 2);
+}
 
 class OpenCL;
 
@@ -53,26 +64,49 @@ private:
     std::vector<cl::Buffer> weights;
 };
 
-class ThreadData {
+// The command queues, kernels and scratch buffers to run a batch. A network
+// keeps a few of them, and a thread borrows one for each batch it evaluates,
+// so the device memory doesn't grow with the number of search threads.
+class ExecutionContext {
     friend class OpenCL;
     friend class OpenCL_Network;
 private:
-    bool m_is_initialized{false};
     cl::CommandQueue m_commandqueue;
-    cl::Kernel m_convolve1_kernel;
-    cl::Kernel m_merge_kernel;
+    cl::Kernel m_expand_input_kernel;
+    cl::Kernel m_heads_kernel;
     cl::Kernel m_in_transform_kernel;
     cl::Kernel m_sgemm_kernel;
     cl::Kernel m_sgemv_kernel;
-    cl::Kernel m_out_transform_bn_kernel;
-    cl::Kernel m_out_transform_bn_in_kernel;
+    cl::Kernel m_out_transform_bias_kernel;
+    cl::Kernel m_out_transform_bias_in_kernel;
     cl::Buffer m_inBuffer;
     cl::Buffer m_inBuffer2;
     cl::Buffer m_VBuffer;
     cl::Buffer m_MBuffer;
-    cl::Buffer m_pinnedOutBuffer_pol;
-    cl::Buffer m_pinnedOutBuffer_val;
-    bool m_buffers_allocated{false};
+    // Packed input planes of the batch on the device and their pinned,
+    // mapped staging buffer.
+    cl::Buffer m_inputBuffer;
+    cl::Buffer m_pinnedInBuffer;
+    void* m_pinnedIn{nullptr};
+    // The input planes expanded from m_inputBuffer.
+    cl::Buffer m_expandedInput;
+    // Outputs of the whole batch on the device and their pinned copy,
+    // the policy and then the value of each position.
+    cl::Buffer m_outBuffer;
+    cl::Buffer m_pinnedOutBuffer;
+    void* m_pinnedOut{nullptr};
+    // Number of positions the buffers can hold.
+    int m_buffers_batch_size{0};
+
+    // With cfg_opencl_profile, the commands of the batch being computed
+    // and the layer they belong to, for their device times.
+    struct ProfiledCommand {
+        const char* name;
+        size_t layer;
+        cl::Event event;
+    };
+    std::vector<ProfiledCommand> m_profiled;
+    size_t m_profile_layer{0};
 };
 
 class OpenCL_Network {
@@ -86,12 +120,10 @@ public:
                        unsigned int channels,
                        unsigned int outputs,
                        const std::vector<float>& weights,
-                       const std::vector<float>& means,
-                       const std::vector<float>& variances) {
+                       const std::vector<float>& biases) {
         size_t layer = get_layer_count();
         push_weights(layer, weights);
-        push_weights(layer, means);
-        push_weights(layer, variances);
+        push_weights(layer, biases);
         m_layers[layer].is_input_convolution = true;
         m_layers[layer].outputs = outputs;
         m_layers[layer].filter_size = filter_size;
@@ -102,18 +134,14 @@ public:
                        unsigned int channels,
                        unsigned int outputs,
                        const std::vector<float>& weights_1,
-                       const std::vector<float>& means_1,
-                       const std::vector<float>& variances_1,
+                       const std::vector<float>& biases_1,
                        const std::vector<float>& weights_2,
-                       const std::vector<float>& means_2,
-                       const std::vector<float>& variances_2) {
+                       const std::vector<float>& biases_2) {
         size_t layer = get_layer_count();
         push_weights(layer, weights_1);
-        push_weights(layer, means_1);
-        push_weights(layer, variances_1);
+        push_weights(layer, biases_1);
         push_weights(layer, weights_2);
-        push_weights(layer, means_2);
-        push_weights(layer, variances_2);
+        push_weights(layer, biases_2);
         m_layers[layer].is_residual_block = true;
         m_layers[layer].outputs = outputs;
         m_layers[layer].filter_size = filter_size;
@@ -125,14 +153,12 @@ public:
                        unsigned int ip_in,
                        unsigned int ip_out,
                        const std::vector<float>& weights,
-                       const std::vector<float>& means,
-                       const std::vector<float>& variances,
+                       const std::vector<float>& biases,
                        const std::vector<float>& fc_w,
                        const std::vector<float>& fc_b) {
         size_t layer = get_layer_count();
         push_weights(layer, weights);
-        push_weights(layer, means);
-        push_weights(layer, variances);
+        push_weights(layer, biases);
         push_weights(layer, fc_w);
         push_weights(layer, fc_b);
         m_layers[layer].is_policy = true;
@@ -147,14 +173,12 @@ public:
                        unsigned int ip_in,
                        unsigned int ip_out,
                        const std::vector<float>& weights,
-                       const std::vector<float>& means,
-                       const std::vector<float>& variances,
+                       const std::vector<float>& biases,
                        const std::vector<float>& fc_w,
                        const std::vector<float>& fc_b) {
         size_t layer = get_layer_count();
         push_weights(layer, weights);
-        push_weights(layer, means);
-        push_weights(layer, variances);
+        push_weights(layer, biases);
         push_weights(layer, fc_w);
         push_weights(layer, fc_b);
         m_layers[layer].is_value = true;
@@ -168,9 +192,14 @@ public:
         return m_layers.size();
     }
 
-    void forward(const std::vector<net_t>& input,
+    void forward(const std::vector<Network::NNPlanes>& input,
             std::vector<net_t>& output_pol,
-            std::vector<net_t>& output_val);
+            std::vector<net_t>& output_val,
+            const int batch_size = 1);
+
+    // Print the average device time per batch of every layer and kernel
+    // since the last call, with cfg_opencl_profile.
+    void dump_profile(const std::string& device);
 
 private:
     using weight_slice_t = std::vector<cl::Buffer>::const_iterator;
@@ -180,37 +209,89 @@ private:
     }
     void add_weights(size_t layer, size_t size, const float* weights);
 
-    void convolve3(int channels, int outputs,
+    // Waits for a free context if all cfg_gpu_contexts of them are in use.
+    ExecutionContext& acquire_context();
+    void release_context(ExecutionContext& context);
+
+    // (Re)allocates the scratch buffers of the context for batch_size
+    // positions.
+    void allocate_buffers(ExecutionContext& context, size_t input_channels,
+                          int batch_size);
+
+    void convolve3(ExecutionContext& context,
+                    int channels, int outputs, int batch_size,
                     cl::Buffer& bufferIn,
                     cl::Buffer& bufferOut,
                     cl::Buffer& bufferV,
                     cl::Buffer& bufferM, weight_slice_t weights,
                     cl::Buffer* bufferResidual,
-                    weight_slice_t bn_weights,
+                    weight_slice_t biases,
                     bool skip_in_transform,
                     bool fuse_in_transform, bool store_inout);
 
-    void convolve1(int channels, int outputs,
-                  cl::Buffer& bufferInput,
-                  cl::Buffer& bufferOutput,
-                  cl::Buffer& bufferMerge,
-                  weight_slice_t weights);
-
-    void innerproduct(cl::Buffer& input,
+    // Packs the input planes of a position into a 64 bit mask of the set
+    // squares and the value of those squares for each plane, so the upload
+    // is a fraction of the size of the planes. The bit planes are the
+    // masks already, nothing is expanded on the host.
+    static void pack_input(const Network::NNPlanes& planes, size_t channels,
+                           void* packed);
+    // Bytes a position takes in the packed upload.
+    static size_t packed_input_size(size_t channels);
+    // Expands the planes packed by pack_input() on the device.
+    void expand_input(ExecutionContext& context, int channels,
+                      int batch_size,
+                      cl::Buffer& bufferPacked,
+                      cl::Buffer& bufferOutput);
+
+    // The 1x1 convolutions of the policy and value heads.
+    void heads(ExecutionContext& context,
+               int channels, int pol_outputs, int val_outputs,
+               int batch_size,
+               cl::Buffer& bufferInput,
+               cl::Buffer& bufferOutput,
+               weight_slice_t pol_weights,
+               weight_slice_t val_weights);
+
+    void innerproduct(ExecutionContext& context,
+                  cl::Buffer& input,
+                  const int input_offset,
                   weight_slice_t weights,
                   weight_slice_t biases,
                   cl::Buffer& output,
+                  const int output_offset,
                   const int inputs, const int outputs,
                   const int relu);
 
+    // The event to time a command of the current layer with, or nullptr
+    // when not profiling.
+    cl::Event* profile_event(ExecutionContext& context, const char* name);
+    // Adds up the device times of the commands of a finished batch.
+    void add_profile(ExecutionContext& context, int batch_size);
+
     OpenCL & m_opencl;
 
     // this mutex is not required for correctness, but this exists simply
-    // because queue.finish() is a busy wait and having a lot of threads
-    // waiting here is counterproductive CPU-wise.  At least std::mutex
-    // isn't busy wait so it should be better.
+    // because waiting for the queue is usually a busy wait and having a
+    // lot of threads waiting here is counterproductive CPU-wise.  At least
+    // std::mutex isn't busy wait so it should be better.
     std::mutex m_queue_finish_mutex;
     std::vector<Layer> m_layers;
+
+    // Created on demand, up to cfg_gpu_contexts.
+    std::vector<std::unique_ptr<ExecutionContext>> m_contexts;
+    std::vector<ExecutionContext*> m_free_contexts;
+    std::mutex m_contexts_mutex;
+    std::condition_variable m_contexts_cv;
+
+    struct ProfileTime {
+        double total_us{0.0};
+        int64_t count{0};
+    };
+    std::mutex m_profile_mutex;
+    std::vector<ProfileTime> m_layer_profile;
+    std::map<std::string, ProfileTime> m_kernel_profile;
+    int64_t m_profiled_batches{0};
+    int64_t m_profiled_positions{0};
 };
 
 class OpenCL {
@@ -219,10 +300,15 @@ class OpenCL {
 public:
     void initialize(const int channels, const std::vector<int> & gpus,
                     bool silent = false);
-    void ensure_thread_initialized(void);
+    void initialize_context(ExecutionContext& context);
     std::string get_device_name();
+    std::string get_driver_version();
 
     std::vector<size_t> get_sgemm_tuners(void);
+    // Output tile of the winograd convolutions, 2 or 4, picked by the Tuner.
+    int get_winograd_m() const {
+        return m_winograd_m;
+    }
 
     cl::Device m_device;
     cl::Context m_context;
@@ -230,6 +316,12 @@ private:
     void tune_sgemm(void);
     void process_tuners(std::string tuners);
 
+    // Size of one element in device memory, 2 bytes in half precision.
+    size_t get_element_size() const;
+    // Convert count values between the host floats and the device format.
+    void to_device(const float* src, void* dst, size_t count) const;
+    void from_device(const void* src, float* dst, size_t count) const;
+
     cl::Program m_program;
     std::string m_cl_args;
 
@@ -239,13 +331,17 @@ private:
         size_t mdimc, ndimc;
     };
     sgemm_tuners m_sgemm_tuners;
+    int m_winograd_m{2};
     size_t m_wavefront_size{0};
     size_t m_max_workgroup_size{0};
     std::vector<size_t> m_max_workgroup_dims;
+    // Weights and activations are stored as half floats on the device.
+    bool m_use_half{false};
     bool m_init_ok{false};
 };
 
-extern thread_local ThreadData opencl_thread_data;
+extern const std::string sourceCode_config;
+extern const std::string sourceCode_convolve3;
 extern const std::string sourceCode_sgemm;
 
 #endif
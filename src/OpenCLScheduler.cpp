@@ -18,41 +18,64 @@
 #include "config.h"
 
 #ifdef USE_OPENCL
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <thread>
+
 #include "Random.h"
 #include "OpenCLScheduler.h"
 #include "Parameters.h"
+#include "SMP.h"
+#include "Utils.h"
+
+using namespace Utils;
 
-thread_local auto current_thread_gpu_num = size_t{0};
 OpenCLScheduler opencl;
 
-void OpenCLScheduler::initialize(const int channels) {
+OpenCLScheduler::~OpenCLScheduler() {
+    for (auto& queue : m_queues) {
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->exit = true;
+        }
+        queue->cv.notify_all();
+        if (queue->worker.joinable()) {
+            queue->worker.join();
+        }
+    }
+}
+
+void OpenCLScheduler::initialize(const int channels, const int cpu_workers,
+                                 CpuForward cpu_forward) {
     // multi-gpu?
     if (!cfg_gpus.empty()) {
-        auto silent{false};
-        for(auto gpu : cfg_gpus) {
-            auto opencl = std::make_unique<OpenCL>();
-            auto net = std::make_unique<OpenCL_Network>(*opencl);
-            opencl->initialize(channels, {gpu}, silent);
-            m_opencl.push_back(std::move(opencl));
-            m_networks.push_back(std::move(net));
-
-            // Clear thread data on every init call.  We don't know which GPU
-            // this thread will be eventually be assigned to
-            opencl_thread_data = ThreadData();
-
-            // starting next GPU, let's not dump full list of GPUs
-            silent = true;
-        }
-
-        for(size_t gnum = 0; gnum < m_networks.size(); gnum++) {
-            // launch the worker thread.  2 threads so that we can fully
-            // utilize GPU, since the worker thread consists of some CPU
-            // work for task preparation.
-            constexpr auto num_threads = 2;
-            for(auto i = 0; i < num_threads; i++) {
-                m_threadpool.add_thread([gnum] {
-                    current_thread_gpu_num = gnum;
-                });
+        // Tuning and building the kernels can take minutes per device, so
+        // the devices are initialized in parallel. Identical devices share
+        // one tuning, see Tuner::load_sgemm_tuners().
+        auto threads = std::vector<std::thread>{};
+        auto errors = std::vector<std::exception_ptr>(cfg_gpus.size());
+        for (size_t i = 0; i < cfg_gpus.size(); i++) {
+            m_opencl.push_back(std::make_unique<OpenCL>());
+            m_networks.push_back(
+                std::make_unique<OpenCL_Network>(*m_opencl.back()));
+        }
+        for (size_t i = 0; i < cfg_gpus.size(); i++) {
+            threads.emplace_back([this, channels, i, &errors] {
+                try {
+                    // Only the first one lists the devices.
+                    m_opencl[i]->initialize(channels, {cfg_gpus[i]}, i > 0);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (const auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
             }
         }
     } else {
@@ -63,20 +86,313 @@ void OpenCLScheduler::initialize(const int channels) {
         m_opencl.push_back(std::move(opencl));
         m_networks.push_back(std::move(net));
     }
+
+    // Exit immediately after tuning. Some NVIDIA drivers are buggy
+    // and will fail to compile the rest of the kernels after a tuning
+    // run. See #729.
+    if (cfg_tune_only) {
+        exit(EXIT_SUCCESS);
+    }
+
+    m_cpu_forward = std::move(cpu_forward);
+    auto devices = m_networks.size();
+    if (m_cpu_forward) {
+        devices += cpu_workers;
+        if (cpu_workers > 0) {
+            myprintf("Evaluating on %d CPU worker(s) too.\n", cpu_workers);
+        }
+    }
+    // A single GPU is used by the search threads directly.
+    if (devices == 1) {
+        return;
+    }
+    for (size_t gnum = 0; gnum < devices; gnum++) {
+        m_queues.push_back(std::make_unique<DeviceQueue>());
+    }
+    // launch the worker threads, one per device.
+    for (size_t gnum = 0; gnum < devices; gnum++) {
+        m_queues[gnum]->worker = std::thread([this, gnum] {
+            SMP::pin_thread();
+            worker(gnum);
+        });
+    }
 }
 
-void OpenCLScheduler::forward(const std::vector<net_t>& input,
+void OpenCLScheduler::forward(const std::vector<Network::NNPlanes>& input,
                               std::vector<net_t>& output_pol,
-                              std::vector<net_t>& output_val) {
-    if (m_networks.size() == 1) {
-        m_networks[0]->forward(input, output_pol, output_val);
+                              std::vector<net_t>& output_val,
+                              const int batch_size) {
+    if (m_queues.empty()) {
+        m_networks[0]->forward(input, output_pol, output_val, batch_size);
         return;
     }
 
-    auto f = m_threadpool.add_task([this, &input, &output_pol, &output_val]{
-        m_networks[current_thread_gpu_num]->forward(input, output_pol, output_val);
-    });
+    // Split a batch into one slice per device, so that they all finish
+    // at the same time T. A device that is done with its backlog after t
+    // gets rate * (T - t) positions, and sits out if t is after T.
+    const auto pol_size = output_pol.size() / batch_size;
+    const auto val_size = output_val.size() / batch_size;
+    const auto rates = get_rates();
+    auto backlogs = std::vector<float>{};
+    for (const auto& queue : m_queues) {
+        backlogs.push_back(get_backlog(*queue));
+    }
+    auto active = std::vector<bool>(m_queues.size(), true);
+    auto finish = 0.0f;
+    for (auto changed = true; changed; ) {
+        auto rate_sum = 0.0f;
+        auto work_sum = 0.0f;
+        for (size_t gnum = 0; gnum < m_queues.size(); gnum++) {
+            if (active[gnum]) {
+                rate_sum += rates[gnum];
+                work_sum += rates[gnum] * backlogs[gnum];
+            }
+        }
+        finish = (batch_size + work_sum) / rate_sum;
+        changed = false;
+        for (size_t gnum = 0; gnum < m_queues.size(); gnum++) {
+            if (active[gnum] && backlogs[gnum] >= finish) {
+                active[gnum] = false;
+                changed = true;
+            }
+        }
+    }
+    auto sizes = std::vector<int>(m_queues.size());
+    auto assigned = 0;
+    auto largest = size_t{0};
+    for (size_t gnum = 0; gnum < m_queues.size(); gnum++) {
+        if (active[gnum]) {
+            sizes[gnum] = static_cast<int>(rates[gnum] * (finish - backlogs[gnum]));
+            assigned += sizes[gnum];
+            if (sizes[gnum] > sizes[largest]) {
+                largest = gnum;
+            }
+        }
+    }
+    // What rounding left over goes to the largest slice.
+    sizes[largest] += batch_size - assigned;
+
+    auto tasks = std::vector<ForwardTask>(m_queues.size());
+    auto results = std::vector<std::future<void>>{};
+    auto start = 0;
+    for (size_t gnum = 0; gnum < m_queues.size(); gnum++) {
+        if (sizes[gnum] == 0) {
+            continue;
+        }
+        auto& task = tasks[gnum];
+        task.input = input.data() + start;
+        task.output_pol = output_pol.data() + start * pol_size;
+        task.output_val = output_val.data() + start * val_size;
+        task.batch_size = sizes[gnum];
+        task.pol_size = pol_size;
+        task.val_size = val_size;
+        results.emplace_back(enqueue(task, gnum));
+        start += sizes[gnum];
+    }
+    // The tasks live on our stack, so make sure every device is done
+    // with them before an error can propagate.
+    for (auto& result : results) {
+        result.wait();
+    }
+    for (auto& result : results) {
+        result.get();
+    }
+}
+
+std::vector<float> OpenCLScheduler::get_rates() const {
+    auto rates = std::vector<float>{};
+    auto sum = 0.0f;
+    auto measured = 0;
+    for (const auto& queue : m_queues) {
+        rates.push_back(queue->rate);
+        if (rates.back() > 0.0f) {
+            sum += rates.back();
+            measured++;
+        }
+    }
+    const auto average = measured ? sum / measured : 1.0f;
+    for (auto& rate : rates) {
+        if (rate <= 0.0f) {
+            rate = average;
+        }
+    }
+    return rates;
+}
+
+float OpenCLScheduler::get_backlog(const DeviceQueue& queue) const {
+    const auto rate = queue.rate.load();
+    return rate > 0.0f ? queue.pending / rate : 0.0f;
+}
 
-    f.get();
+std::future<void> OpenCLScheduler::enqueue(ForwardTask& task, size_t gnum) {
+    auto& queue = *m_queues[gnum];
+    queue.pending += task.batch_size;
+
+    auto result = task.prom.get_future();
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(&task);
+        queue.queued += task.batch_size;
+    }
+    queue.cv.notify_one();
+    return result;
+}
+
+void OpenCLScheduler::worker(size_t gnum) {
+    auto& queue = *m_queues[gnum];
+    auto tasks = std::vector<ForwardTask*>{};
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.cv.wait(lock, [&queue] {
+                return queue.exit || !queue.tasks.empty();
+            });
+            if (queue.exit) {
+                return;
+            }
+            // Take everything that piled up while the GPU was busy.
+            tasks.assign(begin(queue.tasks), end(queue.tasks));
+            queue.tasks.clear();
+            queue.queued = 0;
+        }
+        run_tasks(gnum, tasks);
+        // Rather than go idle while another device has a backlog, help.
+        while (steal_tasks(gnum, tasks)) {
+            run_tasks(gnum, tasks);
+        }
+    }
+}
+
+bool OpenCLScheduler::steal_tasks(size_t gnum, std::vector<ForwardTask*>& tasks) {
+    auto& queue = *m_queues[gnum];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty() || queue.exit) {
+            return false;
+        }
+    }
+    // The batch a device is computing can't be taken, so the victim is
+    // picked by what is still queued, not by its whole backlog.
+    const auto rates = get_rates();
+    DeviceQueue* victim = nullptr;
+    auto victim_queued_time = 0.0f;
+    for (size_t other = 0; other < m_queues.size(); other++) {
+        const auto queued_time = m_queues[other]->queued / rates[other];
+        if (other != gnum && queued_time > victim_queued_time) {
+            victim = m_queues[other].get();
+            victim_queued_time = queued_time;
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+
+    // The victim will take whatever is queued at once when it is done with
+    // its current batch, so take the back half of it. A slow device only
+    // takes it if it would still be done first, and the victim is done
+    // with it at the end of its backlog.
+    const auto rate = queue.rate.load();
+    const auto backlog = get_backlog(*victim);
+    auto batch_size = 0;
+    tasks.clear();
+    {
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        const auto count = (victim->tasks.size() + 1) / 2;
+        const auto first = end(victim->tasks) - count;
+        for (auto it = first; it != end(victim->tasks); ++it) {
+            batch_size += (*it)->batch_size;
+        }
+        if (rate > 0.0f && batch_size / rate > backlog) {
+            return false;
+        }
+        tasks.assign(first, end(victim->tasks));
+        victim->tasks.erase(first, end(victim->tasks));
+        victim->queued -= batch_size;
+    }
+    queue.pending += batch_size;
+    victim->pending -= batch_size;
+    return !tasks.empty();
+}
+
+void OpenCLScheduler::run_tasks(size_t gnum, std::vector<ForwardTask*>& tasks) {
+    const auto& first = *tasks.front();
+    auto batch_size = 0;
+    for (auto task : tasks) {
+        batch_size += task->batch_size;
+    }
+
+    auto error = std::exception_ptr{};
+    try {
+        auto input = std::vector<Network::NNPlanes>{};
+        input.reserve(batch_size);
+        auto output_pol = std::vector<net_t>(batch_size * first.pol_size);
+        auto output_val = std::vector<net_t>(batch_size * first.val_size);
+
+        for (auto task : tasks) {
+            input.insert(end(input), task->input,
+                         task->input + task->batch_size);
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        if (gnum < m_networks.size()) {
+            m_networks[gnum]->forward(input, output_pol, output_val, batch_size);
+        } else {
+            m_cpu_forward(input, output_pol, output_val, batch_size);
+        }
+        const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+        auto& queue = *m_queues[gnum];
+        queue.positions += batch_size;
+        queue.batches++;
+        queue.busy_us += micros;
+        const auto rate = batch_size * 1000.0f / std::max<int64_t>(micros, 1);
+        const auto old_rate = queue.rate.load();
+        queue.rate = old_rate > 0.0f ? 0.8f * old_rate + 0.2f * rate : rate;
+
+        auto pos = size_t{0};
+        for (auto task : tasks) {
+            std::copy_n(begin(output_pol) + pos * task->pol_size,
+                        task->batch_size * task->pol_size, task->output_pol);
+            std::copy_n(begin(output_val) + pos * task->val_size,
+                        task->batch_size * task->val_size, task->output_val);
+            pos += task->batch_size;
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    m_queues[gnum]->pending -= batch_size;
+    // The tasks may be gone as soon as their promise is fulfilled.
+    for (auto task : tasks) {
+        if (error) {
+            task->prom.set_exception(error);
+        } else {
+            task->prom.set_value();
+        }
+    }
+}
+
+void OpenCLScheduler::dump_stats() {
+    for (size_t gnum = 0; gnum < m_queues.size(); gnum++) {
+        const auto& queue = *m_queues[gnum];
+        if (!queue.batches) {
+            continue;
+        }
+        const auto cpu = gnum >= m_networks.size();
+        const auto index = cpu ? gnum - m_networks.size() : gnum;
+        myprintf("OpenCLScheduler: %s %zu: %lld positions in %lld batches, "
+                 "%.1f positions/batch, %.1f positions/ms busy\n",
+                 cpu ? "CPU" : "GPU", index,
+                 (long long)queue.positions, (long long)queue.batches,
+                 double(queue.positions) / queue.batches,
+                 queue.busy_us ? queue.positions * 1000.0 / queue.busy_us : 0.0);
+    }
+}
+
+void OpenCLScheduler::dump_profile() {
+    for (size_t gnum = 0; gnum < m_networks.size(); gnum++) {
+        m_networks[gnum]->dump_profile("GPU " + std::to_string(gnum));
+    }
 }
 #endif
@@ -20,36 +20,100 @@
 #define OPENCL_SCHEDULER_H_INCLUDED
 #include "config.h"
 
-#include <vector>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
 
+#include "Network.h"
 #include "OpenCL.h"
-#include "ThreadPool.h"
 
 class OpenCLScheduler {
 public:
-    void initialize(const int channels);
+    // Evaluates a batch on the CPU, laid out like for forward().
+    using CpuForward = std::function<void(
+        const std::vector<Network::NNPlanes>& input,
+        std::vector<net_t>& output_pol,
+        std::vector<net_t>& output_val,
+        const int batch_size)>;
+
+    ~OpenCLScheduler();
+    // With @cpu_workers, that many threads running @cpu_forward are
+    // devices next to the GPUs and take their share of every batch.
+    void initialize(const int channels, const int cpu_workers = 0,
+                    CpuForward cpu_forward = nullptr);
     std::vector<std::unique_ptr<OpenCL_Network>> & get_networks() {
         return m_networks;
     }
-    void forward(const std::vector<net_t>& input,
+    void forward(const std::vector<Network::NNPlanes>& input,
                  std::vector<net_t>& output_pol,
-                 std::vector<net_t>& output_val);
+                 std::vector<net_t>& output_val,
+                 const int batch_size = 1);
+    // Print what every device evaluated so far.
+    void dump_stats();
+    // Print the device times of the OpenCL networks, see
+    // OpenCL_Network::dump_profile().
+    void dump_profile();
 private:
+    // One or more positions, stored contiguously like for forward().
     class ForwardTask {
     public:
-        const std::vector<net_t> *input;
-        std::vector<net_t> * output;
+        const Network::NNPlanes* input{nullptr};
+        net_t* output_pol{nullptr};
+        net_t* output_val{nullptr};
+        int batch_size{0};
+        // Per position sizes of the outputs.
+        size_t pol_size{0};
+        size_t val_size{0};
         std::promise<void> prom;
-        ForwardTask() : input(nullptr), output(nullptr) {}
-        ForwardTask(const std::vector<net_t> * in,
-                    std::vector<net_t> * out)
-            : input(in), output(out) {}
     };
 
+    // With more than one device, every device has its own queue and a
+    // worker thread that runs everything queued so far as one batch.
+    // The workers are bound to their device, but any of them can run any
+    // task, so an idle one steals from the others. The GPUs come first,
+    // the CPU workers after them.
+    class DeviceQueue {
+    public:
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<ForwardTask*> tasks;
+        // Positions queued or being computed, used to pick a device.
+        std::atomic<int> pending{0};
+        // Positions of the tasks still in the queue, which can be stolen.
+        std::atomic<int> queued{0};
+        // Positions per millisecond, a moving average over the batches,
+        // 0 until the first one.
+        std::atomic<float> rate{0.0f};
+        // Counters for dump_stats().
+        std::atomic<int64_t> positions{0};
+        std::atomic<int64_t> batches{0};
+        std::atomic<int64_t> busy_us{0};
+        bool exit{false};
+        std::thread worker;
+    };
+
+    void worker(size_t gnum);
+    void run_tasks(size_t gnum, std::vector<ForwardTask*>& tasks);
+    // When our own queue is empty, take tasks that are still waiting in
+    // the queue of the device that needs the longest to get through what
+    // is queued, if we finish them sooner. False if there are none.
+    bool steal_tasks(size_t gnum, std::vector<ForwardTask*>& tasks);
+    std::future<void> enqueue(ForwardTask& task, size_t gnum);
+    // The rate of every device, the average of the measured ones for the
+    // others, so that a device that hasn't run yet gets a fair share.
+    std::vector<float> get_rates() const;
+    // Milliseconds until the device is done with what it has.
+    float get_backlog(const DeviceQueue& queue) const;
+
     std::vector<std::unique_ptr<OpenCL_Network>> m_networks;
     std::vector<std::unique_ptr<OpenCL>> m_opencl;
-    Utils::ThreadPool m_threadpool;
+    std::vector<std::unique_ptr<DeviceQueue>> m_queues;
+    CpuForward m_cpu_forward;
 };
 
 extern OpenCLScheduler opencl;
@@ -44,6 +44,20 @@ bool cfg_allow_pondering;
 bool cfg_noinitialize;
 int cfg_max_threads;
 int cfg_num_threads;
+// Number of positions evaluated together by the NN, 1 disables batching
+int cfg_batch_size;
+// Memory used by the NN evaluation cache
+int cfg_cache_mb;
+// File keeping NN evaluations across runs, none if empty, and its size
+std::string cfg_cache_file;
+int cfg_cache_file_mb;
+// Memory the search tree may use before its least visited subtrees are
+// pruned, 0 for no limit but UCTSearch::MAX_TREE_SIZE
+int cfg_tree_mb;
+// Self-play games played at once by "train", sharing the network
+int cfg_selfplay_games;
+// Bind the search and NN threads to cores, see SMP::pin_thread
+bool cfg_pin_threads;
 int cfg_max_playouts;
 int cfg_max_nodes;
 int cfg_lagbuffer_ms;
@@ -63,16 +77,34 @@ uint64_t cfg_rng_seed;
 std::vector<int> cfg_gpus;
 bool cfg_sgemm_exhaustive;
 bool cfg_tune_only;
+// Read only tunings to use when there's no local one for this device
+std::string cfg_tuning_db;
+bool cfg_use_half;
+// CPU threads that evaluate a share of the batches next to the GPUs
+int cfg_cpu_workers;
+// Command queues and scratch buffers of each device, shared by the threads
+int cfg_gpu_contexts;
+// Time the OpenCL commands and print where the device time went
+bool cfg_opencl_profile;
+#else
+bool cfg_int8;
 #endif
+// Output tile of the winograd convolutions, 2 or 4, 0 to time both
+int cfg_winograd;
 float cfg_puct;
 float cfg_softmax_temp;
 float cfg_fpu_reduction;
 bool cfg_fpu_dynamic_eval;
 std::string cfg_weightsfile;
+// Searched tree to start the searches of the positions in it from
+std::string cfg_tree_snapshot;
 std::string cfg_syzygypath; 
 bool cfg_syzygydraw;
+int cfg_syzygythreads;
+bool cfg_syzygyprefetch;
 std::string cfg_logfile;
 std::string cfg_supervise;
+std::string cfg_convert_weights;
 FILE* cfg_logfile_handle;
 bool cfg_quiet;
 bool cfg_go_nodes_as_playouts;
@@ -83,6 +115,13 @@ void Parameters::setup_default_parameters() {
     int num_cpus = std::thread::hardware_concurrency();
     cfg_max_threads = std::max(1, std::min(num_cpus, MAX_CPUS));
     cfg_num_threads = 2;
+    cfg_batch_size = 1;
+    cfg_cache_mb = 64;
+    cfg_cache_file = "";
+    cfg_cache_file_mb = 1024;
+    cfg_tree_mb = 0;
+    cfg_selfplay_games = 1;
+    cfg_pin_threads = false;
 
     cfg_max_playouts = MAXINT_DIV2;
     cfg_max_nodes    = 800;
@@ -91,7 +130,15 @@ void Parameters::setup_default_parameters() {
     cfg_gpus = { };
     cfg_sgemm_exhaustive = false;
     cfg_tune_only = false;
+    cfg_tuning_db = "";
+    cfg_use_half = false;
+    cfg_cpu_workers = 0;
+    cfg_gpu_contexts = 2;
+    cfg_opencl_profile = false;
+#else
+    cfg_int8 = false;
 #endif
+    cfg_winograd = 0;
     cfg_puct = 0.6f;
     cfg_softmax_temp = 1.0f;
     cfg_fpu_reduction = 0.1f;
@@ -111,8 +158,11 @@ void Parameters::setup_default_parameters() {
     cfg_quiet = false;
     cfg_rng_seed = 0;
     cfg_weightsfile = "weights.txt";
+    cfg_tree_snapshot = "";
     cfg_syzygypath = "syzygy";
     cfg_syzygydraw = true;
+    cfg_syzygythreads = 0;
+    cfg_syzygyprefetch = false;
     cfg_go_nodes_as_playouts = false;
 }
 
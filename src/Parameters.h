@@ -19,6 +19,7 @@
 #ifndef GTP_H_INCLUDED
 #define GTP_H_INCLUDED
 
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -27,6 +28,13 @@ extern bool cfg_allow_pondering;
 extern bool cfg_noinitialize;
 extern int cfg_max_threads;
 extern int cfg_num_threads;
+extern int cfg_batch_size;
+extern int cfg_cache_mb;
+extern std::string cfg_cache_file;
+extern int cfg_cache_file_mb;
+extern int cfg_tree_mb;
+extern int cfg_selfplay_games;
+extern bool cfg_pin_threads;
 extern int cfg_max_playouts;
 extern int cfg_max_nodes;
 extern int cfg_lagbuffer_ms;
@@ -44,16 +52,28 @@ extern uint64_t cfg_rng_seed;
 extern std::vector<int> cfg_gpus;
 extern bool cfg_sgemm_exhaustive;
 extern bool cfg_tune_only;
+extern std::string cfg_tuning_db;
+extern bool cfg_use_half;
+extern int cfg_cpu_workers;
+extern int cfg_gpu_contexts;
+extern bool cfg_opencl_profile;
+#else
+extern bool cfg_int8;
 #endif
+extern int cfg_winograd;
 extern float cfg_puct;
 extern float cfg_softmax_temp;
 extern float cfg_fpu_reduction;
 extern bool cfg_fpu_dynamic_eval;
 extern std::string cfg_logfile;
 extern std::string cfg_weightsfile;
+extern std::string cfg_tree_snapshot;
 extern std::string cfg_syzygypath;
 extern bool cfg_syzygydraw;
+extern int cfg_syzygythreads;
+extern bool cfg_syzygyprefetch;
 extern std::string cfg_supervise;
+extern std::string cfg_convert_weights;
 extern FILE* cfg_logfile_handle;
 extern bool cfg_quiet;
 extern bool cfg_go_nodes_as_playouts;
@@ -0,0 +1,118 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PhaseTimer.h"
+
+#ifdef USE_PHASE_TIMERS
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "Utils.h"
+
+namespace {
+    const char* const PHASE_NAMES[PhaseTimer::NUM_PHASES] = {
+        "select", "movegen", "tbprobe", "features", "nneval", "expand", "backup"
+    };
+
+    struct Counters {
+        std::array<std::uint64_t, PhaseTimer::NUM_PHASES> nanos{};
+        std::array<std::uint64_t, PhaseTimer::NUM_PHASES> calls{};
+    };
+
+    // The counters of one thread. Only the owner writes them, so they need
+    // no read-modify-write, just atomic stores for dump_stats() to read.
+    // The counters never go back to 0, dump_stats() prints what was added
+    // since it last reported them.
+    struct alignas(64) Accumulator {
+        Accumulator();
+        ~Accumulator();
+        std::array<std::atomic<std::uint64_t>, PhaseTimer::NUM_PHASES> nanos{};
+        std::array<std::atomic<std::uint64_t>, PhaseTimer::NUM_PHASES> calls{};
+        // Guarded by registry_mutex.
+        Counters reported;
+    };
+
+    std::mutex registry_mutex;
+    std::vector<Accumulator*> registry;
+    // What threads that exited since the last dump_stats() added up.
+    Counters retired;
+
+    Accumulator::Accumulator() {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.emplace_back(this);
+    }
+
+    Accumulator::~Accumulator() {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (auto i = 0; i < PhaseTimer::NUM_PHASES; i++) {
+            retired.nanos[i] += nanos[i] - reported.nanos[i];
+            retired.calls[i] += calls[i] - reported.calls[i];
+        }
+        registry.erase(std::find(begin(registry), end(registry), this));
+    }
+
+    thread_local Accumulator accumulator;
+}
+
+void PhaseTimer::record(Phase phase, std::chrono::steady_clock::duration elapsed) {
+    auto& nanos = accumulator.nanos[phase];
+    auto& calls = accumulator.calls[phase];
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    nanos.store(nanos.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    calls.store(calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+#endif
+
+void PhaseTimer::dump_stats() {
+#ifdef USE_PHASE_TIMERS
+    auto totals = Counters{};
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        totals = retired;
+        retired = Counters{};
+        for (auto acc : registry) {
+            for (auto i = 0; i < NUM_PHASES; i++) {
+                auto nanos = acc->nanos[i].load(std::memory_order_relaxed);
+                auto calls = acc->calls[i].load(std::memory_order_relaxed);
+                totals.nanos[i] += nanos - acc->reported.nanos[i];
+                totals.calls[i] += calls - acc->reported.calls[i];
+                acc->reported.nanos[i] = nanos;
+                acc->reported.calls[i] = calls;
+            }
+        }
+    }
+    auto sum = std::uint64_t{0};
+    for (auto nanos : totals.nanos) {
+        sum += nanos;
+    }
+    if (!sum) {
+        return;
+    }
+    for (auto i = 0; i < NUM_PHASES; i++) {
+        Utils::myprintf_so("info string phase %s time %.1f ms share %.1f%% "
+                           "calls %llu avg %.2f us\n",
+            PHASE_NAMES[i], totals.nanos[i] / 1e6, 100.0 * totals.nanos[i] / sum,
+            static_cast<unsigned long long>(totals.calls[i]),
+            totals.calls[i] ? totals.nanos[i] / 1e3 / totals.calls[i] : 0.0);
+    }
+#endif
+}
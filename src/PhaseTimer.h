@@ -0,0 +1,69 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PHASETIMER_H_INCLUDED
+#define PHASETIMER_H_INCLUDED
+
+#include "config.h"
+
+#include <chrono>
+
+// Where the time of a playout goes. Every thread adds to its own counters,
+// which are summed up and printed after each search. Built only with
+// USE_PHASE_TIMERS, otherwise PHASE_TIMER() compiles to nothing.
+namespace PhaseTimer {
+    enum Phase {
+        SELECT,    // picking the child to descend into
+        MOVEGEN,   // terminal checks and legal move lists
+        TBPROBE,   // WDL tablebase probes
+        FEATURES,  // encoding the network input
+        NNEVAL,    // running the network, or waiting for the batch
+        EXPAND,    // building the children from the network output
+        BACKUP,    // updating the nodes on the way back up
+        NUM_PHASES
+    };
+
+#ifdef USE_PHASE_TIMERS
+    void record(Phase phase, std::chrono::steady_clock::duration elapsed);
+
+    // Records the time from construction to destruction.
+    class Scope {
+    public:
+        explicit Scope(Phase phase)
+            : m_phase(phase), m_start(std::chrono::steady_clock::now()) {}
+        ~Scope() {
+            record(m_phase, std::chrono::steady_clock::now() - m_start);
+        }
+    private:
+        Phase m_phase;
+        std::chrono::steady_clock::time_point m_start;
+    };
+#endif
+
+    // Print and reset the time spent in every phase.
+    // Does nothing unless built with USE_PHASE_TIMERS.
+    void dump_stats();
+}
+
+#ifdef USE_PHASE_TIMERS
+#define PHASE_TIMER(phase) PhaseTimer::Scope phase_timer(PhaseTimer::phase)
+#else
+#define PHASE_TIMER(phase)
+#endif
+
+#endif
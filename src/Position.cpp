@@ -1426,13 +1426,157 @@ Move Position::san_to_move(const std::string& s) const {
   return MOVE_NONE;
 }
 
+/// Position::san_to_move() with a buffer resolves a SAN move without building
+/// strings or generating moves: it parses the move into a piece, a destination
+/// and optional disambiguation, then looks the origin up in the attack
+/// bitboards. Notation it does not understand goes to the string version.
+
+Move Position::san_to_move(const char* san, size_t len) const {
+
+  // Check and annotation suffixes do not change the move
+  while (len && strchr("+#!?", san[len - 1]))
+      --len;
+
+  if (len < 2)
+      return MOVE_NONE;
+
+  if (san[0] == 'O' || san[0] == '0' || san[0] == 'o' || san[0] == '-')
+      return san_to_move(std::string(san, len));
+
+  const char* cur = san;
+  const char* end = san + len;
+  PieceType pt = PAWN;
+  PieceType promotion = NO_PIECE_TYPE;
+  size_t idx;
+
+  if ((idx = PieceToSAN.find(*cur)) != string::npos && idx > PAWN && idx <= KING)
+  {
+      pt = PieceType(idx);
+      ++cur;
+  }
+
+  if ((idx = PieceToSAN.find(end[-1])) != string::npos && idx > PAWN && idx < KING)
+  {
+      promotion = PieceType(idx);
+      --end;
+      if (end > cur && end[-1] == '=')
+          --end;
+  }
+
+  if (   end - cur < 2
+      || end[-2] < 'a' || end[-2] > 'h'
+      || end[-1] < '1' || end[-1] > '8')
+      return san_to_move(std::string(san, len));
+
+  Color us = sideToMove;
+  Square to = make_square(File(end[-2] - 'a'), Rank(end[-1] - '1'));
+  end -= 2;
+
+  // Whatever is left is disambiguation, a capture mark or a long algebraic dash
+  Bitboard from = pieces(us, pt);
+  bool isCapture = false;
+  bool otherFile = false;
+  for ( ; cur < end; ++cur)
+      if (*cur >= 'a' && *cur <= 'h')
+      {
+          from &= file_bb(File(*cur - 'a'));
+          otherFile = *cur != end[0];
+      }
+      else if (*cur >= '1' && *cur <= '8')
+          from &= rank_bb(Rank(*cur - '1'));
+      else if (*cur == 'x' || *cur == ':')
+          isCapture = true;
+      else if (*cur != '-')
+          return san_to_move(std::string(san, len));
+
+  if (pieces(us) & to)
+      return MOVE_NONE;
+
+  if (pt == PAWN)
+  {
+      if ((relative_rank(us, to) == RANK_8) != (promotion != NO_PIECE_TYPE))
+          return MOVE_NONE;
+
+      // A pawn that changes file captures, even without the 'x'
+      if (isCapture || otherFile)
+      {
+          from &= attacks_from<PAWN>(to, ~us);
+          if (!(pieces(~us) & to) && to != ep_square())
+              return MOVE_NONE;
+      }
+      else
+      {
+          Square push = to - pawn_push(us);
+          if (pieces() & to)
+              return MOVE_NONE;
+          if (!(pieces() & push) && relative_rank(us, to) == RANK_4)
+              from &= SquareBB[push] | (push - pawn_push(us));
+          else
+              from &= SquareBB[push];
+      }
+  }
+  else if (promotion != NO_PIECE_TYPE)
+      return MOVE_NONE;
+  else
+      from &= attacks_from(pt, to);
+
+  // Exactly one origin has to be legal, otherwise the move is ambiguous
+  Move found = MOVE_NONE;
+  while (from)
+  {
+      Square s = pop_lsb(&from);
+      Move m =  promotion != NO_PIECE_TYPE      ? make<PROMOTION>(s, to, promotion)
+              : pt == PAWN && to == ep_square() ? make<ENPASSANT>(s, to)
+              :                                   make_move(s, to);
+
+      // legal() relies on the move generator for evasions
+      if ((!checkers() || pseudo_legal(m)) && legal(m))
+      {
+          if (found != MOVE_NONE)
+              return MOVE_NONE;
+          found = m;
+      }
+  }
+  return found;
+}
+
+namespace {
+  constexpr Key HistoryKeyFactor = 0x9E3779B97F4A7C15ULL;
+
+  constexpr Key history_key_factor_pow(int n) {
+    return n == 0 ? 1 : HistoryKeyFactor * history_key_factor_pow(n - 1);
+  }
+
+  // The factor of the full key that leaves the history window
+  constexpr Key HistoryKeyDrop = history_key_factor_pow(BoardHistory::HISTORY_KEY_PLIES);
+}
+
+constexpr int BoardHistory::HISTORY_KEY_PLIES;
+
+void BoardHistory::push_keys() {
+  auto key = cur().full_key();
+  auto history_key = key;
+  if (!history_keys.empty()) {
+    history_key += HistoryKeyFactor * history_keys.back();
+    auto oldest = static_cast<int>(keys.size()) - HISTORY_KEY_PLIES;
+    if (oldest >= 0) {
+      history_key -= HistoryKeyDrop * keys[oldest];
+    }
+  }
+  keys.push_back(key);
+  history_keys.push_back(history_key);
+}
+
 void BoardHistory::set(const std::string& fen) {
   positions.clear();
   states.clear();
+  keys.clear();
+  history_keys.clear();
 
   positions.emplace_back();
   states.emplace_back(new StateInfo());
   cur().set(fen, states.back().get());
+  push_keys();
 }
 
 // Only need to copy the 8 most recent positions, as that's what is needed by
@@ -1442,20 +1586,31 @@ BoardHistory BoardHistory::shallow_clone() const {
   BoardHistory h;
   for (int i = std::max(0, static_cast<int>(positions.size()) - 8); i < static_cast<int>(positions.size()); ++i) {
     h.positions.push_back(positions[i]);
+    h.keys.push_back(keys[i]);
+    h.history_keys.push_back(history_keys[i]);
   }
   return h;
 }
 
 void BoardHistory::do_move(Move m) {
-  states.emplace_back(new StateInfo);
+  if (spare_states.empty()) {
+    states.emplace_back(new StateInfo);
+  } else {
+    states.push_back(std::move(spare_states.back()));
+    spare_states.pop_back();
+  }
   positions.push_back(positions.back());
   positions.back().do_move(m, *states.back());
+  push_keys();
 }
 
 bool BoardHistory::undo_move() {
 	if (positions.size() == 1) return false;
+	spare_states.push_back(std::move(states.back()));
 	states.pop_back();
 	positions.pop_back();
+	keys.pop_back();
+	history_keys.pop_back();
 	return true;
 }
 
@@ -143,6 +143,7 @@ public:
 
   std::string move_to_san(Move m) const;
   Move san_to_move(const std::string& s) const;
+  Move san_to_move(const char* san, size_t len) const;
 
   // Accessing hash keys
   Key key() const;
@@ -403,6 +404,16 @@ inline void Position::do_move(Move m, StateInfo& newSt) {
 struct BoardHistory {
   std::vector<Position> positions;
   std::vector<std::unique_ptr<StateInfo>> states;
+  // The states of undone moves, reused by do_move() so that playing the
+  // same history forwards and back doesn't allocate.
+  std::vector<std::unique_ptr<StateInfo>> spare_states;
+  // The full_key() of every position, and the key of every position
+  // together with the HISTORY_KEY_PLIES - 1 positions before it. Moves
+  // update both in O(1): the history key is a polynomial in the full keys,
+  // so the oldest one can be subtracted out again.
+  std::vector<Key> keys;
+  std::vector<Key> history_keys;
+  static constexpr int HISTORY_KEY_PLIES = 8;
 
   Position& cur() {
     return positions.back();
@@ -412,11 +423,20 @@ struct BoardHistory {
     return positions.back();
   }
 
+  // The key of the current position and the ones before it that the
+  // network sees, which is what the NN cache is keyed by.
+  Key history_key() const {
+    return history_keys.back();
+  }
+
   void set(const std::string& fen);
   BoardHistory shallow_clone() const;
   void do_move(Move m);
   bool undo_move();
   std::string pgn() const;
+
+private:
+  void push_keys();
 };
 
 #endif // #ifndef POSITION_H_INCLUDED
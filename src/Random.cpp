@@ -48,6 +48,10 @@ Random& Random::GetRng(void) {
   return rng;
 }
 
+void Random::seedrandom(std::uint64_t seed) {
+  rand_engine_.seed(seed);
+}
+
 std::uint64_t Random::operator()() {
   return RandInt<std::uint64_t>();
 }
@@ -30,6 +30,9 @@ class Random {
 
   static Random& GetRng(void);
 
+  // Restart the sequence, for runs that must be repeatable.
+  void seedrandom(std::uint64_t seed);
+
   template <typename T = std::uint64_t>
   T RandInt(T max = std::numeric_limits<T>::max()) {
     static_assert(std::is_integral<T>::value, "Integral type required");
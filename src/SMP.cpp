@@ -19,33 +19,147 @@
 #include "SMP.h"
 
 #include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
 #include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#endif
+
+#include "Parameters.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SMP_PAUSE() _mm_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define SMP_PAUSE() __asm__ __volatile__("yield")
+#else
+#define SMP_PAUSE() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+#ifdef USE_LOCK_STATS
+#include <algorithm>
+
+#include "Utils.h"
+#endif
+
+namespace {
+    // Spin for 1, 2, 4, ... pause instructions between attempts, in total
+    // about 2^SPIN_ROUNDS, before parking the thread.
+    constexpr auto SPIN_ROUNDS = 8;
+
+    // Parked threads wait on one of these, picked by the address of the
+    // lock, so that a Mutex itself doesn't need room for a queue.
+    struct alignas(64) ParkingSlot {
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    constexpr auto NUM_PARKING_SLOTS = 64;
+
+    ParkingSlot& parking_slot(const void* lock) {
+        static ParkingSlot slots[NUM_PARKING_SLOTS];
+        auto addr = reinterpret_cast<std::uintptr_t>(lock);
+        return slots[(addr ^ (addr >> 12)) % NUM_PARKING_SLOTS];
+    }
+
+#ifdef USE_LOCK_STATS
+    std::atomic<SMP::LockSite*> lock_sites{nullptr};
+#endif
+}
 
 SMP::Mutex::Mutex() {
-    m_lock = false;
+    m_lock = UNLOCKED;
 }
 
+#ifdef USE_LOCK_STATS
+SMP::LockSite::LockSite(const char* file, int line)
+    : m_file(file), m_line(line) {
+    m_next = lock_sites.load();
+    while (!lock_sites.compare_exchange_weak(m_next, this));
+}
+
+SMP::Lock::Lock(Mutex & m, LockSite * site) {
+    m_mutex = &m;
+    m_site = site;
+    lock();
+}
+#else
 SMP::Lock::Lock(Mutex & m) {
     m_mutex = &m;
     lock();
 }
+#endif
 
 void SMP::Lock::lock() {
     assert(!m_owns_lock);
-    while (m_mutex->m_lock.exchange(true, std::memory_order_acquire) == true);
+#ifdef USE_LOCK_STATS
+    m_site->m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+#endif
+    auto expected = std::uint8_t{Mutex::UNLOCKED};
+    if (!m_mutex->m_lock.compare_exchange_strong(expected, Mutex::LOCKED,
+                                                 std::memory_order_acquire)) {
+        lock_contended();
+    }
     m_owns_lock = true;
 }
 
+void SMP::Lock::lock_contended() {
+#ifdef USE_LOCK_STATS
+    m_site->m_contended.fetch_add(1, std::memory_order_relaxed);
+#endif
+    auto& state = m_mutex->m_lock;
+    for (auto round = 0; round < SPIN_ROUNDS; round++) {
+        for (auto i = 0; i < (1 << round); i++) {
+            SMP_PAUSE();
+        }
+        // Only try the (cache line stealing) exchange once it looks free.
+        auto expected = std::uint8_t{Mutex::UNLOCKED};
+        if (state.load(std::memory_order_relaxed) == Mutex::UNLOCKED
+            && state.compare_exchange_weak(expected, Mutex::LOCKED,
+                                           std::memory_order_acquire)) {
+            return;
+        }
+    }
+
+#ifdef USE_LOCK_STATS
+    m_site->m_parked.fetch_add(1, std::memory_order_relaxed);
+#endif
+    // Mark the lock as contended so the holder knows to wake us. We can't
+    // tell whether anyone else is still parked, so once we own the lock
+    // it stays marked and the unlock may wake somebody needlessly.
+    while (state.exchange(Mutex::CONTENDED, std::memory_order_acquire)
+           != Mutex::UNLOCKED) {
+        auto& slot = parking_slot(m_mutex);
+        std::unique_lock<std::mutex> lock(slot.mutex);
+        slot.cv.wait(lock, [&state] {
+            return state.load(std::memory_order_relaxed) != Mutex::CONTENDED;
+        });
+    }
+}
+
 void SMP::Lock::unlock() {
     assert(m_owns_lock);
-    auto lock_held = m_mutex->m_lock.exchange(false, std::memory_order_release);
+    auto lock_held = m_mutex->m_lock.exchange(Mutex::UNLOCKED, std::memory_order_release);
 
     // If this fails it means we are unlocking an unlocked lock
-#ifdef NDEBUG
-    (void)lock_held;
-#else
-    assert(lock_held);
-#endif
+    assert(lock_held != Mutex::UNLOCKED);
+    if (lock_held == Mutex::CONTENDED) {
+        // Taking the slot mutex orders this against a waiter that is
+        // just about to go to sleep.
+        auto& slot = parking_slot(m_mutex);
+        {
+            std::lock_guard<std::mutex> lock(slot.mutex);
+        }
+        slot.cv.notify_all();
+    }
     m_owns_lock = false;
 }
 
@@ -57,6 +171,103 @@ SMP::Lock::~Lock() {
     }
 }
 
+void SMP::dump_lock_stats() {
+#ifdef USE_LOCK_STATS
+    auto sites = std::vector<LockSite*>{};
+    for (auto site = lock_sites.load(); site; site = site->m_next) {
+        if (site->m_acquisitions) {
+            sites.emplace_back(site);
+        }
+    }
+    std::sort(begin(sites), end(sites), [](LockSite* a, LockSite* b) {
+        return a->m_contended > b->m_contended;
+    });
+    for (auto site : sites) {
+        auto acquisitions = site->m_acquisitions.exchange(0);
+        auto contended = site->m_contended.exchange(0);
+        auto parked = site->m_parked.exchange(0);
+        Utils::myprintf("Lock %s:%d: %llu acquisitions, %.2f%% contended, %llu parked\n",
+                        site->m_file, site->m_line,
+                        static_cast<unsigned long long>(acquisitions),
+                        100.0 * contended / acquisitions,
+                        static_cast<unsigned long long>(parked));
+    }
+#endif
+}
+
 int SMP::get_num_cpus() {
     return std::thread::hardware_concurrency();
 }
+
+#ifdef __linux__
+namespace {
+    // Parse a sysfs CPU list like "0-7,16-23".
+    std::vector<int> parse_cpulist(const std::string& list) {
+        auto cpus = std::vector<int>{};
+        auto ranges = std::istringstream{list};
+        auto range = std::string{};
+        while (std::getline(ranges, range, ',')) {
+            auto dash = range.find('-');
+            auto first = std::stoi(range.substr(0, dash));
+            auto last = dash == std::string::npos
+                      ? first : std::stoi(range.substr(dash + 1));
+            for (auto cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // The cores this process may run on, those of NUMA node 0 first, then
+    // node 1 and so on. Without NUMA information, in plain order.
+    std::vector<int> cpus_by_numa_node() {
+        auto allowed = cpu_set_t{};
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            return {};
+        }
+
+        auto cpus = std::vector<int>{};
+        auto listed = cpu_set_t{};
+        CPU_ZERO(&listed);
+        for (auto node = 0; ; node++) {
+            auto file = std::ifstream{"/sys/devices/system/node/node"
+                                      + std::to_string(node) + "/cpulist"};
+            auto list = std::string{};
+            if (!file || !std::getline(file, list)) {
+                break;
+            }
+            for (auto cpu : parse_cpulist(list)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)
+                    && !CPU_ISSET(cpu, &listed)) {
+                    CPU_SET(cpu, &listed);
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        for (auto cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &listed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+}
+#endif
+
+void SMP::pin_thread() {
+    if (!cfg_pin_threads) {
+        return;
+    }
+#ifdef __linux__
+    static const auto cpus = cpus_by_numa_node();
+    static std::atomic<size_t> next_slot{0};
+    if (cpus.empty()) {
+        return;
+    }
+    auto set = cpu_set_t{};
+    CPU_ZERO(&set);
+    CPU_SET(cpus[next_slot++ % cpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
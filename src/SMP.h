@@ -22,32 +22,85 @@
 #include "config.h"
 
 #include <atomic>
+#include <cstdint>
 
 namespace SMP {
     int get_num_cpus();
 
+    // Bind the calling thread to a core of its own when cfg_pin_threads is
+    // set. Only for threads the engine starts itself, right after they
+    // start, as threads created later inherit the binding. Cores are handed
+    // out one NUMA node after another, so that threads started together
+    // share a node, and the memory they touch first is allocated on it.
+    // Does nothing elsewhere than on Linux.
+    void pin_thread();
+
+    // Spins with backoff for a short while and then parks the thread
+    // until the holder releases the lock. Still a single byte, so it can
+    // be embedded in every UCTNode.
     class Mutex {
     public:
         Mutex();
         ~Mutex() = default;
         friend class Lock;
     private:
-        std::atomic<bool> m_lock;
+        enum State : std::uint8_t {
+            UNLOCKED,
+            LOCKED,
+            // Locked, and there may be parked threads waiting for it.
+            CONTENDED
+        };
+        std::atomic<std::uint8_t> m_lock;
     };
 
+#ifdef USE_LOCK_STATS
+    // Contention counters for one LOCK() call site.
+    class LockSite {
+    public:
+        LockSite(const char* file, int line);
+        const char* m_file;
+        int m_line;
+        std::atomic<std::uint64_t> m_acquisitions{0};
+        // Acquisitions that didn't get the lock on the first try.
+        std::atomic<std::uint64_t> m_contended{0};
+        // Acquisitions that gave up spinning and parked.
+        std::atomic<std::uint64_t> m_parked{0};
+        LockSite* m_next;
+    };
+#endif
+
     class Lock {
     public:
+#ifdef USE_LOCK_STATS
+        Lock(Mutex & m, LockSite * site);
+#else
         explicit Lock(Mutex & m);
+#endif
         ~Lock();
         void lock();
         void unlock();
     private:
+        void lock_contended();
+
         Mutex * m_mutex;
         bool m_owns_lock{false};
+#ifdef USE_LOCK_STATS
+        LockSite * m_site;
+#endif
     };
+
+    // Print and reset the contention counters of every LOCK() call site.
+    // Does nothing unless built with USE_LOCK_STATS.
+    void dump_lock_stats();
 }
 
 // Avoids accidentally creating a temporary
+#ifdef USE_LOCK_STATS
+#define LOCK(mutex, lock) \
+    static SMP::LockSite lock##_site(__FILE__, __LINE__); \
+    SMP::Lock lock((mutex), &lock##_site)
+#else
 #define LOCK(mutex, lock) SMP::Lock lock((mutex))
+#endif
 
 #endif
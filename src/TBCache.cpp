@@ -0,0 +1,96 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "TBCache.h"
+
+#include "Utils.h"
+
+// The low bits of an entry hold the result, the rest the key. The index
+// comes from the low bits of the key, so those aren't needed to tell
+// positions apart.
+static constexpr auto RESULT_BITS = 3;
+static constexpr auto RESULT_MASK = (std::uint64_t{1} << RESULT_BITS) - 1;
+// 0 is an empty entry.
+static constexpr auto RESULT_FAIL = 1;
+// Add to a WDLScore, WDLLoss to WDLWin, for results that are OK.
+static constexpr auto RESULT_WDL_OFFSET = 4;
+
+static_assert(TBCache::SIZE >= (1 << RESULT_BITS),
+              "The index must cover the result bits of the key");
+
+TBCache& TBCache::get_TBCache(void) {
+    static TBCache cache;
+    return cache;
+}
+
+Tablebases::WDLScore TBCache::probe_wdl(const Position& pos,
+                                        Tablebases::ProbeState* result) {
+    auto wdl = Tablebases::WDLDraw;
+    if (lookup(pos.key(), &wdl, result)) {
+        return wdl;
+    }
+    // probe_wdl makes and unmakes moves on the position.
+    auto to_lookup = pos;
+    wdl = Tablebases::probe_wdl(to_lookup, result);
+    insert(pos.key(), wdl, *result);
+    return wdl;
+}
+
+bool TBCache::lookup(Key key, Tablebases::WDLScore* wdl,
+                     Tablebases::ProbeState* result) {
+    const auto& entry = m_entries[key % SIZE];
+    m_lookups.fetch_add(1, std::memory_order_relaxed);
+
+    auto data = entry.load(std::memory_order_relaxed);
+    if (!data || (data & ~RESULT_MASK) != (key & ~RESULT_MASK)) {
+        return false;
+    }
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    auto code = static_cast<int>(data & RESULT_MASK);
+    if (code == RESULT_FAIL) {
+        *result = Tablebases::FAIL;
+        *wdl = Tablebases::WDLDraw;
+    } else {
+        *result = Tablebases::OK;
+        *wdl = static_cast<Tablebases::WDLScore>(code - RESULT_WDL_OFFSET);
+    }
+    return true;
+}
+
+void TBCache::insert(Key key, Tablebases::WDLScore wdl,
+                     Tablebases::ProbeState result) {
+    auto code = result == Tablebases::FAIL
+        ? RESULT_FAIL : wdl + RESULT_WDL_OFFSET;
+    m_entries[key % SIZE].store((key & ~RESULT_MASK) | code,
+                                std::memory_order_relaxed);
+}
+
+void TBCache::clear() {
+    for (auto& entry : m_entries) {
+        entry.store(0, std::memory_order_relaxed);
+    }
+    m_hits = 0;
+    m_lookups = 0;
+}
+
+void TBCache::dump_stats() {
+    auto hits = get_hits();
+    auto lookups = get_lookups();
+    Utils::myprintf("TBCache: %d/%d hits/lookups = %.1f%% hitrate\n",
+        hits, lookups, 100. * hits / (lookups + 1));
+}
@@ -0,0 +1,67 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TBCACHE_H_INCLUDED
+#define TBCACHE_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "Position.h"
+#include "syzygy/tbprobe.h"
+
+// Results of WDL tablebase probes by position key. In endgames the search
+// reaches the same positions over and over, and every probe decompresses
+// tablebase blocks. Every entry is a single word holding the key and the
+// result, so lookups and inserts need no locks; a torn or overwritten
+// entry just doesn't match the key.
+class TBCache {
+public:
+    static constexpr auto SIZE = 1 << 16;
+
+    // return the global TBCache
+    static TBCache& get_TBCache(void);
+
+    // Tablebases::probe_wdl(), from the cache if possible.
+    Tablebases::WDLScore probe_wdl(const Position& pos,
+                                   Tablebases::ProbeState* result);
+    // The cached result for a position key, without probing on a miss.
+    bool lookup(Key key, Tablebases::WDLScore* wdl,
+                Tablebases::ProbeState* result);
+    void insert(Key key, Tablebases::WDLScore wdl,
+                Tablebases::ProbeState result);
+
+    // Drop all entries, for when other tablebases are loaded.
+    void clear();
+
+    int get_hits() const { return m_hits; }
+    int get_lookups() const { return m_lookups; }
+    void dump_stats();
+
+private:
+    TBCache() = default;
+
+    std::array<std::atomic<std::uint64_t>, SIZE> m_entries{};
+    std::atomic<int> m_hits{0};
+    std::atomic<int> m_lookups{0};
+};
+
+#endif
@@ -0,0 +1,145 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "TBProbeService.h"
+
+#include <algorithm>
+
+#include "TBCache.h"
+#include "Utils.h"
+
+TBProbeService& TBProbeService::get_TBProbeService(void) {
+    static TBProbeService service;
+    return service;
+}
+
+TBProbeService::~TBProbeService() {
+    stop_threads();
+}
+
+void TBProbeService::stop_threads() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_worker_cv.notify_all();
+    for (auto& thread : m_threads) {
+        thread.join();
+    }
+    m_threads.clear();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_exit = false;
+    m_queue.clear();
+    m_pending.clear();
+}
+
+void TBProbeService::set_threads(int threads) {
+    stop_threads();
+    for (auto i = 0; i < threads; i++) {
+        m_threads.emplace_back([this] { worker(); });
+    }
+}
+
+bool TBProbeService::probe_wdl(const Position& pos, Tablebases::WDLScore* wdl,
+                               Tablebases::ProbeState* result) {
+    auto& cache = TBCache::get_TBCache();
+    if (cache.lookup(pos.key(), wdl, result)) {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_threads.empty() && m_queue.size() < MAX_QUEUED) {
+            if (m_pending.insert(pos.key()).second) {
+                // The position refers to the state of the search thread,
+                // so the probe thread sets up its own copy from the FEN.
+                m_queue.push_back({pos.key(), pos.fen()});
+                m_queued++;
+                m_worker_cv.notify_one();
+            }
+            return false;
+        }
+        if (m_pending.count(pos.key())) {
+            return false;
+        }
+        m_inline++;
+    }
+    // probe_wdl makes and unmakes moves on the position.
+    auto to_lookup = pos;
+    *wdl = Tablebases::probe_wdl(to_lookup, result);
+    cache.insert(pos.key(), *wdl, *result);
+    return true;
+}
+
+void TBProbeService::worker() {
+    auto batch = std::vector<Request>{};
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_worker_cv.wait(lock, [this] { return m_exit || !m_queue.empty(); });
+            if (m_exit) {
+                return;
+            }
+            // Leave some of the queue to the other probe threads, so that
+            // their reads overlap.
+            const auto threads = m_threads.size();
+            const auto count = (m_queue.size() + threads - 1) / threads;
+            batch.assign(std::make_move_iterator(begin(m_queue)),
+                         std::make_move_iterator(begin(m_queue) + count));
+            m_queue.erase(begin(m_queue), begin(m_queue) + count);
+            m_running++;
+        }
+
+        for (const auto& request : batch) {
+            StateInfo st;
+            Position pos;
+            pos.set(request.fen, &st);
+            auto result = Tablebases::FAIL;
+            auto wdl = Tablebases::probe_wdl(pos, &result);
+            TBCache::get_TBCache().insert(request.key, wdl, result);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto& request : batch) {
+                m_pending.erase(request.key);
+            }
+            m_running--;
+        }
+        m_idle_cv.notify_all();
+    }
+}
+
+void TBProbeService::clear() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (const auto& request : m_queue) {
+        m_pending.erase(request.key);
+    }
+    m_queue.clear();
+    m_idle_cv.wait(lock, [this] { return m_running == 0; });
+}
+
+void TBProbeService::dump_stats() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_queued) {
+        return;
+    }
+    Utils::myprintf("TBProbeService: %lld queued, %lld inline probes, "
+                    "%d probe thread(s)\n",
+                    m_queued, m_inline, int(m_threads.size()));
+}
@@ -0,0 +1,96 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TBPROBESERVICE_H_INCLUDED
+#define TBPROBESERVICE_H_INCLUDED
+
+#include "config.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "Position.h"
+#include "syzygy/tbprobe.h"
+
+// Runs WDL tablebase probes on dedicated I/O threads. A probe that misses
+// the TBCache can read tablebase pages from disk, and a search thread
+// waiting on that does nothing useful. With probe threads running, a miss
+// queues the position and returns right away as pending; the search
+// treats the leaf like one whose evaluation is still in flight, and finds
+// the result in the TBCache on a later visit. Without probe threads, or
+// when the queue is full, the probe runs on the calling thread.
+class TBProbeService {
+public:
+    // Positions that can wait for a probe thread, beyond that callers
+    // probe themselves.
+    static constexpr auto MAX_QUEUED = 1024;
+
+    // return the global TBProbeService
+    static TBProbeService& get_TBProbeService(void);
+
+    ~TBProbeService();
+
+    // Start this many probe threads, 0 to probe on the calling thread.
+    void set_threads(int threads);
+
+    // Returns false if the probe is pending, otherwise sets the results
+    // like Tablebases::probe_wdl().
+    bool probe_wdl(const Position& pos, Tablebases::WDLScore* wdl,
+                   Tablebases::ProbeState* result);
+
+    // Drop queued probes and wait for the running ones, which must be
+    // done before the tablebases are unloaded.
+    void clear();
+
+    void dump_stats();
+
+private:
+    TBProbeService() = default;
+
+    struct Request {
+        Key key;
+        std::string fen;
+    };
+
+    void worker();
+    void stop_threads();
+
+    std::mutex m_mutex;
+    // Signals the probe threads that probes were queued.
+    std::condition_variable m_worker_cv;
+    // Signals clear() that the running probes are done.
+    std::condition_variable m_idle_cv;
+    std::deque<Request> m_queue;
+    // Keys that are queued or being probed, so that every position is
+    // only probed once.
+    std::unordered_set<Key> m_pending;
+    std::vector<std::thread> m_threads;
+    int m_running{0};
+    bool m_exit{false};
+
+    // Statistics
+    int64 m_queued{0};
+    int64 m_inline{0};
+};
+
+#endif
@@ -24,20 +24,37 @@
     distribution.
 */
 
+#include <array>
+#include <atomic>
+#include <cassert>
 #include <cstddef>
+#include <deque>
 #include <vector>
 #include <thread>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <memory>
 #include <future>
 #include <functional>
+#include <stdexcept>
 
 namespace Utils {
 
+// Every thread has its own deque of tasks. It works from the back of its
+// own deque and, when that is empty, steals from the front of the others,
+// so threads rarely contend for the same lock.
 class ThreadPool {
 public:
+    static constexpr auto MAX_THREADS = 256;
+
+    // Work for submit(). The submitter owns the task and must keep it
+    // alive until run() returns, so submitting one allocates nothing.
+    class Task {
+    public:
+        virtual ~Task() = default;
+        virtual void run() = 0;
+    };
+
     ThreadPool() = default;
     ~ThreadPool();
 
@@ -50,36 +67,73 @@ public:
     template<class F, class... Args>
     auto add_task(F&& f, Args&&... args)
         -> std::future<typename std::result_of<F(Args...)>::type>;
+    // Queue a task on the deque of the calling thread if it belongs to the
+    // pool, otherwise on the deques of the threads in turn.
+    void submit(Task& task);
 
     std::size_t size() const {
         return m_threads.size();
     }
 private:
-    std::vector<std::thread> m_threads;
-    std::queue<std::function<void()>> m_tasks;
+    struct alignas(64) WorkQueue {
+        std::mutex mutex;
+        std::deque<Task*> tasks;
+    };
+
+    // A task for add_task(), which deletes itself once it has run.
+    template<class F>
+    class FunctionTask : public Task {
+    public:
+        explicit FunctionTask(F&& f) : m_f(std::move(f)) {}
+        void run() override {
+            m_f();
+            delete this;
+        }
+    private:
+        F m_f;
+    };
+
+    // Take a task from the back of our own deque or steal one from the
+    // front of another.
+    Task* take_task(std::size_t index);
+    void worker(std::size_t index);
+
+    // The pool and queue of the calling thread, if it is a pool thread.
+    struct ThreadSlot {
+        const ThreadPool* pool{nullptr};
+        std::size_t index{0};
+    };
+    static ThreadSlot& this_thread_slot() {
+        thread_local ThreadSlot slot;
+        return slot;
+    }
 
+    std::vector<std::thread> m_threads;
+    // Fixed, so that threads can be added while others steal.
+    std::array<WorkQueue, MAX_THREADS> m_queues;
+    std::atomic<std::size_t> m_num_queues{0};
+    std::atomic<std::size_t> m_next_queue{0};
+    // Tasks queued and not taken yet.
+    std::atomic<int> m_pending{0};
+
+    // Only for threads without work to wait on.
     std::mutex m_mutex;
     std::condition_variable m_condvar;
+    std::atomic<int> m_sleeping{0};
     bool m_exit{false};
 };
 
 inline void ThreadPool::add_thread(std::function<void()> initializer) {
-    m_threads.emplace_back([this, initializer] {
+    const auto index = m_threads.size();
+    if (index >= MAX_THREADS) {
+        throw std::runtime_error("Too many threads in the pool");
+    }
+    m_threads.emplace_back([this, index, initializer] {
+        this_thread_slot() = ThreadSlot{this, index};
         initializer();
-        for (;;) {
-            std::function<void()> task;
-            {
-                std::unique_lock<std::mutex> lock(m_mutex);
-                m_condvar.wait(lock, [this]{ return m_exit || !m_tasks.empty(); });
-                if (m_exit && m_tasks.empty()) {
-                    return;
-                }
-                task = std::move(m_tasks.front());
-                m_tasks.pop();
-            }
-            task();
-        }
+        worker(index);
     });
+    m_num_queues = index + 1;
 }
 
 inline void ThreadPool::initialize(size_t threads) {
@@ -88,21 +142,78 @@ inline void ThreadPool::initialize(size_t threads) {
     }
 }
 
+inline ThreadPool::Task* ThreadPool::take_task(std::size_t index) {
+    {
+        auto& queue = m_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            auto task = queue.tasks.back();
+            queue.tasks.pop_back();
+            m_pending--;
+            return task;
+        }
+    }
+    const auto num_queues = m_num_queues.load();
+    for (std::size_t i = 1; i < num_queues; i++) {
+        auto& queue = m_queues[(index + i) % num_queues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            auto task = queue.tasks.front();
+            queue.tasks.pop_front();
+            m_pending--;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+inline void ThreadPool::worker(std::size_t index) {
+    for (;;) {
+        if (auto task = take_task(index)) {
+            task->run();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // Submitters only notify when someone is asleep, so announce that
+        // before the last look at the work.
+        m_sleeping++;
+        m_condvar.wait(lock, [this]{ return m_exit || m_pending > 0; });
+        m_sleeping--;
+        if (m_exit && m_pending == 0) {
+            return;
+        }
+    }
+}
+
+inline void ThreadPool::submit(Task& task) {
+    const auto& slot = this_thread_slot();
+    auto index = slot.index;
+    if (slot.pool != this) {
+        assert(m_num_queues > 0);
+        index = m_next_queue++ % m_num_queues.load();
+    }
+    {
+        auto& queue = m_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(&task);
+        m_pending++;
+    }
+    if (m_sleeping > 0) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_condvar.notify_one();
+    }
+}
+
 template<class F, class... Args>
 auto ThreadPool::add_task(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type> {
     using return_type = typename std::result_of<F(Args...)>::type;
 
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
+    auto task = std::packaged_task<return_type()>(
         std::bind(std::forward<F>(f), std::forward<Args>(args)...)
     );
-
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_tasks.emplace([task](){(*task)();});
-    }
-    m_condvar.notify_one();
+    std::future<return_type> res = task.get_future();
+    submit(*new FunctionTask<decltype(task)>(std::move(task)));
     return res;
 }
 
@@ -130,6 +241,7 @@ public:
         for (auto && result: m_taskresults) {
             result.get();
         }
+        m_taskresults.clear();
     }
 private:
     ThreadPool & m_pool;
@@ -17,7 +17,12 @@
 */
 
 #include "config.h"
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -32,8 +37,28 @@
 #include "Random.h"
 #include "Utils.h"
 #include "UCTSearch.h"
+#include "Parameters.h"
+#include "pgn.h"
 
-std::vector<TimeStep> Training::m_data{};
+thread_local Training::ThreadGame Training::m_game;
+
+Training::GameRegistry& Training::game_registry() {
+    static auto registry = new GameRegistry;
+    return *registry;
+}
+
+Training::ThreadGame::ThreadGame() {
+    auto& registry = game_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.games.push_back(this);
+}
+
+Training::ThreadGame::~ThreadGame() {
+    auto& registry = game_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto& games = registry.games;
+    games.erase(std::find(begin(games), end(games), this));
+}
 
 std::string OutputChunker::gen_chunk_name(void) const {
     auto base = std::string{m_basename};
@@ -51,13 +76,31 @@ OutputChunker::OutputChunker(const std::string& basename,
         fs::directory_iterator(),
         static_cast<bool(*)(const fs::path&)>(fs::is_regular_file));
     Utils::myprintf("Found %d existing chunks in %s\n", m_chunk_count, basename.c_str());
+    m_writer = std::thread([this] { writer(); });
 }
 
 OutputChunker::~OutputChunker() {
     flush_chunk();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_cv.notify_all();
+    m_writer.join();
+    if (m_error) {
+        Utils::myprintf("Failed to write training data to %s\n",
+                        m_basename.c_str());
+    }
 }
 
-void OutputChunker::append(const std::string& str) {
+void OutputChunker::append(std::string str) {
+    std::lock_guard<std::mutex> append_lock(m_append_mutex);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
     m_buffer.append(str);
     m_game_count++;
     if (m_game_count >= m_games_per_chunk) {
@@ -70,60 +113,245 @@ void OutputChunker::flush_chunk() {
         return;
     }
 
-    if (m_compress) {
-        auto chunk_name = gen_chunk_name();
-        auto out = gzopen(chunk_name.c_str(), "wb9");
+    auto chunk = Chunk{};
+    chunk.name = m_compress ? gen_chunk_name() : m_basename;
+    std::swap(chunk.data, m_buffer);
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_pending.size() < MAX_PENDING; });
+        m_pending.emplace_back(std::move(chunk));
+    }
+    m_cv.notify_all();
 
-        auto in_buff_size = m_buffer.size();
-        auto in_buff = std::make_unique<char[]>(in_buff_size);
-        memcpy(in_buff.get(), m_buffer.data(), in_buff_size);
+    m_chunk_count++;
+    m_game_count = 0;
+}
 
-        auto comp_size = gzwrite(out, in_buff.get(), in_buff_size);
+void OutputChunker::writer() {
+    for (;;) {
+        auto chunk = Chunk{};
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_exit || !m_pending.empty(); });
+            // Finish what was queued even when exiting.
+            if (m_pending.empty()) {
+                return;
+            }
+            chunk = std::move(m_pending.front());
+        }
+        try {
+            write_chunk(chunk);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_error) {
+                m_error = std::current_exception();
+            }
+        }
+        {
+            // Only now, so that the chunk counts against MAX_PENDING
+            // while it is written.
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.pop_front();
+        }
+        m_cv.notify_all();
+    }
+}
+
+void OutputChunker::write_chunk(const Chunk& chunk) {
+    if (m_compress) {
+        auto out = gzopen(chunk.name.c_str(), "wb9");
+        if (!out) {
+            throw std::runtime_error("Error opening " + chunk.name);
+        }
+        auto comp_size = gzwrite(out, chunk.data.data(), chunk.data.size());
+        gzclose(out);
         if (!comp_size) {
             throw std::runtime_error("Error in gzip output");
         }
-        Utils::myprintf("Writing chunk %d\n",  m_chunk_count);
-        gzclose(out);
+        Utils::myprintf("Wrote chunk %s\n", chunk.name.c_str());
     } else {
-        auto chunk_name = m_basename;
         auto flags = std::ofstream::out | std::ofstream::app;
-        auto out = std::ofstream{chunk_name, flags};
-        out << m_buffer;
+        auto out = std::ofstream{chunk.name, flags};
+        out << chunk.data;
         out.close();
+        if (out.fail()) {
+            throw std::runtime_error("Error writing " + chunk.name);
+        }
     }
-
-    m_buffer.clear();
-    m_chunk_count++;
-    m_game_count = 0;
 }
 
 void Training::clear_training() {
-    Training::m_data.clear();
+    auto& registry = game_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (auto game : registry.games) {
+        game->data.clear();
+    }
+}
+
+void Training::clear_thread_training() {
+    m_game.data.clear();
+}
+
+void Training::add_step(TimeStep& step, const Network::NNPlanes& planes) {
+    const auto hist_planes = Network::get_hist_planes();
+    const auto history_planes = Network::T_HISTORY * hist_planes;
+    // Later plies only add a board, store just that when the rest
+    // matches the step before.
+    step.shifted = false;
+    if (!m_game.data.empty()) {
+        auto shifted = Network::NNPlanes{};
+        Network::shift_history(m_game.last_planes, shifted);
+        step.shifted = std::equal(begin(planes.bit) + hist_planes,
+                                  begin(planes.bit) + history_planes,
+                                  begin(shifted.bit) + hist_planes);
+    }
+    const auto stored_planes = step.shifted ? hist_planes : history_planes;
+    step.planes.resize(stored_planes);
+    for (auto p = size_t{0}; p < stored_planes; p++) {
+        step.planes[p] = planes.bit[p].to_ullong();
+    }
+    step.aux_planes = 0;
+    for (auto i = 0; i < 5; i++) {
+        step.aux_planes |= planes.bit[history_planes + i][0] << i;
+    }
+    step.rule50_count = planes.rule50_count;
+    step.move_count = planes.move_count;
+    m_game.last_planes = planes;
+    m_game.data.emplace_back(std::move(step));
+}
+
+void Training::unpack_planes(const TimeStep& step, Network::NNPlanes& planes) {
+    const auto history_planes = Network::T_HISTORY * Network::get_hist_planes();
+    auto unpacked = Network::NNPlanes{};
+    if (step.shifted) {
+        Network::shift_history(planes, unpacked);
+    }
+    for (auto p = size_t{0}; p < step.planes.size(); p++) {
+        unpacked.bit[p] = Network::BoardPlane(step.planes[p]);
+    }
+    for (auto i = 0; i < 5; i++) {
+        if (step.aux_planes & (1 << i)) {
+            unpacked.bit[history_planes + i].set();
+        }
+    }
+    unpacked.rule50_count = step.rule50_count;
+    unpacked.move_count = step.move_count;
+    planes = unpacked;
+}
+
+std::vector<float> Training::get_probabilities(const TimeStep& step) {
+    auto probabilities = std::vector<float>(Network::get_num_output_policy());
+    for (const auto& p : step.probabilities) {
+        probabilities[p.first] = p.second;
+    }
+    return probabilities;
 }
 
 // Used by supervised learning
 void Training::record(const BoardHistory& state, Move move) {
     auto step = TimeStep{};
     step.to_move = state.cur().side_to_move();
-    step.planes = Network::NNPlanes{};
-    Network::gather_features(state, step.planes);
-
-    // TODO: Does the SL flow require you to load a network file?
-    // Because now Network parses the file and stores m_format_version.
-    // Probably we will need a setter function
-    // e.g. Network::set_format_version(2)
-    throw std::runtime_error("Need to update SL flow");
-    step.probabilities.resize(Network::get_num_output_policy());
-    step.probabilities[Network::lookup(move, state.cur().side_to_move())] = 1.0;
-    m_data.emplace_back(step);
+    auto planes = Network::NNPlanes{};
+    Network::gather_features(state, planes);
+
+    step.probabilities.emplace_back(
+        Network::lookup(move, state.cur().side_to_move()), 1.0f);
+    add_step(step, planes);
+}
+
+void Training::dump_supervised(const std::string& pgn_filename,
+                               const std::string& out_basename) {
+    PGNFile pgn(pgn_filename);
+    if (!pgn.is_open()) {
+        throw std::runtime_error("Could not open " + pgn_filename);
+    }
+    OutputChunker chunker{out_basename, true, 15000};
+
+    // This thread splits the file into games, the pool threads parse, record
+    // and encode them, and the chunker compresses and writes them. Every pool
+    // thread records its game in its own Training buffer, so the games can end
+    // up in the chunks in a different order than in the PGN. The tasks are
+    // reused, so queueing a game doesn't allocate.
+    struct GameTask : public Utils::ThreadPool::Task {
+        std::function<void(GameTask&)> process;
+        PGNSpan span;
+        void run() override { process(*this); }
+    };
+    const auto max_queued = size_t(4 * std::max(1, cfg_num_threads));
+    std::mutex mutex;
+    std::condition_variable space_cv;
+    std::vector<GameTask> tasks(max_queued);
+    std::vector<GameTask*> idle;
+    auto done = false;
+    std::exception_ptr error;
+    std::atomic<int> games{0};
+
+    auto process = [&](GameTask& task) {
+        try {
+            auto game = parse_pgn_game(task.span);
+            clear_thread_training();
+            BoardHistory bh;
+            bh.set(Position::StartFEN);
+            for (int i = 0; i < static_cast<int>(game->bh.positions.size()) - 1; ++i) {
+                Move move = game->bh.positions[i + 1].get_move();
+                record(bh, move);
+                bh.do_move(move);
+            }
+            dump_training_v2(game->result, chunker);
+            Utils::myprintf_so("\rProcessed %d games", ++games);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            done = true;
+        }
+        // Notify under the lock: once the task is idle, the wait for the last
+        // one can return and destroy the condition variable.
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(&task);
+        space_cv.notify_one();
+    };
+    for (auto& task : tasks) {
+        task.process = process;
+        idle.push_back(&task);
+    }
+
+    for (;;) {
+        PGNSpan span;
+        if (!pgn.next(span)) {
+            Utils::myprintf_so("\nInvalid game in %s\n", pgn_filename.c_str());
+            break;
+        }
+        GameTask* task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            space_cv.wait(lock, [&] { return done || !idle.empty(); });
+            if (done) {
+                break;
+            }
+            task = idle.back();
+            idle.pop_back();
+        }
+        task->span = span;
+        thread_pool.submit(*task);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        space_cv.wait(lock, [&] { return idle.size() == tasks.size(); });
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
 }
 
 // Used by self play
 void Training::record(const BoardHistory& state, UCTNode& root) {
     auto step = TimeStep{};
     step.to_move = state.cur().side_to_move();
-    step.planes = Network::NNPlanes{};
-    Network::gather_features(state, step.planes);
+    auto planes = Network::NNPlanes{};
+    Network::gather_features(state, planes);
 
     auto result = Network::get_scored_moves(state);
     step.net_winrate = result.second;
@@ -133,13 +361,11 @@ void Training::record(const BoardHistory& state, UCTNode& root) {
     step.child_uct_winrate = best_node.get_eval(step.to_move);
     step.bestmove_visits = best_node.get_visits();
 
-    step.probabilities.resize(Network::get_num_output_policy());
-
     // Get total visit amount. We count rather
     // than trust the root to avoid ttable issues.
     auto sum_visits = 0.0;
     for (const auto& child : root.get_children()) {
-        sum_visits += child->get_visits();
+        sum_visits += child.get_visits();
     }
 
     // In a terminal position, we can have children, but we will not able to
@@ -151,16 +377,17 @@ void Training::record(const BoardHistory& state, UCTNode& root) {
     }
 
     for (const auto& child : root.get_children()) {
-        auto prob = static_cast<float>(child->get_visits() / sum_visits);
-        auto move = child->get_move();
-        step.probabilities[Network::lookup(move, state.cur().side_to_move())] = prob;
+        auto prob = static_cast<float>(child.get_visits() / sum_visits);
+        auto move = child.get_move();
+        step.probabilities.emplace_back(
+            Network::lookup(move, state.cur().side_to_move()), prob);
     }
 
-    m_data.emplace_back(step);
+    add_step(step, planes);
 }
 
 void Training::dump_training(int game_score, const std::string& out_filename) {
-    auto chunker = OutputChunker{out_filename, true};
+    OutputChunker chunker{out_filename, true};
     dump_training(game_score, chunker);
 }
 
@@ -188,13 +415,15 @@ void Training::dump_training_v2(int game_score, OutputChunker& outchunk) {
     assert(VERSION == 2 || VERSION == 3);
 
     std::stringstream out;
-    for (const auto& step : m_data) {
+    auto planes = Network::NNPlanes{};
+    for (const auto& step : m_game.data) {
+        unpack_planes(step, planes);
+
         // Store the binary version number (4 bytes)
         out.write(reinterpret_cast<char*>(&VERSION), sizeof(VERSION));
 
         // Then the move probabilities
-        assert(step.probabilities.size() == Network::get_num_output_policy());
-        for (auto p : step.probabilities) {
+        for (auto p : get_probabilities(step)) {
             uint32 *vp = reinterpret_cast<uint32*>(&p);
             uint32 v = htole32(*vp);
             out.write(reinterpret_cast<char*>(&v), sizeof(v));
@@ -203,7 +432,7 @@ void Training::dump_training_v2(int game_score, OutputChunker& outchunk) {
         // bitplanes
         int kFeatureBase = Network::T_HISTORY * Network::get_hist_planes();
         for (int p = 0; p < kFeatureBase; p++) {
-            const auto& plane = fix_v2(step.planes.bit[p]);
+            const auto& plane = fix_v2(planes.bit[p]);
             auto val = htole64(plane.to_ullong());
             assert(plane.size() == 64);
             out.write(reinterpret_cast<char*>(&val), sizeof(val));
@@ -211,16 +440,16 @@ void Training::dump_training_v2(int game_score, OutputChunker& outchunk) {
 
         // castling and side to move (5 bytes)
         for (int i = 0; i < 5; ++i) {
-            auto bit = static_cast<std::uint8_t>(step.planes.bit[kFeatureBase+i][0]);
+            auto bit = static_cast<std::uint8_t>(planes.bit[kFeatureBase+i][0]);
             out.write(reinterpret_cast<char*>(&bit), 1);
         }
 
         // rule 50 (1 byte)
-        auto rule50 = static_cast<std::uint8_t>(std::min(255, step.planes.rule50_count));
+        auto rule50 = static_cast<std::uint8_t>(std::min(255, planes.rule50_count));
         out.write(reinterpret_cast<char*>(&rule50), 1);
 
         // move count (1 byte)
-        auto move_count = static_cast<std::uint8_t>(std::min(255, step.planes.move_count));
+        auto move_count = static_cast<std::uint8_t>(std::min(255, planes.move_count));
         out.write(reinterpret_cast<char*>(&move_count), 1);
 
         // And the game result (1 byte)
@@ -228,17 +457,20 @@ void Training::dump_training_v2(int game_score, OutputChunker& outchunk) {
         out.write(reinterpret_cast<char*>(&result), 1);
     }
     assert(Network::get_format_version() == 1
-        ? out.str().size() == m_data.size() * 8604
-        : out.str().size() == m_data.size() * 8276);
+        ? out.str().size() == m_game.data.size() * 8604
+        : out.str().size() == m_game.data.size() * 8276);
     outchunk.append(out.str());
 }
 
 void Training::dump_training(int game_score, OutputChunker& outchunk) {
     std::stringstream out;
-    for (const auto& step : m_data) {
+    auto planes = Network::NNPlanes{};
+    for (const auto& step : m_game.data) {
+        unpack_planes(step, planes);
+        const auto probabilities = get_probabilities(step);
         int kFeatureBase = Network::T_HISTORY * 14;
         for (int p = 0; p < kFeatureBase; p++) {
-            const auto& plane = step.planes.bit[p];
+            const auto& plane = planes.bit[p];
             // Write it out as a string of hex characters
             for (auto bit = size_t{0}; bit + 3 < plane.size(); bit += 4) {
                 auto hexdigit =  plane[bit]     << 3
@@ -251,14 +483,14 @@ void Training::dump_training(int game_score, OutputChunker& outchunk) {
             out << std::dec << std::endl;
         }
         for (int i = 0; i < 5; ++i) {
-            out << (step.planes.bit[kFeatureBase + i][0] ? "1" : "0") << std::endl;
+            out << (planes.bit[kFeatureBase + i][0] ? "1" : "0") << std::endl;
         }
-        out << step.planes.rule50_count << std::endl;
-        out << step.planes.move_count << std::endl;
+        out << planes.rule50_count << std::endl;
+        out << planes.move_count << std::endl;
         // Then the move probabilities
-        for (auto it = begin(step.probabilities); it != end(step.probabilities); ++it) {
+        for (auto it = begin(probabilities); it != end(probabilities); ++it) {
             out << *it;
-            if (std::next(it) != end(step.probabilities)) {
+            if (std::next(it) != end(probabilities)) {
                 out << " ";
             }
         }
@@ -270,14 +502,14 @@ void Training::dump_training(int game_score, OutputChunker& outchunk) {
 }
 
 void Training::dump_stats(const std::string& filename) {
-    auto chunker = OutputChunker{filename, true};
+    OutputChunker chunker{filename, true};
     dump_stats(chunker);
 }
 
 void Training::dump_stats(OutputChunker& outchunk) {
     std::stringstream out;
     out << "1" << std::endl; // File format version 1
-    for (const auto& step : m_data) {
+    for (const auto& step : m_game.data) {
         out << step.net_winrate
             << " " << step.root_uct_winrate
             << " " << step.child_uct_winrate
@@ -19,8 +19,15 @@
 #ifndef TRAINING_H_INCLUDED
 #define TRAINING_H_INCLUDED
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "config.h"
 #include "Network.h"
@@ -28,8 +35,17 @@
 
 class TimeStep {
 public:
-    Network::NNPlanes planes;
-    std::vector<float> probabilities;
+    // The history planes as bit masks. If shifted is set these are only the
+    // planes of the newest board, and the older boards are those of the step
+    // before, which is how consecutive plies of a game relate.
+    std::vector<std::uint64_t> planes;
+    bool shifted;
+    // Castling rights and side to move, a bit per plane.
+    std::uint8_t aux_planes;
+    int rule50_count;
+    int move_count;
+    // The moves searched, by policy index. The rest are zero.
+    std::vector<std::pair<std::uint16_t, float>> probabilities;
     Color to_move;
     float net_winrate;
     float root_uct_winrate;
@@ -37,17 +53,34 @@ public:
     int bestmove_visits;
 };
 
+// Groups the serialized games into chunks. The chunks are compressed and
+// written by a background thread, so a slow disk doesn't stall the game
+// threads. Up to MAX_PENDING chunks can wait to be written before append()
+// blocks.
 class OutputChunker {
 public:
     OutputChunker(const std::string& basename, bool compress = false, size_t num_games = NUM_GAMES);
+    // Writes whatever is left and waits for all chunks to be on disk.
     ~OutputChunker();
-    void append(const std::string& str);
+    OutputChunker(const OutputChunker&) = delete;
+    OutputChunker& operator=(const OutputChunker&) = delete;
+
+    void append(std::string str);
 
     // Group this many games in a chunk.
     static constexpr size_t NUM_GAMES = 5;
+    // Chunks that can be queued for the writer.
+    static constexpr size_t MAX_PENDING = 4;
 private:
+    struct Chunk {
+        std::string name;
+        std::string data;
+    };
+
     std::string gen_chunk_name() const;
     void flush_chunk();
+    void writer();
+    void write_chunk(const Chunk& chunk);
 
     size_t m_game_count{0};
     size_t m_chunk_count{0};
@@ -55,21 +88,62 @@ private:
     std::string m_basename;
     bool m_compress{false};
     size_t m_games_per_chunk;
+
+    // Lets several threads append() games.
+    std::mutex m_append_mutex;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Chunk> m_pending;
+    // The first error of the writer, rethrown by the next append().
+    std::exception_ptr m_error;
+    bool m_exit{false};
+    std::thread m_writer;
 };
 
 class Training {
 public:
+    // Clears the games of all threads. None may be recording meanwhile.
     static void clear_training();
+    // Clears the game of the calling thread, to record a new one while
+    // other threads keep recording theirs.
+    static void clear_thread_training();
     static void dump_training(int game_score, const std::string& out_filename);
     static void dump_training(int game_score, OutputChunker& outchunker);
     static void dump_training_v2(int game_score, OutputChunker& outchunker);
     static void dump_stats(const std::string& out_filename);
     static void record(const BoardHistory& state, Move move);
     static void record(const BoardHistory& state, UCTNode& node);
+    // Converts the games of a PGN file into training data, in chunks named
+    // like out_basename. The games are parsed and recorded on the thread
+    // pool, so the chunks need not keep their order.
+    static void dump_supervised(const std::string& pgn_filename,
+                                const std::string& out_basename);
 
 private:
     static void dump_stats(OutputChunker& outchunker);
-    static std::vector<TimeStep> m_data;
+    // Store the planes of step in packed form and add it to m_game.
+    static void add_step(TimeStep& step, const Network::NNPlanes& planes);
+    // Turn the planes of the step before step into the ones of step.
+    static void unpack_planes(const TimeStep& step, Network::NNPlanes& planes);
+    static std::vector<float> get_probabilities(const TimeStep& step);
+    // Every thread records its own game, so that several games can be
+    // recorded at once.
+    struct ThreadGame {
+        ThreadGame();
+        ~ThreadGame();
+        std::vector<TimeStep> data;
+        // The planes of the last step in data.
+        Network::NNPlanes last_planes;
+    };
+    static thread_local ThreadGame m_game;
+    // The games of all threads, for clear_training().
+    struct GameRegistry {
+        std::mutex mutex;
+        std::vector<ThreadGame*> games;
+    };
+    // Never destroyed: pool threads unregister their games when they exit,
+    // which can be after the static destructors ran.
+    static GameRegistry& game_registry();
 };
 
 #endif
@@ -0,0 +1,132 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "TreeSnapshot.h"
+#include "UCTNodePool.h"
+#include "Utils.h"
+
+namespace {
+
+constexpr char MAGIC[8] = {'L', 'C', 'Z', 'T', 'R', 'E', 'E', '\0'};
+constexpr std::uint32_t VERSION = 1;
+
+// Followed by the serialized root.
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    // Utils::hash_file() of the weights.
+    std::uint64_t network_hash;
+    // full_key() of the position of the root.
+    std::uint64_t root_key;
+};
+
+}
+
+TreeSnapshot& TreeSnapshot::get_TreeSnapshot(void) {
+    static TreeSnapshot snapshot;
+    return snapshot;
+}
+
+bool TreeSnapshot::save(const std::string& filename, const UCTNode& root,
+                        Key root_key, const std::string& weightsfile,
+                        int min_visits) {
+    auto header = Header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.root_key = root_key;
+    if (!Utils::hash_file(weightsfile, header.network_hash)) {
+        return false;
+    }
+
+    auto tree = std::string{};
+    root.serialize(tree, min_visits);
+
+    auto out = std::ofstream{filename, std::ios::binary};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(tree.data(), tree.size());
+    return static_cast<bool>(out);
+}
+
+bool TreeSnapshot::load(const std::string& filename,
+                        const std::string& weightsfile) {
+    clear();
+
+    auto in = std::ifstream{filename, std::ios::binary};
+    auto data = std::string{std::istreambuf_iterator<char>(in),
+                            std::istreambuf_iterator<char>()};
+    auto header = Header{};
+    if (data.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    auto network_hash = std::uint64_t{};
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+        || header.version != VERSION
+        || !Utils::hash_file(weightsfile, network_hash)
+        || header.network_hash != network_hash) {
+        return false;
+    }
+
+    // Check that the tree reads back, so that find() only fails for
+    // positions that aren't in it.
+    auto begin = data.data() + sizeof(header);
+    auto end = data.data() + data.size();
+    auto tree = begin;
+    if (!UCTNode::deserialize(MOVE_NONE, tree, end) || tree != end) {
+        return false;
+    }
+
+    m_root_key = header.root_key;
+    m_tree.assign(begin, end);
+    return true;
+}
+
+void TreeSnapshot::clear() {
+    m_root_key = 0;
+    m_tree.clear();
+}
+
+UCTNode::node_ptr_t TreeSnapshot::find(BoardHistory& bh) const {
+    if (m_tree.empty()) {
+        return nullptr;
+    }
+    auto data = m_tree.data();
+    if (bh.cur().full_key() == m_root_key) {
+        return UCTNode::deserialize(bh.cur().get_move(), data,
+                                    data + m_tree.size());
+    }
+    // Maybe a later position, through the moves played since the root.
+    auto found = false;
+    for (const auto& pos : bh.positions) {
+        found |= pos.full_key() == m_root_key;
+    }
+    if (!found) {
+        return nullptr;
+    }
+    auto root = UCTNode::deserialize(MOVE_NONE, data, data + m_tree.size());
+    auto node = root->find_new_root(m_root_key, bh);
+    UCTNodePool::get_UCTNodePool().release_async(std::move(root));
+    return node;
+}
@@ -0,0 +1,64 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TREESNAPSHOT_H_INCLUDED
+#define TREESNAPSHOT_H_INCLUDED
+
+#include "config.h"
+
+#include <string>
+
+#include "Position.h"
+#include "UCTNode.h"
+
+// A search tree saved to a file, with the visits, evals and priors of its
+// nodes. Searches of the positions in it start from the saved subtree
+// rather than from scratch, e.g. from a deep search of the opening in
+// games at short time controls. A snapshot is only used with the network
+// it was searched with.
+class TreeSnapshot {
+public:
+    // return the global TreeSnapshot
+    static TreeSnapshot& get_TreeSnapshot(void);
+
+    // Writes the tree below @root, which is the position with @root_key,
+    // searched with the network in @weightsfile. Children with fewer than
+    // @min_visits visits are left out.
+    static bool save(const std::string& filename, const UCTNode& root,
+                     Key root_key, const std::string& weightsfile,
+                     int min_visits);
+
+    // Replaces the snapshot with the one in @filename. Returns false, and
+    // holds none, if the file can't be read or is for another network.
+    // Must not be called while a search runs.
+    bool load(const std::string& filename, const std::string& weightsfile);
+    void clear();
+
+    // A new tree from the snapshot for the last position of @bh, or
+    // nullptr if the snapshot doesn't reach it.
+    UCTNode::node_ptr_t find(BoardHistory& bh) const;
+
+private:
+    TreeSnapshot() = default;
+
+    Key m_root_key{0};
+    // The serialized root, see UCTNode::serialize().
+    std::string m_tree;
+};
+
+#endif
@@ -28,8 +28,11 @@
 #include <random>
 #include <cmath>
 #include <fstream>
+#include <future>
+#include <mutex>
 
 #include "Parameters.h"
+#include "Network.h"
 #include "OpenCL.h"
 #include "Tuner.h"
 #include "Utils.h"
@@ -46,7 +49,20 @@
 #endif
 
 const auto TUNER_FILE_LOCAL = std::string("leelaz_opencl_tuning");
+
+// Devices are initialized in parallel, so the tuning file is read and
+// written under a lock, and identical devices share one tuning, by the
+// prefix of its line and the device key.
+static std::mutex tuning_file_mutex;
+static std::mutex tunings_mutex;
+static std::map<std::string, std::shared_future<std::string>> tunings;
 constexpr auto MAX_ERROR = 1e-4f;
+// Half floats only have 11 bits of mantissa.
+constexpr auto MAX_ERROR_HALF = 1e-1f;
+// Largest error of the F(4x4, 3x3) winograd convolution relative to the
+// largest output, like the CPU allows.
+constexpr auto MAX_ERROR_WINOGRAD = 1e-3f;
+constexpr auto MAX_ERROR_WINOGRAD_HALF = 1e-2f;
 
 using namespace Utils;
 
@@ -70,6 +86,45 @@ static void sgemmBatched_ref(const std::vector<float>& a,
     }
 }
 
+// The 3x3 convolution of the 8x8 inputs of some positions, without bias,
+// followed by a ReLU like the winograd convolutions of the network.
+static void convolve3_ref(const std::vector<float>& input,
+                          const std::vector<float>& weights,
+                          std::vector<float>& output,
+                          const int channels, const int outputs,
+                          const int positions) {
+    constexpr auto width = 8;
+    constexpr auto height = 8;
+    for (auto n = 0; n < positions; n++) {
+        for (auto o = 0; o < outputs; o++) {
+            for (auto y = 0; y < height; y++) {
+                for (auto x = 0; x < width; x++) {
+                    auto sum = 0.0f;
+                    for (auto c = 0; c < channels; c++) {
+                        for (auto i = 0; i < 3; i++) {
+                            const auto yy = y + i - 1;
+                            if (yy < 0 || yy >= height) {
+                                continue;
+                            }
+                            for (auto j = 0; j < 3; j++) {
+                                const auto xx = x + j - 1;
+                                if (xx < 0 || xx >= width) {
+                                    continue;
+                                }
+                                sum += weights[(o * channels + c) * 9
+                                               + i * 3 + j]
+                                     * input[((n * channels + c) * height + yy)
+                                             * width + xx];
+                            }
+                        }
+                    }
+                    output[((n * outputs + o) * height + y) * width + x] =
+                        std::max(sum, 0.0f);
+                }
+            }
+        }
+    }
+}
 
 static bool IsMultiple(const size_t a, const size_t b) {
     return (a % b == 0);
@@ -258,15 +313,23 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
 
     sgemmBatched_ref(at, b, c_ref, m, n, k, batch_size);
 
+    // The kernels are built with the same precision as the network, so
+    // the test matrices have to be converted to the device format.
+    const auto elem_size = m_opencl.get_element_size();
+    const auto max_error = m_opencl.m_use_half ? MAX_ERROR_HALF : MAX_ERROR;
+    auto at_dev = std::vector<char>(elem_size * at_size);
+    auto b_dev = std::vector<char>(elem_size * b_size);
+    auto c_dev = std::vector<char>(elem_size * c_size);
+
     auto aBuffer = cl::Buffer(
         m_context,
-        CL_MEM_READ_WRITE, sizeof(float) * at_size, nullptr, nullptr);
+        CL_MEM_READ_WRITE, elem_size * at_size, nullptr, nullptr);
     auto bBuffer = cl::Buffer(
         m_context,
-        CL_MEM_READ_WRITE, sizeof(float) * b_size, nullptr, nullptr);
+        CL_MEM_READ_WRITE, elem_size * b_size, nullptr, nullptr);
     auto cBuffer = cl::Buffer(
         m_context,
-        CL_MEM_READ_WRITE, sizeof(float) * c_size, nullptr, nullptr);
+        CL_MEM_READ_WRITE, elem_size * c_size, nullptr, nullptr);
 
     myprintf("\nStarted OpenCL SGEMM tuner.\n");
 
@@ -335,10 +398,12 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
             sgemm_generate_data(at, k, m, batch_size, k_ceil, m_ceil);
             sgemm_generate_data(b, n, k, batch_size, n_ceil, k_ceil);
 
+            m_opencl.to_device(at.data(), at_dev.data(), at_size);
+            m_opencl.to_device(b.data(), b_dev.data(), b_size);
             queue.enqueueWriteBuffer(aBuffer, CL_FALSE, 0,
-                                     at_size * sizeof(float), at.data());
+                                     at_dev.size(), at_dev.data());
             queue.enqueueWriteBuffer(bBuffer, CL_FALSE, 0,
-                                     b_size * sizeof(float), b.data());
+                                     b_dev.size(), b_dev.data());
             queue.finish();
         }
 
@@ -357,7 +422,7 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
                                   (size_t)batch_size};
 
         auto sum = 0.0f;
-        auto max_error = 0.0f;
+        auto error = 0.0f;
         for (auto r = 0; r < runs; r++) {
             try {
                 queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
@@ -367,12 +432,13 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
                 event.wait();
 
                 queue.enqueueReadBuffer(cBuffer, CL_FALSE, 0,
-                                        c_size * sizeof(float), c.data());
+                                        c_dev.size(), c_dev.data());
                 queue.finish();
+                m_opencl.from_device(c_dev.data(), c.data(), c_size);
 
                 auto this_error = compare_ref(c, c_ref, n, m, batch_size,
                                               n_ceil, m_ceil);
-                max_error = std::max(max_error, this_error);
+                error = std::max(error, this_error);
 
                 auto elapsed =
                     event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
@@ -381,11 +447,11 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
                 sum += elapsed;
             } catch (const cl::Error&) {
                 // Failed to enqueue kernel. Set error to max.
-                max_error = MAX_ERROR;
+                error = max_error;
                 break;
             }
         }
-        if (max_error < MAX_ERROR && (best_time == 0 || sum < best_time)) {
+        if (error < max_error && (best_time == 0 || sum < best_time)) {
             auto param_str = parameters_to_string(p);
             auto kernel_ms = 1e-6f * (sum / runs);
             // Timing is in nanoseconds (10^-9), Giga = 10^9, so this works out
@@ -404,8 +470,200 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
     return best_params;
 }
 
-void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
-                               const int batch_size, std::string tuners) {
+std::string Tuner::tune_winograd(const int channels, const int positions,
+                                 const int runs) {
+    constexpr auto boardsize = 8 * 8;
+
+    // Tower inputs come out of a ReLU.
+    auto rng = Random{0};
+    auto input = std::vector<float>(positions * channels * boardsize);
+    for (auto& x : input) {
+        x = rng.RandFlt(1.0f);
+    }
+    auto weights = std::vector<float>(channels * channels * 9);
+    for (auto& w : weights) {
+        w = rng.RandFlt(2.0f) - 1.0f;
+    }
+    auto ref = std::vector<float>(positions * channels * boardsize);
+    convolve3_ref(input, weights, ref, channels, channels, positions);
+    auto scale = 1e-6f;
+    for (const auto x : ref) {
+        scale = std::max(scale, x);
+    }
+
+    const auto elem_size = m_opencl.get_element_size();
+    const auto max_error = m_opencl.m_use_half ? MAX_ERROR_WINOGRAD_HALF
+                                               : MAX_ERROR_WINOGRAD;
+    auto input_dev = std::vector<char>(elem_size * input.size());
+    m_opencl.to_device(input.data(), input_dev.data(), input.size());
+    // Zero bits are a zero in both formats.
+    auto biases_dev = std::vector<char>(elem_size * channels);
+    auto output_dev = std::vector<char>(elem_size * ref.size());
+    auto output = std::vector<float>(ref.size());
+
+    auto inBuffer = cl::Buffer(
+        m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        input_dev.size(), input_dev.data());
+    auto biasBuffer = cl::Buffer(
+        m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        biases_dev.size(), biases_dev.data());
+    auto outBuffer = cl::Buffer(
+        m_context, CL_MEM_WRITE_ONLY, output_dev.size());
+
+    auto queue = cl::CommandQueue(m_context,
+                                  m_device,
+                                  CL_QUEUE_PROFILING_ENABLE);
+
+    myprintf("\nTiming the OpenCL winograd convolutions.\n");
+
+    auto best_m = 0;
+    auto best_time = cl_ulong{0};
+    for (const auto m : {2, 4}) {
+        const auto tiles = winograd_p(m);
+        const auto tile = winograd_tile(m);
+        const auto sgemm_tuners =
+            load_sgemm_tuners(channels, tiles * positions, channels, tile);
+
+        auto program = cl::Program(m_context, sourceCode_config
+                                              + sourceCode_convolve3
+                                              + sourceCode_sgemm);
+        try {
+            auto args = m_opencl.m_cl_args
+                        + " -DWINOGRAD_M=" + std::to_string(m)
+                        + sgemm_tuners;
+            program.build(args.c_str());
+        } catch (const cl::Error&) {
+            myprintf("F(%dx%d, 3x3) failed to build.\n", m, m);
+            continue;
+        }
+
+        // The GEMM parameters of this variant, OpenCL::initialize()
+        // processes the ones it uses again afterwards.
+        m_opencl.process_tuners(sgemm_tuners);
+        const auto& p = m_opencl.m_sgemm_tuners;
+        const auto m_ceil = int(ceilMultiple(ceilMultiple(channels, p.mwg),
+                                             p.vwm));
+        const auto n_ceil = int(ceilMultiple(
+            ceilMultiple(tiles * positions, p.nwg), p.vwn));
+        const auto k_ceil = int(ceilMultiple(ceilMultiple(channels, p.kwg),
+                                             p.vwm));
+
+        const auto transform_f = m == 4 ? Network::winograd4_transform_f
+                                        : Network::winograd_transform_f;
+        const auto U = Network::zeropad_U(
+            transform_f(weights, channels, channels),
+            channels, channels, m_ceil, k_ceil, m + 2);
+        auto U_dev = std::vector<char>(elem_size * U.size());
+        m_opencl.to_device(U.data(), U_dev.data(), U.size());
+        // The GEMM reads the padding of V, which has to be zero.
+        auto V_zeros = std::vector<char>(elem_size * tile * k_ceil * n_ceil);
+
+        auto UBuffer = cl::Buffer(
+            m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            U_dev.size(), U_dev.data());
+        auto VBuffer = cl::Buffer(
+            m_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+            V_zeros.size(), V_zeros.data());
+        auto MBuffer = cl::Buffer(
+            m_context, CL_MEM_READ_WRITE,
+            elem_size * tile * m_ceil * n_ceil);
+
+        auto in_transform_kernel = cl::Kernel(program, "in_transform");
+        auto sgemm_kernel = cl::Kernel(program, "XgemmBatched");
+        auto out_transform_kernel =
+            cl::Kernel(program, "out_transform_fused_bias");
+        const auto wavefront_size = sgemm_kernel.getWorkGroupInfo<
+            CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(m_device);
+        const auto wgs = ceilMultiple(tiles, wavefront_size);
+
+        // The arguments of OpenCL_Network::convolve3().
+        in_transform_kernel.setArg(0, inBuffer);
+        in_transform_kernel.setArg(1, VBuffer);
+        in_transform_kernel.setArg(2, channels);
+        in_transform_kernel.setArg(3, k_ceil);
+        in_transform_kernel.setArg(4, n_ceil);
+
+        sgemm_kernel.setArg(0, m_ceil);
+        sgemm_kernel.setArg(1, n_ceil);
+        sgemm_kernel.setArg(2, k_ceil);
+        sgemm_kernel.setArg(3, UBuffer);
+        sgemm_kernel.setArg(4, VBuffer);
+        sgemm_kernel.setArg(5, MBuffer);
+        cl::NDRange local_sgemm = {p.mdimc, p.ndimc, 1};
+        cl::NDRange size_sgemm = {(m_ceil * p.mdimc) / p.mwg,
+                                  (n_ceil * p.ndimc) / p.nwg,
+                                  (cl::size_type)tile};
+
+        out_transform_kernel.setArg(0, MBuffer);
+        out_transform_kernel.setArg(1, outBuffer);
+        out_transform_kernel.setArg(2, channels);
+        out_transform_kernel.setArg(3, m_ceil);
+        out_transform_kernel.setArg(4, n_ceil);
+        out_transform_kernel.setArg(5, nullptr);
+        out_transform_kernel.setArg(6, biasBuffer);
+
+        auto sum = cl_ulong{0};
+        try {
+            for (auto r = 0; r < runs; r++) {
+                auto events = std::array<cl::Event, 3>{};
+                queue.enqueueNDRangeKernel(in_transform_kernel, cl::NullRange,
+                                           cl::NDRange(wgs, channels,
+                                                       positions),
+                                           cl::NullRange, nullptr,
+                                           &events[0]);
+                queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
+                                           size_sgemm, local_sgemm,
+                                           nullptr, &events[1]);
+                queue.enqueueNDRangeKernel(out_transform_kernel,
+                                           cl::NullRange,
+                                           cl::NDRange(channels, wgs,
+                                                       positions),
+                                           cl::NullRange, nullptr,
+                                           &events[2]);
+                queue.finish();
+                for (const auto& event : events) {
+                    sum +=
+                        event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                        event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                }
+            }
+            queue.enqueueReadBuffer(outBuffer, CL_TRUE, 0,
+                                    output_dev.size(), output_dev.data());
+        } catch (const cl::Error&) {
+            myprintf("F(%dx%d, 3x3) failed to run.\n", m, m);
+            continue;
+        }
+        m_opencl.from_device(output_dev.data(), output.data(), output.size());
+
+        auto error = 0.0f;
+        for (auto i = size_t{0}; i < output.size(); i++) {
+            error = std::max(error, std::fabs(output[i] - ref[i]));
+        }
+        error /= scale;
+        myprintf("F(%dx%d, 3x3) %.4f ms, largest error %.2g\n",
+                 m, m, 1e-6f * (sum / runs), error);
+        // F(2x2, 3x3) is what the network always ran with, the larger
+        // constants of F(4x4, 3x3) must not cost precision that matters.
+        if (m == 4 && error > max_error) {
+            myprintf("F(4x4, 3x3) is too far off the reference convolution.\n");
+            continue;
+        }
+        if (best_m == 0 || sum < best_time) {
+            best_m = m;
+            best_time = sum;
+        }
+    }
+    if (best_m == 0) {
+        myprintf_so("Failed to find a working configuration.\nCheck your OpenCL drivers.\n");
+        throw std::runtime_error("Tuner failed to find working configuration.");
+    }
+    return " -DWINOGRAD_M=" + std::to_string(best_m);
+}
+
+void Tuner::store_tuners(const std::string& kernel,
+                         const int m, const int n, const int k,
+                         const int batch_size, std::string tuners) {
+    std::lock_guard<std::mutex> lock(tuning_file_mutex);
     auto file_contents = std::vector<std::string>();
     {
         // Read the previous contents to string
@@ -419,19 +677,18 @@ void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
     }
     auto file = std::ofstream{TUNER_FILE_LOCAL};
 
-    auto device_name = m_opencl.get_device_name();
-    auto tuning_params = std::stringstream{};
-    tuning_params << m << ";" << n << ";" << k << ";" << batch_size;
+    auto tuning_line_prefix =
+        get_tuning_line_prefix(kernel, m, n, k, batch_size);
+    auto device_suffix = ";" + get_device_key();
+    auto tuning_line = tuning_line_prefix + tuners + device_suffix;
 
-    auto tuning_line_prefix = std::to_string(TUNER_VERSION) + ";XgemmBatched;"
-        + tuning_params.str() + ";";
-    auto tuning_line = tuning_line_prefix + tuners + ";" + device_name;
-
-    // Write back previous data as long as it's not the device and
+    // Write back previous data as long as it's not the device, driver and
     // tuning we just tuned
     for (const auto& line: file_contents) {
-        if (line.find(tuning_line_prefix) == std::string::npos
-            || line.find(device_name) == std::string::npos) {
+        if (line.compare(0, tuning_line_prefix.size(), tuning_line_prefix) != 0
+            || line.size() < device_suffix.size()
+            || line.compare(line.size() - device_suffix.size(),
+                            device_suffix.size(), device_suffix) != 0) {
             file << line << std::endl;
         }
     }
@@ -446,9 +703,32 @@ void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
     }
 }
 
-std::string Tuner::sgemm_tuners_from_line(std::string line,
-                                          const int m, const int n, const int k,
-                                          const int batch_size) {
+std::string Tuner::get_kernel_tag(const std::string& kernel) {
+    // Half precision kernels are tuned separately.
+    return m_opencl.m_use_half ? kernel + "Half" : kernel;
+}
+
+std::string Tuner::get_device_key() {
+    // Tunings are only reused on the same device with the same driver,
+    // a driver update can change which kernels are fastest.
+    return m_opencl.get_device_name() + ";" + m_opencl.get_driver_version();
+}
+
+std::string Tuner::get_tuning_line_prefix(const std::string& kernel,
+                                          const int m, const int n,
+                                          const int k, const int batch_size) {
+    auto tuning_params = std::stringstream{};
+    tuning_params << m << ";" << n << ";" << k << ";" << batch_size;
+
+    return std::to_string(TUNER_VERSION) + ";" + get_kernel_tag(kernel) + ";"
+        + tuning_params.str() + ";";
+}
+
+std::string Tuner::tuners_from_line(std::string line,
+                                    const std::string& kernel,
+                                    const int m, const int n, const int k,
+                                    const int batch_size) {
+    // version;kernel;m;n;k;batch_size;tuners;device;driver
     auto s = std::vector<std::string>{};
     auto ss = std::stringstream{line};
     auto item = std::string{};
@@ -457,7 +737,7 @@ std::string Tuner::sgemm_tuners_from_line(std::string line,
         s.emplace_back(item);
     }
 
-    if (s.size() != 8) {
+    if (s.size() != 9) {
         return "";
     }
 
@@ -465,7 +745,7 @@ std::string Tuner::sgemm_tuners_from_line(std::string line,
         return "";
     }
 
-    if (s[1] != "XgemmBatched") {
+    if (s[1] != get_kernel_tag(kernel)) {
         return "";
     }
 
@@ -489,24 +769,114 @@ std::string Tuner::sgemm_tuners_from_line(std::string line,
         return "";
     }
 
+    if (s[8] != m_opencl.get_driver_version()) {
+        return "";
+    }
+
     return s[6];
 }
 
-std::string Tuner::load_sgemm_tuners(const int m, const int n, const int k,
-                                     const int batch_size) {
-    auto file = std::ifstream{TUNER_FILE_LOCAL};
-    if (!cfg_sgemm_exhaustive && file.good()) {
+std::string Tuner::tuners_from_file(const std::string& filename,
+                                    const std::string& kernel,
+                                    const int m, const int n, const int k,
+                                    const int batch_size) {
+    std::lock_guard<std::mutex> lock(tuning_file_mutex);
+    auto file = std::ifstream{filename};
+    if (file.good()) {
         auto line = std::string{};
         while (std::getline(file, line)) {
-            auto tuners = sgemm_tuners_from_line(line, m, n, k, batch_size);
+            auto tuners = tuners_from_line(line, kernel, m, n, k, batch_size);
+            if (tuners.size() != 0) {
+                return tuners;
+            }
+        }
+    }
+    return "";
+}
+
+std::string Tuner::load_sgemm_tuners(const int m, const int n, const int k,
+                                     const int batch_size) {
+    return load_tuners("XgemmBatched", m, n, k, batch_size, [&] {
+        return tune_sgemm(m, n, k, batch_size);
+    });
+}
+
+int Tuner::load_winograd_m(const int channels, const int positions) {
+    if (cfg_winograd != 0) {
+        return cfg_winograd;
+    }
+    // The squares of all positions of a batch go through the same GEMMs.
+    constexpr auto boardsize = 8 * 8;
+    const auto tuners = load_tuners("Winograd", channels,
+                                    boardsize * positions, channels, 1, [&] {
+        return tune_winograd(channels, positions);
+    });
+    const auto found = tuners.find("=");
+    if (found == std::string::npos) {
+        return 2;
+    }
+    return std::stoi(tuners.substr(found + 1));
+}
+
+std::string Tuner::load_tuners(const std::string& kernel,
+                               const int m, const int n, const int k,
+                               const int batch_size, TuneFunction tune) {
+    // The first of identical devices to get here loads or tunes, the
+    // others wait for its result.
+    const auto key = get_tuning_line_prefix(kernel, m, n, k, batch_size)
+                     + get_device_key();
+    auto promise = std::promise<std::string>{};
+    auto tuning = std::shared_future<std::string>{};
+    auto first = false;
+    {
+        std::lock_guard<std::mutex> lock(tunings_mutex);
+        auto it = tunings.find(key);
+        if (it != end(tunings)) {
+            tuning = it->second;
+        } else {
+            tuning = promise.get_future().share();
+            tunings.emplace(key, tuning);
+            first = true;
+        }
+    }
+    if (!first) {
+        myprintf("Using the %s tuning of an identical device.\n",
+                 kernel.c_str());
+        return tuning.get();
+    }
+    try {
+        promise.set_value(load_or_tune(kernel, m, n, k, batch_size, tune));
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+    }
+    return tuning.get();
+}
+
+std::string Tuner::load_or_tune(const std::string& kernel,
+                                const int m, const int n, const int k,
+                                const int batch_size, TuneFunction tune) {
+    if (!cfg_sgemm_exhaustive) {
+        auto tuners = tuners_from_file(TUNER_FILE_LOCAL,
+                                       kernel, m, n, k, batch_size);
+        if (tuners.size() != 0) {
+            myprintf("Loaded existing %s tuning.\n", kernel.c_str());
+            return tuners;
+        }
+        // Fall back to the tunings someone else did for this device,
+        // and keep a copy so we don't depend on the database next time.
+        if (!cfg_tuning_db.empty()) {
+            tuners = tuners_from_file(cfg_tuning_db,
+                                      kernel, m, n, k, batch_size);
             if (tuners.size() != 0) {
-                myprintf("Loaded existing SGEMM tuning.\n");
+                myprintf("Loaded %s tuning from %s.\n",
+                         kernel.c_str(), cfg_tuning_db.c_str());
+                store_tuners(kernel, m, n, k, batch_size, tuners);
                 return tuners;
             }
         }
     }
-    auto tuners = tune_sgemm(m, n, k, batch_size);
-    store_sgemm_tuners(m, n, k, batch_size, tuners);
+    auto tuners = tune();
+    store_tuners(kernel, m, n, k, batch_size, tuners);
     return tuners;
 }
 
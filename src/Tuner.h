@@ -20,6 +20,7 @@
 #define SGEMM_TUNER_H_INCLUDED
 
 #include "config.h"
+#include <functional>
 #include <vector>
 #include <map>
 #include <string>
@@ -38,21 +39,47 @@ public:
                            const int batch_size, const int runs = 4);
     std::string load_sgemm_tuners(const int m, const int n, const int k,
                                   const int batch_size);
+    // Output tile of the winograd convolutions of a network with channels
+    // filters, 2 or 4: the one of --winograd, or else the one whose
+    // convolution of a batch of positions, with its transforms, is faster
+    // on this device.
+    int load_winograd_m(const int channels, const int positions);
 
-    static constexpr auto TUNER_VERSION = 0;
+    static constexpr auto TUNER_VERSION = 1;
     Tuner(OpenCL & opencl, cl::Context context, cl::Device device) :
         m_opencl(opencl), m_context(context), m_device(device) {}
 private:
-    void store_sgemm_tuners(const int m, const int n, const int k,
-                            const int batch_size, std::string tuners);
+    using TuneFunction = std::function<std::string()>;
+
+    std::string tune_winograd(const int channels, const int positions,
+                              const int runs = 4);
+    std::string load_tuners(const std::string& kernel,
+                            const int m, const int n, const int k,
+                            const int batch_size, TuneFunction tune);
+    std::string load_or_tune(const std::string& kernel,
+                             const int m, const int n, const int k,
+                             const int batch_size, TuneFunction tune);
+    void store_tuners(const std::string& kernel,
+                      const int m, const int n, const int k,
+                      const int batch_size, std::string tuners);
     bool valid_config_sgemm(TuneParameters p, bool exhaustive);
     std::string parameters_to_defines(const TuneParameters& p);
     std::string parameters_to_string(const TuneParameters& p);
     TuneParameters get_parameters_by_int(const std::vector<Configurations>& opts,
                                      const int n);
-    std::string sgemm_tuners_from_line(std::string line, const int m,
-                                       const int n, const int k,
+    std::string get_kernel_tag(const std::string& kernel);
+    std::string get_device_key();
+    std::string get_tuning_line_prefix(const std::string& kernel,
+                                       const int m, const int n, const int k,
                                        const int batch_size);
+    std::string tuners_from_line(std::string line,
+                                 const std::string& kernel,
+                                 const int m, const int n, const int k,
+                                 const int batch_size);
+    std::string tuners_from_file(const std::string& filename,
+                                 const std::string& kernel,
+                                 const int m, const int n, const int k,
+                                 const int batch_size);
 };
 
 #endif
@@ -19,20 +19,37 @@
  */
 
 #include <boost/filesystem.hpp>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <exception>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include "Movegen.h"
 #include "Parameters.h"
 #include "pgn.h"
 #include "Position.h"
 #include "Misc.h"
+#include "Random.h"
+#include "SMP.h"
+#include "NNBatchQueue.h"
+#include "NNCache.h"
+#include "NNDiskCache.h"
+#ifdef USE_OPENCL
+#include "OpenCLScheduler.h"
+#endif
+#include "TBCache.h"
+#include "TBProbeService.h"
 #include "Training.h"
+#include "TreeSnapshot.h"
 #include "UCI.h"
+#include "UCTNodePool.h"
 #include "UCTSearch.h"
 #include "Utils.h"
 #include "syzygy/tbprobe.h"
@@ -120,17 +137,56 @@ namespace {
           }
           else if (token == "movetime")  is >> Limits.movetime;
           else if (token == "infinite")  Limits.infinite = 1;
+          else if (token == "ponder")    Limits.ponder = 1;
       };
+      // Set here rather than by the search thread, so that a ponderhit
+      // right after the go isn't lost.
+      search.set_pondering(Limits.ponder != 0);
   }
 
-  // called when receiving the 'perft Depth' command
+  // called when receiving the 'perft Depth [Threads] [HashMB]' command
   void uci_perft(BoardHistory& bh, istringstream& is) {
-       int d;
-       is >> d;
+       int d = 1, threads = 1, hash_mb = 0;
+       is >> d >> threads >> hash_mb;
 
        Depth depth = Depth(d);
-       uint64_t total = UCI::perft<true>(bh, depth);
+       TimePoint start = now();
+       uint64_t total;
+       if (threads <= 1 && hash_mb <= 0) {
+           total = UCI::perft<true>(bh, depth);
+       } else {
+           std::vector<std::pair<Move, uint64_t>> root_counts;
+           total = UCI::perft_parallel(bh.cur(), depth, threads, hash_mb, &root_counts);
+           for (const auto& rc : root_counts)
+               myprintf_so("%s: %lld\n", UCI::move(rc.first).c_str(), rc.second);
+       }
+       TimePoint elapsed = now() - start;
        myprintf_so("Total: %lld\n", total);
+       myprintf_so("Time: %lld ms, %lld nps\n", (long long)elapsed,
+                   (long long)(total * 1000 / (elapsed + 1)));
+  }
+
+  // The --tree-snapshot is read again for every game, in case it was
+  // refreshed in between.
+  void load_tree_snapshot() {
+    if (cfg_tree_snapshot.empty()) {
+      return;
+    }
+    if (!TreeSnapshot::get_TreeSnapshot().load(cfg_tree_snapshot, cfg_weightsfile)) {
+      myprintf("Can't use the tree snapshot %s, it's missing, damaged or "
+               "for another network.\n", cfg_tree_snapshot.c_str());
+    }
+  }
+
+  // savetree <file> [min visits] saves the tree of the last search, for
+  // --tree-snapshot.
+  void save_tree(const UCTSearch& search, istringstream& is) {
+    string filename;
+    int min_visits = 10;
+    is >> filename >> min_visits;
+    if (filename.empty() || !search.save_tree(filename, min_visits)) {
+      myprintf_so("Could not save the tree.\n");
+    }
   }
 
   void printVersion() {
@@ -149,8 +205,8 @@ namespace {
       // Construct search inside the loop to ensure there is no tree reuse
       // which reduces the effectiveness of noise.
       auto search = std::make_unique<UCTSearch>(bh.shallow_clone());
-      Limits.startTime = now();
-      Move move = search->think(bh.shallow_clone());
+      // Games can run at once, so the start isn't kept in Limits.
+      Move move = search->think(bh.shallow_clone(), now());
 
       if (move != MOVE_NONE) {
         myprintf_so("move played %s\n", UCI::move(move).c_str());
@@ -183,7 +239,7 @@ namespace {
     BoardHistory bh;
     bh.set(Position::StartFEN);
 
-    Training::clear_training();
+    Training::clear_thread_training();
     int game_score = play_one_game(bh);
 
     myprintf_so("PGN\n%s\nEND\n", bh.pgn().c_str());
@@ -210,13 +266,116 @@ namespace {
       fs::create_directories(dir);
       myprintf_so("Created dirs %s\n", dir.string().c_str());
     }
-    auto chunker = OutputChunker{dir.string() + "/training", true};
-    for (int64_t i = 0; i < num_games; i++) {
-      Training::dump_training_v2(play_one_game(), chunker);
+    {
+      OutputChunker chunker{dir.string() + "/training", true};
+      // Every game thread records into its own Training buffers and plays
+      // games until num_games are started. The searches share the network,
+      // so their NN evaluations are batched together.
+      std::atomic<int64_t> games_started{0};
+      std::atomic<bool> failed{false};
+      std::mutex error_mutex;
+      std::exception_ptr error;
+      auto play_games = [&] {
+        try {
+          while (!failed && games_started++ < num_games) {
+            Training::dump_training_v2(play_one_game(), chunker);
+          }
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+          failed = true;
+        }
+      };
+      std::vector<std::thread> games;
+      for (int i = 1; i < cfg_selfplay_games; i++) {
+        games.emplace_back([&play_games] {
+          // They search next to the pool threads.
+          SMP::pin_thread();
+          play_games();
+        });
+      }
+      play_games();
+      for (auto& game : games) {
+        game.join();
+      }
+      if (error) {
+        std::rethrow_exception(error);
+      }
     }
+    // The chunks are on disk now. A client which keeps the engine running
+    // between games waits for this line rather than for the process to exit.
+    myprintf_so("trainok %s\n", dir.string().c_str());
+  }
+
+  // Positions for bench, besides the game below.
+  const char* BenchFENs[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r1bqkb1r/pp3ppp/2n1pn2/2pp4/3P4/2PBPN2/PP1N1PPP/R1BQK2R b KQkq - 1 6",
+    "2r2rk1/1bqnbppp/p2ppn2/1p6/3NP3/1BN1BP2/PPPQ2PP/2KR3R w - - 4 14",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "6k1/5pp1/7p/8/3R4/6P1/5PKP/2r5 b - - 3 40",
+  };
+
+  // Seed of the RNG during bench, so that every run searches alike.
+  constexpr uint64_t BenchSeed = 0x1ee1a;
+
+  struct BenchResult {
+    int playouts = 0;
+    int nodes = 0;
+    int nnevals = 0;
+    int cachehits = 0;
+    int cachelookups = 0;
+    TimePoint time = 0;
+  };
+
+  BenchResult bench_position(BoardHistory& bh, int playouts) {
+    auto& cache = NNCache::get_NNCache();
+    const auto start_rate = cache.hit_rate();
+
+    Random::GetRng().seedrandom(BenchSeed);
+    Limits = LimitsType();
+    auto search = std::make_unique<UCTSearch>(bh.shallow_clone());
+    search->set_playout_limit(playouts);
+    search->set_node_limit(0);
+    search->set_quiet(false);
+    TimePoint start = now();
+    search->think(bh.shallow_clone());
+
+    BenchResult r;
+    r.time = now() - start;
+    r.playouts = search->get_playouts();
+    r.nodes = search->get_nodes();
+    const auto rate = cache.hit_rate();
+    r.cachehits = rate.first - start_rate.first;
+    r.cachelookups = rate.second - start_rate.second;
+    // Every lookup that misses is followed by an evaluation.
+    r.nnevals = r.cachelookups - r.cachehits;
+    return r;
+  }
+
+  void print_bench(const std::string& name, const BenchResult& r) {
+    myprintf_so("bench %s playouts %d time %lld nps %lld nnevals %d nneps %lld "
+                "cachehits %d cachelookups %d cachehitrate %.3f treesize %d\n",
+                name.c_str(), r.playouts, (long long)r.time,
+                (long long)(r.playouts * 1000LL / (r.time + 1)), r.nnevals,
+                (long long)(r.nnevals * 1000LL / (r.time + 1)), r.cachehits,
+                r.cachelookups, double(r.cachehits) / std::max(1, r.cachelookups),
+                r.nodes);
   }
 
-  void bench() {
+  // called when receiving the 'bench [Playouts]' command. Searches every
+  // position of a fixed suite for a fixed number of playouts, with noise and
+  // randomization off, and prints one line of "key value" pairs for every
+  // position and one with the totals.
+  void bench(istringstream& is) {
+    int playouts = 800;
+    is >> playouts;
+
     std::string raw = R"EOM([Event "?"]
 [Site "?"]
 [Date "2018.01.14"]
@@ -241,23 +400,48 @@ Bg3 15. f4 d6 16. cxd6+ Ke8 17. Kg1 Bd7 18. a4 Rd8 {0.50s} 19. a5 Ra8 {0.54s}
     PGNParser parser(ss);
     auto game = parser.parse();
 
-    myprintf_so("%s\n", game->bh.cur().fen().c_str());
-
-    /*
-    Network::DebugRawData debug_data;
-    auto r = Network::get_scored_moves(game->bh, &debug_data);
-
-    FILE* f = fopen("/tmp/output", "w");
-    fputs(debug_data.getJson().c_str(), f);
-    fclose(f);
-    */
+    std::vector<BoardHistory> suite;
+    suite.emplace_back(game->bh.shallow_clone());
+    for (const char* fen : BenchFENs) {
+      suite.emplace_back();
+      suite.back().set(fen);
+    }
 
-    auto search = std::make_unique<UCTSearch>(game->bh.shallow_clone());
     auto save_cfg_timemanage = cfg_timemanage;
+    auto save_cfg_noise = cfg_noise;
+    auto save_cfg_randomize = cfg_randomize;
     cfg_timemanage = false;
-    search->set_quiet(false);
-    search->think(game->bh.shallow_clone());
+    cfg_noise = false;
+    cfg_randomize = false;
+    NNCache::get_NNCache().clear();
+
+    BenchResult total;
+    for (size_t i = 0; i < suite.size(); ++i) {
+      myprintf_so("%s\n", suite[i].cur().fen().c_str());
+      auto r = bench_position(suite[i], playouts);
+      print_bench("position " + std::to_string(i + 1), r);
+      total.playouts += r.playouts;
+      total.nodes += r.nodes;
+      total.nnevals += r.nnevals;
+      total.cachehits += r.cachehits;
+      total.cachelookups += r.cachelookups;
+      total.time += r.time;
+    }
+
     cfg_timemanage = save_cfg_timemanage;
+    cfg_noise = save_cfg_noise;
+    cfg_randomize = save_cfg_randomize;
+    NNBatchQueue::get_NNBatchQueue().dump_stats();
+    NNDiskCache::get_NNDiskCache().dump_stats();
+#ifdef USE_OPENCL
+    opencl.dump_stats();
+#endif
+    UCTNodePool::get_UCTNodePool().dump_stats();
+    TBCache::get_TBCache().dump_stats();
+    TBProbeService::get_TBProbeService().dump_stats();
+    print_bench("total", total);
+    myprintf_so("bench threads %d batchsize %d peakrss %zu\n",
+                cfg_num_threads, cfg_batch_size, Utils::peak_rss());
   }
 
 } // namespace
@@ -288,6 +472,120 @@ uint64_t UCI::perft(BoardHistory& bh, Depth depth) {
   return nodes;
 }
 
+namespace {
+
+  // Node counts of subtrees by position and depth. An entry stores the count
+  // and the key xor the count, so a torn entry written by two threads at
+  // once doesn't match the key and needs no lock.
+  class PerftHash {
+  public:
+    explicit PerftHash(size_t mb) {
+      size_t size = 1;
+      while (size * 2 * sizeof(Entry) <= mb * 1024 * 1024)
+          size *= 2;
+      entries = std::vector<Entry>(size);
+    }
+
+    bool probe(Key key, uint64_t& cnt) const {
+      const Entry& e = entries[key & (entries.size() - 1)];
+      cnt = e.count.load(std::memory_order_relaxed);
+      return (e.check.load(std::memory_order_relaxed) ^ cnt) == key;
+    }
+
+    void store(Key key, uint64_t cnt) {
+      Entry& e = entries[key & (entries.size() - 1)];
+      e.count.store(cnt, std::memory_order_relaxed);
+      e.check.store(key ^ cnt, std::memory_order_relaxed);
+    }
+
+  private:
+    struct Entry {
+      std::atomic<uint64_t> check{0};
+      std::atomic<uint64_t> count{0};
+    };
+    std::vector<Entry> entries;
+  };
+
+  // Subtrees of different depths must not share entries.
+  Key perft_key(const Position& pos, Depth depth) {
+    return pos.key() ^ (uint64_t(depth) * 0x9E3779B97F4A7C15ULL);
+  }
+
+  uint64_t perft_node(Position& pos, Depth depth, PerftHash* hash) {
+
+    if (depth <= ONE_PLY)
+        return MoveList<LEGAL>(pos).size();
+
+    uint64_t nodes = 0;
+    Key key = 0;
+    if (hash) {
+        key = perft_key(pos, depth);
+        if (hash->probe(key, nodes))
+            return nodes;
+        nodes = 0;
+    }
+
+    StateInfo st;
+    for (const auto& m : MoveList<LEGAL>(pos))
+    {
+        pos.do_move(m, st);
+        nodes += perft_node(pos, depth - ONE_PLY, hash);
+        pos.undo_move(m);
+    }
+
+    if (hash)
+        hash->store(key, nodes);
+    return nodes;
+  }
+
+} // namespace
+
+uint64_t UCI::perft_parallel(const Position& pos, Depth depth, int threads, int hash_mb,
+                             std::vector<std::pair<Move, uint64_t>>* root_counts) {
+
+  std::vector<Move> moves;
+  for (const auto& m : MoveList<LEGAL>(pos))
+      moves.push_back(m);
+
+  std::vector<uint64_t> counts(moves.size(), depth <= ONE_PLY ? 1 : 0);
+  if (depth > ONE_PLY) {
+      std::unique_ptr<PerftHash> hash;
+      if (hash_mb > 0)
+          hash = std::make_unique<PerftHash>(hash_mb);
+
+      // Every thread sets up its own copy of the position and takes the next
+      // root move that nobody took yet.
+      const std::string fen = pos.fen();
+      std::atomic<size_t> next{0};
+      auto worker = [&]() {
+          StateInfo rootSt;
+          Position p;
+          p.set(fen, &rootSt);
+          for (size_t i; (i = next++) < moves.size(); )
+          {
+              StateInfo st;
+              p.do_move(moves[i], st);
+              counts[i] = perft_node(p, depth - ONE_PLY, hash.get());
+              p.undo_move(moves[i]);
+          }
+      };
+
+      std::vector<std::thread> pool;
+      for (int i = 1; i < threads; ++i)
+          pool.emplace_back(worker);
+      worker();
+      for (auto& t : pool)
+          t.join();
+  }
+
+  uint64_t nodes = 0;
+  for (size_t i = 0; i < moves.size(); ++i) {
+      nodes += counts[i];
+      if (root_counts)
+          root_counts->emplace_back(moves[i], counts[i]);
+  }
+  return nodes;
+}
 
 /// UCI::loop() waits for a command from stdin, parses it and calls the appropriate
 /// function. Also intercepts EOF from stdin to ensure gracefully exiting if the
@@ -302,6 +600,7 @@ void UCI::loop(const std::string& start) {
   UCTSearch search (bh.shallow_clone());//std::make_unique<UCTSearch>(bh.shallow_clone());
   std::thread search_thread;
   std::mutex bh_mutex;
+  load_tree_snapshot();
 
   do {
       if (start.empty() && !getline(cin, cmd)) // Block here waiting for input or EOF
@@ -314,25 +613,11 @@ void UCI::loop(const std::string& start) {
 
       if (token == "quit" || token == "exit") break;
 
-      /*
-      // The GUI sends 'ponderhit' to tell us the user has played the expected move.
-      // So 'ponderhit' will be sent if we were told to ponder on the same move the
-      // user has played. We should continue searching but switch from pondering to
-      // normal search. In case Threads.stopOnPonderhit is set we are waiting for
-      // 'ponderhit' to stop the search, for instance if max search depth is reached.
-      if (    token == "quit"
-          ||  token == "stop"
-          || (token == "ponderhit" && Threads.stopOnPonderhit))
-          Threads.stop = true;
-      else if (token == "ponderhit")
-          Threads.ponder = false; // Switch to normal search
-      */
-
       std::unique_lock<std::mutex> bh_guard(bh_mutex); //locking for all commands for safety, explicitly unlock when needed
 
       auto wait_search = [&bh_guard, &search, &search_thread]() {
           bh_guard.unlock();
-          if (Limits.infinite) search.please_stop();
+          if (Limits.infinite || search.is_pondering()) search.please_stop();
 
           if (search_thread.joinable()) search_thread.join();
       };
@@ -359,16 +644,27 @@ void UCI::loop(const std::string& start) {
 
           search_thread = std::thread([&bh, &search, bhc = bh.shallow_clone(), &bh_mutex]() mutable {
               Move move = search.think(std::move(bhc));
+              Move ponder_move = search.get_ponder_move(move);
               std::lock_guard<std::mutex> l(bh_mutex); //synchronizing with uci loop board history
 
               if (move != MOVE_NULL && move != MOVE_NONE)  //Can happen if we were given a finished game position
                 bh.do_move(move);
-              myprintf_so("bestmove %s\n", UCI::move(move).c_str());
+              if (ponder_move != MOVE_NONE) {
+                  myprintf_so("bestmove %s ponder %s\n", UCI::move(move).c_str(),
+                              UCI::move(ponder_move).c_str());
+              } else {
+                  myprintf_so("bestmove %s\n", UCI::move(move).c_str());
+              }
           });
       }
       else if (token == "stop") {
           stop_and_wait_search();
       }
+      else if (token == "ponderhit") {
+          // The opponent played the move we ponder on. The search goes on
+          // with the tree and the cache it has.
+          search.ponderhit();
+      }
       else if (token == "perft") {
           stop_and_wait_search();
 
@@ -382,6 +678,7 @@ void UCI::loop(const std::string& start) {
       else if (token == "ucinewgame") {
           stop_and_wait_search();
           Training::clear_training();
+          load_tree_snapshot();
       }
       else if (token == "isready") {
           Network::initialize();
@@ -396,7 +693,12 @@ void UCI::loop(const std::string& start) {
       else if (token == "bench") {
           stop_and_wait_search();
 
-          bench();
+          bench(is);
+      }
+      else if (token == "savetree") {
+          stop_and_wait_search();
+
+          save_tree(search, is);
       }
       else if (token == "d" || token == "showboard") { //bh is guarded by bh_guard
           std::stringstream ss;
@@ -23,6 +23,8 @@
 
 #include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "Types.h"
 
@@ -93,6 +95,12 @@ Move to_move(const Position& pos, std::string const& str);
 
 template<bool Root>
 uint64_t perft(BoardHistory& bh, Depth depth);
+// perft() with the root moves split over threads. With hash_mb > 0 the node
+// counts of subtrees are kept in a hash table of that size, so that
+// transpositions are only counted once. If root_counts is given, it receives
+// the count for every root move.
+uint64_t perft_parallel(const Position& pos, Depth depth, int threads, int hash_mb,
+                        std::vector<std::pair<Move, uint64_t>>* root_counts = nullptr);
 } // namespace UCI
 
 extern UCI::OptionsMap Options;
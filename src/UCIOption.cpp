@@ -19,9 +19,12 @@
 #include <cassert>
 #include <ostream>
 
+#include "NNCache.h"
 #include "Utils.h"
 #include "UCI.h"
 #include "Parameters.h"
+#include "SMP.h"
+#include "TBProbeService.h"
 #include "syzygy/tbprobe.h"
 
 using std::string;
@@ -38,7 +41,7 @@ namespace UCI {
 
         if (num_threads > cfg_num_threads) {
             for (auto i = thread_pool.size(); i < static_cast<std::size_t>(num_threads); ++i) {
-                thread_pool.add_thread([](){});
+                thread_pool.add_thread([] { SMP::pin_thread(); });
             }
 
             cfg_num_threads = num_threads;
@@ -49,6 +52,29 @@ namespace UCI {
         myprintf("Using %d thread(s).\n", num_threads);
     }
 
+    void on_batchsize(const Option& o) {
+        cfg_batch_size = o;
+
+        myprintf("Using NN batch size %d.\n", cfg_batch_size);
+    }
+
+    void on_cachemb(const Option& o) {
+        cfg_cache_mb = o;
+        NNCache::get_NNCache().set_size_mb(cfg_cache_mb);
+
+        myprintf("Using %d MB for the NN cache.\n", cfg_cache_mb);
+    }
+
+    void on_treemb(const Option& o) {
+        cfg_tree_mb = o;
+
+        if (cfg_tree_mb > 0) {
+            myprintf("Using %d MB for the search tree.\n", cfg_tree_mb);
+        } else {
+            myprintf("Not limiting the memory of the search tree.\n");
+        }
+    }
+
     void on_quiet(const Option& o) {
         bool value = o;
 
@@ -79,6 +105,18 @@ namespace UCI {
         myprintf("Syzygy Path set to string: %s\n", value.c_str());
         Tablebases::init(cfg_syzygypath);
     }
+
+    void on_syzygythreads(const Option& o) {
+        cfg_syzygythreads = o;
+        TBProbeService::get_TBProbeService().set_threads(cfg_syzygythreads);
+        myprintf("Using %d tablebase probe thread(s).\n", cfg_syzygythreads);
+    }
+
+    void on_syzygyprefetch(const Option& o) {
+        cfg_syzygyprefetch = o;
+        // Reload, so that the tablebases are mapped or not right away.
+        Tablebases::init(cfg_syzygypath);
+    }
   
     bool set_float_cfg(float& cfg_param, const std::string& value) {
         try {
@@ -135,6 +173,11 @@ namespace UCI {
         myprintf("Set cfg_slowmover to %d.\n", cfg_slowmover);
     }
 
+    void on_ponder(const Option& o) {
+        // Only tells the GUI that we can ponder, it sends 'go ponder'.
+        cfg_allow_pondering = o;
+    }
+
     void on_nodes_as_playouts(const Option& o) {
         cfg_go_nodes_as_playouts = o;
 
@@ -157,15 +200,21 @@ namespace UCI {
 
     void init(OptionsMap& o) {
         o["Threads"]                << Option(cfg_num_threads, 1, cfg_max_threads, on_threads);
+        o["Batch Size"]             << Option(cfg_batch_size, 1, 256, on_batchsize);
+        o["Cache MB"]               << Option(cfg_cache_mb, 1, 65536, on_cachemb);
+        o["Tree MB"]                << Option(cfg_tree_mb, 0, 1048576, on_treemb);
         o["Quiet"]                  << Option(cfg_quiet, on_quiet);
         o["SyzygyDraw"]             << SilentOption(cfg_syzygydraw, on_syzygydraw);
         o["SyzygyPath"]             << Option(cfg_syzygypath.c_str(), on_syzygypath);
+        o["SyzygyThreads"]          << Option(cfg_syzygythreads, 0, 64, on_syzygythreads);
+        o["SyzygyPrefetch"]         << Option(cfg_syzygyprefetch, on_syzygyprefetch);
         o["Softmax Temp"]           << SilentOption(std::to_string(cfg_softmax_temp).c_str(), on_softmaxtemp);
         o["FPU Reduction"]          << Option(std::to_string(cfg_fpu_reduction).c_str(), on_fpureduction);
         o["FPU Dynamic Eval"]       << SilentOption(cfg_fpu_dynamic_eval, on_fpudynamiceval);
         o["Puct"]                   << Option(std::to_string(cfg_puct).c_str(), on_puct);
         o["SlowMover"]              << Option(cfg_slowmover, 1, std::numeric_limits<int>::max(), on_slowmover);
         o["GoNodesPlayouts"]        << Option(cfg_go_nodes_as_playouts, on_nodes_as_playouts);
+        o["Ponder"]                 << Option(cfg_allow_pondering, on_ponder);
     }
 
 /// operator<<() is used to print all the options default values in chronological
@@ -0,0 +1,105 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <cassert>
+
+#include "UCTEdge.h"
+#include "UCTNode.h"
+
+UCTEdge::UCTEdge(Move move, float score)
+    : m_score(score), m_move(static_cast<std::uint16_t>(move)) {
+    assert(m_score >= 0.0 && m_score <= 1.0);
+    assert(m_move == move);
+}
+
+UCTEdge::UCTEdge(UCTEdge&& other)
+    : m_node(other.m_node.exchange(nullptr)),
+      m_score(other.m_score),
+      m_move(other.m_move),
+      m_active(other.m_active.load()) {
+}
+
+UCTEdge& UCTEdge::operator=(UCTEdge&& other) {
+    if (this != &other) {
+        delete m_node.exchange(other.m_node.exchange(nullptr));
+        m_score = other.m_score;
+        m_move = other.m_move;
+        m_active = other.m_active.load();
+    }
+    return *this;
+}
+
+UCTEdge::~UCTEdge() {
+    delete m_node.load();
+}
+
+void UCTEdge::inflate(float init_eval) {
+    if (is_inflated()) {
+        return;
+    }
+    m_node.store(new UCTNode(get_move(), init_eval), std::memory_order_release);
+}
+
+bool UCTEdge::is_inflated() const {
+    return get() != nullptr;
+}
+
+UCTNode* UCTEdge::get() const {
+    return m_node.load(std::memory_order_acquire);
+}
+
+std::unique_ptr<UCTNode> UCTEdge::release() {
+    return std::unique_ptr<UCTNode>(m_node.exchange(nullptr));
+}
+
+Move UCTEdge::get_move() const {
+    return static_cast<Move>(m_move);
+}
+
+float UCTEdge::get_score() const {
+    return m_score;
+}
+
+void UCTEdge::set_score(float score) {
+    m_score = score;
+}
+
+bool UCTEdge::active() const {
+    return m_active;
+}
+
+void UCTEdge::set_active(const bool active) {
+    m_active = active;
+}
+
+int UCTEdge::get_visits() const {
+    auto node = get();
+    return node ? node->get_visits() : 0;
+}
+
+bool UCTEdge::first_visit() const {
+    auto node = get();
+    return !node || node->first_visit();
+}
+
+float UCTEdge::get_eval(int tomove) const {
+    assert(is_inflated());
+    return get()->get_eval(tomove);
+}
@@ -0,0 +1,71 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UCTEDGE_H_INCLUDED
+#define UCTEDGE_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "Types.h"
+
+class UCTNode;
+
+// A child of an expanded UCTNode. Most children are never visited, so an
+// edge only holds the move and its prior, and the UCTNode behind it is
+// created on the first visit. An edge is 16 bytes against 64 for a node.
+class UCTEdge {
+public:
+    UCTEdge(Move move, float score);
+    UCTEdge(UCTEdge&& other);
+    UCTEdge& operator=(UCTEdge&& other);
+    UCTEdge(const UCTEdge&) = delete;
+    UCTEdge& operator=(const UCTEdge&) = delete;
+    ~UCTEdge();
+
+    // Create the node if it doesn't exist yet. Only one thread may
+    // inflate an edge at a time, callers hold the lock of the parent.
+    void inflate(float init_eval);
+    bool is_inflated() const;
+    // nullptr until the edge has been inflated.
+    UCTNode* get() const;
+    // Take the node away from the edge, e.g. to make it the new root.
+    std::unique_ptr<UCTNode> release();
+
+    Move get_move() const;
+    float get_score() const;
+    void set_score(float score);
+    bool active() const;
+    void set_active(const bool active);
+    int get_visits() const;
+    bool first_visit() const;
+    // Only valid for inflated edges.
+    float get_eval(int tomove) const;
+
+private:
+    std::atomic<UCTNode*> m_node{nullptr};
+    // Prior from the network, possibly with noise mixed in.
+    float m_score;
+    std::uint16_t m_move;
+    std::atomic<bool> m_active{true};
+};
+
+#endif
@@ -33,11 +33,14 @@
 #include <numeric>
 #include <boost/range/adaptor/reversed.hpp>
 
+#include "CPUKernels.h"
 #include "Position.h"
 #include "Parameters.h"
+#include "PhaseTimer.h"
 #include "Movegen.h"
 #include "UCI.h"
 #include "UCTNode.h"
+#include "UCTNodePool.h"
 #include "UCTSearch.h"
 #include "Utils.h"
 #include "Network.h"
@@ -45,9 +48,21 @@
 
 using namespace Utils;
 
-UCTNode::UCTNode(Move move, float score, float init_eval)
-    : m_move(move), m_score(score), m_init_eval(init_eval) {
-    assert(m_score >= 0.0 && m_score <= 1.0);
+namespace {
+    // The arrays in UCTNode::m_child_stats.
+    struct ChildStats {
+        ChildStats(float* data, size_t count)
+            : prior(data), visits(data + count),
+              virtual_loss(data + 2 * count), white_wins(data + 3 * count) {}
+        float* prior;
+        float* visits;
+        float* virtual_loss;
+        float* white_wins;
+    };
+}
+
+UCTNode::UCTNode(Move move, float init_eval)
+    : m_move(move), m_init_eval(init_eval) {
 }
 
 UCTNode::~UCTNode() {
@@ -56,11 +71,22 @@ UCTNode::~UCTNode() {
     m_children.clear();
 }
 
+void* UCTNode::operator new(size_t size) {
+    assert(size == sizeof(UCTNode));
+    (void)size;
+    return UCTNodePool::get_UCTNodePool().allocate();
+}
+
+void UCTNode::operator delete(void* ptr) {
+    UCTNodePool::get_UCTNodePool().deallocate(ptr);
+}
+
 bool UCTNode::first_visit() const {
     return m_visits == 0;
 }
 
-bool UCTNode::create_children(std::atomic<int>& nodecount, const BoardHistory& state, float& eval) {
+bool UCTNode::create_children(std::atomic<int>& nodecount, const BoardHistory& state, float& eval,
+                              const MoveList<LEGAL>* legal_moves) {
     // check whether somebody beat us to it (atomic)
     if (has_children()) {
         return false;
@@ -79,11 +105,12 @@ bool UCTNode::create_children(std::atomic<int>& nodecount, const BoardHistory& s
     m_is_expanding = true;
     lock.unlock();
 
-    auto raw_netlist = Network::get_scored_moves(state);
+    auto raw_netlist = Network::get_scored_moves(state, nullptr, false, legal_moves);
     // no successors in final state
     if (raw_netlist.first.empty()) {
         return false;
     }
+    PHASE_TIMER(EXPAND);
 
     // DCNN returns winrate as side to move
     auto net_eval = raw_netlist.second;
@@ -127,11 +154,10 @@ void UCTNode::link_nodelist(std::atomic<int>& nodecount, std::vector<Network::sc
 
     LOCK(m_nodemutex, lock);
 
+    m_net_eval = init_eval;
     m_children.reserve(nodelist.size());
     for (const auto& node : nodelist) {
-        m_children.emplace_back(
-            std::make_unique<UCTNode>(node.second, node.first, init_eval)
-        );
+        m_children.emplace_back(node.second, node.first);
     }
 
     nodecount += m_children.size();
@@ -161,11 +187,12 @@ void UCTNode::dirichlet_noise(float epsilon, float alpha) {
 
     child_cnt = 0;
     for (auto& child : m_children) {
-        auto score = child->get_score();
+        auto score = child.get_score();
         auto eta_a = dirichlet_vector[child_cnt++];
         score = score * (1 - epsilon) + epsilon * eta_a;
-        child->set_score(score);
+        child.set_score(score);
     }
+    m_child_stats.reset();
 }
 
 std::vector<float> UCTNode::calc_proportional(float tau, Color color) {
@@ -176,10 +203,11 @@ std::vector<float> UCTNode::calc_proportional(float tau, Color color) {
 
     // Calculate exponentiated visit count vector
     for (const auto& child : m_children) {
-        if ((child->get_eval(color) > best_child.get_eval(color) - cfg_rand_eval_maxdiff) &&
-            (child->get_visits() > best_child.get_visits() * cfg_rand_visit_floor)) {
+        // Check the visits first, unvisited children have no eval of their own.
+        if ((child.get_visits() > best_child.get_visits() * cfg_rand_visit_floor) &&
+            (child.get_eval(color) > best_child.get_eval(color) - cfg_rand_eval_maxdiff)) {
             // Only increment accum for children that reach the thresholds.
-            accum += std::pow(1.0f*child->get_visits()/parent_visits, 1.0f/tau);
+            accum += std::pow(1.0f*child.get_visits()/parent_visits, 1.0f/tau);
         }
         accum_vector.emplace_back(accum);
     }
@@ -216,12 +244,13 @@ void UCTNode::randomize_first_proportionally(float tau, Color color) {
     // Now swap the child at index with the first child
     assert(index < m_children.size());
     std::iter_swap(begin(m_children), begin(m_children) + index);
+    m_child_stats.reset();
 }
 
 void UCTNode::ensure_first_not_pruned(const std::unordered_set<int>& pruned_moves) {
     size_t selectedIndex = size_t{0};
     for (size_t i = 0; i < m_children.size(); i++) {
-        if (!pruned_moves.count((int)m_children[i]->get_move())) {
+        if (!pruned_moves.count((int)m_children[i].get_move())) {
             selectedIndex = i;
             break;
         }
@@ -235,6 +264,7 @@ void UCTNode::ensure_first_not_pruned(const std::unordered_set<int>& pruned_move
     // Now swap the child at index with the first child
     assert(selectedIndex < m_children.size());
     std::iter_swap(begin(m_children), begin(m_children) + selectedIndex);
+    m_child_stats.reset();
 }
 
 Move UCTNode::get_move() const {
@@ -258,16 +288,12 @@ bool UCTNode::has_children() const {
     return m_has_children;
 }
 
-void UCTNode::set_visits(int visits) {
-    m_visits = visits;
-}
-
-float UCTNode::get_score() const {
-    return m_score;
+bool UCTNode::is_expanding() const {
+    return m_is_expanding;
 }
 
-void UCTNode::set_score(float score) {
-    m_score = score;
+void UCTNode::set_visits(int visits) {
+    m_visits = visits;
 }
 
 int UCTNode::get_visits() const {
@@ -321,36 +347,85 @@ float UCTNode::get_raw_eval(int tomove) const {
     }
 } 
 
+float UCTNode::get_net_eval(int tomove) const {
+    if (tomove == BLACK) {
+        return 1.0f - m_net_eval;
+    }
+    return m_net_eval;
+}
+
 double UCTNode::get_whiteevals() const {
-    return m_whiteevals;
+    return static_cast<double>(m_whiteevals.load()) / EVAL_ONE;
 }
 
 void UCTNode::set_whiteevals(double whiteevals) {
-    m_whiteevals = whiteevals;
+    m_whiteevals = std::llround(whiteevals * EVAL_ONE);
 }
 
 void UCTNode::accumulate_eval(float eval) {
-    atomic_add(m_whiteevals, (double)eval);
+    m_whiteevals.fetch_add(std::llround(double(eval) * EVAL_ONE));
 }
 
-UCTNode* UCTNode::uct_select_child(Color color, bool is_root) {
-    UCTNode* best = nullptr;
+void UCTNode::init_child_stats() {
+    m_child_stats.reset(new float[4 * m_children.size()]);
+    for (auto i = size_t{0}; i < m_children.size(); i++) {
+        copy_child_stats(i);
+    }
+}
+
+void UCTNode::copy_child_stats(size_t index) {
+    auto stats = ChildStats{m_child_stats.get(), m_children.size()};
+    const auto& child = m_children[index];
+    stats.prior[index] = child.get_score();
+    auto node = child.get();
+    if (node) {
+        stats.visits[index] = node->get_visits();
+        stats.virtual_loss[index] = node->m_virtual_loss;
+        stats.white_wins[index] = node->get_whiteevals();
+    } else {
+        stats.visits[index] = 0.0f;
+        stats.virtual_loss[index] = 0.0f;
+        stats.white_wins[index] = 0.0f;
+    }
+}
+
+void UCTNode::update_child_stats(size_t index) {
+    LOCK(m_nodemutex, lock);
+    if (m_child_stats) {
+        copy_child_stats(index);
+    }
+}
+
+UCTNode* UCTNode::uct_select_child(Color color, bool is_root, size_t& index) {
+    auto best = size_t{0};
     auto best_value = std::numeric_limits<double>::lowest();
 
     LOCK(m_nodemutex, lock);
 
+    if (!m_child_stats && m_visits >= CHILD_STATS_VISITS) {
+        init_child_stats();
+    }
+
     // Count parentvisits manually to avoid issues with transpositions.
     auto total_visited_policy = 0.0f;
     auto parentvisits = size_t{0};
-    // Net eval can be obtained from an unvisited child. This is invalid
-    // if there are no unvisited children, but then this isn't used in that case.
-    auto net_eval = 0.0f;
-    for (const auto& child : m_children) {
-        parentvisits += child->get_visits();
-        if (child->get_visits() > 0) {
-            total_visited_policy += child->get_score();
-        } else {
-            net_eval = child->get_eval(color);
+    if (m_child_stats) {
+        auto stats = ChildStats{m_child_stats.get(), m_children.size()};
+        auto visits = 0.0f;
+        for (auto i = size_t{0}; i < m_children.size(); i++) {
+            visits += stats.visits[i];
+            if (stats.visits[i] > 0.0f) {
+                total_visited_policy += stats.prior[i];
+            }
+        }
+        parentvisits = static_cast<size_t>(visits);
+    } else {
+        for (const auto& child : m_children) {
+            auto visits = child.get_visits();
+            parentvisits += visits;
+            if (visits > 0) {
+                total_visited_policy += child.get_score();
+            }
         }
     }
 
@@ -365,51 +440,74 @@ UCTNode* UCTNode::uct_select_child(Color color, bool is_root) {
 
     // Estimated eval for unknown nodes = original parent NN eval - reduction
     // Or curent parent eval - reduction if dynamic_eval is enabled.
-    auto fpu_eval = (cfg_fpu_dynamic_eval ? get_raw_eval(color) : net_eval) - fpu_reduction;
-
-    for (const auto& child : m_children) {
-        if (!child->active()) {
-            continue;
+    auto fpu_eval = (cfg_fpu_dynamic_eval ? get_raw_eval(color) : get_net_eval(color)) - fpu_reduction;
+
+    if (m_child_stats) {
+        auto stats = ChildStats{m_child_stats.get(), m_children.size()};
+        float scores[MAX_MOVES];
+        assert(m_children.size() <= MAX_MOVES);
+        CPUKernels::puct_scores(m_children.size(), stats.prior, stats.visits,
+                                stats.virtual_loss, stats.white_wins,
+                                color == WHITE, fpu_eval,
+                                cfg_puct * static_cast<float>(numerator),
+                                scores);
+        for (auto i = size_t{0}; i < m_children.size(); i++) {
+            if (m_children[i].active() && scores[i] > best_value) {
+                best_value = scores[i];
+                best = i;
+            }
         }
+        // Until the child adds its own, so that other threads see it.
+        stats.virtual_loss[best] += VIRTUAL_LOSS_COUNT;
+    } else {
+        for (auto i = size_t{0}; i < m_children.size(); i++) {
+            const auto& child = m_children[i];
+            if (!child.active()) {
+                continue;
+            }
 
-        float winrate = fpu_eval;
-        if (child->get_visits() > 0) {
-            winrate = child->get_eval(color);
-        }
-        auto psa = child->get_score();
-        auto denom = 1.0f + child->get_visits();
-        auto puct = cfg_puct * psa * (numerator / denom);
-        auto value = winrate + puct;
-        assert(value > std::numeric_limits<double>::lowest());
-
-        if (value > best_value) {
-            best_value = value;
-            best = child.get();
+            float winrate = fpu_eval;
+            auto visits = child.get_visits();
+            if (visits > 0) {
+                winrate = child.get_eval(color);
+            }
+            auto psa = child.get_score();
+            auto denom = 1.0f + visits;
+            auto puct = cfg_puct * psa * (numerator / denom);
+            auto value = winrate + puct;
+            assert(value > std::numeric_limits<double>::lowest());
+
+            if (value > best_value) {
+                best_value = value;
+                best = i;
+            }
         }
     }
 
-    assert(best != nullptr);
-    return best;
+    assert(best_value > std::numeric_limits<double>::lowest());
+    index = best;
+    m_children[best].inflate(m_net_eval);
+    return m_children[best].get();
 }
 
-class NodeComp : public std::binary_function<UCTNode::node_ptr_t&,
-                                             UCTNode::node_ptr_t&, bool> {
+class NodeComp : public std::binary_function<UCTEdge&,
+                                             UCTEdge&, bool> {
 public:
     NodeComp(int color) : m_color(color) {};
-    bool operator()(const UCTNode::node_ptr_t& a,
-                    const UCTNode::node_ptr_t& b) {
+    bool operator()(const UCTEdge& a,
+                    const UCTEdge& b) {
         // if visits are not same, sort on visits
-        if (a->get_visits() != b->get_visits()) {
-            return a->get_visits() < b->get_visits();
+        if (a.get_visits() != b.get_visits()) {
+            return a.get_visits() < b.get_visits();
         }
 
         // neither has visits, sort on prior score
-        if (a->get_visits() == 0) {
-            return a->get_score() < b->get_score();
+        if (a.get_visits() == 0) {
+            return a.get_score() < b.get_score();
         }
 
         // both have same non-zero number of visits
-        return a->get_eval(m_color) < b->get_eval(m_color);
+        return a.get_eval(m_color) < b.get_eval(m_color);
     }
 private:
     int m_color;
@@ -419,14 +517,45 @@ void UCTNode::sort_root_children(Color color) {
     LOCK(m_nodemutex, lock);
     std::stable_sort(begin(m_children), end(m_children), NodeComp(color));
     std::reverse(begin(m_children), end(m_children));
+    m_child_stats.reset();
+}
+
+std::vector<UCTNode::ChildSnapshot> UCTNode::snapshot_children(Color color) const {
+    auto children = std::vector<ChildSnapshot>{};
+    if (!m_has_children) {
+        return children;
+    }
+    children.reserve(m_children.size());
+    for (const auto& child : m_children) {
+        // Read the node once, another thread may inflate the edge.
+        const auto node = child.get();
+        const auto visits = node ? node->get_visits() : 0;
+        const auto eval = visits > 0 ? node->get_eval(color) : 0.0f;
+        children.push_back({child.get_move(), child.get_score(), visits,
+                            eval, node});
+    }
+    // As NodeComp, best first, and the first of equals like max_element.
+    std::stable_sort(begin(children), end(children),
+        [](const ChildSnapshot& a, const ChildSnapshot& b) {
+            if (a.visits != b.visits) {
+                return a.visits > b.visits;
+            }
+            if (a.visits == 0) {
+                return a.score > b.score;
+            }
+            return a.eval > b.eval;
+        });
+    return children;
 }
 
 UCTNode& UCTNode::get_best_root_child(Color color) {
     LOCK(m_nodemutex, lock);
     assert(!m_children.empty());
 
-    return *(std::max_element(begin(m_children), end(m_children),
-                              NodeComp(color))->get());
+    auto& best = *std::max_element(begin(m_children), end(m_children),
+                                   NodeComp(color));
+    best.inflate(m_net_eval);
+    return *best.get();
 }
 
 size_t UCTNode::count_nodes() const {
@@ -434,20 +563,187 @@ size_t UCTNode::count_nodes() const {
     if (m_has_children) {
         nodecount += m_children.size();
         for (auto& child : m_children) {
-            nodecount += child->count_nodes();
+            if (child.is_inflated()) {
+                nodecount += child.get()->count_nodes();
+            }
         }
     }
     return nodecount;
 }
 
-UCTNode* UCTNode::get_first_child() const {
+namespace {
+    template<typename T>
+    void put(std::string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template<typename T>
+    bool get(const char*& data, const char* end, T& value) {
+        if (end - data < static_cast<std::ptrdiff_t>(sizeof(value))) {
+            return false;
+        }
+        memcpy(&value, data, sizeof(value));
+        data += sizeof(value);
+        return true;
+    }
+}
+
+// A node is its first eval, white's wins, visits and net eval, the
+// number of children, the move, prior and a flag for every child, and
+// then the children with the flag set, in order.
+void UCTNode::serialize(std::string& out, int min_visits) const {
+    put(out, m_init_eval);
+    put(out, std::int64_t{m_whiteevals});
+    put(out, std::int32_t{m_visits});
+    put(out, m_net_eval);
+    if (!m_has_children) {
+        put(out, std::uint16_t{0});
+        return;
+    }
+    put(out, static_cast<std::uint16_t>(m_children.size()));
+    for (const auto& child : m_children) {
+        auto saved = child.is_inflated() && child.get_visits() >= min_visits;
+        put(out, static_cast<std::uint16_t>(child.get_move()));
+        put(out, child.get_score());
+        put(out, std::uint8_t{saved});
+    }
+    for (const auto& child : m_children) {
+        if (child.is_inflated() && child.get_visits() >= min_visits) {
+            child.get()->serialize(out, min_visits);
+        }
+    }
+}
+
+UCTNode::node_ptr_t UCTNode::deserialize(Move move, const char*& data,
+                                         const char* end) {
+    auto init_eval = 0.0f;
+    if (!get(data, end, init_eval)) {
+        return nullptr;
+    }
+    auto node = std::make_unique<UCTNode>(move, init_eval);
+    if (!node->deserialize_tree(data, end)) {
+        return nullptr;
+    }
+    return node;
+}
+
+bool UCTNode::deserialize_tree(const char*& data, const char* end) {
+    auto whiteevals = std::int64_t{};
+    auto visits = std::int32_t{};
+    auto num_children = std::uint16_t{};
+    if (!get(data, end, whiteevals) || !get(data, end, visits)
+        || !get(data, end, m_net_eval) || !get(data, end, num_children)
+        || visits < 0 || num_children > MAX_MOVES) {
+        return false;
+    }
+    m_whiteevals = whiteevals;
+    m_visits = visits;
+    if (num_children == 0) {
+        return true;
+    }
+
+    auto saved = std::vector<bool>{};
+    m_children.reserve(num_children);
+    for (auto i = 0; i < num_children; i++) {
+        auto move = std::uint16_t{};
+        auto score = 0.0f;
+        auto flag = std::uint8_t{};
+        if (!get(data, end, move) || !get(data, end, score)
+            || !get(data, end, flag)) {
+            return false;
+        }
+        m_children.emplace_back(Move(move), score);
+        saved.push_back(flag != 0);
+    }
+    m_is_expanding = true;
+    m_has_children = true;
+    for (auto i = size_t{0}; i < m_children.size(); i++) {
+        if (!saved[i]) {
+            continue;
+        }
+        auto init_eval = 0.0f;
+        if (!get(data, end, init_eval)) {
+            return false;
+        }
+        m_children[i].inflate(init_eval);
+        if (!m_children[i].get()->deserialize_tree(data, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t UCTNode::get_children_memory() const {
+    auto bytes = m_children.capacity() * sizeof(UCTEdge);
+    if (m_child_stats) {
+        bytes += 4 * m_children.size() * sizeof(float);
+    }
+    for (const auto& child : m_children) {
+        if (child.is_inflated()) {
+            bytes += sizeof(UCTNode);
+        }
+    }
+    return bytes;
+}
+
+void UCTNode::clear_children() {
+    LOCK(m_nodemutex, lock);
+    auto children = std::vector<UCTEdge>{};
+    children.swap(m_children);
+    m_child_stats.reset();
+    m_has_children = false;
+    m_is_expanding = false;
+    lock.unlock();
+
+    // Like an old tree, the subtrees can be large, so don't wait for them.
+    auto& pool = UCTNodePool::get_UCTNodePool();
+    for (auto& child : children) {
+        if (child.is_inflated()) {
+            pool.release_async(child.release());
+        }
+    }
+}
+
+size_t UCTNode::get_tree_memory(std::map<int, size_t>* bytes_by_visits) const {
+    auto bytes = get_children_memory();
+    for (const auto& child : m_children) {
+        auto next = child.get();
+        if (next && next->has_children()) {
+            if (bytes_by_visits) {
+                (*bytes_by_visits)[next->get_visits()] +=
+                    next->get_children_memory();
+            }
+            bytes += next->get_tree_memory(bytes_by_visits);
+        }
+    }
+    return bytes;
+}
+
+void UCTNode::prune_subtrees(int visits) {
+    for (auto& child : m_children) {
+        auto next = child.get();
+        if (next && next->has_children()) {
+            if (next->get_visits() < visits) {
+                next->clear_children();
+            } else {
+                next->prune_subtrees(visits);
+            }
+        }
+    }
+}
+
+const UCTEdge* UCTNode::get_first_child() const {
     if (m_children.empty()) {
         return nullptr;
     }
-    return m_children.front().get();
+    return &m_children.front();
 }
 
-const std::vector<UCTNode::node_ptr_t>& UCTNode::get_children() const {
+std::vector<UCTEdge>& UCTNode::get_children() {
+    return m_children;
+}
+
+const std::vector<UCTEdge>& UCTNode::get_children() const {
     return m_children;
 }
 
@@ -478,22 +774,18 @@ UCTNode::node_ptr_t UCTNode::find_path(std::vector<Move>& moves) {
     auto move = moves.back();
     moves.pop_back();
     for (auto& node : m_children) {
-        if (node->get_move() == move) {
+        if (node.get_move() == move) {
+            // An edge that was never visited has nothing to reuse.
+            if (!node.is_inflated()) {
+                return nullptr;
+            }
             if (moves.size() > 0) {
                 // Keep going recursively through the move list.
-                return node->find_path(moves);
+                return node.get()->find_path(moves);
             } else {
-                return std::move(node);
+                return node.release();
             }
         }
     }
     return nullptr;
 }
-
-void UCTNode::set_active(const bool active) {
-    m_status = active ? ACTIVE : PRUNED;
-}
-
-bool UCTNode::active() const {
-    return m_status == ACTIVE;
-}
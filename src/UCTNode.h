@@ -22,13 +22,17 @@
 #include "config.h"
 
 #include <atomic>
+#include <cstdint>
 #include <limits>
+#include <map>
 #include <mutex>
+#include <string>
 #include <tuple>
 
 #include "Network.h"
 #include "Position.h"
 #include "SMP.h"
+#include "UCTEdge.h"
 #include <unordered_set>
 
 class UCTNode {
@@ -37,24 +41,39 @@ public:
     // to it to encourage other CPUs to explore other parts of the
     // search tree.
     static constexpr auto VIRTUAL_LOSS_COUNT = 3;
+    // Nodes with this many visits keep copies of the statistics of their
+    // children for selection. Below it they aren't selected from often
+    // enough to be worth the memory.
+    static constexpr auto CHILD_STATS_VISITS = 16;
+    // White's wins are summed in fixed point with this many steps per
+    // win, so a backup is a single fetch_add. 2^30 leaves room for 2^33
+    // visits.
+    static constexpr auto EVAL_ONE = std::int64_t{1} << 30;
 
     using node_ptr_t = std::unique_ptr<UCTNode>;
 
-    explicit UCTNode(Move move, float score, float init_eval);
+    explicit UCTNode(Move move, float init_eval);
     UCTNode() = delete;
     ~UCTNode();
+
+    // Nodes live in the UCTNodePool slabs rather than on the heap.
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
     size_t count_nodes() const;
     bool first_visit() const;
     bool has_children() const;
-    void set_active(const bool active);
-    bool active() const;
-    bool create_children(std::atomic<int> & nodecount, const BoardHistory& state, float& eval);
+    // Whether some thread is evaluating this node to create its children.
+    bool is_expanding() const;
+    // legal_moves, if given, are the legal moves of state, so that they
+    // aren't generated again.
+    bool create_children(std::atomic<int> & nodecount, const BoardHistory& state, float& eval,
+                         const MoveList<LEGAL>* legal_moves = nullptr);
     Move get_move() const;
     int get_visits() const;
-    float get_score() const;
-    void set_score(float score);
     float get_eval(int tomove) const;
     float get_raw_eval(int tomove) const;
+    float get_net_eval(int tomove) const;
     double get_whiteevals() const;
     void set_visits(int visits);
     void set_whiteevals(double whiteevals);
@@ -67,41 +86,91 @@ public:
     void ensure_first_not_pruned(const std::unordered_set<int>& pruned_moves);
     void update(float eval = std::numeric_limits<float>::quiet_NaN());
 
-    UCTNode* uct_select_child(Color color, bool is_root);
-    UCTNode* get_first_child() const;
-    const std::vector<node_ptr_t>& get_children() const;
+    // index is set to the position of the child in get_children().
+    UCTNode* uct_select_child(Color color, bool is_root, size_t& index);
+    // Refresh the copies of the statistics of the child at index after a
+    // playout through it.
+    void update_child_stats(size_t index);
+    // Bytes held by the children: the edges, their statistics for
+    // selection and the nodes of the visited ones, but not what is below.
+    size_t get_children_memory() const;
+    // Free the children and everything below them. The node keeps its
+    // own statistics and is expanded again on its next visit. No other
+    // thread may be in the subtree.
+    void clear_children();
+    // The memory held by the tree below this node. With bytes_by_visits,
+    // also add what every expanded node below it holds to the entry for
+    // its visits.
+    size_t get_tree_memory(std::map<int, size_t>* bytes_by_visits = nullptr) const;
+    // Prune the expanded nodes below this one with fewer than visits
+    // visits back to their edges. Their own subtrees have even fewer
+    // visits, so this frees everything tallied for visit counts below
+    // visits. No other thread may be in the tree.
+    void prune_subtrees(int visits);
+    const UCTEdge* get_first_child() const;
+    std::vector<UCTEdge>& get_children();
+    const std::vector<UCTEdge>& get_children() const;
+
+    // The statistics of a child, copied without the lock of the node.
+    struct ChildSnapshot {
+        Move move;
+        float score;
+        int visits;
+        // Only set for children with visits.
+        float eval;
+        // nullptr if the child hasn't been inflated.
+        UCTNode* node;
+    };
+    // Copies the statistics of the children, best first for color, in the
+    // order of sort_root_children(). Takes no lock, so that the threads
+    // selecting children of this node don't wait. The search threads may
+    // run meanwhile, but nothing may reorder or free the children.
+    std::vector<ChildSnapshot> snapshot_children(Color color) const;
 
     void sort_root_children(Color color);
     UCTNode& get_best_root_child(Color color);
     UCTNode::node_ptr_t find_new_root(Key prevroot_full_key, BoardHistory& new_bh);
     UCTNode::node_ptr_t find_path(std::vector<Move>& moves);
 
+    // Appends the node and the tree below it to @out, leaving out the
+    // children with fewer than @min_visits visits. No other thread may be
+    // in the subtree.
+    void serialize(std::string& out, int min_visits) const;
+    // Rebuilds a node written by serialize() from @data, which is advanced
+    // past it. Returns nullptr if the data is malformed.
+    static node_ptr_t deserialize(Move move, const char*& data, const char* end);
+
 private:
-    enum Status : char {
-        //INVALID, // superko for Go, NA for chess.
-        PRUNED,
-        ACTIVE
-    };
+    bool deserialize_tree(const char*& data, const char* end);
     void link_nodelist(std::atomic<int>& nodecount, std::vector<Network::scored_node>& nodelist, float init_eval);
+    void init_child_stats();
+    void copy_child_stats(size_t index);
 
+    // Ordered to keep the node at 64 bytes.
+    std::atomic<std::int64_t> m_whiteevals{0};
     // Move
     Move m_move;
     // UCT
-    std::atomic<int16_t> m_virtual_loss{0};
     std::atomic<int> m_visits{0};
     // UCT eval
-    float m_score;
     float m_init_eval;
-    std::atomic<double> m_whiteevals{0};
-    std::atomic<Status> m_status{ACTIVE};
+    // White's winrate from the network, the first estimate for
+    // children that haven't been visited yet.
+    float m_net_eval{0.5f};
+    std::atomic<int16_t> m_virtual_loss{0};
     // Is someone adding scores to this node?
-    // We don't need to unset this.
-    bool m_is_expanding{false};
+    // Only unset when the children are cleared.
+    std::atomic<bool> m_is_expanding{false};
     SMP::Mutex m_nodemutex;
 
     // Tree data
     std::atomic<bool> m_has_children{false};
-    std::vector<node_ptr_t> m_children;
+    std::vector<UCTEdge> m_children;
+    // The prior, visits, virtual loss and white's wins of every child, one
+    // array after the other, so that selection streams through them
+    // rather than touch the node of every child. Guarded by m_nodemutex,
+    // nullptr until the node has CHILD_STATS_VISITS visits.
+    std::unique_ptr<float[]> m_child_stats;
 };
 
 #endif
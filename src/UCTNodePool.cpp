@@ -0,0 +1,194 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "UCTNodePool.h"
+#include "UCTNode.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+namespace {
+    constexpr auto SLOT_ALIGN = alignof(UCTNode);
+    constexpr auto SLOT_SIZE =
+        (std::max(sizeof(UCTNode), sizeof(void*)) + SLOT_ALIGN - 1)
+        / SLOT_ALIGN * SLOT_ALIGN;
+    static_assert(SLOT_ALIGN <= alignof(std::max_align_t),
+                  "Slabs are not aligned enough for UCTNode");
+}
+
+struct UCTNodePool::ThreadCache {
+    FreeSlot* head{nullptr};
+    int count{0};
+
+    ~ThreadCache() {
+        // Don't strand the free slots of a thread that goes away.
+        if (count) {
+            get_UCTNodePool().spill(*this, count);
+        }
+    }
+};
+
+UCTNodePool& UCTNodePool::get_UCTNodePool(void) {
+    static UCTNodePool pool;
+    return pool;
+}
+
+UCTNodePool::~UCTNodePool() {
+    {
+        std::lock_guard<std::mutex> lock(m_reclaim_mutex);
+        m_exit = true;
+    }
+    m_reclaim_cv.notify_all();
+    if (m_reclaimer.joinable()) {
+        m_reclaimer.join();
+    }
+}
+
+UCTNodePool::ThreadCache& UCTNodePool::get_thread_cache() {
+    thread_local ThreadCache cache;
+    return cache;
+}
+
+void* UCTNodePool::allocate() {
+    auto& cache = get_thread_cache();
+    if (!cache.head) {
+        refill(cache);
+    }
+    auto slot = cache.head;
+    cache.head = slot->next;
+    cache.count--;
+    return slot;
+}
+
+void UCTNodePool::deallocate(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    auto& cache = get_thread_cache();
+    auto slot = static_cast<FreeSlot*>(ptr);
+    slot->next = cache.head;
+    cache.head = slot;
+    cache.count++;
+    // A thread that frees a large tree shouldn't keep all of it for itself.
+    if (cache.count >= 2 * CACHE_BLOCK) {
+        spill(cache, CACHE_BLOCK);
+    }
+}
+
+void UCTNodePool::refill(ThreadCache& cache) {
+    LOCK(m_mutex, lock);
+    if (!m_free) {
+        add_slab();
+    }
+    auto count = 0;
+    auto tail = m_free;
+    while (count < CACHE_BLOCK - 1 && tail->next) {
+        tail = tail->next;
+        count++;
+    }
+    cache.head = m_free;
+    cache.count = count + 1;
+    m_free = tail->next;
+    tail->next = nullptr;
+}
+
+void UCTNodePool::spill(ThreadCache& cache, int count) {
+    assert(count > 0 && count <= cache.count);
+    auto head = cache.head;
+    auto tail = head;
+    for (auto i = 1; i < count; i++) {
+        tail = tail->next;
+    }
+    cache.head = tail->next;
+    cache.count -= count;
+
+    LOCK(m_mutex, lock);
+    tail->next = m_free;
+    m_free = head;
+}
+
+void UCTNodePool::add_slab() {
+    // Called with m_mutex held.
+    auto slab = HugePages(SLAB_NODES * SLOT_SIZE);
+    for (auto i = SLAB_NODES - 1; i >= 0; i--) {
+        auto slot = reinterpret_cast<FreeSlot*>(slab.data() + i * SLOT_SIZE);
+        slot->next = m_free;
+        m_free = slot;
+    }
+    m_slabs.emplace_back(std::move(slab));
+}
+
+void UCTNodePool::release_async(std::unique_ptr<UCTNode> tree) {
+    if (!tree) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_reclaim_mutex);
+        if (!m_reclaimer.joinable()) {
+            m_reclaimer = std::thread([this] { reclaimer(); });
+        }
+        m_reclaim_queue.emplace_back(std::move(tree));
+    }
+    m_reclaim_cv.notify_one();
+}
+
+void UCTNodePool::reclaimer() {
+    auto trees = std::vector<std::unique_ptr<UCTNode>>{};
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_reclaim_mutex);
+            m_reclaim_cv.wait(lock, [this] {
+                return m_exit || !m_reclaim_queue.empty();
+            });
+            // Finish what was queued even when exiting.
+            if (m_reclaim_queue.empty()) {
+                return;
+            }
+            std::swap(trees, m_reclaim_queue);
+        }
+        // The nodes go back to this thread's free list, and from there
+        // to the pool in blocks.
+        trees.clear();
+    }
+}
+
+size_t UCTNodePool::get_capacity() {
+    LOCK(m_mutex, lock);
+    return m_slabs.size() * SLAB_NODES;
+}
+
+void UCTNodePool::dump_stats() {
+    auto slabs = size_t{0};
+    auto huge_slabs = size_t{0};
+    {
+        LOCK(m_mutex, lock);
+        slabs = m_slabs.size();
+        huge_slabs = std::count_if(begin(m_slabs), end(m_slabs),
+            [](const HugePages& slab) {
+                return slab.kind() != HugePages::Kind::NORMAL;
+            });
+    }
+    myprintf("UCTNodePool: %zu slabs, %zu on huge pages, %zu nodes, %.1f MB\n",
+             slabs, huge_slabs, slabs * SLAB_NODES,
+             slabs * SLAB_NODES * SLOT_SIZE / (1024.0 * 1024.0));
+}
@@ -0,0 +1,94 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UCTNODEPOOL_H_INCLUDED
+#define UCTNODEPOOL_H_INCLUDED
+
+#include "config.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "HugePages.h"
+#include "SMP.h"
+
+class UCTNode;
+
+// Slab allocator backing UCTNode::operator new/delete. Nodes are carved
+// out of large slabs and recycled through free lists, so expanding a node
+// and tearing down a tree don't go through malloc per node. Every thread
+// keeps a small private free list and only takes the pool lock to move a
+// whole block of slots at once.
+//
+// Trees that are no longer needed can be handed to a background thread,
+// so that freeing millions of nodes doesn't delay the next search.
+class UCTNodePool {
+public:
+    // Number of nodes per slab, 2 MB with the current 64 byte nodes, so
+    // that a slab fills a huge page.
+    static constexpr auto SLAB_NODES = 32768;
+    // Number of free slots moved between a thread and the pool at once.
+    static constexpr auto CACHE_BLOCK = 256;
+
+    // return the global UCTNodePool
+    static UCTNodePool& get_UCTNodePool(void);
+
+    ~UCTNodePool();
+
+    void* allocate();
+    void deallocate(void* ptr);
+
+    // Destroy a (sub)tree on the reclaimer thread.
+    void release_async(std::unique_ptr<UCTNode> tree);
+
+    // Number of nodes the slabs have room for, live or free.
+    size_t get_capacity();
+    void dump_stats();
+
+private:
+    UCTNodePool() = default;
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+    struct ThreadCache;
+
+    static ThreadCache& get_thread_cache();
+    // Hand a block of up to CACHE_BLOCK free slots to a thread cache.
+    void refill(ThreadCache& cache);
+    // Give count slots from the head of a thread cache back to the pool.
+    void spill(ThreadCache& cache, int count);
+    void add_slab();
+    void reclaimer();
+
+    SMP::Mutex m_mutex;
+    std::vector<HugePages> m_slabs;
+    FreeSlot* m_free{nullptr};
+
+    std::mutex m_reclaim_mutex;
+    std::condition_variable m_reclaim_cv;
+    std::vector<std::unique_ptr<UCTNode>> m_reclaim_queue;
+    std::thread m_reclaimer;
+    bool m_exit{false};
+};
+
+#endif
@@ -20,20 +20,30 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <chrono>
 #include <cmath>
 #include <vector>
 #include <utility>
 #include <thread>
 #include <algorithm>
+#include <map>
+#include <mutex>
 #include <type_traits>
+#include <boost/optional.hpp>
 #include <boost/range/adaptor/reversed.hpp>
 
 #include "Position.h"
 #include "Movegen.h"
 #include "UCI.h"
+#include "UCTNodePool.h"
 #include "UCTSearch.h"
 #include "Random.h"
+#include "SMP.h"
 #include "Parameters.h"
+#include "PhaseTimer.h"
+#include "TBCache.h"
+#include "TBProbeService.h"
+#include "TreeSnapshot.h"
 #include "Utils.h"
 #include "Network.h"
 #include "Training.h"
@@ -42,17 +52,21 @@
 #include "syzygy/tbprobe.h"
 #ifdef USE_OPENCL
 #include "OpenCL.h"
+#include "OpenCLScheduler.h"
 #endif
 
 using namespace Utils;
 
 LimitsType Limits;
 
+constexpr int UCTSearch::COLLISION_MIN_SLEEP_US;
+constexpr int UCTSearch::COLLISION_MAX_SLEEP_US;
+
 UCTSearch::UCTSearch(BoardHistory&& bh)
     : bh_(std::move(bh)) {
     set_playout_limit(cfg_max_playouts);
     set_node_limit(cfg_max_nodes);
-    m_root = std::make_unique<UCTNode>(MOVE_NONE, 0.0f, 0.5f);
+    m_root = std::make_unique<UCTNode>(MOVE_NONE, 0.5f);
 }
 
 void UCTSearch::set_quiet(bool quiet) {
@@ -71,16 +85,36 @@ SearchResult UCTSearch::play_simulation(BoardHistory& bh, UCTNode* const node, i
     }
 
     if (!node->has_children()) {
-        bool drawn = cur.is_draw();
-        if (drawn || !MoveList<LEGAL>(cur).size()) {
+        // The legal moves are generated once, for the mate check here and
+        // for the children of the expansion.
+        boost::optional<MoveList<LEGAL>> legal_moves;
+        bool drawn, terminal;
+        {
+            PHASE_TIMER(MOVEGEN);
+            drawn = cur.is_draw();
+            if (!drawn) {
+                legal_moves.emplace(cur);
+            }
+            terminal = drawn || !legal_moves->size();
+        }
+        if (terminal) {
             float score = (drawn || !cur.checkers()) ? 0.0 : (color == Color::WHITE ? -1.0 : 1.0);
             result = SearchResult::from_score(score);
         } else if (m_nodes < MAX_TREE_SIZE) {
             Tablebases::ProbeState err = Tablebases::ProbeState::FAIL;
+            auto pending = false;
             if (cur.rule50_count() == 0 && cur.count<ALL_PIECES>() <= Tablebases::MaxCardinality && !cur.can_castle(ANY_CASTLING)) {
-                Position to_lookup = cur;
-                Tablebases::WDLScore wdl = Tablebases::probe_wdl(to_lookup, &err);
-                if (err != Tablebases::ProbeState::FAIL) {
+                Tablebases::WDLScore wdl = Tablebases::WDLDraw;
+                {
+                    PHASE_TIMER(TBPROBE);
+                    pending = !TBProbeService::get_TBProbeService().probe_wdl(cur, &wdl, &err);
+                }
+                if (pending) {
+                    // Like an evaluation that is still running, so the
+                    // parent retries another child.
+                    result = SearchResult::from_collision();
+                    ++m_collisions;
+                } else if (err != Tablebases::ProbeState::FAIL) {
                     if (wdl == Tablebases::WDLLoss) {
                         result = SearchResult::from_score(color == Color::WHITE ? -1.0 : 1.0);
                     } else if (wdl == Tablebases::WDLWin) {
@@ -93,27 +127,88 @@ SearchResult UCTSearch::play_simulation(BoardHistory& bh, UCTNode* const node, i
                     ++m_tbhits;
                 }
             }
-            if (err == Tablebases::ProbeState::FAIL) {
+            if (!pending && err == Tablebases::ProbeState::FAIL) {
                 float eval;
-                auto success = node->create_children(m_nodes, bh, eval);
+                auto success = node->create_children(m_nodes, bh, eval, &*legal_moves);
                 if (success) {
                     result = SearchResult::from_eval(eval);
+                    // The node itself was created on the first visit.
+                    m_tree_bytes += node->get_children_memory() + sizeof(UCTNode);
+                } else if (!node->has_children() && node->is_expanding()) {
+                    result = SearchResult::from_collision();
+                    ++m_collisions;
                 }
             }
         }
     }
 
     if (node->has_children() && !result.valid()) {
-        auto next = node->uct_select_child(color, node == m_root.get());
-        auto move = next->get_move();
-        bh.do_move(move);
-        result = play_simulation(bh, next, ndepth+1);
+        // A child that collided keeps its virtual loss until the retries
+        // are over, so that they select other children.
+        UCTNode* collided[MAX_COLLISION_RETRIES + 1];
+        size_t collided_index[MAX_COLLISION_RETRIES + 1];
+        auto collisions = 0;
+        do {
+            UCTNode* next;
+            size_t index;
+            {
+                PHASE_TIMER(SELECT);
+                next = node->uct_select_child(color, node == m_root.get(), index);
+            }
+            auto move = next->get_move();
+            bh.do_move(move);
+            result = play_simulation(bh, next, ndepth+1);
+            bh.undo_move();
+            if (result.collision()) {
+                collided_index[collisions] = index;
+                collided[collisions++] = next;
+            } else {
+                node->update_child_stats(index);
+            }
+        } while (result.collision() && collisions <= MAX_COLLISION_RETRIES);
+        if (result.collision()) {
+            // Everything we tried is being expanded. Rather than start a
+            // new playout that likely collides again, wait for the last
+            // one and back up its evaluation. That waits for a batch of the
+            // network, so after a few yields back off to sleeps, rather
+            // than take a core from the threads that fill the batch.
+            // A pending tablebase probe has no expansion to wait for.
+            auto leaf = collided[collisions - 1];
+            auto yields = 0;
+            auto sleep = std::chrono::microseconds{COLLISION_MIN_SLEEP_US};
+            while (!leaf->has_children() && leaf->is_expanding()
+                   && is_running()) {
+                if (yields < COLLISION_YIELDS) {
+                    ++yields;
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(sleep);
+                    sleep = std::min(2 * sleep,
+                        std::chrono::microseconds{COLLISION_MAX_SLEEP_US});
+                }
+            }
+            result = SearchResult{};
+            if (leaf->has_children()) {
+                result = SearchResult::from_eval(leaf->get_net_eval(Color::WHITE));
+                leaf->update(result.eval());
+            }
+        }
+        for (auto i = 0; i < collisions; i++) {
+            collided[i]->virtual_loss_undo();
+            node->update_child_stats(collided_index[i]);
+        }
     }
 
-    if (result.valid()) {
-        node->update(result.eval());
+    {
+        PHASE_TIMER(BACKUP);
+        if (result.valid()) {
+            node->update(result.eval());
+        }
+        // The parent undoes the virtual loss of a collision.
+        if (!result.collision() || ndepth == 0) {
+            node->virtual_loss_undo();
+        }
     }
-    node->virtual_loss_undo();
 
     return result;
 }
@@ -126,7 +221,8 @@ void UCTSearch::dump_stats(BoardHistory& state, UCTNode& parent) {
 
     const Color color = state.cur().side_to_move();
 
-    // sort children, put best move on top
+    // sort children, put best move on top. The search threads are done,
+    // so this doesn't hold them up, unlike the output during the search.
     m_root->sort_root_children(color);
 
     if (parent.get_first_child()->first_visit()) {
@@ -137,7 +233,7 @@ void UCTSearch::dump_stats(BoardHistory& state, UCTNode& parent) {
     auto accum_vector = m_root->calc_proportional(root_temperature, color);
 
     for (const auto& node : boost::adaptors::reverse(parent.get_children())) {
-        std::string tmp = state.cur().move_to_san(node->get_move());
+        std::string tmp = state.cur().move_to_san(node.get_move());
         std::string pvstring(tmp);
         std::string moveprob(10, '\0');
 
@@ -161,16 +257,18 @@ void UCTSearch::dump_stats(BoardHistory& state, UCTNode& parent) {
         }
         myprintf_so("info string %5s -> %7d %s (V: %5.2f%%) (N: %5.2f%%) PV: ",
                 tmp.c_str(),
-                node->get_visits(),
+                node.get_visits(),
                 moveprob.c_str(),
-                node->get_eval(color)*100.0f,
-                node->get_score() * 100.0f);
-
-        StateInfo si;
-        state.cur().do_move(node->get_move(), si);
-        // Since this is just a string, set use_san=true
-        pvstring += " " + get_pv(state, *node, true);
-        state.cur().undo_move(node->get_move());
+                (node.first_visit() ? parent.get_net_eval(color) : node.get_eval(color))*100.0f,
+                node.get_score() * 100.0f);
+
+        if (node.is_inflated()) {
+            StateInfo si;
+            state.cur().do_move(node.get_move(), si);
+            // Since this is just a string, set use_san=true
+            pvstring += " " + get_pv(state, *node.get(), true);
+            state.cur().undo_move(node.get_move());
+        }
 
         myprintf_so("%s\n", pvstring.c_str());
     }
@@ -178,6 +276,18 @@ void UCTSearch::dump_stats(BoardHistory& state, UCTNode& parent) {
     float feval = m_root->get_eval(color);
     myprintf_so("info string stm %s winrate %5.2f%%\n",
         color == Color::WHITE ? "White" : "Black", feval * 100.f);
+    auto tbcache_lookups =
+        TBCache::get_TBCache().get_lookups() - m_tbcache_lookups_start;
+    if (tbcache_lookups > 0) {
+        auto tbcache_hits =
+            TBCache::get_TBCache().get_hits() - m_tbcache_hits_start;
+        myprintf_so("info string tbhits %d tbcache %d hits %d misses\n",
+            int(m_tbhits), tbcache_hits, tbcache_lookups - tbcache_hits);
+    }
+    if (m_collisions > 0) {
+        myprintf_so("info string collisions %d (%.2f per playout)\n",
+            int(m_collisions), float(m_collisions) / std::max(1, int(m_playouts)));
+    }
     myprintf("\n");
 }
 
@@ -232,19 +342,23 @@ Move UCTSearch::get_best_move() {
     return bestmove;
 }
 
-std::string UCTSearch::get_pv(BoardHistory& state, UCTNode& parent, bool use_san) {
-    if (!parent.has_children()) {
+std::string UCTSearch::get_pv(BoardHistory& state, const UCTNode& parent, bool use_san) {
+    const auto children = parent.snapshot_children(state.cur().side_to_move());
+    if (children.empty()) {
         return std::string();
     }
 
-    auto& best_child = parent.get_best_root_child(state.cur().side_to_move());
-    auto best_move = best_child.get_move();
+    const auto& best_child = children.front();
+    auto best_move = best_child.move;
     auto res = use_san ? state.cur().move_to_san(best_move) : UCI::move(best_move);
+    if (!best_child.node) {
+        return res;
+    }
 
     StateInfo st;
     state.cur().do_move(best_move, st);
 
-    auto next = get_pv(state, best_child, use_san);
+    auto next = get_pv(state, *best_child.node, use_san);
     if (!next.empty()) {
         res.append(" ").append(next);
     }
@@ -279,6 +393,49 @@ void UCTSearch::dump_analysis(int64_t elapsed, bool force_output) {
              cp, elapsed, pvstring.c_str());
 }
 
+size_t UCTSearch::get_tree_budget() const {
+    // The node limit still applies, the edges alone of that many take
+    // this much.
+    return std::min(size_t(cfg_tree_mb) * 1024 * 1024,
+                    size_t(MAX_TREE_SIZE) * sizeof(UCTEdge));
+}
+
+bool UCTSearch::tree_over_budget() const {
+    return cfg_tree_mb > 0
+        && (m_tree_bytes > get_tree_budget() || m_nodes >= MAX_TREE_SIZE);
+}
+
+void UCTSearch::collect_garbage(ThreadGroup& tg, int workers) {
+    // Nobody may be in the tree while subtrees are freed.
+    m_run = false;
+    tg.wait_all();
+
+    auto bytes_by_visits = std::map<int, size_t>{};
+    const auto bytes = m_root->get_tree_memory(&bytes_by_visits);
+    const auto target = get_tree_budget() / 100 * GC_TARGET_PERCENT;
+    // The least visited subtrees are the least likely to matter, so
+    // they go first.
+    auto freed = size_t{0};
+    auto visits = 0;
+    for (const auto& entry : bytes_by_visits) {
+        if (bytes - freed <= target) {
+            break;
+        }
+        freed += entry.second;
+        visits = entry.first + 1;
+    }
+    m_root->prune_subtrees(visits);
+    m_tree_bytes = bytes - freed;
+    m_nodes = m_root->count_nodes();
+    myprintf("Tree at %zu MB, pruned subtrees below %d visits to %zu MB.\n",
+             bytes / (1024 * 1024), visits, size_t(m_tree_bytes) / (1024 * 1024));
+
+    m_run = true;
+    for (int i = 1; i < workers; i++) {
+        tg.add_task(UCTWorker(bh_, this, m_root.get()));
+    }
+}
+
 bool UCTSearch::is_running() const {
     return m_run && m_nodes < MAX_TREE_SIZE;
 }
@@ -292,30 +449,35 @@ int UCTSearch::est_playouts_left() const {
                 std::max(0, std::min(m_maxplayouts - playouts,
                                      m_maxnodes - m_root->get_visits()));
         return playouts_left;
-    } else if (elapsed_millis < 1000 || playouts < 100) {
-        // Until we reach 1 second or 100 playouts playout_rate
-        // is not reliable, so just return max.
+    } else if (playouts < 100 || m_playout_rate <= 0.0f) {
+        // Until we have 100 playouts and a measured interval the
+        // playout rate is not reliable, so just return max.
         return MAXINT_DIV2;
     } else {
-        const auto playout_rate = 1.0f * playouts / elapsed_millis;
-        const auto time_left = std::max<int>(0, m_target_time - elapsed_millis);
-        return static_cast<int>(std::ceil(playout_rate * time_left));
+        // The rate of the last intervals follows the NN latency and batch
+        // fill as they change during the search, where the average since
+        // the start would lag behind. The playouts that are running when
+        // the search stops only finish one NN latency later, so that part
+        // of the budget gives no new ones.
+        const auto time_left = std::max(0.0f,
+            m_target_time - elapsed_millis - get_nn_latency());
+        return static_cast<int>(std::ceil(m_playout_rate * time_left));
     }
 }
 
 size_t UCTSearch::prune_noncontenders() {
     auto Nfirst = 0;
-    for (const auto& node : m_root->get_children()) {
-        Nfirst = std::max(Nfirst, node->get_visits());
+    for (auto& node : m_root->get_children()) {
+        Nfirst = std::max(Nfirst, node.get_visits());
     }
     const auto min_required_visits =
         Nfirst - est_playouts_left();
     auto pruned_nodes = size_t{0};
-    for (const auto& node : m_root->get_children()) {
+    for (auto& node : m_root->get_children()) {
         const auto has_enough_visits =
-            node->get_visits() >= min_required_visits;
-        node->set_active(has_enough_visits && !m_tbpruned.count((int)node->get_move()));
-        if (!node->active()) {
+            node.get_visits() >= min_required_visits;
+        node.set_active(has_enough_visits && !m_tbpruned.count((int)node.get_move()));
+        if (!node.active()) {
             ++pruned_nodes;
         }
     }
@@ -355,14 +517,45 @@ bool UCTSearch::have_alternate_moves() {
 }
 
 
+void UCTSearch::update_playout_rate() {
+    // Shorter intervals than this give too few playouts at slow rates.
+    constexpr auto RATE_INTERVAL_MS = 100;
+    constexpr auto RATE_DECAY = 0.5f;
+
+    const auto time = now();
+    const auto interval = time - m_rate_time;
+    if (interval < RATE_INTERVAL_MS) {
+        return;
+    }
+    const auto playouts = m_playouts.load();
+    const auto rate = 1.0f * (playouts - m_rate_playouts) / interval;
+    if (m_playout_rate > 0.0f) {
+        m_playout_rate = RATE_DECAY * m_playout_rate + (1.0f - RATE_DECAY) * rate;
+    } else {
+        m_playout_rate = rate;
+    }
+    m_rate_time = time;
+    m_rate_playouts = playouts;
+}
+
+float UCTSearch::get_nn_latency() const {
+    const auto evals = Network::get_eval_count() - m_eval_count_start;
+    if (evals <= 0) {
+        return 0.0f;
+    }
+    const auto micros = Network::get_eval_micros() - m_eval_micros_start;
+    return micros / 1000.0f / evals;
+}
+
 bool UCTSearch::pv_limit_reached() const {
     return m_playouts >= m_maxplayouts
         || m_root->get_visits() >= m_maxnodes;
 }
 
 void UCTWorker::operator()() {
+    // Every playout undoes its moves, so the same history serves them all.
+    auto bh = bh_.shallow_clone();
     do {
-        BoardHistory bh = bh_.shallow_clone();
         auto result = m_search->play_simulation(bh, m_root, 0);
         if (result.valid()) {
             m_search->increment_playouts();
@@ -374,7 +567,19 @@ void UCTSearch::increment_playouts() {
     m_playouts++;
 }
 
-Move UCTSearch::think(BoardHistory&& new_bh) {
+UCTSearch::~UCTSearch() {
+    UCTNodePool::get_UCTNodePool().release_async(std::move(m_root));
+}
+
+bool UCTSearch::save_tree(const std::string& filename, int min_visits) const {
+    if (!m_root->has_children()) {
+        return false;
+    }
+    return TreeSnapshot::save(filename, *m_root, m_prevroot_full_key,
+                              cfg_weightsfile, min_visits);
+}
+
+Move UCTSearch::think(BoardHistory&& new_bh, int64_t start_time) {
 #ifndef NDEBUG
     auto start_nodes = m_root->count_nodes();
 #endif
@@ -383,15 +588,24 @@ Move UCTSearch::think(BoardHistory&& new_bh) {
 
     // See if the position is in our previous search tree.
     // If not, construct a new m_root.
-    m_root = m_root->find_new_root(m_prevroot_full_key, new_bh);
+    auto new_root = m_root->find_new_root(m_prevroot_full_key, new_bh);
+    // Don't make the search wait for the rest of the old tree to be freed.
+    UCTNodePool::get_UCTNodePool().release_async(std::move(m_root));
+    m_root = std::move(new_root);
+    if (!m_root) {
+        m_root = TreeSnapshot::get_TreeSnapshot().find(new_bh);
+    }
     if (!m_root) {
-        m_root = std::make_unique<UCTNode>(new_bh.cur().get_move(), 0.0f, 0.5f);
+        m_root = std::make_unique<UCTNode>(new_bh.cur().get_move(), 0.5f);
     }
 
     m_playouts = 0;
     m_maxdepth = 0;
     m_nodes = m_root->count_nodes();
     m_tbhits = 0;
+    m_collisions = 0;
+    m_tbcache_hits_start = TBCache::get_TBCache().get_hits();
+    m_tbcache_lookups_start = TBCache::get_TBCache().get_lookups();
     // TODO: Both UCI and the next line do shallow_clone.
     // Could optimize this.
     bh_ = new_bh.shallow_clone();
@@ -406,10 +620,20 @@ Move UCTSearch::think(BoardHistory&& new_bh) {
 
     // set up timing info
 
-    Time.init(bh_.cur().side_to_move(), bh_.cur().game_ply());
-    m_target_time = (Limits.movetime ? Limits.movetime : Time.optimum()) - cfg_lagbuffer_ms;
-    m_max_time    = Time.maximum() - cfg_lagbuffer_ms;
-    m_start_time  = Limits.timeStarted();
+    if (Limits.dynamic_controls_set()) {
+        Time.init(bh_.cur().side_to_move(), bh_.cur().game_ply());
+        m_target_time = (Limits.movetime ? Limits.movetime : Time.optimum()) - cfg_lagbuffer_ms;
+        m_max_time    = Time.maximum() - cfg_lagbuffer_ms;
+    } else {
+        m_target_time = Limits.movetime - cfg_lagbuffer_ms;
+        m_max_time    = m_target_time;
+    }
+    m_start_time  = start_time ? start_time : Limits.timeStarted();
+    m_playout_rate = 0.0f;
+    m_rate_time = now();
+    m_rate_playouts = 0;
+    m_eval_count_start = Network::get_eval_count();
+    m_eval_micros_start = Network::get_eval_micros();
 
     // create a sorted list of legal moves (make sure we
     // play something legal and decent even in time trouble)
@@ -428,15 +652,17 @@ Move UCTSearch::think(BoardHistory&& new_bh) {
         // This copy should not be required, just being paranoid since root_probe mutates the pos argument.
         Position cur_pos = bh_.cur();
         if (Tablebases::root_probe(cur_pos, m_root->get_children()) || Tablebases::root_probe_wdl(cur_pos, m_root->get_children())) {
-            for (const auto& node : m_root->get_children()) {
+            for (auto& node : m_root->get_children()) {
                 m_tbhits++;
-                if (!node->active()) {
-                    m_tbpruned.insert((int)node->get_move());
+                if (!node.active()) {
+                    m_tbpruned.insert((int)node.get_move());
                 }
             }
         }
     }
 
+    m_tree_bytes = m_root->get_tree_memory();
+
     m_run = true;
     int cpus = cfg_num_threads;
     ThreadGroup tg(thread_pool);
@@ -446,8 +672,8 @@ Move UCTSearch::think(BoardHistory&& new_bh) {
 
     bool keeprunning = true;
     int last_update = 0;
+    auto currstate = bh_.shallow_clone();
     do {
-        auto currstate = bh_.shallow_clone();
         auto result = play_simulation(currstate, m_root.get(), 0);
         if (result.valid()) {
             increment_playouts();
@@ -456,13 +682,19 @@ Move UCTSearch::think(BoardHistory&& new_bh) {
         int depth = m_maxdepth;
         if (depth != last_update) {
             last_update = depth;
-            dump_analysis(Time.elapsed(), false);
+            dump_analysis(now() - m_start_time, false);
+        }
+
+        update_playout_rate();
+
+        if (tree_over_budget()) {
+            collect_garbage(tg, cpus);
         }
 
         // check if we should still search
         keeprunning = is_running();
         keeprunning &= !should_halt_search();
-        if (!Limits.infinite) {
+        if (!Limits.infinite && !m_pondering) {
             // have_alternate_moves has the side effect
             // of pruning moves, so be careful to not even
             // call it when running infinite.
@@ -473,17 +705,33 @@ Move UCTSearch::think(BoardHistory&& new_bh) {
     // stop the search
     m_run = false;
     tg.wait_all();
+    // UCI doesn't allow the bestmove before ponderhit or stop, even when
+    // the tree is full.
+    {
+        std::unique_lock<std::mutex> lock(m_ponder_mutex);
+        m_ponder_cv.wait(lock, [this] {
+            return !m_pondering || uci_stop.load(std::memory_order_seq_cst);
+        });
+    }
+    m_pondering = false;
     if (!m_root->has_children()) {
         return MOVE_NONE;
     }
 
     // reactivate all pruned root children
-    for (const auto& node : m_root->get_children()) {
-        node->set_active(true);
+    for (auto& node : m_root->get_children()) {
+        node.set_active(true);
     }
 
     // display search info
     dump_stats(bh_, *m_root);
+    SMP::dump_lock_stats();
+    PhaseTimer::dump_stats();
+#ifdef USE_OPENCL
+    if (cfg_opencl_profile) {
+        opencl.dump_profile();
+    }
+#endif
     Training::record(bh_, *m_root);
 
     int64_t milliseconds_elapsed = now() - m_start_time;
@@ -498,18 +746,23 @@ void UCTSearch::ponder() {
     assert(m_playouts == 0);
     assert(m_nodes == 0);
 
+    m_tree_bytes = m_root->get_tree_memory();
+
     m_run = true;
     int cpus = cfg_num_threads;
     ThreadGroup tg(thread_pool);
     for (int i = 1; i < cpus; i++) {
         tg.add_task(UCTWorker(bh_, this, m_root.get()));
     }
+    auto bh = bh_.shallow_clone();
     do {
-        auto bh = bh_.shallow_clone();
         auto result = play_simulation(bh, m_root.get(), 0);
         if (result.valid()) {
             increment_playouts();
         }
+        if (tree_over_budget()) {
+            collect_garbage(tg, cpus);
+        }
     } while(!Utils::input_pending() && is_running());
 
     // stop the search
@@ -525,8 +778,10 @@ void UCTSearch::ponder() {
 // Used to check if we've run out of time or reached out playout limit
 bool UCTSearch::should_halt_search() {
     if (uci_stop.load(std::memory_order_seq_cst)) return true;
-    if (Limits.infinite) return false;
-    auto elapsed_millis = now() - m_start_time;
+    if (Limits.infinite || m_pondering) return false;
+    // Stop one NN latency early, the running playouts take that long to
+    // finish, so that the search ends on time.
+    auto elapsed_millis = now() - m_start_time + get_nn_latency();
     if (Limits.movetime)
         return (elapsed_millis > m_target_time);
     if (Limits.dynamic_controls_set())
@@ -536,7 +791,42 @@ bool UCTSearch::should_halt_search() {
 
 // Asks the search to stop politely
 void UCTSearch::please_stop() {
-    uci_stop.store(true, std::memory_order_seq_cst);
+    {
+        std::lock_guard<std::mutex> lock(m_ponder_mutex);
+        uci_stop.store(true, std::memory_order_seq_cst);
+    }
+    m_ponder_cv.notify_all();
+}
+
+// The opponent played the move we ponder on, so the tree searched so far
+// is already the tree of our move. Our clock runs from now, the time
+// management takes over from here.
+void UCTSearch::ponderhit() {
+    if (!m_pondering) {
+        return;
+    }
+    m_start_time = now();
+    {
+        std::lock_guard<std::mutex> lock(m_ponder_mutex);
+        m_pondering = false;
+    }
+    m_ponder_cv.notify_all();
+}
+
+Move UCTSearch::get_ponder_move(Move bestmove) {
+    if (bestmove == MOVE_NONE || !m_root->has_children()) {
+        return MOVE_NONE;
+    }
+    for (const auto& edge : m_root->get_children()) {
+        auto node = edge.get();
+        if (edge.get_move() != bestmove || !node || !node->has_children()) {
+            continue;
+        }
+        auto color = ~bh_.cur().side_to_move();
+        auto& reply = node->get_best_root_child(color);
+        return reply.first_visit() ? MOVE_NONE : reply.get_move();
+    }
+    return MOVE_NONE;
 }
 
 void UCTSearch::set_playout_limit(int playouts) {
@@ -21,6 +21,8 @@
 
 #include <memory>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <tuple>
 #include <unordered_set>
 
@@ -38,6 +40,7 @@ class SearchResult {
 public:
     SearchResult() = default;
     bool valid() const { return m_valid;  }
+    bool collision() const { return m_collision; }
     float eval() const { return m_eval;  }
     static SearchResult from_eval(float eval) {
         return SearchResult(eval);
@@ -51,56 +54,129 @@ public:
             return SearchResult(0.5f);
         }
     }
+    // The playout reached a leaf that another thread is expanding.
+    static SearchResult from_collision() {
+        auto result = SearchResult{};
+        result.m_collision = true;
+        return result;
+    }
 private:
     explicit SearchResult(float eval)
         : m_valid(true), m_eval(eval) {}
     bool m_valid{false};
+    bool m_collision{false};
     float m_eval{0.0f};
 };
 
 class UCTSearch {
 public:
     /*
-        Maximum size of the tree in memory. Nodes are about
-        40 bytes, so limit to ~1.6G.
+        Maximum size of the tree in memory. This counts children,
+        which are 16 byte edges until they are visited and get a
+        64 byte node, so the edges alone take up to ~640M.
     */
     static constexpr auto MAX_TREE_SIZE = 40'000'000;
 
+    /*
+        How often a playout that runs into a leaf that another
+        thread is expanding picks another child of the leaf's parent
+        before it gives up.
+    */
+    static constexpr auto MAX_COLLISION_RETRIES = 3;
+
+    /*
+        A playout whose retries all collided waits for the last
+        leaf. It yields this many times and then sleeps, starting
+        at the minimum and doubling up to the maximum microseconds.
+    */
+    static constexpr auto COLLISION_YIELDS = 16;
+    static constexpr auto COLLISION_MIN_SLEEP_US = 10;
+    static constexpr auto COLLISION_MAX_SLEEP_US = 1000;
+
+    /*
+        With a tree memory budget, the collector prunes the tree
+        down to this percentage of the budget when it is full.
+    */
+    static constexpr auto GC_TARGET_PERCENT = 75;
+
     UCTSearch(BoardHistory&& bh);
-    Move think(BoardHistory&& bh);
+    ~UCTSearch();
+    // Times the search from @start_time, or from Limits.startTime when 0.
+    // Time management, which uses the globals Limits and Time, is left out
+    // without a time control, so searches without one can run at once.
+    Move think(BoardHistory&& bh, int64_t start_time = 0);
     void set_playout_limit(int playouts);
     void set_node_limit(int nodes);
     void set_analyzing(bool flag);
     void set_quiet(bool flag);
     void ponder();
+    // Makes the next think() a 'go ponder' search, which runs until
+    // ponderhit() turns it into a normal one, timed from then on, or stop.
+    void set_pondering(bool flag) { m_pondering = flag; }
+    void ponderhit();
+    bool is_pondering() const { return m_pondering; }
+    // The expected reply to the last best move, MOVE_NONE if the search
+    // has no idea. Only valid right after think().
+    Move get_ponder_move(Move bestmove);
     bool is_running() const;
     int est_playouts_left() const;
     size_t prune_noncontenders();
     bool have_alternate_moves();
     bool pv_limit_reached() const;
     void increment_playouts();
+    int get_playouts() const { return m_playouts; }
+    int get_nodes() const { return m_nodes; }
     bool should_halt_search();
     void please_stop();
     SearchResult play_simulation(BoardHistory& bh, UCTNode* const node, int sdepth);
+    // Saves the tree of the last search as a TreeSnapshot, see there.
+    bool save_tree(const std::string& filename, int min_visits) const;
 
 private:
     void dump_stats(BoardHistory& pos, UCTNode& parent);
-    std::string get_pv(BoardHistory& pos, UCTNode& parent, bool use_san);
+    // Follows the most visited children from snapshots, so it doesn't
+    // hold up the search threads.
+    std::string get_pv(BoardHistory& pos, const UCTNode& parent, bool use_san);
     void dump_analysis(int64_t elapsed, bool force_output);
     Move get_best_move();
     float get_root_temperature();
+    size_t get_tree_budget() const;
+    bool tree_over_budget() const;
+    // Stop the workers, prune the least visited subtrees and restart.
+    void collect_garbage(Utils::ThreadGroup& tg, int workers);
 
     BoardHistory bh_;
     Key m_prevroot_full_key{0};
     std::unique_ptr<UCTNode> m_root;
     std::atomic<int> m_nodes{0};
+    // Memory used by the tree, measured when the search starts and by the
+    // collector and estimated from the expansions in between.
+    std::atomic<size_t> m_tree_bytes{0};
     std::atomic<int> m_playouts{0};
     std::atomic<int> m_maxdepth{0};
     std::atomic<int> m_tbhits{0};
+    std::atomic<int> m_collisions{0};
+    // TBCache counters when the search started.
+    int m_tbcache_hits_start{0};
+    int m_tbcache_lookups_start{0};
+    // Live measurements for the time management. The playout rate is in
+    // playouts per millisecond, a moving average over recent intervals.
+    float m_playout_rate{0.0f};
+    int64_t m_rate_time{0};
+    int m_rate_playouts{0};
+    std::int64_t m_eval_count_start{0};
+    std::int64_t m_eval_micros_start{0};
     int64_t m_target_time{0};
     int64_t m_max_time{0};
-    int64_t m_start_time{0};
+    // Set again from the UCI thread on ponderhit.
+    std::atomic<int64_t> m_start_time{0};
     std::atomic<bool> m_run{false};
+    // Searching the expected position on the opponent's time, without
+    // stopping until ponderhit or stop.
+    std::atomic<bool> m_pondering{false};
+    // Wakes a finished ponder search on ponderhit or stop.
+    std::mutex m_ponder_mutex;
+    std::condition_variable m_ponder_cv;
     int m_maxplayouts;
     int m_maxnodes;
 
@@ -110,6 +186,10 @@ private:
     std::unordered_set<int> m_tbpruned;
 
     int get_search_time();
+    void update_playout_rate();
+    // The average time from queueing an evaluation to its result during
+    // this search, in milliseconds.
+    float get_nn_latency() const;
 };
 
 class UCTWorker {
@@ -130,7 +210,8 @@ struct LimitsType {
 
     LimitsType() { // Init explicitly due to broken value-initialization of non POD in MSVC
         nodes = time[WHITE] = time[BLACK] = inc[WHITE] = inc[BLACK] =
-        npmsec = movestogo = depth = movetime = mate = perft = infinite = 0;
+        npmsec = movestogo = depth = movetime = mate = perft = infinite =
+        ponder = 0;
         startTime = now();
     }
 
@@ -146,7 +227,7 @@ struct LimitsType {
 
     std::vector<Move> searchmoves;
     int time[COLOR_NB], inc[COLOR_NB], npmsec, movestogo, depth,
-            movetime, mate, perft, infinite;
+            movetime, mate, perft, infinite, ponder;
     int64_t nodes;
     TimePoint startTime;
 };
@@ -26,10 +26,13 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
 #else
+#include <sys/resource.h>
 #include <sys/select.h>
 #endif
 
+#include "MappedFile.h"
 #include "Parameters.h"
 
 Utils::ThreadPool thread_pool;
@@ -167,3 +170,50 @@ size_t Utils::ceilMultiple(size_t a, size_t b) {
     auto ret = a + (b - a % b);
     return ret;
 }
+
+size_t Utils::peak_rss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    // Linux counts in kilobytes.
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+std::uint64_t Utils::fnv1a(const char* data, size_t size, std::uint64_t hash) {
+    for (auto i = size_t{0}; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool Utils::hash_file(const std::string& filename, std::uint64_t& hash) {
+    MappedFile file(filename);
+    if (!file.data()) {
+        return false;
+    }
+    hash = fnv1a(file.data(), file.size());
+    return true;
+}
+
+void Utils::lower_thread_priority() {
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+    // Linux keeps a nice value per thread, so this leaves the others alone.
+    setpriority(PRIO_PROCESS, 0, 19);
+#endif
+}
@@ -21,7 +21,8 @@
 
 #include "config.h"
 
-#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <limits>
 #include <string>
 
@@ -39,12 +40,6 @@ namespace Utils {
     void log_input(const std::string& input);
     bool input_pending();
 
-    template<class T>
-    void atomic_add(std::atomic<T> &f, T d) {
-        T old = f.load();
-        while (!f.compare_exchange_weak(old, old + d));
-    }
-
     template<typename T>
     T rotl(const T x, const int k) {
 	    return (x << k) | (x >> (std::numeric_limits<T>::digits - k));
@@ -57,6 +52,80 @@ namespace Utils {
     size_t lcm(size_t a, size_t b);
     size_t ceilMultiple(size_t a, size_t b);
 
+    // The most memory the process had resident so far, in bytes, or 0 if
+    // the platform doesn't tell.
+    size_t peak_rss();
+
+    // Lowers the scheduling priority of the calling thread, for background
+    // work that shouldn't slow down the search. Best effort.
+    void lower_thread_priority();
+
+    // 64 bit FNV-1a of @size bytes, continuing from @hash. Good enough to
+    // tell files apart, not against malice.
+    std::uint64_t fnv1a(const char* data, size_t size,
+                        std::uint64_t hash = 14695981039346656037ULL);
+    // fnv1a() of the contents of @filename. Returns false if it can't be
+    // read.
+    bool hash_file(const std::string& filename, std::uint64_t& hash);
+
+    // IEEE 754 half precision conversions, rounding to nearest even.
+    // These work on the bit patterns so they are cheap enough to convert
+    // network inputs and outputs on the fly.
+    inline std::uint16_t float_to_half(float f) {
+        auto u = std::uint32_t{};
+        std::memcpy(&u, &f, sizeof(u));
+        const auto sign = (u >> 16) & 0x8000;
+        u &= 0x7fffffff;
+
+        auto h = std::uint32_t{};
+        if (u >= (127 + 16) << 23) {
+            // Too large for a half, or Inf/NaN already.
+            h = u > 0x7f800000 ? 0x7e00 : 0x7c00;
+        } else if (u < 113 << 23) {
+            // Subnormal half or zero: add a magic number so that the
+            // FPU rounds the 10 mantissa bits into place for us.
+            const auto magic_u = std::uint32_t{((127 - 15) + (23 - 10) + 1) << 23};
+            auto magic = 0.0f;
+            std::memcpy(&magic, &magic_u, sizeof(magic));
+            auto v = 0.0f;
+            std::memcpy(&v, &u, sizeof(v));
+            v += magic;
+            std::memcpy(&u, &v, sizeof(u));
+            h = u - magic_u;
+        } else {
+            const auto mant_odd = (u >> 13) & 1;
+            // Rebias the exponent and round the mantissa.
+            u -= (127 - 15) << 23;
+            u += 0xfff + mant_odd;
+            h = u >> 13;
+        }
+        return static_cast<std::uint16_t>(h | sign);
+    }
+
+    inline float half_to_float(std::uint16_t h) {
+        const auto shifted_exp = std::uint32_t{0x7c00} << 13;
+        auto u = std::uint32_t{h & 0x7fffu} << 13;
+        const auto exp = u & shifted_exp;
+        u += (127 - 15) << 23;
+        auto f = 0.0f;
+        if (exp == shifted_exp) {
+            // Inf/NaN
+            u += (128 - 16) << 23;
+            std::memcpy(&f, &u, sizeof(f));
+        } else if (exp == 0) {
+            // Zero/subnormal, renormalize through the FPU.
+            u += 1 << 23;
+            std::memcpy(&f, &u, sizeof(f));
+            const auto magic_u = std::uint32_t{113 << 23};
+            auto magic = 0.0f;
+            std::memcpy(&magic, &magic_u, sizeof(magic));
+            f -= magic;
+        } else {
+            std::memcpy(&f, &u, sizeof(f));
+        }
+        return (h & 0x8000) ? -f : f;
+    }
+
 }
 
 #endif
@@ -0,0 +1,170 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WeightsFile.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include "MappedFile.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+namespace {
+    constexpr char MAGIC[4] = {'L', 'C', 'Z', 'W'};
+
+    uint32_t read_u32(const char* data) {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    void write_u32(std::ofstream& out, uint32_t value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+}
+
+bool WeightsFile::is_binary(const std::string& filename) {
+    auto file = std::ifstream{filename, std::ios::binary};
+    char magic[sizeof(MAGIC)];
+    return file.read(magic, sizeof(magic))
+        && is_binary(magic, sizeof(magic));
+}
+
+bool WeightsFile::is_binary(const char* data, const size_t size) {
+    return size >= sizeof(MAGIC)
+        && std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+bool WeightsFile::read_binary(const std::string& filename,
+                              int& format_version,
+                              std::vector<std::vector<float>>& lines) {
+    MappedFile file(filename);
+    if (file.data()) {
+        return parse_binary(file.data(), file.size(), format_version, lines);
+    }
+    // Some file systems can't be mapped, read the file there.
+    auto in = std::ifstream{filename, std::ios::binary};
+    if (!in) {
+        myprintf("Could not read weights file: %s\n", filename.c_str());
+        return false;
+    }
+    auto buffer = std::string{std::istreambuf_iterator<char>{in},
+                              std::istreambuf_iterator<char>{}};
+    return parse_binary(buffer.data(), buffer.size(), format_version, lines);
+}
+
+bool WeightsFile::parse_binary(const char* const data, const size_t size,
+                               int& format_version,
+                               std::vector<std::vector<float>>& lines) {
+    constexpr auto header_size = sizeof(MAGIC) + 3 * sizeof(uint32_t);
+    if (size < header_size || !is_binary(data, size)) {
+        myprintf("Weights file is not in the binary format.\n");
+        return false;
+    }
+    auto end = data + size;
+    auto pos = data + sizeof(MAGIC);
+    auto version = read_u32(pos);
+    if (version < 1 || version > BINARY_VERSION) {
+        myprintf("Binary weights file is the wrong version.\n");
+        return false;
+    }
+    format_version = static_cast<int>(read_u32(pos + 4));
+    auto count = size_t{read_u32(pos + 8)};
+    pos += 12;
+    auto encoding = uint32_t{FLOAT32};
+    if (version >= 2) {
+        if (end - pos < 4) {
+            myprintf("Binary weights file is truncated.\n");
+            return false;
+        }
+        encoding = read_u32(pos);
+        pos += 4;
+    }
+    if (encoding != FLOAT32 && encoding != FLOAT16) {
+        myprintf("Binary weights file has an unknown encoding.\n");
+        return false;
+    }
+    auto element_size = encoding == FLOAT16 ? sizeof(uint16_t)
+                                            : sizeof(float);
+
+    if (static_cast<size_t>(end - pos) / sizeof(uint32_t) < count) {
+        myprintf("Binary weights file is truncated.\n");
+        return false;
+    }
+    auto floats = pos + count * sizeof(uint32_t);
+    lines.clear();
+    lines.reserve(count);
+    for (auto i = size_t{0}; i < count; i++) {
+        auto line_size = size_t{read_u32(pos + i * sizeof(uint32_t))};
+        if (static_cast<size_t>(end - floats) / element_size < line_size) {
+            myprintf("Binary weights file is truncated.\n");
+            return false;
+        }
+        lines.emplace_back(line_size);
+        if (encoding == FLOAT16) {
+            for (auto j = size_t{0}; j < line_size; j++) {
+                uint16_t half;
+                std::memcpy(&half, floats + j * sizeof(half), sizeof(half));
+                lines.back()[j] = half_to_float(half);
+            }
+        } else {
+            std::memcpy(lines.back().data(), floats,
+                        line_size * sizeof(float));
+        }
+        floats += line_size * element_size;
+    }
+    return true;
+}
+
+bool WeightsFile::write_binary(const std::string& filename,
+                               const int format_version,
+                               const std::vector<std::vector<float>>& lines,
+                               const Encoding encoding) {
+    auto out = std::ofstream{filename, std::ios::binary};
+    out.write(MAGIC, sizeof(MAGIC));
+    write_u32(out, BINARY_VERSION);
+    write_u32(out, format_version);
+    write_u32(out, lines.size());
+    write_u32(out, encoding);
+    for (const auto& line : lines) {
+        write_u32(out, line.size());
+    }
+    for (const auto& line : lines) {
+        if (encoding == FLOAT16) {
+            auto halves = std::vector<uint16_t>(line.size());
+            std::transform(begin(line), end(line), begin(halves),
+                           float_to_half);
+            out.write(reinterpret_cast<const char*>(halves.data()),
+                      halves.size() * sizeof(uint16_t));
+        } else {
+            out.write(reinterpret_cast<const char*>(line.data()),
+                      line.size() * sizeof(float));
+        }
+    }
+    out.close();
+    if (out.fail()) {
+        myprintf("Could not write weights file: %s\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+/*
+    This file is part of Leela Chess.
+    Copyright (C) 2018 Gary Linscott and contributors
+
+    Leela Chess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Chess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WEIGHTSFILE_H_INCLUDED
+#define WEIGHTSFILE_H_INCLUDED
+
+#include "config.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary network weights. The text format stores every layer as a line of
+// floats, which takes seconds to parse for big networks. The binary format
+// stores the same lines as raw floats, so loading it is a memory map and a
+// copy. All fields are little endian:
+//
+//   char     magic[4]      "LCZW"
+//   uint32_t version       BINARY_VERSION
+//   uint32_t format        the weights format version, the first text line
+//   uint32_t count         the number of lines after the first
+//   uint32_t encoding      FLOAT32 or FLOAT16, not in version 1 files
+//   uint32_t sizes[count]  the number of floats on every line
+//   float    data[]        the lines back to back, IEEE half precision
+//                          floats with FLOAT16
+//
+// The training pipeline writes this format directly, gzipped for upload.
+namespace WeightsFile {
+    constexpr uint32_t BINARY_VERSION = 2;
+
+    enum Encoding : uint32_t {
+        FLOAT32 = 0,
+        FLOAT16 = 1,
+    };
+
+    // Whether the file starts with the binary magic.
+    bool is_binary(const std::string& filename);
+    bool is_binary(const char* data, size_t size);
+    // Read a binary file, returns false and prints why if that fails.
+    bool read_binary(const std::string& filename, int& format_version,
+                     std::vector<std::vector<float>>& lines);
+    // Same for a binary file already in memory, like a gunzipped one.
+    bool parse_binary(const char* data, size_t size, int& format_version,
+                      std::vector<std::vector<float>>& lines);
+    bool write_binary(const std::string& filename, int format_version,
+                      const std::vector<std::vector<float>>& lines,
+                      Encoding encoding = FLOAT32);
+}
+
+#endif
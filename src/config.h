@@ -38,6 +38,10 @@
 static constexpr int SELFCHECK_PROBABILITY = 2000;
 static constexpr int SELFCHECK_MIN_EXPANSIONS = 2'000'000;
 #define USE_TUNER
+// Count contention per LOCK() call site and print it after each search.
+//#define USE_LOCK_STATS
+// Time the phases of every playout and print them after each search.
+//#define USE_PHASE_TIMERS
 
 #define PROGRAM_VERSION "v0.10"
 
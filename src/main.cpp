@@ -20,9 +20,11 @@
 
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <random>
+#include <vector>
 
 #include "config.h"
 #include "Bitboard.h"
@@ -31,8 +33,11 @@
 #include "Utils.h"
 #include "UCI.h"
 #include "Random.h"
+#include "SMP.h"
 #include "Network.h"
+#include "NNCache.h"
 #include "UCTSearch.h"
+#include "TBProbeService.h"
 #include "Training.h"
 #include "Movegen.h"
 #include "pgn.h"
@@ -68,6 +73,29 @@ static std::string parse_commandline(int argc, char *argv[]) {
         ("threads,t", po::value<int>()->default_value
                       (std::min(cfg_num_threads, cfg_max_threads)),
                       "Number of threads to use.")
+        ("batchsize,b", po::value<int>()->default_value(cfg_batch_size),
+                      "Number of positions to send to the NN as one batch. "
+                      "Batches are gathered across search threads, so use at "
+                      "least as many threads.")
+        ("cache-mb", po::value<int>()->default_value(cfg_cache_mb),
+                     "Memory in MB used to cache NN evaluations.")
+        ("cache-file", po::value<std::string>(),
+                       "File keeping NN evaluations across runs, for "
+                       "analysing the same positions again. It is reset "
+                       "when used with another network.")
+        ("cache-file-mb", po::value<int>()->default_value(cfg_cache_file_mb),
+                          "Size in MB of the --cache-file.")
+        ("tree-mb", po::value<int>()->default_value(cfg_tree_mb),
+                    "Memory in MB for the search tree. When it is full the "
+                    "least visited subtrees are pruned so the search can go "
+                    "on. 0 stops expanding at a fixed number of nodes instead.")
+        ("selfplay-games", po::value<int>()->default_value(cfg_selfplay_games),
+                           "Number of self-play games the train command plays "
+                           "at once. Their searches share the network, so the "
+                           "NN batches fill up from all of them.")
+        ("pin-threads", "Bind the search and NN threads to cores of their "
+                        "own, filling one NUMA node before the next, so the "
+                        "tree stays in memory local to them. Linux only.")
         ("playouts,p", po::value<int>(),
                        "Weaken engine by limiting the number of playouts. ")
         ("nodes,v", po::value<int>(),
@@ -88,19 +116,51 @@ static std::string parse_commandline(int argc, char *argv[]) {
         ("seed,s", po::value<std::uint64_t>(),
                    "Random number generation seed.")
         ("weights,w", po::value<std::string>(), "File with network weights.")
+        ("tree-snapshot", po::value<std::string>(),
+                          "Search tree saved by the savetree command. "
+                          "Searches of the positions in it start from there. "
+                          "Read at startup and at ucinewgame.")
         ("syzygypath,e", po::value<std::string>(), "Folder with syzygy endgame tablebases.")
+        ("syzygy-threads", po::value<int>()->default_value(cfg_syzygythreads),
+                "Threads that probe the tablebases, so that the search "
+                "doesn't wait for the disk. 0 probes on the search threads.")
+        ("syzygy-prefetch", "Map all tablebases when they are loaded and ask "
+                            "the OS to read them into memory.")
         ("logfile,l", po::value<std::string>(), "File to log input/output to.")
         ("quiet,q", "Disable all diagnostic output.")
         ("uci", "Don't initialize the engine until \"isready\" command is sent. Use this if your "
                 "GUI is freezing on startup.")
         ("start", po::value<std::string>(), "Start command {train, bench}.")
         ("supervise", po::value<std::string>(), "Dump supervised learning data from the pgn.")
+        ("convert-weights", po::value<std::string>(),
+                "Write the weights to this file in the binary format, "
+                "which loads much faster, and exit.")
 #ifdef USE_OPENCL
         ("gpu",  po::value<std::vector<int> >(),
                 "ID of the OpenCL device(s) to use (disables autodetection).")
         ("full-tuner", "Try harder to find an optimal OpenCL tuning.")
-        ("tune-only", "Tune OpenCL only and then exit.")
+        ("tune-only", "Tune OpenCL for --batchsize and the powers of two "
+                      "below it only and then exit.")
+        ("tuning-db", po::value<std::string>(),
+                "File with OpenCL tunings to use when there is no local "
+                "one for this device and driver.")
+        ("half", "Store weights and activations as half precision floats "
+                 "on OpenCL devices that support it.")
+        ("cpu-workers", po::value<int>(),
+                "Number of CPU threads that evaluate a share of the "
+                "batches next to the OpenCL devices.")
+        ("gpu-contexts", po::value<int>(),
+                "Number of command queues, with their own buffers, on each "
+                "OpenCL device. The search threads take turns using them.")
+        ("opencl-profile", "Time every OpenCL kernel and transfer, and print "
+                "the device time per layer and per kernel after each search.")
+#else
+        ("int8", "Run the residual tower with int8 weights and activations. "
+                 "Faster, but slightly less accurate.")
 #endif
+        ("winograd", po::value<int>(),
+                "Output tile of the winograd convolutions, 2 for F(2x2, 3x3) "
+                "or 4 for F(4x4, 3x3). By default the faster one.")
 #ifdef USE_TUNER
         ("puct", po::value<float>())
         ("fpu_reduction", po::value<float>())
@@ -152,6 +212,10 @@ static std::string parse_commandline(int argc, char *argv[]) {
         cfg_quiet = true;
     }
 
+    if (vm.count("pin-threads")) {
+        cfg_pin_threads = true;
+    }
+
 #ifdef USE_TUNER
     if (vm.count("puct")) {
         cfg_puct = vm["puct"].as<float>();
@@ -174,16 +238,33 @@ static std::string parse_commandline(int argc, char *argv[]) {
         cfg_supervise = vm["supervise"].as<std::string>();
     }
 
+    if (vm.count("convert-weights")) {
+        cfg_convert_weights = vm["convert-weights"].as<std::string>();
+    }
+
     if (vm.count("weights")) {
         cfg_weightsfile = vm["weights"].as<std::string>();
     } else if (cfg_supervise.empty()) {
         cfg_weightsfile = "weights.txt";
+    } else {
+        // Supervised data can do without a network.
+        cfg_weightsfile.clear();
+    }
+
+    if (vm.count("tree-snapshot")) {
+        cfg_tree_snapshot = vm["tree-snapshot"].as<std::string>();
     }
 
     if (vm.count("syzygypath")) {
         cfg_syzygypath = vm["syzygypath"].as<std::string>();
     }
 
+    cfg_syzygythreads = std::max(0, vm["syzygy-threads"].as<int>());
+
+    if (vm.count("syzygy-prefetch")) {
+        cfg_syzygyprefetch = true;
+    }
+
     if (vm.count("threads")) {
         int num_threads = vm["threads"].as<int>();
         if (num_threads > cfg_max_threads) {
@@ -196,6 +277,53 @@ static std::string parse_commandline(int argc, char *argv[]) {
 
     }
 
+    if (vm.count("batchsize")) {
+        cfg_batch_size = vm["batchsize"].as<int>();
+        if (cfg_batch_size < 1) {
+            myprintf("Nonsensical options: Batch size must be at least 1.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (cfg_batch_size > 1) {
+            myprintf("Using NN batch size %d.\n", cfg_batch_size);
+        }
+    }
+
+    if (vm.count("cache-mb")) {
+        cfg_cache_mb = vm["cache-mb"].as<int>();
+        if (cfg_cache_mb < 1) {
+            myprintf("Nonsensical options: NN cache size must be at least 1 MB.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("cache-file")) {
+        cfg_cache_file = vm["cache-file"].as<std::string>();
+    }
+
+    if (vm.count("cache-file-mb")) {
+        cfg_cache_file_mb = vm["cache-file-mb"].as<int>();
+        if (cfg_cache_file_mb < 1) {
+            myprintf("Nonsensical options: NN cache file size must be at least 1 MB.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("tree-mb")) {
+        cfg_tree_mb = vm["tree-mb"].as<int>();
+        if (cfg_tree_mb < 0) {
+            myprintf("Nonsensical options: Tree memory can't be negative.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("selfplay-games")) {
+        cfg_selfplay_games = vm["selfplay-games"].as<int>();
+        if (cfg_selfplay_games < 1) {
+            myprintf("Nonsensical options: Self-play games must be at least 1.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (vm.count("seed")) {
         cfg_rng_seed = vm["seed"].as<std::uint64_t>();
         if (cfg_rng_seed == 0) {
@@ -209,6 +337,12 @@ static std::string parse_commandline(int argc, char *argv[]) {
           exit(EXIT_FAILURE);
         }
 
+        if (cfg_selfplay_games > 1) {
+          myprintf("Nonsensical options: lczero loses deterministic property "
+                   "of the random seed when playing several games at once.\n");
+          exit(EXIT_FAILURE);
+        }
+
         if (cfg_num_threads > 1) {
             cfg_num_threads = 1;
             myprintf("Using rng seed from cli, activating single thread mode!\n");
@@ -216,6 +350,12 @@ static std::string parse_commandline(int argc, char *argv[]) {
         myprintf("RNG seed from cli: %llu\n", cfg_rng_seed);
     }
 
+    if (cfg_num_threads * cfg_selfplay_games > Utils::ThreadPool::MAX_THREADS) {
+        myprintf("Nonsensical options: Threads times self-play games "
+                 "must be at most %d.\n", Utils::ThreadPool::MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+
     if (vm.count("uci")) {
         cfg_noinitialize = true;
     }
@@ -275,7 +415,46 @@ static std::string parse_commandline(int argc, char *argv[]) {
     if (vm.count("tune-only")) {
         cfg_tune_only = true;
     }
+
+    if (vm.count("tuning-db")) {
+        cfg_tuning_db = vm["tuning-db"].as<std::string>();
+    }
+
+    if (vm.count("half")) {
+        cfg_use_half = true;
+    }
+
+    if (vm.count("cpu-workers")) {
+        cfg_cpu_workers = vm["cpu-workers"].as<int>();
+        if (cfg_cpu_workers < 0) {
+            myprintf("Nonsensical options: CPU workers must be at least 0.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("gpu-contexts")) {
+        cfg_gpu_contexts = vm["gpu-contexts"].as<int>();
+        if (cfg_gpu_contexts < 1) {
+            myprintf("Nonsensical options: GPU contexts must be at least 1.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("opencl-profile")) {
+        cfg_opencl_profile = true;
+    }
+#else
+    if (vm.count("int8")) {
+        cfg_int8 = true;
+    }
 #endif
+    if (vm.count("winograd")) {
+        cfg_winograd = vm["winograd"].as<int>();
+        if (cfg_winograd != 2 && cfg_winograd != 4) {
+            myprintf("Nonsensical options: Winograd tile must be 2 or 4.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     std::string start = "";
     if (vm.count("start")) {
@@ -336,30 +515,7 @@ void generate_supervised_data(const std::string& filename) {
     fs::create_directories(dir);
     myprintf_so("Created dirs %s\n", dir.string().c_str());
   }
-  auto chunker = OutputChunker{dir.string() + "/training", true, 15000};
-
-  std::ifstream f;
-  f.open(filename);
-
-  PGNParser parser(f);
-  int games = 0;
-  for (;;) {
-    Training::clear_training();
-    auto game = parser.parse();
-    if (game == nullptr) {
-      myprintf_so("Invalid game in %s\n", filename.c_str());
-      break;
-    }
-    myprintf_so("\rProcessed %d games", ++games);
-    BoardHistory bh;
-    bh.set(Position::StartFEN);
-    for (int i = 0; i < static_cast<int>(game->bh.positions.size()) - 1; ++i) {
-      Move move = game->bh.positions[i + 1].get_move();
-      Training::record(bh, move);
-      bh.do_move(move);
-    }
-    Training::dump_training(game->result, chunker);
-  }
+  Training::dump_supervised(filename, dir.string() + "/training");
 }
 
 int main(int argc, char* argv[]) {
@@ -382,9 +538,21 @@ int main(int argc, char* argv[]) {
 #ifndef WIN32
   setbuf(stdin, nullptr);
 #endif
-  thread_pool.initialize(cfg_num_threads);
+  // Every self-play game searches with its own pool threads.
+  for (auto i = 0; i < cfg_num_threads * cfg_selfplay_games; i++) {
+      thread_pool.add_thread([] { SMP::pin_thread(); });
+  }
+  NNCache::get_NNCache().set_size_mb(cfg_cache_mb);
   // Random::GetRng().seedrandom(cfg_rng_seed);
-  if (!cfg_noinitialize) {
+  if (!cfg_convert_weights.empty()) {
+      auto ok = Network::convert_network_file(cfg_weightsfile,
+                                              cfg_convert_weights);
+      return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (!cfg_supervise.empty() && cfg_weightsfile.empty()) {
+      // Supervised data needs the input format of a network, not its weights.
+      Network::set_format_version(2);
+  } else if (!cfg_noinitialize) {
       Network::initialize();
   }
 
@@ -394,6 +562,7 @@ int main(int argc, char* argv[]) {
   }
 
   Tablebases::init(cfg_syzygypath);
+  TBProbeService::get_TBProbeService().set_threads(cfg_syzygythreads);
   UCI::init(Options);
   UCI::loop(uci_start);
 
@@ -1,92 +1,224 @@
 #include "pgn.h"
 
 #include <boost/optional.hpp>
+#include <cstring>
 #include <istream>
+#include <vector>
 
-PGNParser::PGNParser(std::istream& is)
-  : is_(is) {
-}
+namespace {
 
-boost::optional<int> parse_result(const std::string& result) {
-  if (result == "1-0") {
+boost::optional<int> parse_result(const char* result, size_t len) {
+  if (len == 3 && !strncmp(result, "1-0", 3)) {
     return 1;
-  } else if (result == "0-1") {
+  } else if (len == 3 && !strncmp(result, "0-1", 3)) {
     return -1;
-  } else if (result == "1/2-1/2") {
+  } else if (len == 7 && !strncmp(result, "1/2-1/2", 7)) {
     return 0;
   }
   return boost::none;
 }
 
-std::unique_ptr<PGNGame> PGNParser::parse() {
-  // Skip all the PGN headers
-  std::string s;
-  std::string result;
-  const std::string kResultToken = "[Result \"";
-  for (;;) {
-    getline(is_, s);
-    if (s.substr(0, kResultToken.size()) == kResultToken) {
-      result = s.substr(kResultToken.size(), s.size() - kResultToken.size() - 2);
-    }
-    if (s.empty()) {
-      break;
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+const char* skip_space(const char* p, const char* end) {
+  while (p < end && is_space(*p)) {
+    ++p;
+  }
+  return p;
+}
+
+// Skips past the first c, or to the end.
+const char* skip_past(const char* p, const char* end, char c) {
+  p = static_cast<const char*>(memchr(p, c, end - p));
+  return p ? p + 1 : end;
+}
+
+// Skips a recursive annotation variation, p points at the '('.
+const char* skip_variation(const char* p, const char* end) {
+  auto depth = 0;
+  for (; p < end; ++p) {
+    if (*p == '{') {
+      p = skip_past(p, end, '}') - 1;
+    } else if (*p == '(') {
+      ++depth;
+    } else if (*p == ')' && --depth == 0) {
+      return p + 1;
     }
   }
+  return end;
+}
 
-  if (is_.eof()) {
-    return nullptr;
+}  // namespace
+
+std::unique_ptr<PGNGame> parse_pgn_game(const PGNSpan& span) {
+  auto p = span.begin;
+  auto end = span.end;
+
+  // Only the result is needed from the tag pairs
+  const char* result = nullptr;
+  auto result_len = size_t{0};
+  const auto kResultTag = "[Result \"";
+  const auto kResultTagLen = strlen(kResultTag);
+  for (p = skip_space(p, end); p < end && *p == '['; p = skip_space(p, end)) {
+    auto eol = skip_past(p, end, '\n');
+    if (size_t(eol - p) > kResultTagLen && !strncmp(p, kResultTag, kResultTagLen)) {
+      auto quote = static_cast<const char*>(memchr(p + kResultTagLen, '"', eol - p - kResultTagLen));
+      if (quote) {
+        result = p + kResultTagLen;
+        result_len = quote - result;
+      }
+    }
+    p = eol;
   }
 
   std::unique_ptr<PGNGame> game(new PGNGame);
   game->bh.set(Position::StartFEN);
 
-  auto game_result = parse_result(result);
+  auto game_result = result ? parse_result(result, result_len) : boost::none;
   if (game_result) {
     game->result = game_result.get();
   } else {
-    throw std::runtime_error("Unknown result: " + result);
+    throw std::runtime_error("Unknown result: " + (result ? std::string(result, result_len) : ""));
   }
 
-  // Read in the moves
-  for (int i = 0;;) {
-    is_ >> s;
-    if (!is_.good() || s.empty() || s == "[Event" || parse_result(s)) {
+  // Find the moves first, so that the history is allocated only once
+  std::vector<PGNSpan> moves;
+  while ((p = skip_space(p, end)) < end) {
+    // Skip comments, variations and annotation glyphs
+    if (*p == '{') {
+      p = skip_past(p, end, '}');
+      continue;
+    } else if (*p == ';') {
+      p = skip_past(p, end, '\n');
+      continue;
+    } else if (*p == '(') {
+      p = skip_variation(p, end);
+      continue;
+    } else if (*p == '[') {
       break;
     }
-
-    // Skip comments
-    if (s.front() == '{' || s.front() == '[' || s.back() == '}' || s.back() == ']') {
+    auto token = p;
+    while (p < end && !is_space(*p) && !strchr("{}();[", *p)) {
+      ++p;
+    }
+    if (p == token) {
+      // A stray closing bracket
+      ++p;
       continue;
     }
-
-    // Skip the move numbers
-    if (s.back() == '.') {
+    if (*token == '$') {
       continue;
     }
+    if (*token == '*' || parse_result(token, p - token)) {
+      break;
+    }
 
-    // Drop annotations
-    if (s.back() == '!' || s.back() == '?') {
-      size_t len = s.length();
-      auto backIt = s.end();
-      backIt--;
-      while (*backIt == '!' || *backIt == '?') {
-        backIt--;
-        len--;
+    // Skip the move numbers, also when the move follows without a space
+    auto digits = token;
+    while (digits < p && *digits >= '0' && *digits <= '9') {
+      ++digits;
+    }
+    if (digits > token && digits < p && *digits == '.') {
+      token = digits;
+      while (token < p && *token == '.') {
+        ++token;
+      }
+      if (token == p) {
+        continue;
       }
-      s = s.substr(0, len);
     }
 
-    ++i;
-    Move m = game->bh.cur().san_to_move(s);
+    moves.push_back(PGNSpan{token, p});
+  }
+
+  game->bh.positions.reserve(moves.size() + 1);
+  game->bh.states.reserve(moves.size() + 1);
+  for (const auto& move : moves) {
+    Move m = game->bh.cur().san_to_move(move.begin, move.end - move.begin);
     if (m == MOVE_NONE) {
-      throw std::runtime_error("Unable to parse pgn move " + s);
+      throw std::runtime_error("Unable to parse pgn move " + std::string(move.begin, move.end));
     }
     game->bh.do_move(m);
   }
 
-  // Read the empty line after the game
-  getline(is_, s);
-  getline(is_, s);
-
   return game;
 }
+
+PGNTokenizer::PGNTokenizer(const char* data, size_t size)
+  : cur_(data), end_(data + size) {
+}
+
+bool PGNTokenizer::next(PGNSpan& span) {
+  cur_ = skip_space(cur_, end_);
+  if (cur_ == end_) {
+    return false;
+  }
+  span.begin = cur_;
+  auto in_moves = false;
+  auto in_comment = false;
+  auto p = cur_;
+  while (p < end_) {
+    if (*p == '[' && in_moves && !in_comment) {
+      break;
+    }
+    auto eol = skip_past(p, end_, '\n');
+    if (!in_comment && *p == '[') {
+      p = eol;
+      continue;
+    }
+    // Brace comments can span lines and start a line with a '['
+    for (; p < eol; ++p) {
+      if (*p == '{') {
+        in_comment = true;
+      } else if (*p == '}') {
+        in_comment = false;
+      } else if (!is_space(*p)) {
+        in_moves = true;
+      }
+    }
+  }
+  span.end = p;
+  cur_ = p;
+  return true;
+}
+
+PGNParser::PGNParser(std::istream& is)
+  : is_(is) {
+}
+
+std::unique_ptr<PGNGame> PGNParser::parse() {
+  // Collect the tag pairs and the movetext, which both end at an empty line
+  std::string text;
+  std::string s;
+  auto in_moves = false;
+  while (getline(is_, s)) {
+    if (s.find_first_not_of(" \t\r") == std::string::npos) {
+      if (in_moves) {
+        break;
+      }
+      continue;
+    }
+    in_moves |= s.front() != '[';
+    text += s;
+    text += '\n';
+  }
+
+  if (!in_moves) {
+    return nullptr;
+  }
+  return parse_pgn_game(PGNSpan{text.data(), text.data() + text.size()});
+}
+
+PGNFile::PGNFile(const std::string& filename)
+  : file_(filename), tokenizer_(file_.data(), file_.size()) {
+}
+
+std::unique_ptr<PGNGame> PGNFile::parse() {
+  PGNSpan span;
+  if (!next(span)) {
+    return nullptr;
+  }
+  return parse_pgn_game(span);
+}
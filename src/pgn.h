@@ -1,5 +1,6 @@
 #pragma once
 
+#include "MappedFile.h"
 #include "Position.h"
 
 struct PGNGame {
@@ -7,6 +8,31 @@ struct PGNGame {
   int result;
 };
 
+// The text of one game, the tag pairs and the movetext, inside a bigger
+// buffer.
+struct PGNSpan {
+  const char* begin;
+  const char* end;
+};
+
+// Parses the game in a span. Throws std::runtime_error on an unknown result
+// or a move that is not legal.
+std::unique_ptr<PGNGame> parse_pgn_game(const PGNSpan& span);
+
+// Splits PGN text into games without copying it. A game ends where the tag
+// pairs of the next one start.
+class PGNTokenizer {
+ public:
+  PGNTokenizer(const char* data, size_t size);
+
+  // Finds the next game, returns false at the end of the text.
+  bool next(PGNSpan& span);
+
+ private:
+  const char* cur_;
+  const char* end_;
+};
+
 class PGNParser {
  public:
   PGNParser(std::istream& is);
@@ -16,3 +42,19 @@ class PGNParser {
  private:
   std::istream& is_;
 };
+
+// Reads the games of a PGN file through a memory map. The spans stay valid
+// as long as the PGNFile does, so they can be parsed on other threads.
+class PGNFile {
+ public:
+  PGNFile(const std::string& filename);
+
+  // False if the file could not be opened or is empty.
+  bool is_open() const { return file_.data() != nullptr; }
+  bool next(PGNSpan& span) { return tokenizer_.next(span); }
+  std::unique_ptr<PGNGame> parse();
+
+ private:
+  MappedFile file_;
+  PGNTokenizer tokenizer_;
+};
@@ -30,7 +30,10 @@
 
 #include "../Bitboard.h"
 #include "../Movegen.h"
+#include "../Parameters.h"
 #include "../Position.h"
+#include "../TBCache.h"
+#include "../TBProbeService.h"
 #include "../UCTSearch.h"
 #include "../thread_win32.h"
 #include "../Types.h"
@@ -265,6 +268,19 @@ public:
         return data + 4; // Skip Magics's header
     }
 
+    // Ask the OS to read a mapped file into memory in the background, so
+    // that the first probes don't wait for the disk.
+    static void prefetch(void* baseAddress, uint64_t mapping) {
+
+#ifndef _WIN32
+        madvise(baseAddress, mapping, MADV_WILLNEED);
+#else
+        // The mapping is made, the pages are read at first access.
+        (void)baseAddress;
+        (void)mapping;
+#endif
+    }
+
     static void unmap(void* baseAddress, uint64_t mapping) {
 
 #ifndef _WIN32
@@ -393,6 +409,7 @@ class TBTables {
 
     std::deque<TBTable<WDL>> wdlTable;
     std::deque<TBTable<DTZ>> dtzTable;
+    std::vector<std::string> codes; // Like "KRvK", for every wdlTable entry
     size_t m_dtzsize{0};
 
     void insert(Key key, TBTable<WDL>* wdl, TBTable<DTZ>* dtz) {
@@ -421,11 +438,13 @@ public:
         memset(hashTable, 0, sizeof(hashTable));
         wdlTable.clear();
         dtzTable.clear();
+        codes.clear();
         m_dtzsize = size_t{0};
     }
     size_t size() const { return wdlTable.size(); }
     size_t dtz_size() const { return m_dtzsize; }
     void add(const std::vector<PieceType>& pieces);
+    void prefetch();
 };
 
 TBTables TBTables;
@@ -454,6 +473,7 @@ void TBTables::add(const std::vector<PieceType>& pieces) {
 
     MaxCardinality = std::max((int)pieces.size(), MaxCardinality);
 
+    codes.push_back(code);
     wdlTable.emplace_back(code);
     dtzTable.emplace_back(wdlTable.back());
 
@@ -1119,6 +1139,21 @@ void* mapped(TBTable<Type>& e, const Position& pos) {
     return e.baseAddress;
 }
 
+// Memory map all WDL files at init time instead of at first access, and
+// start reading them in.
+void TBTables::prefetch() {
+
+    for (const auto& code : codes) {
+        StateInfo st;
+        Position pos;
+        pos.set(code, WHITE, &st);
+
+        TBTable<WDL>* entry = get<WDL>(pos.material_key());
+        if (mapped(*entry, pos))
+            TBFile::prefetch(entry->baseAddress, entry->mapping);
+    }
+}
+
 template<TBType Type, typename Ret = typename TBTable<Type>::Ret>
 Ret probe_table(const Position& pos, ProbeState* result, WDLScore wdl = WDLDraw) {
 
@@ -1216,6 +1251,9 @@ WDLScore search(Position& pos, ProbeState* result) {
 /// safe, nor it needs to be.
 void Tablebases::init(const std::string& paths) {
 
+    // No probes may run while the tables change.
+    TBProbeService::get_TBProbeService().clear();
+    TBCache::get_TBCache().clear();
     TBTables.clear();
     MaxCardinality = 0;
     TBFile::Paths = paths;
@@ -1345,6 +1383,11 @@ void Tablebases::init(const std::string& paths) {
     }
     Utils::myprintf("info string Found %d wdl tablebases\n", TBTables.size());
     Utils::myprintf("info string Found %d dtz tablebases\n", TBTables.dtz_size());
+
+    if (cfg_syzygyprefetch) {
+        TBTables.prefetch();
+        Utils::myprintf("info string Prefetching wdl tablebases\n");
+    }
 }
 
 // Probe the WDL table for a particular position.
@@ -1453,7 +1496,7 @@ int Tablebases::probe_dtz(Position& pos, ProbeState* result) {
 // Use the DTZ tables to rank root moves.
 //
 // A return value false indicates that not all probes were successful.
-bool Tablebases::root_probe(Position& pos, const std::vector<UCTNode::node_ptr_t>& rootMoves) {
+bool Tablebases::root_probe(Position& pos, std::vector<UCTEdge>& rootMoves) {
 
     ProbeState result;
     StateInfo st;
@@ -1472,7 +1515,7 @@ bool Tablebases::root_probe(Position& pos, const std::vector<UCTNode::node_ptr_t
     // Probe and rank each move
     for (auto& m : rootMoves)
     {
-        pos.do_move(m->get_move(), st);
+        pos.do_move(m.get_move(), st);
 
         // Calculate dtz for the current move counting from the root position
         if (pos.rule50_count() == 0)
@@ -1495,7 +1538,7 @@ bool Tablebases::root_probe(Position& pos, const std::vector<UCTNode::node_ptr_t
             && MoveList<LEGAL>(pos).size() == 0)
             dtz = 1;
 
-        pos.undo_move(m->get_move());
+        pos.undo_move(m.get_move());
 
         if (result == FAIL)
             return false;
@@ -1512,7 +1555,7 @@ bool Tablebases::root_probe(Position& pos, const std::vector<UCTNode::node_ptr_t
     int counter = 0;
     for (auto& m : rootMoves)
     {
-        m->set_active(ranks[counter] == best_rank);
+        m.set_active(ranks[counter] == best_rank);
         counter++;
     }
 
@@ -1524,7 +1567,7 @@ bool Tablebases::root_probe(Position& pos, const std::vector<UCTNode::node_ptr_t
 // This is a fallback for the case that some or all DTZ tables are missing.
 //
 // A return value false indicates that not all probes were successful.
-bool Tablebases::root_probe_wdl(Position& pos, const std::vector<UCTNode::node_ptr_t>& rootMoves) {
+bool Tablebases::root_probe_wdl(Position& pos, std::vector<UCTEdge>& rootMoves) {
 
     static const int WDL_to_rank[] = { -1000, -899, 0, 899, 1000 };
 
@@ -1537,11 +1580,11 @@ bool Tablebases::root_probe_wdl(Position& pos, const std::vector<UCTNode::node_p
     // Probe and rank each move
     for (auto& m : rootMoves)
     {
-        pos.do_move(m->get_move(), st);
+        pos.do_move(m.get_move(), st);
 
         WDLScore wdl = -probe_wdl(pos, &result);
 
-        pos.undo_move(m->get_move());
+        pos.undo_move(m.get_move());
 
         if (result == FAIL)
             return false;
@@ -1554,7 +1597,7 @@ bool Tablebases::root_probe_wdl(Position& pos, const std::vector<UCTNode::node_p
     int counter = 0;
     for (auto& m : rootMoves)
     {
-        m->set_active(ranks[counter] == best_rank);
+        m.set_active(ranks[counter] == best_rank);
         counter++;
     }
 
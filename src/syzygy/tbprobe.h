@@ -49,8 +49,8 @@ extern int MaxCardinality;
 void init(const std::string& paths);
 WDLScore probe_wdl(Position& pos, ProbeState* result);
 int probe_dtz(Position& pos, ProbeState* result);
-bool root_probe(Position& pos, const std::vector<UCTNode::node_ptr_t>& children);
-bool root_probe_wdl(Position& pos, const std::vector<UCTNode::node_ptr_t>& children);
+bool root_probe(Position& pos, std::vector<UCTEdge>& children);
+bool root_probe_wdl(Position& pos, std::vector<UCTEdge>& children);
 //void rank_root_moves(Position& pos, Search::RootMoves& rootMoves);
 
 inline std::ostream& operator<<(std::ostream& os, const WDLScore v) {
@@ -0,0 +1,236 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "CPUKernels.h"
+#include "Network.h"
+#include "Random.h"
+
+// Every vectorized kernel the CPU supports must match the scalar ones.
+class CPUKernelsTest: public ::testing::Test {
+protected:
+  void TearDown() override {
+    CPUKernels::set_isa(CPUKernels::get_best_isa());
+  }
+
+  static std::vector<float> random_data(size_t size) {
+    auto rng = Random{42};
+    auto data = std::vector<float>(size);
+    for (auto& x : data) {
+      x = rng.RandFlt(2.0f) - 1.0f;
+    }
+    return data;
+  }
+
+  static std::vector<CPUKernels::Isa> vector_isas() {
+    auto isas = std::vector<CPUKernels::Isa>{};
+    for (auto isa : {CPUKernels::Isa::AVX2, CPUKernels::Isa::AVX512,
+                     CPUKernels::Isa::AVX512VNNI}) {
+      if (isa <= CPUKernels::get_best_isa()) {
+        isas.emplace_back(isa);
+      }
+    }
+    return isas;
+  }
+};
+
+TEST_F(CPUKernelsTest, WinogradTransformInMatchesScalar) {
+  constexpr auto C = 24;
+  auto in = random_data(C * 64);
+  auto ref = std::vector<float>(16 * C * 16);
+  CPUKernels::set_isa(CPUKernels::Isa::Scalar);
+  CPUKernels::winograd_transform_in(in.data(), ref.data(), C);
+  for (auto isa : vector_isas()) {
+    CPUKernels::set_isa(isa);
+    auto V = std::vector<float>(ref.size());
+    CPUKernels::winograd_transform_in(in.data(), V.data(), C);
+    for (auto i = size_t{0}; i < V.size(); i++) {
+      ASSERT_NEAR(V[i], ref[i], 1e-5f) << CPUKernels::get_isa_name(isa) << " " << i;
+    }
+  }
+}
+
+TEST_F(CPUKernelsTest, WinogradTransformOutMatchesScalar) {
+  constexpr auto K = 24;
+  auto M = random_data(16 * K * 16);
+  auto ref = std::vector<float>(K * 64);
+  CPUKernels::set_isa(CPUKernels::Isa::Scalar);
+  CPUKernels::winograd_transform_out(M.data(), ref.data(), K);
+  for (auto isa : vector_isas()) {
+    CPUKernels::set_isa(isa);
+    auto Y = std::vector<float>(ref.size());
+    CPUKernels::winograd_transform_out(M.data(), Y.data(), K);
+    for (auto i = size_t{0}; i < Y.size(); i++) {
+      ASSERT_NEAR(Y[i], ref[i], 1e-5f) << CPUKernels::get_isa_name(isa) << " " << i;
+    }
+  }
+}
+
+TEST_F(CPUKernelsTest, BiasReluMatchesScalar) {
+  constexpr auto channels = 8;
+  // Not a multiple of the vector width, to cover the remainder.
+  constexpr auto spatial = 70;
+  auto data = random_data(channels * spatial);
+  auto res = random_data(channels * spatial);
+  auto biases = random_data(channels);
+  for (auto eltwise : {static_cast<const float*>(nullptr),
+                       static_cast<const float*>(res.data())}) {
+    auto ref = data;
+    CPUKernels::set_isa(CPUKernels::Isa::Scalar);
+    CPUKernels::bias_relu(channels, spatial, ref.data(), biases.data(), eltwise);
+    for (auto isa : vector_isas()) {
+      CPUKernels::set_isa(isa);
+      auto out = data;
+      CPUKernels::bias_relu(channels, spatial, out.data(), biases.data(), eltwise);
+      for (auto i = size_t{0}; i < out.size(); i++) {
+        ASSERT_FLOAT_EQ(out[i], ref[i]) << CPUKernels::get_isa_name(isa) << " " << i;
+        ASSERT_GE(out[i], 0.0f);
+      }
+    }
+  }
+}
+
+TEST_F(CPUKernelsTest, AddBiasMatchesScalar) {
+  constexpr auto outputs = 1858;
+  auto data = random_data(outputs);
+  auto biases = random_data(outputs);
+  for (auto relu : {false, true}) {
+    auto ref = data;
+    CPUKernels::set_isa(CPUKernels::Isa::Scalar);
+    CPUKernels::add_bias(outputs, ref.data(), biases.data(), relu);
+    for (auto isa : vector_isas()) {
+      CPUKernels::set_isa(isa);
+      auto out = data;
+      CPUKernels::add_bias(outputs, out.data(), biases.data(), relu);
+      for (auto i = size_t{0}; i < out.size(); i++) {
+        ASSERT_FLOAT_EQ(out[i], ref[i]) << CPUKernels::get_isa_name(isa) << " " << i;
+      }
+    }
+  }
+}
+
+TEST_F(CPUKernelsTest, Int8GemmMatchesScalar) {
+  // Not a multiple of any row block, to cover the remainder.
+  constexpr auto M = 13;
+  constexpr auto N = 128;
+  constexpr auto K4 = 9;
+  auto rng = Random{42};
+  auto A = std::vector<int8_t>(M * K4 * 4);
+  for (auto& a : A) {
+    a = static_cast<int8_t>(rng.RandInt(255) - 127);
+  }
+  auto B = std::vector<uint8_t>(K4 * 4 * N);
+  for (auto& b : B) {
+    b = static_cast<uint8_t>(rng.RandInt(256));
+  }
+  // The largest sums there can be.
+  for (auto k = 0; k < K4; k++) {
+    for (auto i = 0; i < 4; i++) {
+      A[k * 4 + i] = -127;
+      B[k * N * 4 + i] = 255;
+    }
+  }
+  auto scales = random_data(M);
+  auto ref = std::vector<float>(M * N);
+  CPUKernels::set_isa(CPUKernels::Isa::Scalar);
+  CPUKernels::int8_gemm(M, N, K4, A.data(), B.data(), scales.data(), ref.data());
+  ASSERT_FLOAT_EQ(ref[0], scales[0] * (-127 * 255 * K4 * 4));
+  for (auto isa : vector_isas()) {
+    CPUKernels::set_isa(isa);
+    auto C = std::vector<float>(ref.size());
+    CPUKernels::int8_gemm(M, N, K4, A.data(), B.data(), scales.data(), C.data());
+    for (auto i = size_t{0}; i < C.size(); i++) {
+      ASSERT_FLOAT_EQ(C[i], ref[i]) << CPUKernels::get_isa_name(isa) << " " << i;
+    }
+  }
+}
+
+TEST_F(CPUKernelsTest, PuctScoresMatchScalar) {
+  // Not a multiple of eight, to cover the remainder.
+  constexpr auto count = 37;
+  auto rng = Random{42};
+  auto prior = random_data(count);
+  auto visits = std::vector<float>(count);
+  auto virtual_loss = std::vector<float>(count);
+  auto white_wins = std::vector<float>(count);
+  for (auto i = 0; i < count; i++) {
+    prior[i] = prior[i] * 0.5f + 0.5f;
+    // Some unvisited children, one of them with a virtual loss.
+    visits[i] = i % 5 ? rng.RandInt(100) + 1 : 0;
+    virtual_loss[i] = i % 3 ? 0 : 3;
+    white_wins[i] = visits[i] * rng.RandFlt(1.0f);
+  }
+  for (auto white : {false, true}) {
+    auto ref = std::vector<float>(count);
+    CPUKernels::set_isa(CPUKernels::Isa::Scalar);
+    CPUKernels::puct_scores(count, prior.data(), visits.data(),
+                            virtual_loss.data(), white_wins.data(), white,
+                            0.3f, 8.5f, ref.data());
+    ASSERT_FLOAT_EQ(ref[0], 0.3f + 8.5f * prior[0]);
+    for (auto isa : vector_isas()) {
+      CPUKernels::set_isa(isa);
+      auto scores = std::vector<float>(count);
+      CPUKernels::puct_scores(count, prior.data(), visits.data(),
+                              virtual_loss.data(), white_wins.data(), white,
+                              0.3f, 8.5f, scores.data());
+      for (auto i = size_t{0}; i < scores.size(); i++) {
+        ASSERT_FLOAT_EQ(scores[i], ref[i]) << CPUKernels::get_isa_name(isa) << " " << i;
+      }
+    }
+  }
+}
+
+TEST_F(CPUKernelsTest, Winograd4MatchesDirectConvolution) {
+  // Not a multiple of the tiles the transforms do at a time.
+  constexpr auto C = 20;
+  constexpr auto K = 5;
+  constexpr auto P = 4;
+  constexpr auto alpha = Network::WINOGRAD4_ALPHA;
+  auto in = random_data(C * 64);
+  auto f = random_data(K * C * 9);
+
+  auto ref = std::vector<float>(K * 64);
+  for (auto k = 0; k < K; k++) {
+    for (auto y = 0; y < 8; y++) {
+      for (auto x = 0; x < 8; x++) {
+        auto sum = 0.0f;
+        for (auto c = 0; c < C; c++) {
+          for (auto dy = 0; dy < 3; dy++) {
+            for (auto dx = 0; dx < 3; dx++) {
+              const auto iy = y + dy - 1;
+              const auto ix = x + dx - 1;
+              if (iy >= 0 && iy < 8 && ix >= 0 && ix < 8) {
+                sum += f[(k * C + c) * 9 + dy * 3 + dx] * in[c * 64 + iy * 8 + ix];
+              }
+            }
+          }
+        }
+        ref[k * 64 + y * 8 + x] = sum;
+      }
+    }
+  }
+
+  const auto U = Network::winograd4_transform_f(f, K, C);
+  ASSERT_EQ(U.size(), size_t{alpha * alpha * K * C});
+
+  auto V = std::vector<float>(alpha * alpha * C * P);
+  CPUKernels::winograd4_transform_in(in.data(), V.data(), C);
+  auto M = std::vector<float>(alpha * alpha * K * P);
+  for (auto e = 0; e < alpha * alpha; e++) {
+    for (auto k = 0; k < K; k++) {
+      for (auto t = 0; t < P; t++) {
+        auto acc = 0.0f;
+        for (auto c = 0; c < C; c++) {
+          acc += U[(e * C + c) * K + k] * V[(e * C + c) * P + t];
+        }
+        M[(e * K + k) * P + t] = acc;
+      }
+    }
+  }
+  auto Y = std::vector<float>(K * 64);
+  CPUKernels::winograd4_transform_out(M.data(), Y.data(), K);
+  for (auto i = size_t{0}; i < Y.size(); i++) {
+    ASSERT_NEAR(Y[i], ref[i], 1e-4f) << i;
+  }
+}
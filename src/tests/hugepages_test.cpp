@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <utility>
+
+#include "HugePages.h"
+
+namespace {
+  // Whether all of the memory is zero, writing to every page of it on the
+  // way.
+  bool zeroed_and_writable(const HugePages& pages) {
+    auto data = pages.data();
+    auto zeroed = true;
+    for (auto i = size_t{0}; i < pages.size(); i += 4096) {
+      zeroed &= data[i] == 0;
+      data[i] = 1;
+    }
+    zeroed &= data[pages.size() - 1] == 0;
+    data[pages.size() - 1] = 1;
+    return zeroed;
+  }
+}
+
+TEST(HugePagesTest, SmallAllocationsUseNormalPages) {
+  const auto total = HugePages::get_total_bytes();
+  const auto huge = HugePages::get_huge_bytes();
+  {
+    auto pages = HugePages{HugePages::HUGE_PAGE_SIZE - 1};
+    ASSERT_NE(pages.data(), nullptr);
+    EXPECT_EQ(pages.kind(), HugePages::Kind::NORMAL);
+    EXPECT_TRUE(zeroed_and_writable(pages));
+    EXPECT_EQ(HugePages::get_total_bytes(), total + HugePages::HUGE_PAGE_SIZE - 1);
+    EXPECT_EQ(HugePages::get_huge_bytes(), huge);
+  }
+  EXPECT_EQ(HugePages::get_total_bytes(), total);
+}
+
+TEST(HugePagesTest, LargeAllocationsFallBackToWhatThereIs) {
+  // Without reserved huge pages, as on most machines, this gets transparent
+  // or normal ones. Whichever it is, the memory has to work.
+  const auto total = HugePages::get_total_bytes();
+  const auto huge = HugePages::get_huge_bytes();
+  const auto size = 3 * HugePages::HUGE_PAGE_SIZE + 100;
+  {
+    auto pages = HugePages{size};
+    ASSERT_NE(pages.data(), nullptr);
+    EXPECT_EQ(pages.size(), size);
+    EXPECT_TRUE(zeroed_and_writable(pages));
+    const auto is_huge = pages.kind() != HugePages::Kind::NORMAL;
+    if (is_huge) {
+      EXPECT_EQ(reinterpret_cast<std::uintptr_t>(pages.data())
+                % HugePages::HUGE_PAGE_SIZE, 0u);
+    }
+    EXPECT_EQ(HugePages::get_total_bytes(), total + size);
+    EXPECT_EQ(HugePages::get_huge_bytes(), huge + (is_huge ? size : 0));
+  }
+  EXPECT_EQ(HugePages::get_total_bytes(), total);
+  EXPECT_EQ(HugePages::get_huge_bytes(), huge);
+}
+
+TEST(HugePagesTest, MovesHandOverTheMemory) {
+  const auto total = HugePages::get_total_bytes();
+  const auto size = 2 * HugePages::HUGE_PAGE_SIZE;
+  auto pages = HugePages{size};
+  const auto data = pages.data();
+  const auto kind = pages.kind();
+  data[42] = 7;
+
+  auto moved = HugePages{std::move(pages)};
+  EXPECT_EQ(pages.data(), nullptr);
+  EXPECT_EQ(pages.size(), 0u);
+  EXPECT_EQ(moved.data(), data);
+  EXPECT_EQ(moved.size(), size);
+  EXPECT_EQ(moved.kind(), kind);
+  EXPECT_EQ(moved.data()[42], 7);
+  EXPECT_EQ(HugePages::get_total_bytes(), total + size);
+
+  // Assigning frees what the target had.
+  auto other = HugePages{1000};
+  EXPECT_EQ(HugePages::get_total_bytes(), total + size + 1000);
+  other = std::move(moved);
+  EXPECT_EQ(moved.data(), nullptr);
+  EXPECT_EQ(other.data(), data);
+  EXPECT_EQ(HugePages::get_total_bytes(), total + size);
+
+  auto& self = other;
+  other = std::move(self);
+  EXPECT_EQ(other.data(), data);
+
+  other = HugePages{};
+  EXPECT_EQ(other.data(), nullptr);
+  EXPECT_EQ(HugePages::get_total_bytes(), total);
+}
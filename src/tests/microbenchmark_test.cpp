@@ -0,0 +1,199 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Bitboard.h"
+#include "Movegen.h"
+#include "NNCache.h"
+#include "Network.h"
+#include "Position.h"
+#include "Random.h"
+#include "UCTNode.h"
+#include "serialized_tree.h"
+
+// Benchmarks of the hot paths of the search for local runs, as a baseline
+// for optimizations. Enable with
+// --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*
+class MicroBenchmark: public ::testing::Test {
+protected:
+  static void SetUpTestCase() {
+    Bitboards::init();
+    Position::init();
+  }
+
+  // 1, 2, 4, ... threads up to the number of CPUs.
+  static std::vector<int> thread_counts() {
+    const auto cpus = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    auto counts = std::vector<int>{};
+    for (auto threads = 1; threads < cpus; threads *= 2) {
+      counts.push_back(threads);
+    }
+    counts.push_back(cpus);
+    return counts;
+  }
+
+  // Runs op(thread, i) for i < ops in each of threads threads and returns
+  // the wall clock time per op of a thread in ns.
+  template<typename Op>
+  static double time_threads(int threads, int ops, Op op) {
+    auto workers = std::vector<std::thread>{};
+    const auto start = std::chrono::steady_clock::now();
+    for (auto t = 0; t < threads; t++) {
+      workers.emplace_back([t, ops, &op] {
+        for (auto i = 0; i < ops; i++) {
+          op(t, i);
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+  }
+
+  template<typename Op>
+  static double time_ops(int ops, Op op) {
+    return time_threads(1, ops, [&op](int, int i) { op(i); });
+  }
+
+  // Prints the time per op and the throughput relative to one thread.
+  static void report(const std::string& name, int threads, double ns,
+                     double single_thread_ns) {
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::setw(3) << threads << " thread(s): "
+              << std::fixed << std::setprecision(1) << std::setw(8) << ns
+              << " ns/op, scaling " << std::setprecision(2)
+              << threads * single_thread_ns / ns << std::endl;
+  }
+};
+
+TEST_F(MicroBenchmark, DISABLED_NNCacheBenchmark) {
+  constexpr auto ENTRIES = 200'000;
+  constexpr auto OPS = 1'000'000;
+  auto& cache = NNCache::get_NNCache();
+  auto result = Network::Netresult{};
+  for (auto i = 0; i < 35; i++) {
+    result.first.emplace_back(1.0f / 35, Move(i + 1));
+  }
+  result.second = 0.5f;
+
+  auto single_thread_ns = 0.0;
+  for (auto threads : thread_counts()) {
+    cache.resize(ENTRIES);
+    auto rngs = std::vector<Random>{};
+    for (auto t = 0; t < threads; t++) {
+      rngs.emplace_back(t + 1);
+    }
+    // Twice as many positions as there is room for, like a long search.
+    auto ns = time_threads(threads, OPS, [&](int t, int) {
+      const auto hash = rngs[t].RandInt<std::uint64_t>(2 * ENTRIES);
+      auto found = Network::Netresult{};
+      if (!cache.lookup(hash, found)) {
+        cache.insert(hash, result);
+      }
+    });
+    if (threads == 1) {
+      single_thread_ns = ns;
+    }
+    report("NNCache lookup/insert", threads, ns, single_thread_ns);
+  }
+  cache.resize(ENTRIES);
+}
+
+TEST_F(MicroBenchmark, DISABLED_UCTSelectChildBenchmark) {
+  constexpr auto OPS = 1'000'000;
+  BoardHistory bh;
+  bh.set("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+  auto moves = std::vector<Move>{};
+  for (Move move : MoveList<LEGAL>(bh.cur())) {
+    moves.emplace_back(move);
+  }
+
+  // A root with 10000 visits and a child for every legal move, the last
+  // five of them unvisited.
+  auto tree = std::string{};
+  const auto visited = moves.size() - 5;
+  const auto prior = 1.0f / moves.size();
+  put_node(tree, 10000, 0.5f, moves.size());
+  for (auto i = size_t{0}; i < moves.size(); i++) {
+    put_child(tree, moves[i], prior, i < visited);
+  }
+  for (auto i = size_t{0}; i < visited; i++) {
+    put_node(tree, 10000 / visited, 0.4f + 0.2f * i / visited, 0);
+  }
+  auto data = tree.data();
+  auto root = UCTNode::deserialize(MOVE_NONE, data, data + tree.size());
+  ASSERT_TRUE(root);
+
+  auto single_thread_ns = 0.0;
+  for (auto threads : thread_counts()) {
+    auto ns = time_threads(threads, OPS, [&](int, int) {
+      auto index = size_t{0};
+      root->uct_select_child(WHITE, false, index);
+    });
+    if (threads == 1) {
+      single_thread_ns = ns;
+    }
+    report("uct_select_child", threads, ns, single_thread_ns);
+  }
+}
+
+TEST_F(MicroBenchmark, DISABLED_EncoderBenchmark) {
+  constexpr auto OPS = 100'000;
+  // A game long enough to fill the history.
+  auto rng = Random{1};
+  BoardHistory bh;
+  bh.set(Position::StartFEN);
+  for (auto ply = 0; ply < 40; ply++) {
+    auto moves = std::vector<Move>{};
+    for (Move move : MoveList<LEGAL>(bh.cur())) {
+      moves.emplace_back(move);
+    }
+    if (moves.empty()) {
+      break;
+    }
+    bh.do_move(moves[rng.RandInt(moves.size())]);
+  }
+  auto moves = std::vector<Move>{};
+  for (Move move : MoveList<LEGAL>(bh.cur())) {
+    moves.emplace_back(move);
+  }
+  ASSERT_FALSE(moves.empty());
+
+  auto parent = Network::NNPlanes{};
+  Network::gather_features(bh, parent);
+  auto planes = Network::NNPlanes{};
+  auto ns = time_ops(OPS, [&](int) {
+    Network::gather_features(bh, planes);
+  });
+  report("gather_features", 1, ns, ns);
+
+  // The child positions from the planes of their parent, as the search
+  // encodes them.
+  auto child = bh.shallow_clone();
+  ns = time_ops(OPS, [&](int i) {
+    child.do_move(moves[i % moves.size()]);
+    Network::gather_features(child, planes, &parent);
+    child.undo_move();
+  });
+  auto walk_ns = time_ops(OPS, [&](int i) {
+    child.do_move(moves[i % moves.size()]);
+    child.undo_move();
+  });
+  report("gather_features parent", 1, ns - walk_ns, ns - walk_ns);
+
+  auto sum = 0;
+  ns = time_ops(OPS, [&](int i) {
+    sum += Network::lookup(moves[i % moves.size()], i & 1 ? BLACK : WHITE);
+  });
+  report("Network::lookup", 1, ns, ns);
+  EXPECT_GT(sum, 0);
+}
@@ -1,11 +1,97 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "Bitboard.h"
+#include "Movegen.h"
+#include "Network.h"
+#include "Position.h"
+#include "Random.h"
+
 class NetworkTest: public ::testing::Test {
 public:
   NetworkTest() {
   }
+
+protected:
+  static void SetUpTestCase() {
+    Bitboards::init();
+    Position::init();
+  }
 };
 
 TEST_F(NetworkTest, Init) {
   EXPECT_EQ(1, 1);
 }
+
+TEST_F(NetworkTest, IncrementalFeaturesMatchFullEncoding) {
+  auto rng = Random{7};
+  for (auto game = 0; game < 4; game++) {
+    BoardHistory bh;
+    bh.set(Position::StartFEN);
+    Network::NNPlanes parent;
+    Network::gather_features(bh, parent);
+    // Long enough to cover captures, castling and repetitions.
+    for (auto ply = 0; ply < 60; ply++) {
+      auto moves = std::vector<Move>{};
+      for (Move move : MoveList<LEGAL>(bh.cur())) {
+        moves.emplace_back(move);
+      }
+      if (moves.empty()) {
+        break;
+      }
+      bh.do_move(moves[rng.RandInt(moves.size())]);
+
+      Network::NNPlanes full;
+      Network::gather_features(bh, full);
+      Network::NNPlanes incremental;
+      Network::gather_features(bh, incremental, &parent);
+      for (auto i = size_t{0}; i < full.bit.size(); i++) {
+        ASSERT_EQ(incremental.bit[i], full.bit[i]) << "ply " << ply << " plane " << i;
+      }
+      EXPECT_EQ(incremental.rule50_count, full.rule50_count);
+      EXPECT_EQ(incremental.move_count, full.move_count);
+      parent = full;
+    }
+  }
+}
+
+TEST_F(NetworkTest, MoveLookupIsDenseAndFlipsBlack) {
+  EXPECT_EQ(Network::lookup(make_move(SQ_A1, SQ_B1), WHITE), 0);
+  EXPECT_EQ(Network::lookup(make_move(SQ_A1, SQ_C2), WHITE), 9);
+  EXPECT_EQ(Network::lookup(make_move(SQ_E7, SQ_E5), BLACK),
+            Network::lookup(make_move(SQ_E2, SQ_E4), WHITE));
+  EXPECT_EQ(Network::lookup(make<PROMOTION>(SQ_A7, SQ_A8, KNIGHT), WHITE),
+            Network::lookup(make_move(SQ_A7, SQ_A8), WHITE));
+  EXPECT_EQ(Network::lookup(make<PROMOTION>(SQ_B2, SQ_A1, QUEEN), BLACK),
+            Network::lookup(make<PROMOTION>(SQ_B7, SQ_A8, QUEEN), WHITE));
+  EXPECT_EQ(Network::lookup(make<PROMOTION>(SQ_H7, SQ_H8, BISHOP), WHITE),
+            Network::V2_NUM_OUTPUT_POLICY - 1);
+  EXPECT_THROW(Network::lookup(make_move(SQ_A1, SQ_H2), WHITE),
+               std::out_of_range);
+
+  auto rng = Random{3};
+  for (auto game = 0; game < 8; game++) {
+    BoardHistory bh;
+    bh.set(Position::StartFEN);
+    for (auto ply = 0; ply < 150; ply++) {
+      auto indices = std::vector<int>{};
+      auto moves = std::vector<Move>{};
+      for (Move move : MoveList<LEGAL>(bh.cur())) {
+        auto index = Network::lookup(move, bh.cur().side_to_move());
+        ASSERT_GE(index, 0);
+        ASSERT_LT(index, int(Network::V2_NUM_OUTPUT_POLICY));
+        indices.emplace_back(index);
+        moves.emplace_back(move);
+      }
+      if (moves.empty()) {
+        break;
+      }
+      std::sort(begin(indices), end(indices));
+      EXPECT_EQ(std::unique(begin(indices), end(indices)), end(indices));
+      bh.do_move(moves[rng.RandInt(moves.size())]);
+    }
+  }
+}
@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "NNBatchQueue.h"
+#include "Network.h"
+#include "Parameters.h"
+
+constexpr auto POL_SIZE = 3;
+constexpr auto VAL_SIZE = 2;
+
+class NNBatchQueueTest: public ::testing::Test {
+protected:
+  void SetUp() override {
+    saved_threads = cfg_num_threads;
+    saved_batch_size = cfg_batch_size;
+  }
+
+  void TearDown() override {
+    cfg_num_threads = saved_threads;
+    cfg_batch_size = saved_batch_size;
+  }
+
+  // Policy j of a position is its rule50 count plus j, its values twice and
+  // three times that count. The first batch waits until all other callers
+  // are about to queue, so that they end up in the next batch together.
+  void evaluate(const std::vector<Network::NNPlanes>& input,
+                std::vector<float>& output_pol,
+                std::vector<float>& output_val, int batch_size) {
+    if (batches++ == 0) {
+      while (started < callers - 1) {
+        std::this_thread::yield();
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    ASSERT_EQ(input.size(), size_t(batch_size));
+    ASSERT_EQ(output_pol.size(), size_t(batch_size * POL_SIZE));
+    ASSERT_EQ(output_val.size(), size_t(batch_size * VAL_SIZE));
+    for (auto i = 0; i < batch_size; i++) {
+      const auto x = float(input[i].rule50_count);
+      for (auto j = 0; j < POL_SIZE; j++) {
+        output_pol[i * POL_SIZE + j] = x + j;
+      }
+      output_val[i * VAL_SIZE] = 2 * x;
+      output_val[i * VAL_SIZE + 1] = 3 * x;
+    }
+    positions += batch_size;
+  }
+
+  int saved_threads;
+  int saved_batch_size;
+  int callers{0};
+  std::atomic<int> started{0};
+  std::atomic<int> batches{0};
+  std::atomic<int> positions{0};
+};
+
+TEST_F(NNBatchQueueTest, DuplicateKeysAllGetTheirOutputs) {
+  // The first key once, and then 4 keys twice or three times each.
+  const auto keys = std::vector<Key>{7, 1, 2, 1, 3, 2, 4, 1, 3, 4};
+  callers = keys.size();
+  cfg_num_threads = callers;
+  cfg_batch_size = callers;
+
+  NNBatchQueue queue{[this](const std::vector<Network::NNPlanes>& input,
+                            std::vector<float>& output_pol,
+                            std::vector<float>& output_val, int batch_size) {
+      evaluate(input, output_pol, output_val, batch_size);
+  }};
+  auto pols = std::vector<std::vector<float>>(callers,
+                                              std::vector<float>(POL_SIZE));
+  auto vals = std::vector<std::vector<float>>(callers,
+                                              std::vector<float>(VAL_SIZE));
+  auto inputs = std::vector<Network::NNPlanes>(callers);
+  for (auto i = 0; i < callers; i++) {
+    inputs[i].rule50_count = int(keys[i]);
+  }
+
+  auto threads = std::vector<std::thread>{};
+  for (auto i = 0; i < callers; i++) {
+    threads.emplace_back([&, i] {
+      // The first caller goes alone, the others once it is evaluated.
+      if (i > 0) {
+        while (batches == 0) {
+          std::this_thread::yield();
+        }
+        started++;
+      }
+      queue.forward(keys[i], inputs[i], pols[i], vals[i]);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (auto i = 0; i < callers; i++) {
+    const auto x = float(keys[i]);
+    EXPECT_EQ(pols[i], (std::vector<float>{x, x + 1, x + 2})) << "caller " << i;
+    EXPECT_EQ(vals[i], (std::vector<float>{2 * x, 3 * x})) << "caller " << i;
+  }
+  EXPECT_EQ(batches, 2);
+  EXPECT_EQ(positions, 5);
+}
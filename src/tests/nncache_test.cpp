@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+
+#include "NNCache.h"
+
+class NNCacheTest: public ::testing::Test {
+protected:
+  void SetUp() override {
+    NNCache::get_NNCache().resize(1000);
+  }
+
+  static Network::Netresult make_result(int num_moves, float eval) {
+    Network::Netresult result;
+    for (int i = 0; i < num_moves; ++i) {
+      result.first.emplace_back(1.0f / num_moves, Move(i + 1));
+    }
+    result.second = eval;
+    return result;
+  }
+};
+
+TEST_F(NNCacheTest, LookupReturnsInsertedResult) {
+  auto& cache = NNCache::get_NNCache();
+  Network::Netresult result;
+  EXPECT_FALSE(cache.lookup(12345, result));
+
+  cache.insert(12345, make_result(20, 0.75f));
+  ASSERT_TRUE(cache.lookup(12345, result));
+  ASSERT_EQ(result.first.size(), 20u);
+  EXPECT_EQ(result.first[3].second, Move(4));
+  // Priors are stored as half floats.
+  EXPECT_NEAR(result.first[3].first, 1.0f / 20, 1.0f / 20 / 1024);
+  EXPECT_FLOAT_EQ(result.second, 0.75f);
+}
+
+TEST_F(NNCacheTest, PriorsKeepRelativePrecision) {
+  auto& cache = NNCache::get_NNCache();
+  Network::Netresult input;
+  for (auto prior : {1.0f, 0.5f, 0.3333f, 1e-3f, 1e-5f, 1e-7f, 0.0f}) {
+    input.first.emplace_back(prior, Move(input.first.size() + 1));
+  }
+  cache.insert(777, input);
+  Network::Netresult result;
+  ASSERT_TRUE(cache.lookup(777, result));
+  ASSERT_EQ(result.first.size(), input.first.size());
+  for (size_t i = 0; i < input.first.size(); ++i) {
+    auto expected = input.first[i].first;
+    // Half floats have 11 bits of precision, less for subnormals.
+    EXPECT_NEAR(result.first[i].first, expected, expected / 1024 + 6e-8f);
+    EXPECT_EQ(result.first[i].second, input.first[i].second);
+  }
+}
+
+TEST_F(NNCacheTest, OversizedResultsAreNotCached) {
+  auto& cache = NNCache::get_NNCache();
+  Network::Netresult result;
+  cache.insert(42, make_result(NNCache::MAX_CACHED_MOVES + 1, 0.5f));
+  EXPECT_FALSE(cache.lookup(42, result));
+}
+
+TEST_F(NNCacheTest, OldestEntryOfBucketIsReplaced) {
+  auto& cache = NNCache::get_NNCache();
+  cache.resize(NNCache::BUCKET_SIZE);
+  // All keys map to the single bucket.
+  for (int i = 0; i <= NNCache::BUCKET_SIZE; ++i) {
+    cache.insert(100 + i, make_result(5, 0.1f * i));
+  }
+  Network::Netresult result;
+  EXPECT_FALSE(cache.lookup(100, result));
+  for (int i = 1; i <= NNCache::BUCKET_SIZE; ++i) {
+    EXPECT_TRUE(cache.lookup(100 + i, result));
+  }
+}
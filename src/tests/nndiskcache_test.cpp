@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "NNDiskCache.h"
+
+class NNDiskCacheTest: public ::testing::Test {
+protected:
+  const std::string cachefile = "nndiskcache_test.cache";
+  const std::string weightsfile = "nndiskcache_test.txt";
+
+  void SetUp() override {
+    write_weights("2\n1 2 3\n");
+  }
+
+  void TearDown() override {
+    NNDiskCache::get_NNDiskCache().close();
+    std::remove(cachefile.c_str());
+    std::remove(weightsfile.c_str());
+  }
+
+  void write_weights(const std::string& contents) {
+    auto out = std::ofstream{weightsfile};
+    out << contents;
+  }
+
+  static Network::Netresult make_result(int num_moves, float eval) {
+    Network::Netresult result;
+    for (int i = 0; i < num_moves; ++i) {
+      result.first.emplace_back(1.0f / num_moves, Move(i + 1));
+    }
+    result.second = eval;
+    return result;
+  }
+};
+
+TEST_F(NNDiskCacheTest, LookupReturnsInsertedResult) {
+  auto& cache = NNDiskCache::get_NNDiskCache();
+  ASSERT_TRUE(cache.open(cachefile, 1, weightsfile));
+  Network::Netresult result;
+  EXPECT_FALSE(cache.lookup(12345, result));
+
+  cache.insert(12345, make_result(20, 0.75f));
+  cache.flush();
+  ASSERT_TRUE(cache.lookup(12345, result));
+  ASSERT_EQ(result.first.size(), 20u);
+  EXPECT_EQ(result.first[3].second, Move(4));
+  EXPECT_NEAR(result.first[3].first, 1.0f / 20, 1.0f / 20 / 1024);
+  EXPECT_FLOAT_EQ(result.second, 0.75f);
+}
+
+TEST_F(NNDiskCacheTest, EntriesSurviveReopening) {
+  auto& cache = NNDiskCache::get_NNDiskCache();
+  ASSERT_TRUE(cache.open(cachefile, 1, weightsfile));
+  cache.insert(777, make_result(5, 0.25f));
+  cache.close();
+  EXPECT_FALSE(cache.is_open());
+
+  ASSERT_TRUE(cache.open(cachefile, 1, weightsfile));
+  Network::Netresult result;
+  ASSERT_TRUE(cache.lookup(777, result));
+  EXPECT_EQ(result.first.size(), 5u);
+  EXPECT_FLOAT_EQ(result.second, 0.25f);
+}
+
+TEST_F(NNDiskCacheTest, OtherNetworkStartsAfresh) {
+  auto& cache = NNDiskCache::get_NNDiskCache();
+  ASSERT_TRUE(cache.open(cachefile, 1, weightsfile));
+  cache.insert(777, make_result(5, 0.25f));
+  cache.close();
+
+  write_weights("2\n1 2 4\n");
+  ASSERT_TRUE(cache.open(cachefile, 1, weightsfile));
+  Network::Netresult result;
+  EXPECT_FALSE(cache.lookup(777, result));
+}
+
+TEST_F(NNDiskCacheTest, UnknownKeysAreNotFound) {
+  auto& cache = NNDiskCache::get_NNDiskCache();
+  ASSERT_TRUE(cache.open(cachefile, 1, weightsfile));
+  cache.insert(777, make_result(5, 0.25f));
+  cache.flush();
+  Network::Netresult result;
+  EXPECT_FALSE(cache.lookup(778, result));
+  EXPECT_FALSE(cache.lookup(0, result));
+}
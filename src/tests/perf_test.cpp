@@ -1,7 +1,13 @@
 #include <gtest/gtest.h>
 
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include "Types.h"
 #include "Bitboard.h"
+#include "Misc.h"
 #include "Position.h"
 #include "UCI.h"
 
@@ -53,3 +59,32 @@ TEST_F(PerfTest, Pos6) {
   EXPECT_EQ(n, 3'894'594);
 }
 
+
+TEST_F(PerfTest, ParallelMatchesSerial) {
+  bh_.set("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+  auto moves = std::vector<std::pair<Move, uint64_t>>{};
+  auto n = UCI::perft_parallel(bh_.cur(), Depth(4), 4, 0, &moves);
+  EXPECT_EQ(n, 4'085'603);
+  EXPECT_EQ(moves.size(), 48u);
+  EXPECT_EQ(UCI::perft_parallel(bh_.cur(), Depth(1), 4, 0), 48u);
+
+  bh_.set("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -");
+  EXPECT_EQ(UCI::perft_parallel(bh_.cur(), Depth(6), 4, 16), 11'030'083u);
+}
+
+// A movegen benchmark for local runs, enable with
+// --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*
+TEST_F(PerfTest, DISABLED_Benchmark) {
+  bh_.set("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+  const auto cpus = static_cast<int>(std::thread::hardware_concurrency());
+  for (auto config : {std::make_pair(1, 0), std::make_pair(cpus, 0),
+                      std::make_pair(cpus, 64)}) {
+    auto start = now();
+    auto n = UCI::perft_parallel(bh_.cur(), Depth(5), config.first, config.second);
+    auto elapsed = now() - start;
+    EXPECT_EQ(n, 193'690'690u);
+    std::cout << "perft 5, " << config.first << " thread(s), hash "
+              << config.second << " MB: " << elapsed << " ms, "
+              << n * 1000 / (elapsed + 1) << " nps" << std::endl;
+  }
+}
@@ -0,0 +1,84 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Bitboard.h"
+#include "Position.h"
+#include "UCI.h"
+#include "pgn.h"
+
+class PGNTest: public ::testing::Test {
+protected:
+  static void SetUpTestCase() {
+    Bitboards::init();
+    Position::init();
+  }
+};
+
+namespace {
+
+const char* kGames = R"EOM([Event "?"]
+[Result "1-0"]
+
+1. e4 e5 2. Nf3 {a comment
+[that looks like a tag]} Nc6 3. Bb5 a6 (3... Nf6 4. O-O (4. d3)) 4.Ba4 $1 Nf6
+5. O-O Be7 6. Re1 b5 7. Bb3 d6 8. c3 O-O 9. h3 Bb7 10. d4 Re8 1-0
+
+[Event "?"]
+[Result "0-1"]
+
+1. f3 e5 2. g4?? Qh4# 0-1
+[Event "no blank line before this one"]
+[Result "1/2-1/2"]
+
+1. d4 d5 ; a rest of line comment
+2. c4 dxc4 1/2-1/2
+)EOM";
+
+std::vector<std::string> moves(const PGNGame& game) {
+  std::vector<std::string> out;
+  for (auto i = size_t{1}; i < game.bh.positions.size(); i++) {
+    out.emplace_back(UCI::move(game.bh.positions[i].get_move()));
+  }
+  return out;
+}
+
+}  // namespace
+
+TEST_F(PGNTest, TokenizerSplitsGames) {
+  PGNTokenizer tokenizer(kGames, strlen(kGames));
+  auto results = std::vector<int>{};
+  auto plies = std::vector<size_t>{};
+  PGNSpan span;
+  while (tokenizer.next(span)) {
+    EXPECT_EQ(span.begin[0], '[');
+    auto game = parse_pgn_game(span);
+    results.emplace_back(game->result);
+    plies.emplace_back(game->bh.positions.size() - 1);
+  }
+  EXPECT_EQ(results, (std::vector<int>{1, -1, 0}));
+  EXPECT_EQ(plies, (std::vector<size_t>{20, 4, 4}));
+}
+
+TEST_F(PGNTest, StreamAndSpanAgree) {
+  std::istringstream ss(kGames);
+  PGNParser parser(ss);
+  auto first = parser.parse();
+  ASSERT_NE(first, nullptr);
+  PGNTokenizer tokenizer(kGames, strlen(kGames));
+  PGNSpan span;
+  ASSERT_TRUE(tokenizer.next(span));
+  EXPECT_EQ(moves(*first), moves(*parse_pgn_game(span)));
+  EXPECT_EQ(moves(*parser.parse()).back(), "d8h4");
+}
+
+TEST_F(PGNTest, RejectsIllegalMoves) {
+  const std::string bad = "[Result \"1-0\"]\n\n1. e4 e4 1-0\n";
+  PGNTokenizer tokenizer(bad.data(), bad.size());
+  PGNSpan span;
+  ASSERT_TRUE(tokenizer.next(span));
+  EXPECT_THROW(parse_pgn_game(span), std::runtime_error);
+}
@@ -1,7 +1,9 @@
 #include <gtest/gtest.h>
 
 #include "Bitboard.h"
+#include "Movegen.h"
 #include "Position.h"
+#include "Random.h"
 #include "UCI.h"
 
 class PositionTest: public ::testing::Test {
@@ -200,3 +202,110 @@ TEST_F(PositionTest, PGNTest) {
   bh_.do_move(UCI::to_move(bh_.cur(), "f5e6"));
   EXPECT_EQ(bh_.pgn(), "1. f4 a6 2. f5 e5 3. fxe6 ");
 }
+
+TEST_F(PositionTest, UndoneMovesReuseTheirStates) {
+  BoardHistory root;
+  root.set(Position::StartFEN);
+  root.do_move(UCI::to_move(root.cur(), "g1f3"));
+  auto bh = root.shallow_clone();
+  const auto key = bh.cur().full_key();
+
+  bh.do_move(UCI::to_move(bh.cur(), "g8f6"));
+  auto state = bh.states.back().get();
+  bh.do_move(UCI::to_move(bh.cur(), "f3g1"));
+  bh.do_move(UCI::to_move(bh.cur(), "f6g8"));
+  EXPECT_EQ(bh.cur().repetitions_count(), 1);
+  EXPECT_TRUE(bh.undo_move());
+  EXPECT_TRUE(bh.undo_move());
+  EXPECT_TRUE(bh.undo_move());
+  EXPECT_EQ(bh.cur().full_key(), key);
+  EXPECT_TRUE(bh.states.empty());
+
+  // Play a different line, the states of the first are used again.
+  bh.do_move(UCI::to_move(bh.cur(), "b8c6"));
+  EXPECT_EQ(bh.states.back().get(), state);
+  EXPECT_EQ(bh.spare_states.size(), 2u);
+  EXPECT_EQ(bh.cur().repetitions_count(), 0);
+}
+
+TEST_F(PositionTest, SanBufferMatchesMoveToSan) {
+  auto check_all = [](const Position& pos) {
+    for (const auto& m : MoveList<LEGAL>(pos)) {
+      auto san = pos.move_to_san(m.move);
+      ASSERT_EQ(pos.san_to_move(san.data(), san.size()), m.move) << pos.fen() << " " << san;
+    }
+  };
+  // En passant, promotions, pins and a check.
+  for (auto fen : {"4k3/1P6/8/2pP4/8/8/5p2/R3K2R w KQ c6 0 1",
+                   "r3k2r/8/8/4q3/8/8/4R3/4K3 w kq - 0 1",
+                   "4k3/8/8/8/1b6/8/3N1N2/4K3 w - - 0 1",
+                   "4k3/8/8/8/8/8/4r3/R3K2R w KQ - 0 1"}) {
+    BoardHistory bh;
+    bh.set(fen);
+    check_all(bh.cur());
+  }
+  auto rng = Random{11};
+  for (auto game = 0; game < 10; game++) {
+    BoardHistory bh;
+    bh.set(Position::StartFEN);
+    for (auto ply = 0; ply < 200; ply++) {
+      check_all(bh.cur());
+      auto moves = MoveList<LEGAL>(bh.cur());
+      if (!moves.size()) {
+        break;
+      }
+      bh.do_move((moves.begin() + rng.RandInt(moves.size()))->move);
+    }
+  }
+
+  BoardHistory bh;
+  bh.set("4k3/1P6/8/2pP4/8/8/8/4K3 w - c6 0 1");
+  const auto& pos = bh.cur();
+  EXPECT_EQ(pos.san_to_move("b8Q", 3), make<PROMOTION>(SQ_B7, SQ_B8, QUEEN));
+  EXPECT_EQ(pos.san_to_move("b8=N+", 5), make<PROMOTION>(SQ_B7, SQ_B8, KNIGHT));
+  EXPECT_EQ(pos.san_to_move("dc6", 3), make<ENPASSANT>(SQ_D5, SQ_C6));
+  EXPECT_EQ(pos.san_to_move("b8", 2), MOVE_NONE);
+  EXPECT_EQ(pos.san_to_move("d7", 2), MOVE_NONE);
+  EXPECT_EQ(pos.san_to_move("Ke2!?", 5), make_move(SQ_E1, SQ_E2));
+}
+
+TEST_F(PositionTest, HistoryKeyCoversTheNetworkHistory) {
+  auto play = [](BoardHistory& bh, std::initializer_list<const char*> moves) {
+    for (auto move : moves) {
+      bh.do_move(UCI::to_move(bh.cur(), move));
+    }
+  };
+  BoardHistory a;
+  a.set(Position::StartFEN);
+  BoardHistory b;
+  b.set(Position::StartFEN);
+  EXPECT_EQ(a.history_key(), b.history_key());
+
+  // The same position through another move order.
+  play(a, {"g1f3", "g8f6", "b1c3", "b8c6"});
+  play(b, {"b1c3", "b8c6", "g1f3", "g8f6"});
+  EXPECT_EQ(a.cur().full_key(), b.cur().full_key());
+  EXPECT_NE(a.history_key(), b.history_key());
+
+  // Undoing a move restores the key.
+  const auto key = a.history_key();
+  play(a, {"a1b1"});
+  EXPECT_TRUE(a.undo_move());
+  EXPECT_EQ(a.history_key(), key);
+
+  // Until the differing positions fall out of the history.
+  auto clone = a.shallow_clone();
+  EXPECT_EQ(clone.history_key(), a.history_key());
+  const char* shuffle[] = {"a1b1", "a8b8", "b1a1", "b8a8"};
+  for (auto i = 0; i < BoardHistory::HISTORY_KEY_PLIES - 1; i++) {
+    auto move = shuffle[i % 4];
+    play(a, {move});
+    play(b, {move});
+    play(clone, {move});
+    EXPECT_EQ(clone.history_key(), a.history_key());
+    if (i < BoardHistory::HISTORY_KEY_PLIES - 2) {
+      EXPECT_NE(a.history_key(), b.history_key()) << i;
+    }
+  }
+  EXPECT_EQ(a.history_key(), b.history_key());
+}
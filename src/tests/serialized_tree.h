@@ -0,0 +1,33 @@
+#ifndef SERIALIZED_TREE_H_INCLUDED
+#define SERIALIZED_TREE_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+
+#include "UCTNode.h"
+
+// Writers of trees in the format of UCTNode::serialize(), for the tests
+// which load them: a node, then a child record for each of its children,
+// then the nodes of the children saved with it, depth first.
+
+template<typename T>
+inline void put(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void put_node(std::string& out, int visits, float eval,
+                     int num_children) {
+  put(out, 0.5f);
+  put(out, std::int64_t(visits * eval * UCTNode::EVAL_ONE));
+  put(out, std::int32_t{visits});
+  put(out, eval);
+  put(out, static_cast<std::uint16_t>(num_children));
+}
+
+inline void put_child(std::string& out, Move move, float prior, bool saved) {
+  put(out, static_cast<std::uint16_t>(move));
+  put(out, prior);
+  put(out, std::uint8_t{saved});
+}
+
+#endif
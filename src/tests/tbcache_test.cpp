@@ -0,0 +1,41 @@
+#include <gtest/gtest.h>
+
+#include "Bitboard.h"
+#include "Position.h"
+#include "TBCache.h"
+#include "syzygy/tbprobe.h"
+
+class TBCacheTest: public ::testing::Test {
+protected:
+  static void SetUpTestCase() {
+    Bitboards::init();
+    Position::init();
+  }
+};
+
+TEST_F(TBCacheTest, RepeatedProbesHitTheCache) {
+  // No tablebases are loaded, so every probe fails, and so must the
+  // cached ones.
+  Tablebases::init("");
+  auto& cache = TBCache::get_TBCache();
+  EXPECT_EQ(cache.get_lookups(), 0);
+
+  BoardHistory bh;
+  bh.set("8/8/8/4k3/8/8/2KQ4/8 w - - 0 1");
+  auto err = Tablebases::ProbeState::OK;
+  cache.probe_wdl(bh.cur(), &err);
+  EXPECT_EQ(err, Tablebases::ProbeState::FAIL);
+  EXPECT_EQ(cache.get_hits(), 0);
+
+  err = Tablebases::ProbeState::OK;
+  cache.probe_wdl(bh.cur(), &err);
+  EXPECT_EQ(err, Tablebases::ProbeState::FAIL);
+  EXPECT_EQ(cache.get_hits(), 1);
+  EXPECT_EQ(cache.get_lookups(), 2);
+
+  // Loading tablebases drops the cached results.
+  Tablebases::init("");
+  EXPECT_EQ(cache.get_lookups(), 0);
+  cache.probe_wdl(bh.cur(), &err);
+  EXPECT_EQ(cache.get_hits(), 0);
+}
@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+#include "Bitboard.h"
+#include "Position.h"
+#include "TBProbeService.h"
+#include "syzygy/tbprobe.h"
+
+class TBProbeServiceTest: public ::testing::Test {
+protected:
+  static void SetUpTestCase() {
+    Bitboards::init();
+    Position::init();
+  }
+};
+
+TEST_F(TBProbeServiceTest, ProbesInlineWithoutThreads) {
+  Tablebases::init("");
+  auto& service = TBProbeService::get_TBProbeService();
+  service.set_threads(0);
+
+  BoardHistory bh;
+  bh.set("8/8/8/4k3/8/8/2KR4/8 w - - 0 1");
+  auto wdl = Tablebases::WDLWin;
+  auto err = Tablebases::ProbeState::OK;
+  EXPECT_TRUE(service.probe_wdl(bh.cur(), &wdl, &err));
+  EXPECT_EQ(err, Tablebases::ProbeState::FAIL);
+}
+
+TEST_F(TBProbeServiceTest, PendingProbesFinishOnProbeThreads) {
+  Tablebases::init("");
+  auto& service = TBProbeService::get_TBProbeService();
+  service.set_threads(2);
+
+  BoardHistory bh;
+  bh.set("8/8/8/4k3/8/8/2KR4/8 w - - 0 1");
+  auto wdl = Tablebases::WDLWin;
+  auto err = Tablebases::ProbeState::OK;
+  // The first probe misses the cache, so it's queued.
+  EXPECT_FALSE(service.probe_wdl(bh.cur(), &wdl, &err));
+  auto done = false;
+  for (auto i = 0; i < 1000 && !done; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    done = service.probe_wdl(bh.cur(), &wdl, &err);
+  }
+  EXPECT_TRUE(done);
+  EXPECT_EQ(err, Tablebases::ProbeState::FAIL);
+
+  // Loading tablebases waits for the probe threads and drops the results.
+  Tablebases::init("");
+  EXPECT_FALSE(service.probe_wdl(bh.cur(), &wdl, &err));
+  service.set_threads(0);
+}
@@ -0,0 +1,107 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018 Gian-Carlo Pascutto
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <future>
+#include <vector>
+
+#include "ThreadPool.h"
+
+TEST(ThreadPoolTest, RunsEveryTask) {
+  Utils::ThreadPool pool;
+  pool.initialize(4);
+
+  std::atomic<int> count{0};
+  auto results = std::vector<std::future<int>>{};
+  for (auto i = 0; i < 1000; ++i) {
+    results.emplace_back(pool.add_task([&count, i] {
+      ++count;
+      return i;
+    }));
+  }
+  auto sum = 0;
+  for (auto& result : results) {
+    sum += result.get();
+  }
+  EXPECT_EQ(count, 1000);
+  EXPECT_EQ(sum, 999 * 1000 / 2);
+}
+
+TEST(ThreadPoolTest, PoolThreadsQueueOnTheirOwnDeque) {
+  Utils::ThreadPool pool;
+  pool.initialize(2);
+
+  // The nested tasks land on the deque of the thread that is blocked on
+  // them, so the other thread has to steal them.
+  auto outer = pool.add_task([&pool] {
+    auto inner = std::vector<std::future<int>>{};
+    for (auto i = 0; i < 100; ++i) {
+      inner.emplace_back(pool.add_task([i] { return i; }));
+    }
+    auto sum = 0;
+    for (auto& result : inner) {
+      sum += result.get();
+    }
+    return sum;
+  });
+  EXPECT_EQ(outer.get(), 99 * 100 / 2);
+}
+
+TEST(ThreadPoolTest, SubmitsCallerOwnedTasks) {
+  class CountTask : public Utils::ThreadPool::Task {
+  public:
+    void run() override {
+      ++m_runs;
+      m_done.set_value();
+    }
+    int m_runs{0};
+    std::promise<void> m_done;
+  };
+
+  Utils::ThreadPool pool;
+  pool.initialize(3);
+
+  auto tasks = std::vector<CountTask>(50);
+  for (auto& task : tasks) {
+    pool.submit(task);
+  }
+  for (auto& task : tasks) {
+    task.m_done.get_future().wait();
+    EXPECT_EQ(task.m_runs, 1);
+  }
+}
+
+TEST(ThreadPoolTest, ThreadGroupWaitsForAllTasks) {
+  Utils::ThreadPool pool;
+  pool.initialize(2);
+
+  std::atomic<int> count{0};
+  Utils::ThreadGroup group(pool);
+  for (auto i = 0; i < 10; ++i) {
+    group.add_task([&count] { ++count; });
+  }
+  group.wait_all();
+  EXPECT_EQ(count, 10);
+
+  // The group can be reused after waiting.
+  group.add_task([&count] { ++count; });
+  group.wait_all();
+  EXPECT_EQ(count, 11);
+}
@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "Bitboard.h"
+#include "Network.h"
+#include "Parameters.h"
+#include "Position.h"
+#include "Training.h"
+#include "Utils.h"
+#include "zlib.h"
+
+namespace fs = boost::filesystem;
+
+TEST(OutputChunkerTest, WritesAllGamesInOrder) {
+  auto dir = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(dir);
+  auto basename = (dir / "training").string();
+  {
+    // Uncompressed chunks all go to the same file.
+    OutputChunker chunker{basename, false, 2};
+    for (auto i = 0; i < 25; i++) {
+      chunker.append("game " + std::to_string(i) + "\n");
+    }
+  }
+  auto expected = std::string{};
+  for (auto i = 0; i < 25; i++) {
+    expected += "game " + std::to_string(i) + "\n";
+  }
+  auto in = std::ifstream{basename};
+  auto contents = std::stringstream{};
+  contents << in.rdbuf();
+  EXPECT_EQ(contents.str(), expected);
+  fs::remove_all(dir);
+}
+
+TEST(TrainingTest, DumpSupervisedConvertsGamesOnSeveralThreads) {
+  Bitboards::init();
+  Position::init();
+  Network::set_format_version(2);
+  auto dir = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(dir);
+  auto pgn_filename = (dir / "games.pgn").string();
+  {
+    // More games than the queue holds, so that the reader has to wait.
+    auto out = std::ofstream{pgn_filename};
+    for (auto i = 0; i < 20; i++) {
+      out << "[Event \"?\"]\n[Result \"1-0\"]\n\n"
+          << "1. e4 e5 2. Nf3 Nc6 3. Bb5 a6 1-0\n\n"
+          << "[Event \"?\"]\n[Result \"0-1\"]\n\n"
+          << "1. f3 e5 2. g4 Qh4# 0-1\n\n"
+          << "[Event \"?\"]\n[Result \"1/2-1/2\"]\n\n"
+          << "1. d4 d5 1/2-1/2\n\n";
+    }
+  }
+  const auto threads = cfg_num_threads;
+  cfg_num_threads = 3;
+  while (thread_pool.size() < 3) {
+    thread_pool.add_thread([] {});
+  }
+  Training::dump_supervised(pgn_filename, (dir / "training").string());
+  cfg_num_threads = threads;
+
+  // Every ply is a record, with the played move as the whole policy and
+  // the result of the game for the side to move.
+  constexpr auto record_size = 8276;
+  constexpr auto policy_size = Network::V2_NUM_OUTPUT_POLICY;
+  auto data = std::string{};
+  for (auto& entry : fs::directory_iterator(dir)) {
+    if (entry.path().extension() != ".gz") {
+      continue;
+    }
+    auto in = gzopen(entry.path().string().c_str(), "rb");
+    ASSERT_NE(in, nullptr);
+    char buffer[record_size];
+    int bytes;
+    while ((bytes = gzread(in, buffer, sizeof(buffer))) > 0) {
+      data.append(buffer, bytes);
+    }
+    gzclose(in);
+  }
+  ASSERT_EQ(data.size(), size_t{20 * (6 + 4 + 2) * record_size});
+  auto results = std::map<int, int>{};
+  for (auto offset = size_t{0}; offset < data.size(); offset += record_size) {
+    std::int32_t version;
+    std::memcpy(&version, &data[offset], sizeof(version));
+    EXPECT_EQ(version, 3);
+    auto sum = 0.0f;
+    for (auto i = 0; i < policy_size; i++) {
+      float p;
+      std::memcpy(&p, &data[offset + 4 + 4 * i], sizeof(p));
+      sum += p;
+    }
+    EXPECT_EQ(sum, 1.0f);
+    results[static_cast<std::int8_t>(data[offset + record_size - 1])]++;
+  }
+  EXPECT_EQ(results[1], 20 * (3 + 2));
+  EXPECT_EQ(results[-1], 20 * (3 + 2));
+  EXPECT_EQ(results[0], 20 * 2);
+  fs::remove_all(dir);
+}
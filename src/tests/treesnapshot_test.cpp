@@ -0,0 +1,151 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "Bitboard.h"
+#include "Position.h"
+#include "TreeSnapshot.h"
+#include "UCI.h"
+#include "UCTNode.h"
+#include "serialized_tree.h"
+
+class TreeSnapshotTest: public ::testing::Test {
+protected:
+  const std::string snapshotfile = "treesnapshot_test.tree";
+  const std::string weightsfile = "treesnapshot_test.txt";
+
+  static void SetUpTestCase() {
+    Bitboards::init();
+    Position::init();
+  }
+
+  void SetUp() override {
+    write_weights("2\n1 2 3\n");
+    bh.set(Position::StartFEN);
+  }
+
+  void TearDown() override {
+    TreeSnapshot::get_TreeSnapshot().clear();
+    std::remove(snapshotfile.c_str());
+    std::remove(weightsfile.c_str());
+  }
+
+  void write_weights(const std::string& contents) {
+    auto out = std::ofstream{weightsfile};
+    out << contents;
+  }
+
+  // The start position with 3 visits, e2e4 with 2 and d2d4 unvisited.
+  std::string make_tree() {
+    auto tree = std::string{};
+    put_node(tree, 3, 0.5f, 2);
+    put_child(tree, UCI::to_move(bh.cur(), "e2e4"), 0.6f, true);
+    put_child(tree, UCI::to_move(bh.cur(), "d2d4"), 0.4f, false);
+    put_node(tree, 2, 0.25f, 0);
+    return tree;
+  }
+
+  BoardHistory bh;
+};
+
+TEST_F(TreeSnapshotTest, SerializeRoundTrip) {
+  const auto tree = make_tree();
+  auto data = tree.data();
+  auto root = UCTNode::deserialize(MOVE_NONE, data, data + tree.size());
+  ASSERT_TRUE(root);
+  EXPECT_EQ(data, tree.data() + tree.size());
+  EXPECT_EQ(root->get_visits(), 3);
+  ASSERT_EQ(root->get_children().size(), 2u);
+  EXPECT_EQ(root->get_children()[0].get_visits(), 2);
+  EXPECT_FALSE(root->get_children()[1].is_inflated());
+  EXPECT_FLOAT_EQ(root->get_children()[1].get_score(), 0.4f);
+
+  auto out = std::string{};
+  root->serialize(out, 1);
+  EXPECT_EQ(out, tree);
+}
+
+TEST_F(TreeSnapshotTest, LowVisitChildrenAreLeftOut) {
+  const auto tree = make_tree();
+  auto data = tree.data();
+  auto root = UCTNode::deserialize(MOVE_NONE, data, data + tree.size());
+  ASSERT_TRUE(root);
+  auto out = std::string{};
+  root->serialize(out, 3);
+  data = out.data();
+  root = UCTNode::deserialize(MOVE_NONE, data, data + out.size());
+  ASSERT_TRUE(root);
+  EXPECT_EQ(root->get_children().size(), 2u);
+  EXPECT_FALSE(root->get_children()[0].is_inflated());
+}
+
+TEST_F(TreeSnapshotTest, TruncatedTreeIsRejected) {
+  const auto tree = make_tree();
+  auto data = tree.data();
+  EXPECT_FALSE(UCTNode::deserialize(MOVE_NONE, data,
+                                    data + tree.size() - 1));
+}
+
+TEST_F(TreeSnapshotTest, FindsSavedPositions) {
+  const auto tree = make_tree();
+  auto data = tree.data();
+  auto root = UCTNode::deserialize(MOVE_NONE, data, data + tree.size());
+  ASSERT_TRUE(TreeSnapshot::save(snapshotfile, *root, bh.cur().full_key(),
+                                 weightsfile, 1));
+
+  auto& snapshot = TreeSnapshot::get_TreeSnapshot();
+  ASSERT_TRUE(snapshot.load(snapshotfile, weightsfile));
+  auto node = snapshot.find(bh);
+  ASSERT_TRUE(node);
+  EXPECT_EQ(node->get_visits(), 3);
+
+  auto e4 = bh.shallow_clone();
+  e4.do_move(UCI::to_move(e4.cur(), "e2e4"));
+  node = snapshot.find(e4);
+  ASSERT_TRUE(node);
+  EXPECT_EQ(node->get_visits(), 2);
+  EXPECT_FLOAT_EQ(node->get_eval(WHITE), 0.25f);
+
+  auto d4 = bh.shallow_clone();
+  d4.do_move(UCI::to_move(d4.cur(), "d2d4"));
+  EXPECT_FALSE(snapshot.find(d4));
+}
+
+TEST_F(TreeSnapshotTest, OtherNetworkIsRejected) {
+  const auto tree = make_tree();
+  auto data = tree.data();
+  auto root = UCTNode::deserialize(MOVE_NONE, data, data + tree.size());
+  ASSERT_TRUE(TreeSnapshot::save(snapshotfile, *root, bh.cur().full_key(),
+                                 weightsfile, 1));
+  write_weights("2\n1 2 4\n");
+  auto& snapshot = TreeSnapshot::get_TreeSnapshot();
+  EXPECT_FALSE(snapshot.load(snapshotfile, weightsfile));
+  EXPECT_FALSE(snapshot.find(bh));
+}
+
+TEST_F(TreeSnapshotTest, ChildSnapshotsAreBestFirst) {
+  auto tree = std::string{};
+  put_node(tree, 3, 0.5f, 2);
+  put_child(tree, UCI::to_move(bh.cur(), "d2d4"), 0.6f, false);
+  put_child(tree, UCI::to_move(bh.cur(), "e2e4"), 0.4f, true);
+  put_node(tree, 2, 0.25f, 0);
+  auto data = tree.data();
+  auto root = UCTNode::deserialize(MOVE_NONE, data, data + tree.size());
+  ASSERT_TRUE(root);
+
+  const auto children = root->snapshot_children(WHITE);
+  ASSERT_EQ(children.size(), 2u);
+  EXPECT_EQ(children[0].move, UCI::to_move(bh.cur(), "e2e4"));
+  EXPECT_EQ(children[0].visits, 2);
+  EXPECT_FLOAT_EQ(children[0].eval, 0.25f);
+  EXPECT_EQ(children[0].node, root->get_children()[1].get());
+  EXPECT_EQ(children[1].move, UCI::to_move(bh.cur(), "d2d4"));
+  EXPECT_EQ(children[1].visits, 0);
+  EXPECT_FALSE(children[1].node);
+  // The children themselves keep their order.
+  EXPECT_EQ(root->get_children()[0].get_move(),
+            UCI::to_move(bh.cur(), "d2d4"));
+}
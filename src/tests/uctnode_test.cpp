@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "Bitboard.h"
+#include "Position.h"
+#include "UCI.h"
+#include "UCTNode.h"
+#include "serialized_tree.h"
+
+class UCTNodeTest: public ::testing::Test {
+protected:
+  static void SetUpTestCase() {
+    Bitboards::init();
+    Position::init();
+  }
+
+  void SetUp() override {
+    bh.set(Position::StartFEN);
+  }
+
+  Move move(const BoardHistory& pos, const std::string& uci) {
+    return UCI::to_move(pos.cur(), uci);
+  }
+
+  // The start position with 10 visits. e2e4 has 7 and the children e7e5
+  // with 4 and c7c5 with 2, whose child g1f3 has 1. d2d4 has 2 and its
+  // child d7d5 1.
+  UCTNode::node_ptr_t make_tree() {
+    auto e4 = bh.shallow_clone();
+    e4.do_move(move(bh, "e2e4"));
+    auto c5 = e4.shallow_clone();
+    c5.do_move(move(e4, "c7c5"));
+    auto d4 = bh.shallow_clone();
+    d4.do_move(move(bh, "d2d4"));
+
+    auto tree = std::string{};
+    put_node(tree, 10, 0.5f, 2);
+    put_child(tree, move(bh, "e2e4"), 0.5f, true);
+    put_child(tree, move(bh, "d2d4"), 0.5f, true);
+    put_node(tree, 7, 0.5f, 2);
+    put_child(tree, move(e4, "e7e5"), 0.5f, true);
+    put_child(tree, move(e4, "c7c5"), 0.5f, true);
+    put_node(tree, 4, 0.5f, 0);
+    put_node(tree, 2, 0.5f, 1);
+    put_child(tree, move(c5, "g1f3"), 0.5f, true);
+    put_node(tree, 1, 0.5f, 0);
+    put_node(tree, 2, 0.5f, 1);
+    put_child(tree, move(d4, "d7d5"), 0.5f, true);
+    put_node(tree, 1, 0.5f, 0);
+
+    auto data = tree.data();
+    return UCTNode::deserialize(MOVE_NONE, data, data + tree.size());
+  }
+
+  static const UCTNode* child(const UCTNode& node, size_t index) {
+    return node.get_children()[index].get();
+  }
+
+  BoardHistory bh;
+};
+
+TEST_F(UCTNodeTest, TreeMemoryIsTalliedByVisits) {
+  auto root = make_tree();
+  ASSERT_TRUE(root);
+  auto bytes_by_visits = std::map<int, size_t>{};
+  const auto bytes = root->get_tree_memory(&bytes_by_visits);
+  EXPECT_EQ(bytes, root->get_tree_memory());
+
+  const auto& e4 = *child(*root, 0);
+  const auto& c5 = *child(e4, 1);
+  const auto& d4 = *child(*root, 1);
+  ASSERT_EQ(bytes_by_visits.size(), 2u);
+  EXPECT_EQ(bytes_by_visits[7], e4.get_children_memory());
+  EXPECT_EQ(bytes_by_visits[2],
+            c5.get_children_memory() + d4.get_children_memory());
+  EXPECT_EQ(bytes, root->get_children_memory() + bytes_by_visits[7]
+                   + bytes_by_visits[2]);
+}
+
+TEST_F(UCTNodeTest, PruneKeepsTheWellVisitedSubtrees) {
+  auto root = make_tree();
+  ASSERT_TRUE(root);
+  auto bytes_by_visits = std::map<int, size_t>{};
+  const auto bytes = root->get_tree_memory(&bytes_by_visits);
+  EXPECT_EQ(root->count_nodes(), 6u);
+
+  root->prune_subtrees(3);
+
+  // Everything tallied below 3 visits is gone and only that.
+  EXPECT_EQ(root->get_tree_memory(), bytes - bytes_by_visits[2]);
+  EXPECT_EQ(root->count_nodes(), 4u);
+
+  const auto& e4 = *child(*root, 0);
+  const auto& c5 = *child(e4, 1);
+  const auto& d4 = *child(*root, 1);
+  EXPECT_TRUE(e4.has_children());
+  EXPECT_EQ(e4.get_children().size(), 2u);
+  EXPECT_FALSE(c5.has_children());
+  EXPECT_FALSE(d4.has_children());
+  EXPECT_FALSE(d4.is_expanding());
+
+  // The pruned nodes keep their statistics.
+  EXPECT_EQ(root->get_visits(), 10);
+  EXPECT_EQ(e4.get_visits(), 7);
+  EXPECT_EQ(c5.get_visits(), 2);
+  EXPECT_EQ(d4.get_visits(), 2);
+  EXPECT_FLOAT_EQ(d4.get_raw_eval(WHITE), 0.5f);
+}
+
+TEST_F(UCTNodeTest, PruneBelowTheLeastVisitsKeepsTheTree) {
+  auto root = make_tree();
+  ASSERT_TRUE(root);
+  const auto bytes = root->get_tree_memory();
+  root->prune_subtrees(2);
+  EXPECT_EQ(root->get_tree_memory(), bytes);
+  EXPECT_EQ(root->count_nodes(), 6u);
+}
@@ -0,0 +1,82 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "WeightsFile.h"
+
+TEST(WeightsFileTest, BinaryRoundTrip) {
+  const auto filename = std::string{"weightsfile_test.bin"};
+  auto lines = std::vector<std::vector<float>>{
+      {1.0f, -2.5f, 3.25f}, {}, {0.1f}, std::vector<float>(1000, 7.0f)};
+  ASSERT_TRUE(WeightsFile::write_binary(filename, 2, lines));
+  EXPECT_TRUE(WeightsFile::is_binary(filename));
+
+  auto format_version = 0;
+  auto read = std::vector<std::vector<float>>{};
+  ASSERT_TRUE(WeightsFile::read_binary(filename, format_version, read));
+  EXPECT_EQ(format_version, 2);
+  EXPECT_EQ(read, lines);
+  std::remove(filename.c_str());
+}
+
+TEST(WeightsFileTest, HalfPrecision) {
+  const auto filename = std::string{"weightsfile_test.bin"};
+  // All exact in half precision.
+  auto lines = std::vector<std::vector<float>>{
+      {1.0f, -2.5f, 3.25f}, {}, std::vector<float>(1000, 0.125f)};
+  ASSERT_TRUE(WeightsFile::write_binary(filename, 2, lines,
+                                        WeightsFile::FLOAT16));
+
+  auto format_version = 0;
+  auto read = std::vector<std::vector<float>>{};
+  ASSERT_TRUE(WeightsFile::read_binary(filename, format_version, read));
+  EXPECT_EQ(format_version, 2);
+  EXPECT_EQ(read, lines);
+  std::remove(filename.c_str());
+}
+
+TEST(WeightsFileTest, ReadsVersion1) {
+  // magic, version 1, format 2, 1 line of 2 floats, no encoding.
+  auto data = std::string{"LCZW"};
+  for (auto value : {1u, 2u, 1u, 2u}) {
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  for (auto value : {0.5f, -1.0f}) {
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  auto format_version = 0;
+  auto read = std::vector<std::vector<float>>{};
+  ASSERT_TRUE(WeightsFile::parse_binary(data.data(), data.size(),
+                                        format_version, read));
+  EXPECT_EQ(format_version, 2);
+  EXPECT_EQ(read, (std::vector<std::vector<float>>{{0.5f, -1.0f}}));
+}
+
+TEST(WeightsFileTest, RejectsTruncatedAndText) {
+  const auto filename = std::string{"weightsfile_test.bin"};
+  auto lines = std::vector<std::vector<float>>{std::vector<float>(64, 1.0f)};
+  ASSERT_TRUE(WeightsFile::write_binary(filename, 2, lines));
+  {
+    // Cut off the last float.
+    auto in = std::ifstream{filename, std::ios::binary};
+    auto data = std::vector<char>(std::istreambuf_iterator<char>(in), {});
+    in.close();
+    auto out = std::ofstream{filename, std::ios::binary};
+    out.write(data.data(), data.size() - 4);
+  }
+  auto format_version = 0;
+  auto read = std::vector<std::vector<float>>{};
+  EXPECT_FALSE(WeightsFile::read_binary(filename, format_version, read));
+
+  {
+    auto out = std::ofstream{filename};
+    out << "2\n1 2 3\n";
+  }
+  EXPECT_FALSE(WeightsFile::is_binary(filename));
+  EXPECT_FALSE(WeightsFile::read_binary(filename, format_version, read));
+  std::remove(filename.c_str());
+}
@@ -0,0 +1,755 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Python extension decoding training chunks into the batches of
+// ChunkParser.parse(), see chunkparser.py. Worker threads read the gzip
+// chunks, sample their V3 and V4 records and feed a shuffle buffer, and the
+// records of a batch are expanded to planes outside of the GIL. For shuffle
+// windows larger than memory, the records can go through shards on disk
+// first.
+//
+// Build it with: python3 setup.py build_ext --inplace
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "neural/writer.h"
+#include "utils/fp16_utils.h"
+
+namespace lczero {
+namespace {
+
+const int kNumMoves = 1858;
+const int kNumPlanes = 112;
+const int kPackedPlanes = 104;
+
+#pragma pack(push, 1)
+// A record of the V3 format, which the Python parser also converts V4
+// records to. It's the V4 position after dense probabilities.
+struct V3Record {
+  uint32_t version;
+  float probabilities[kNumMoves];
+  V4TrainingPosition position;
+} PACKED_STRUCT;
+static_assert(sizeof(V3Record) == 8276, "Wrong struct size");
+#pragma pack(pop)
+
+// How records are kept in the shards of the disk shuffle: the count of
+// moves with a probability, their uint16 indices, their float probabilities
+// and the V4 position. Unlike V4 records the probabilities stay exact.
+void WriteCompact(const V3Record& record, std::FILE* file) {
+  uint16_t indices[kNumMoves];
+  float probabilities[kNumMoves];
+  uint16_t count = 0;
+  for (int i = 0; i < kNumMoves; ++i) {
+    if (record.probabilities[i] == 0.0f) continue;
+    indices[count] = i;
+    probabilities[count] = record.probabilities[i];
+    ++count;
+  }
+  std::fwrite(&count, sizeof(count), 1, file);
+  std::fwrite(indices, sizeof(indices[0]), count, file);
+  std::fwrite(probabilities, sizeof(probabilities[0]), count, file);
+  std::fwrite(&record.position, sizeof(record.position), 1, file);
+}
+
+// Reads the compact record at @data, returns its size or 0 if it's cut.
+size_t ReadCompact(const char* data, size_t size, V3Record* record) {
+  uint16_t count;
+  if (size < sizeof(count)) return 0;
+  std::memcpy(&count, data, sizeof(count));
+  const size_t record_size = sizeof(count) + count * sizeof(uint16_t) +
+                             count * sizeof(float) + sizeof(record->position);
+  if (count > kNumMoves || size < record_size) return 0;
+  const char* indices = data + sizeof(count);
+  const char* probabilities = indices + count * sizeof(uint16_t);
+  record->version = 3;
+  std::fill(std::begin(record->probabilities),
+            std::end(record->probabilities), 0.0f);
+  for (int i = 0; i < count; ++i) {
+    uint16_t index;
+    std::memcpy(&index, indices + i * sizeof(index), sizeof(index));
+    if (index >= kNumMoves) continue;
+    std::memcpy(&record->probabilities[index],
+                probabilities + i * sizeof(float), sizeof(float));
+  }
+  std::memcpy(&record->position, probabilities + count * sizeof(float),
+              sizeof(record->position));
+  return record_size;
+}
+
+// The tensors of a batch, as ChunkParser.parse() yields them: uint8 planes,
+// float32 probabilities and float32 results.
+struct Batch {
+  std::string planes;
+  std::string probs;
+  std::string winner;
+};
+
+// Appends the planes of the record the way ChunkParser.convert_v3_to_tuple
+// does: the bit planes unpacked, most significant bit of every byte first,
+// then flat planes of the castlings, side to move, the byte the Python
+// parser takes as rule50_count, 0 for move_count and ones.
+void ExpandPlanes(const V4TrainingPosition& position, uint8_t* out) {
+  const auto* packed = reinterpret_cast<const uint8_t*>(position.planes);
+  for (int i = 0; i < kPackedPlanes * 8; ++i) {
+    const uint8_t byte = packed[i];
+    for (int bit = 0; bit < 8; ++bit) *out++ = (byte >> (7 - bit)) & 1;
+  }
+  const uint8_t flat[] = {position.castling_us_ooo,
+                          position.castling_us_oo,
+                          position.castling_them_ooo,
+                          position.castling_them_oo,
+                          position.side_to_move,
+                          position.move_count,
+                          0,
+                          1};
+  for (const auto value : flat) {
+    std::memset(out, value, 64);
+    out += 64;
+  }
+}
+
+class Decoder {
+ public:
+  // Reads @files in a new random order on every pass, @passes times or
+  // forever when 0. Keeps 1 in @sample records. With @shuffle_dir, an empty
+  // directory which the decoder removes when done, records are shuffled in
+  // windows of @disk_shuffle_size on disk before the shuffle buffer.
+  Decoder(std::vector<std::string> files, size_t shuffle_size, int sample,
+          size_t batch_size, int workers, int passes,
+          std::string shuffle_dir, size_t disk_shuffle_size)
+      : files_(std::move(files)),
+        shuffle_size_(std::max<size_t>(1, shuffle_size)),
+        sample_(std::max(1, sample)),
+        batch_size_(batch_size),
+        passes_(passes),
+        rng_(std::random_device()()),
+        shuffle_dir_(std::move(shuffle_dir)),
+        generation_size_(disk_shuffle_size),
+        // A shard is read into memory at once, so it's about as large as
+        // the shuffle buffer.
+        shards_(std::max<size_t>(1, (disk_shuffle_size + shuffle_size_ - 1) /
+                                        shuffle_size_)),
+        disk_rng_(std::random_device()()) {
+    buffer_.reserve(std::min<size_t>(shuffle_size_, 1 << 16));
+    running_workers_ = workers;
+    decoding_workers_ = workers;
+    if (UseDisk()) {
+      ++running_workers_;
+      reader_ = std::thread([this]() { Reader(); });
+    }
+    for (int i = 0; i < workers; ++i) {
+      threads_.emplace_back([this]() { Worker(); });
+    }
+  }
+
+  ~Decoder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) thread.join();
+    if (reader_.joinable()) reader_.join();
+    if (filling_) {
+      CloseGeneration(filling_.get());
+      RemoveGeneration(filling_->id);
+    }
+    for (const int generation : full_) RemoveGeneration(generation);
+    if (!shuffle_dir_.empty()) rmdir(shuffle_dir_.c_str());
+  }
+
+  // Takes the next batch, which is smaller than batch_size only at the end.
+  // Returns false when all records were taken.
+  bool NextBatch(Batch* batch) {
+    std::vector<V3Record> records;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() {
+        return ready_.size() >= batch_size_ || running_workers_ == 0;
+      });
+      if (running_workers_ == 0 && !buffer_.empty()) {
+        // Held in shuffled order already.
+        ready_.insert(ready_.end(), buffer_.begin(), buffer_.end());
+        buffer_.clear();
+      }
+      const auto count = std::min(batch_size_, ready_.size());
+      records.assign(ready_.begin(), ready_.begin() + count);
+      ready_.erase(ready_.begin(), ready_.begin() + count);
+    }
+    cv_.notify_all();
+    if (records.empty()) return false;
+
+    batch->planes.resize(records.size() * kNumPlanes * 64);
+    batch->probs.resize(records.size() * kNumMoves * sizeof(float));
+    batch->winner.resize(records.size() * sizeof(float));
+    auto* planes = reinterpret_cast<uint8_t*>(&batch->planes[0]);
+    auto* probs = &batch->probs[0];
+    auto* winner = &batch->winner[0];
+    for (const auto& record : records) {
+      ExpandPlanes(record.position, planes);
+      planes += kNumPlanes * 64;
+      std::memcpy(probs, record.probabilities, sizeof(record.probabilities));
+      probs += sizeof(record.probabilities);
+      const float result = record.position.result;
+      std::memcpy(winner, &result, sizeof(result));
+      winner += sizeof(result);
+    }
+    return true;
+  }
+
+ private:
+  void Worker() {
+    std::mt19937 rng(std::random_device{}());
+    std::string filename;
+    std::string data;
+    while (NextFile(&filename, &rng)) {
+      if (!ReadGzip(filename, &data)) {
+        std::printf("failed to parse %s\n", filename.c_str());
+        continue;
+      }
+      if (!Decode(data, &rng)) break;
+    }
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      last = --decoding_workers_ == 0;
+    }
+    if (last && UseDisk()) {
+      // The last records don't fill a window.
+      std::lock_guard<std::mutex> lock(disk_mutex_);
+      SealGeneration();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --running_workers_;
+    }
+    cv_.notify_all();
+  }
+
+  bool NextFile(std::string* filename, std::mt19937* rng) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_) return false;
+    if (pending_.empty()) {
+      if (files_.empty() || (passes_ && pass_ == passes_)) return false;
+      ++pass_;
+      pending_ = files_;
+      std::shuffle(pending_.begin(), pending_.end(), *rng);
+    }
+    *filename = std::move(pending_.back());
+    pending_.pop_back();
+    return true;
+  }
+
+  // Reads a chunk file, or a game in a bundle of the server given as
+  // "bundle@offset:size", see bundle_chunks() in chunkparser.py.
+  static bool ReadGzip(const std::string& filename, std::string* data) {
+    data->clear();
+    std::string bundle;
+    long offset;
+    size_t size;
+    if (ParseBundleChunk(filename, &bundle, &offset, &size)) {
+      return ReadBundleChunk(bundle, offset, size, data);
+    }
+    gzFile file = gzopen(filename.c_str(), "rb");
+    if (!file) return false;
+    char buffer[1 << 16];
+    int bytes;
+    while ((bytes = gzread(file, buffer, sizeof(buffer))) > 0) {
+      data->append(buffer, bytes);
+    }
+    gzclose(file);
+    return bytes == 0;
+  }
+
+  static bool ParseBundleChunk(const std::string& chunk, std::string* bundle,
+                               long* offset, size_t* size) {
+    const size_t at = chunk.rfind('@');
+    if (at == std::string::npos) return false;
+    unsigned long long chunk_offset, chunk_size;
+    int end = 0;
+    if (std::sscanf(chunk.c_str() + at + 1, "%llu:%llu%n", &chunk_offset,
+                    &chunk_size, &end) != 2 ||
+        at + 1 + end != chunk.size()) {
+      return false;
+    }
+    *bundle = chunk.substr(0, at);
+    *offset = static_cast<long>(chunk_offset);
+    *size = static_cast<size_t>(chunk_size);
+    return true;
+  }
+
+  // The game is one gzip member of the bundle.
+  static bool ReadBundleChunk(const std::string& bundle, long offset,
+                              size_t size, std::string* data) {
+    std::FILE* file = std::fopen(bundle.c_str(), "rb");
+    if (!file) return false;
+    std::string compressed(size, '\0');
+    const bool read = std::fseek(file, offset, SEEK_SET) == 0 &&
+                      std::fread(&compressed[0], 1, size, file) == size;
+    std::fclose(file);
+    if (!read) return false;
+
+    z_stream stream{};
+    // Gzip rather than zlib headers.
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) return false;
+    stream.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+    stream.avail_in = static_cast<uInt>(size);
+    char buffer[1 << 16];
+    int result;
+    do {
+      stream.next_out = reinterpret_cast<Bytef*>(buffer);
+      stream.avail_out = sizeof(buffer);
+      result = inflate(&stream, Z_NO_FLUSH);
+      data->append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (result == Z_OK);
+    inflateEnd(&stream);
+    return result == Z_STREAM_END;
+  }
+
+  // Inserts the sampled records of the chunk. Returns false when stopped.
+  bool Decode(const std::string& data, std::mt19937* rng) {
+    std::uniform_int_distribution<int> sample(0, sample_ - 1);
+    V3Record record;
+    size_t pos = 0;
+    while (pos + sizeof(uint32_t) + sizeof(uint16_t) <= data.size()) {
+      uint32_t version;
+      std::memcpy(&version, &data[pos], sizeof(version));
+      size_t size;
+      if (version == 3) {
+        size = sizeof(V3Record);
+      } else if (version == V4TrainingData::kVersion) {
+        // Records differ in size, so all of them have to be walked.
+        uint16_t count;
+        std::memcpy(&count, &data[pos + 4], sizeof(count));
+        size = 6 + count * sizeof(V4Probability) + sizeof(V4TrainingPosition);
+      } else {
+        return true;
+      }
+      if (pos + size > data.size()) return true;
+      const char* start = &data[pos];
+      pos += size;
+      // Downsample, using only 1/Nth of the items.
+      if (sample_ > 1 && sample(*rng) != 0) continue;
+
+      if (version == 3) {
+        std::memcpy(&record, start, sizeof(record));
+      } else {
+        uint16_t count;
+        std::memcpy(&count, start + 4, sizeof(count));
+        record.version = 3;
+        std::fill(std::begin(record.probabilities),
+                  std::end(record.probabilities), 0.0f);
+        for (int i = 0; i < count; ++i) {
+          V4Probability probability;
+          std::memcpy(&probability, start + 6 + i * sizeof(probability),
+                      sizeof(probability));
+          if (probability.index < kNumMoves) {
+            record.probabilities[probability.index] =
+                FP16toFP32(probability.probability);
+          }
+        }
+        std::memcpy(&record.position, start + 6 + count * sizeof(V4Probability),
+                    sizeof(record.position));
+      }
+      if (!(UseDisk() ? WriteToDisk(record) : Insert(record))) return false;
+    }
+    return true;
+  }
+
+  // The disk shuffle. Records are written to a random shard of the
+  // generation being filled, which holds a window of disk_shuffle_size
+  // records. The reader reads the shards of full generations in a random
+  // order, shuffles every one in memory and inserts its records into the
+  // shuffle buffer. So a record ends up anywhere in its window, which is
+  // then mixed with its neighbours by the shuffle buffer.
+
+  bool UseDisk() const { return !shuffle_dir_.empty() && generation_size_; }
+
+  std::string ShardPath(int generation, int shard) const {
+    return shuffle_dir_ + "/shard." + std::to_string(generation) + "." +
+           std::to_string(shard);
+  }
+
+  // Returns false when stopped. When the shards can't be created, records
+  // only go through the shuffle buffer.
+  bool WriteToDisk(const V3Record& record) {
+    {
+      std::lock_guard<std::mutex> lock(disk_mutex_);
+      if (!filling_ && !disk_failed_) {
+        filling_.reset(new Generation{next_generation_++});
+        for (int i = 0; i < shards_ && !disk_failed_; ++i) {
+          const std::string path = ShardPath(filling_->id, i);
+          std::FILE* file = std::fopen(path.c_str(), "wb");
+          if (file) {
+            filling_->files.push_back(file);
+          } else {
+            std::printf("failed to create %s, shuffling in memory\n",
+                        path.c_str());
+            disk_failed_ = true;
+          }
+        }
+        if (disk_failed_) {
+          CloseGeneration(filling_.get());
+          RemoveGeneration(filling_->id);
+          filling_.reset();
+        }
+      }
+      if (!disk_failed_) {
+        std::uniform_int_distribution<int> shard(0, shards_ - 1);
+        WriteCompact(record, filling_->files[shard(disk_rng_)]);
+        if (++filling_->records < generation_size_) return true;
+        return SealGeneration();
+      }
+    }
+    return Insert(record);
+  }
+
+  // Hands the generation being filled to the reader. Waits while another
+  // one is waiting for it, so that at most three are on disk. Returns false
+  // when stopped. Needs disk_mutex_.
+  bool SealGeneration() {
+    if (!filling_) return true;
+    auto generation = std::move(filling_);
+    CloseGeneration(generation.get());
+    if (generation->records == 0) {
+      RemoveGeneration(generation->id);
+      return true;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ || full_.size() < 2; });
+      if (stop_) {
+        RemoveGeneration(generation->id);
+        return false;
+      }
+      full_.push_back(generation->id);
+    }
+    cv_.notify_all();
+    return true;
+  }
+
+  void Reader() {
+    std::mt19937 rng(std::random_device{}());
+    for (;;) {
+      int generation;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() {
+          return stop_ || !full_.empty() || decoding_workers_ == 0;
+        });
+        if (stop_) break;
+        if (full_.empty()) {
+          // The last workers may still seal a generation.
+          if (running_workers_ > 1) {
+            cv_.wait(lock, [this]() {
+              return stop_ || !full_.empty() || running_workers_ == 1;
+            });
+          }
+          if (stop_ || full_.empty()) break;
+        }
+        generation = full_.front();
+      }
+      const bool read = ReadGeneration(generation, &rng);
+      RemoveGeneration(generation);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        full_.pop_front();
+      }
+      cv_.notify_all();
+      if (!read) break;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --running_workers_;
+    }
+    cv_.notify_all();
+  }
+
+  // Returns false when stopped.
+  bool ReadGeneration(int generation, std::mt19937* rng) {
+    std::vector<int> shards(shards_);
+    std::iota(shards.begin(), shards.end(), 0);
+    std::shuffle(shards.begin(), shards.end(), *rng);
+    std::string data;
+    std::vector<size_t> offsets;
+    V3Record record;
+    for (const int shard : shards) {
+      if (!ReadFile(ShardPath(generation, shard), &data)) continue;
+      offsets.clear();
+      for (size_t pos = 0; pos < data.size();) {
+        const size_t size = ReadCompact(&data[pos], data.size() - pos, &record);
+        if (!size) break;
+        offsets.push_back(pos);
+        pos += size;
+      }
+      std::shuffle(offsets.begin(), offsets.end(), *rng);
+      for (const size_t offset : offsets) {
+        ReadCompact(&data[offset], data.size() - offset, &record);
+        if (!Insert(record)) return false;
+      }
+    }
+    return true;
+  }
+
+  static bool ReadFile(const std::string& filename, std::string* data) {
+    data->clear();
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if (!file) return false;
+    char buffer[1 << 16];
+    size_t bytes;
+    while ((bytes = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+      data->append(buffer, bytes);
+    }
+    std::fclose(file);
+    return true;
+  }
+
+  struct Generation {
+    int id;
+    std::vector<std::FILE*> files;
+    size_t records = 0;
+  };
+
+  static void CloseGeneration(Generation* generation) {
+    for (auto* file : generation->files) std::fclose(file);
+    generation->files.clear();
+  }
+
+  void RemoveGeneration(int generation) const {
+    for (int i = 0; i < shards_; ++i) {
+      std::remove(ShardPath(generation, i).c_str());
+    }
+  }
+
+  // Puts the record in the shuffle buffer, and the one it replaces, if
+  // full, in the records ready for batches. Returns false when stopped.
+  bool Insert(const V3Record& record) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() {
+      return stop_ || ready_.size() < 4 * std::max<size_t>(1, batch_size_);
+    });
+    if (stop_) return false;
+    if (buffer_.size() < shuffle_size_) {
+      // Putting the new record in a random place and the displaced one at
+      // the end keeps the buffer shuffled (Fisher-Yates).
+      buffer_.push_back(record);
+      std::uniform_int_distribution<size_t> index(0, buffer_.size() - 1);
+      std::swap(buffer_[index(rng_)], buffer_.back());
+      return true;
+    }
+    std::uniform_int_distribution<size_t> index(0, buffer_.size() - 1);
+    auto& replaced = buffer_[index(rng_)];
+    ready_.push_back(replaced);
+    replaced = record;
+    const bool notify = ready_.size() >= batch_size_;
+    lock.unlock();
+    if (notify) cv_.notify_all();
+    return true;
+  }
+
+  const std::vector<std::string> files_;
+  const size_t shuffle_size_;
+  const int sample_;
+  const size_t batch_size_;
+  const int passes_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  int running_workers_ = 0;
+  // The files left in this pass.
+  std::vector<std::string> pending_;
+  int pass_ = 0;
+  std::vector<V3Record> buffer_;
+  std::mt19937 rng_;
+  // Records out of the shuffle buffer, for the next batches.
+  std::deque<V3Record> ready_;
+  std::vector<std::thread> threads_;
+  int decoding_workers_ = 0;
+
+  const std::string shuffle_dir_;
+  const size_t generation_size_;
+  const int shards_;
+  std::mutex disk_mutex_;
+  std::unique_ptr<Generation> filling_;
+  int next_generation_ = 0;
+  bool disk_failed_ = false;
+  std::mt19937 disk_rng_;
+  // Full generations, the first is being read.
+  std::deque<int> full_;
+  std::thread reader_;
+};
+
+// The Python type.
+
+struct DecoderObject {
+  PyObject_HEAD
+  Decoder* decoder;
+};
+
+int DecoderInit(DecoderObject* self, PyObject* args, PyObject* kwargs) {
+  static const char* keywords[] = {"chunks",      "shuffle_size",
+                                   "sample",      "batch_size",
+                                   "workers",     "passes",
+                                   "shuffle_dir", "disk_shuffle_size",
+                                   nullptr};
+  PyObject* chunks;
+  Py_ssize_t shuffle_size = 1;
+  int sample = 1;
+  Py_ssize_t batch_size = 256;
+  int workers = 0;
+  int passes = 0;
+  const char* shuffle_dir = nullptr;
+  Py_ssize_t disk_shuffle_size = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|niniizn",
+                                   const_cast<char**>(keywords), &chunks,
+                                   &shuffle_size, &sample, &batch_size,
+                                   &workers, &passes, &shuffle_dir,
+                                   &disk_shuffle_size)) {
+    return -1;
+  }
+  if (batch_size < 1) {
+    PyErr_SetString(PyExc_ValueError, "batch_size must be at least 1");
+    return -1;
+  }
+  PyObject* iterator = PyObject_GetIter(chunks);
+  if (!iterator) return -1;
+  std::vector<std::string> files;
+  while (PyObject* item = PyIter_Next(iterator)) {
+    const char* filename = PyUnicode_AsUTF8(item);
+    if (filename) files.emplace_back(filename);
+    Py_DECREF(item);
+    if (!filename) break;
+  }
+  Py_DECREF(iterator);
+  if (PyErr_Occurred()) return -1;
+  if (workers <= 0) {
+    // Leave 2 cores for TensorFlow, as ChunkParser does.
+    workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 2);
+  }
+
+  std::string directory;
+  if (shuffle_dir && disk_shuffle_size > 0) {
+    // A directory of its own, so that decoders can share @shuffle_dir.
+    std::string path = std::string(shuffle_dir) + "/chunkdecoder-XXXXXX";
+    if (!mkdtemp(&path[0])) {
+      PyErr_SetFromErrnoWithFilename(PyExc_OSError, shuffle_dir);
+      return -1;
+    }
+    directory = path;
+  }
+
+  delete self->decoder;
+  self->decoder = new Decoder(std::move(files), shuffle_size, sample,
+                              batch_size, workers, passes,
+                              std::move(directory), disk_shuffle_size);
+  return 0;
+}
+
+void DecoderDealloc(DecoderObject* self) {
+  delete self->decoder;
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+PyObject* DecoderNextBatch(DecoderObject* self, PyObject*) {
+  if (!self->decoder) {
+    PyErr_SetString(PyExc_ValueError, "The decoder is closed");
+    return nullptr;
+  }
+  Batch batch;
+  bool ok;
+  Py_BEGIN_ALLOW_THREADS;
+  ok = self->decoder->NextBatch(&batch);
+  Py_END_ALLOW_THREADS;
+  if (!ok) Py_RETURN_NONE;
+  return Py_BuildValue("(y#y#y#)", batch.planes.data(),
+                       static_cast<Py_ssize_t>(batch.planes.size()),
+                       batch.probs.data(),
+                       static_cast<Py_ssize_t>(batch.probs.size()),
+                       batch.winner.data(),
+                       static_cast<Py_ssize_t>(batch.winner.size()));
+}
+
+PyObject* DecoderClose(DecoderObject* self, PyObject*) {
+  Decoder* decoder = self->decoder;
+  self->decoder = nullptr;
+  Py_BEGIN_ALLOW_THREADS;
+  delete decoder;
+  Py_END_ALLOW_THREADS;
+  Py_RETURN_NONE;
+}
+
+PyMethodDef kDecoderMethods[] = {
+    {"next_batch", reinterpret_cast<PyCFunction>(DecoderNextBatch),
+     METH_NOARGS,
+     "Returns the next (planes, probs, winner) batch, None at the end."},
+    {"close", reinterpret_cast<PyCFunction>(DecoderClose), METH_NOARGS,
+     "Stops the worker threads."},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyTypeObject kDecoderType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+PyModuleDef kModule = {PyModuleDef_HEAD_INIT, "chunkdecoder",
+                       "Native decoder of training chunks.", -1, nullptr};
+
+}  // namespace
+}  // namespace lczero
+
+PyMODINIT_FUNC PyInit_chunkdecoder() {
+  using namespace lczero;
+  kDecoderType.tp_name = "chunkdecoder.ChunkDecoder";
+  kDecoderType.tp_basicsize = sizeof(DecoderObject);
+  kDecoderType.tp_flags = Py_TPFLAGS_DEFAULT;
+  kDecoderType.tp_doc =
+      "ChunkDecoder(chunks, shuffle_size=1, sample=1, batch_size=256, "
+      "workers=0, passes=0, shuffle_dir=None, disk_shuffle_size=0)\n\n"
+      "Decodes the gzip chunk files, reading them in a new random order on "
+      "every pass, forever when passes is 0. With shuffle_dir and "
+      "disk_shuffle_size, records are first shuffled in windows of "
+      "disk_shuffle_size through temporary files in shuffle_dir.";
+  kDecoderType.tp_new = PyType_GenericNew;
+  kDecoderType.tp_init = reinterpret_cast<initproc>(DecoderInit);
+  kDecoderType.tp_dealloc = reinterpret_cast<destructor>(DecoderDealloc);
+  kDecoderType.tp_methods = kDecoderMethods;
+  if (PyType_Ready(&kDecoderType) < 0) return nullptr;
+
+  PyObject* module = PyModule_Create(&kModule);
+  if (!module) return nullptr;
+  Py_INCREF(&kDecoderType);
+  PyModule_AddObject(module, "ChunkDecoder",
+                     reinterpret_cast<PyObject*>(&kDecoderType));
+  return module;
+}
@@ -17,17 +17,70 @@
 #    You should have received a copy of the GNU General Public License
 #    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
 
+import gzip
 import itertools
 import multiprocessing as mp
 import numpy as np
+import os
 import random
+import re
 import shufflebuffer as sb
 import struct
+import tempfile
 import tensorflow as tf
 import unittest
 
+try:
+    # The native decoder, built by setup.py from chunkdecoder.cc.
+    import chunkdecoder
+except ImportError:
+    chunkdecoder = None
+
 VERSION = struct.pack('i', 3)
 STRUCT_STRING = '4s7432s832sBBBBBBBb'
+V4_VERSION = struct.pack('i', 4)
+# Planes and the bytes after them, which are the same as in v3.
+V4_POSITION_SIZE = 840
+
+# A bundle of the server holds the games of a network, each a gzip member,
+# one after the other. The index next to it has a line "offset size" per
+# game. Each game is a chunk of its own, named "bundle@offset:size".
+BUNDLE_SUFFIX = '.bundle.gz'
+BUNDLE_CHUNK = re.compile(r'^(.*)@(\d+):(\d+)$')
+
+
+def bundle_chunks(bundle):
+    """
+    Return the chunks of the games in a bundle file.
+    """
+    chunks = []
+    with open(bundle + '.index', 'r') as index:
+        for line in index:
+            offset, size = line.split()
+            chunks.append('{}@{}:{}'.format(bundle, offset, size))
+    return chunks
+
+
+def chunk_file(chunk):
+    """
+    Return the file a chunk is stored in.
+    """
+    match = BUNDLE_CHUNK.match(chunk)
+    return match.group(1) if match else chunk
+
+
+def read_chunk(chunk):
+    """
+    Return the uncompressed data of a chunk file or of a game in a bundle.
+    """
+    match = BUNDLE_CHUNK.match(chunk)
+    if not match:
+        with gzip.open(chunk, 'rb') as f:
+            return f.read()
+    with open(match.group(1), 'rb') as bundle:
+        bundle.seek(int(match.group(2)))
+        return gzip.decompress(bundle.read(int(match.group(3))))
+
 
 # Interface for a chunk data source.
 class ChunkDataSrc:
@@ -57,8 +110,9 @@ class ChunkParser:
 
         chunk: The name of a file containing chunkdata
 
-        chunkdata: type Bytes. Multiple records of v3 format where each record
-        consists of (state, policy, result)
+        chunkdata: type Bytes. Multiple records of v3 or v4 format where each
+        record consists of (state, policy, result). v4 records are converted
+        to v3 once sampled.
 
         raw: A byte string holding raw tensors contenated together. This is
         used to pass data from the workers to the parent. Exists because
@@ -128,6 +182,25 @@ class ChunkParser:
         self.v3_struct = struct.Struct(STRUCT_STRING)
 
 
+    @staticmethod
+    def convert_v4_to_v3(content):
+        """
+        Convert a v4 binary record to a v3 one.
+
+        v4 format is (846 + 4 * count bytes total)
+            int32 version (4 bytes)
+            uint16 count (2 bytes)
+            count (uint16 index, float16 probability) pairs, sorted by index
+            (4 * count bytes). Probabilities of other moves are 0.
+            the rest as in v3 (840 bytes)
+        """
+        (count,) = struct.unpack_from('H', content, 4)
+        pairs = np.frombuffer(content, dtype=np.uint16, count=2 * count, offset=6)
+        probs = np.zeros(1858, dtype=np.float32)
+        probs[pairs[0::2]] = pairs.view(np.float16)[1::2].astype(np.float32)
+        return VERSION + probs.tobytes() + content[6 + 4 * count:]
+
+
     @staticmethod
     def parse_function(planes, probs, winner):
         """
@@ -184,7 +257,8 @@ class ChunkParser:
 
     def sample_record(self, chunkdata):
         """
-        Randomly sample through the v3 chunk data and select records
+        Randomly sample through the v3 or v4 chunk data and select records,
+        as v3 records.
         """
         if chunkdata[0:4] == VERSION:
             for i in range(0, len(chunkdata), self.v3_struct.size):
@@ -193,6 +267,19 @@ class ChunkParser:
                     if random.randint(0, self.sample-1) != 0:
                         continue  # Skip this record.
                 yield chunkdata[i:i+self.v3_struct.size]
+        elif chunkdata[0:4] == V4_VERSION:
+            # Records differ in size, so all of them have to be walked.
+            i = 0
+            while i < len(chunkdata):
+                (count,) = struct.unpack_from('H', chunkdata, i + 4)
+                end = i + 6 + 4 * count + V4_POSITION_SIZE
+                record = chunkdata[i:end]
+                i = end
+                if self.sample > 1:
+                    # Downsample, using only 1/Nth of the items.
+                    if random.randint(0, self.sample-1) != 0:
+                        continue  # Skip this record.
+                yield self.convert_v4_to_v3(record)
 
 
     def task(self, chunkdatasrc, writer):
@@ -275,6 +362,49 @@ class ChunkParser:
 
 
 
+class NativeChunkParser:
+    def __init__(self, chunks, shuffle_size=1, sample=1, batch_size=256, workers=None, passes=0,
+            shuffle_dir=None, disk_shuffle_size=0):
+        """
+        Read chunk files and yield the batches of ChunkParser.parse(),
+        decoded by the chunkdecoder extension with threads rather than by
+        worker processes.
+
+        'chunks' is a list of chunk file names, read in a new random order on
+        every pass, forever when 'passes' is 0.
+
+        With 'shuffle_dir' and 'disk_shuffle_size', records are shuffled in
+        windows of 'disk_shuffle_size' through temporary files in
+        'shuffle_dir' before the 'shuffle_size' buffer, so that the window
+        can be much larger than memory.
+        """
+        if workers is None:
+            workers = max(1, mp.cpu_count() - 2)
+        print("Using {} decoder threads.".format(workers))
+        self.decoder = chunkdecoder.ChunkDecoder(chunks, shuffle_size=shuffle_size,
+                sample=sample, batch_size=batch_size, workers=workers, passes=passes,
+                shuffle_dir=shuffle_dir, disk_shuffle_size=disk_shuffle_size)
+
+
+    def shutdown(self):
+        """
+        Stops the decoder threads
+        """
+        self.decoder.close()
+
+
+    def parse(self):
+        """
+        Yield batches of unpacked records
+        """
+        while True:
+            batch = self.decoder.next_batch()
+            if batch is None:
+                return
+            yield batch
+
+
+
 # Tests to check that records parse correctly
 class ChunkParserTest(unittest.TestCase):
     def setUp(self):
@@ -311,6 +441,26 @@ class ChunkParserTest(unittest.TestCase):
         return self.v3_struct.pack(VERSION, pi, pl, i[0], i[1], i[2], i[3], i[4], i[5], i[6], winner)
 
 
+    def v4_record(self, planes, i, probs, winner):
+        v3 = self.v3_record(planes, i, probs, winner)
+        indices = np.nonzero(probs)[0]
+        pairs = np.empty(2 * len(indices), dtype=np.uint16)
+        pairs[0::2] = indices
+        pairs.view(np.float16)[1::2] = probs[indices]
+        return (V4_VERSION + struct.pack('H', len(indices)) + pairs.tobytes() +
+                v3[4 + 7432:])
+
+
+    def v3_v4_chunks(self, truth):
+        """
+        A chunk of two v3 records and one of two v4 records, as a game is
+        written in one format.
+        """
+        v3 = self.v3_record(*truth)
+        v4 = self.v4_record(*truth)
+        return (v3 + v3, v4 + v4)
+
+
     def test_structsize(self):
         """
         Test struct size
@@ -349,6 +499,140 @@ class ChunkParserTest(unittest.TestCase):
         parser.shutdown()
 
 
+    def test_v4_parsing(self):
+        """
+        Test that v4 records parse the same as v3 ones.
+        """
+        truth = self.generate_fake_pos()
+        # Stored as float32 in v3, as the pipeline does.
+        truth = (truth[0], truth[1], truth[2].astype(np.float32), truth[3])
+        v3 = self.v3_record(*truth)
+        v4 = self.v4_record(*truth)
+        self.assertLess(len(v4), len(v3))
+        self.assertEqual(ChunkParser.convert_v4_to_v3(v4), v3)
+
+        parser = ChunkParser(ChunkDataSrc([v4 + v4]), shuffle_size=1, workers=1, batch_size=2)
+        batchgen = parser.parse()
+        data = next(batchgen)
+        probs = np.reshape(np.frombuffer(data[1], dtype=np.float32), (2, 1858))
+        for i in range(2):
+            self.assertTrue((probs[i] == truth[2]).all())
+        parser.shutdown()
+
+
+    @unittest.skipIf(chunkdecoder is None, "chunkdecoder is not built")
+    def test_native_parsing(self):
+        """
+        Test that the native decoder gives the batches of the Python one.
+        """
+        truth = self.generate_fake_pos()
+        truth = (truth[0], truth[1], truth[2].astype(np.float32), truth[3])
+        v3_chunk, v4_chunk = self.v3_v4_chunks(truth)
+        batch_size = 4
+
+        parser = ChunkParser(ChunkDataSrc([v3_chunk, v4_chunk]), shuffle_size=1, workers=1, batch_size=batch_size)
+        expected = next(parser.parse())
+        parser.shutdown()
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            chunks = []
+            for i, records in enumerate([v3_chunk, v4_chunk]):
+                chunks.append(os.path.join(tmpdir, "training.{}.gz".format(i)))
+                with gzip.open(chunks[-1], 'wb') as f:
+                    f.write(records)
+            parser = NativeChunkParser(chunks, shuffle_size=3, workers=2, batch_size=batch_size, passes=1)
+            batches = list(parser.parse())
+            parser.shutdown()
+
+        self.assertEqual(len(batches), 1)
+        self.assertEqual(batches[0], expected)
+
+
+    def write_bundle(self, path, games):
+        with open(path, 'wb') as bundle, open(path + '.index', 'w') as index:
+            for game in games:
+                data = gzip.compress(game)
+                index.write('{} {}\n'.format(bundle.tell(), len(data)))
+                bundle.write(data)
+
+
+    def test_bundle_chunks(self):
+        """
+        Test that every game of a bundle is read as a chunk.
+        """
+        games = [b'first game', b'second game', b'third game']
+        with tempfile.TemporaryDirectory() as tmpdir:
+            bundle = os.path.join(tmpdir, 'network1.1' + BUNDLE_SUFFIX)
+            self.write_bundle(bundle, games)
+            chunks = bundle_chunks(bundle)
+            self.assertEqual(len(chunks), 3)
+            self.assertEqual([chunk_file(chunk) for chunk in chunks], [bundle] * 3)
+            self.assertEqual([read_chunk(chunk) for chunk in chunks], games)
+            # Like any gzip file, the bundle is all of its games.
+            with gzip.open(bundle, 'rb') as f:
+                self.assertEqual(f.read(), b''.join(games))
+
+
+    @unittest.skipIf(chunkdecoder is None, "chunkdecoder is not built")
+    def test_native_bundle_parsing(self):
+        """
+        Test that the native decoder reads the games of bundles.
+        """
+        truth = self.generate_fake_pos()
+        truth = (truth[0], truth[1], truth[2].astype(np.float32), truth[3])
+        v3_chunk, v4_chunk = self.v3_v4_chunks(truth)
+        batch_size = 4
+
+        parser = ChunkParser(ChunkDataSrc([v3_chunk, v4_chunk]), shuffle_size=1, workers=1, batch_size=batch_size)
+        expected = next(parser.parse())
+        parser.shutdown()
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            bundle = os.path.join(tmpdir, 'network1.1' + BUNDLE_SUFFIX)
+            self.write_bundle(bundle, [v3_chunk, v4_chunk])
+            parser = NativeChunkParser(bundle_chunks(bundle), shuffle_size=3, workers=2, batch_size=batch_size, passes=1)
+            batches = list(parser.parse())
+            parser.shutdown()
+
+        self.assertEqual(len(batches), 1)
+        self.assertEqual(batches[0], expected)
+
+
+    @unittest.skipIf(chunkdecoder is None, "chunkdecoder is not built")
+    def test_native_disk_shuffle(self):
+        """
+        Test that the disk shuffle keeps every record and cleans up.
+        """
+        truth = self.generate_fake_pos()
+        truth = (truth[0], truth[1], truth[2].astype(np.float32), truth[3])
+        v3_chunk, v4_chunk = self.v3_v4_chunks(truth)
+        batch_size = 2
+
+        parser = ChunkParser(ChunkDataSrc([v3_chunk]), shuffle_size=1, workers=1, batch_size=1)
+        expected = next(parser.parse())
+        parser.shutdown()
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            chunks = []
+            for i in range(5):
+                chunks.append(os.path.join(tmpdir, "training.{}.gz".format(i)))
+                with gzip.open(chunks[-1], 'wb') as f:
+                    f.write(v4_chunk if i % 2 else v3_chunk)
+            shuffle_dir = os.path.join(tmpdir, "shuffle")
+            os.mkdir(shuffle_dir)
+            parser = NativeChunkParser(chunks, shuffle_size=2, workers=2, batch_size=batch_size,
+                    passes=2, shuffle_dir=shuffle_dir, disk_shuffle_size=3)
+            batches = list(parser.parse())
+            parser.shutdown()
+            self.assertEqual(os.listdir(shuffle_dir), [])
+
+        self.assertEqual(len(batches), 10)
+        for batch in batches:
+            for i in range(batch_size):
+                self.assertEqual(batch[0][i*len(expected[0]):(i+1)*len(expected[0])], expected[0])
+                self.assertEqual(batch[1][i*len(expected[1]):(i+1)*len(expected[1])], expected[1])
+
+
     def test_tensorflow_parsing(self):
         """
         Test game position decoding pipeline including tensorflow.
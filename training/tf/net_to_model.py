@@ -38,26 +38,20 @@ model:
 YAMLCFG = textwrap.dedent(YAMLCFG).strip()
 cfg = yaml.safe_load(YAMLCFG)
 
-with open(sys.argv[1], 'r') as f:
-    version = f.readline()
-    if version != '{}\n'.format(tfprocess.VERSION):
-        raise ValueError("Invalid version {}".format(version.strip()))
+version, weights = tfprocess.read_leelaz_weights(sys.argv[1])
+if version != tfprocess.VERSION:
+    raise ValueError("Invalid version {}".format(version))
 
-    weights = []
-    for e, line in enumerate(f):
-        weights.append(list(map(float, line.split(' '))))
+filters = len(weights[1])
+print("Channels", filters)
 
-        if e == 1:
-            filters = len(line.split(' '))
-            print("Channels", filters)
+blocks = len(weights) - (4 + 14)
 
-    blocks = e - (3 + 14)
+if blocks % 8 != 0:
+    raise ValueError("Inconsistent number of weights in the file")
 
-    if blocks % 8 != 0:
-        raise ValueError("Inconsistent number of weights in the file")
-
-    blocks //= 8
-    print("Blocks", blocks)
+blocks //= 8
+print("Blocks", blocks)
 
 cfg['model']['filters'] = filters
 cfg['model']['residual_blocks'] = blocks
@@ -0,0 +1,36 @@
+#!/usr/bin/env python3
+#
+#    This file is part of Leela Chess Zero.
+#    Copyright (C) 2018 The LCZero Authors
+#
+#    Leela Chess is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    Leela Chess is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+# Builds the native chunk decoder next to chunkparser.py with
+#   python3 setup.py build_ext --inplace
+
+import os
+from setuptools import setup, Extension
+
+LC0_SRC = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'lc0', 'src')
+
+setup(
+    name='chunkdecoder',
+    ext_modules=[Extension(
+        'chunkdecoder',
+        sources=['chunkdecoder.cc'],
+        include_dirs=[LC0_SRC],
+        libraries=['z'],
+        extra_compile_args=['-std=c++14', '-O3'],
+        language='c++')],
+)
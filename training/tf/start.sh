@@ -4,7 +4,7 @@ set -e
 
 CONFIG=$1
 ADDRESS=$2
-NET="/tmp/weights.txt"
+NET="/tmp/weights.bin"
 
 while true
 do
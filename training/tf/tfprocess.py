@@ -17,8 +17,10 @@
 #    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
 
 import numpy as np
+import gzip
 import os
 import random
+import struct
 import tensorflow as tf
 import time
 import bisect
@@ -27,6 +29,79 @@ NUM_STEP_TRAIN = 200
 NUM_STEP_TEST = 2000
 VERSION = 2
 
+# The binary weights format of src/WeightsFile.h, which the engines map
+# instead of parsing text.
+BINARY_MAGIC = b'LCZW'
+BINARY_VERSION = 2
+BINARY_FLOAT32 = 0
+BINARY_FLOAT16 = 1
+BN_EPSILON = 1e-5
+
+def fold_batchnorm(lines):
+    """
+    Fold every batchnorm into the convolution before it.
+
+    The engines compute stddiv * (W.x + bias - mean), so the folded weights
+    are stddiv * W, with the mean set to -stddiv * (bias - mean) and the
+    variance to 1 - epsilon. The engines then fold nothing, and the folded
+    weights are rounded only once in half precision.
+    """
+    lines = list(lines)
+    blocks = (len(lines) - (4 + 14)) // 8
+    convs = [4 * i for i in range(1 + 2 * blocks)]
+    # Policy and value head convolutions
+    convs += [4 * (1 + 2 * blocks), 4 * (1 + 2 * blocks) + 6]
+    for i in convs:
+        weights, biases, means, variances = [np.asarray(l, dtype=np.float64) for l in lines[i:i+4]]
+        stddivs = 1.0 / np.sqrt(variances + BN_EPSILON)
+        weights = weights.reshape(len(stddivs), -1) * stddivs[:, None]
+        lines[i] = weights.ravel()
+        lines[i+1] = np.zeros_like(biases)
+        lines[i+2] = -stddivs * (biases - means)
+        lines[i+3] = np.full_like(variances, 1.0 - BN_EPSILON)
+    return lines
+
+def write_binary_weights(file, lines, fp16=False):
+    """
+    Write the weight lines, all but the version line, in the binary format.
+    """
+    dtype = '<f2' if fp16 else '<f4'
+    file.write(struct.pack('<4sIIII', BINARY_MAGIC, BINARY_VERSION, VERSION,
+        len(lines), BINARY_FLOAT16 if fp16 else BINARY_FLOAT32))
+    file.write(struct.pack('<{}I'.format(len(lines)), *[np.size(l) for l in lines]))
+    for line in lines:
+        file.write(np.asarray(line, dtype=dtype).tobytes())
+
+def read_leelaz_weights(filename):
+    """
+    Read a text or binary weights file, either may be gzipped. Returns the
+    version and the other lines as arrays.
+    """
+    with open(filename, 'rb') as f:
+        data = f.read()
+    if data[:2] == b'\x1f\x8b':
+        data = gzip.decompress(data)
+    if data[:4] != BINARY_MAGIC:
+        text = data.decode('ascii').splitlines()
+        lines = [np.array(line.split(), dtype=np.float32) for line in text[1:] if line.strip()]
+        return int(text[0]), lines
+    version, file_version, count = struct.unpack_from('<III', data, 4)
+    pos = 16
+    encoding = BINARY_FLOAT32
+    if version >= 2:
+        encoding, = struct.unpack_from('<I', data, pos)
+        pos += 4
+    if version > BINARY_VERSION or encoding not in (BINARY_FLOAT32, BINARY_FLOAT16):
+        raise ValueError("Unsupported binary weights file {}".format(filename))
+    sizes = struct.unpack_from('<{}I'.format(count), data, pos)
+    pos += 4 * count
+    dtype = np.dtype('<f2' if encoding == BINARY_FLOAT16 else '<f4')
+    lines = []
+    for size in sizes:
+        lines.append(np.frombuffer(data, dtype=dtype, count=size, offset=pos).astype(np.float32))
+        pos += size * dtype.itemsize
+    return file_version, lines
+
 def weight_variable(shape):
     """Xavier initialization"""
     stddev = np.sqrt(2.0 / (sum(shape)))
@@ -269,42 +344,64 @@ class TFProcess:
             path = os.path.join(self.root_dir, self.cfg['name'])
             save_path = self.saver.save(self.session, path, global_step=steps)
             print("Model saved in file: {}".format(save_path))
-            leela_path = path + "-" + str(steps) + ".txt"
-            self.save_leelaz_weights(leela_path) 
+            leela_path = path + "-" + str(steps) + ".bin"
+            self.save_leelaz_weights(leela_path)
             print("Weights saved in file: {}".format(leela_path))
 
+    def get_leelaz_weights(self):
+        """
+        Return the weights as the lines of the weights file, without the
+        version line, in the layout of the engines.
+        """
+        lines = []
+        for weights in self.weights:
+            work_weights = None
+            # Keyed batchnorm weights
+            if isinstance(weights, str):
+                work_weights = tf.get_default_graph().get_tensor_by_name(weights)
+            elif weights.shape.ndims == 4:
+                # Convolution weights need a transpose
+                #
+                # TF (kYXInputOutput)
+                # [filter_height, filter_width, in_channels, out_channels]
+                #
+                # Leela/cuDNN/Caffe (kOutputInputYX)
+                # [output, input, filter_size, filter_size]
+                work_weights = tf.transpose(weights, [3, 2, 0, 1])
+            elif weights.shape.ndims == 2:
+                # Fully connected layers are [in, out] in TF
+                #
+                # [out, in] in Leela
+                #
+                work_weights = tf.transpose(weights, [1, 0])
+            else:
+                # Biases, batchnorm etc
+                work_weights = weights
+            lines.append(np.ravel(work_weights.eval(session=self.session)))
+        return lines
+
     def save_leelaz_weights(self, filename):
-        with open(filename, "w") as file:
-            # Version tag
-            file.write("{}".format(VERSION))
-            for weights in self.weights:
-                # Newline unless last line (single bias)
-                file.write("\n")
-                work_weights = None
-                # Keyed batchnorm weights
-                if isinstance(weights, str):
-                    work_weights = tf.get_default_graph().get_tensor_by_name(weights)
-                elif weights.shape.ndims == 4:
-                    # Convolution weights need a transpose
-                    #
-                    # TF (kYXInputOutput)
-                    # [filter_height, filter_width, in_channels, out_channels]
-                    #
-                    # Leela/cuDNN/Caffe (kOutputInputYX)
-                    # [output, input, filter_size, filter_size]
-                    work_weights = tf.transpose(weights, [3, 2, 0, 1])
-                elif weights.shape.ndims == 2:
-                    # Fully connected layers are [in, out] in TF
-                    #
-                    # [out, in] in Leela
-                    #
-                    work_weights = tf.transpose(weights, [1, 0])
-                else:
-                    # Biases, batchnorm etc
-                    work_weights = weights
-                nparray = work_weights.eval(session=self.session)
-                wt_str = [str(wt) for wt in np.ravel(nparray)]
-                file.write(" ".join(wt_str))
+        """
+        Save the weights for the engines. Files ending in .txt are in the
+        text format, others in the binary one, gzipped when they end in .gz.
+        The training config can ask for half precision and folded batchnorm
+        in binary files.
+        """
+        lines = self.get_leelaz_weights()
+        if filename.endswith('.txt'):
+            with open(filename, "w") as file:
+                # Version tag
+                file.write("{}".format(VERSION))
+                for line in lines:
+                    file.write("\n")
+                    file.write(" ".join([str(wt) for wt in line]))
+            return
+        if self.cfg['training'].get('fold_batchnorm', False):
+            lines = fold_batchnorm(lines)
+        fp16 = self.cfg['training'].get('weights_fp16', False)
+        opener = gzip.open if filename.endswith('.gz') else open
+        with opener(filename, 'wb') as file:
+            write_binary_weights(file, lines, fp16)
 
     def get_batchnorm_key(self):
         result = "bn" + str(self.batch_norm_count)
@@ -21,12 +21,12 @@ import os
 import yaml
 import sys
 import glob
-import gzip
 import random
 import multiprocessing as mp
 import tensorflow as tf
 from tfprocess import TFProcess
-from chunkparser import ChunkParser
+from chunkparser import ChunkParser, NativeChunkParser, chunkdecoder
+from chunkparser import BUNDLE_SUFFIX, bundle_chunks, chunk_file, read_chunk
 
 SKIP = 16
 
@@ -38,7 +38,14 @@ def get_checkpoint(root_dir):
 
 
 def get_chunks(data_prefix):
-    return glob.glob(data_prefix + "*.gz")
+    chunks = []
+    for filename in glob.glob(data_prefix + "*.gz"):
+        # The games of a bundle are chunks of their own.
+        if filename.endswith(BUNDLE_SUFFIX):
+            chunks += bundle_chunks(filename)
+        else:
+            chunks.append(filename)
+    return chunks
 
 
 def get_latest_chunks(path, num_chunks):
@@ -51,7 +58,13 @@ def get_latest_chunks(path, num_chunks):
         sys.exit(1)
 
     print("sorting {} chunks...".format(len(chunks)), end='')
-    chunks.sort(key=os.path.getmtime, reverse=True)
+    mtimes = {}
+    def mtime(chunk):
+        filename = chunk_file(chunk)
+        if filename not in mtimes:
+            mtimes[filename] = os.path.getmtime(filename)
+        return mtimes[filename]
+    chunks.sort(key=mtime, reverse=True)
     print("[done]")
     chunks = chunks[:num_chunks]
     print("{} - {}".format(os.path.basename(chunks[-1]), os.path.basename(chunks[0])))
@@ -75,13 +88,24 @@ class FileDataSrc:
         while len(self.chunks):
             filename = self.chunks.pop()
             try:
-                with gzip.open(filename, 'rb') as chunk_file:
-                    self.done.append(filename)
-                    return chunk_file.read()
+                data = read_chunk(filename)
+                self.done.append(filename)
+                return data
             except:
                 print("failed to parse {}".format(filename))
 
 
+def make_parser(chunks, shuffle_size, shuffle_dir=None, disk_shuffle_size=0):
+    # The native decoder keeps up with the GPU, the Python one is a fallback
+    # for when it isn't built.
+    if chunkdecoder is not None:
+        return NativeChunkParser(chunks, shuffle_size=shuffle_size,
+                sample=SKIP, batch_size=ChunkParser.BATCH_SIZE,
+                shuffle_dir=shuffle_dir, disk_shuffle_size=disk_shuffle_size)
+    return ChunkParser(FileDataSrc(chunks), shuffle_size=shuffle_size,
+            sample=SKIP, batch_size=ChunkParser.BATCH_SIZE)
+
+
 def main(cmd):
     cfg = yaml.safe_load(cmd.cfg.read())
     print(yaml.dump(cfg, default_flow_style=False))
@@ -92,14 +116,16 @@ def main(cmd):
     train_ratio = cfg['dataset']['train_ratio']
     num_train = int(num_chunks*train_ratio)
     shuffle_size = cfg['training']['shuffle_size']
+    shuffle_dir = cfg['training'].get('shuffle_dir')
+    disk_shuffle_size = cfg['training'].get('disk_shuffle_size', 0)
     ChunkParser.BATCH_SIZE = cfg['training']['batch_size']
 
     root_dir = os.path.join(cfg['training']['path'], cfg['name'])
     if not os.path.exists(root_dir):
         os.makedirs(root_dir)
 
-    train_parser = ChunkParser(FileDataSrc(chunks[:num_train]),
-            shuffle_size=shuffle_size, sample=SKIP, batch_size=ChunkParser.BATCH_SIZE)
+    train_parser = make_parser(chunks[:num_train], shuffle_size,
+            shuffle_dir, disk_shuffle_size)
     dataset = tf.data.Dataset.from_generator(
         train_parser.parse, output_types=(tf.string, tf.string, tf.string))
     dataset = dataset.map(ChunkParser.parse_function)
@@ -107,8 +133,9 @@ def main(cmd):
     train_iterator = dataset.make_one_shot_iterator()
 
     shuffle_size = int(shuffle_size*(1.0-train_ratio))
-    test_parser = ChunkParser(FileDataSrc(chunks[num_train:]), 
-            shuffle_size=shuffle_size, sample=SKIP, batch_size=ChunkParser.BATCH_SIZE)
+    disk_shuffle_size = int(disk_shuffle_size*(1.0-train_ratio))
+    test_parser = make_parser(chunks[num_train:], shuffle_size,
+            shuffle_dir, disk_shuffle_size)
     dataset = tf.data.Dataset.from_generator(
         test_parser.parse, output_types=(tf.string, tf.string, tf.string))
     dataset = dataset.map(ChunkParser.parse_function)
@@ -141,7 +168,7 @@ if __name__ == "__main__":
     argparser.add_argument('--cfg', type=argparse.FileType('r'), 
         help='yaml configuration with training parameters')
     argparser.add_argument('--output', type=str, 
-        help='file to store weights in')
+        help='file to store weights in, binary unless it ends in .txt, gzipped if it ends in .gz')
 
     mp.set_start_method('spawn')
     main(argparser.parse_args())